@@ -0,0 +1,2 @@
+#define SIM_GIT_COMMIT_ID e622883314e678f25d8dccfe2f1dcbb07ff0e007
+#define SIM_GIT_COMMIT_TIME 2026-10-16 16:08:04+00:00
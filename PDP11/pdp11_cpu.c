@@ -323,6 +323,13 @@ jmp_buf save_env;                                       /* abort handler */
 int32 hst_p = 0;                                        /* history pointer */
 int32 hst_lnt = 0;                                      /* history length */
 InstHistory *hst = NULL;                                /* instruction history */
+static int32 hst_swmap[4] = {                           /* cpu_ex switches by mode */
+    SWMASK ('K') | SWMASK ('V'), SWMASK ('S') | SWMASK ('V'),
+    SWMASK ('U') | SWMASK ('V'), SWMASK ('U') | SWMASK ('V')
+    };
+static const char *cpu_exectrace_regs[] = {             /* execution trace registers */
+    "R0", "R1", "R2", "R3", "R4", "R5", "SP", "PSW", NULL
+    };
 int32 dsmask[4] = { MMR3_KDS, MMR3_SDS, 0, MMR3_UDS };  /* dspace enables */
 int16 inst_pc;                                          /* PC of current instr */
 int32 inst_psw;                                         /* PSW at instr. start */
@@ -338,6 +345,7 @@ extern CPUTAB cpu_tab[];
 
 t_stat cpu_ex (t_value *vptr, t_addr addr, UNIT *uptr, int32 sw);
 t_stat cpu_dep (t_value val, t_addr addr, UNIT *uptr, int32 sw);
+void *cpu_memory_buffer (DEVICE *dptr, UNIT *uptr);
 t_stat cpu_reset (DEVICE *dptr);
 t_stat cpu_boot (int32 unitno, DEVICE *dptr);
 t_bool cpu_is_pc_a_subroutine_call (t_addr **ret_addrs);
@@ -374,6 +382,7 @@ void set_stack_trap (int32 adr);
 int32 get_PSW (void);
 void put_PSW (int32 val, t_bool prot);
 void put_PIRQ (int32 val);
+static uint32 cpu_inst_lnt (int32 IR);
 
 extern void fp11 (int32 IR);
 extern t_stat cis11 (int32 IR);
@@ -984,10 +993,7 @@ while (reason == 0)  {
     if (hst_lnt) {                                      /* record history? */
         t_value val;
         uint32 i;
-        static int32 swmap[4] = {
-            SWMASK ('K') | SWMASK ('V'), SWMASK ('S') | SWMASK ('V'),
-            SWMASK ('U') | SWMASK ('V'), SWMASK ('U') | SWMASK ('V')
-            };
+
         hst_ent = &hst[hst_p];
         hst_ent->pc = PC | HIST_VLD;
         hst_ent->sp = SP;
@@ -996,7 +1002,7 @@ while (reason == 0)  {
         hst_ent->dst = 0;
         hst_ent->inst[0] = IR;
         for (i = 1; i < HIST_ILNT; i++) {
-            if (cpu_ex (&val, (PC + (i << 1)) & 0177777, &cpu_unit, swmap[cm & 03]))
+            if (cpu_ex (&val, (PC + (i << 1)) & 0177777, &cpu_unit, hst_swmap[cm & 03]))
                 hst_ent->inst[i] = 0;
             else hst_ent->inst[i] = (uint16) val;
             }
@@ -1004,6 +1010,24 @@ while (reason == 0)  {
         if (hst_p >= hst_lnt)
             hst_p = 0;
         }
+    if (sim_exectrace_on) {                             /* record execution trace? */
+        t_value val, regs[8];
+        uint8 inst[6];                                  /* longest instruction */
+        uint32 i;
+
+        for (i = 0; i < 7; i++)
+            regs[i] = R[i];
+        regs[7] = get_PSW ();
+        inst[0] = IR & 0377;
+        inst[1] = (IR >> 8) & 0377;
+        for (i = 1; i < 3; i++) {                       /* possible operand words */
+            if (cpu_ex (&val, (PC + (i << 1)) & 0177777, &cpu_unit, hst_swmap[cm & 03]))
+                val = 0;
+            inst[2 * i] = val & 0377;
+            inst[2 * i + 1] = (val >> 8) & 0377;
+            }
+        sim_exectrace_insn (PC, inst, cpu_inst_lnt (IR), regs);
+        }
     PC = (PC + 2) & 0177777;                            /* incr PC, mod 65k */
     switch ((IR >> 12) & 017) {                         /* decode IR<15:12> */
 
@@ -2817,6 +2841,8 @@ void PWriteW (int32 data, int32 pa)
 {
 if (ADDR_IS_MEM (pa)) {                                 /* memory address? */
     WrMemW (pa, data);
+    if (sim_exectrace_on)                               /* record completed write */
+        sim_exectrace_mem (pa, data & 0177777, 2);
     return;
     }
 if (pa < IOPAGEBASE) {                                  /* not I/O address? */
@@ -2827,6 +2853,8 @@ if (iopageW (data, pa, WRITE) != SCPE_OK) {             /* invalid I/O addr? */
     setCPUERR (CPUE_TMO);
     ABORT (TRAP_NXM);
     }
+if (sim_exectrace_on)                                   /* record completed write */
+    sim_exectrace_mem (pa, data & 0177777, 2);
 return;
 }
 
@@ -2834,6 +2862,8 @@ void PWriteB (int32 data, int32 pa)
 {
 if (ADDR_IS_MEM (pa)) {                                 /* memory address? */
     WrMemB (pa, data);
+    if (sim_exectrace_on)                               /* record completed write */
+        sim_exectrace_mem (pa, data & 0377, 1);
     return;
     }             
 if (pa < IOPAGEBASE) {                                  /* not I/O address? */
@@ -2844,9 +2874,36 @@ if (iopageW (data, pa, WRITEB) != SCPE_OK) {            /* invalid I/O addr? */
     setCPUERR (CPUE_TMO);
     ABORT (TRAP_NXM);
     }
+if (sim_exectrace_on)                                   /* record completed write */
+    sim_exectrace_mem (pa, data & 0377, 1);
 return;
 }
 
+/* Instruction length in bytes, for the execution trace
+
+   Each operand specifier using index or index deferred mode, or
+   immediate or absolute mode (PC autoincrement), adds one word.
+*/
+
+#define SPEC_LNT(s)     (((((s) >> 3) & 06) == 06) || (((s) & 067) == 027)? 2: 0)
+
+static uint32 cpu_inst_lnt (int32 IR)
+{
+int32 dst = 0;
+
+if ((IR & 0070000) && ((IR & 0070000) != 0070000))     /* double operand */
+    return 2 + SPEC_LNT ((IR >> 6) & 077) + SPEC_LNT (IR & 077);
+if ((IR & 0070000) == 0070000)                          /* EIS or FP */
+    dst = (IR & 0100000)? (IR >= 0170100): (IR < 0075000);
+else if (IR & 0100000)                                  /* byte single operand */
+    dst = (IR >= 0105000);
+else dst = ((IR >= 0000100) && (IR < 0000200)) ||       /* JMP, SWAB */
+           ((IR >= 0000300) && (IR < 0000400)) ||
+           ((IR >= 0004000) && (IR < 0006400)) ||       /* JSR, single op */
+           (IR >= 0006500);                             /* MFPI ... TSTSET */
+return dst? 2 + SPEC_LNT (IR & 077): 2;
+}
+
 /* Relocate virtual address, read access
 
    Inputs:
@@ -3447,6 +3504,8 @@ if (M == NULL) {                    /* First time init */
                     SWMASK ('W')|SWMASK ('X');
     sim_brk_type_desc = cpu_breakpoints;
     sim_vm_is_subroutine_call = &cpu_is_pc_a_subroutine_call;
+    sim_vm_memory_buffer = &cpu_memory_buffer;
+    sim_vm_exectrace_regs = cpu_exectrace_regs;
     sim_clock_precalibrate_commands = pdp11_clock_precalibrate_commands;
     auto_config(NULL, 0);           /* do an initial auto configure */
     }
@@ -3569,6 +3628,17 @@ if (addr < IOPAGEBASE)
 return iopageW ((int32) val, addr, WRITEC);
 }
 
+/* Memory buffer for SAVE/RESTORE */
+
+void *cpu_memory_buffer (DEVICE *dptr, UNIT *uptr)
+{
+#if defined (UC15)
+return NULL;                                            /* memory is in the PDP-15 */
+#else
+return (uptr == &cpu_unit) ? M : NULL;
+#endif
+}
+
 /* Set R, SP register display addresses */
 
 void set_r_display (int32 rs, int32 cm)
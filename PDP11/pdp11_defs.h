@@ -869,6 +869,7 @@ int32 Map_ReadB (uint32 ba, int32 bc, uint8 *buf);
 int32 Map_ReadW (uint32 ba, int32 bc, uint16 *buf);
 int32 Map_WriteB (uint32 ba, int32 bc, const uint8 *buf);
 int32 Map_WriteW (uint32 ba, int32 bc, const uint16 *buf);
+void *Map_HostAddr (uint32 ba, int32 *bc);
 
 int32 mba_rdbufW (uint32 mbus, int32 bc, uint16 *buf);
 int32 mba_wrbufW (uint32 mbus, int32 bc, const uint16 *buf);
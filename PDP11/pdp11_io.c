@@ -416,6 +416,44 @@ else {                                                  /* physical */
     }
 }
 
+/* Host memory address of a DMA buffer
+
+   Returns a pointer to the host memory which holds bus address ba and
+   reduces *bc to the number of bytes which follow it contiguously in
+   host memory (the rest of a Unibus map page when the map is enabled),
+   so a device can transfer directly to or from memory.  Returns NULL
+   for the I/O page, for nonexistent memory and on big endian hosts
+   (where M doesn't hold bytes in PDP-11 order); those buffers must be
+   moved with Map_ReadW and Map_WriteW. */
+
+void *Map_HostAddr (uint32 ba, int32 *bc)
+{
+#if defined (UC15)
+return NULL;
+#else
+uint32 ma, lim;
+
+if (!sim_end)                                           /* big endian host? */
+    return NULL;
+ba = (ba & BUSMASK) & ~01;                              /* trim, align addr */
+if (UNIBUS && (ba >= (uint32)(IOPAGEBASE & UNIMASK)))   /* I/O page? */
+    return NULL;
+if (cpu_bme) {                                          /* map enabled? */
+    ma = Map_Addr (ba);                                 /* map addr */
+    lim = UBM_PAGSIZE - UBM_GETOFF (ba);                /* contiguous to end of page */
+    }
+else {                                                  /* physical */
+    ma = ba;
+    lim = UNIBUS ? (IOPAGEBASE & UNIMASK) - ba : (uint32)*bc;
+    }
+if ((uint32)*bc > lim)
+    *bc = (int32)lim;
+if ((*bc <= 0) || !ADDR_IS_MEM (ma) || !ADDR_IS_MEM (ma + *bc - 1))
+    return NULL;
+return ((uint8 *)M) + ma;
+#endif
+}
+
 /* Build tables from device list */
 
 t_stat build_dib_tab (void)
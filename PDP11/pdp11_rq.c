@@ -152,6 +152,7 @@ extern int32 MMR2;
 #define RQ_MAXDR        254                             /* max # drives */
 #define RQ_NUMBY        512                             /* bytes per block */
 #define RQ_MAXFR        (1 << 16)                       /* max xfer */
+#define RQ_MAXSEG       16                              /* max direct xfer segments */
 #define RQ_MAPXFER      (1u << 31)                      /* mapped xfer */
 #define RQ_M_PFN        0x1FFFFF                        /* map entry PFN */
 
@@ -174,6 +175,8 @@ extern int32 MMR2;
 #define io_complete     u6                              /* io completion flag */
 /* we can re-use filebuf because we don't set UNIT_BUFABLE in flags */
 #define rqxb            filebuf                         /* xfer buffer */
+#define rqsg            up7                             /* direct xfer segments */
+#define rqnsg           u3                              /* segments in use, 0 if via rqxb */
 #define RQ_RMV(u)       ((drv_tab[GET_DTYPE (u->flags)].flgs & RQDF_RMV)? \
                         UF_RMV: 0)
 #define RQ_WPH(u)       (((drv_tab[GET_DTYPE (u->flags)].flgs & RQDF_RO) || \
@@ -2455,6 +2458,45 @@ if (ba & RQ_MAPXFER) {                                  /* mapped xfer? */
 return Map_WriteW (ba, bc, buf);                        /* unmapped xfer */
 }
 
+/* Describe a buffer as host memory segments for a direct transfer
+
+   Returns the number of segments, or 0 when the data must be copied
+   through rqxb: the buffer isn't word aligned, isn't all memory, needs
+   too many segments, or data tracing wants to see the transfer. */
+
+static uint32 rq_host_segs (MSC *cp, UNIT *uptr, uint32 ba, uint32 bc)
+{
+#if defined (VM_PDP11)
+DISK_SEG *sg = (DISK_SEG *)uptr->rqsg;
+uint32 n = 0;
+int32 lbc;
+uint8 *addr;
+
+if ((sg == NULL) || ((ba | bc) & 1) || (DBG_DAT & rq_devmap[cp->cnum]->dctrl))
+    return 0;
+while (bc > 0) {
+    lbc = (int32)bc;
+    addr = (uint8 *)Map_HostAddr (ba, &lbc);
+    if (addr == NULL)
+        return 0;
+    if ((n > 0) && (sg[n - 1].buf + sg[n - 1].size == addr))
+        sg[n - 1].size += lbc;                          /* contiguous in host memory */
+    else {
+        if (n == RQ_MAXSEG)
+            return 0;
+        sg[n].buf = addr;
+        sg[n].size = lbc;
+        n = n + 1;
+        }
+    ba = ba + lbc;
+    bc = bc - lbc;
+    }
+return n;
+#else
+return 0;
+#endif
+}
+
 /* Unit service for data transfer commands */
 
 t_stat rq_svc (UNIT *uptr)
@@ -2500,6 +2542,7 @@ if ((cmd == OP_ERS) || (cmd == OP_WR)) {                /* write op? */
     }
 
 if (!uptr->io_complete) { /* Top End (I/O Initiation) Processing */
+    uptr->rqnsg = 0;
     if (cmd == OP_ERS) {                                /* erase? */
         wwc = ((tbc + (RQ_NUMBY - 1)) & ~(RQ_NUMBY - 1)) >> 1;
         memset (uptr->rqxb, 0, wwc * sizeof(uint16));   /* clr buf */
@@ -2507,6 +2550,11 @@ if (!uptr->io_complete) { /* Top End (I/O Initiation) Processing */
         err = sim_disk_wrsect_a (uptr, bl, (uint8 *)uptr->rqxb, NULL, (wwc << 1) / RQ_NUMBY, rq_io_complete);
         }
 
+    else if ((cmd == OP_WR) &&                          /* write directly from memory? */
+             (uptr->rqnsg = rq_host_segs (cp, uptr, ba, tbc))) {
+        err = sim_disk_wrsect_sg_a (uptr, bl, (DISK_SEG *)uptr->rqsg, uptr->rqnsg, NULL, (tbc + RQ_NUMBY - 1) / RQ_NUMBY, rq_io_complete);
+        }
+
     else if (cmd == OP_WR) {                            /* write? */
         t = rq_readw (ba, tbc, ma, (uint16 *)uptr->rqxb);/* fetch buffer */
         if ((abc = tbc - t)) {                          /* any xfer? */
@@ -2518,6 +2566,11 @@ if (!uptr->io_complete) { /* Top End (I/O Initiation) Processing */
             }
         }
 
+    else if ((cmd == OP_RD) &&                          /* read directly into memory? */
+             (uptr->rqnsg = rq_host_segs (cp, uptr, ba, tbc))) {
+        err = sim_disk_rdsect_sg_a (uptr, bl, (DISK_SEG *)uptr->rqsg, uptr->rqnsg, NULL, (tbc + RQ_NUMBY - 1) / RQ_NUMBY, rq_io_complete);
+        }
+
     else {  /* OP_RD & OP_CMP */
         err = sim_disk_rdsect_a (uptr, bl, (uint8 *)uptr->rqxb, NULL, (tbc + RQ_NUMBY - 1) / RQ_NUMBY, rq_io_complete);
         }                                               /* end else read */
@@ -2530,7 +2583,7 @@ else { /* Bottom End (After I/O processing) */
         }
 
     else if (cmd == OP_WR) {                            /* write? */
-        t = rq_readw (ba, tbc, ma, (uint16 *)uptr->rqxb);/* fetch buffer */
+        t = uptr->rqnsg ? 0 : rq_readw (ba, tbc, ma, (uint16 *)uptr->rqxb);/* fetch buffer */
         abc = tbc - t;                                  /* any xfer? */
         if (t) {                                        /* nxm? */
             PUTP32 (pkt, RW_WBCL, bc - abc);            /* adj bc */
@@ -2543,7 +2596,7 @@ else { /* Bottom End (After I/O processing) */
 
     else {
         sim_disk_data_trace(uptr, (uint8 *)uptr->rqxb, bl, tbc, "sim_disk_rdsect", DBG_DAT & rq_devmap[cp->cnum]->dctrl, DBG_REQ);
-        if ((cmd == OP_RD) && !err) {                   /* read? */
+        if ((cmd == OP_RD) && !err && !uptr->rqnsg) {   /* read via rqxb? */
             if ((t = rq_writew (ba, tbc, ma, (uint16 *)uptr->rqxb))) {/* store, nxm? */
                 PUTP32 (pkt, RW_WBCL, bc - (tbc - t));  /* adj bc */
                 PUTP32 (pkt, RW_WBAL, ba + (tbc - t));  /* adj ba */
@@ -3359,6 +3412,10 @@ for (i = 0; i < dptr->numunits; i++) {                  /* init units */
     uptr->rqxb = (uint16 *) realloc (uptr->rqxb, (RQ_MAXFR >> 1) * sizeof (uint16));
     if (uptr->rqxb == NULL)
         return SCPE_MEM;
+    uptr->rqsg = realloc (uptr->rqsg, RQ_MAXSEG * sizeof (DISK_SEG));
+    if (uptr->rqsg == NULL)
+        return SCPE_MEM;
+    uptr->rqnsg = 0;
     }
 for (i=cp->max_plug = 0; i < (dptr->numunits - 2); i++)
     if ((0 == (dptr->units[i].flags & UNIT_DIS)) && (dptr->units[i].unit_plug > cp->max_plug))
@@ -286,6 +286,12 @@ int32 hst_switches;                                     /* history option switch
 FILE *hst_log;                                          /* history log file */
 int32 hst_log_p;                                        /* history last log written pointer */
 int32 step_out_nest_level = 0;                          /* step to call return - nest level */
+static const char *cpu_exectrace_regs[] = {             /* execution trace registers */
+    "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9", "R10", "R11",
+    "AP", "FP", "SP", "PSL", NULL
+    };
+static t_value cpu_exectrace_start[16];                 /* registers at instruction start */
+static t_bool cpu_exectrace_pend = FALSE;               /* instruction not yet recorded */
 
 const uint32 byte_mask[33] = { 0x00000000,
  0x00000001, 0x00000003, 0x00000007, 0x0000000F,
@@ -319,6 +325,7 @@ t_stat cpu_reset (DEVICE *dptr);
 t_bool cpu_is_pc_a_subroutine_call (t_addr **ret_addrs);
 t_stat cpu_ex (t_value *vptr, t_addr exta, UNIT *uptr, int32 sw);
 t_stat cpu_dep (t_value val, t_addr exta, UNIT *uptr, int32 sw);
+void *cpu_memory_buffer (DEVICE *dptr, UNIT *uptr);
 t_stat cpu_set_size (UNIT *uptr, int32 val, CONST char *cptr, void *desc);
 t_stat cpu_set_hist (UNIT *uptr, int32 val, CONST char *cptr, void *desc);
 t_stat cpu_show_hist (FILE *st, UNIT *uptr, int32 val, CONST void *desc);
@@ -335,6 +342,7 @@ t_bool cpu_show_opnd (FILE *st, InstHistory *h, int32 line);
 t_stat cpu_show_hist_records (FILE *st, t_bool do_header, int32 start, int32 count);
 int32 cpu_emulate_exception (int32 *opnd, int32 cc, int32 opc, int32 acc);
 void cpu_idle (void);
+static void cpu_exectrace_record (void);
 
 /* CPU data structures
 
@@ -519,6 +527,7 @@ FLUSH_ISTR;                                             /* clear prefetch */
 
 abortval = setjmp (save_env);                           /* set abort hdlr */
 if (abortval > 0) {                                     /* sim stop? */
+    cpu_exectrace_pend = FALSE;                         /* drop partial instruction */
     PSL = PSL | cc;                                     /* put PSL together */
     pcq_r->qptr = pcq_p;                                /* update pc q ptr */
     if (hst_log) {                                      /* auto logging history? */
@@ -529,6 +538,9 @@ if (abortval > 0) {                                     /* sim stop? */
     }
 else if (abortval < 0) {                                /* mm or rsrv or int */
     int32 i, delta;
+
+    if (cpu_exectrace_pend)                             /* faulted in specifier decode? */
+        cpu_exectrace_record ();
     if ((PSL & PSL_FPD) == 0) {                         /* FPD? no recovery */
         for (i = 0; i < recqptr; i++) {                 /* unwind inst */
             int32 rrn, rlnt;
@@ -728,6 +740,12 @@ for ( ;; ) {
 
     sim_interval = sim_interval - (1 + (extra_bytes>>5));/* count instr */
     extra_bytes = 0;                                    /* digest string count */
+    if (sim_exectrace_on) {                             /* execution trace? */
+        for (i = 0; i < 15; i++)                        /* registers before decode */
+            cpu_exectrace_start[i] = (uint32) R[i];
+        cpu_exectrace_start[15] = (uint32) (PSL | cc);
+        cpu_exectrace_pend = TRUE;
+        }
     GET_ISTR (opc, L_BYTE);                             /* get opcode */
     if (opc == 0xFD) {                                  /* 2 byte op? */
         GET_ISTR (opc, L_BYTE);                         /* get second byte */
@@ -1590,6 +1608,11 @@ for ( ;; ) {
             cpu_show_hist_records (hst_log, FALSE, hst_log_p, hst_lnt);
         }
 
+/* Optionally record execution trace */
+
+    if (cpu_exectrace_pend)
+        cpu_exectrace_record ();
+
 /* Dispatch to instructions */
 
     switch (opc) {              
@@ -3298,6 +3321,28 @@ return 0;                                               /* set new cc's */
 
 /* Idle before the next instruction */
 
+/* Record the current instruction in the execution trace.  The registers
+   were captured before specifier decode, the instruction bytes are those
+   consumed so far (all of them unless decode faulted). */
+
+static void cpu_exectrace_record (void)
+{
+t_value wd;
+uint8 inst[32];
+int32 i, lim;
+
+cpu_exectrace_pend = FALSE;
+lim = PC - fault_PC;
+if ((uint32) lim > sizeof (inst))
+    lim = sizeof (inst);
+for (i = 0; i < lim; i++) {
+    if ((cpu_ex (&wd, fault_PC + i, &cpu_unit, SWMASK ('V'))) != SCPE_OK)
+        break;
+    inst[i] = (uint8) wd;
+    }
+sim_exectrace_insn ((uint32) fault_PC, inst, i, cpu_exectrace_start);
+}
+
 void cpu_idle (void)
 {
 sim_idle (TMR_CLK, TRUE);
@@ -3334,6 +3379,8 @@ if (M == NULL) {                        /* first time init? */
     vax_init();
     sim_brk_types = sim_brk_dflt = SWMASK ('E');
     sim_vm_is_subroutine_call = cpu_is_pc_a_subroutine_call;
+    sim_vm_memory_buffer = cpu_memory_buffer;
+    sim_vm_exectrace_regs = cpu_exectrace_regs;
     sim_clock_precalibrate_commands = vax_clock_precalibrate_commands;
     sim_vm_initial_ips = SIM_INITIAL_IPS;
     pcq_r = find_reg ("PCQ", NULL, dptr);
@@ -3440,6 +3487,16 @@ if (ADDR_IS_ROM (addr)) {
 return SCPE_NXM;
 }
 
+/* Memory buffer for SAVE/RESTORE - memory is saved as bytes, so M can only
+   be used directly on little endian hosts */
+
+void *cpu_memory_buffer (DEVICE *dptr, UNIT *uptr)
+{
+if ((uptr != &cpu_unit) || !sim_end)
+    return NULL;
+return M;
+}
+
 /* Memory allocation */
 
 t_stat cpu_set_size (UNIT *uptr, int32 val, CONST char *cptr, void *desc)
@@ -171,6 +171,14 @@ else {
     }
 }
 
+/* Record a completed write in the execution trace */
+
+static SIM_INLINE void WriteTrace (uint32 va, int32 val, int32 lnt)
+{
+sim_exectrace_mem (va, (uint32) val & ((lnt == L_BYTE) ? BMASK : ((lnt == L_WORD) ? WMASK : LMASK)),
+                   (lnt >= L_LONG) ? L_LONG : lnt);
+}
+
 /* Write virtual
 
    Inputs:
@@ -212,6 +220,8 @@ if ((pa & (lnt - 1)) == 0) {                            /* aligned? */
         else
             WriteB (pa, val);                              /* byte */
         }
+    if (sim_exectrace_on)                               /* record execution trace? */
+        WriteTrace (va, val, lnt);
     return;
     }
 if (mapen && ((uint32)(off + lnt) > VA_PAGSIZE)) {
@@ -237,6 +247,8 @@ else {                                                  /* word cross lw */
     WriteU (pa, val & BMASK, L_BYTE);
     WriteU (pa1, (val >> 8) & BMASK, L_BYTE);
     }
+if (sim_exectrace_on)                                   /* record execution trace? */
+    WriteTrace (va, val, lnt);
 return;
 }
 
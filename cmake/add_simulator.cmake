@@ -42,6 +42,9 @@ set(SIM_VIDEO_SOURCES
     ${CMAKE_SOURCE_DIR}/display/display.c
     ${CMAKE_SOURCE_DIR}/display/sim_ws.c)
 
+## BENCHMARK command test script, run by every simulator:
+set(SIMH_BENCHMARK_SCRIPT ${CMAKE_SOURCE_DIR}/cmake/simh-benchmark.ini)
+
 ## Build a simulator core library, with and without AIO support. The AIO variant
 ## has "_aio" appended to its name, e.g., "simhz64_aio" or "simhz64_video_aio".
 function(build_simcore _targ)
@@ -297,8 +300,11 @@ function (add_simulator _targ)
 
     add_test(NAME "simh-${_targ}" COMMAND ${test_cmd})
 
+    ## BENCHMARK command smoke test, common to all simulators:
+    add_test(NAME "simh-${_targ}-benchmark" COMMAND "${_targ}" "${SIMH_BENCHMARK_SCRIPT}")
+
     if (SIMH_LABEL)
-        set_tests_properties("simh-${_targ}" PROPERTIES LABELS "simh-${SIMH_LABEL}")
+        set_tests_properties("simh-${_targ}" "simh-${_targ}-benchmark" PROPERTIES LABELS "simh-${SIMH_LABEL}")
     endif ()
 
     if (BUILD_SHARED_DEPS)
@@ -326,7 +332,7 @@ function (add_simulator _targ)
         endif ()
     endif ()
 
-    set_property(TEST "simh-${_targ}" PROPERTY ENVIRONMENT "${test_add_env}")
+    set_property(TEST "simh-${_targ}" "simh-${_targ}-benchmark" PROPERTY ENVIRONMENT "${test_add_env}")
 
     if (DONT_USE_ROMS)
         target_compile_definitions(DONT_USE_INTERNAL_ROM)
@@ -431,6 +437,17 @@ if (NOT DONT_USE_ROMS)
     )
 endif ()
 
+## SET DEBUG -X binary trace decoder.
+add_executable(DebugDecode ${CMAKE_SOURCE_DIR}/sim_DebugDecode.c)
+target_include_directories(DebugDecode PUBLIC "${CMAKE_SOURCE_DIR}")
+
+## Disk container conversion, compaction, verification and checksum tool.
+## It is built on the simulator framework to share sim_disk.c.
+simh_executable_template(DiskTool
+    SOURCES ${CMAKE_SOURCE_DIR}/sim_DiskTool.c
+    FEATURE_FULL64
+    USES_AIO)
+
 ## Front panel test.
 ##
 ## From all evidence in makefile, sim_frontpanel isn't used yet by any targets.
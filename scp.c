@@ -235,6 +235,10 @@
 #include "sim_video.h"
 #include "sim_sock.h"
 #include "sim_frontpanel.h"
+#include "sim_debtrace.h"
+#if defined (HAVE_ZLIB)
+#include <zlib.h>
+#endif
 #include <signal.h>
 #include <ctype.h>
 #include <time.h>
@@ -244,6 +248,9 @@
 #include <fcntl.h>
 #endif
 #include <setjmp.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 #if defined(HAVE_EDITLINE)              /* Editline command line editing */
 #include <editline/readline.h>
@@ -281,6 +288,13 @@
 #define SRBSIZ          1024                            /* save/restore buffer */
 #define SIM_BRK_INILNT  4096                            /* bpt tbl length */
 #define SIM_BRK_ALLTYP  0xFFFFFFFB
+#define SIM_BRK_PG_V    6                               /* log2 addrs per bpt page */
+#define SIM_BRK_PG_BITS 15                              /* log2 bpt page map size */
+#define SIM_BRK_PG_MASK ((1u << SIM_BRK_PG_BITS) - 1)
+#define SIM_BRK_PG(l)   ((uint32)((((t_uint64)(l)) >> SIM_BRK_PG_V) ^ \
+                                  (((t_uint64)(l)) >> (SIM_BRK_PG_V + SIM_BRK_PG_BITS))) & SIM_BRK_PG_MASK)
+#define SIM_BRK_PG_SET(l)  sim_brk_pgmap[SIM_BRK_PG(l) >> 5] |= (1u << (SIM_BRK_PG(l) & 0x1F))
+#define SIM_BRK_PG_TEST(l) (sim_brk_pgmap[SIM_BRK_PG(l) >> 5] & (1u << (SIM_BRK_PG(l) & 0x1F)))
 #define UPDATE_SIM_TIME                                         \
     if (1) {                                                    \
         int32 _x;                                               \
@@ -468,6 +482,8 @@ t_addr (*sim_vm_parse_addr) (DEVICE *dptr, CONST char *cptr, CONST char **tptr)
 t_value (*sim_vm_pc_value) (void) = NULL;
 t_bool (*sim_vm_is_subroutine_call) (t_addr **ret_addrs) = NULL;
 void (*sim_vm_reg_update) (REG *rptr, uint32 idx, t_value prev_val, t_value new_val) = NULL;
+void *(*sim_vm_memory_buffer) (DEVICE *dptr, UNIT *uptr) = NULL;
+const char * const *sim_vm_exectrace_regs = NULL;
 t_bool (*sim_vm_fprint_stopped) (FILE *st, t_stat reason) = NULL;
 const char *sim_vm_release = NULL;
 const char *sim_vm_release_message = NULL;
@@ -483,6 +499,10 @@ t_stat set_dev_enbdis (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr);
 t_stat set_dev_debug (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr);
 t_stat set_unit_enbdis (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr);
 t_stat set_unit_append (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr);
+t_stat set_unit_cache (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr);
+t_stat set_unit_mmap (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr);
+t_stat set_unit_ddistore (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr);
+t_stat set_unit_iotrace (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr);
 t_stat ssh_break (FILE *st, const char *cptr, int32 flg);
 t_stat show_cmd_fi (FILE *ofile, int32 flag, CONST char *cptr);
 t_stat show_config (FILE *st, DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr);
@@ -569,6 +589,7 @@ t_stat dep_addr (int32 flag, const char *cptr, t_addr addr, DEVICE *dptr,
 void fprint_fields (FILE *stream, t_value before, t_value after, BITFIELD* bitdefs);
 t_stat step_svc (UNIT *ptr);
 t_stat runlimit_svc (UNIT *ptr);
+t_stat benchmark_svc (UNIT *ptr);
 t_stat expect_svc (UNIT *ptr);
 t_stat flush_svc (UNIT *ptr);
 t_stat shift_args (char *do_arg[], size_t arg_count);
@@ -587,6 +608,22 @@ static const char *_get_dbg_verb (uint32 dbits, DEVICE* dptr, UNIT *uptr);
 static t_stat sim_sanity_check_register_declarations (DEVICE **devices);
 static void fix_writelock_mtab (DEVICE *dptr);
 static t_stat _sim_debug_flush (void);
+static UNIT **_sim_clock_queue_units (uint32 *count);
+t_stat sim_set_queue (int32 flag, CONST char *cptr);
+t_stat sim_set_profile (int32 flag, CONST char *cptr);
+t_stat sim_show_profile (FILE *st, DEVICE *dnotused, UNIT *unotused, int32 flag, CONST char *cptr);
+t_stat sim_set_evstats (int32 flag, CONST char *cptr);
+t_stat sim_show_evstats (FILE *st, DEVICE *dnotused, UNIT *unotused, int32 flag, CONST char *cptr);
+t_stat sim_show_dev_evstats (FILE *st, DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr);
+t_stat sim_set_exectrace (int32 flag, CONST char *cptr);
+t_stat sim_show_exectrace (FILE *st, DEVICE *dnotused, UNIT *unotused, int32 flag, CONST char *cptr);
+static void _sim_prof_stop (void);
+static void _sim_extr_stop (void);
+static void _sim_evstats_clear (void);
+static t_stat _sim_save (FILE *sfile, t_bool snapshot, t_bool delta);
+static t_stat _sim_rest (FILE *rfile, const char *filename);
+static t_stat _sim_snap_wait (void);
+extern DEVICE sim_prof_dev;
 
 /* Global data */
 
@@ -622,6 +659,7 @@ BRKTAB **sim_brk_tab = NULL;
 int32 sim_brk_ent = 0;
 int32 sim_brk_lnt = 0;
 int32 sim_brk_ins = 0;
+static uint32 sim_brk_pgmap[(1u << SIM_BRK_PG_BITS) >> 5];/* pages with breakpoints */
 int32 sim_quiet = 0;
 int32 sim_show_message = 1;                         /* the message display status of the currently open do file */
 int32 sim_step = 0;
@@ -638,6 +676,18 @@ size_t *sim_sub_instr_off = NULL;   /* offsets in substitution buffer where orig
 static double sim_time;
 static uint32 sim_rtime;
 static int32 noqueue_time;
+static t_bool sim_clock_heap_enabled = FALSE;           /* heap event queue engine selected */
+static UNIT **sim_clock_heap = NULL;                    /* heap event queue (when enabled) */
+static uint32 sim_clock_heap_count = 0;                 /* heap event queue entries */
+static uint32 sim_clock_heap_size = 0;                  /* heap event queue allocated size */
+static t_uint64 sim_clock_heap_seq = 0;                 /* heap event queue activation sequence */
+static t_bool sim_bench_active = FALSE;                 /* BENCHMARK command executing */
+static t_uint64 sim_bench_events = 0;                   /* events processed */
+static double sim_bench_event_secs = 0.0;               /* host time in sim_process_event */
+static UNIT * volatile sim_event_unit = NULL;           /* unit whose event service routine is executing */
+static t_bool sim_evstats_enabled = FALSE;              /* event service accounting enabled */
+static double sim_evstats_start = 0.0;                  /* host time event service accounting started */
+static double sim_evstats_start_gtime = 0.0;            /* sim time event service accounting started */
 volatile t_bool stop_cpu = FALSE;
 volatile t_bool sigterm_received = FALSE;
 static unsigned int sim_stop_sleep_ms = 250;
@@ -727,6 +777,20 @@ DEVICE sim_runlimit_dev = {
     NULL, NULL, NULL, NULL, NULL, NULL,
     sim_int_runlimit_description};
 
+static const char *sim_int_benchmark_description (DEVICE *dptr)
+{
+return "Benchmark facility";
+}
+
+static UNIT sim_benchmark_unit = { UDATA (&benchmark_svc, 0, 0) };
+DEVICE sim_benchmark_dev = {
+    "INT-BENCHMARK", &sim_benchmark_unit, NULL, NULL,
+    1, 0, 0, 0, 0, 0,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, DEV_NOSAVE, 0,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    sim_int_benchmark_description};
+
 static const char *sim_int_expect_description (DEVICE *dptr)
 {
 return "Expect facility";
@@ -777,6 +841,7 @@ const char *sim_savename = sim_name;      /* Simulator Name used in SAVE/RESTORE
 
 const char save_vercur[] = "V4.0";
 const char save_ver40[] = "V4.0";
+const char save_ver40i[] = "V4.0I";                    /* incremental snapshot */
 const char save_ver35[] = "V3.5";
 const char save_ver32[] = "V3.2";
 const char save_ver30[] = "V3.0";
@@ -1023,6 +1088,14 @@ static const char simh_help1[] =
       " to a file.  This includes the contents of main memory and all registers,\n"
       " and the I/O connections of devices:\n\n"
       "++SAVE <filename>\n\n"
+      "4Switches\n"
+      "++-I      Save an incremental snapshot\n\n"
+      " SAVE -I saves only the memory which changed since the previous SAVE -I,\n"
+      " along with the complete device and register state.  The resulting file\n"
+      " refers to the previous snapshot, which must be kept for RESTORE to work.\n"
+      " The first SAVE -I, and any SAVE -I after a plain SAVE or a RESTORE,\n"
+      " saves the complete state and starts a new chain of snapshots.  The\n"
+      " changed memory is written while the simulator continues running.\n\n"
 #define HLP_RESTORE     "*Commands Saving_and_Restoring_State RESTORE"
       "3RESTORE\n"
       " The RESTORE command (abbreviation REST, alternately GET) restores a\n"
@@ -1036,7 +1109,9 @@ static const char simh_help1[] =
       "\n"
       "4Notes:\n"
       " 1) SAVE file format compresses zeroes to minimize file size.\n"
-      " 2) The simulator can't restore active incoming telnet sessions to\n"
+      " 2) RESTORE of an incremental snapshot first restores the snapshots it\n"
+      " was based on.\n"
+      " 3) The simulator can't restore active incoming telnet sessions to\n"
       " multiplexer devices, but the listening ports will be restored across a\n"
       " save/restore.\n"
        /***************** 80 character line width template *************************/
@@ -1084,6 +1159,27 @@ static const char simh_help1[] =
       " The BOOT command (abbreviated BO) resets all devices and bootstraps the\n"
       " device and unit given by its argument.  If no unit is supplied, unit 0 is\n"
       " bootstrapped.  The specified unit must be attached.\n"
+#define HLP_BENCHMARK   "*Commands Running_A_Simulated_Program BENCHMARK"
+      "3BENCHMARK\n"
+      " The BENCHMARK command resumes execution at the current PC, like CONTINUE,\n"
+      " for a fixed number of %Is or a fixed amount of wall clock time,\n"
+      " with throttling and idling suspended, and then reports the achieved\n"
+      " execution rate:\n\n"
+      "++BENCHMARK {-C|-J} n {%C|MICROSECONDS|SECONDS|MINUTES} {file}\n\n"
+      " The report includes the %Is executed per second, the number of\n"
+      " events processed per second, the host time spent in event processing\n"
+      " and, on hosts which provide a cycle counter, the host cycles used per\n"
+      " simulated %I.  Execution may stop before the requested amount if\n"
+      " the simulated program halts or another stop condition occurs; the stop\n"
+      " reason is part of the report.\n"
+      "4Switches\n"
+      " The -C switch produces the report as comma separated values and the -J\n"
+      " switch produces it as a JSON object.  If a file is specified, the CSV\n"
+      " (or with -J, JSON) report is appended to it, with a CSV header line\n"
+      " written when the file is new, and a summary is displayed on the console.\n"
+      "4Examples\n"
+      "++BENCHMARK 100000000          run 100 million %Is\n"
+      "++BENCHMARK -C 10 SECONDS bench.csv\n"
        /***************** 80 character line width template *************************/
       "2Stopping The Simulator\n"
       " Programs run until the simulator detects an error or stop condition, or\n"
@@ -1421,6 +1517,19 @@ static const char simh_help1[] =
       " The size of the circular memory buffer that is used is specified on\n"
       " the SET DEBUG command line, for example:\n\n"
       "++SET DEBUG -B <sizeinMB> <debug-destination>\n\n"
+      "5-W\n"
+      " The -W switch causes debug messages to be formatted and written by a\n"
+      " separate writer thread.  The simulator only records each message in a\n"
+      " memory buffer, which makes debugging busy devices much less intrusive.\n"
+      " The output is the same as without -W.  A debug file is required.\n"
+      "5-X\n"
+      " The -X switch causes debug messages to be written by a separate writer\n"
+      " thread as compact binary trace records.  The records are turned back\n"
+      " into normal debug output with the DebugDecode program, which accepts\n"
+      " the -T, -A, -R, -P and -F switches described above:\n\n"
+      "++SET DEBUG -X trace.bin\n"
+      "++DebugDecode -T trace.bin trace.log\n\n"
+      " -X can't be combined with -B.\n"
 #define HLP_SET_BREAK  "*Commands SET Breakpoints"
       "3Breakpoints\n"
       "+SET BREAK <list>            set breakpoints\n"
@@ -1469,6 +1578,55 @@ static const char simh_help1[] =
       "3Asynch\n"
       "+SET ASYNCH                  enable asynchronous I/O\n"
       "+SET NOASYNCH                disable asynchronous I/O\n"
+#define HLP_SET_QUEUE "*Commands SET Queue"
+      "3Queue\n"
+      "+SET QUEUE LIST              use the sorted list event queue (default)\n"
+      "+SET QUEUE HEAP              use the binary heap event queue\n\n"
+      " Each activation or cancel of a unit event costs time proportional to\n"
+      " the number of pending events with the sorted list event queue, and time\n"
+      " proportional to the logarithm of that number with the heap event queue.\n"
+      " Configurations with many simultaneously active units (large multiplexers,\n"
+      " many disk and tape drives) may run faster with the heap event queue.\n"
+      " Both event queues dispatch events in exactly the same order and pending\n"
+      " events are preserved when switching between them.\n"
+#define HLP_SET_PROFILE "*Commands SET Profile"
+      "3Profile\n"
+      "+SET PROFILE {rate}          start sampling the simulated PC (default\n"
+      "++++++++                     100 samples per second)\n"
+      "+SET NOPROFILE               stop sampling\n\n"
+      " While profiling is enabled, the simulated PC is sampled periodically\n"
+      " while the simulator is running.  When the host supports threads, the\n"
+      " samples are timed by a separate thread and samples requested while a\n"
+      " device's event service routine is executing are attributed to that\n"
+      " device unit.\n"
+      " SET PROFILE discards any previously collected samples.  SET NOPROFILE\n"
+      " stops sampling but keeps the samples for display with SHOW PROFILE.\n"
+#define HLP_SET_EVENTSTATS "*Commands SET Eventstats"
+      "3Eventstats\n"
+      "+SET EVENTSTATS              clear and enable event service statistics\n"
+      "+SET NOEVENTSTATS            disable event service statistics\n\n"
+      " Event service statistics record, for each device, the number of calls\n"
+      " to its event service routines, the host time spent in them and the\n"
+      " average delay with which they reschedule the device's units.  They are\n"
+      " disabled by default, since they add host clock reads to every event.\n"
+      " Once enabled, they are displayed with SHOW EVENTSTATS or\n"
+      " SHOW <dev> STATISTICS.\n"
+#define HLP_SET_EXECTRACE "*Commands SET Exectrace"
+      "3Exectrace\n"
+      "+SET EXECTRACE file          record every executed instruction in file\n"
+      "+SET NOEXECTRACE             stop recording\n\n"
+      " An execution trace records the PC, the instruction, the register values\n"
+      " at the start of the instruction and the memory it wrote for every\n"
+      " instruction the simulator executes.  The trace is compactly encoded and written by a separate\n"
+      " thread, so traces of billions of instructions are practical.  Only\n"
+      " simulators whose CPU supports it can record execution traces.\n\n"
+      " SHOW EXECTRACE displays the state of the recording.  A finished trace\n"
+      " is displayed with:\n\n"
+      "++SHOW EXECTRACE file {first {count}}\n\n"
+      " which shows count instructions (default: the rest of the trace)\n"
+      " starting at instruction number first (default: 0, the first recorded\n"
+      " instruction).  Starting far into a trace doesn't require reading the\n"
+      " part of the trace before it.\n"
 #define HLP_SET_ENVIRON "*Commands SET Environment"
       "3Environment\n"
       "4Explicitily Changing a Variable\n"
@@ -1561,6 +1719,21 @@ static const char simh_help1[] =
       "+SET <unit> ENABLED          enable unit\n"
       "+SET <unit> DISABLED         disable unit\n"
       "+SET <unit> arg{,arg...}     set unit parameters (see show modifiers)\n"
+      "+SET <unit> CACHE{=size}     enable a sector cache for a disk unit (size\n"
+      "++++++++                     in KB or with a K, M or G suffix, default 1M)\n"
+      "+SET <unit> CACHE=WRITEBACK  hold small writes in the cache until evicted\n"
+      "++++++++                     or the simulator stops\n"
+      "+SET <unit> CACHE=WRITETHROUGH write every write to the container (default)\n"
+      "+SET <unit> NOCACHE          disable the disk unit sector cache\n"
+      "+SET <unit> MMAP             memory map a SIMH or RAW format disk container\n"
+      "++++++++                     when the unit is attached\n"
+      "+SET <unit> NOMMAP           access the disk unit container with file I/O\n"
+      "+SET <unit> DDISTORE=path    new DDI containers keep their chunks in a\n"
+      "++++++++                     shared chunk store file\n"
+      "+SET <unit> NODDISTORE       new DDI containers hold their own chunks\n"
+      "+SET <unit> IOTRACE=file     record the disk unit's transfers in a binary\n"
+      "++++++++                     trace file (for DiskTool REPLAY)\n"
+      "+SET <unit> NOIOTRACE        stop recording the disk unit's transfers\n"
       "+HELP <dev> SET              displays the device specific set commands\n"
       "++++++++                     available\n"
 #define HLP_NOAUTOSIZE  "*Commands SET NoAutosize"
@@ -1602,6 +1775,13 @@ static const char simh_help2[] =
       "+sh{ow} on                   show on condition actions\n"
       "+sh{ow} do                   show do nesting state\n"
       "+sh{ow} runlimit             show execution limit states\n"
+      "+sh{ow} profile {n}          show the n most sampled locations\n"
+      "+sh{ow} -f profile {file}    write profile samples as folded stacks\n"
+      "++++++++                     for flame graph tools\n"
+      "+sh{ow} eventstats           show event service statistics for all devices\n"
+      "+sh{ow} <dev> statistics     show event service statistics for a device\n"
+      "+sh{ow} <dev> eventstats     same as statistics (for devices which\n"
+      "++++++++                     have their own statistics display)\n"
       "+h{elp} <dev> show           displays the device specific show commands\n"
       "++++++++                     available\n"
 #define HLP_SHOW_CONFIG         "*Commands SHOW"
@@ -1630,6 +1810,9 @@ static const char simh_help2[] =
 #define HLP_SHOW_ON             "*Commands SHOW"
 #define HLP_SHOW_DO             "*Commands SHOW"
 #define HLP_SHOW_RUNLIMIT       "*Commands SHOW"
+#define HLP_SHOW_PROFILE        "*Commands SHOW"
+#define HLP_SHOW_EVENTSTATS     "*Commands SHOW"
+#define HLP_SHOW_EXECTRACE      "*Commands SHOW"
 #define HLP_SHOW_SEND           "*Commands SHOW"
 #define HLP_SHOW_EXPECT         "*Commands SHOW"
 #define HLP_HELP                "*Commands HELP"
@@ -2180,7 +2363,9 @@ static const char simh_help2[] =
       " specific mention of a particular EXPECT match string, will remove all\n"
       " currently defined EXPECT match rules.\n\n"
       " The SHOW EXPECT command displays all of the pending EXPECT state for\n"
-      " the console or a specific multiplexer line.\n"
+      " the console or a specific multiplexer line.  This includes how often\n"
+      " each rule has matched and, for regular expression rules, how often they\n"
+      " were evaluated and the host time those evaluations took.\n"
        /***************** 80 character line width template *************************/
       "4Switches\n"
       " Switches can be used to influence the behavior of EXPECT rules\n\n"
@@ -2515,7 +2700,22 @@ static const char simh_help2[] =
 #define HLP_DISKINFO    "*Commands Disk_Container_Information"
       "2Disk Container Information\n"
       " Information about a Disk Container can be displayed with the DISKINFO command:\n\n"
-      "++DISKINFO container-spec    show information about a disk container\n\n";
+      "++DISKINFO container-spec    show information about a disk container\n\n"
+#define HLP_SNAPSHOT    "*Commands Disk_Snapshots"
+      "2Disk Snapshots\n"
+      " A snapshot preserves the contents of an attached VHD format disk\n"
+      " container while the simulator keeps using the disk.  Writes made after\n"
+      " the snapshot go to a differencing VHD, which can later be discarded or\n"
+      " merged into the container:\n\n"
+      "++SNAPSHOT <unit> {file}      write to a new differencing VHD from now on\n"
+      "++++++++                     (default file name <container>-snapN.vhd)\n"
+      "++ROLLBACK <unit>             discard the most recent snapshot\n"
+      "++COMMIT <unit>               merge the most recent snapshot into its parent\n\n"
+      " A COMMIT is done in the background while the simulator runs, and the\n"
+      " unit switches to the parent container when it has finished.  SAVE\n"
+      " waits for a commit in progress, and records a unit with a snapshot as\n"
+      " attached to the snapshot file.  Rolling back or committing a snapshot\n"
+      " recorded in a SAVE file prevents RESTORE from reattaching it.\n\n";
 
 
 static CTAB cmd_table[] = {
@@ -2589,9 +2789,13 @@ static CTAB cmd_table[] = {
     { "CURL",       &curl_cmd,      0,          HLP_CURL,       NULL, NULL },
     { "RUNLIMIT",   &runlimit_cmd,  1,          HLP_RUNLIMIT,   NULL, NULL },
     { "NORUNLIMIT", &runlimit_cmd,  0,          HLP_RUNLIMIT,   NULL, NULL },
+    { "BENCHMARK",  &benchmark_cmd, 0,          HLP_BENCHMARK,  NULL, NULL },
     { "TESTLIB",    &test_lib_cmd,  0,          HLP_TESTLIB,    NULL, NULL },
     { "DISKINFO",   &sim_disk_info_cmd,  0,     HLP_DISKINFO,   NULL, NULL },
     { "ZAPTYPE",    &sim_disk_info_cmd,  1,     NULL,           NULL, NULL },
+    { "SNAPSHOT",   &sim_disk_snapshot_cmd, 0,  HLP_SNAPSHOT,   NULL, NULL },
+    { "ROLLBACK",   &sim_disk_snapshot_cmd, 1,  HLP_SNAPSHOT,   NULL, NULL },
+    { "COMMIT",     &sim_disk_snapshot_cmd, 2,  HLP_SNAPSHOT,   NULL, NULL },
     { NULL,         NULL,           0,          NULL,           NULL, NULL }
     };
 
@@ -2612,6 +2816,13 @@ static CTAB set_glob_tab[] = {
     { "CLOCKS",     &sim_set_timers,            1, HLP_SET_CLOCK },
     { "ASYNCH",     &sim_set_asynch,            1, HLP_SET_ASYNCH },
     { "NOASYNCH",   &sim_set_asynch,            0, HLP_SET_ASYNCH },
+    { "QUEUE",      &sim_set_queue,             0, HLP_SET_QUEUE },
+    { "PROFILE",    &sim_set_profile,           1, HLP_SET_PROFILE },
+    { "NOPROFILE",  &sim_set_profile,           0, HLP_SET_PROFILE },
+    { "EVENTSTATS", &sim_set_evstats,           1, HLP_SET_EVENTSTATS },
+    { "NOEVENTSTATS", &sim_set_evstats,         0, HLP_SET_EVENTSTATS },
+    { "EXECTRACE",  &sim_set_exectrace,         1, HLP_SET_EXECTRACE },
+    { "NOEXECTRACE", &sim_set_exectrace,        0, HLP_SET_EXECTRACE },
     { "ENVIRONMENT", &sim_set_environment,      1, HLP_SET_ENVIRON },
     { "ON",         &set_on,                    1, HLP_SET_ON },
     { "NOON",       &set_on,                    0, HLP_SET_ON },
@@ -2651,6 +2862,14 @@ static C1TAB set_unit_tab[] = {
     { "NODEBUG",    &set_dev_debug,     2+0 },
     { "APPEND",     &set_unit_append,   0 },
     { "EOF",        &set_unit_append,   0 },
+    { "CACHE",      &set_unit_cache,    1 },
+    { "NOCACHE",    &set_unit_cache,    0 },
+    { "MMAP",       &set_unit_mmap,     1 },
+    { "NOMMAP",     &set_unit_mmap,     0 },
+    { "DDISTORE",   &set_unit_ddistore, 1 },
+    { "NODDISTORE", &set_unit_ddistore, 0 },
+    { "IOTRACE",    &set_unit_iotrace,  1 },
+    { "NOIOTRACE",  &set_unit_iotrace,  0 },
     { NULL,         NULL,               0 }
     };
 
@@ -2685,6 +2904,9 @@ static SHTAB show_glob_tab[] = {
     { "ON",             &show_on,                  -1, HLP_SHOW_ON },
     { "DO",             &show_do,                   0, HLP_SHOW_DO },
     { "RUNLIMIT",       &show_runlimit,             0, HLP_SHOW_RUNLIMIT },
+    { "PROFILE",        &sim_show_profile,          0, HLP_SHOW_PROFILE },
+    { "EVENTSTATS",     &sim_show_evstats,          0, HLP_SHOW_EVENTSTATS },
+    { "EXECTRACE",      &sim_show_exectrace,        0, HLP_SHOW_EXECTRACE },
     { NULL,             NULL,                       0 }
     };
 
@@ -2694,6 +2916,8 @@ static SHTAB show_dev_tab[] = {
     { "MODIFIERS",  &show_dev_modifiers,        0 },
     { "NAMES",      &show_dev_logicals,         0 },
     { "SHOW",       &show_dev_show_commands,    0 },
+    { "STATISTICS", &sim_show_dev_evstats,      0 },
+    { "EVENTSTATS", &sim_show_dev_evstats,      0 },
     { NULL,         NULL,                       0 }
     };
 
@@ -2858,6 +3082,9 @@ sim_register_internal_device (&sim_expect_dev);
 sim_register_internal_device (&sim_step_dev);
 sim_register_internal_device (&sim_flush_dev);
 sim_register_internal_device (&sim_runlimit_dev);
+sim_register_internal_device (&sim_benchmark_dev);
+sim_register_internal_device (&sim_prof_dev);
+_sim_evstats_clear ();
 
 if ((stat = sim_ttinit ()) != SCPE_OK) {
     fprintf (stderr, "Fatal terminal initialization error\n%s\n",
@@ -2979,6 +3206,9 @@ cleanup_and_exit:
 detach_all (0, TRUE);                                   /* close files */
 sim_set_deboff (0, NULL);                               /* close debug */
 sim_set_logoff (0, NULL);                               /* close log */
+_sim_prof_stop ();                                      /* stop profiling */
+_sim_extr_stop ();                                      /* finish execution trace */
+_sim_snap_wait ();                                      /* finish snapshot */
 sim_set_notelnet (0, NULL);                             /* close Telnet */
 vid_close_all ();                                       /* close video */
 sim_ttclose ();                                         /* close console */
@@ -6041,6 +6271,12 @@ while (*cptr != 0) {                                    /* do all mods */
         }                                               /* end for */
     if (!mptr || (mptr->mask == 0)) {                   /* no match? */
         if ((glbr = find_c1tab (ctbr, gbuf))) {         /* global match? */
+            if (cvptr && ((glbr->action == &set_unit_ddistore) ||
+                          (glbr->action == &set_unit_iotrace))) {/* file path value? */
+                get_glyph_nc (svptr, gbuf, ',');        /* keep its case */
+                if ((cvptr = strchr (gbuf, '=')))
+                    *cvptr++ = 0;
+                }
             r = glbr->action (dptr, uptr, glbr->arg, cvptr);    /* do global */
             if (r != SCPE_OK)
                 return r;
@@ -6207,6 +6443,34 @@ if (0 == sim_fseek (uptr->fileref, 0, SEEK_END)) {
 return sim_messagef (SCPE_IERR, "%s Can't seek to end of file: %s - %s\n", sim_uname (uptr), uptr->filename, strerror (errno));
 }
 
+t_stat set_unit_cache (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr)
+{
+if (DEV_TYPE (dptr) != DEV_DISK)
+    return sim_messagef (SCPE_NOFNC, "%s is not a disk device.\n", sim_uname (uptr));
+return sim_disk_set_cache (uptr, flag, cptr);
+}
+
+t_stat set_unit_mmap (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr)
+{
+if (DEV_TYPE (dptr) != DEV_DISK)
+    return sim_messagef (SCPE_NOFNC, "%s is not a disk device.\n", sim_uname (uptr));
+return sim_disk_set_mmap (uptr, flag, cptr);
+}
+
+t_stat set_unit_ddistore (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr)
+{
+if (DEV_TYPE (dptr) != DEV_DISK)
+    return sim_messagef (SCPE_NOFNC, "%s is not a disk device.\n", sim_uname (uptr));
+return sim_disk_set_store (uptr, flag, cptr);
+}
+
+t_stat set_unit_iotrace (DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr)
+{
+if (DEV_TYPE (dptr) != DEV_DISK)
+    return sim_messagef (SCPE_NOFNC, "%s is not a disk device.\n", sim_uname (uptr));
+return sim_disk_set_iotrace (uptr, flag, cptr);
+}
+
 /* Show command */
 
 t_stat show_cmd (int32 flag, CONST char *cptr)
@@ -6506,8 +6770,18 @@ else {
         }
     }
 show_all_mods (st, dptr, uptr, MTAB_VUN, &toks);        /* show unit mods */
+if (DEV_TYPE (dptr) == DEV_DISK) {
+    const char *cache = sim_disk_cache_summary (uptr);
+
+    if (cache) {
+        fprint_sep (st, &toks);
+        fprintf (st, "%s", cache);
+        }
+    }
 if (toks || (flag < 0) || (flag > 1))
     fprintf (st, "\n");
+if ((flag < 0) && (DEV_TYPE (dptr) == DEV_DISK))       /* SHOW <unit>? */
+    sim_disk_show_stats (st, uptr);
 return SCPE_OK;
 }
 
@@ -6993,6 +7267,8 @@ t_stat show_queue (FILE *st, DEVICE *dnotused, UNIT *unotused, int32 flag, CONST
 {
 DEVICE *dptr;
 UNIT *uptr;
+UNIT **units;
+uint32 i, count;
 MEMFILE buf;
 
 memset (&buf, 0, sizeof (buf));
@@ -7005,9 +7281,11 @@ else {
     const char *tim = "";
     double inst_per_sec = sim_timer_inst_per_sec ();
 
-    fprintf (st, "%s event queue status, time = %.0f, executing %s %s/sec\n",
-             sim_name, sim_time, sim_fmt_numeric (inst_per_sec), sim_vm_interval_units);
-    for (uptr = sim_clock_queue; uptr != QUEUE_LIST_END; uptr = uptr->next) {
+    fprintf (st, "%s event queue status%s, time = %.0f, executing %s %s/sec\n",
+             sim_name, sim_clock_heap_enabled ? " (heap)" : "", sim_time, sim_fmt_numeric (inst_per_sec), sim_vm_interval_units);
+    units = _sim_clock_queue_units (&count);
+    for (i = 0; i < count; i++) {
+        uptr = units[i];
         if (uptr == &sim_step_unit)
             fprintf (st, "  Step timer");
         else
@@ -7032,6 +7310,7 @@ else {
                                             (*tim) ? " (" : "", tim, (*tim) ? ")" : "",
                                             (uptr->flags & UNIT_IDLE) ? " (Idle capable)" : "");
         }
+    free (units);
     }
 sim_show_clock_queues (st, dnotused, unotused, flag, cptr);
 #if defined (SIM_ASYNCH_IO)
@@ -7838,6 +8117,32 @@ if (dptr->reset != NULL)
 else return SCPE_OK;
 }
 
+/* Match a wall clock time unit name, returning its microsecond factor */
+
+static t_bool _sim_time_units (const char *gbuf, double *usec_factor, const char **units)
+{
+int i;
+static struct {
+    const char *name;
+    double usec_factor;
+    } time_units[] = {
+        {"MICROSECONDS",             1.0},
+        {"USECONDS",                 1.0},
+        {"SECONDS",            1000000.0},
+        {"MINUTES",         60*1000000.0},
+        {"HOURS",        60*60*1000000.0},
+        {NULL,                       0.0}};
+
+for (i=0; time_units[i].name; i++) {
+    if (MATCH_CMD (gbuf, time_units[i].name) == 0) {
+        *usec_factor = time_units[i].usec_factor;
+        *units = time_units[i].name;
+        return TRUE;
+        }
+    }
+return FALSE;
+}
+
 t_stat runlimit_cmd (int32 flag, CONST char *cptr)
 {
 char gbuf[CBUFSIZE];
@@ -7871,28 +8176,9 @@ if ((gbuf[0] == '\0') ||
     units = sim_vm_interval_units;
     }
 else {
-    int i;
-    struct {
-        const char *name;
-        double usec_factor;
-        } time_units[] = {
-            {"MICROSECONDS",             1.0},
-            {"USECONDS",                 1.0},
-            {"SECONDS",            1000000.0},
-            {"MINUTES",         60*1000000.0},
-            {"HOURS",        60*60*1000000.0},
-            {NULL,                       0.0}};
-
-    for (i=0; time_units[i].name; i++) {
-        if (MATCH_CMD (gbuf, time_units[i].name) == 0) {
-            sim_switches |= SWMASK ('T');
-            usec_factor = time_units[i].usec_factor;
-            units = time_units[i].name;
-            break;
-            }
-        }
-    if (time_units[i].name == NULL)
+    if (!_sim_time_units (gbuf, &usec_factor, &units))
         return sim_messagef (SCPE_2MARG, "Too many arguments: %s %s\n", gbuf, cptr);
+    sim_switches |= SWMASK ('T');
     }
 if (*cptr)
     return sim_messagef (SCPE_2MARG, "Too many arguments: %s\n", cptr);
@@ -7953,6 +8239,157 @@ else
 return SCPE_OK;
 }
 
+/* Benchmark command
+
+   Runs the simulator from the current state for a fixed number of
+   instructions (or a fixed wall clock time) with throttling and idling
+   suspended and reports the execution rate achieved, the event processing
+   load and (where available) host cycles per simulated instruction.
+*/
+
+static t_uint64 _sim_host_cycles (void)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+return __rdtsc ();
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+return __builtin_ia32_rdtsc ();
+#else
+return 0;                                               /* not available */
+#endif
+}
+
+static const char *_sim_stop_text (t_stat r)
+{
+r = SCPE_BARE_STATUS (r);
+if ((r != SCPE_OK) && (r < SCPE_BASE)) {                /* VM stop code? */
+    if (sim_stop_messages[r])
+        return sim_stop_messages[r];
+    return "Simulator specific stop";
+    }
+return sim_error_text (r);
+}
+
+t_stat benchmark_cmd (int32 flag, CONST char *cptr)
+{
+char gbuf[CBUFSIZE], fname[CBUFSIZE] = "";
+char report[4*CBUFSIZE];
+int32 num, bench_switches;
+double usec_factor = 0.0;
+const char *units = sim_vm_interval_units;
+const char *stop_reason;
+t_stat r, stat;
+t_bool completed;
+double start_gtime, start_wall, instructions, elapsed;
+double events, event_secs, inst_per_sec, events_per_sec, cycles_per_inst;
+t_uint64 start_cycles, cycles;
+FILE *rfile = NULL;
+
+GET_SWITCHES (cptr);                                    /* get switches */
+bench_switches = sim_switches;
+if ((bench_switches & SWMASK ('C')) && (bench_switches & SWMASK ('J')))
+    return sim_messagef (SCPE_ARG, "Only one of -C or -J may be specified\n");
+cptr = get_glyph (cptr, gbuf, 0);                       /* get count */
+num = (int32) get_uint (gbuf, 10, INT_MAX, &r);
+if ((r != SCPE_OK) || (num == 0))                       /* error? */
+    return sim_messagef (SCPE_ARG, "Invalid benchmark count: %s\n", gbuf);
+cptr = get_glyph_nc (cptr, gbuf, 0);                    /* get units or file */
+if (gbuf[0] != '\0') {
+    if (MATCH_CMD (gbuf, sim_vm_interval_units) == 0)
+        cptr = get_glyph_nc (cptr, gbuf, 0);
+    else {
+        if (_sim_time_units (gbuf, &usec_factor, &units))
+            cptr = get_glyph_nc (cptr, gbuf, 0);
+        }
+    strlcpy (fname, gbuf, sizeof (fname));
+    }
+if (*cptr)
+    return sim_messagef (SCPE_2MARG, "Too many arguments: %s\n", cptr);
+if (fname[0] != '\0') {
+    rfile = sim_fopen (fname, "a");
+    if (rfile == NULL)
+        return sim_messagef (SCPE_OPENERR, "Can't open benchmark report file %s: %s\n", fname, strerror (errno));
+    }
+sim_cancel (&sim_benchmark_unit);
+if (usec_factor != 0.0)
+    r = sim_activate_after_d (&sim_benchmark_unit, num * usec_factor);
+else
+    r = sim_activate (&sim_benchmark_unit, num);
+if (r != SCPE_OK) {
+    if (rfile)
+        fclose (rfile);
+    return r;
+    }
+sim_timer_set_benchmark (TRUE);                         /* no throttling or idling */
+sim_bench_events = 0;
+sim_bench_event_secs = 0.0;
+sim_bench_active = TRUE;
+start_gtime = sim_gtime ();
+start_cycles = _sim_host_cycles ();
+start_wall = sim_timenow_double ();
+sim_switches = 0;
+stat = run_cmd (RU_CONT, "");
+elapsed = sim_timenow_double () - start_wall;
+cycles = _sim_host_cycles () - start_cycles;
+instructions = sim_gtime () - start_gtime;
+sim_bench_active = FALSE;
+sim_timer_set_benchmark (FALSE);
+completed = ((SCPE_BARE_STATUS (stat) == SCPE_STEP) && !sim_is_active (&sim_benchmark_unit));
+sim_cancel (&sim_benchmark_unit);
+if (!completed && (SCPE_BARE_STATUS (stat) != SCPE_OK))
+    run_cmd_message (NULL, stat);                       /* report why execution stopped */
+stop_reason = completed ? "Completed" : _sim_stop_text (stat);
+events = (double)sim_bench_events;
+event_secs = sim_bench_event_secs;
+inst_per_sec = (elapsed > 0.0) ? instructions / elapsed : 0.0;
+events_per_sec = (elapsed > 0.0) ? events / elapsed : 0.0;
+cycles_per_inst = ((cycles != 0) && (instructions > 0.0)) ? (double)cycles / instructions : 0.0;
+if ((rfile != NULL) && !(bench_switches & SWMASK ('J')))
+    bench_switches |= SWMASK ('C');                     /* files default to CSV */
+if (bench_switches & SWMASK ('C')) {
+    if (rfile && (sim_ftell (rfile) == 0))
+        fprintf (rfile, "simulator,%s,seconds,%s_per_sec,calibrated_%s_per_sec,events,events_per_sec,event_seconds,host_cycles_per_%s,stop_reason\n",
+                 sim_vm_interval_units, sim_vm_interval_units, sim_vm_interval_units, sim_vm_step_unit);
+    snprintf (report, sizeof (report), "\"%s\",%.0f,%.6f,%.0f,%.0f,%.0f,%.0f,%.6f,%.2f,\"%s\"\n",
+              sim_name, instructions, elapsed, inst_per_sec, sim_timer_inst_per_sec (),
+              events, events_per_sec, event_secs, cycles_per_inst, stop_reason);
+    }
+else if (bench_switches & SWMASK ('J'))
+    snprintf (report, sizeof (report), "{\"simulator\": \"%s\", \"%s\": %.0f, \"seconds\": %.6f, "
+              "\"%s_per_sec\": %.0f, \"calibrated_%s_per_sec\": %.0f, \"events\": %.0f, "
+              "\"events_per_sec\": %.0f, \"event_seconds\": %.6f, \"host_cycles_per_%s\": %.2f, "
+              "\"stop_reason\": \"%s\"}\n",
+              sim_name, sim_vm_interval_units, instructions, elapsed,
+              sim_vm_interval_units, inst_per_sec, sim_vm_interval_units, sim_timer_inst_per_sec (),
+              events, events_per_sec, event_secs, sim_vm_step_unit, cycles_per_inst, stop_reason);
+else
+    report[0] = '\0';
+if (rfile) {
+    fputs (report, rfile);
+    fclose (rfile);
+    }
+if ((rfile == NULL) && report[0])
+    sim_printf ("%s", report);
+else {
+    sim_printf ("%s benchmark: %s\n", sim_name, stop_reason);
+    sim_printf ("  %-32s%s\n", sim_vm_interval_units, sim_fmt_numeric (instructions));
+    sim_printf ("  %-32s%.3f\n", "seconds", elapsed);
+    snprintf (gbuf, sizeof (gbuf), "%s/sec", sim_vm_interval_units);
+    sim_printf ("  %-32s%s\n", gbuf, sim_fmt_numeric (inst_per_sec));
+    snprintf (gbuf, sizeof (gbuf), "calibrated %s/sec", sim_vm_interval_units);
+    sim_printf ("  %-32s%s\n", gbuf, sim_fmt_numeric (sim_timer_inst_per_sec ()));
+    sim_printf ("  %-32s%s\n", "events", sim_fmt_numeric (events));
+    sim_printf ("  %-32s%s\n", "events/sec", sim_fmt_numeric (events_per_sec));
+    sim_printf ("  %-32s%.3f (%.1f%%)\n", "event processing seconds", event_secs, (elapsed > 0.0) ? (100.0 * event_secs) / elapsed : 0.0);
+    if (cycles_per_inst != 0.0) {
+        snprintf (gbuf, sizeof (gbuf), "host cycles/%s", sim_vm_step_unit);
+        sim_printf ("  %-32s%.2f\n", gbuf, cycles_per_inst);
+        }
+    }
+if (completed || (SCPE_BARE_STATUS (stat) == SCPE_OK))
+    return SCPE_OK;
+return stat | SCPE_NOMESSAGE;
+}
+
 /* Reset devices start..end
 
    Inputs:
@@ -8550,6 +8987,335 @@ return uptr->uname = strcpy ((char *)malloc (1 + strlen (uname)), uname);
 }
 
 
+/* Incremental snapshots
+
+   SAVE -I writes an incremental snapshot: a save file which names the
+   previous snapshot in the chain as its base and contains only the memory
+   blocks (SRBSIZ values) which changed since that snapshot.  All other
+   state (devices, units and registers) is small and is saved completely.
+   The first SAVE -I, or any SAVE -I after a plain SAVE or a RESTORE, writes
+   a complete V4.0 save file which becomes the base of a new chain.
+
+   Changed blocks are found by comparing each block with a copy of the
+   memory unit made when the previous snapshot was taken, so every path
+   which can write simulated memory (CPU, DMA, device specific) is covered
+   without the simulator having to maintain a dirty map.  The copy costs as
+   much host memory as the unit itself.  Only memory units which the
+   simulator exposes via sim_vm_memory_buffer are saved incrementally.
+
+   Changed blocks are copied as the snapshot is taken and are written at
+   the end of the file (after the device state) by a background thread when
+   threads are available, so the simulator can continue running while the
+   snapshot is flushed.  The next SAVE or RESTORE waits for the previous
+   snapshot to be complete.
+
+   RESTORE of an incremental snapshot restores its base first (recursively)
+   and then applies the snapshot.
+*/
+
+typedef struct {
+    UNIT        *uptr;                                  /* memory unit */
+    size_t      size;                                   /* bytes of memory */
+    uint8       *copy;                                  /* memory at last snapshot */
+    } SNAPSHADOW;
+
+static SNAPSHADOW *sim_snap_shadows = NULL;             /* per memory unit copies */
+static uint32 sim_snap_shadow_count = 0;
+static char **sim_snap_chain = NULL;                    /* snapshot full file names, base first */
+static uint32 sim_snap_chain_len = 0;
+static double sim_snap_base_time = 0.0;                 /* sim time saved in the last snapshot */
+static char sim_snap_base_ref[PATH_MAX + 1];            /* base name as recorded in the next snapshot */
+static char sim_snap_base_check[64];                    /* base file size and sim time */
+
+typedef struct {
+    size_t      off;                                    /* offset in data buffer */
+    size_t      size;                                   /* item size */
+    size_t      count;                                  /* item count */
+    } SNAPOP;
+
+static struct {
+    FILE        *sfile;                                 /* snapshot file */
+    char        *name;                                  /* snapshot file name */
+    SNAPOP      *ops;                                   /* pending writes */
+    size_t      nops, maxops;
+    uint8       *data;                                  /* copied snapshot data */
+    size_t      datalen, datamax;
+    t_stat      stat;                                   /* write status */
+    t_bool      failed;                                 /* allocation failure */
+#if defined (SIM_ASYNCH_IO)
+    pthread_t   thread;
+    t_bool      thread_active;
+#endif
+    } sim_snap_wr;
+
+static void _sim_snap_forget (void)
+{
+uint32 i;
+
+for (i = 0; i < sim_snap_shadow_count; i++)
+    free (sim_snap_shadows[i].copy);
+free (sim_snap_shadows);
+sim_snap_shadows = NULL;
+sim_snap_shadow_count = 0;
+for (i = 0; i < sim_snap_chain_len; i++)
+    free (sim_snap_chain[i]);
+free (sim_snap_chain);
+sim_snap_chain = NULL;
+sim_snap_chain_len = 0;
+}
+
+/* Find (or create) the copy of a memory unit.  The copy of a unit whose
+   size changed is discarded so that all of its blocks are saved */
+
+static SNAPSHADOW *_sim_snap_shadow_find (UNIT *uptr, size_t size, t_bool *valid)
+{
+SNAPSHADOW *sh = NULL;
+uint32 i;
+
+*valid = FALSE;
+for (i = 0; i < sim_snap_shadow_count; i++)
+    if (sim_snap_shadows[i].uptr == uptr)
+        sh = &sim_snap_shadows[i];
+if (sh == NULL) {
+    SNAPSHADOW *nh = (SNAPSHADOW *)realloc (sim_snap_shadows, (sim_snap_shadow_count + 1) * sizeof (*nh));
+
+    if (nh == NULL)
+        return NULL;
+    sim_snap_shadows = nh;
+    sh = &sim_snap_shadows[sim_snap_shadow_count++];
+    memset (sh, 0, sizeof (*sh));
+    sh->uptr = uptr;
+    }
+if ((sh->copy != NULL) && (sh->size == size))
+    *valid = TRUE;
+else {
+    free (sh->copy);
+    sh->size = size;
+    sh->copy = (uint8 *)malloc (size + 1);
+    if (sh->copy == NULL)
+        return NULL;
+    }
+return sh;
+}
+
+/* Queue data to be written at the end of the snapshot */
+
+static void _sim_snap_add (const void *ptr, size_t size, size_t count)
+{
+size_t len = size * count;
+
+if (sim_snap_wr.failed)
+    return;
+if (sim_snap_wr.nops == sim_snap_wr.maxops) {
+    size_t nmax = sim_snap_wr.maxops ? 2 * sim_snap_wr.maxops : 256;
+    SNAPOP *nops = (SNAPOP *)realloc (sim_snap_wr.ops, nmax * sizeof (*nops));
+
+    if (nops == NULL) {
+        sim_snap_wr.failed = TRUE;
+        return;
+        }
+    sim_snap_wr.ops = nops;
+    sim_snap_wr.maxops = nmax;
+    }
+if ((sim_snap_wr.datalen + len) > sim_snap_wr.datamax) {
+    size_t nmax = sim_snap_wr.datamax ? sim_snap_wr.datamax : 65536;
+    uint8 *ndata;
+
+    while ((sim_snap_wr.datalen + len) > nmax)
+        nmax = 2 * nmax;
+    ndata = (uint8 *)realloc (sim_snap_wr.data, nmax);
+    if (ndata == NULL) {
+        sim_snap_wr.failed = TRUE;
+        return;
+        }
+    sim_snap_wr.data = ndata;
+    sim_snap_wr.datamax = nmax;
+    }
+memcpy (sim_snap_wr.data + sim_snap_wr.datalen, ptr, len);
+sim_snap_wr.ops[sim_snap_wr.nops].off = sim_snap_wr.datalen;
+sim_snap_wr.ops[sim_snap_wr.nops].size = size;
+sim_snap_wr.ops[sim_snap_wr.nops].count = count;
+++sim_snap_wr.nops;
+sim_snap_wr.datalen += len;
+}
+
+/* Write the queued snapshot data and close the snapshot file */
+
+static void *_sim_snap_writer (void *arg)
+{
+FILE *sfile = sim_snap_wr.sfile;
+size_t i;
+
+for (i = 0; (i < sim_snap_wr.nops) && !ferror (sfile); i++)
+    sim_fwrite (sim_snap_wr.data + sim_snap_wr.ops[i].off, sim_snap_wr.ops[i].size,
+                sim_snap_wr.ops[i].count, sfile);
+if (!ferror (sfile)) {
+    t_offset pos = sim_ftell (sfile);
+
+    if (pos >= 0)
+        sim_set_fsize (sfile, (t_addr)pos);             /* truncate the save file */
+    }
+sim_snap_wr.stat = ferror (sfile) ? SCPE_IOERR : SCPE_OK;
+if (fclose (sfile) == EOF)
+    sim_snap_wr.stat = SCPE_IOERR;
+sim_snap_wr.sfile = NULL;
+return NULL;
+}
+
+/* Wait for the completion of a snapshot being written */
+
+static t_stat _sim_snap_wait (void)
+{
+t_stat r;
+
+#if defined (SIM_ASYNCH_IO)
+if (sim_snap_wr.thread_active) {
+    pthread_join (sim_snap_wr.thread, NULL);
+    sim_snap_wr.thread_active = FALSE;
+    }
+#endif
+r = (sim_snap_wr.name != NULL) ? sim_snap_wr.stat : SCPE_OK;
+if (r != SCPE_OK) {
+    sim_printf ("Error writing snapshot %s\n", sim_snap_wr.name);
+    _sim_snap_forget ();                                /* chain is broken */
+    }
+free (sim_snap_wr.name);
+sim_snap_wr.name = NULL;
+sim_snap_wr.failed = FALSE;
+free (sim_snap_wr.ops);
+free (sim_snap_wr.data);
+sim_snap_wr.ops = NULL;
+sim_snap_wr.data = NULL;
+sim_snap_wr.nops = sim_snap_wr.maxops = sim_snap_wr.datalen = sim_snap_wr.datamax = 0;
+return r;
+}
+
+/* Start writing the queued snapshot data */
+
+static t_stat _sim_snap_start (FILE *sfile, const char *filename)
+{
+sim_snap_wr.sfile = sfile;
+sim_snap_wr.name = (char *)malloc (1 + strlen (filename));
+if (sim_snap_wr.name == NULL) {
+    fclose (sfile);
+    return SCPE_MEM;
+    }
+strcpy (sim_snap_wr.name, filename);
+sim_snap_wr.stat = SCPE_OK;
+#if defined (SIM_ASYNCH_IO)
+if (pthread_create (&sim_snap_wr.thread, NULL, _sim_snap_writer, NULL) == 0) {
+    sim_snap_wr.thread_active = TRUE;
+    return SCPE_OK;
+    }
+#endif
+_sim_snap_writer (NULL);                                /* write synchronously */
+return _sim_snap_wait ();
+}
+
+/* Save a memory unit's changed blocks to the snapshot trailer */
+
+static t_stat _sim_snap_save_mem (DEVICE *dptr, UNIT *uptr, const uint8 *mem, t_addr high, t_bool delta)
+{
+size_t sz = SZ_D (dptr);
+t_addr cnt = (high + dptr->aincr - 1) / dptr->aincr;
+t_addr nblks = (cnt + SRBSIZ - 1) / SRBSIZ;
+t_addr blk, end = (t_addr)-1;
+t_bool valid;
+SNAPSHADOW *sh = _sim_snap_shadow_find (uptr, (size_t)cnt * sz, &valid);
+int32 unitno = (int32)(uptr - dptr->units);
+
+if (sh == NULL)
+    return SCPE_MEM;
+if (delta) {
+    _sim_snap_add (dptr->name, 1, strlen (dptr->name));
+    _sim_snap_add ("\n", 1, 1);
+    _sim_snap_add (&unitno, sizeof (unitno), 1);
+    }
+for (blk = 0; blk < nblks; blk++) {
+    size_t l = (size_t)(((cnt - blk * SRBSIZ) < SRBSIZ) ? (cnt - blk * SRBSIZ) : SRBSIZ);
+    size_t off = (size_t)(blk * SRBSIZ) * sz;
+
+    if (!valid || (memcmp (mem + off, sh->copy + off, l * sz) != 0)) { /* changed block? */
+        if (delta) {
+            _sim_snap_add (&blk, sizeof (blk), 1);
+            _sim_snap_add (mem + off, sz, l);
+            }
+        memcpy (sh->copy + off, mem + off, l * sz);
+        }
+    }
+if (delta)
+    _sim_snap_add (&end, sizeof (end), 1);
+return sim_snap_wr.failed ? SCPE_MEM : SCPE_OK;
+}
+
+/* Apply an incremental snapshot's memory blocks during RESTORE */
+
+static t_stat _sim_snap_rest_mem (FILE *rfile)
+{
+char buf[CBUFSIZE];
+DEVICE *dptr;
+UNIT *uptr;
+int32 unitno;
+t_addr blk, cnt;
+size_t sz, l, j;
+uint8 *mem, *bbuf = NULL;
+t_value val;
+t_stat r = SCPE_OK;
+
+for ( ;; ) {
+    if (read_line (buf, sizeof (buf), rfile) == NULL)
+        return SCPE_IOERR;
+    if (buf[0] == '\0')                                 /* end of snapshot? */
+        break;
+    if (((dptr = find_dev (buf)) == NULL) ||
+        (sim_fread (&unitno, sizeof (unitno), 1, rfile) == 0) ||
+        (unitno < 0) || ((uint32)unitno >= dptr->numunits)) {
+        sim_printf ("Invalid snapshot memory unit: %s\n", buf);
+        return SCPE_INCOMP;
+        }
+    uptr = dptr->units + unitno;
+    sz = SZ_D (dptr);
+    cnt = (uptr->capac + dptr->aincr - 1) / dptr->aincr;
+    mem = sim_vm_memory_buffer ? (uint8 *)sim_vm_memory_buffer (dptr, uptr) : NULL;
+    if ((mem == NULL) && (bbuf = (uint8 *)realloc (bbuf, SRBSIZ * sz)) == NULL)
+        return SCPE_MEM;
+    for ( ;; ) {
+        if (sim_fread (&blk, sizeof (blk), 1, rfile) == 0) {
+            r = SCPE_IOERR;
+            break;
+            }
+        if (blk == (t_addr)-1)                          /* end of unit? */
+            break;
+        if (blk >= (cnt + SRBSIZ - 1) / SRBSIZ) {
+            r = SCPE_IOERR;
+            break;
+            }
+        l = (size_t)(((cnt - blk * SRBSIZ) < SRBSIZ) ? (cnt - blk * SRBSIZ) : SRBSIZ);
+        if (mem != NULL) {
+            if (sim_fread (mem + (size_t)(blk * SRBSIZ) * sz, sz, l, rfile) != l) {
+                r = SCPE_IOERR;
+                break;
+                }
+            continue;
+            }
+        if (sim_fread (bbuf, sz, l, rfile) != l) {
+            r = SCPE_IOERR;
+            break;
+            }
+        for (j = 0; (j < l) && (r == SCPE_OK); j++) {
+            SZ_LOAD (sz, val, bbuf, j);
+            r = dptr->deposit (val, (blk * SRBSIZ + j) * dptr->aincr, uptr, SIM_SW_REST);
+            }
+        if (r != SCPE_OK)
+            break;
+        }
+    if (r != SCPE_OK)
+        break;
+    }
+free (bbuf);
+return r;
+}
+
 /* Save command
 
    sa[ve] filename              save state to specified file
@@ -8560,6 +9326,10 @@ t_stat save_cmd (int32 flag, CONST char *cptr)
 FILE *sfile;
 t_stat r;
 char gbuf[4*CBUFSIZE];
+char *fullname;
+t_bool snapshot, delta;
+char **chain = NULL;
+uint32 i;
 
 GET_SWITCHES (cptr);                                    /* get switches */
 if (*cptr == 0)                                         /* must be more */
@@ -8567,17 +9337,127 @@ if (*cptr == 0)                                         /* must be more */
 gbuf[sizeof(gbuf)-1] = '\0';
 strlcpy (gbuf, cptr, sizeof(gbuf));
 sim_trim_endspc (gbuf);
+_sim_snap_wait ();                                      /* finish prior snapshot */
+snapshot = ((sim_switches & SWMASK ('I')) != 0);
+if (!snapshot)                                          /* complete save ends chain */
+    _sim_snap_forget ();
+delta = (snapshot && (sim_snap_chain_len > 0));
+fullname = sim_filepath_parts (gbuf, "f");
+if (fullname == NULL)
+    return SCPE_MEM;
+for (i = 0; delta && (i < sim_snap_chain_len); i++) {
+    if (strcmp (fullname, sim_snap_chain[i]) == 0) {
+        free (fullname);
+        return sim_messagef (SCPE_ARG, "Snapshot %s is part of the current snapshot chain\n", gbuf);
+        }
+    }
+if (delta) {                                            /* identify the base snapshot */
+    const char *base = sim_snap_chain[sim_snap_chain_len - 1];
+    char *dir = sim_filepath_parts (gbuf, "p");
+    struct stat bstat;
+
+    /* A base in the same directory is recorded relative to it, so the
+       chain can be restored from any working directory or moved as a whole */
+    if ((dir != NULL) && (strncmp (base, dir, strlen (dir)) == 0))
+        base += strlen (dir);
+    free (dir);
+    if (stat (sim_snap_chain[sim_snap_chain_len - 1], &bstat) != 0) {
+        free (fullname);
+        _sim_snap_forget ();
+        return sim_messagef (SCPE_OPENERR, "Can't find base snapshot %s: %s\n", base, strerror (errno));
+        }
+    strlcpy (sim_snap_base_ref, base, sizeof (sim_snap_base_ref));
+    snprintf (sim_snap_base_check, sizeof (sim_snap_base_check), "%" LL_FMT "d %.0f",
+              (LL_TYPE)bstat.st_size, sim_snap_base_time);
+    }
 if ((sfile = sim_fopen (gbuf, "r+b")) == NULL) {    /* try existing file */
-    if ((sfile = sim_fopen (gbuf, "wb")) == NULL)   /* create new empty file */
+    if ((sfile = sim_fopen (gbuf, "wb")) == NULL) { /* create new empty file */
+        free (fullname);
         return SCPE_OPENERR;
+        }
     }
-r = sim_save (sfile);
-fclose (sfile);
-return r;
+r = _sim_save (sfile, snapshot, delta);
+if ((r != SCPE_OK) || !delta)
+    fclose (sfile);
+else
+    r = _sim_snap_start (sfile, gbuf);                  /* write changed memory */
+if (!snapshot) {
+    free (fullname);
+    return r;
+    }
+if (r == SCPE_OK)
+    chain = (char **)realloc (sim_snap_chain, (sim_snap_chain_len + 1) * sizeof (*chain));
+if ((r != SCPE_OK) || (chain == NULL)) {
+    free (fullname);
+    _sim_snap_forget ();
+    return (r != SCPE_OK) ? r : SCPE_MEM;
+    }
+sim_snap_chain = chain;
+sim_snap_chain[sim_snap_chain_len++] = fullname;
+sim_snap_base_time = sim_time;
+if (!delta)
+    sim_messagef (SCPE_OK, "Snapshot chain started with complete save %s\n", gbuf);
+return SCPE_OK;
+}
+
+/* Write a buffered unit's changed blocks back to its file.  filebuf2
+   holds the file's contents, and is updated as blocks are written */
+
+static void _sim_save_filebuf (DEVICE *dptr, UNIT *uptr)
+{
+size_t sz = SZ_D (dptr);
+uint32 cap = (uptr->hwmark + dptr->aincr - 1) / dptr->aincr;
+uint32 k, l;
+
+if (uptr->filebuf2 == NULL) {                           /* no copy of file? */
+    rewind (uptr->fileref);
+    sim_fwrite (uptr->filebuf, sz, cap, uptr->fileref);
+    return;
+    }
+for (k = 0; k < cap; k = k + l) {
+    size_t off = (size_t)k * sz;
+
+    l = ((cap - k) < SRBSIZ) ? (cap - k) : SRBSIZ;
+    if (((k + l) < cap) &&                              /* last block always written */
+        (memcmp ((uint8 *)uptr->filebuf + off, (uint8 *)uptr->filebuf2 + off, l * sz) == 0))
+        continue;                                       /* unchanged */
+    sim_fseek (uptr->fileref, (t_offset)off, SEEK_SET);
+    sim_fwrite ((uint8 *)uptr->filebuf + off, sz, l, uptr->fileref);
+    memcpy ((uint8 *)uptr->filebuf2 + off, (uint8 *)uptr->filebuf + off, l * sz);
+    }
+}
+
+/* Memory contents are normally saved and restored one value at a time with
+   the device's examine and deposit routines.  A simulator can instead provide
+   sim_vm_memory_buffer, which returns a pointer to the host memory holding a
+   memory-like unit's contents, laid out as one SZ_D (dptr) sized value for
+   each address from 0 to the unit's capacity in steps of aincr (exactly the
+   values that examine would return), or NULL if that unit's memory can't be
+   accessed that way.  SAVE and RESTORE then move the memory in blocks while
+   producing and consuming the same V4.0 save file format.
+
+   Test a memory block for all zeros */
+
+static t_bool _sim_mem_is_zero (const uint8 *blk, size_t len)
+{
+static const uint8 zeros[SRBSIZ * sizeof (t_uint64)];
+size_t chunk;
+
+for ( ; len > 0; blk = blk + chunk, len = len - chunk) {
+    chunk = (len < sizeof (zeros)) ? len : sizeof (zeros);
+    if (memcmp (blk, zeros, chunk) != 0)
+        return FALSE;
+    }
+return TRUE;
 }
 
 t_stat sim_save (FILE *sfile)
 {
+return _sim_save (sfile, FALSE, FALSE);
+}
+
+static t_stat _sim_save (FILE *sfile, t_bool snapshot, t_bool delta)
+{
 void *mbuf;
 int32 l, t;
 uint32 i, j, device_count;
@@ -8596,8 +9476,13 @@ sim_debug(SIM_DBG_SAVE, &sim_scp_dev, "sim_save ()\n");
 
 /* Don't make changes below without also changing save_vercur above */
 
-fprintf (sfile, "%s\n%s\n%s\n%s\n%s\n%.0f\n",
-    save_vercur,                                        /* [V2.5] save format */
+if (delta)                                              /* [V4.0I] incremental? */
+    fprintf (sfile, "%s\n%s\n%s\n", save_ver40i,
+                    sim_snap_base_ref,                  /* base snapshot */
+                    sim_snap_base_check);               /* base size and sim time */
+else
+    fprintf (sfile, "%s\n", save_vercur);                /* [V2.5] save format */
+fprintf (sfile, "%s\n%s\n%s\n%s\n%.0f\n",
     sim_savename,                                       /* sim name */
     sim_si64, sim_sa64, eth_capabilities(),             /* [V3.5] options */
     sim_time);                                          /* [V3.2] sim time */
@@ -8646,13 +9531,13 @@ for (i = 0; i < (device_count + sim_internal_device_count); i++) {/* loop thru d
         fprintf (sfile, "%.0f\n", uptr->usecs_remaining);/* [V4.0] remaining wait */
         WRITE_I (uptr->pos);
         if (uptr->flags & UNIT_ATT) {
+            if (DEV_TYPE (dptr) == DEV_DISK)
+                sim_disk_snapshot_wait (uptr);          /* container changes at commit end */
             fputs (uptr->filename, sfile);
             if ((uptr->flags & UNIT_BUF) &&             /* writable buffered */
                 uptr->hwmark &&                         /* files need to be */
                 ((uptr->flags & UNIT_RO) == 0)) {       /* written on save */
-                uint32 cap = (uptr->hwmark + dptr->aincr - 1) / dptr->aincr;
-                rewind (uptr->fileref);
-                sim_fwrite (uptr->filebuf, SZ_D (dptr), cap, uptr->fileref);
+                _sim_save_filebuf (dptr, uptr);         /* write changed blocks */
                 fclose (uptr->fileref);                 /* flush data and state */
                 uptr->fileref = sim_fopen (uptr->filename, "rb+");/* reopen r/w */
                 }
@@ -8663,10 +9548,42 @@ for (i = 0; i < (device_count + sim_internal_device_count); i++) {/* loop thru d
              ((high = uptr->capac) != 0)) {             /* memory-like unit? */
             WRITE_I (high);                             /* [V2.5] write size */
             sz = SZ_D (dptr);
-            if ((mbuf = calloc (SRBSIZ, sz)) == NULL) {
-                fclose (sfile);
-                return SCPE_MEM;
+            if (sim_vm_memory_buffer &&                 /* memory directly accessible? */
+                ((mbuf = sim_vm_memory_buffer (dptr, uptr)) != NULL)) {
+                t_addr cnt = (high + dptr->aincr - 1) / dptr->aincr;
+
+                if (snapshot) {                         /* track changed blocks */
+                    r = _sim_snap_save_mem (dptr, uptr, (uint8 *)mbuf, high, delta);
+                    if (r != SCPE_OK)
+                        return r;
+                    }
+                if (delta) {                            /* [V4.0I] blocks in trailer */
+                    t = 1;
+                    WRITE_I (t);
+                    continue;                           /* next unit */
+                    }
+                for (k = 0; k < cnt; k = k + l) {       /* loop thru mem */
+                    uint8 *blk = ((uint8 *)mbuf) + k * sz;
+
+                    l = (int32)(((cnt - k) < SRBSIZ) ? (cnt - k) : SRBSIZ);
+                    if (_sim_mem_is_zero (blk, l * sz)) { /* all zero's? */
+                        l = -l;                         /* invert block count */
+                        WRITE_I (l);                    /* write only count */
+                        l = -l;
+                        }
+                    else {
+                        WRITE_I (l);                    /* block count */
+                        sim_fwrite (blk, sz, l, sfile);
+                        }
+                    }
+                continue;                               /* next unit */
                 }
+            if (delta) {                                /* [V4.0I] blocks follow */
+                t = 0;
+                WRITE_I (t);
+                }
+            if ((mbuf = calloc (SRBSIZ, sz)) == NULL)
+                return SCPE_MEM;
             for (k = 0; k < high; ) {                   /* loop thru mem */
                 zeroflg = TRUE;
                 for (l = 0; (l < SRBSIZ) && (k < high); l++,
@@ -8710,6 +9627,12 @@ for (i = 0; i < (device_count + sim_internal_device_count); i++) {/* loop thru d
     fputc ('\n', sfile);                                /* end registers */
     }
 fputc ('\n', sfile);                                    /* end devices */
+if (delta) {                                            /* changed blocks written later */
+    _sim_snap_add ("\n", 1, 1);                         /* end of snapshot trailer */
+    if (sim_snap_wr.failed)
+        return SCPE_MEM;
+    return (ferror (sfile))? SCPE_IOERR: SCPE_OK;
+    }
 if (!ferror (sfile)) {
     t_offset pos = sim_ftell (sfile);                   /* get current position */
 
@@ -8737,28 +9660,39 @@ if (*cptr == 0)                                         /* must be more */
 gbuf[sizeof(gbuf)-1] = '\0';
 strlcpy (gbuf, cptr, sizeof(gbuf));
 sim_trim_endspc (gbuf);
+_sim_snap_wait ();                                      /* finish prior snapshot */
+_sim_snap_forget ();                                    /* and start a new chain */
 if ((rfile = sim_fopen (gbuf, "rb")) == NULL)
     return SCPE_OPENERR;
-r = sim_rest (rfile);
+r = _sim_rest (rfile, gbuf);
 fclose (rfile);
 return r;
 }
 
 t_stat sim_rest (FILE *rfile)
 {
+return _sim_rest (rfile, NULL);
+}
+
+/* Restore from a save file.  filename, when known, locates the base of
+   an incremental snapshot recorded relative to the snapshot's directory */
+
+static t_stat _sim_rest (FILE *rfile, const char *filename)
+{
 char buf[CBUFSIZE];
 char **attnames = NULL;
 UNIT **attunits = NULL;
 int32 *attswitches = NULL;
 int32 attcnt = 0;
 void *mbuf = NULL;
+uint8 *mem;
 int32 j, blkcnt, limit, unitno, time, flg;
 uint32 us, depth;
 t_addr k, high, old_capac;
 t_value val, max;
 t_stat r;
 size_t sz;
-t_bool v40, v35, v32;
+t_bool v40i, v40, v35, v32;
 DEVICE *dptr;
 UNIT *uptr;
 REG *rptr;
@@ -8785,8 +9719,10 @@ if (fstat (fileno (rfile), &rstat)) {
     }
 READ_S (buf);                                           /* [V2.5+] read version */
 sim_debug (SIM_DBG_RESTORE, &sim_scp_dev, "version=%s\n", buf);
-v40 = v35 = v32 = FALSE;
-if (strcmp (buf, save_ver40) == 0)                      /* version 4.0? */
+v40i = v40 = v35 = v32 = FALSE;
+if (strcmp (buf, save_ver40i) == 0)                     /* incremental 4.0? */
+    v40i = v40 = v35 = v32 = TRUE;
+else if (strcmp (buf, save_ver40) == 0)                 /* version 4.0? */
     v40 = v35 = v32 = TRUE;
 else if (strcmp (buf, save_ver35) == 0)                 /* version 3.5? */
     v35 = v32 = TRUE;
@@ -8796,10 +9732,55 @@ else if (strcmp (buf, save_ver30) != 0) {               /* version 3.0? */
     sim_printf ("Invalid file version: %s\n", buf);
     return SCPE_INCOMP;
     }
-if ((strcmp (buf, save_ver40) != 0) && (!sim_quiet) && (!suppress_warning)) {
+if ((!v40) && (!sim_quiet) && (!suppress_warning)) {
     sim_printf ("warning - attempting to restore a saved simulator image in %s image format.\n", buf);
     warned = TRUE;
     }
+if (v40i) {                                             /* [V4.0I] base snapshot */
+    FILE *bfile;
+    char bname[PATH_MAX + CBUFSIZE];
+    char check[CBUFSIZE];
+    LL_TYPE bsize = -1;
+    double btime = -1.0;
+    struct stat bstat;
+
+    READ_S (buf);
+    READ_S (check);
+    if ((filename != NULL) &&                           /* relative to this snapshot? */
+        (buf[0] != '/') && (buf[0] != '\\') && (buf[1] != ':')) {
+        char *dir = sim_filepath_parts (filename, "p");
+
+        snprintf (bname, sizeof (bname), "%s%s", dir ? dir : "", buf);
+        free (dir);
+        }
+    else
+        strlcpy (bname, buf, sizeof (bname));
+    sim_debug (SIM_DBG_RESTORE, &sim_scp_dev, "base snapshot=%s\n", bname);
+    if ((bfile = sim_fopen (bname, "rb")) == NULL) {
+        sim_printf ("Can't open base snapshot %s: %s\n", bname, strerror (errno));
+        r = SCPE_OPENERR;
+        goto Cleanup_Return;
+        }
+    sscanf (check, "%" LL_FMT "d %lf", &bsize, &btime);
+    if ((fstat (fileno (bfile), &bstat) != 0) || ((LL_TYPE)bstat.st_size != bsize)) {
+        fclose (bfile);
+        sim_printf ("Base snapshot %s has changed since this snapshot was saved\n", bname);
+        r = SCPE_INCOMP;
+        goto Cleanup_Return;
+        }
+    sim_switches = SWMASK ('D') | SWMASK ('Q') |        /* attach state comes from this file */
+                   (force_restore ? SWMASK ('F') : 0);
+    r = _sim_rest (bfile, bname);
+    fclose (bfile);
+    if ((r == SCPE_OK) && (sim_time != btime)) {
+        sim_printf ("Base snapshot %s has changed since this snapshot was saved\n", bname);
+        r = SCPE_INCOMP;
+        }
+    if (r != SCPE_OK) {
+        sim_printf ("Error restoring base snapshot %s\n", bname);
+        goto Cleanup_Return;
+        }
+    }
 READ_S (buf);                                           /* read sim name */
 sim_debug (SIM_DBG_RESTORE, &sim_scp_dev, "sim_name=%s\n", buf);
 if (strcmp (buf, sim_savename)) {                       /* name match? */
@@ -8974,9 +9955,41 @@ for ( ;; ) {                                            /* device loop */
                     fprint_capac (sim_log, dptr, uptr);
                 sim_printf ("\n");
                 }
-            sz = SZ_D (dptr);                           /* allocate buffer */
-            if ((mbuf = realloc (mbuf, SRBSIZ * sz)) == NULL) {
-                r = SCPE_MEM;
+            if (v40i) {                                 /* [V4.0I] blocks in trailer? */
+                READ_I (flg);
+                if (flg)
+                    continue;                           /* next unit */
+                }
+            sz = SZ_D (dptr);
+            if (sim_vm_memory_buffer &&                 /* memory directly accessible? */
+                ((mem = (uint8 *)sim_vm_memory_buffer (dptr, uptr)) != NULL)) {
+                t_addr cnt = (high + dptr->aincr - 1) / dptr->aincr;
+
+                for (k = 0; k < cnt; k = k + limit) {   /* loop thru mem */
+                    if (sim_fread (&blkcnt, sizeof (blkcnt), 1, rfile) == 0) {/* block count */
+                        r = SCPE_IOERR;
+                        goto Cleanup_Return;
+                        }
+                    limit = (blkcnt < 0) ? -blkcnt : blkcnt;
+                    if ((limit == 0) || ((t_addr)limit > (cnt - k))) {/* invalid? */
+                        r = SCPE_IOERR;
+                        goto Cleanup_Return;
+                        }
+                    if (blkcnt < 0) {                   /* compressed? */
+                        if (!_sim_mem_is_zero (mem + k * sz, limit * sz))
+                            memset (mem + k * sz, 0, limit * sz);/* avoid touching zero pages */
+                        }
+                    else {
+                        if (sim_fread (mem + k * sz, sz, limit, rfile) != (size_t)limit) {
+                            r = SCPE_IOERR;
+                            goto Cleanup_Return;
+                            }
+                        }
+                    }                                   /* end for k */
+                continue;                               /* next unit */
+                }
+            if ((mbuf = realloc (mbuf, SRBSIZ * sz)) == NULL) {     /* allocate buffer */
+                r = SCPE_MEM;
                 goto Cleanup_Return;
                 }
             for (k = 0; k < high; ) {                   /* loop thru mem */
@@ -9040,6 +10053,11 @@ for ( ;; ) {                                            /* device loop */
             }
         }                                               /* end register loop */
     }                                                   /* end device loop */
+if (v40i) {                                             /* [V4.0I] changed memory */
+    r = _sim_snap_rest_mem (rfile);
+    if (r != SCPE_OK)
+        goto Cleanup_Return;
+    }
 /* Now that all of the register state has been imported, we can attach
    units which were originally attached.  Some of these attach operations
    may depend on the state of the device (in registers) to work correctly */
@@ -9534,6 +10552,14 @@ t_stat runlimit_svc (UNIT *uptr)
 return SCPE_RUNTIME;
 }
 
+/* Unit service for the end of a BENCHMARK command run
+   Return step timeout SCP code, will cause simulation to stop */
+
+t_stat benchmark_svc (UNIT *uptr)
+{
+return SCPE_STEP;
+}
+
 /* Unit service to facilitate expect matching to stop simulation.
    Return expect SCP code, will cause simulation to stop */
 
@@ -11878,264 +12904,1861 @@ for (c=0, p=buf; c < len; c++) {
 return buf;
 }
 
-/* Event queue package
-
-        sim_activate            add entry to event queue
-        sim_activate_abs        add entry to event queue even if event already scheduled
-        sim_activate_notbefore  add entry to event queue even if event already scheduled
-                                but not before the specified time
-        sim_activate_after      add entry to event queue after a specified amount of wall time
-        sim_cancel              remove entry from event queue
-        sim_process_event       process entries on event queue
-        sim_is_active           see if entry is on event queue
-        sim_activate_time       return time until activation
-        sim_atime               return absolute time for an entry
-        sim_gtime               return global time
-        sim_qcount              return event queue entry count
+/* Heap event queue engine
 
-   Asynchronous events are set up by queueing a unit data structure
-   to the event queue with a timeout (in simulator units, relative
-   to the current time).  Each simulator 'times' these events by
-   counting down interval counter sim_interval.  When this reaches
-   zero the simulator calls sim_process_event to process the event
-   and to see if further events need to be processed, or sim_interval
-   reset to count the next one.
+   When SET QUEUE HEAP is in effect, the pending events are kept in a
+   binary min-heap (sim_clock_heap) ordered by absolute event time, with
+   ties broken by activation order so that events are dispatched in exactly
+   the same order as the sorted list would dispatch them.  Activation and
+   cancellation then cost O(log n) rather than O(n).
 
-   The event queue is maintained in clock order; entry timeouts are
-   RELATIVE to the time in the previous entry.
+   The externally visible invariants of the list engine are preserved:
 
-   sim_process_event - process event
+        sim_clock_queue         points at the earliest pending event
+        sim_clock_queue->time   is the time of the earliest event relative
+                                to the current time (as used by
+                                UPDATE_SIM_TIME)
+        uptr->next              is non NULL for every queued unit; the
+                                units are chained in heap array order
+                                (NOT clock order) so that code which just
+                                walks the queue still visits every entry
 
-   Inputs:
-        none
-   Outputs:
-        reason  =       reason code returned by any event processor,
-                        or 0 (SCPE_OK) if no exceptions
+   The current time implied by the queue is always
+   sim_clock_queue->event_time - sim_clock_queue->time.
 */
 
-t_stat sim_process_event (void)
+static t_bool _sim_heap_before (UNIT *a, UNIT *b)
 {
-UNIT *uptr;
-t_stat reason, bare_reason;
-int32 sim_interval_catchup;
-
-if (stop_cpu) {                                         /* stop CPU? */
-    stop_cpu = 0;
-    return SCPE_STOP;
-    }
-AIO_UPDATE_QUEUE;
-UPDATE_SIM_TIME;                                        /* update sim time */
-if (sim_interval > 0) {
-    sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Interval not yet expired: %d\n", sim_interval);
-    return SCPE_OK;
-    }
-if (sim_clock_queue == QUEUE_LIST_END) {                /* queue empty? */
-    sim_interval = noqueue_time = NOQUEUE_WAIT;         /* flag queue empty */
-    sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Queue Empty New Interval = %d\n", sim_interval);
-    return SCPE_OK;
-    }
-sim_processing_event = TRUE;
-/* If sim_interval is negative, we've missed the opportunity to  */
-/* dispatch one or more events when they were scheduled to fire. */
-/* To accomodate this, we backup time to when the first event    */
-/* was supposed to fire and advance it from there until things   */
-/* have caught up.                                               */
-if (sim_interval < 0) {
-    sim_interval_catchup = sim_interval;
-    sim_interval = 0;
-    UPDATE_SIM_TIME;                          /* update sim time */
-    sim_debug (SIM_DBG_EVENT_NEG, &sim_scp_dev, "Processing event for %s with sim_interval = %d, event time = %.0f\n",
-        sim_uname (sim_clock_queue), sim_interval_catchup, sim_gtime ());
-    if (sim_clock_queue->next != QUEUE_LIST_END)
-        sim_debug (SIM_DBG_EVENT_NEG, &sim_scp_dev, "- Next event for %s after = %d\n",
-            sim_uname (sim_clock_queue->next), sim_clock_queue->next->time);
-    sim_time -= sim_clock_queue->time;
-    sim_rtime -= sim_clock_queue->time;
-    }
-else
-    sim_interval_catchup = 0;
-do {
-    uptr = sim_clock_queue;                             /* get first */
-    sim_clock_queue = uptr->next;                       /* remove first */
-    uptr->next = NULL;                                  /* hygiene */
-    uptr->time = 0;
-    if (sim_clock_queue != QUEUE_LIST_END) {
-        if (sim_interval_catchup < 0)
-            sim_interval = -sim_interval_catchup;
-        sim_interval += sim_interval_catchup + sim_clock_queue->time;
-        }
-    else
-        sim_interval = noqueue_time = NOQUEUE_WAIT;
-    AIO_EVENT_BEGIN(uptr);
-    if (uptr->usecs_remaining) {
-        sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Requeueing %s after %.0f usecs\n", sim_uname (uptr), uptr->usecs_remaining);
-        reason = sim_timer_activate_after (uptr, uptr->usecs_remaining);
-        }
-    else {
-        sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Processing Event for %s\n", sim_uname (uptr));
-        if (uptr->action != NULL)
-            reason = uptr->action (uptr);
-        else
-            reason = SCPE_OK;
-        }
-    AIO_EVENT_COMPLETE(uptr, reason);
-    if (sim_interval_catchup < -1) {
-        sim_interval_catchup += sim_clock_queue->time;
-        sim_time += sim_clock_queue->time;
-        sim_rtime += sim_clock_queue->time;
-        }
-    else
-        sim_interval_catchup = 0;
-    bare_reason = SCPE_BARE_STATUS (reason);
-    if ((bare_reason != SCPE_OK)      && /* Provide context for unexpected errors */
-        (bare_reason >= SCPE_BASE)    &&
-        (bare_reason != SCPE_EXPECT)  &&
-        (bare_reason != SCPE_REMOTE)  &&
-        (bare_reason != SCPE_MTRLNT)  &&
-        (bare_reason != SCPE_STOP)    &&
-        (bare_reason != SCPE_STEP)    &&
-        (bare_reason != SCPE_RUNTIME) &&
-        (bare_reason != SCPE_EXIT)) {
-        if (bare_reason == SCPE_UNATT)
-            sim_messagef (reason, "\nUnexpected I/O error while processing event for %s - %s\n", sim_uname (uptr), sim_error_text (reason));
-        else
-            sim_messagef (reason, "\nUnexpected internal error while processing event for %s which returned %d - %s\n", sim_uname (uptr), reason, sim_error_text (reason));
-        }
-    } while ((reason == SCPE_OK) &&
-             ((sim_interval + sim_interval_catchup) <= 0) &&
-             (sim_clock_queue != QUEUE_LIST_END) &&
-             (!stop_cpu));
-
-if (sim_clock_queue == QUEUE_LIST_END) {                /* queue empty? */
-    sim_interval = noqueue_time = NOQUEUE_WAIT;         /* flag queue empty */
-    sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Processing Queue Complete New Interval = %d\n", sim_interval);
-    }
-else
-    sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Processing Queue Complete New Interval = %d(%s)\n", sim_interval, sim_uname(sim_clock_queue));
-
-if ((reason == SCPE_OK) && stop_cpu) {
-    stop_cpu = FALSE;
-    reason = SCPE_STOP;
-    }
-sim_processing_event = FALSE;
-return reason;
+return ((a->event_time < b->event_time) ||
+        ((a->event_time == b->event_time) && (a->event_seq < b->event_seq)));
 }
 
-/* sim_activate - activate (queue) event
-
-   Inputs:
-        uptr    =       pointer to unit
-        event_time =    relative timeout
-   Outputs:
-        reason  =       result (SCPE_OK if ok)
-*/
-
-t_stat sim_activate (UNIT *uptr, int32 event_time)
+static void _sim_heap_set (uint32 i, UNIT *uptr)
 {
-if (uptr->dynflags & UNIT_TMR_UNIT)
-    return sim_timer_activate (uptr, event_time);
-return _sim_activate (uptr, event_time);
+sim_clock_heap[i] = uptr;
+uptr->event_index = i;
+uptr->next = ((i + 1) < sim_clock_heap_count) ? sim_clock_heap[i + 1] : QUEUE_LIST_END;
+if (i > 0)
+    sim_clock_heap[i - 1]->next = uptr;
 }
 
-t_stat _sim_activate (UNIT *uptr, int32 event_time)
+static void _sim_heap_swap (uint32 i, uint32 j)
 {
-UNIT *cptr, *prvptr;
-int32 accum;
+UNIT *uptr = sim_clock_heap[i];
 
-AIO_ACTIVATE (_sim_activate, uptr, event_time);
-if (sim_is_active (uptr))                               /* already active? */
-    return SCPE_OK;
-UPDATE_SIM_TIME;                                        /* update sim time */
+_sim_heap_set (i, sim_clock_heap[j]);
+_sim_heap_set (j, uptr);
+}
 
-sim_debug (SIM_DBG_ACTIVATE, &sim_scp_dev, "Activating %s delay=%d\n", sim_uname (uptr), event_time);
+static uint32 _sim_heap_sift_up (uint32 i)
+{
+while (i > 0) {
+    uint32 parent = (i - 1) / 2;
 
-prvptr = NULL;
-accum = 0;
-for (cptr = sim_clock_queue; cptr != QUEUE_LIST_END; cptr = cptr->next) {
-    if (event_time < (accum + cptr->time))
+    if (!_sim_heap_before (sim_clock_heap[i], sim_clock_heap[parent]))
         break;
-    accum = accum + cptr->time;
-    prvptr = cptr;
-    }
-if (prvptr == NULL) {                                   /* insert at head */
-    cptr = uptr->next = sim_clock_queue;
-    sim_clock_queue = uptr;
-    }
-else {
-    cptr = uptr->next = prvptr->next;                   /* insert at prvptr */
-    prvptr->next = uptr;
+    _sim_heap_swap (i, parent);
+    i = parent;
     }
-uptr->time = event_time - accum;
-if (cptr != QUEUE_LIST_END)
-    cptr->time = cptr->time - uptr->time;
-sim_interval = sim_clock_queue->time;
-return SCPE_OK;
+return i;
 }
 
-/* sim_activate_abs - activate (queue) event even if event already scheduled
+static void _sim_heap_sift_down (uint32 i)
+{
+while (1) {
+    uint32 child = 2 * i + 1;
 
-   Inputs:
-        uptr    =       pointer to unit
-        event_time =    relative timeout
-   Outputs:
-        reason  =       result (SCPE_OK if ok)
-*/
+    if (child >= sim_clock_heap_count)
+        break;
+    if (((child + 1) < sim_clock_heap_count) &&
+        _sim_heap_before (sim_clock_heap[child + 1], sim_clock_heap[child]))
+        ++child;
+    if (!_sim_heap_before (sim_clock_heap[child], sim_clock_heap[i]))
+        break;
+    _sim_heap_swap (i, child);
+    i = child;
+    }
+}
 
-t_stat sim_activate_abs (UNIT *uptr, int32 event_time)
+static t_bool _sim_heap_queued (UNIT *uptr)
 {
-AIO_ACTIVATE (sim_activate_abs, uptr, event_time);
-sim_cancel (uptr);
-return _sim_activate (uptr, event_time);
+return ((uptr->next != NULL) &&
+        (uptr->event_index < sim_clock_heap_count) &&
+        (sim_clock_heap[uptr->event_index] == uptr));
 }
 
-/* sim_activate_notbefore - activate (queue) event even if event already scheduled
-                            but not before the specified time
+static void _sim_heap_insert (UNIT *uptr)
+{
+if (sim_clock_heap_count == sim_clock_heap_size) {
+    uint32 new_size = (sim_clock_heap_size == 0) ? 64 : 2 * sim_clock_heap_size;
+    UNIT **new_heap = (UNIT **)realloc (sim_clock_heap, new_size * sizeof (*sim_clock_heap));
 
-   Inputs:
-        uptr    =       pointer to unit
-        rtime   =       relative timeout
-   Outputs:
-        reason  =       result (SCPE_OK if ok)
-*/
+    if (new_heap == NULL) {
+        sim_printf ("Event queue allocation failed for %s\n", sim_uname (uptr));
+        if (sim_deb)
+            fclose (sim_deb);
+        abort ();
+        }
+    sim_clock_heap = new_heap;
+    sim_clock_heap_size = new_size;
+    }
+uptr->event_seq = sim_clock_heap_seq++;
+_sim_heap_set (sim_clock_heap_count++, uptr);
+_sim_heap_sift_up (sim_clock_heap_count - 1);
+sim_clock_queue = sim_clock_heap[0];
+}
 
-t_stat sim_activate_notbefore (UNIT *uptr, int32 rtime)
+static void _sim_heap_remove (UNIT *uptr)
 {
-uint32 rtimenow, urtime = (uint32)rtime;
+uint32 i = uptr->event_index;
+UNIT *last = sim_clock_heap[--sim_clock_heap_count];
 
-AIO_ACTIVATE (sim_activate_notbefore, uptr, rtime);
-sim_cancel (uptr);
-rtimenow = sim_grtime();
-sim_cancel (uptr);
-if (0x80000000 <= urtime-rtimenow)
-    return _sim_activate (uptr, 0);
+if (last != uptr) {
+    _sim_heap_set (i, last);
+    _sim_heap_sift_down (_sim_heap_sift_up (i));
+    }
+if (sim_clock_heap_count > 0) {
+    sim_clock_heap[sim_clock_heap_count - 1]->next = QUEUE_LIST_END;
+    sim_clock_queue = sim_clock_heap[0];
+    }
 else
-    return sim_activate (uptr, urtime-rtimenow);
+    sim_clock_queue = QUEUE_LIST_END;
+uptr->next = NULL;                                      /* hygiene */
 }
 
-/* sim_activate_after - activate (queue) event
-
-   Inputs:
-        uptr    =       pointer to unit
-        usec_delay =    relative timeout (in microseconds)
-   Outputs:
-        reason  =       result (SCPE_OK if ok)
-*/
+/* Remove the earliest event from the queue.  The time of the new first
+   entry becomes relative to the time of the removed entry. */
 
-t_stat sim_activate_after_abs (UNIT *uptr, uint32 usec_delay)
+static UNIT *_sim_clock_queue_pop (void)
 {
-return _sim_activate_after_abs (uptr, (double)usec_delay);
+UNIT *uptr = sim_clock_queue;
+
+if (sim_clock_heap_enabled) {
+    _sim_heap_remove (uptr);
+    if (sim_clock_queue != QUEUE_LIST_END)
+        sim_clock_queue->time = (int32)(sim_clock_queue->event_time - uptr->event_time);
+    }
+else {
+    sim_clock_queue = uptr->next;
+    uptr->next = NULL;                                  /* hygiene */
+    }
+return uptr;
 }
 
-t_stat sim_activate_after_abs_d (UNIT *uptr, double usec_delay)
+/* Return the event which follows the earliest event, and its relative time */
+
+static UNIT *_sim_clock_queue_second (int32 *delta)
 {
-return _sim_activate_after_abs (uptr, usec_delay);
+UNIT *uptr;
+
+*delta = 0;
+if (sim_clock_queue == QUEUE_LIST_END)
+    return QUEUE_LIST_END;
+if (!sim_clock_heap_enabled) {
+    uptr = sim_clock_queue->next;
+    if (uptr != QUEUE_LIST_END)
+        *delta = uptr->time;
+    return uptr;
+    }
+if (sim_clock_heap_count < 2)
+    return QUEUE_LIST_END;
+uptr = sim_clock_heap[1];
+if ((sim_clock_heap_count > 2) && _sim_heap_before (sim_clock_heap[2], uptr))
+    uptr = sim_clock_heap[2];
+*delta = (int32)(uptr->event_time - sim_clock_queue->event_time);
+return uptr;
 }
 
-t_stat _sim_activate_after_abs (UNIT *uptr, double usec_delay)
+static int _sim_heap_compare (const void *pa, const void *pb)
 {
-AIO_VALIDATE(uptr);             /* Can't call asynchronously */
-sim_cancel (uptr);
-return _sim_activate_after (uptr, usec_delay);
+UNIT *a = *(UNIT * const *)pa;
+UNIT *b = *(UNIT * const *)pb;
+
+if (a == b)
+    return 0;
+return _sim_heap_before (a, b) ? -1 : 1;
+}
+
+/* Return an allocated array of the queued units in clock order */
+
+static UNIT **_sim_clock_queue_units (uint32 *count)
+{
+UNIT **units;
+UNIT *uptr;
+uint32 i;
+
+*count = (uint32)sim_qcount ();
+units = (UNIT **)calloc (*count + 1, sizeof (*units));
+if (units == NULL) {
+    *count = 0;
+    return NULL;
+    }
+if (sim_clock_heap_enabled) {
+    memcpy (units, sim_clock_heap, *count * sizeof (*units));
+    qsort (units, *count, sizeof (*units), _sim_heap_compare);
+    }
+else {
+    for (i = 0, uptr = sim_clock_queue; uptr != QUEUE_LIST_END; uptr = uptr->next)
+        units[i++] = uptr;
+    }
+return units;
+}
+
+/* Set the event queue engine.  Pending events are moved to the newly
+   selected engine with their absolute times and order preserved. */
+
+t_stat sim_set_queue (int32 flag, CONST char *cptr)
+{
+char gbuf[CBUFSIZE];
+t_bool heap;
+UNIT **units;
+UNIT *uptr;
+uint32 i, count;
+double now, when;
+
+if ((cptr == NULL) || (*cptr == 0))
+    return SCPE_2FARG;
+cptr = get_glyph (cptr, gbuf, 0);
+if (*cptr != 0)
+    return SCPE_2MARG;
+if (MATCH_CMD (gbuf, "HEAP") == 0)
+    heap = TRUE;
+else {
+    if (MATCH_CMD (gbuf, "LIST") == 0)
+        heap = FALSE;
+    else
+        return sim_messagef (SCPE_ARG, "Unknown event queue type: %s\n", gbuf);
+    }
+if (heap == sim_clock_heap_enabled)                     /* already set correctly? */
+    return SCPE_OK;
+AIO_UPDATE_QUEUE;
+UPDATE_SIM_TIME;                                        /* update sim time */
+units = _sim_clock_queue_units (&count);
+if ((units == NULL) && (count > 0))
+    return SCPE_MEM;
+if (count > 0) {
+    now = sim_clock_heap_enabled ? (units[0]->event_time - units[0]->time) : sim_time;
+    when = now;
+    for (i = 0; i < count; i++) {                       /* record absolute times */
+        uptr = units[i];
+        when = sim_clock_heap_enabled ? uptr->event_time : when + uptr->time;
+        uptr->event_time = when;
+        uptr->next = NULL;
+        }
+    }
+sim_clock_queue = QUEUE_LIST_END;
+sim_clock_heap_count = 0;
+sim_clock_heap_enabled = heap;
+for (i = 0; i < count; i++) {                           /* rebuild in clock order */
+    uptr = units[i];
+    if (heap)
+        _sim_heap_insert (uptr);
+    else {
+        uptr->time = (int32)(uptr->event_time - ((i == 0) ? now : units[i - 1]->event_time));
+        uptr->next = (i + 1 < count) ? units[i + 1] : QUEUE_LIST_END;
+        }
+    }
+if (count > 0) {
+    sim_clock_queue = units[0];
+    sim_clock_queue->time = (int32)(units[0]->event_time - now);
+    sim_interval = sim_clock_queue->time;
+    }
+free (units);
+if (!heap) {
+    free (sim_clock_heap);
+    sim_clock_heap = NULL;
+    sim_clock_heap_size = 0;
+    }
+return sim_messagef (SCPE_OK, "Using %s event queue\n", heap ? "heap" : "sorted list");
+}
+
+/* Sampling profiler
+
+   SET PROFILE {rate} starts sampling the simulated PC (and the unit whose
+   event service routine is executing, if any) rate times per second while
+   the simulator is running.  Samples are accumulated in a hash table keyed
+   by PC and unit.  When pthreads are available, a separate timer thread
+   decides when to sample, so event service routines can be observed as well
+   as the simulated program.  The thread only notes the unit being serviced
+   and posts the profiler's event; the sample is recorded by the simulator
+   thread, which owns the table and is the only one which can read its PC.
+   Otherwise the samples are taken by an internal timer event, which only
+   observes the simulated program.
+
+   SHOW PROFILE displays the most frequently sampled locations, and
+   SHOW -F PROFILE {file} produces the samples in the "folded stack"
+   format consumed by flame graph tools.
+*/
+
+typedef struct {
+    t_addr  pc;                                         /* sampled PC */
+    UNIT    *uptr;                                      /* unit in event service, or NULL */
+    uint32  count;                                      /* hit count */
+    } PROFENT;
+
+static PROFENT *sim_prof_tab = NULL;                    /* hash table */
+static uint32 sim_prof_size = 0;                        /* hash table size (power of 2) */
+static uint32 sim_prof_used = 0;                        /* entries in use */
+static uint32 sim_prof_rate = 0;                        /* samples per second, 0 if stopped */
+static t_uint64 sim_prof_samples = 0;                   /* total samples */
+static t_uint64 sim_prof_dropped = 0;                   /* samples lost to allocation failure */
+
+static uint32 _sim_prof_hash (t_addr pc, UNIT *uptr)
+{
+t_uint64 key = ((t_uint64)pc) ^ ((t_uint64)((size_t)uptr) >> 4);
+
+key = key * 0x9E3779B97F4A7C15ULL;
+return (uint32)(key >> 32);
+}
+
+static PROFENT *_sim_prof_lookup (PROFENT *tab, uint32 size, t_addr pc, UNIT *uptr)
+{
+uint32 i = _sim_prof_hash (pc, uptr) & (size - 1);
+
+while (tab[i].count && ((tab[i].pc != pc) || (tab[i].uptr != uptr)))
+    i = (i + 1) & (size - 1);                           /* linear probe */
+return &tab[i];
+}
+
+static void _sim_prof_record (t_addr pc, UNIT *uptr)
+{
+PROFENT *ent;
+
+if (uptr != NULL)                                       /* event samples aggregate by unit */
+    pc = 0;
+++sim_prof_samples;
+if ((sim_prof_used + 1) > ((sim_prof_size / 4) * 3)) {  /* grow at 75% load */
+    uint32 i, new_size = (sim_prof_size == 0) ? 4096 : 2 * sim_prof_size;
+    PROFENT *new_tab = (PROFENT *)calloc (new_size, sizeof (*new_tab));
+
+    if (new_tab == NULL) {
+        ++sim_prof_dropped;
+        return;
+        }
+    for (i = 0; i < sim_prof_size; i++)
+        if (sim_prof_tab[i].count)
+            *_sim_prof_lookup (new_tab, new_size, sim_prof_tab[i].pc, sim_prof_tab[i].uptr) = sim_prof_tab[i];
+    free (sim_prof_tab);
+    sim_prof_tab = new_tab;
+    sim_prof_size = new_size;
+    }
+ent = _sim_prof_lookup (sim_prof_tab, sim_prof_size, pc, uptr);
+if (ent->count == 0) {
+    ent->pc = pc;
+    ent->uptr = uptr;
+    ++sim_prof_used;
+    }
+++ent->count;
+}
+
+static t_addr _sim_prof_pc (void)
+{
+if (sim_vm_pc_value)
+    return (t_addr)(*sim_vm_pc_value)();
+return (t_addr)get_rval (sim_PC, 0);
+}
+
+static t_stat sim_prof_svc (UNIT *uptr);
+static UNIT sim_prof_unit = { UDATA (&sim_prof_svc, UNIT_IDLE, 0) };
+
+#if defined (SIM_ASYNCH_IO)
+static pthread_t sim_prof_thread;
+static volatile t_bool sim_prof_thread_running = FALSE;
+static UNIT * volatile sim_prof_sample_unit = NULL;     /* unit in event service when the sample was posted */
+
+static void *_sim_prof_sampler (void *arg)
+{
+UNIT *uptr;
+
+while (sim_prof_thread_running) {
+    sim_os_ms_sleep (1000 / sim_prof_rate);
+    if (sim_is_running && sim_prof_thread_running) {
+        uptr = sim_event_unit;
+        sim_prof_sample_unit = (uptr == &sim_prof_unit) ? NULL : uptr;
+        sim_activate (&sim_prof_unit, 0);               /* recorded by the simulator thread */
+        }
+    }
+return NULL;
+}
+#endif
+
+static const char *sim_int_profile_description (DEVICE *dptr)
+{
+return "Sampling profiler";
+}
+
+DEVICE sim_prof_dev = {
+    "INT-PROFILE", &sim_prof_unit, NULL, NULL,
+    1, 0, 0, 0, 0, 0,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, DEV_NOSAVE, 0,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    sim_int_profile_description};
+
+/* Sample service: a sample posted by the timer thread, or the periodic
+   sample when there is no timer thread */
+
+static t_stat sim_prof_svc (UNIT *uptr)
+{
+if (sim_prof_rate == 0)                                 /* stopped since posted? */
+    return SCPE_OK;
+#if defined (SIM_ASYNCH_IO)
+_sim_prof_record (_sim_prof_pc (), sim_prof_sample_unit);
+return SCPE_OK;
+#else
+_sim_prof_record (_sim_prof_pc (), NULL);
+return sim_activate_after (uptr, 1000000 / sim_prof_rate);
+#endif
+}
+
+static void _sim_prof_stop (void)
+{
+if (sim_prof_rate == 0)
+    return;
+#if defined (SIM_ASYNCH_IO)
+sim_prof_thread_running = FALSE;
+pthread_join (sim_prof_thread, NULL);
+#endif
+sim_cancel (&sim_prof_unit);                            /* including a posted sample */
+sim_prof_rate = 0;
+}
+
+t_stat sim_set_profile (int32 flag, CONST char *cptr)
+{
+t_stat r;
+uint32 rate = 100;
+
+if (flag == 0) {                                        /* NOPROFILE */
+    if (cptr && *cptr)
+        return SCPE_2MARG;
+    _sim_prof_stop ();
+    return SCPE_OK;
+    }
+if (sim_PC == NULL)
+    return sim_messagef (SCPE_NOFNC, "Profiling requires a simulator PC register\n");
+if (cptr && *cptr) {
+    rate = (uint32) get_uint (cptr, 10, 1000, &r);
+    if ((r != SCPE_OK) || (rate == 0))
+        return sim_messagef (SCPE_ARG, "Invalid sample rate: %s (1-1000 samples/sec)\n", cptr);
+    }
+_sim_prof_stop ();
+free (sim_prof_tab);                                    /* start with empty counts */
+sim_prof_tab = NULL;
+sim_prof_size = sim_prof_used = 0;
+sim_prof_samples = sim_prof_dropped = 0;
+sim_prof_rate = rate;
+#if defined (SIM_ASYNCH_IO)
+sim_prof_thread_running = TRUE;
+if (pthread_create (&sim_prof_thread, NULL, _sim_prof_sampler, NULL)) {
+    sim_prof_thread_running = FALSE;
+    sim_prof_rate = 0;
+    return sim_messagef (SCPE_IERR, "Can't create profile sampling thread\n");
+    }
+#else
+sim_activate_after (&sim_prof_unit, 1000000 / sim_prof_rate);
+#endif
+return SCPE_OK;
+}
+
+static int _sim_prof_compare (const void *pa, const void *pb)
+{
+const PROFENT *a = (const PROFENT *)pa;
+const PROFENT *b = (const PROFENT *)pb;
+
+if (a->count != b->count)
+    return (a->count > b->count) ? -1 : 1;
+if (a->pc != b->pc)
+    return (a->pc < b->pc) ? -1 : 1;
+return 0;
+}
+
+/* Format the location of a profile entry into buf.  Guest samples are
+   the symbolic PC and instruction, event samples are the unit name. */
+
+static void _sim_prof_location (PROFENT *ent, char *buf, size_t bufsize, t_bool folded)
+{
+MEMFILE mbuf;
+MEMFILE *saved_mfile = sim_mfile;
+DEVICE *dptr = sim_dflt_dev;
+t_stat r = SCPE_OK;
+int32 i;
+t_addr k;
+char *cptr;
+
+if (ent->uptr != NULL) {
+    DEVICE *udptr = find_dev_from_unit (ent->uptr);
+
+    snprintf (buf, bufsize, "%s%s%s", udptr ? sim_dname (udptr) : "Unknown", folded ? ";" : " ", sim_uname (ent->uptr));
+    return;
+    }
+memset (&mbuf, 0, sizeof (mbuf));
+sim_mfile = &mbuf;
+if ((sim_PC->flags & REG_VMAD) && sim_vm_fprint_addr)
+    sim_vm_fprint_addr (stdout, dptr, ent->pc);
+else
+    fprint_val (stdout, ent->pc, sim_PC->radix, sim_PC->width, sim_PC->flags & REG_FMT);
+if ((dptr != NULL) && (dptr->examine != NULL)) {
+    for (i = 0; i < sim_emax; i++)
+        sim_eval[i] = 0;
+    for (i = 0, k = ent->pc; i < sim_emax; i++, k = k + dptr->aincr) {
+        if ((r = dptr->examine (&sim_eval[i], k, dptr->units, SWMASK ('V'))) != SCPE_OK)
+            break;
+        }
+    if ((r == SCPE_OK) || (i > 0)) {
+        fprintf (stdout, " ");
+        if (fprint_sym (stdout, ent->pc, sim_eval, NULL, SWMASK ('M')) > 0)
+            fprint_val (stdout, sim_eval[0], dptr->dradix, dptr->dwidth, PV_RZRO);
+        }
+    }
+sim_mfile = saved_mfile;
+snprintf (buf, bufsize, "%.*s", (int)mbuf.pos, mbuf.buf ? mbuf.buf : "");
+free (mbuf.buf);
+for (cptr = buf; *cptr; cptr++) {                       /* keep folded stack frames intact */
+    if ((*cptr == ';') || (*cptr == '\n') || (*cptr == '\r') || (*cptr == '\t'))
+        *cptr = ' ';
+    }
+}
+
+t_stat sim_show_profile (FILE *st, DEVICE *dnotused, UNIT *unotused, int32 flag, CONST char *cptr)
+{
+char gbuf[CBUFSIZE], loc[CBUFSIZE];
+PROFENT *ents;
+FILE *ofile = st;
+uint32 i, j, limit = 20;
+t_stat r;
+
+cptr = get_glyph_nc (cptr, gbuf, 0);
+if (*cptr)
+    return SCPE_2MARG;
+if (!(sim_switches & SWMASK ('F')) && gbuf[0]) {
+    limit = (uint32) get_uint (gbuf, 10, 0xFFFFFFFF, &r);
+    if ((r != SCPE_OK) || (limit == 0))
+        return sim_messagef (SCPE_ARG, "Invalid entry count: %s\n", gbuf);
+    }
+if (sim_prof_used == 0) {
+    fprintf (st, "Profiling %s, no samples\n", sim_prof_rate ? "enabled" : "disabled");
+    return SCPE_OK;
+    }
+ents = (PROFENT *)malloc (sim_prof_used * sizeof (*ents));
+if (ents == NULL)
+    return SCPE_MEM;
+for (i = j = 0; i < sim_prof_size; i++)
+    if (sim_prof_tab[i].count)
+        ents[j++] = sim_prof_tab[i];
+qsort (ents, sim_prof_used, sizeof (*ents), _sim_prof_compare);
+if (sim_switches & SWMASK ('F')) {                      /* folded stacks for flame graphs */
+    if (gbuf[0]) {
+        ofile = sim_fopen (gbuf, "w");
+        if (ofile == NULL) {
+            free (ents);
+            return sim_messagef (SCPE_OPENERR, "Can't open %s: %s\n", gbuf, strerror (errno));
+            }
+        }
+    for (i = 0; i < sim_prof_used; i++) {
+        _sim_prof_location (&ents[i], loc, sizeof (loc), TRUE);
+        fprintf (ofile, "%s;%s;%s %u\n", sim_name, ents[i].uptr ? "event" : sim_dname (sim_dflt_dev), loc, ents[i].count);
+        }
+    if (ofile != st)
+        fclose (ofile);
+    }
+else {
+    if (sim_prof_rate)
+        fprintf (st, "Profiling enabled at %u samples/sec, ", sim_prof_rate);
+    else
+        fprintf (st, "Profiling disabled, ");
+    fprintf (st, "%s samples", sim_fmt_numeric ((double)sim_prof_samples));
+    if (sim_prof_dropped)
+        fprintf (st, ", %s dropped", sim_fmt_numeric ((double)sim_prof_dropped));
+    fprintf (st, ", %u distinct locations\n", sim_prof_used);
+    for (i = 0; (i < sim_prof_used) && (i < limit); i++) {
+        _sim_prof_location (&ents[i], loc, sizeof (loc), FALSE);
+        fprintf (st, "%10u %5.1f%%  %s%s\n", ents[i].count, (100.0 * ents[i].count) / sim_prof_samples,
+                                            ents[i].uptr ? "Event: " : "", loc);
+        }
+    }
+free (ents);
+return SCPE_OK;
+}
+
+/* Event service accounting
+
+   While enabled (the default), each device accumulates the number of calls
+   to its units' event service routines, the host time spent in them, and
+   the delays with which those routines reschedule the device's units.
+   These are displayed by SHOW EVENTSTATS and SHOW <dev> STATISTICS.
+*/
+
+static t_uint64 _sim_host_nsec (void)
+{
+struct timespec now;
+
+#if defined (CLOCK_MONOTONIC)
+clock_gettime (CLOCK_MONOTONIC, &now);
+#else
+clock_gettime (CLOCK_REALTIME, &now);
+#endif
+return ((t_uint64)now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+static void _sim_evstats_clear (void)
+{
+DEVICE *dptr;
+uint32 i, ndevs;
+
+for (ndevs = 0; sim_devices[ndevs] != NULL; ndevs++)
+    ;
+for (i = 0; i < ndevs + sim_internal_device_count; i++) {
+    dptr = (i < ndevs) ? sim_devices[i] : sim_internal_devices[i - ndevs];
+    dptr->ev_count = dptr->ev_host_ns = dptr->ev_resched = 0;
+    dptr->ev_resched_time = 0.0;
+    }
+sim_evstats_start = sim_timenow_double ();
+sim_evstats_start_gtime = sim_gtime ();
+}
+
+t_stat sim_set_evstats (int32 flag, CONST char *cptr)
+{
+if (cptr && *cptr)
+    return SCPE_2MARG;
+if (flag)                                               /* EVENTSTATS starts afresh */
+    _sim_evstats_clear ();
+sim_evstats_enabled = (flag != 0);
+return SCPE_OK;
+}
+
+static void _sim_evstats_line (FILE *st, DEVICE *dptr, double total_ns)
+{
+/* sim_fmt_numeric returns a static buffer, so it can only be used once per call */
+fprintf (st, "%-16s %14s %12.3f %10.0f %6.1f%%", sim_dname (dptr),
+             sim_fmt_numeric ((double)dptr->ev_count), dptr->ev_host_ns / 1000000.0,
+             dptr->ev_count ? ((double)dptr->ev_host_ns) / dptr->ev_count : 0.0,
+             total_ns ? (100.0 * dptr->ev_host_ns) / total_ns : 0.0);
+fprintf (st, " %14s %14.0f\n", sim_fmt_numeric ((double)dptr->ev_resched),
+             dptr->ev_resched ? dptr->ev_resched_time / dptr->ev_resched : 0.0);
+}
+
+static void _sim_evstats_header (FILE *st)
+{
+double host_secs = sim_timenow_double () - sim_evstats_start;
+
+fprintf (st, "Event service statistics %s", sim_evstats_enabled ? "" : "(disabled) ");
+fprintf (st, "over %.3f host seconds, %s %s\n", host_secs,
+             sim_fmt_numeric (sim_gtime () - sim_evstats_start_gtime), sim_vm_interval_units);
+fprintf (st, "%-16s %14s %12s %10s %7s %14s %14s\n", "Device", "Calls", "Host msecs", "ns/call", "Host%", "Reschedules", "Avg Interval");
+}
+
+static int _sim_evstats_compare (const void *pa, const void *pb)
+{
+const DEVICE *a = *(DEVICE * const *)pa;
+const DEVICE *b = *(DEVICE * const *)pb;
+
+if (a->ev_host_ns != b->ev_host_ns)
+    return (a->ev_host_ns > b->ev_host_ns) ? -1 : 1;
+return strcmp (a->name, b->name);
+}
+
+t_stat sim_show_evstats (FILE *st, DEVICE *dnotused, UNIT *unotused, int32 flag, CONST char *cptr)
+{
+DEVICE **devs, *dptr;
+uint32 i, ndevs = 0, count = 0;
+t_uint64 total_calls = 0, total_ns = 0;
+
+if (cptr && *cptr)
+    return SCPE_2MARG;
+for (i = 0; sim_devices[i] != NULL; i++)
+    ++ndevs;
+devs = (DEVICE **)calloc (ndevs + sim_internal_device_count, sizeof (*devs));
+if (devs == NULL)
+    return SCPE_MEM;
+for (i = 0; i < ndevs + sim_internal_device_count; i++) {
+    dptr = (i < ndevs) ? sim_devices[i] : sim_internal_devices[i - ndevs];
+    if (dptr->ev_count == 0)
+        continue;
+    devs[count++] = dptr;
+    total_calls += dptr->ev_count;
+    total_ns += dptr->ev_host_ns;
+    }
+qsort (devs, count, sizeof (*devs), _sim_evstats_compare);
+_sim_evstats_header (st);
+for (i = 0; i < count; i++)
+    _sim_evstats_line (st, devs[i], (double)total_ns);
+fprintf (st, "%-16s %14s %12.3f %10.0f\n", "Total", sim_fmt_numeric ((double)total_calls), total_ns / 1000000.0,
+             total_calls ? ((double)total_ns) / total_calls : 0.0);
+free (devs);
+return SCPE_OK;
+}
+
+t_stat sim_show_dev_evstats (FILE *st, DEVICE *dptr, UNIT *uptr, int32 flag, CONST char *cptr)
+{
+if (cptr && *cptr)
+    return SCPE_2MARG;
+_sim_evstats_header (st);
+_sim_evstats_line (st, dptr, 0.0);
+return SCPE_OK;
+}
+
+/* Execution trace recorder
+
+   SET EXECTRACE file records every instruction executed by a CPU which
+   supports it (one which sets sim_vm_exectrace_regs) into a file of
+   arbitrary length.  While recording, the CPU calls sim_exectrace_insn
+   once per instruction with the PC, the instruction bytes and the values
+   of the registers it names in sim_vm_exectrace_regs, and may call
+   sim_exectrace_mem for the memory writes the instruction performs.
+
+   Records are delta encoded into blocks.  A full block is handed to a
+   writer thread (when the host supports threads) which compresses it
+   (when zlib is available) and writes it out, so the simulator thread
+   only pays for the encoding.  The delta state is reset at the start of
+   every block, so each block can be decoded on its own.  When recording
+   stops, an index of the blocks is appended, which lets the reader
+   (SHOW EXECTRACE file first {count}) go directly to the block holding
+   any instruction.  Files without an index (the simulator didn't exit
+   cleanly) are read by scanning the block headers.
+
+   File layout (all integers are little endian):
+
+   header   bytes 0-7       EXTR_MAGIC
+            bytes 8-11      format version
+            bytes 12-15     header length
+            bytes 16-19     register count
+            bytes 20-23     PC radix
+            bytes 24-27     PC width
+            bytes 28-       simulator name, NUL, then each register name, NUL
+
+   block    bytes 0-3       EXTR_BLOCK (or EXTR_INDEX)
+            bytes 4-7       stored payload length
+            bytes 8-11      raw payload length
+            bytes 12-15     instructions in the block
+            bytes 16-23     number of the first instruction in the block
+            bytes 24-31     simulated time at the start of the block
+            bytes 32-35     flags (EXTR_F_ZLIB)
+            bytes 36-39     reserved
+
+   trailer  bytes 0-7       EXTR_TRAILER
+            bytes 8-15      file offset of the index block
+
+   The index payload is a list of (block file offset, first instruction)
+   pairs of 8 byte integers.  Block payloads are a sequence of records
+   starting with a tag byte:
+
+   instruction (tag bit 7 clear)
+            EXTR_T_PC       PC - predicted PC (signed varint), where the
+                            prediction is the previous PC plus the previous
+                            instruction length.  Absent if the prediction
+                            holds.
+            EXTR_T_INST     instruction length, instruction bytes.  Absent if
+                            the bytes are the same as those last recorded at
+                            this PC (a direct mapped cache of EXTR_ICACHE
+                            entries indexed by PC).
+            EXTR_T_REGS     bitmap of changed registers (varint), then the
+                            difference from the previous value of each
+                            changed register (signed varint).
+
+   memory write (tag bit 7 set, bits 3-0 size in bytes)
+            address - (previous write address + previous size) (signed
+            varint), value (varint).  A write belongs to the preceding
+            instruction, which may be the last instruction of the
+            previous block.
+*/
+
+#define EXTR_MAGIC      "SIMHEXTR"
+#define EXTR_TRAILER    "SIMHEXIX"
+#define EXTR_VERSION    1
+#define EXTR_BLOCK      0x4B4C4258                      /* "XBLK" */
+#define EXTR_INDEX      0x58444958                      /* "XIDX" */
+#define EXTR_BLKHDR     40                              /* block header size */
+#define EXTR_F_ZLIB     1                               /* payload compressed with zlib */
+#define EXTR_T_PC       0x01                            /* record tag bits */
+#define EXTR_T_INST     0x02
+#define EXTR_T_REGS     0x04
+#define EXTR_T_MEM      0x80
+#define EXTR_BLOCKSIZE  (256*1024)                      /* raw block size */
+#define EXTR_NBUFS      8                               /* blocks being filled or written */
+#define EXTR_ICACHE     1024                            /* instruction cache entries (power of 2) */
+#define EXTR_MAXINST    32                              /* instruction bytes recorded */
+#define EXTR_MAXREGS    64                              /* registers recorded */
+#define EXTR_MAXREC     (1 + 10 + 1 + EXTR_MAXINST + 10 + 10*EXTR_MAXREGS)
+
+t_bool sim_exectrace_on = FALSE;
+
+typedef struct {
+    t_addr              pc;
+    uint32              len;
+    uint8               inst[EXTR_MAXINST];
+    } EXTRINST;
+
+typedef struct {
+    uint8               *data;                          /* raw records */
+    size_t              used;                           /* bytes used */
+    uint32              count;                          /* instructions */
+    t_uint64            first;                          /* number of first instruction */
+    double              gtime;                          /* simulated time at start */
+    volatile t_bool     full;                           /* waiting to be written */
+    } EXTRBLOCK;
+
+static struct {
+    FILE                *file;                          /* trace file */
+    char                *filename;
+    uint32              nregs;                          /* registers recorded */
+    EXTRBLOCK           blocks[EXTR_NBUFS];
+    uint32              cur;                            /* block being filled */
+    uint32              wr;                             /* next block to write */
+    t_uint64            insns;                          /* instructions recorded */
+    t_addr              next_pc;                        /* delta state */
+    t_addr              mem_addr;
+    t_value             regs[EXTR_MAXREGS];
+    EXTRINST            icache[EXTR_ICACHE];
+    uint8               *zbuf;                          /* compression buffer */
+    size_t              zbuf_size;
+    t_offset            offset;                         /* file offset of next block */
+    t_uint64            *index;                         /* block offset, first instruction pairs */
+    uint32              nblocks;
+    uint32              maxblocks;
+    t_uint64            raw_bytes;                      /* payload bytes before compression */
+    t_bool              error;                          /* write failed */
+#if defined (SIM_ASYNCH_IO)
+    t_bool              thread_active;
+    t_bool              stop;
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      work;                           /* a block is full */
+    pthread_cond_t      done;                           /* a block was written */
+#endif
+    } sim_extr;
+
+static void _sim_extr_le (uint8 *p, t_uint64 val, int bytes)
+{
+while (bytes-- > 0) {
+    *p++ = (uint8)val;
+    val >>= 8;
+    }
+}
+
+static t_uint64 _sim_extr_get_le (const uint8 *p, int bytes)
+{
+t_uint64 val = 0;
+
+while (bytes-- > 0)
+    val = (val << 8) | p[bytes];
+return val;
+}
+
+static size_t _sim_extr_varint (uint8 *p, t_uint64 val)
+{
+size_t n = 0;
+
+while (val >= 0x80) {
+    p[n++] = (uint8)(val | 0x80);
+    val >>= 7;
+    }
+p[n++] = (uint8)val;
+return n;
+}
+
+static size_t _sim_extr_svarint (uint8 *p, t_uint64 delta)
+{
+t_int64 d = (t_int64)delta;
+
+return _sim_extr_varint (p, (((t_uint64)d) << 1) ^ (t_uint64)(d >> 63));
+}
+
+/* Write a block (called by the writer thread, if there is one) */
+
+static void _sim_extr_write_block (EXTRBLOCK *b)
+{
+uint8 hdr[EXTR_BLKHDR];
+const uint8 *payload = b->data;
+size_t stored = b->used;
+uint32 flags = 0;
+t_uint64 gtime;
+
+#if defined (HAVE_ZLIB)
+uLongf zlen = (uLongf)sim_extr.zbuf_size;
+
+if ((compress2 (sim_extr.zbuf, &zlen, b->data, (uLong)b->used, Z_BEST_SPEED) == Z_OK) &&
+    (zlen < b->used)) {
+    payload = sim_extr.zbuf;
+    stored = zlen;
+    flags |= EXTR_F_ZLIB;
+    }
+#endif
+memset (hdr, 0, sizeof (hdr));
+_sim_extr_le (hdr, EXTR_BLOCK, 4);
+_sim_extr_le (hdr + 4, stored, 4);
+_sim_extr_le (hdr + 8, b->used, 4);
+_sim_extr_le (hdr + 12, b->count, 4);
+_sim_extr_le (hdr + 16, b->first, 8);
+memcpy (&gtime, &b->gtime, sizeof (gtime));            /* IEEE double */
+_sim_extr_le (hdr + 24, gtime, 8);
+_sim_extr_le (hdr + 32, flags, 4);
+if (sim_extr.nblocks == sim_extr.maxblocks) {
+    t_uint64 *index = (t_uint64 *)realloc (sim_extr.index, 2 * sizeof (*index) * (sim_extr.maxblocks + 1024));
+
+    if (index != NULL) {
+        sim_extr.index = index;
+        sim_extr.maxblocks += 1024;
+        }
+    }
+if (sim_extr.nblocks < sim_extr.maxblocks) {
+    sim_extr.index[2 * sim_extr.nblocks] = (t_uint64)sim_extr.offset;
+    sim_extr.index[2 * sim_extr.nblocks + 1] = b->first;
+    ++sim_extr.nblocks;
+    }
+if ((fwrite (hdr, 1, sizeof (hdr), sim_extr.file) != sizeof (hdr)) ||
+    (fwrite (payload, 1, stored, sim_extr.file) != stored))
+    sim_extr.error = TRUE;
+sim_extr.offset += sizeof (hdr) + stored;
+sim_extr.raw_bytes += b->used;
+}
+
+#if defined (SIM_ASYNCH_IO)
+static void *_sim_extr_writer (void *arg)
+{
+pthread_mutex_lock (&sim_extr.lock);
+while (1) {
+    EXTRBLOCK *b = &sim_extr.blocks[sim_extr.wr];
+
+    if (!b->full) {
+        if (sim_extr.stop)
+            break;
+        pthread_cond_wait (&sim_extr.work, &sim_extr.lock);
+        continue;
+        }
+    pthread_mutex_unlock (&sim_extr.lock);
+    _sim_extr_write_block (b);
+    pthread_mutex_lock (&sim_extr.lock);
+    b->full = FALSE;
+    sim_extr.wr = (sim_extr.wr + 1) % EXTR_NBUFS;
+    pthread_cond_signal (&sim_extr.done);
+    }
+pthread_mutex_unlock (&sim_extr.lock);
+return NULL;
+}
+#endif
+
+/* Finish the current block and start the next one */
+
+static EXTRBLOCK *_sim_extr_next_block (void)
+{
+EXTRBLOCK *b = &sim_extr.blocks[sim_extr.cur];
+
+if (b->used) {
+#if defined (SIM_ASYNCH_IO)
+    if (sim_extr.thread_active) {
+        pthread_mutex_lock (&sim_extr.lock);
+        b->full = TRUE;
+        pthread_cond_signal (&sim_extr.work);
+        sim_extr.cur = (sim_extr.cur + 1) % EXTR_NBUFS;
+        while (sim_extr.blocks[sim_extr.cur].full)      /* writer behind? */
+            pthread_cond_wait (&sim_extr.done, &sim_extr.lock);
+        pthread_mutex_unlock (&sim_extr.lock);
+        }
+    else
+#endif
+        _sim_extr_write_block (b);
+    }
+b = &sim_extr.blocks[sim_extr.cur];
+b->used = 0;
+b->count = 0;
+b->first = sim_extr.insns;
+b->gtime = sim_gtime ();
+sim_extr.next_pc = 0;                                   /* each block decodes on its own */
+sim_extr.mem_addr = 0;
+memset (sim_extr.regs, 0, sizeof (sim_extr.regs));
+memset (sim_extr.icache, 0, sizeof (sim_extr.icache));
+return b;
+}
+
+void sim_exectrace_insn (t_addr pc, const uint8 *inst, uint32 ilen, const t_value *regs)
+{
+EXTRBLOCK *b = &sim_extr.blocks[sim_extr.cur];
+EXTRINST *ic;
+uint8 *p, *tag;
+t_uint64 changed = 0;
+uint32 i;
+
+if (b->used >= EXTR_BLOCKSIZE)
+    b = _sim_extr_next_block ();
+p = b->data + b->used;
+tag = p++;
+*tag = 0;
+if (pc != sim_extr.next_pc) {
+    *tag |= EXTR_T_PC;
+    p += _sim_extr_svarint (p, (t_uint64)pc - (t_uint64)sim_extr.next_pc);
+    }
+if (ilen > EXTR_MAXINST)
+    ilen = EXTR_MAXINST;
+ic = &sim_extr.icache[((uint32)pc) & (EXTR_ICACHE - 1)];
+if ((ic->pc != pc) || (ic->len != ilen) || memcmp (ic->inst, inst, ilen)) {
+    *tag |= EXTR_T_INST;
+    *p++ = (uint8)ilen;
+    memcpy (p, inst, ilen);
+    p += ilen;
+    ic->pc = pc;
+    ic->len = ilen;
+    memcpy (ic->inst, inst, ilen);
+    }
+for (i = 0; i < sim_extr.nregs; i++)
+    if (regs[i] != sim_extr.regs[i])
+        changed |= ((t_uint64)1) << i;
+if (changed) {
+    *tag |= EXTR_T_REGS;
+    p += _sim_extr_varint (p, changed);
+    for (i = 0; i < sim_extr.nregs; i++) {
+        if (regs[i] != sim_extr.regs[i]) {
+            p += _sim_extr_svarint (p, (t_uint64)regs[i] - (t_uint64)sim_extr.regs[i]);
+            sim_extr.regs[i] = regs[i];
+            }
+        }
+    }
+sim_extr.next_pc = pc + ilen;
+b->used = p - b->data;
+++b->count;
+++sim_extr.insns;
+}
+
+void sim_exectrace_mem (t_addr addr, t_value val, uint32 size)
+{
+EXTRBLOCK *b = &sim_extr.blocks[sim_extr.cur];
+uint8 *p;
+
+if (b->used >= EXTR_BLOCKSIZE)
+    b = _sim_extr_next_block ();
+p = b->data + b->used;
+*p++ = (uint8)(EXTR_T_MEM | (size & 0xF));
+p += _sim_extr_svarint (p, (t_uint64)addr - (t_uint64)sim_extr.mem_addr);
+p += _sim_extr_varint (p, (t_uint64)val);
+sim_extr.mem_addr = addr + size;
+b->used = p - b->data;
+}
+
+/* Stop recording: write out the last block, the index and the trailer */
+
+static void _sim_extr_stop (void)
+{
+uint8 hdr[EXTR_BLKHDR], trailer[16];
+t_offset index_offset;
+uint32 i;
+
+if (sim_extr.file == NULL)
+    return;
+sim_exectrace_on = FALSE;
+(void)_sim_extr_next_block ();
+#if defined (SIM_ASYNCH_IO)
+if (sim_extr.thread_active) {
+    pthread_mutex_lock (&sim_extr.lock);
+    sim_extr.stop = TRUE;
+    pthread_cond_signal (&sim_extr.work);
+    pthread_mutex_unlock (&sim_extr.lock);
+    pthread_join (sim_extr.thread, NULL);
+    sim_extr.thread_active = FALSE;
+    pthread_cond_destroy (&sim_extr.done);
+    pthread_cond_destroy (&sim_extr.work);
+    pthread_mutex_destroy (&sim_extr.lock);
+    }
+#endif
+index_offset = sim_extr.offset;
+memset (hdr, 0, sizeof (hdr));
+_sim_extr_le (hdr, EXTR_INDEX, 4);
+_sim_extr_le (hdr + 4, 16 * sim_extr.nblocks, 4);
+_sim_extr_le (hdr + 8, 16 * sim_extr.nblocks, 4);
+_sim_extr_le (hdr + 12, sim_extr.nblocks, 4);
+_sim_extr_le (hdr + 16, sim_extr.insns, 8);
+fwrite (hdr, 1, sizeof (hdr), sim_extr.file);
+for (i = 0; i < 2 * sim_extr.nblocks; i++) {
+    uint8 ent[8];
+
+    _sim_extr_le (ent, sim_extr.index[i], 8);
+    fwrite (ent, 1, sizeof (ent), sim_extr.file);
+    }
+memcpy (trailer, EXTR_TRAILER, 8);
+_sim_extr_le (trailer + 8, (t_uint64)index_offset, 8);
+if ((fwrite (trailer, 1, sizeof (trailer), sim_extr.file) != sizeof (trailer)) ||
+    (fclose (sim_extr.file) != 0))
+    sim_extr.error = TRUE;
+sim_extr.file = NULL;
+if (sim_extr.error)
+    sim_printf ("Error writing execution trace %s\n", sim_extr.filename);
+for (i = 0; i < EXTR_NBUFS; i++) {
+    free (sim_extr.blocks[i].data);
+    sim_extr.blocks[i].data = NULL;
+    }
+free (sim_extr.zbuf);
+sim_extr.zbuf = NULL;
+free (sim_extr.index);
+sim_extr.index = NULL;
+}
+
+t_stat sim_set_exectrace (int32 flag, CONST char *cptr)
+{
+char gbuf[4*CBUFSIZE];
+uint8 *hdr;
+size_t hlen;
+uint32 i;
+
+if (flag == 0) {                                        /* NOEXECTRACE */
+    if (cptr && *cptr)
+        return SCPE_2MARG;
+    if (sim_extr.file == NULL)
+        return SCPE_OK;
+    _sim_extr_stop ();
+    return sim_messagef (SCPE_OK, "Execution trace %s: %s instructions\n", sim_extr.filename, sim_fmt_numeric ((double)sim_extr.insns));
+    }
+if (sim_vm_exectrace_regs == NULL)
+    return sim_messagef (SCPE_NOFNC, "Execution tracing isn't supported by this simulator\n");
+if ((cptr == NULL) || (*cptr == 0))
+    return SCPE_2FARG;
+cptr = get_glyph_nc (cptr, gbuf, 0);
+if (*cptr)
+    return SCPE_2MARG;
+_sim_extr_stop ();
+free (sim_extr.filename);
+sim_extr.filename = NULL;
+sim_extr.file = sim_fopen (gbuf, "wb");
+if (sim_extr.file == NULL)
+    return sim_messagef (SCPE_OPENERR, "Can't open %s: %s\n", gbuf, strerror (errno));
+sim_extr.filename = (char *)malloc (strlen (gbuf) + 1);
+strcpy (sim_extr.filename, gbuf);
+for (sim_extr.nregs = 0; (sim_extr.nregs < EXTR_MAXREGS) && sim_vm_exectrace_regs[sim_extr.nregs]; sim_extr.nregs++) ;
+hlen = 28 + strlen (sim_name) + 1;
+for (i = 0; i < sim_extr.nregs; i++)
+    hlen += strlen (sim_vm_exectrace_regs[i]) + 1;
+hdr = (uint8 *)calloc (1, hlen);
+memcpy (hdr, EXTR_MAGIC, 8);
+_sim_extr_le (hdr + 8, EXTR_VERSION, 4);
+_sim_extr_le (hdr + 12, hlen, 4);
+_sim_extr_le (hdr + 16, sim_extr.nregs, 4);
+_sim_extr_le (hdr + 20, sim_PC ? sim_PC->radix : 16, 4);
+_sim_extr_le (hdr + 24, sim_PC ? sim_PC->width : 32, 4);
+hlen = 28;
+strcpy ((char *)hdr + hlen, sim_name);
+hlen += strlen (sim_name) + 1;
+for (i = 0; i < sim_extr.nregs; i++) {
+    strcpy ((char *)hdr + hlen, sim_vm_exectrace_regs[i]);
+    hlen += strlen (sim_vm_exectrace_regs[i]) + 1;
+    }
+sim_extr.error = (fwrite (hdr, 1, hlen, sim_extr.file) != hlen);
+free (hdr);
+sim_extr.offset = (t_offset)hlen;
+sim_extr.insns = sim_extr.raw_bytes = 0;
+sim_extr.nblocks = sim_extr.maxblocks = 0;
+sim_extr.cur = sim_extr.wr = 0;
+for (i = 0; i < EXTR_NBUFS; i++) {
+    sim_extr.blocks[i].data = (uint8 *)malloc (EXTR_BLOCKSIZE + EXTR_MAXREC);
+    sim_extr.blocks[i].used = 0;
+    sim_extr.blocks[i].full = FALSE;
+    }
+#if defined (HAVE_ZLIB)
+sim_extr.zbuf_size = compressBound (EXTR_BLOCKSIZE + EXTR_MAXREC);
+sim_extr.zbuf = (uint8 *)malloc (sim_extr.zbuf_size);
+#endif
+for (i = 0; i < EXTR_NBUFS; i++)
+    if (sim_extr.blocks[i].data == NULL)
+        break;
+if (i < EXTR_NBUFS) {
+    _sim_extr_stop ();
+    return SCPE_MEM;
+    }
+(void)_sim_extr_next_block ();
+#if defined (SIM_ASYNCH_IO)
+sim_extr.stop = FALSE;
+pthread_mutex_init (&sim_extr.lock, NULL);
+pthread_cond_init (&sim_extr.work, NULL);
+pthread_cond_init (&sim_extr.done, NULL);
+if (pthread_create (&sim_extr.thread, NULL, _sim_extr_writer, NULL) == 0)
+    sim_extr.thread_active = TRUE;
+else {                                                  /* write synchronously */
+    pthread_cond_destroy (&sim_extr.done);
+    pthread_cond_destroy (&sim_extr.work);
+    pthread_mutex_destroy (&sim_extr.lock);
+    }
+#endif
+sim_exectrace_on = TRUE;
+return sim_messagef (SCPE_OK, "Recording execution trace to %s\n", sim_extr.filename);
+}
+
+/* Execution trace reader */
+
+typedef struct {
+    FILE                *file;
+    uint32              nregs;
+    uint32              radix;
+    uint32              width;
+    char                *names;                         /* simulator name, register names */
+    const char          **regnames;
+    t_uint64            *index;                         /* block offset, first instruction pairs */
+    uint32              nblocks;
+    uint8               *raw;                           /* decoded block payload */
+    uint8               *stored;
+    } EXTRREAD;
+
+static void _sim_extr_close_read (EXTRREAD *rd)
+{
+if (rd->file)
+    fclose (rd->file);
+free (rd->names);
+free (rd->regnames);
+free (rd->index);
+free (rd->raw);
+free (rd->stored);
+}
+
+static t_stat _sim_extr_add_block (EXTRREAD *rd, t_uint64 offset, t_uint64 first)
+{
+if ((rd->nblocks & 1023) == 0) {
+    t_uint64 *index = (t_uint64 *)realloc (rd->index, 2 * sizeof (*index) * (rd->nblocks + 1024));
+
+    if (index == NULL)
+        return SCPE_MEM;
+    rd->index = index;
+    }
+rd->index[2 * rd->nblocks] = offset;
+rd->index[2 * rd->nblocks + 1] = first;
+++rd->nblocks;
+return SCPE_OK;
+}
+
+static t_stat _sim_extr_open_read (EXTRREAD *rd, const char *filename)
+{
+uint8 buf[EXTR_BLKHDR];
+t_offset size, offset;
+uint32 hlen, i;
+char *name;
+
+memset (rd, 0, sizeof (*rd));
+rd->file = sim_fopen (filename, "rb");
+if (rd->file == NULL)
+    return sim_messagef (SCPE_OPENERR, "Can't open %s: %s\n", filename, strerror (errno));
+if ((fread (buf, 1, 28, rd->file) != 28) || memcmp (buf, EXTR_MAGIC, 8) ||
+    (_sim_extr_get_le (buf + 8, 4) != EXTR_VERSION))
+    return sim_messagef (SCPE_FMT, "%s is not an execution trace file\n", filename);
+hlen = (uint32)_sim_extr_get_le (buf + 12, 4);
+rd->nregs = (uint32)_sim_extr_get_le (buf + 16, 4);
+rd->radix = (uint32)_sim_extr_get_le (buf + 20, 4);
+rd->width = (uint32)_sim_extr_get_le (buf + 24, 4);
+if ((hlen < 28) || (rd->nregs > EXTR_MAXREGS))
+    return sim_messagef (SCPE_FMT, "Invalid execution trace header in %s\n", filename);
+rd->names = (char *)calloc (1, hlen - 28 + 1);
+rd->regnames = (const char **)calloc (rd->nregs + 1, sizeof (*rd->regnames));
+rd->raw = (uint8 *)malloc (EXTR_BLOCKSIZE + EXTR_MAXREC);
+if ((rd->names == NULL) || (rd->regnames == NULL) || (rd->raw == NULL))
+    return SCPE_MEM;
+if (fread (rd->names, 1, hlen - 28, rd->file) != hlen - 28)
+    return sim_messagef (SCPE_FMT, "Invalid execution trace header in %s\n", filename);
+for (i = 0, name = rd->names + strlen (rd->names) + 1; i < rd->nregs; i++) {
+    if (name >= rd->names + (hlen - 28))
+        return sim_messagef (SCPE_FMT, "Invalid execution trace header in %s\n", filename);
+    rd->regnames[i] = name;
+    name += strlen (name) + 1;
+    }
+size = sim_fsize_ex (rd->file);
+if ((size >= (t_offset)(hlen + 16)) &&                  /* index present? */
+    (sim_fseeko (rd->file, size - 16, SEEK_SET) == 0) &&
+    (fread (buf, 1, 16, rd->file) == 16) &&
+    (memcmp (buf, EXTR_TRAILER, 8) == 0)) {
+    uint32 nblocks;
+
+    offset = (t_offset)_sim_extr_get_le (buf + 8, 8);
+    if ((sim_fseeko (rd->file, offset, SEEK_SET) == 0) &&
+        (fread (buf, 1, EXTR_BLKHDR, rd->file) == EXTR_BLKHDR) &&
+        (_sim_extr_get_le (buf, 4) == EXTR_INDEX)) {
+        nblocks = (uint32)_sim_extr_get_le (buf + 12, 4);
+        for (i = 0; i < nblocks; i++) {
+            uint8 ent[16];
+
+            if ((fread (ent, 1, 16, rd->file) != 16) ||
+                (_sim_extr_add_block (rd, _sim_extr_get_le (ent, 8), _sim_extr_get_le (ent + 8, 8)) != SCPE_OK))
+                break;
+            }
+        if (i == nblocks)
+            return SCPE_OK;
+        }
+    rd->nblocks = 0;
+    }
+offset = hlen;                                          /* no index, scan the block headers */
+while ((sim_fseeko (rd->file, offset, SEEK_SET) == 0) &&
+       (fread (buf, 1, EXTR_BLKHDR, rd->file) == EXTR_BLKHDR) &&
+       (_sim_extr_get_le (buf, 4) == EXTR_BLOCK)) {
+    if (_sim_extr_add_block (rd, (t_uint64)offset, _sim_extr_get_le (buf + 16, 8)) != SCPE_OK)
+        return SCPE_MEM;
+    offset += EXTR_BLKHDR + (t_offset)_sim_extr_get_le (buf + 4, 4);
+    }
+return SCPE_OK;
+}
+
+/* Read a block's payload, returning its raw length or -1 */
+
+static int32 _sim_extr_read_block (EXTRREAD *rd, uint32 blk, t_uint64 *first)
+{
+uint8 hdr[EXTR_BLKHDR];
+uint32 stored, raw, flags;
+
+if ((sim_fseeko (rd->file, (t_offset)rd->index[2 * blk], SEEK_SET) != 0) ||
+    (fread (hdr, 1, EXTR_BLKHDR, rd->file) != EXTR_BLKHDR) ||
+    (_sim_extr_get_le (hdr, 4) != EXTR_BLOCK))
+    return -1;
+stored = (uint32)_sim_extr_get_le (hdr + 4, 4);
+raw = (uint32)_sim_extr_get_le (hdr + 8, 4);
+flags = (uint32)_sim_extr_get_le (hdr + 32, 4);
+*first = _sim_extr_get_le (hdr + 16, 8);
+if ((raw > EXTR_BLOCKSIZE + EXTR_MAXREC) || (stored > EXTR_BLOCKSIZE + EXTR_MAXREC + 1024))
+    return -1;
+if (flags & EXTR_F_ZLIB) {
+#if defined (HAVE_ZLIB)
+    uLongf zlen = raw;
+
+    if (rd->stored == NULL)
+        rd->stored = (uint8 *)malloc (EXTR_BLOCKSIZE + EXTR_MAXREC + 1024);
+    if ((rd->stored == NULL) ||
+        (fread (rd->stored, 1, stored, rd->file) != stored) ||
+        (uncompress (rd->raw, &zlen, rd->stored, stored) != Z_OK) ||
+        (zlen != raw))
+        return -1;
+#else
+    return -1;
+#endif
+    }
+else {
+    if ((stored != raw) || (fread (rd->raw, 1, raw, rd->file) != raw))
+        return -1;
+    }
+return (int32)raw;
+}
+
+static const uint8 *_sim_extr_get_varint (const uint8 *p, const uint8 *end, t_uint64 *val)
+{
+int shift = 0;
+
+*val = 0;
+while (p < end) {
+    *val |= ((t_uint64)(*p & 0x7F)) << shift;
+    if (!(*p++ & 0x80))
+        return p;
+    shift += 7;
+    if (shift > 63)
+        break;
+    }
+return NULL;
+}
+
+static const uint8 *_sim_extr_get_svarint (const uint8 *p, const uint8 *end, t_uint64 *val)
+{
+p = _sim_extr_get_varint (p, end, val);
+*val = (*val >> 1) ^ (t_uint64)(-(t_int64)(*val & 1));
+return p;
+}
+
+static void _sim_extr_print_insn (FILE *st, EXTRREAD *rd, t_uint64 n, t_addr pc, const uint8 *inst, uint32 ilen,
+                                  const t_value *regs, t_uint64 changed)
+{
+t_bool same_sim = (strcmp (rd->names, sim_name) == 0);
+uint32 i;
+
+fprintf (st, "%12" LL_FMT "u  ", (unsigned LL_TYPE)n);
+fprint_val (st, (t_value)pc, rd->radix, rd->width, PV_RZRO);
+fprintf (st, ": ");
+if (same_sim && sim_dflt_dev && (sim_emax > 0)) {
+    uint32 bpu = (sim_dflt_dev->dwidth + 7) / 8;        /* bytes per addressable unit */
+    uint32 u, b;
+    t_stat r;
+
+    for (u = 0; u < (uint32)sim_emax; u++) {
+        sim_eval[u] = 0;
+        for (b = 0; b < bpu; b++)
+            if (u * bpu + b < ilen)
+                sim_eval[u] |= ((t_value)inst[u * bpu + b]) << (8 * b);
+        }
+    r = fprint_sym (st, pc, sim_eval, sim_dflt_dev->units, SWMASK ('M'));
+    if (r > 0)
+        fprint_val (st, sim_eval[0], sim_dflt_dev->dradix, sim_dflt_dev->dwidth, PV_RZRO);
+    }
+else {
+    for (i = 0; i < ilen; i++)
+        fprintf (st, "%02X", inst[i]);
+    }
+for (i = 0; i < rd->nregs; i++) {
+    if (changed & (((t_uint64)1) << i)) {
+        fprintf (st, " %s=", rd->regnames[i]);
+        fprint_val (st, regs[i], rd->radix, rd->width, PV_RZRO);
+        }
+    }
+fprintf (st, "\n");
+}
+
+static t_stat _sim_extr_show_file (FILE *st, const char *filename, t_uint64 start, t_uint64 count)
+{
+EXTRREAD rd;
+EXTRINST *icache = NULL;
+t_value regs[EXTR_MAXREGS], shown[EXTR_MAXREGS];
+t_uint64 n = 0, end, first;
+t_bool shown_valid = FALSE;
+uint32 blk;
+t_stat r;
+
+end = (count > ((t_uint64)-1) - start) ? (t_uint64)-1 : start + count;
+r = _sim_extr_open_read (&rd, filename);
+if (r != SCPE_OK) {
+    _sim_extr_close_read (&rd);
+    return r;
+    }
+for (blk = 0; (blk + 1 < rd.nblocks) && (rd.index[2 * (blk + 1) + 1] <= start); blk++) ;
+icache = (EXTRINST *)malloc (EXTR_ICACHE * sizeof (*icache));
+if (icache == NULL) {
+    _sim_extr_close_read (&rd);
+    return SCPE_MEM;
+    }
+for (; (blk < rd.nblocks) && (n <= end); blk++) {  /* through the block with the last one's writes */
+    int32 len = _sim_extr_read_block (&rd, blk, &first);
+    const uint8 *p = rd.raw, *lim;
+    t_addr pc = 0, next_pc = 0, mem_addr = 0;
+
+    if (len < 0) {
+        fprintf (st, "Invalid or unreadable block at offset %" LL_FMT "u\n", (unsigned LL_TYPE)rd.index[2 * blk]);
+        break;
+        }
+    lim = rd.raw + len;
+    n = first;
+    memset (regs, 0, sizeof (regs));
+    memset (icache, 0, EXTR_ICACHE * sizeof (*icache));
+    while ((p != NULL) && (p < lim)) {
+        uint8 tag = *p++;
+        t_uint64 val, changed = 0;
+
+        if (tag & EXTR_T_MEM) {                         /* memory write */
+            t_uint64 addr;
+
+            p = _sim_extr_get_svarint (p, lim, &addr);
+            if (p)
+                p = _sim_extr_get_varint (p, lim, &val);
+            mem_addr = (t_addr)(mem_addr + addr);
+            if (p && (n > start) && (n <= end)) {       /* belongs to instruction n - 1 */
+                fprintf (st, "%12s  write ", "");
+                fprint_val (st, (t_value)mem_addr, rd.radix, rd.width, PV_RZRO);
+                fprintf (st, " <- ");
+                fprint_val (st, (t_value)val, rd.radix, 8 * (tag & 0xF), PV_RZRO);
+                fprintf (st, "\n");
+                }
+            mem_addr = (t_addr)(mem_addr + (tag & 0xF));
+            continue;
+            }
+        if (n >= end)
+            break;
+        pc = next_pc;
+        if (tag & EXTR_T_PC) {
+            p = _sim_extr_get_svarint (p, lim, &val);
+            pc = (t_addr)(pc + val);
+            }
+        if (p && (tag & EXTR_T_INST)) {
+            EXTRINST *ic = &icache[((uint32)pc) & (EXTR_ICACHE - 1)];
+
+            if ((p >= lim) || (*p > EXTR_MAXINST) || (p + 1 + *p > lim)) {
+                p = NULL;
+                break;
+                }
+            ic->pc = pc;
+            ic->len = *p++;
+            memcpy (ic->inst, p, ic->len);
+            p += ic->len;
+            }
+        if (p && (tag & EXTR_T_REGS)) {
+            uint32 i;
+
+            p = _sim_extr_get_varint (p, lim, &changed);
+            for (i = 0; p && (i < rd.nregs); i++) {
+                if (changed & (((t_uint64)1) << i)) {
+                    p = _sim_extr_get_svarint (p, lim, &val);
+                    regs[i] = (t_value)(regs[i] + val);
+                    }
+                }
+            }
+        if (p == NULL)
+            break;
+        if (n >= start) {
+            EXTRINST *ic = &icache[((uint32)pc) & (EXTR_ICACHE - 1)];
+            t_uint64 show = 0;
+            uint32 i;
+
+            for (i = 0; i < rd.nregs; i++)              /* show what changed since the last line */
+                if (!shown_valid || (regs[i] != shown[i]))
+                    show |= ((t_uint64)1) << i;
+            memcpy (shown, regs, sizeof (shown));
+            shown_valid = TRUE;
+            _sim_extr_print_insn (st, &rd, n, pc, ic->inst, ic->len, regs, show);
+            }
+        next_pc = (t_addr)(pc + icache[((uint32)pc) & (EXTR_ICACHE - 1)].len);
+        ++n;
+        }
+    if (p == NULL) {
+        fprintf (st, "Invalid record in block at offset %" LL_FMT "u\n", (unsigned LL_TYPE)rd.index[2 * blk]);
+        break;
+        }
+    }
+free (icache);
+_sim_extr_close_read (&rd);
+return SCPE_OK;
+}
+
+t_stat sim_show_exectrace (FILE *st, DEVICE *dnotused, UNIT *unotused, int32 flag, CONST char *cptr)
+{
+char gbuf[4*CBUFSIZE];
+t_uint64 start = 0, count = (t_uint64)-1;
+
+if (cptr && *cptr) {                                    /* show a trace file */
+    cptr = get_glyph_nc (cptr, gbuf, 0);
+    if (*cptr) {
+        char nbuf[CBUFSIZE];
+
+        unsigned LL_TYPE val;
+        char c;
+
+        cptr = get_glyph (cptr, nbuf, 0);
+        if (sscanf (nbuf, "%" LL_FMT "u%c", &val, &c) != 1)
+            return sim_messagef (SCPE_ARG, "Invalid instruction number: %s\n", nbuf);
+        start = (t_uint64)val;
+        if (*cptr) {
+            cptr = get_glyph (cptr, nbuf, 0);
+            if ((sscanf (nbuf, "%" LL_FMT "u%c", &val, &c) != 1) || (val == 0))
+                return sim_messagef (SCPE_ARG, "Invalid instruction count: %s\n", nbuf);
+            count = (t_uint64)val;
+            }
+        if (*cptr)
+            return SCPE_2MARG;
+        }
+    if ((sim_extr.file != NULL) && (strcmp (gbuf, sim_extr.filename) == 0))
+        return sim_messagef (SCPE_ARG, "%s is still being recorded\n", gbuf);
+    return _sim_extr_show_file (st, gbuf, start, count);
+    }
+if (sim_vm_exectrace_regs == NULL) {
+    fprintf (st, "Execution tracing isn't supported by this simulator\n");
+    return SCPE_OK;
+    }
+if (sim_extr.file == NULL) {
+    fprintf (st, "Execution trace not being recorded\n");
+    return SCPE_OK;
+    }
+fprintf (st, "Recording execution trace to %s%s\n", sim_extr.filename, sim_extr.error ? " (write errors)" : "");
+fprintf (st, "  Instructions:   %s\n", sim_fmt_numeric ((double)sim_extr.insns));
+fprintf (st, "  Blocks written: %s\n", sim_fmt_numeric ((double)sim_extr.nblocks));
+fprintf (st, "  Encoded bytes:  %s", sim_fmt_numeric ((double)sim_extr.raw_bytes));
+fprintf (st, " (%.2f per instruction)\n", sim_extr.insns ? ((double)sim_extr.raw_bytes) / sim_extr.insns : 0.0);
+fprintf (st, "  File bytes:     %s", sim_fmt_numeric ((double)sim_extr.offset));
+fprintf (st, " (%.2f per instruction)\n", sim_extr.insns ? ((double)sim_extr.offset) / sim_extr.insns : 0.0);
+return SCPE_OK;
+}
+
+/* Event queue package
+
+        sim_activate            add entry to event queue
+        sim_activate_abs        add entry to event queue even if event already scheduled
+        sim_activate_notbefore  add entry to event queue even if event already scheduled
+                                but not before the specified time
+        sim_activate_after      add entry to event queue after a specified amount of wall time
+        sim_cancel              remove entry from event queue
+        sim_process_event       process entries on event queue
+        sim_is_active           see if entry is on event queue
+        sim_activate_time       return time until activation
+        sim_atime               return absolute time for an entry
+        sim_gtime               return global time
+        sim_qcount              return event queue entry count
+
+   Asynchronous events are set up by queueing a unit data structure
+   to the event queue with a timeout (in simulator units, relative
+   to the current time).  Each simulator 'times' these events by
+   counting down interval counter sim_interval.  When this reaches
+   zero the simulator calls sim_process_event to process the event
+   and to see if further events need to be processed, or sim_interval
+   reset to count the next one.
+
+   The event queue is maintained in clock order; entry timeouts are
+   RELATIVE to the time in the previous entry.  Alternatively (SET QUEUE
+   HEAP) the events are kept in a heap by absolute time, as described
+   above.
+
+   sim_process_event - process event
+
+   Inputs:
+        none
+   Outputs:
+        reason  =       reason code returned by any event processor,
+                        or 0 (SCPE_OK) if no exceptions
+*/
+
+static t_stat _sim_process_event (void);
+
+t_stat sim_process_event (void)
+{
+t_stat reason;
+double start;
+
+if (!sim_bench_active)
+    return _sim_process_event ();
+start = sim_timenow_double ();
+reason = _sim_process_event ();
+sim_bench_event_secs += sim_timenow_double () - start;
+return reason;
+}
+
+static t_stat _sim_process_event (void)
+{
+UNIT *uptr;
+t_stat reason, bare_reason;
+int32 sim_interval_catchup;
+
+if (stop_cpu) {                                         /* stop CPU? */
+    stop_cpu = 0;
+    return SCPE_STOP;
+    }
+AIO_UPDATE_QUEUE;
+UPDATE_SIM_TIME;                                        /* update sim time */
+if (sim_interval > 0) {
+    sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Interval not yet expired: %d\n", sim_interval);
+    return SCPE_OK;
+    }
+if (sim_clock_queue == QUEUE_LIST_END) {                /* queue empty? */
+    sim_interval = noqueue_time = NOQUEUE_WAIT;         /* flag queue empty */
+    sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Queue Empty New Interval = %d\n", sim_interval);
+    return SCPE_OK;
+    }
+sim_processing_event = TRUE;
+/* If sim_interval is negative, we've missed the opportunity to  */
+/* dispatch one or more events when they were scheduled to fire. */
+/* To accomodate this, we backup time to when the first event    */
+/* was supposed to fire and advance it from there until things   */
+/* have caught up.                                               */
+if (sim_interval < 0) {
+    sim_interval_catchup = sim_interval;
+    sim_interval = 0;
+    UPDATE_SIM_TIME;                          /* update sim time */
+    sim_debug (SIM_DBG_EVENT_NEG, &sim_scp_dev, "Processing event for %s with sim_interval = %d, event time = %.0f\n",
+        sim_uname (sim_clock_queue), sim_interval_catchup, sim_gtime ());
+    if (1) {
+        int32 next_time;
+        UNIT *next = _sim_clock_queue_second (&next_time);
+
+        if (next != QUEUE_LIST_END)
+            sim_debug (SIM_DBG_EVENT_NEG, &sim_scp_dev, "- Next event for %s after = %d\n",
+                sim_uname (next), next_time);
+        }
+    sim_time -= sim_clock_queue->time;
+    sim_rtime -= sim_clock_queue->time;
+    }
+else
+    sim_interval_catchup = 0;
+do {
+    uptr = _sim_clock_queue_pop ();                     /* get and remove first */
+    uptr->time = 0;
+    ++sim_bench_events;
+    if (sim_clock_queue != QUEUE_LIST_END) {
+        if (sim_interval_catchup < 0)
+            sim_interval = -sim_interval_catchup;
+        sim_interval += sim_interval_catchup + sim_clock_queue->time;
+        }
+    else
+        sim_interval = noqueue_time = NOQUEUE_WAIT;
+    AIO_EVENT_BEGIN(uptr);
+    if (uptr->usecs_remaining) {
+        sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Requeueing %s after %.0f usecs\n", sim_uname (uptr), uptr->usecs_remaining);
+        reason = sim_timer_activate_after (uptr, uptr->usecs_remaining);
+        }
+    else {
+        sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Processing Event for %s\n", sim_uname (uptr));
+        if (uptr->action != NULL) {
+            DEVICE *dptr = NULL;
+
+            if (sim_evstats_enabled)                    /* the lookup fills in uptr->dptr */
+                dptr = uptr->dptr ? uptr->dptr : find_dev_from_unit (uptr);
+
+            sim_event_unit = uptr;
+            if (dptr != NULL) {
+                t_uint64 start = _sim_host_nsec ();
+
+                reason = uptr->action (uptr);
+                dptr->ev_host_ns += _sim_host_nsec () - start;
+                ++dptr->ev_count;
+                }
+            else
+                reason = uptr->action (uptr);
+            sim_event_unit = NULL;
+            }
+        else
+            reason = SCPE_OK;
+        }
+    AIO_EVENT_COMPLETE(uptr, reason);
+    if (sim_interval_catchup < -1) {
+        sim_interval_catchup += sim_clock_queue->time;
+        sim_time += sim_clock_queue->time;
+        sim_rtime += sim_clock_queue->time;
+        }
+    else
+        sim_interval_catchup = 0;
+    bare_reason = SCPE_BARE_STATUS (reason);
+    if ((bare_reason != SCPE_OK)      && /* Provide context for unexpected errors */
+        (bare_reason >= SCPE_BASE)    &&
+        (bare_reason != SCPE_EXPECT)  &&
+        (bare_reason != SCPE_REMOTE)  &&
+        (bare_reason != SCPE_MTRLNT)  &&
+        (bare_reason != SCPE_STOP)    &&
+        (bare_reason != SCPE_STEP)    &&
+        (bare_reason != SCPE_RUNTIME) &&
+        (bare_reason != SCPE_EXIT)) {
+        if (bare_reason == SCPE_UNATT)
+            sim_messagef (reason, "\nUnexpected I/O error while processing event for %s - %s\n", sim_uname (uptr), sim_error_text (reason));
+        else
+            sim_messagef (reason, "\nUnexpected internal error while processing event for %s which returned %d - %s\n", sim_uname (uptr), reason, sim_error_text (reason));
+        }
+    } while ((reason == SCPE_OK) &&
+             ((sim_interval + sim_interval_catchup) <= 0) &&
+             (sim_clock_queue != QUEUE_LIST_END) &&
+             (!stop_cpu));
+
+if (sim_clock_queue == QUEUE_LIST_END) {                /* queue empty? */
+    sim_interval = noqueue_time = NOQUEUE_WAIT;         /* flag queue empty */
+    sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Processing Queue Complete New Interval = %d\n", sim_interval);
+    }
+else
+    sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Processing Queue Complete New Interval = %d(%s)\n", sim_interval, sim_uname(sim_clock_queue));
+
+if ((reason == SCPE_OK) && stop_cpu) {
+    stop_cpu = FALSE;
+    reason = SCPE_STOP;
+    }
+sim_processing_event = FALSE;
+return reason;
+}
+
+/* sim_activate - activate (queue) event
+
+   Inputs:
+        uptr    =       pointer to unit
+        event_time =    relative timeout
+   Outputs:
+        reason  =       result (SCPE_OK if ok)
+*/
+
+t_stat sim_activate (UNIT *uptr, int32 event_time)
+{
+if (uptr->dynflags & UNIT_TMR_UNIT)
+    return sim_timer_activate (uptr, event_time);
+return _sim_activate (uptr, event_time);
+}
+
+t_stat _sim_activate (UNIT *uptr, int32 event_time)
+{
+UNIT *cptr, *prvptr;
+int32 accum;
+
+AIO_ACTIVATE (_sim_activate, uptr, event_time);
+if (sim_is_active (uptr))                               /* already active? */
+    return SCPE_OK;
+UPDATE_SIM_TIME;                                        /* update sim time */
+
+sim_debug (SIM_DBG_ACTIVATE, &sim_scp_dev, "Activating %s delay=%d\n", sim_uname (uptr), event_time);
+if (sim_evstats_enabled &&                               /* rescheduled from event service? */
+    (sim_event_unit != NULL) &&
+    (sim_event_unit->dptr == uptr->dptr) && (uptr->dptr != NULL)) {
+    ++uptr->dptr->ev_resched;
+    uptr->dptr->ev_resched_time += event_time;
+    }
+
+if (sim_clock_heap_enabled) {
+    UNIT *first = sim_clock_queue;
+    double now = (first == QUEUE_LIST_END) ? sim_time : (first->event_time - first->time);
+
+    uptr->event_time = now + event_time;
+    _sim_heap_insert (uptr);
+    if (sim_clock_queue != first)                       /* new first entry? */
+        sim_clock_queue->time = event_time;
+    sim_interval = sim_clock_queue->time;
+    return SCPE_OK;
+    }
+prvptr = NULL;
+accum = 0;
+for (cptr = sim_clock_queue; cptr != QUEUE_LIST_END; cptr = cptr->next) {
+    if (event_time < (accum + cptr->time))
+        break;
+    accum = accum + cptr->time;
+    prvptr = cptr;
+    }
+if (prvptr == NULL) {                                   /* insert at head */
+    cptr = uptr->next = sim_clock_queue;
+    sim_clock_queue = uptr;
+    }
+else {
+    cptr = uptr->next = prvptr->next;                   /* insert at prvptr */
+    prvptr->next = uptr;
+    }
+uptr->time = event_time - accum;
+if (cptr != QUEUE_LIST_END)
+    cptr->time = cptr->time - uptr->time;
+sim_interval = sim_clock_queue->time;
+return SCPE_OK;
+}
+
+/* sim_activate_abs - activate (queue) event even if event already scheduled
+
+   Inputs:
+        uptr    =       pointer to unit
+        event_time =    relative timeout
+   Outputs:
+        reason  =       result (SCPE_OK if ok)
+*/
+
+t_stat sim_activate_abs (UNIT *uptr, int32 event_time)
+{
+AIO_ACTIVATE (sim_activate_abs, uptr, event_time);
+sim_cancel (uptr);
+return _sim_activate (uptr, event_time);
+}
+
+/* sim_activate_notbefore - activate (queue) event even if event already scheduled
+                            but not before the specified time
+
+   Inputs:
+        uptr    =       pointer to unit
+        rtime   =       relative timeout
+   Outputs:
+        reason  =       result (SCPE_OK if ok)
+*/
+
+t_stat sim_activate_notbefore (UNIT *uptr, int32 rtime)
+{
+uint32 rtimenow, urtime = (uint32)rtime;
+
+AIO_ACTIVATE (sim_activate_notbefore, uptr, rtime);
+sim_cancel (uptr);
+rtimenow = sim_grtime();
+sim_cancel (uptr);
+if (0x80000000 <= urtime-rtimenow)
+    return _sim_activate (uptr, 0);
+else
+    return sim_activate (uptr, urtime-rtimenow);
+}
+
+/* sim_activate_after - activate (queue) event
+
+   Inputs:
+        uptr    =       pointer to unit
+        usec_delay =    relative timeout (in microseconds)
+   Outputs:
+        reason  =       result (SCPE_OK if ok)
+*/
+
+t_stat sim_activate_after_abs (UNIT *uptr, uint32 usec_delay)
+{
+return _sim_activate_after_abs (uptr, (double)usec_delay);
+}
+
+t_stat sim_activate_after_abs_d (UNIT *uptr, double usec_delay)
+{
+return _sim_activate_after_abs (uptr, usec_delay);
+}
+
+t_stat _sim_activate_after_abs (UNIT *uptr, double usec_delay)
+{
+AIO_VALIDATE(uptr);             /* Can't call asynchronously */
+sim_cancel (uptr);
+return _sim_activate_after (uptr, usec_delay);
 }
 
 t_stat sim_activate_after (UNIT *uptr, uint32 usec_delay)
@@ -12184,7 +14807,17 @@ UPDATE_SIM_TIME;                                        /* update sim time */
 sim_debug (SIM_DBG_EVENT, &sim_scp_dev, "Canceling Event for %s\n", sim_uname(uptr));
 nptr = QUEUE_LIST_END;
 
-if (sim_clock_queue == uptr) {
+if (sim_clock_heap_enabled) {
+    if (_sim_heap_queued (uptr)) {
+        double now = sim_clock_queue->event_time - sim_clock_queue->time;
+        t_bool first = (sim_clock_queue == uptr);
+
+        _sim_heap_remove (uptr);
+        if (first && (sim_clock_queue != QUEUE_LIST_END))
+            sim_clock_queue->time = (int32)(sim_clock_queue->event_time - now);
+        }
+    }
+else if (sim_clock_queue == uptr) {
     nptr = sim_clock_queue = uptr->next;
     uptr->next = NULL;                                  /* hygiene */
     }
@@ -12238,12 +14871,19 @@ return (((uptr->next) || AIO_IS_ACTIVE(uptr) || ((uptr->dynflags & UNIT_TMR_UNIT
         result =        absolute activation time + 1, 0 if inactive
 */
 
-int32 _sim_activate_queue_time (UNIT *uptr)
+static int32 _sim_clock_queue_accum (UNIT *uptr)
 {
 UNIT *cptr;
 int32 accum;
 
 accum = 0;
+if (sim_clock_heap_enabled) {
+    if (!_sim_heap_queued (uptr))
+        return -1;
+    if (sim_interval > 0)
+        accum = accum + sim_interval;
+    return accum + (int32)(uptr->event_time - sim_clock_queue->event_time);
+    }
 for (cptr = sim_clock_queue; cptr != QUEUE_LIST_END; cptr = cptr->next) {
     if (cptr == sim_clock_queue) {
         if (sim_interval > 0)
@@ -12252,9 +14892,16 @@ for (cptr = sim_clock_queue; cptr != QUEUE_LIST_END; cptr = cptr->next) {
     else
         accum = accum + cptr->time;
     if (cptr == uptr)
-        return accum + 1;
+        return accum;
     }
-return 0;
+return -1;
+}
+
+int32 _sim_activate_queue_time (UNIT *uptr)
+{
+int32 accum = _sim_clock_queue_accum (uptr);
+
+return (accum < 0) ? 0 : accum + 1;
 }
 
 int32 _sim_activate_time (UNIT *uptr)
@@ -12279,7 +14926,6 @@ return _sim_activate_time (uptr);
 
 double sim_activate_time_usecs (UNIT *uptr)
 {
-UNIT *cptr;
 int32 accum;
 double result;
 
@@ -12287,18 +14933,10 @@ AIO_VALIDATE(uptr);
 result = sim_timer_activate_time_usecs (uptr);
 if (result >= 0)
     return result;
-accum = 0;
-for (cptr = sim_clock_queue; cptr != QUEUE_LIST_END; cptr = cptr->next) {
-    if (cptr == sim_clock_queue) {
-        if (sim_interval > 0)
-            accum = accum + sim_interval;
-        }
-    else
-        accum = accum + cptr->time;
-    if (cptr == uptr)
-        return 1.0 + uptr->usecs_remaining + ((1000000.0 * accum) / sim_timer_inst_per_sec ());
-    }
-return 0.0;
+accum = _sim_clock_queue_accum (uptr);
+if (accum < 0)
+    return 0.0;
+return 1.0 + uptr->usecs_remaining + ((1000000.0 * accum) / sim_timer_inst_per_sec ());
 }
 
 /* sim_gtime - return global time
@@ -12335,6 +14973,8 @@ int32 sim_qcount (void)
 int32 cnt;
 UNIT *uptr;
 
+if (sim_clock_heap_enabled)
+    return (int32)sim_clock_heap_count;
 cnt = 0;
 for (uptr = sim_clock_queue; uptr != QUEUE_LIST_END; uptr = uptr->next)
     cnt++;
@@ -12360,6 +15000,11 @@ return cnt;
    is the bitwise OR of all the type fields).  A simulator need only check for
    a breakpoint of type X if bit SWMASK('X') is set in sim_brk_summ.
 
+   sim_brk_pgmap is a bitmap with a bit for each page (2**SIM_BRK_PG_V
+   addresses) which contains a breakpoint.  Large address spaces fold onto
+   the map, so a set bit means there may be a breakpoint on the page, while
+   a clear bit means there is none and sim_brk_test needn't search the table.
+
    The package contains the following public routines:
 
         sim_brk_init            initialize
@@ -12397,6 +15042,7 @@ sim_brk_tab = (BRKTAB **) realloc (sim_brk_tab, sim_brk_lnt*sizeof (BRKTAB*));
 if (sim_brk_tab == NULL)
     return SCPE_MEM;
 memset (sim_brk_tab, 0, sim_brk_lnt*sizeof (BRKTAB*));
+memset (sim_brk_pgmap, 0, sizeof (sim_brk_pgmap));
 sim_brk_ent = sim_brk_ins = 0;
 sim_brk_clract ();
 sim_brk_npc (0);
@@ -12459,12 +15105,11 @@ BRKTAB *bp, **newp;
 if (sim_brk_ins < 0)
     return NULL;
 if (sim_brk_ent >= sim_brk_lnt) {                       /* out of space? */
-    t = sim_brk_lnt + SIM_BRK_INILNT;                   /* new size */
+    t = 2 * sim_brk_lnt;                                /* new size */
     newp = (BRKTAB **) calloc (t, sizeof (BRKTAB*));    /* new table */
     if (newp == NULL)                                   /* can't extend */
         return NULL;
     memcpy (newp, sim_brk_tab, sim_brk_lnt * sizeof (*sim_brk_tab));/* copy table */
-    memset (newp + sim_brk_lnt, 0, SIM_BRK_INILNT * sizeof (*newp));/* zero new entries */
     free (sim_brk_tab);                                 /* free old table */
     sim_brk_tab = newp;                                 /* new base, lnt */
     sim_brk_lnt = t;
@@ -12472,8 +15117,8 @@ if (sim_brk_ent >= sim_brk_lnt) {                       /* out of space? */
 if ((sim_brk_ins == sim_brk_ent) ||
     ((sim_brk_ins != sim_brk_ent) &&
      (sim_brk_tab[sim_brk_ins]->addr != loc))) {        /* need to open a hole? */
-    for (i = sim_brk_ent; i > sim_brk_ins; --i)
-        sim_brk_tab[i] = sim_brk_tab[i - 1];
+    memmove (&sim_brk_tab[sim_brk_ins + 1], &sim_brk_tab[sim_brk_ins],
+             (sim_brk_ent - sim_brk_ins) * sizeof (*sim_brk_tab));
     sim_brk_tab[sim_brk_ins] = NULL;
     }
 bp = (BRKTAB *)calloc (1, sizeof (*bp));
@@ -12481,6 +15126,7 @@ bp->next = sim_brk_tab[sim_brk_ins];
 sim_brk_tab[sim_brk_ins] = bp;
 if (bp->next == NULL)
     sim_brk_ent += 1;
+SIM_BRK_PG_SET (loc);                                   /* page has a breakpoint */
 bp->addr = loc;
 bp->typ = btyp;
 bp->cnt = 0;
@@ -12533,13 +15179,32 @@ sim_brk_summ = sim_brk_summ | (sw & ~BRK_TYP_TEMP);
 return SCPE_OK;
 }
 
+/* Recalculate the breakpoint summary and page map after breakpoints
+   have been removed */
+
+static void _sim_brk_recalc (void)
+{
+BRKTAB *bp;
+int32 i;
+
+sim_brk_summ = 0;                                       /* recalc summary */
+memset (sim_brk_pgmap, 0, sizeof (sim_brk_pgmap));      /* and page map */
+for (i = 0; i < sim_brk_ent; i++) {
+    bp = sim_brk_tab[i];
+    SIM_BRK_PG_SET (bp->addr);
+    while (bp) {
+        sim_brk_summ |= (bp->typ & ~BRK_TYP_TEMP);
+        bp = bp->next;
+        }
+    }
+}
+
 /* Clear a breakpoint */
 
 t_stat sim_brk_clr (t_addr loc, int32 sw)
 {
 BRKTAB *bpl = NULL;
 BRKTAB *bp = sim_brk_fnd (loc);
-int32 i;
 
 if (!bp)                                                /* not there? ok */
     return SCPE_OK;
@@ -12563,35 +15228,51 @@ while (bp) {
     }
 if (sim_brk_tab[sim_brk_ins] == NULL) {                 /* erased entry */
     sim_brk_ent = sim_brk_ent - 1;                      /* decrement count */
-    for (i = sim_brk_ins; i < sim_brk_ent; i++)         /* shuffle remaining entries */
-        sim_brk_tab[i] = sim_brk_tab[i+1];
-    }
-sim_brk_summ = 0;                                       /* recalc summary */
-for (i = 0; i < sim_brk_ent; i++) {
-    bp = sim_brk_tab[i];
-    while (bp) {
-        sim_brk_summ |= (bp->typ & ~BRK_TYP_TEMP);
-        bp = bp->next;
-        }
+    memmove (&sim_brk_tab[sim_brk_ins], &sim_brk_tab[sim_brk_ins + 1],
+             (sim_brk_ent - sim_brk_ins) * sizeof (*sim_brk_tab));
+    sim_brk_tab[sim_brk_ent] = NULL;
     }
+_sim_brk_recalc ();
 return SCPE_OK;
 }
 
-/* Clear all breakpoints */
+/* Clear all breakpoints
+
+   The table is compacted in a single pass and the summary and page map
+   are recalculated once, rather than once per breakpoint removed. */
 
 t_stat sim_brk_clrall (int32 sw)
 {
-int32 i;
+int32 i, j;
 
 if (sw == 0)
     sw = SIM_BRK_ALLTYP;
-for (i = 0; i < sim_brk_ent;) {
-    t_addr loc = sim_brk_tab[i]->addr;
-    sim_brk_clr (loc, sw);
-    if ((i < sim_brk_ent) &&
-        (loc == sim_brk_tab[i]->addr))
-        ++i;
+for (i = j = 0; i < sim_brk_ent; i++) {
+    BRKTAB *bpl = NULL;
+    BRKTAB *bp = sim_brk_tab[i];
+
+    while (bp) {
+        BRKTAB *next = bp->next;
+
+        if (bp->typ == (bp->typ & sw)) {
+            free (bp->act);                             /* deallocate action */
+            if (bpl)
+                bpl->next = next;                       /* remove from middle of list */
+            else
+                sim_brk_tab[i] = next;                  /* remove from head of list */
+            free (bp);
+            }
+        else
+            bpl = bp;
+        bp = next;
+        }
+    if (sim_brk_tab[i] != NULL)                         /* anything left at this address? */
+        sim_brk_tab[j++] = sim_brk_tab[i];
     }
+for (i = j; i < sim_brk_ent; i++)
+    sim_brk_tab[i] = NULL;
+sim_brk_ent = j;
+_sim_brk_recalc ();
 return SCPE_OK;
 }
 
@@ -12713,6 +15394,8 @@ uint32 sim_brk_test (t_addr loc, uint32 btyp)
 BRKTAB *bp;
 uint32 spc = (btyp >> SIM_BKPT_V_SPC) & (SIM_BKPT_N_SPC - 1);
 
+if (!SIM_BRK_PG_TEST (loc))                             /* nothing on this page? */
+    return 0;
 if (sim_brk_summ & BRK_TYP_DYN_ALL)
     btyp |= BRK_TYP_DYN_ALL;
 
@@ -12901,24 +15584,233 @@ return msg;
 
    All active expect rules are contained in an expect match context structure.
 
-        rules                   the match rules
-        size                    the count of match rules
-        buf                     the buffer of output data which has been produced
-        buf_ins                 the buffer insertion point for the next output data
-        buf_size                the buffer size
+        rules                   the match rules
+        size                    the count of match rules
+        buf                     the buffer of output data which has been produced
+        buf_ins                 the buffer insertion point for the next output data
+        buf_size                the buffer size
+
+   The package contains the following public routines:
+
+        sim_set_expect          expect command parser and initializer
+        sim_set_noexpect        noexpect command parser
+        sim_exp_init            initialize an expect context
+        sim_exp_set             set or add an expect rule
+        sim_exp_clr             clear or delete an expect rule
+        sim_exp_clrall          clear all expect rules
+        sim_exp_show            show an expect rule
+        sim_exp_showall         show all expect rules
+        sim_exp_check           test for rule match
+
+   Rules aren't evaluated one at a time.  The first time output is checked
+   after the rules change, they are compiled into a single matcher:
+
+        - all literal rules become one Aho-Corasick automaton, so each output
+          character costs a single table lookup no matter how many literal
+          rules are active.
+        - regular expression rules which can safely be combined are joined
+          into one alternation which is evaluated once per character.  Only
+          when that combined expression matches are the individual rules
+          evaluated to determine which one matched and to capture its
+          sub-groups.
+
+   When more than one rule matches at the same point, the rule defined first
+   wins, just as if the rules had been evaluated in order.
+*/
+
+#define EXP_NOMATCH     0xFFFFFFFF                      /* automaton state with no matching rule */
+
+struct EXPMATCH {
+    uint32              state;                          /* current automaton state */
+    uint32              nstates;                        /* automaton state count */
+    uint32              nclasses;                       /* input byte class count */
+    uint16              cls[256];                       /* input byte to class map */
+    uint32              *delta;                         /* transitions [state * nclasses + class] */
+    uint32              *out;                           /* first rule matching in each state */
+    size_t              literals;                       /* literal rule count */
+    size_t              regexes;                        /* regular expression rule count */
+#if defined(USE_REGEX)
+    pcre                *regex;                         /* combined regular expression */
+    pcre_extra          *regex_extra;                   /* study data for combined expression */
+    size_t              combined;                       /* rules in combined expression */
+    uint8               *in_combined;                   /* per rule flag: part of combined expression */
+#endif
+    };
+
+static void _sim_exp_free_matcher (EXPECT *exp)
+{
+EXPMATCH *mp = exp->matcher;
+
+if (mp == NULL)
+    return;
+free (mp->delta);
+free (mp->out);
+#if defined(USE_REGEX)
+if (mp->regex_extra)
+    pcre_free_study (mp->regex_extra);
+if (mp->regex)
+    pcre_free (mp->regex);
+free (mp->in_combined);
+#endif
+free (mp);
+exp->matcher = NULL;
+}
+
+#if defined(USE_REGEX)
+/* A regular expression can be part of the combined alternation if wrapping it
+   in a group can't change its meaning.  Back references (which would be
+   renumbered), pattern start options, recursion and quoting are excluded. */
+
+static t_bool _sim_exp_regex_combinable (const char *re, size_t len)
+{
+size_t i;
+
+for (i = 0; i < len; i++) {
+    if (re[i] == '\\') {
+        if ((++i == len) || strchr ("123456789gkQ", re[i]))
+            return FALSE;
+        continue;
+        }
+    if ((re[i] == '(') && (i + 1 < len) &&
+        ((re[i + 1] == '*') || ((re[i + 1] == '?') && ((i + 2 == len) || (re[i + 2] != ':')))))
+        return FALSE;
+    }
+return TRUE;
+}
+#endif
+
+/* Build the combined matcher for the current rules */
+
+static t_stat _sim_exp_compile (EXPECT *exp)
+{
+EXPMATCH *mp;
+size_t i, j, n, total = 1;
+uint32 s, t, c, head, tail;
+uint32 *fail, *queue;
+
+_sim_exp_free_matcher (exp);
+mp = (EXPMATCH *)calloc (1, sizeof (*mp));
+if (mp == NULL)
+    return SCPE_MEM;
+mp->nclasses = 1;                                       /* class 0: bytes in no literal rule */
+for (i = 0; i < exp->size; i++) {
+    EXPTAB *ep = &exp->rules[i];
+
+    if (ep->switches & EXP_TYP_REGEX) {
+        ++mp->regexes;
+        continue;
+        }
+    ++mp->literals;
+    total += ep->size;
+    for (j = 0; j < ep->size; j++)
+        if (mp->cls[ep->match[j]] == 0)
+            mp->cls[ep->match[j]] = (uint16)mp->nclasses++;
+    }
+mp->delta = (uint32 *)calloc (total * mp->nclasses, sizeof (*mp->delta));
+mp->out = (uint32 *)malloc (total * sizeof (*mp->out));
+fail = (uint32 *)calloc (total, sizeof (*fail));
+queue = (uint32 *)malloc (total * sizeof (*queue));
+if ((mp->delta == NULL) || (mp->out == NULL) || (fail == NULL) || (queue == NULL)) {
+    free (fail);
+    free (queue);
+    exp->matcher = mp;
+    _sim_exp_free_matcher (exp);
+    return SCPE_MEM;
+    }
+for (s = 0; s < total; s++)
+    mp->out[s] = EXP_NOMATCH;
+mp->nstates = 1;
+for (i = 0; i < exp->size; i++) {                       /* build the trie of literal rules */
+    EXPTAB *ep = &exp->rules[i];
+
+    if (ep->switches & EXP_TYP_REGEX)
+        continue;
+    for (j = 0, s = 0; j < ep->size; j++) {
+        uint32 *next = &mp->delta[s * mp->nclasses + mp->cls[ep->match[j]]];
+
+        if (*next == 0)
+            *next = mp->nstates++;
+        s = *next;
+        }
+    if (mp->out[s] == EXP_NOMATCH)                      /* earliest rule wins */
+        mp->out[s] = (uint32)i;
+    }
+head = tail = 0;                                        /* add failure transitions breadth first */
+for (c = 0; c < mp->nclasses; c++)
+    if ((t = mp->delta[c]))
+        queue[tail++] = t;
+while (head < tail) {
+    s = queue[head++];
+    if (mp->out[fail[s]] < mp->out[s])                  /* rules matching a suffix match here too */
+        mp->out[s] = mp->out[fail[s]];
+    for (c = 0; c < mp->nclasses; c++) {
+        t = mp->delta[s * mp->nclasses + c];
+        if (t) {
+            fail[t] = mp->delta[fail[s] * mp->nclasses + c];
+            queue[tail++] = t;
+            }
+        else
+            mp->delta[s * mp->nclasses + c] = mp->delta[fail[s] * mp->nclasses + c];
+        }
+    }
+free (fail);
+free (queue);
+#if defined(USE_REGEX)
+if (mp->regexes > 1) {
+    char *pattern;
+    size_t plen = 1;
+    const char *errmsg;
+    int erroffset;
 
-   The package contains the following public routines:
+    mp->in_combined = (uint8 *)calloc (exp->size, sizeof (*mp->in_combined));
+    for (i = 0; i < exp->size; i++)
+        if (exp->rules[i].switches & EXP_TYP_REGEX)
+            plen += strlen (exp->rules[i].match_pattern) + 6;
+    pattern = (char *)malloc (plen);
+    if ((mp->in_combined == NULL) || (pattern == NULL)) {
+        free (pattern);
+        exp->matcher = mp;
+        _sim_exp_free_matcher (exp);
+        return SCPE_MEM;
+        }
+    pattern[0] = '\0';
+    for (i = 0; i < exp->size; i++) {
+        EXPTAB *ep = &exp->rules[i];
 
-        sim_set_expect          expect command parser and initializer
-        sim_set_noexpect        noexpect command parser
-        sim_exp_init            initialize an expect context
-        sim_exp_set             set or add an expect rule
-        sim_exp_clr             clear or delete an expect rule
-        sim_exp_clrall          clear all expect rules
-        sim_exp_show            show an expect rule
-        sim_exp_showall         show all expect rules
-        sim_exp_check           test for rule match
-*/
+        if (!(ep->switches & EXP_TYP_REGEX))
+            continue;
+        n = strlen (ep->match_pattern) - 2;             /* without surrounding quotes */
+        if (!_sim_exp_regex_combinable (ep->match_pattern + 1, n))
+            continue;
+        sprintf (&pattern[strlen (pattern)], "%s(?%s:%.*s)", mp->combined ? "|" : "",
+                 (ep->switches & EXP_TYP_REGEX_I) ? "i" : "", (int)n, ep->match_pattern + 1);
+        mp->in_combined[i] = 1;
+        ++mp->combined;
+        }
+    if (mp->combined > 1)
+        mp->regex = pcre_compile (pattern, 0, &errmsg, &erroffset, NULL);
+    if (mp->regex) {
+        mp->regex_extra = pcre_study (mp->regex, 0, &errmsg);
+        sim_debug (exp->dbit, exp->dptr, "Expect Combined Regular Expression: \"%s\"\n", pattern);
+        }
+    else {                                              /* evaluate each rule by itself */
+        memset (mp->in_combined, 0, exp->size);
+        mp->combined = 0;
+        }
+    free (pattern);
+    }
+#endif
+if (exp->buf_size) {                                    /* catch up with the data already buffered */
+    n = MIN (exp->buf_data, exp->buf_size);
+    for (j = n; j > 0; j--)
+        mp->state = mp->delta[mp->state * mp->nclasses +
+                              mp->cls[exp->buf[(exp->buf_ins + exp->buf_size - j) % exp->buf_size]]];
+    }
+sim_debug (exp->dbit, exp->dptr, "Expect Matcher: %d literal rules, %d states, %d byte classes, %d regular expression rules\n",
+           (int)mp->literals, (int)mp->nstates, (int)mp->nclasses, (int)mp->regexes);
+exp->matcher = mp;
+return SCPE_OK;
+}
 
 /*   Initialize an expect context. */
 
@@ -13017,9 +15909,13 @@ free (ep->match);                                       /* deallocate match stri
 free (ep->match_pattern);                               /* deallocate the display format match string */
 free (ep->act);                                         /* deallocate action */
 #if defined(USE_REGEX)
-if (ep->switches & EXP_TYP_REGEX)
+if (ep->switches & EXP_TYP_REGEX) {
+    if (ep->regex_extra)
+        pcre_free_study (ep->regex_extra);              /* release study data */
     pcre_free (ep->regex);                              /* release compiled regex */
+    }
 #endif
+_sim_exp_free_matcher (exp);                            /* rule numbers change */
 exp->size -= 1;                                         /* decrement count */
 for (i=ep-exp->rules; i<exp->size; i++)                 /* shuffle up remaining rules */
     exp->rules[i] = exp->rules[i+1];
@@ -13052,10 +15948,14 @@ for (i=0; i<exp->size; i++) {
     free (exp->rules[i].match_pattern);                 /* deallocate display format match string */
     free (exp->rules[i].act);                           /* deallocate action */
 #if defined(USE_REGEX)
-    if (exp->rules[i].switches & EXP_TYP_REGEX)
+    if (exp->rules[i].switches & EXP_TYP_REGEX) {
+        if (exp->rules[i].regex_extra)
+            pcre_free_study (exp->rules[i].regex_extra);/* release study data */
         pcre_free (exp->rules[i].regex);                /* release compiled regex */
+        }
 #endif
     }
+_sim_exp_free_matcher (exp);
 free (exp->rules);
 exp->rules = NULL;
 exp->size = 0;
@@ -13124,6 +16024,7 @@ if (after && exp->size)
 exp->rules = (EXPTAB *) realloc (exp->rules, sizeof (*exp->rules)*(exp->size + 1));
 ep = &exp->rules[exp->size];
 exp->size += 1;
+_sim_exp_free_matcher (exp);                            /* rebuild when next checked */
 memset (ep, 0, sizeof(*ep));
 ep->after = after;                                     /* set halt after value */
 ep->match_pattern = (char *)malloc (strlen (match) + 1);
@@ -13146,6 +16047,7 @@ if (switches & EXP_TYP_REGEX) {
     match_buf[strlen(match)-2] = '\0';
     ep->regex = pcre_compile ((char *)match_buf, (switches & EXP_TYP_REGEX_I) ? PCRE_CASELESS : 0, &errmsg, &erroffset, NULL);
     (void)pcre_fullinfo(ep->regex, NULL, PCRE_INFO_CAPTURECOUNT, &ep->re_nsub);
+    ep->regex_extra = pcre_study (ep->regex, 0, &errmsg);
 #endif
     free (match_buf);
     match_buf = NULL;
@@ -13232,6 +16134,7 @@ if (exp->buf_size) {
     }
 if (exp->dptr && (exp->dbit & exp->dptr->dctrl))
     fprintf (st, "  Expect Debugging via: SET %s DEBUG%s%s\n", sim_dname(exp->dptr), exp->dptr->debflags ? "=" : "", exp->dptr->debflags ? _get_dbg_verb (exp->dbit, exp->dptr, NULL) : "");
+sim_exp_show_stats (st, exp);
 fprintf (st, "  Match Rules:\n");
 if (!*match)
     return sim_exp_showall (st, exp);
@@ -13246,6 +16149,43 @@ do {
 return SCPE_OK;
 }
 
+/* Show expect matching statistics */
+
+t_stat sim_exp_show_stats (FILE *st, const EXPECT *exp)
+{
+size_t i;
+
+if (exp->chars == 0)
+    return SCPE_OK;
+fprintf (st, "  Characters Scanned: %s\n", sim_fmt_numeric ((double)exp->chars));
+if (exp->matcher) {
+    fprintf (st, "  Literal Matcher: %d rule%s, %d states, %d byte classes\n", (int)exp->matcher->literals,
+             (exp->matcher->literals == 1) ? "" : "s", (int)exp->matcher->nstates, (int)exp->matcher->nclasses);
+#if defined(USE_REGEX)
+    if (exp->matcher->combined)
+        fprintf (st, "  Combined RegEx: %d rules\n", (int)exp->matcher->combined);
+#endif
+    }
+if (exp->regex_passes)
+    fprintf (st, "  Combined RegEx Evaluations: %s, %.3f msecs, %.0f ns/eval\n", sim_fmt_numeric ((double)exp->regex_passes),
+             exp->regex_ns / 1000000.0, ((double)exp->regex_ns) / exp->regex_passes);
+if (exp->size == 0)
+    return SCPE_OK;
+fprintf (st, "  Rule Statistics:\n");
+fprintf (st, "    %10s %12s %12s %10s  %s\n", "Matches", "Evaluations", "Host msecs", "ns/eval", "Rule");
+for (i = 0; i < exp->size; i++) {
+    const EXPTAB *ep = &exp->rules[i];
+
+    fprintf (st, "    %10s", sim_fmt_numeric ((double)ep->matches));
+    if (ep->switches & EXP_TYP_REGEX)
+        fprintf (st, " %12s %12.3f %10.0f  %s\n", sim_fmt_numeric ((double)ep->checks), ep->host_ns / 1000000.0,
+                 ep->checks ? ((double)ep->host_ns) / ep->checks : 0.0, ep->match_pattern);
+    else                                                /* literal rules share the automaton */
+        fprintf (st, " %12s %12s %10s  %s\n", "-", "-", "-", ep->match_pattern);
+    }
+return SCPE_OK;
+}
+
 /* Show all expect rules */
 
 t_stat sim_exp_showall (FILE *st, const EXPECT *exp)
@@ -13257,150 +16197,138 @@ for (i=0; i < exp->size; i++)
 return SCPE_OK;
 }
 
+#if defined (USE_REGEX)
+/* Evaluate a single regular expression rule against the buffered data */
+
+static t_bool _sim_exp_regex_check (EXPECT *exp, EXPTAB *ep, char *cbuf)
+{
+int *ovector = NULL;
+int ovector_elts;
+int rc;
+t_uint64 start;
+static size_t sim_exp_match_sub_count = 0;
+
+ovector_elts = 3 * (ep->re_nsub + 1);
+ovector = (int *)calloc ((size_t) ovector_elts, sizeof(*ovector));
+if (sim_deb && exp->dptr && (exp->dptr->dctrl & exp->dbit)) {
+    char *estr = sim_encode_quoted_string (exp->buf, exp->buf_ins);
+    sim_debug (exp->dbit, exp->dptr, "Checking String: %s\n", estr);
+    sim_debug (exp->dbit, exp->dptr, "Against RegEx Match Rule: %s\n", ep->match_pattern);
+    free (estr);
+    }
+/* exp->buf_ins is never going to exceed 1024 (current limit), so this is safe to
+   downcast to int. */
+start = _sim_host_nsec ();
+rc = pcre_exec (ep->regex, ep->regex_extra, cbuf, (int) exp->buf_ins, 0, PCRE_NOTBOL, ovector, ovector_elts);
+ep->host_ns += _sim_host_nsec () - start;
+++ep->checks;
+if (rc >= 0) {
+    size_t j;
+    char *buf = (char *)malloc (1 + exp->buf_ins);
+
+    for (j=0; j < (size_t)rc; j++) {
+        char env_name[32];
+        int end_offs = ovector[2 * j + 1], start_offs = ovector[2 * j];
+
+        sprintf (env_name, "_EXPECT_MATCH_GROUP_%d", (int)j);
+        if (start_offs >= 0 && end_offs >= start_offs) {
+            memcpy (buf, &cbuf[start_offs], end_offs - start_offs);
+            buf[end_offs - start_offs] = '\0';
+            setenv (env_name, buf, 1);      /* Make the match and substrings available as environment variables */
+            sim_debug (exp->dbit, exp->dptr, "%s=%s\n", env_name, buf);
+            }
+        else {
+            /* Substring was not captured by regexp: remove from the environment
+             * (unsetenv is local static -- doesn't actually remove the variable from
+             * the environment, sets it to an empty string.) */
+            sim_debug (exp->dbit, exp->dptr, "unsetenv %s\n", env_name);
+            unsetenv(env_name);
+            }
+        }
+    for (; j<sim_exp_match_sub_count; j++) {
+        char env_name[32];
+
+        sprintf (env_name, "_EXPECT_MATCH_GROUP_%d", (int)j);
+        setenv (env_name, "", 1);      /* Remove previous extra environment variables */
+        }
+    sim_exp_match_sub_count = ep->re_nsub;
+    free (buf);
+    }
+free (ovector);
+return (rc >= 0);
+}
+#endif
+
 /* Test for expect match */
 
 t_stat sim_exp_check (EXPECT *exp, uint8 data)
 {
 size_t i;
 EXPTAB *ep = NULL;
-int regex_checks = 0;
+EXPMATCH *mp;
 char *tstr = NULL;
 
 if ((!exp) || (!exp->rules))                            /* Anything to check? */
     return SCPE_OK;
+if ((!exp->matcher) &&                                  /* Rules changed? */
+    (SCPE_OK != _sim_exp_compile (exp)))
+    return SCPE_MEM;
+mp = exp->matcher;
 
 exp->buf[exp->buf_ins++] = data;                        /* Save new data */
 exp->buf[exp->buf_ins] = '\0';                          /* Nul terminate for RegEx match */
 if (exp->buf_data < exp->buf_size)
     ++exp->buf_data;                                    /* Record amount of data in buffer */
+++exp->chars;
+
+/* All literal rules at once: the automaton state identifies the first
+   rule whose match string ends with the data just produced */
+mp->state = mp->delta[mp->state * mp->nclasses + mp->cls[data]];
+i = (mp->out[mp->state] == EXP_NOMATCH) ? exp->size : (size_t)mp->out[mp->state];
+if (i != exp->size)
+    sim_debug (exp->dbit, exp->dptr, "Literal Match Rule %d: %s\n", (int)i, exp->rules[i].match_pattern);
 
-for (i=0; i < exp->size; i++) {
-    ep = &exp->rules[i];
-    if (ep->switches & EXP_TYP_REGEX) {
 #if defined (USE_REGEX)
-        int *ovector = NULL;
-        int ovector_elts;
+if (mp->regexes) {
+    char *cbuf = (char *)exp->buf;
+    t_bool combined_match = FALSE;
+    size_t j;
+
+    if (strlen ((char *)exp->buf) != exp->buf_ins) {    /* Nul characters in buffer? */
+        size_t off;
+
+        tstr = (char *)malloc (exp->buf_ins + 1);
+        tstr[0] = '\0';
+        for (off=0; off < exp->buf_ins; off += 1 + strlen ((char *)&exp->buf[off]))
+            strcpy (&tstr[strlen (tstr)], (char *)&exp->buf[off]);
+        cbuf = tstr;
+        }
+    if (mp->regex) {                                    /* One pass for all combined rules */
+        int ovector[3];
         int rc;
-        char *cbuf = (char *)exp->buf;
-        static size_t sim_exp_match_sub_count = 0;
-
-        if (tstr)
-            cbuf = tstr;
-        else {
-            if (strlen ((char *)exp->buf) != exp->buf_ins) { /* Nul characters in buffer? */
-                size_t off;
-
-                tstr = (char *)malloc (exp->buf_ins + 1);
-                tstr[0] = '\0';
-                for (off=0; off < exp->buf_ins; off += 1 + strlen ((char *)&exp->buf[off]))
-                    strcpy (&tstr[strlen (tstr)], (char *)&exp->buf[off]);
-                cbuf = tstr;
-                }
-            }
-        ++regex_checks;
-        ovector_elts = 3 * (ep->re_nsub + 1);
-        ovector = (int *)calloc ((size_t) ovector_elts, sizeof(*ovector));
-        if (sim_deb && exp->dptr && (exp->dptr->dctrl & exp->dbit)) {
-            char *estr = sim_encode_quoted_string (exp->buf, exp->buf_ins);
-            sim_debug (exp->dbit, exp->dptr, "Checking String: %s\n", estr);
-            sim_debug (exp->dbit, exp->dptr, "Against RegEx Match Rule: %s\n", ep->match_pattern);
-            free (estr);
-            }
-        /* exp->buf_ins is never going to exceed 1024 (current limit), so this is safe to
-           downcast to int. */
-        rc = pcre_exec (ep->regex, NULL, cbuf, (int) exp->buf_ins, 0, PCRE_NOTBOL, ovector, ovector_elts);
-        if (rc >= 0) {
-            size_t j;
-            char *buf = (char *)malloc (1 + exp->buf_ins);
-
-            for (j=0; j < (size_t)rc; j++) {
-                char env_name[32];
-                int end_offs = ovector[2 * j + 1], start_offs = ovector[2 * j];
-
-                sprintf (env_name, "_EXPECT_MATCH_GROUP_%d", (int)j);
-                if (start_offs >= 0 && end_offs >= start_offs) {
-                    memcpy (buf, &cbuf[start_offs], end_offs - start_offs);
-                    buf[end_offs - start_offs] = '\0';
-                    setenv (env_name, buf, 1);      /* Make the match and substrings available as environment variables */
-                    sim_debug (exp->dbit, exp->dptr, "%s=%s\n", env_name, buf);
-                    }
-                else {
-                    /* Substring was not captured by regexp: remove from the environment
-                     * (unsetenv is local static -- doesn't actually remove the variable from
-                     * the environment, sets it to an empty string.) */
-                    sim_debug (exp->dbit, exp->dptr, "unsetenv %s\n", env_name);
-                    unsetenv(env_name);
-                    }
-                }
-            for (; j<sim_exp_match_sub_count; j++) {
-                char env_name[32];
-
-                sprintf (env_name, "_EXPECT_MATCH_GROUP_%d", (int)j);
-                setenv (env_name, "", 1);      /* Remove previous extra environment variables */
-                }
-            sim_exp_match_sub_count = ep->re_nsub;
-            free (ovector);
-            ovector = NULL;
-            free (buf);
-            break;
-            }
-        free (ovector);
-#endif
-        }
-    else {
-        if (exp->buf_data < ep->size)                           /* Too little data to match yet? */
-            continue;                                           /* Yes, Try next one. */
-        if (exp->buf_ins < ep->size) {                          /* Match might straddle end of buffer */
-            /*
-             * First compare the newly deposited data at the beginning
-             * of buffer with the end of the match string
-             */
-            if (exp->buf_ins > 0) {
-                if (sim_deb && exp->dptr && (exp->dptr->dctrl & exp->dbit)) {
-                    char *estr = sim_encode_quoted_string (exp->buf, exp->buf_ins);
-                    char *mstr = sim_encode_quoted_string (&ep->match[ep->size-exp->buf_ins], exp->buf_ins);
-
-                    sim_debug (exp->dbit, exp->dptr, "Checking String[0:%" SIZE_T_FMT "d]: %s\n", exp->buf_ins, estr);
-                    sim_debug (exp->dbit, exp->dptr, "Against Match Data: %s\n", mstr);
-                    free (estr);
-                    free (mstr);
-                    }
-                if (memcmp (exp->buf, &ep->match[ep->size-exp->buf_ins], exp->buf_ins)) /* Tail Match? */
-                    continue;                                   /* Nope, Try next one. */
-                }
-            if (sim_deb && exp->dptr && (exp->dptr->dctrl & exp->dbit)) {
-                char *estr = sim_encode_quoted_string (&exp->buf[exp->buf_size-(ep->size-exp->buf_ins)], ep->size-exp->buf_ins);
-                char *mstr = sim_encode_quoted_string (ep->match, ep->size-exp->buf_ins);
-
-                sim_debug (exp->dbit, exp->dptr, "Checking String[%" SIZE_T_FMT "d:%" SIZE_T_FMT "d]: %s\n",
-                           exp->buf_size - ep->size - exp->buf_ins, ep->size-exp->buf_ins, estr);
-                sim_debug (exp->dbit, exp->dptr, "Against Match Data: %s\n", mstr);
-                free (estr);
-                free (mstr);
-                }
-            if (memcmp (&exp->buf[exp->buf_size-(ep->size-exp->buf_ins)], ep->match, ep->size-exp->buf_ins)) /* Front Match? */
-                continue;                                       /* Nope, Try next one. */
-            break;
-            }
-        else {
-            if (sim_deb && exp->dptr && (exp->dptr->dctrl & exp->dbit)) {
-                char *estr = sim_encode_quoted_string (&exp->buf[exp->buf_ins-ep->size], ep->size);
-                char *mstr = sim_encode_quoted_string (ep->match, ep->size);
-
-                sim_debug (exp->dbit, exp->dptr, "Checking String[%" SIZE_T_FMT "u:%" SIZE_T_FMT "u]: %s\n",
-                          exp->buf_ins - ep->size, ep->size, estr);
-                sim_debug (exp->dbit, exp->dptr, "Against Match Data: %s\n", mstr);
-                free (estr);
-                free (mstr);
-                }
-            if (memcmp (&exp->buf[exp->buf_ins-ep->size], ep->match, ep->size)) /* Whole string match? */
-                continue;                                       /* Nope, Try next one. */
+        t_uint64 start = _sim_host_nsec ();
+
+        rc = pcre_exec (mp->regex, mp->regex_extra, cbuf, (int) exp->buf_ins, 0, PCRE_NOTBOL, ovector, 3);
+        exp->regex_ns += _sim_host_nsec () - start;
+        ++exp->regex_passes;
+        combined_match = (rc != PCRE_ERROR_NOMATCH);
+        }
+    /* Only rules defined before a matching literal rule can take precedence */
+    for (j=0; j < i; j++) {
+        ep = &exp->rules[j];
+        if (!(ep->switches & EXP_TYP_REGEX) ||
+            (mp->in_combined && mp->in_combined[j] && !combined_match))
+            continue;
+        if (_sim_exp_regex_check (exp, ep, cbuf)) {
+            i = j;
             break;
             }
         }
     }
+#endif
+ep = (i != exp->size) ? &exp->rules[i] : NULL;
 if (exp->buf_ins == exp->buf_size) {                    /* At end of match buffer? */
-    if (regex_checks) {
+    if (mp->regexes) {
         /* When processing regular expressions, let the match buffer fill
            up and then shuffle the buffer contents down by half the buffer size
            so that the regular expression has a single contiguous buffer to
@@ -13417,7 +16345,8 @@ if (exp->buf_ins == exp->buf_size) {                    /* At end of match buffe
         sim_debug (exp->dbit, exp->dptr, "Buffer wrapping\n");
         }
     }
-if (i != exp->size) {                                   /* Found? */
+if (ep != NULL) {                                       /* Found? */
+    ++ep->matches;
     sim_debug (exp->dbit, exp->dptr, "Matched expect pattern: %s\n", ep->match_pattern);
     setenv ("_EXPECT_MATCH_PATTERN", ep->match_pattern, 1);   /* Make the match detail available as an environment variable */
     if (ep->cnt > 0) {
@@ -13449,6 +16378,8 @@ if (i != exp->size) {                                   /* Found? */
         }
     /* Matched data is no longer available for future matching */
     exp->buf_data = exp->buf_ins = 0;
+    if (exp->matcher)
+        exp->matcher->state = 0;
     }
 free (tstr);
 return SCPE_OK;
@@ -13607,6 +16538,51 @@ size_t debug_line_bufsize = 0;
 size_t debug_line_offset = 0;
 size_t debug_line_count = 0;
 
+/* Asynchronous debug output state (see "Asynchronous debug output" below) */
+
+#define DEBREC_PAD      0x80000000                      /* span flag: skip to ring start */
+#define DEBREC_RINGSIZE (4*1024*1024)                   /* ring size (power of 2) */
+#define DEBREC_MAXTEXT  (DEBREC_RINGSIZE/8)             /* text per record limit */
+
+typedef struct DEBREC {
+    volatile uint32     span;                           /* ring bytes used, 0 until published */
+    uint32              type;                           /* SIM_DEBTRACE_MSG, _TEXT or 0 (flush) */
+    DEVICE              *dptr;                          /* device */
+    uint32              dbits;                          /* matched debug bits */
+    uint32              flags;                          /* SIM_DEBTRACE_F_x */
+    struct timespec     tod;                            /* time of day */
+    double              gtime;                          /* simulated time */
+    t_value             pc;                             /* PC value */
+    size_t              len;                            /* text length, text follows */
+    } DEBREC;
+
+static struct {
+    t_bool              active;                         /* -W or -X in effect */
+    t_bool              thread_active;                  /* writer thread running */
+    uint8               *buf;                           /* ring buffer */
+    volatile t_bool     idle;                           /* writer waiting for work */
+    volatile t_bool     stop;                           /* writer should exit */
+    char                pad1[64];                       /* keep producer and writer */
+    volatile size_t     head;                           /*   fields in separate cache lines */
+    size_t              tail_seen;                      /* tail as last seen by producers */
+    char                pad2[64];
+    volatile size_t     tail;                           /* next byte to consume */
+    t_bool              dirty;                          /* output since last fflush */
+    int32               unterm;                         /* writer's debug_unterm */
+    DEVICE              **devs;                         /* devices seen in binary trace */
+    uint32              ndevs;
+    uint32              maxdevs;
+    uint32              lastdev;
+#if defined (SIM_ASYNCH_IO)
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      wake;
+#endif
+    } sim_deb_ring;
+
+static void _sim_deb_queue (DEBREC *hdr, const char *text, size_t len);
+static void _sim_deb_drain (void);
+
 static void _debug_fwrite_all (const char *buf, size_t len, FILE *f)
 {
 size_t len_written;
@@ -13654,13 +16630,15 @@ while (len > 0) {
 static void _sim_debug_write_flush (const char *buf, size_t len, t_bool flush)
 {
 char *eol;
+t_bool locked = !sim_deb_ring.thread_active;            /* the debug writer thread needs no lock */
 
 if (sim_deb_switches & SWMASK ('F')) {              /* filtering disabled? */
     if (len > 0)
         _debug_fwrite (buf, len);                   /* output now. */
     return;                                         /* done */
     }
-AIO_LOCK;
+if (locked)
+    AIO_LOCK;
 if (debug_line_offset + len + 1 > debug_line_bufsize) {
     /* realloc(NULL, size) == malloc(size). Initialize the malloc()-ed space. Only
        need to test debug_line_buf since SIMH allocates both buffers at the same
@@ -13745,118 +16723,567 @@ while (NULL != (eol = strchr (debug_line_buf, '\n')) || flush) {
         memmove (debug_line_buf, eol + 1, debug_line_offset);
     debug_line_buf[debug_line_offset] = '\0';
     }
-AIO_UNLOCK;
+if (locked)
+    AIO_UNLOCK;
+}
+
+static void _sim_debug_write (const char *buf, size_t len)
+{
+if (sim_deb_ring.active) {                              /* asynchronous output? */
+    DEBREC rec;
+
+    memset (&rec, 0, sizeof (rec));
+    rec.type = SIM_DEBTRACE_TEXT;
+    _sim_deb_queue (&rec, buf, len);
+    return;
+    }
+_sim_debug_write_flush (buf, len, FALSE);
+}
+
+static t_stat _sim_debug_flush (void)
+{
+int32 saved_quiet = sim_quiet;
+int32 saved_sim_switches = sim_switches;
+int32 saved_deb_switches = sim_deb_switches;
+struct timespec saved_deb_basetime = sim_deb_basetime;
+char saved_debug_filename[CBUFSIZE];
+
+if (sim_deb == NULL)                                    /* no debug? */
+    return SCPE_OK;
+
+if (sim_deb_ring.active) {                              /* writer owns the filter state */
+    DEBREC rec;
+
+    memset (&rec, 0, sizeof (rec));                     /* queue a flush request */
+    _sim_deb_queue (&rec, "", 0);
+    _sim_deb_drain ();
+    }
+else
+    _sim_debug_write_flush ("", 0, TRUE);
+
+if (sim_deb == sim_log) {                               /* debug is log */
+    fflush (sim_deb);                                   /* fflush is the best we can do */
+    return SCPE_OK;
+    }
+
+if (!(saved_deb_switches & SWMASK ('B'))) {
+    strcpy (saved_debug_filename, sim_logfile_name (sim_deb, sim_deb_ref));
+
+    sim_quiet = 1;
+    sim_set_deboff (0, NULL);
+    sim_switches = saved_deb_switches;
+    sim_set_debon (0, saved_debug_filename);
+    sim_deb_basetime = saved_deb_basetime;
+    sim_switches = saved_sim_switches;
+    sim_quiet = saved_quiet;
+    }
+return SCPE_OK;
+}
+
+
+/* Finds debug phrase matching bitmask from from device DEBTAB table */
+
+static const char *_sim_debug_verb (uint32 dbits, DEVICE* dptr)
+{
+static const char *debtab_none    = "DEBTAB_ISNULL";
+static const char *debtab_nomatch = "DEBTAB_NOMATCH";
+const char *some_match = NULL;
+int32 offset = 0;
+
+if (dptr->debflags == NULL)
+    return debtab_none;
+
+/* Find matching words for bitmask */
+
+while (dptr->debflags[offset].name && (offset < 32)) {
+    if (dptr->debflags[offset].mask == dbits)   /* All Bits Match */
+        return dptr->debflags[offset].name;
+    if (dptr->debflags[offset].mask & dbits)
+        some_match = dptr->debflags[offset].name;
+    offset++;
+    }
+return some_match ? some_match : debtab_nomatch;
+}
+
+static const char *_get_dbg_verb (uint32 dbits, DEVICE* dptr, UNIT *uptr)
+{
+return _sim_debug_verb (dbits & (dptr->dctrl | (uptr ? uptr->dctrl : 0)), dptr);/* Look for just the bits that matched */
+}
+
+/* Prints standard debug prefix unless previous call unterminated */
+
+static void _sim_debug_fmt_prefix (char *prefix, const char *debug_type, DEVICE *dptr,
+                                   struct timespec time_now, double gtime, t_value val,
+                                   t_bool main_thread)
+{
+char tim_t[32] = "";
+char tim_a[32] = "";
+char pc_s[MAX_WIDTH + 1] = "";
+
+if (sim_deb_switches & (SWMASK ('T') | SWMASK ('R') | SWMASK ('A'))) {
+    if (sim_deb_switches & SWMASK ('R'))
+        sim_timespec_diff (&time_now, &time_now, &sim_deb_basetime);
+    if (sim_deb_switches & SWMASK ('T')) {
+        time_t tnow = (time_t)time_now.tv_sec;
+        struct tm *now = localtime(&tnow);
+
+        sprintf(tim_t, "%02d:%02d:%02d.%03d ", now->tm_hour, now->tm_min, now->tm_sec, (int)(time_now.tv_nsec/1000000));
+        }
+    if (sim_deb_switches & SWMASK ('A')) {
+        sprintf(tim_t, "%" LL_FMT "d.%03d ", (LL_TYPE)(time_now.tv_sec), (int)(time_now.tv_nsec/1000000));
+        }
+    }
+if (sim_deb_switches & SWMASK ('P')) {
+    sprintf(pc_s, "-%s:", sim_PC->name);
+    sprint_val (&pc_s[strlen(pc_s)], val, sim_PC->radix, sim_PC->width, sim_PC->flags & REG_FMT);
+    }
+sprintf(prefix, "DBG(%s%s%.0f%s)%s> %s %s: ", tim_t, tim_a, gtime, pc_s, main_thread ? "" : "+", dptr->name, debug_type);
+}
+
+static const char *sim_debug_prefix (uint32 dbits, DEVICE* dptr, UNIT* uptr)
+{
+t_value val = 0;
+struct timespec time_now = {0, 0};
+
+if (sim_deb_switches & (SWMASK ('T') | SWMASK ('R') | SWMASK ('A')))
+    sim_rtcn_get_time(&time_now, 0);
+if (sim_deb_switches & SWMASK ('P')) {
+    /* Some simulators expose the PC as a register, some don't expose it or expose a register
+       which is not a variable which is updated during instruction execution (i.e. only upon
+       exit of sim_instr()).  For the -P debug option to be effective, such a simulator should
+       provide a routine which returns the value of the current PC and set the sim_vm_pc_value
+       routine pointer to that routine.
+     */
+    if (sim_vm_pc_value)
+        val = (*sim_vm_pc_value)();
+    else
+        val = get_rval (sim_PC, 0);
+    }
+_sim_debug_fmt_prefix (debug_line_prefix, _get_dbg_verb (dbits, dptr, uptr), dptr,
+                       time_now, sim_gtime(), val, AIO_MAIN_THREAD);
+return debug_line_prefix;
+}
+
+/* Output formatted debug text, expanding newlines and inserting the
+   prefix at the start of each line */
+
+static void _sim_debug_lines (const char *debug_prefix, const char *buf, int32 len, int32 *unterm)
+{
+int32 i, j;
+
+for (i = j = 0; i < len; ++i) {
+    if ('\n' == buf[i]) {
+        if (i >= j) {
+            if ((i != j) || (i == 0)) {
+                if (!*unterm)                           /* print prefix when required */
+                    _sim_debug_write_flush (debug_prefix, strlen (debug_prefix), FALSE);
+                _sim_debug_write_flush (&buf[j], i-j, FALSE);
+                _sim_debug_write_flush ("\r\n", 2, FALSE);
+                }
+            *unterm = 0;
+            }
+        j = i + 1;
+        }
+    else {
+        if (buf[i] == 0) {      /* Imbedded \0 character in formatted result? */
+            fprintf (stderr, "sim_debug() formatted result: '%s'\r\n"
+                             "            has an imbedded \\0 character.\r\n"
+                             "DON'T DO THAT!\r\n", buf);
+            abort();
+            }
+        }
+    }
+if (i > j) {
+    if (!*unterm)                                       /* print prefix when required */
+        _sim_debug_write_flush (debug_prefix, strlen (debug_prefix), FALSE);
+    _sim_debug_write_flush (&buf[j], i-j, FALSE);
+    }
+
+/* Set unterminated flag for next time */
+
+*unterm = len ? (((buf[len-1]=='\n')) ? 0 : 1) : *unterm;
+}
+
+/* Asynchronous debug output
+
+   SET DEBUG -W and -X take the cost of debug output off the simulator
+   thread.  A sim_debug () call formats just the message text and queues
+   it in a ring buffer together with the device, the matched debug bits,
+   the time of day, the simulated time and the PC.  A writer thread takes
+   the records off the ring and either expands them into the usual text
+   lines (prefix, duplicate line summaries) or, with -X, writes them to the
+   debug file in the binary form described in sim_debtrace.h, which the
+   DebugDecode tool turns back into text.  Other output directed to the
+   debug file (fprintf (sim_deb, ...), sim_printf, etc.) is queued too, so
+   everything stays in order.
+
+   Producers claim ring space with a compare and swap on the head index,
+   fill in the record and publish it by storing its span last.  The writer
+   waits for the span of the record at the tail, handles the record, clears
+   the space and advances the tail.  Neither side takes a lock unless the
+   writer has gone to sleep or the ring is full.  Without thread support
+   (or atomic operations) the records are handled as soon as they are
+   queued.
+ */
+
+#if defined (SIM_ASYNCH_IO) && defined (__GNUC__)
+#define DEB_THREADS         1
+#define DEB_CAS(p, o, n)    __sync_bool_compare_and_swap ((p), (o), (n))
+#define DEB_BARRIER()       __sync_synchronize ()
+#elif defined (SIM_ASYNCH_IO) && defined (_WIN32)
+#define DEB_THREADS         1
+#define DEB_CAS(p, o, n)    (InterlockedCompareExchangePointer ((PVOID volatile *)(p), (PVOID)(n), (PVOID)(o)) == (PVOID)(o))
+#define DEB_BARRIER()       MemoryBarrier ()
+#endif
+
+static void _sim_deb_le (uint8 *p, t_uint64 val, int bytes)
+{
+while (bytes-- > 0) {
+    *p++ = (uint8)val;
+    val >>= 8;
+    }
+}
+
+static void _sim_deb_rechdr (uint8 *p, int type, uint32 dev, size_t len)
+{
+p[0] = 0;
+p[1] = (uint8)type;
+_sim_deb_le (p + 2, dev, 2);
+_sim_deb_le (p + 4, len, 4);
+}
+
+/* Write the INFO record which starts a binary trace */
+
+static void _sim_deb_put_info (void)
+{
+const char *pcname = sim_PC ? sim_PC->name : "";
+size_t len = SIM_DEBTRACE_INFO_HDR + strlen (sim_name) + 1 + strlen (pcname) + 1;
+uint8 *rec = (uint8 *)calloc (1, len);
+struct timespec now;
+
+if (rec == NULL)
+    return;
+sim_rtcn_get_time (&now, 0);
+_sim_deb_rechdr (rec, SIM_DEBTRACE_INFO, 0, len);
+memcpy (rec + 8, SIM_DEBTRACE_MAGIC, 8);
+_sim_deb_le (rec + 16, SIM_DEBTRACE_VERSION, 4);
+if (sim_PC) {
+    _sim_deb_le (rec + 20, sim_PC->radix, 4);
+    _sim_deb_le (rec + 24, sim_PC->width, 4);
+    _sim_deb_le (rec + 28, sim_PC->flags & REG_FMT, 4);
+    }
+_sim_deb_le (rec + 32, (t_uint64)now.tv_sec, 8);
+_sim_deb_le (rec + 40, (t_uint64)now.tv_nsec, 4);
+strcpy ((char *)rec + SIM_DEBTRACE_INFO_HDR, sim_name);
+strcpy ((char *)rec + SIM_DEBTRACE_INFO_HDR + strlen (sim_name) + 1, pcname);
+_debug_fwrite_all ((char *)rec, len, sim_deb);
+free (rec);
+}
+
+/* Return the trace number of a device, describing the device and its debug
+   flags in a DEVICE record the first time it is seen */
+
+static uint32 _sim_deb_devno (DEVICE *dptr)
+{
+uint32 i, n;
+size_t len, off;
+uint8 *rec;
+
+if ((sim_deb_ring.lastdev < sim_deb_ring.ndevs) &&
+    (sim_deb_ring.devs[sim_deb_ring.lastdev] == dptr))
+    return sim_deb_ring.lastdev;
+for (i = 0; i < sim_deb_ring.ndevs; i++)
+    if (sim_deb_ring.devs[i] == dptr)
+        return sim_deb_ring.lastdev = i;
+if (sim_deb_ring.ndevs == sim_deb_ring.maxdevs) {
+    DEVICE **devs = (DEVICE **)realloc (sim_deb_ring.devs, (sim_deb_ring.maxdevs + 32) * sizeof (*devs));
+
+    if (devs == NULL)
+        return 0xFFFF;
+    sim_deb_ring.devs = devs;
+    sim_deb_ring.maxdevs += 32;
+    }
+sim_deb_ring.devs[i] = dptr;
+sim_deb_ring.ndevs++;
+len = SIM_DEBTRACE_HDR + strlen (dptr->name) + 1;
+for (n = 0; dptr->debflags && dptr->debflags[n].name && (n < 32); n++)
+    len += 4 + strlen (dptr->debflags[n].name) + 1;
+rec = (uint8 *)malloc (len);
+if (rec != NULL) {
+    _sim_deb_rechdr (rec, SIM_DEBTRACE_DEVICE, i, len);
+    strcpy ((char *)rec + SIM_DEBTRACE_HDR, dptr->name);
+    off = SIM_DEBTRACE_HDR + strlen (dptr->name) + 1;
+    for (n = 0; dptr->debflags && dptr->debflags[n].name && (n < 32); n++) {
+        _sim_deb_le (rec + off, dptr->debflags[n].mask, 4);
+        strcpy ((char *)rec + off + 4, dptr->debflags[n].name);
+        off += 4 + strlen (dptr->debflags[n].name) + 1;
+        }
+    _debug_fwrite_all ((char *)rec, len, sim_deb);
+    free (rec);
+    }
+return sim_deb_ring.lastdev = i;
+}
+
+/* Write out one queued record */
+
+static void _sim_deb_output (const DEBREC *rec, const char *text)
+{
+if (rec->type == 0) {                                   /* flush request */
+    if (!(sim_deb_switches & SWMASK ('X')))
+        _sim_debug_write_flush ("", 0, TRUE);
+    return;
+    }
+if (sim_deb_switches & SWMASK ('X')) {                  /* binary trace? */
+    uint8 hdr[SIM_DEBTRACE_MSG_HDR];
+
+    if (rec->type == SIM_DEBTRACE_MSG) {
+        t_uint64 gbits;
+
+        memcpy (&gbits, &rec->gtime, sizeof (gbits));
+        _sim_deb_rechdr (hdr, SIM_DEBTRACE_MSG, _sim_deb_devno (rec->dptr), SIM_DEBTRACE_MSG_HDR + rec->len);
+        _sim_deb_le (hdr + 8, rec->dbits, 4);
+        _sim_deb_le (hdr + 12, rec->flags, 4);
+        _sim_deb_le (hdr + 16, (t_uint64)rec->tod.tv_sec, 8);
+        _sim_deb_le (hdr + 24, (t_uint64)rec->tod.tv_nsec, 4);
+        _sim_deb_le (hdr + 28, gbits, 8);
+        _sim_deb_le (hdr + 36, (t_uint64)rec->pc, 8);
+        _debug_fwrite_all ((char *)hdr, SIM_DEBTRACE_MSG_HDR, sim_deb);
+        }
+    else {
+        _sim_deb_rechdr (hdr, SIM_DEBTRACE_TEXT, 0, SIM_DEBTRACE_HDR + rec->len);
+        _debug_fwrite_all ((char *)hdr, SIM_DEBTRACE_HDR, sim_deb);
+        }
+    _debug_fwrite_all (text, rec->len, sim_deb);
+    }
+else {                                                  /* text */
+    if (rec->type == SIM_DEBTRACE_MSG) {
+        char prefix[sizeof (debug_line_prefix)];
+
+        _sim_debug_fmt_prefix (prefix, _sim_debug_verb (rec->dbits, rec->dptr), rec->dptr,
+                               rec->tod, rec->gtime, rec->pc, !(rec->flags & SIM_DEBTRACE_F_THREAD));
+        _sim_debug_lines (prefix, text, (int32)rec->len, &sim_deb_ring.unterm);
+        }
+    else
+        _sim_debug_write_flush (text, rec->len, FALSE);
+    }
+sim_deb_ring.dirty = TRUE;
 }
 
-static void _sim_debug_write (const char *buf, size_t len)
+#if defined (DEB_THREADS)
+static void _sim_deb_wake (void)
 {
-_sim_debug_write_flush (buf, len, FALSE);
+pthread_mutex_lock (&sim_deb_ring.lock);
+pthread_cond_signal (&sim_deb_ring.wake);
+pthread_mutex_unlock (&sim_deb_ring.lock);
 }
 
-static t_stat _sim_debug_flush (void)
-{
-int32 saved_quiet = sim_quiet;
-int32 saved_sim_switches = sim_switches;
-int32 saved_deb_switches = sim_deb_switches;
-struct timespec saved_deb_basetime = sim_deb_basetime;
-char saved_debug_filename[CBUFSIZE];
-
-if (sim_deb == NULL)                                    /* no debug? */
-    return SCPE_OK;
+/* Writer thread */
 
-_sim_debug_write_flush ("", 0, TRUE);
+static void *_sim_deb_writer (void *arg)
+{
+int32 polls = 0;
 
-if (sim_deb == sim_log) {                               /* debug is log */
-    fflush (sim_deb);                                   /* fflush is the best we can do */
-    return SCPE_OK;
+while (1) {
+    size_t tail = sim_deb_ring.tail;
+    DEBREC *rec = (DEBREC *)(sim_deb_ring.buf + (tail & (DEBREC_RINGSIZE - 1)));
+    uint32 span = rec->span;
+
+    if (span == 0) {                                    /* nothing published yet? */
+        if (sim_deb_ring.dirty) {
+            fflush (sim_deb);
+            sim_deb_ring.dirty = FALSE;
+            }
+        if (sim_deb_ring.stop) {
+            if (tail == sim_deb_ring.head)              /* all done? */
+                break;
+            sim_os_ms_sleep (1);                        /* wait for a producer to finish */
+            continue;
+            }
+        if (++polls < 100) {                            /* recently busy? */
+            sim_os_ms_sleep (1);                        /* collect a batch */
+            continue;
+            }
+        pthread_mutex_lock (&sim_deb_ring.lock);
+        sim_deb_ring.idle = TRUE;
+        DEB_BARRIER ();
+        if ((rec->span == 0) && !sim_deb_ring.stop)
+            pthread_cond_wait (&sim_deb_ring.wake, &sim_deb_ring.lock);
+        sim_deb_ring.idle = FALSE;
+        pthread_mutex_unlock (&sim_deb_ring.lock);
+        continue;
+        }
+    polls = 0;
+    DEB_BARRIER ();
+    if (!(span & DEBREC_PAD))
+        _sim_deb_output (rec, (const char *)(rec + 1));
+    span &= ~DEBREC_PAD;
+    memset (rec, 0, span);
+    DEB_BARRIER ();
+    sim_deb_ring.tail = tail + span;
     }
+return NULL;
+}
 
-if (!(saved_deb_switches & SWMASK ('B'))) {
-    strcpy (saved_debug_filename, sim_logfile_name (sim_deb, sim_deb_ref));
+/* Claim ring space for a record, waiting for the writer if the ring is full */
 
-    sim_quiet = 1;
-    sim_set_deboff (0, NULL);
-    sim_switches = saved_deb_switches;
-    sim_set_debon (0, saved_debug_filename);
-    sim_deb_basetime = saved_deb_basetime;
-    sim_switches = saved_sim_switches;
-    sim_quiet = saved_quiet;
+static DEBREC *_sim_deb_reserve (size_t need)
+{
+size_t head, room, pad;
+
+while (1) {
+    head = sim_deb_ring.head;
+    room = DEBREC_RINGSIZE - (head & (DEBREC_RINGSIZE - 1));
+    pad = (room < need) ? room : 0;                     /* doesn't fit before the wrap? */
+    if ((head + pad + need) - sim_deb_ring.tail_seen > DEBREC_RINGSIZE) {
+        if (sim_deb_ring.tail_seen != sim_deb_ring.tail) {
+            sim_deb_ring.tail_seen = sim_deb_ring.tail; /* writer has made room */
+            continue;
+            }
+        _sim_deb_wake ();                               /* full, let the writer catch up */
+        sim_os_ms_sleep (1);
+        continue;
+        }
+    if (DEB_CAS (&sim_deb_ring.head, head, head + pad + need))
+        break;
     }
-return SCPE_OK;
+if (pad) {
+    ((DEBREC *)(sim_deb_ring.buf + (head & (DEBREC_RINGSIZE - 1))))->span = (uint32)pad | DEBREC_PAD;
+    head += pad;
+    }
+return (DEBREC *)(sim_deb_ring.buf + (head & (DEBREC_RINGSIZE - 1)));
 }
+#endif
 
+/* Queue a record, splitting long text into several records */
 
-/* Finds debug phrase matching bitmask from from device DEBTAB table */
-
-static const char *_get_dbg_verb (uint32 dbits, DEVICE* dptr, UNIT *uptr)
+static void _sim_deb_queue (DEBREC *hdr, const char *text, size_t len)
 {
-static const char *debtab_none    = "DEBTAB_ISNULL";
-static const char *debtab_nomatch = "DEBTAB_NOMATCH";
-const char *some_match = NULL;
-int32 offset = 0;
+do {
+    hdr->len = MIN (len, DEBREC_MAXTEXT);
+#if defined (DEB_THREADS)
+    if (sim_deb_ring.thread_active) {
+        size_t need = (sizeof (*hdr) + hdr->len + 7) & ~((size_t)7);
+        DEBREC *rec = _sim_deb_reserve (need);
+
+        memcpy ((char *)rec + sizeof (rec->span), (char *)hdr + sizeof (hdr->span), sizeof (*hdr) - sizeof (hdr->span));
+        memcpy (rec + 1, text, hdr->len);
+        DEB_BARRIER ();
+        rec->span = (uint32)need;                       /* publish */
+        DEB_BARRIER ();
+        if (sim_deb_ring.idle)
+            _sim_deb_wake ();
+        }
+    else
+#endif
+        {
+        AIO_LOCK;
+        _sim_deb_output (hdr, text);
+        AIO_UNLOCK;
+        }
+    text += hdr->len;
+    len -= hdr->len;
+    } while (len > 0);
+}
 
-if (dptr->debflags == NULL)
-    return debtab_none;
+/* Wait until the writer has written everything queued so far */
 
-dbits &= (dptr->dctrl | (uptr ? uptr->dctrl : 0));/* Look for just the bits that matched */
+static void _sim_deb_drain (void)
+{
+#if defined (DEB_THREADS)
+if (!sim_deb_ring.thread_active)
+    return;
+while (sim_deb_ring.tail != sim_deb_ring.head) {
+    _sim_deb_wake ();
+    sim_os_ms_sleep (1);
+    }
+#endif
+}
 
-/* Find matching words for bitmask */
+/* Start and stop asynchronous output, called by SET DEBUG and SET NODEBUG */
 
-while (dptr->debflags[offset].name && (offset < 32)) {
-    if (dptr->debflags[offset].mask == dbits)   /* All Bits Match */
-        return dptr->debflags[offset].name;
-    if (dptr->debflags[offset].mask & dbits)
-        some_match = dptr->debflags[offset].name;
-    offset++;
+t_stat sim_debug_writer_start (void)
+{
+if (!(sim_deb_switches & (SWMASK ('W') | SWMASK ('X'))))
+    return SCPE_OK;
+sim_deb_ring.unterm = 0;
+sim_deb_ring.ndevs = sim_deb_ring.lastdev = 0;
+sim_deb_ring.dirty = FALSE;
+if (sim_deb_switches & SWMASK ('X'))
+    _sim_deb_put_info ();
+#if defined (DEB_THREADS)
+if (sim_deb_ring.buf == NULL)
+    sim_deb_ring.buf = (uint8 *)calloc (1, DEBREC_RINGSIZE);
+if (sim_deb_ring.buf == NULL)
+    return SCPE_MEM;
+sim_deb_ring.head = sim_deb_ring.tail = sim_deb_ring.tail_seen = 0;
+sim_deb_ring.stop = sim_deb_ring.idle = FALSE;
+pthread_mutex_init (&sim_deb_ring.lock, NULL);
+pthread_cond_init (&sim_deb_ring.wake, NULL);
+if (pthread_create (&sim_deb_ring.thread, NULL, _sim_deb_writer, NULL) == 0)
+    sim_deb_ring.thread_active = TRUE;
+else {                                                  /* write synchronously */
+    pthread_cond_destroy (&sim_deb_ring.wake);
+    pthread_mutex_destroy (&sim_deb_ring.lock);
     }
-return some_match ? some_match : debtab_nomatch;
+#endif
+sim_deb_ring.active = TRUE;
+return SCPE_OK;
 }
 
-/* Prints standard debug prefix unless previous call unterminated */
+void sim_debug_writer_stop (void)
+{
+if (!sim_deb_ring.active)
+    return;
+#if defined (DEB_THREADS)
+if (sim_deb_ring.thread_active) {
+    pthread_mutex_lock (&sim_deb_ring.lock);
+    sim_deb_ring.stop = TRUE;
+    pthread_cond_signal (&sim_deb_ring.wake);
+    pthread_mutex_unlock (&sim_deb_ring.lock);
+    pthread_join (sim_deb_ring.thread, NULL);
+    sim_deb_ring.thread_active = FALSE;
+    pthread_cond_destroy (&sim_deb_ring.wake);
+    pthread_mutex_destroy (&sim_deb_ring.lock);
+    }
+#endif
+sim_deb_ring.active = FALSE;
+free (sim_deb_ring.devs);
+sim_deb_ring.devs = NULL;
+sim_deb_ring.ndevs = sim_deb_ring.maxdevs = 0;
+}
 
-static const char *sim_debug_prefix (uint32 dbits, DEVICE* dptr, UNIT* uptr)
+/* Append formatted text to an explicit memory file */
+
+static void _sim_mfile_printf (MEMFILE *mf, const char *fmt, ...)
 {
-const char* debug_type = _get_dbg_verb (dbits, dptr, uptr);
-char tim_t[32] = "";
-char tim_a[32] = "";
-char pc_s[MAX_WIDTH + 1] = "";
-struct timespec time_now;
+va_list arglist;
+char *nbuf;
+int len;
 
-if (sim_deb_switches & (SWMASK ('T') | SWMASK ('R') | SWMASK ('A'))) {
-    sim_rtcn_get_time(&time_now, 0);
-    if (sim_deb_switches & SWMASK ('R'))
-        sim_timespec_diff (&time_now, &time_now, &sim_deb_basetime);
-    if (sim_deb_switches & SWMASK ('T')) {
-        time_t tnow = (time_t)time_now.tv_sec;
-        struct tm *now = localtime(&tnow);
+while (1) {
+    size_t avail = mf->size - mf->pos;
 
-        sprintf(tim_t, "%02d:%02d:%02d.%03d ", now->tm_hour, now->tm_min, now->tm_sec, (int)(time_now.tv_nsec/1000000));
-        }
-    if (sim_deb_switches & SWMASK ('A')) {
-        sprintf(tim_t, "%" LL_FMT "d.%03d ", (LL_TYPE)(time_now.tv_sec), (int)(time_now.tv_nsec/1000000));
+    va_start (arglist, fmt);
+    len = vsnprintf (mf->buf ? mf->buf + mf->pos : NULL, avail, fmt, arglist);
+    va_end (arglist);
+    if (len < 0)
+        return;
+    if ((size_t)len < avail) {
+        mf->pos += len;
+        return;
         }
+    nbuf = (char *)realloc (mf->buf, mf->pos + len + 512);
+    if (nbuf == NULL)                               /* out of memory */
+        return;
+    mf->buf = nbuf;
+    mf->size = mf->pos + len + 512;
     }
-if (sim_deb_switches & SWMASK ('P')) {
-    t_value val;
-
-    /* Some simulators expose the PC as a register, some don't expose it or expose a register
-       which is not a variable which is updated during instruction execution (i.e. only upon
-       exit of sim_instr()).  For the -P debug option to be effective, such a simulator should
-       provide a routine which returns the value of the current PC and set the sim_vm_pc_value
-       routine pointer to that routine.
-     */
-    if (sim_vm_pc_value)
-        val = (*sim_vm_pc_value)();
-    else
-        val = get_rval (sim_PC, 0);
-    sprintf(pc_s, "-%s:", sim_PC->name);
-    sprint_val (&pc_s[strlen(pc_s)], val, sim_PC->radix, sim_PC->width, sim_PC->flags & REG_FMT);
-    }
-sprintf(debug_line_prefix, "DBG(%s%s%.0f%s)%s> %s %s: ", tim_t, tim_a, sim_gtime(), pc_s, AIO_MAIN_THREAD ? "" : "+", dptr->name, debug_type);
-return debug_line_prefix;
 }
 
-void fprint_fields (FILE *stream, t_value before, t_value after, BITFIELD* bitdefs)
+/* Format the field translation into a memory file.  This never touches
+   sim_mfile, so it is safe while the debug writer thread is running. */
+
+static void _sim_mfile_fields (MEMFILE *mf, t_value before, t_value after, BITFIELD* bitdefs)
 {
 int32 i, fields, offset;
 uint32 value, beforevalue, mask;
@@ -13873,7 +17300,7 @@ for (i = fields-1; i >= 0; i--) {                   /* print xlation, transition
         continue;
     if ((bitdefs[i].width == 1) && (bitdefs[i].valuenames == NULL)) {
         int off = ((after >> bitdefs[i].offset) & 1) + (((before ^ after) >> bitdefs[i].offset) & 1) * 2;
-        fprintf(stream, "%s%c ", bitdefs[i].name, debug_bstates[off]);
+        _sim_mfile_printf (mf, "%s%c ", bitdefs[i].name, debug_bstates[off]);
         }
     else {
         const char *delta = "";
@@ -13886,19 +17313,30 @@ for (i = fields-1; i >= 0; i--) {                   /* print xlation, transition
         if (value > beforevalue)
             delta = "^";
         if (bitdefs[i].valuenames)
-            fprintf(stream, "%s=%s%s ", bitdefs[i].name, delta, bitdefs[i].valuenames[value]);
+            _sim_mfile_printf (mf, "%s=%s%s ", bitdefs[i].name, delta, bitdefs[i].valuenames[value]);
         else
             if (bitdefs[i].format) {
-                fprintf(stream, "%s=%s", bitdefs[i].name, delta);
-                fprintf(stream, bitdefs[i].format, value);
-                fprintf(stream, " ");
+                _sim_mfile_printf (mf, "%s=%s", bitdefs[i].name, delta);
+                _sim_mfile_printf (mf, bitdefs[i].format, value);
+                _sim_mfile_printf (mf, " ");
                 }
             else
-                fprintf(stream, "%s=%s0x%X ", bitdefs[i].name, delta, value);
+                _sim_mfile_printf (mf, "%s=%s0x%X ", bitdefs[i].name, delta, value);
         }
     }
 }
 
+void fprint_fields (FILE *stream, t_value before, t_value after, BITFIELD* bitdefs)
+{
+MEMFILE mbuf;
+
+memset (&mbuf, 0, sizeof (mbuf));
+_sim_mfile_fields (&mbuf, before, after, bitdefs);
+if (mbuf.pos)
+    fprintf(stream, "%.*s", (int)mbuf.pos, mbuf.buf);
+free (mbuf.buf);
+}
+
 /* Prints state of a register: bit translation + state (0,1,_,^)
    indicating the state and transition of the bit and bitfields. States:
    0=steady(0->0), 1=steady(1->1), _=falling(1->0), ^=rising(0->1) */
@@ -13909,6 +17347,19 @@ void sim_debug_bits_hdr(uint32 dbits, DEVICE* dptr, const char *header,
 if (sim_deb && dptr && (dptr->dctrl & dbits)) {
     TMLN *saved_oline = sim_oline;
 
+    if (sim_deb_ring.active) {                                          /* asynchronous output? */
+        MEMFILE mbuf;
+
+        memset (&mbuf, 0, sizeof (mbuf));                               /* capture the fields */
+        if (header)
+            _sim_mfile_printf (&mbuf, "%s: ", header);
+        _sim_mfile_fields (&mbuf, (t_value)before, (t_value)after, bitdefs);
+        if (terminate)
+            _sim_mfile_printf (&mbuf, "\n");
+        _sim_debug_device (dbits, dptr, "%.*s", (int)mbuf.pos, mbuf.buf ? mbuf.buf : "");
+        free (mbuf.buf);
+        return;
+        }
     sim_oline = NULL;                                                   /* avoid potential debug to active socket */
     if (!debug_unterm)
         fprintf(sim_deb, "%s", sim_debug_prefix(dbits, dptr, NULL));    /* print prefix if required */
@@ -14102,8 +17553,7 @@ if (sim_deb && dptr && ((dptr->dctrl | (uptr ? uptr->dctrl : 0)) & dbits)) {
     char stackbuf[STACKBUFSIZE];
     int32 bufsize = sizeof(stackbuf);
     char *buf = stackbuf;
-    int32 i, j, len;
-    const char* debug_prefix = sim_debug_prefix(dbits, dptr, uptr);   /* prefix to print if required */
+    int32 len;
 
     sim_oline = NULL;                                   /* avoid potential debug to active socket */
     buf[bufsize-1] = '\0';
@@ -14132,39 +17582,28 @@ if (sim_deb && dptr && ((dptr->dctrl | (uptr ? uptr->dctrl : 0)) & dbits)) {
         break;
         }
 
-/* Output the formatted data expanding newlines where they exist */
+/* Queue the message for the debug writer, or output the formatted data
+   expanding newlines where they exist */
 
-    for (i = j = 0; i < len; ++i) {
-        if ('\n' == buf[i]) {
-            if (i >= j) {
-                if ((i != j) || (i == 0)) {
-                    if (!debug_unterm)                  /* print prefix when required */
-                        _sim_debug_write (debug_prefix, strlen (debug_prefix));
-                    _sim_debug_write (&buf[j], i-j);
-                    _sim_debug_write ("\r\n", 2);
-                    }
-                debug_unterm = 0;
-                }
-            j = i + 1;
-            }
-        else {
-            if (buf[i] == 0) {      /* Imbedded \0 character in formatted result? */
-                fprintf (stderr, "sim_debug() formatted result: '%s'\r\n"
-                                 "            has an imbedded \\0 character.\r\n"
-                                 "DON'T DO THAT!\r\n", buf);
-                abort();
-                }
+    if (sim_deb_ring.active) {
+        DEBREC rec;
+
+        memset (&rec, 0, sizeof (rec));
+        rec.type = SIM_DEBTRACE_MSG;
+        rec.dptr = dptr;
+        rec.dbits = dbits & (dptr->dctrl | (uptr ? uptr->dctrl : 0));
+        rec.flags = AIO_MAIN_THREAD ? 0 : SIM_DEBTRACE_F_THREAD;
+        if (sim_deb_switches & (SWMASK ('T') | SWMASK ('R') | SWMASK ('A') | SWMASK ('X')))
+            sim_rtcn_get_time (&rec.tod, 0);
+        rec.gtime = sim_gtime ();
+        if ((sim_deb_switches & (SWMASK ('P') | SWMASK ('X'))) && (sim_vm_pc_value || sim_PC)) {
+            rec.pc = sim_vm_pc_value ? (*sim_vm_pc_value)() : get_rval (sim_PC, 0);
+            rec.flags |= SIM_DEBTRACE_F_PC;
             }
+        _sim_deb_queue (&rec, buf, (size_t)len);
         }
-    if (i > j) {
-        if (!debug_unterm)                          /* print prefix when required */
-            _sim_debug_write (debug_prefix, strlen (debug_prefix));
-        _sim_debug_write (&buf[j], i-j);
-        }
-
-/* Set unterminated flag for next time */
-
-    debug_unterm = len ? (((buf[len-1]=='\n')) ? 0 : 1) : debug_unterm;
+    else
+        _sim_debug_lines (sim_debug_prefix (dbits, dptr, uptr), buf, len, &debug_unterm);
     if (buf != stackbuf)
         free (buf);
     sim_oline = saved_oline;                            /* restore original socket */
@@ -16408,7 +19847,7 @@ sim_printf ("Unit %s fired at %.0f\n", sim_uname (uptr), sim_gtime ());
 return SCPE_OK;
 }
 
-static t_stat test_scp_event_sequencing (void)
+static t_stat _test_scp_event_sequencing (void)
 {
 DEVICE *dptr = &sim_scp_dev;
 uint32 i;
@@ -16504,6 +19943,331 @@ sim_set_deb_switches (start_deb_switches);
 return r;
 }
 
+static t_stat test_scp_event_sequencing (void)
+{
+DEVICE *dptr = &sim_scp_dev;
+const char *engine[] = {"LIST", "HEAP", "LIST"};
+uint32 i, j;
+t_stat r;
+
+for (i = 0; i < 2; i++) {
+    sim_printf ("Testing %s event queue\n", engine[i]);
+    sim_set_queue (0, engine[i]);
+    r = _test_scp_event_sequencing ();
+    if (r != SCPE_OK)
+        return r;
+    }
+/* switch engines with events pending and check that times are preserved */
+for (i = 0; i < 2; i++) {
+    sim_set_queue (0, engine[i]);
+    while (sim_clock_queue != QUEUE_LIST_END)
+        sim_cancel (sim_clock_queue);
+    for (j = 0; j < dptr->numunits; j++)
+        sim_activate (&dptr->units[j], 10 + 5 * (j & 1));
+    sim_set_queue (0, engine[i + 1]);
+    for (j = 0; j < dptr->numunits; j++) {
+        int32 t = sim_activate_time (&dptr->units[j]);
+
+        if (t != (int32)(11 + 5 * (j & 1)))
+            return sim_messagef (SCPE_IERR, "sim_activate_time() unexpected result for unit %d after switch to %s: %d\n", j, engine[i + 1], t);
+        }
+    if (sim_clock_queue != &dptr->units[0])
+        return sim_messagef (SCPE_IERR, "unexpected first event %s after switch to %s\n", sim_uname (sim_clock_queue), engine[i + 1]);
+    }
+while (sim_clock_queue != QUEUE_LIST_END)
+    sim_cancel (sim_clock_queue);
+return SCPE_OK;
+}
+
+static t_stat test_scp_breakpoints (void)
+{
+uint32 saved_types = sim_brk_types, saved_dflt = sim_brk_dflt;
+const uint32 nbkpts = 5000, stride = 37;
+t_addr loc;
+uint32 hits;
+
+if (sim_brk_ent != 0) {
+    sim_printf ("Skipping breakpoint test - breakpoints already set\n");
+    return SCPE_OK;
+    }
+sim_printf ("Testing breakpoint lookup with %u breakpoints\n", nbkpts);
+sim_brk_types = sim_brk_dflt = SWMASK ('E');
+for (loc = 0; loc < nbkpts; loc++)
+    if (sim_brk_set (loc * stride, 0, 0, NULL) != SCPE_OK)
+        return sim_messagef (SCPE_IERR, "sim_brk_set() failed for %u\n", (uint32)(loc * stride));
+for (loc = hits = 0; loc < nbkpts * stride; loc++) {
+    if (sim_brk_test (loc, SWMASK ('E')) != 0) {
+        if ((loc % stride) != 0)
+            return sim_messagef (SCPE_IERR, "unexpected breakpoint match at %u\n", (uint32)loc);
+        ++hits;
+        }
+    }
+if (hits != nbkpts)
+    return sim_messagef (SCPE_IERR, "expected %u breakpoint matches, got %u\n", nbkpts, hits);
+for (loc = 0; loc < nbkpts; loc += 2)                   /* clear half individually */
+    sim_brk_clr (loc * stride, 0);
+for (loc = 0; loc < nbkpts * stride; loc += stride)
+    if ((sim_brk_fnd (loc) != NULL) != ((loc / stride) & 1))
+        return sim_messagef (SCPE_IERR, "wrong breakpoint state at %u after clear\n", (uint32)loc);
+sim_brk_clrall (0);                                     /* and the rest at once */
+if ((sim_brk_ent != 0) || sim_brk_summ)
+    return sim_messagef (SCPE_IERR, "breakpoints remain after clear: %d\n", sim_brk_ent);
+for (loc = 0; loc < nbkpts * stride; loc++)
+    if (SIM_BRK_PG_TEST (loc))
+        return sim_messagef (SCPE_IERR, "breakpoint page map not cleared at %u\n", (uint32)loc);
+sim_brk_types = saved_types;
+sim_brk_dflt = saved_dflt;
+return SCPE_OK;
+}
+
+/* Round trip memory through a chain of incremental snapshots, restore
+   the chain from another working directory, and check that a changed or
+   missing base snapshot is refused */
+
+static t_stat test_scp_snapshots (void)
+{
+DEVICE *dptr = sim_dflt_dev;
+UNIT *uptr;
+double saved_time = sim_time;
+char cwd[PATH_MAX + 1];
+char cmd[2 * PATH_MAX];
+const char *leaf;
+t_addr a1, a2;
+t_value v1, v2;
+t_stat r = SCPE_OK;
+
+if ((dptr == NULL) || (dptr->examine == NULL) || (dptr->deposit == NULL) ||
+    (sim_vm_memory_buffer == NULL) || (sim_getcwd (cwd, sizeof (cwd)) == NULL)) {
+    sim_printf ("Skipping snapshot test - no memory buffer\n");
+    return SCPE_OK;
+    }
+sim_printf ("Testing incremental snapshots\n");
+uptr = dptr->units;
+a1 = 0;                                                 /* two addresses in different blocks */
+a2 = (uptr->capac / 2) - ((uptr->capac / 2) % dptr->aincr);
+leaf = strrchr (cwd, '/');
+if (leaf == NULL)
+    leaf = strrchr (cwd, '\\');
+leaf = leaf ? leaf + 1 : "";
+dptr->deposit (1, a1, uptr, 0);
+dptr->deposit (2, a2, uptr, 0);
+sim_time = 1000.0;
+sim_switches = 0;
+r = save_cmd (0, "-I SnapTest-1.sav");                  /* complete base */
+if (r == SCPE_OK) {
+    dptr->deposit (3, a2, uptr, 0);
+    sim_time = 2000.0;
+    sim_switches = 0;
+    r = save_cmd (0, "-I SnapTest-2.sav");              /* changes only */
+    }
+if (r == SCPE_OK) {
+    dptr->deposit (4, a1, uptr, 0);
+    dptr->deposit (5, a2, uptr, 0);
+    sim_time = 3000.0;
+    sim_switches = 0;
+    if ((*leaf != '\0') && (sim_chdir ("..") == 0)) {   /* restore from the parent directory */
+        snprintf (cmd, sizeof (cmd), "%s/SnapTest-2.sav", leaf);
+        r = restore_cmd (0, cmd);
+        (void)sim_chdir (cwd);
+        }
+    else
+        r = restore_cmd (0, "SnapTest-2.sav");
+    if (r != SCPE_OK)
+        r = sim_messagef (SCPE_IERR, "RESTORE of incremental snapshot failed: %s\n", sim_error_text (r));
+    }
+if (r == SCPE_OK) {
+    dptr->examine (&v1, a1, uptr, 0);
+    dptr->examine (&v2, a2, uptr, 0);
+    if ((v1 != 1) || (v2 != 3) || (sim_time != 2000.0))
+        r = sim_messagef (SCPE_IERR, "Incremental snapshot restored %u and %u at time %.0f, expected 1 and 3 at time 2000\n",
+                                     (uint32)v1, (uint32)v2, sim_time);
+    }
+if (r == SCPE_OK) {                                     /* replace the base */
+    sim_time = 4000.0;
+    sim_switches = 0;
+    r = save_cmd (0, "SnapTest-1.sav");
+    sim_switches = SWMASK ('Q');
+    if ((r == SCPE_OK) && (restore_cmd (0, "SnapTest-2.sav") == SCPE_OK))
+        r = sim_messagef (SCPE_IERR, "RESTORE succeeded with a changed base snapshot\n");
+    }
+if (r == SCPE_OK) {                                     /* remove the base */
+    (void)remove ("SnapTest-1.sav");
+    sim_switches = SWMASK ('Q');
+    if (restore_cmd (0, "SnapTest-2.sav") == SCPE_OK)
+        r = sim_messagef (SCPE_IERR, "RESTORE succeeded with a missing base snapshot\n");
+    }
+(void)remove ("SnapTest-1.sav");
+(void)remove ("SnapTest-2.sav");
+dptr->deposit (0, a1, uptr, 0);
+dptr->deposit (0, a2, uptr, 0);
+sim_switches = 0;
+sim_time = saved_time;
+return r;
+}
+
+/* Execution trace recorder and reader.  Synthetic instructions with
+   varying lengths, jumps, register changes and memory writes are recorded
+   across several blocks, and then displayed from a range of starting
+   points both with and without the block index. */
+
+#define XT_TEST_INSNS   200000
+#define XT_TEST_REG(n, i) ((t_value)((((n) / ((i) + 1)) * 3 + (i)) & 077777))
+#define XT_TEST_ADDR(n) ((t_addr)(((n) * 6) & 0177776))
+#define XT_TEST_DATA(n) ((t_value)(((n) ^ 052525) & 0177777))
+
+static t_stat _test_scp_exectrace_show (const char *trace, t_uint64 start, t_uint64 count, const t_addr *pcs)
+{
+const char *outname = "ExecTraceTest.txt";
+const uint32 radix = sim_PC ? sim_PC->radix : 16;
+t_uint64 n = start, lines = 0, want;
+uint32 nregs, i, writes = 0;
+char line[1024], name[64];
+FILE *st;
+t_stat r;
+
+for (nregs = 0; sim_vm_exectrace_regs[nregs]; nregs++) ;
+st = fopen (outname, "w");
+if (st == NULL)
+    return sim_messagef (SCPE_OPENERR, "Can't create %s\n", outname);
+r = _sim_extr_show_file (st, trace, start, count);
+fclose (st);
+st = fopen (outname, "r");
+if ((r == SCPE_OK) && (st == NULL))
+    r = sim_messagef (SCPE_OPENERR, "Can't open %s\n", outname);
+while ((r == SCPE_OK) && fgets (line, sizeof (line), st)) {
+    char *p = strstr (line, "  write ");
+
+    if (p != NULL) {                                    /* memory write of the last instruction */
+        t_uint64 addr, data;
+
+        addr = strtoull (p + 8, &p, radix);
+        p = strstr (p, " <- ");
+        data = p ? strtoull (p + 4, NULL, radix) : 0;
+        if ((lines == 0) || ((n - 1) % 5) || writes ||
+            (addr != XT_TEST_ADDR (n - 1)) || (data != XT_TEST_DATA (n - 1)))
+            r = sim_messagef (SCPE_IERR, "Unexpected write after instruction %" LL_FMT "u: %s", (unsigned LL_TYPE)(n - 1), line);
+        ++writes;
+        continue;
+        }
+    if ((lines > 0) && (((n - 1) % 5) == 0) && (writes != 1)) {
+        r = sim_messagef (SCPE_IERR, "Missing write for instruction %" LL_FMT "u\n", (unsigned LL_TYPE)(n - 1));
+        break;
+        }
+    writes = 0;
+    if ((strtoull (line, &p, 10) != n) || ((t_addr)strtoull (p, &p, radix) != pcs[n]) || (*p != ':')) {
+        r = sim_messagef (SCPE_IERR, "Expected instruction %" LL_FMT "u at PC %X: %s", (unsigned LL_TYPE)n, (unsigned int)pcs[n], line);
+        break;
+        }
+    for (i = 0; i < nregs; i++) {
+        char *v;
+
+        snprintf (name, sizeof (name), " %s=", sim_vm_exectrace_regs[i]);
+        v = strstr (p, name);
+        if (v ? (strtoull (v + strlen (name), NULL, radix) != XT_TEST_REG (n, i)) :
+                ((lines == 0) || (XT_TEST_REG (n, i) != XT_TEST_REG (n - 1, i)))) {
+            r = sim_messagef (SCPE_IERR, "Wrong %s for instruction %" LL_FMT "u: %s", sim_vm_exectrace_regs[i], (unsigned LL_TYPE)n, line);
+            break;
+            }
+        }
+    ++n;
+    ++lines;
+    }
+if (st)
+    fclose (st);
+(void)remove (outname);
+want = MIN (count, XT_TEST_INSNS - start);
+if ((r == SCPE_OK) && ((lines != want) || ((((n - 1) % 5) == 0) && (writes != 1))))
+    r = sim_messagef (SCPE_IERR, "Showing %" LL_FMT "u instructions from %" LL_FMT "u displayed %" LL_FMT "u\n",
+                      (unsigned LL_TYPE)count, (unsigned LL_TYPE)start, (unsigned LL_TYPE)lines);
+return r;
+}
+
+static t_stat test_scp_exectrace (void)
+{
+const char *trace = "ExecTraceTest.trc";
+const char *noindex = "ExecTraceTest-noidx.trc";
+int32 saved_quiet = sim_quiet;
+t_value regs[EXTR_MAXREGS];
+uint8 inst[6] = {0};
+t_addr *pcs, pc = 01000;
+t_uint64 starts[8];
+uint8 *data = NULL;
+size_t size = 0;
+uint32 nregs, i, n, nstarts = 0;
+EXTRREAD rd;
+FILE *f;
+t_stat r;
+
+if ((sim_vm_exectrace_regs == NULL) || (sim_extr.file != NULL))
+    return SCPE_OK;
+sim_printf ("Testing execution trace recording\n");
+for (nregs = 0; sim_vm_exectrace_regs[nregs]; nregs++) ;
+pcs = (t_addr *)malloc (XT_TEST_INSNS * sizeof (*pcs));
+if (pcs == NULL)
+    return SCPE_MEM;
+sim_quiet = 1;
+r = sim_set_exectrace (1, trace);
+sim_quiet = saved_quiet;
+if (r != SCPE_OK) {
+    free (pcs);
+    return r;
+    }
+for (n = 0; n < XT_TEST_INSNS; n++) {
+    uint32 ilen = 2 + 2 * (n % 3);
+
+    for (i = 0; i < nregs; i++)
+        regs[i] = XT_TEST_REG (n, i);
+    pcs[n] = pc;
+    sim_exectrace_insn (pc, inst, ilen, regs);
+    if ((n % 5) == 0)
+        sim_exectrace_mem (XT_TEST_ADDR (n), XT_TEST_DATA (n), 2);
+    pc = ((n % 37) == 36) ? (t_addr)((n * 14) & 077776) : (t_addr)((pc + ilen) & 077776);
+    }
+sim_quiet = 1;
+sim_set_exectrace (0, NULL);
+sim_quiet = saved_quiet;
+r = _sim_extr_open_read (&rd, trace);
+if ((r == SCPE_OK) && (rd.nblocks < 3))
+    r = sim_messagef (SCPE_IERR, "Execution trace has only %d blocks\n", (int)rd.nblocks);
+if (r == SCPE_OK) {                                     /* around block boundaries */
+    starts[nstarts++] = 0;
+    starts[nstarts++] = rd.index[2 * 1 + 1] - 3;
+    starts[nstarts++] = rd.index[2 * 1 + 1];
+    starts[nstarts++] = rd.index[2 * (rd.nblocks - 1) + 1] + 1;
+    starts[nstarts++] = XT_TEST_INSNS / 2;
+    starts[nstarts++] = XT_TEST_INSNS - 4;
+    }
+_sim_extr_close_read (&rd);
+for (i = 0; (r == SCPE_OK) && (i < nstarts); i++)
+    r = _test_scp_exectrace_show (trace, starts[i], 20, pcs);
+if (r == SCPE_OK)
+    r = _test_scp_exectrace_show (trace, 0, XT_TEST_INSNS, pcs);
+f = fopen (trace, "rb");                                /* copy without the index */
+if ((r == SCPE_OK) && (f != NULL)) {
+    size = (size_t)sim_fsize_ex (f);
+    data = (uint8 *)malloc (size);
+    if ((data == NULL) || (fread (data, 1, size, f) != size) || (size < 16))
+        r = sim_messagef (SCPE_IOERR, "Can't read %s\n", trace);
+    }
+if (f)
+    fclose (f);
+if (r == SCPE_OK) {
+    size = (size_t)_sim_extr_get_le (data + size - 8, 8);
+    f = fopen (noindex, "wb");
+    if ((f == NULL) || (fwrite (data, 1, size, f) != size))
+        r = sim_messagef (SCPE_IOERR, "Can't write %s\n", noindex);
+    if (f)
+        fclose (f);
+    }
+for (i = 0; (r == SCPE_OK) && (i < nstarts); i++)
+    r = _test_scp_exectrace_show (noindex, starts[i], 20, pcs);
+free (data);
+free (pcs);
+(void)remove (trace);
+(void)remove (noindex);
+return r;
+}
+
 static t_stat test_scp_debug_logging()
 {
 uint32 saved_scp_dev_dbits = sim_scp_dev.dctrl;
@@ -16534,6 +20298,167 @@ sim_printf ("Log de-duplication successful.\n");
 return SCPE_OK;
 }
 
+/* Compare the combined EXPECT matcher against matching each literal rule
+   in definition order on a pseudo random output stream.  The rules
+   overlap, are suffixes of each other and include a one shot rule and a
+   rule added while data is buffered. */
+
+static t_stat test_scp_expect (void)
+{
+static const char *rules[] = {"abcab", "bca", "ab", "cabx", "aaaa", "xb", "cab", "bcaxa"};
+const size_t nrules = sizeof (rules) / sizeof (rules[0]);
+const size_t oneshot = 1;                               /* "bca" is removed when it matches */
+const size_t late = nrules - 1;                         /* "bcaxa" is added after 1000 characters */
+size_t expected[sizeof (rules) / sizeof (rules[0])];
+t_bool active[sizeof (rules) / sizeof (rules[0])];
+char since[64], quoted[32];
+size_t i, j, slen = 0;
+uint32 seed = 12345;
+EXPECT exp;
+t_stat r = SCPE_OK;
+
+sim_printf ("Testing EXPECT literal matching with %d rules\n", (int)nrules);
+sim_exp_init (&exp);
+exp.dptr = &sim_scp_dev;
+exp.dbit = SCP_LOG_TESTING;
+for (i = 0; i < nrules; i++) {
+    expected[i] = 0;
+    active[i] = (i != late);
+    snprintf (quoted, sizeof (quoted), "\"%s\"", rules[i]);
+    if (active[i] && (SCPE_OK != sim_exp_set (&exp, quoted, 0, 0, (i == oneshot) ? 0 : EXP_TYP_PERSIST, NULL)))
+        return sim_messagef (SCPE_IERR, "Can't define EXPECT rule %s\n", quoted);
+    }
+for (j = 0; (r == SCPE_OK) && (j < 20000); j++) {
+    char c;
+    size_t match = nrules;
+
+    if (j == 1000) {
+        snprintf (quoted, sizeof (quoted), "\"%s\"", rules[late]);
+        if (SCPE_OK != sim_exp_set (&exp, quoted, 0, 0, EXP_TYP_PERSIST, NULL))
+            r = sim_messagef (SCPE_IERR, "Can't define EXPECT rule %s\n", quoted);
+        active[late] = TRUE;
+        }
+    seed = seed * 1103515245 + 12345;
+    c = "abcxab"[(seed >> 16) % 6];
+    if (slen == sizeof (since)) {                       /* keep the most recent data */
+        memmove (since, since + sizeof (since) / 2, sizeof (since) / 2);
+        slen = sizeof (since) / 2;
+        }
+    since[slen++] = c;
+    for (i = 0; (match == nrules) && (i < nrules); i++) {
+        size_t len = strlen (rules[i]);
+
+        if (active[i] && (len <= slen) && (memcmp (since + slen - len, rules[i], len) == 0))
+            match = i;
+        }
+    if (match != nrules) {
+        ++expected[match];
+        slen = 0;                                       /* matched data is consumed */
+        if (match == oneshot)
+            active[oneshot] = FALSE;
+        }
+    sim_exp_check (&exp, (uint8)c);
+    }
+for (i = 0; (r == SCPE_OK) && (i < exp.size); i++) {
+    size_t k;
+
+    for (k = 0; k < nrules; k++) {
+        snprintf (quoted, sizeof (quoted), "\"%s\"", rules[k]);
+        if (strcmp (quoted, exp.rules[i].match_pattern) == 0)
+            break;
+        }
+    if ((k == nrules) || (exp.rules[i].matches != expected[k]))
+        r = sim_messagef (SCPE_IERR, "EXPECT rule %s matched %d times, expected %d\n",
+                          exp.rules[i].match_pattern, (int)exp.rules[i].matches, (k == nrules) ? -1 : (int)expected[k]);
+    }
+if ((r == SCPE_OK) && ((expected[oneshot] != 1) || (exp.size != nrules - 1)))
+    r = sim_messagef (SCPE_IERR, "One shot EXPECT rule matched %d times, %d rules remain\n",
+                      (int)expected[oneshot], (int)exp.size);
+sim_exp_clrall (&exp);
+sim_cancel (&sim_expect_unit);                          /* discard the match side effects */
+sim_brk_clract ();
+unsetenv ("_EXPECT_MATCH_PATTERN");
+return r;
+}
+
+/* Exercise the asynchronous debug writer: enough records to wrap the
+   ring, direct debug file output interleaved with device messages and
+   bit field output, then check that everything arrived in order. */
+
+static t_stat test_scp_debug_ring (void)
+{
+static BITFIELD ring_bits[] = {
+    BITF(LOW,4),
+    BIT(FLAG),
+    ENDBITS
+    };
+uint32 saved_scp_dev_dbits = sim_scp_dev.dctrl;
+int32 saved_switches = sim_switches;
+int32 saved_quiet = sim_quiet;
+const char *logname = "DebugRingTest.log";
+const int32 count = 100000;
+int32 i, next = 0, direct = 0, bits = 0;
+char line[256];
+FILE *f;
+t_stat r;
+
+if (sim_deb != NULL)                                    /* don't disturb user debug output */
+    return SCPE_OK;
+sim_quiet = 1;
+sim_switches = SWMASK ('W') | SWMASK ('F');
+r = sim_set_debon (0, logname);
+sim_switches = saved_switches;
+if (r != SCPE_OK) {
+    sim_quiet = saved_quiet;
+    return sim_messagef (r, "Can't start asynchronous debug output\n");
+    }
+sim_scp_dev.dctrl = SCP_LOG_TESTING;
+for (i = 0; i < count; i++) {
+    _sim_debug_device (SCP_LOG_TESTING, &sim_scp_dev, "Ring message %d of the asynchronous writer test\n", (int)i);
+    if ((i % 1000) == 999)
+        fprintf (sim_deb, "Direct line %d\n", (int)(i + 1));
+    if (i == count / 2)
+        sim_debug_bits_hdr (SCP_LOG_TESTING, &sim_scp_dev, "Ring bits", ring_bits, 0x03, 0x11, 1);
+    }
+sim_scp_dev.dctrl = saved_scp_dev_dbits;
+sim_set_deboff (0, NULL);
+sim_quiet = saved_quiet;
+f = fopen (logname, "r");
+if (f == NULL)
+    return sim_messagef (SCPE_OPENERR, "Can't open %s\n", logname);
+r = SCPE_OK;
+while ((r == SCPE_OK) && fgets (line, sizeof (line), f)) {
+    const char *p;
+    int n;
+
+    if ((p = strstr (line, "Ring message ")) != NULL) {
+        n = atoi (p + strlen ("Ring message "));
+        if (n != next)
+            r = sim_messagef (SCPE_IERR, "Expected ring message %d, found %d\n", (int)next, n);
+        ++next;
+        }
+    else if (strncmp (line, "Direct line ", 12) == 0) {
+        n = atoi (line + 12);
+        if (n != next)
+            r = sim_messagef (SCPE_IERR, "Direct line %d out of order after message %d\n", n, (int)next);
+        ++direct;
+        }
+    else if (strstr (line, "Ring bits: FLAG^ LOW=_0x1 ") != NULL) {
+        if (next != count / 2 + 1)
+            r = sim_messagef (SCPE_IERR, "Bit field output out of order after message %d\n", (int)next);
+        ++bits;
+        }
+    }
+fclose (f);
+(void)remove (logname);
+if ((r == SCPE_OK) && ((next != count) || (direct != count / 1000) || (bits != 1)))
+    r = sim_messagef (SCPE_IERR, "Asynchronous debug output: %d of %d messages, %d of %d direct lines, %d bit field lines\n",
+                                 (int)next, (int)count, (int)direct, (int)(count / 1000), (int)bits);
+if (r == SCPE_OK)
+    sim_printf ("Asynchronous debug output successful.\n");
+return r;
+}
+
 /*
  * Compiled in unit tests for the various device oriented library
  * modules: sim_card, sim_disk, sim_tape, sim_ether, sim_tmxr, etc.
@@ -16580,6 +20505,16 @@ if ((strcmp (gbuf, "ALL") == 0) || (strcmp (gbuf, "SCP") == 0)) {
         return sim_messagef (SCPE_IERR, "SCP event sequencing test failed\n");
     if (test_scp_debug_logging () != SCPE_OK)
         return sim_messagef (SCPE_IERR, "SCP debug logging test failed\n");
+    if (test_scp_debug_ring () != SCPE_OK)
+        return sim_messagef (SCPE_IERR, "SCP asynchronous debug output test failed\n");
+    if (test_scp_breakpoints () != SCPE_OK)
+        return sim_messagef (SCPE_IERR, "SCP breakpoint test failed\n");
+    if (test_scp_expect () != SCPE_OK)
+        return sim_messagef (SCPE_IERR, "SCP EXPECT test failed\n");
+    if (test_scp_snapshots () != SCPE_OK)
+        return sim_messagef (SCPE_IERR, "SCP snapshot test failed\n");
+    if (test_scp_exectrace () != SCPE_OK)
+        return sim_messagef (SCPE_IERR, "SCP execution trace test failed\n");
 }
 for (i = 0; (dptr = sim_devices[i]) != NULL; i++) {
     t_stat tstat = SCPE_OK;
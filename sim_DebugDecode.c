@@ -0,0 +1,413 @@
+/* sim_DebugDecode.c: convert a SET DEBUG -X binary trace to text
+
+   Copyright (c) 2026, The open-simh project
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+   IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   This program reads the records written by SET DEBUG -X (see
+   sim_debtrace.h) and writes the text which SET DEBUG would have written
+   directly.  The -T, -A, -R, -P and -F switches have the same meaning as
+   they do on the SET DEBUG command, so the choice of what each line shows
+   can be made after the trace has been captured:
+
+        DebugDecode [-T|-A] [-R] [-P] [-F] tracefile [outputfile]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sim_debtrace.h"
+
+typedef unsigned long long t_val;
+
+typedef struct {
+    char        *name;                              /* device name */
+    int         nflags;
+    unsigned    masks[32];                          /* debug flag masks */
+    char        *flags[32];                         /* debug flag names */
+    } DEVINFO;
+
+static int sw_t, sw_a, sw_r, sw_p, sw_f;            /* switches */
+static FILE *out;
+static DEVINFO *devs = NULL;
+static int ndevs = 0;
+static char pc_name[64] = "";
+static unsigned pc_radix, pc_width, pc_fmt;
+static long long base_sec;
+static long base_nsec;
+static int unterm = 0;
+
+static char *line = NULL;                           /* output line assembly */
+static size_t line_len = 0, line_size = 0;
+static char *last = NULL;                           /* duplicate line filter */
+static size_t last_size = 0;
+static char last_prefix[512];
+static int last_count = 0;
+
+static t_val get_le (const unsigned char *p, int bytes)
+{
+t_val val = 0;
+
+while (bytes-- > 0)
+    val = (val << 8) | p[bytes];
+return val;
+}
+
+/* Duplicate line summary, as in _sim_debug_write_flush () */
+
+static void flush_dups (void)
+{
+if (last_count > 0)
+    fputs (last, out);
+if (last_count > 1)
+    fprintf (out, "%ssame as above (%d time%s)\r\n", last_prefix, last_count - 1,
+                  ((last_count - 1) != 1) ? "s" : "");
+last_count = 0;
+}
+
+static void put_line (const char *buf)
+{
+const char *endprefix = strstr (buf, ")> ");
+size_t len = strlen (buf);
+
+if (sw_f || (0 != memcmp ("DBG(", buf, 4)) || (endprefix == NULL)) {
+    flush_dups ();
+    fputs (buf, out);
+    return;
+    }
+if ((last_count > 0) && (0 == strcmp (strstr (last, ")> "), endprefix))) {
+    size_t plen = (size_t)(endprefix - buf) + 3;
+
+    if (plen >= sizeof (last_prefix))
+        plen = sizeof (last_prefix) - 1;
+    memcpy (last_prefix, buf, plen);
+    last_prefix[plen] = '\0';
+    ++last_count;
+    return;
+    }
+flush_dups ();
+if (len + 1 > last_size) {
+    last_size = len + 1;
+    last = (char *)realloc (last, last_size);
+    if (last == NULL) {
+        fprintf (stderr, "Out of memory\n");
+        exit (EXIT_FAILURE);
+        }
+    }
+strcpy (last, buf);
+last_count = 1;
+}
+
+static void put_text (const char *buf, size_t len)
+{
+size_t i;
+
+for (i = 0; i < len; i++) {
+    if (line_len + 2 > line_size) {
+        line_size = line_size ? 2 * line_size : 1024;
+        line = (char *)realloc (line, line_size);
+        if (line == NULL) {
+            fprintf (stderr, "Out of memory\n");
+            exit (EXIT_FAILURE);
+            }
+        }
+    line[line_len++] = buf[i];
+    if (buf[i] == '\n') {
+        line[line_len] = '\0';
+        put_line (line);
+        line_len = 0;
+        }
+    }
+}
+
+static const char *dev_verb (DEVINFO *dev, unsigned dbits)
+{
+const char *some_match = NULL;
+int i;
+
+if (dev->nflags == 0)
+    return "DEBTAB_ISNULL";
+for (i = 0; i < dev->nflags; i++) {
+    if (dev->masks[i] == dbits)
+        return dev->flags[i];
+    if (dev->masks[i] & dbits)
+        some_match = dev->flags[i];
+    }
+return some_match ? some_match : "DEBTAB_NOMATCH";
+}
+
+/* Format a PC value the way sprint_val () does for PV_RZRO and PV_RSPC */
+
+static void format_pc (char *buf, t_val val)
+{
+char dbuf[72];
+int d = sizeof (dbuf) - 1, ndigits = 1;
+t_val mask = (pc_width >= 64) ? ~0ULL : ((1ULL << pc_width) - 1);
+t_val wtest, owtest;
+unsigned radix = pc_radix ? pc_radix : 16;
+
+memset (dbuf, (pc_fmt == 0) ? '0' : ' ', sizeof (dbuf) - 1);
+dbuf[d] = '\0';
+do {
+    unsigned digit = (unsigned)(val % radix);
+
+    val = val / radix;
+    dbuf[--d] = (char)((digit <= 9) ? '0' + digit : 'A' + (digit - 10));
+    } while ((d > 0) && (val != 0));
+if (pc_fmt <= 1) {                                  /* PV_RZRO or PV_RSPC */
+    wtest = owtest = radix;
+    while ((wtest < mask) && (wtest >= owtest)) {
+        owtest = wtest;
+        wtest = wtest * radix;
+        ndigits = ndigits + 1;
+        }
+    if (((int)sizeof (dbuf) - 1 - ndigits) < d)
+        d = (int)sizeof (dbuf) - 1 - ndigits;
+    }
+strcpy (buf, &dbuf[d]);
+}
+
+static void do_msg (const unsigned char *rec, size_t len, unsigned devno)
+{
+unsigned dbits = (unsigned)get_le (rec + 8, 4);
+unsigned flags = (unsigned)get_le (rec + 12, 4);
+long long sec = (long long)get_le (rec + 16, 8);
+long nsec = (long)get_le (rec + 24, 4);
+t_val gbits = get_le (rec + 28, 8);
+t_val pc = get_le (rec + 36, 8);
+const char *text = (const char *)rec + SIM_DEBTRACE_MSG_HDR;
+size_t tlen = len - SIM_DEBTRACE_MSG_HDR;
+char prefix[512], tim[64] = "", pc_s[128] = "";
+DEVINFO unknown = {(char *)"UNKNOWN", 0};
+DEVINFO *dev = (devno < (unsigned)ndevs) ? &devs[devno] : &unknown;
+double gtime;
+size_t i, j;
+
+memcpy (&gtime, &gbits, sizeof (gtime));
+if (sw_r) {
+    sec -= base_sec;
+    nsec -= base_nsec;
+    if (nsec < 0) {
+        nsec += 1000000000;
+        sec -= 1;
+        }
+    }
+if (sw_t) {
+    if (sw_r)
+        sprintf (tim, "%02d:%02d:%02d.%03d ", (int)((sec / 3600) % 24), (int)((sec / 60) % 60),
+                                              (int)(sec % 60), (int)(nsec / 1000000));
+    else {
+        time_t tnow = (time_t)sec;
+        struct tm *now = localtime (&tnow);
+
+        sprintf (tim, "%02d:%02d:%02d.%03d ", now->tm_hour, now->tm_min, now->tm_sec, (int)(nsec / 1000000));
+        }
+    }
+if (sw_a)
+    sprintf (tim, "%lld.%03d ", sec, (int)(nsec / 1000000));
+if (sw_p && (flags & SIM_DEBTRACE_F_PC)) {
+    sprintf (pc_s, "-%s:", pc_name);
+    format_pc (&pc_s[strlen (pc_s)], pc);
+    }
+snprintf (prefix, sizeof (prefix), "DBG(%s%.0f%s)%s> %s %s: ", tim, gtime, pc_s,
+          (flags & SIM_DEBTRACE_F_THREAD) ? "+" : "", dev->name, dev_verb (dev, dbits));
+
+/* Expand newlines the way _sim_debug_lines () does */
+
+for (i = j = 0; i < tlen; ++i) {
+    if ('\n' == text[i]) {
+        if ((i != j) || (i == 0)) {
+            if (!unterm)
+                put_text (prefix, strlen (prefix));
+            put_text (&text[j], i - j);
+            put_text ("\r\n", 2);
+            }
+        unterm = 0;
+        j = i + 1;
+        }
+    }
+if (i > j) {
+    if (!unterm)
+        put_text (prefix, strlen (prefix));
+    put_text (&text[j], i - j);
+    }
+unterm = tlen ? ((text[tlen - 1] == '\n') ? 0 : 1) : unterm;
+}
+
+static void do_device (const unsigned char *rec, size_t len, unsigned devno)
+{
+const char *p = (const char *)rec + SIM_DEBTRACE_HDR;
+const char *end = (const char *)rec + len;
+DEVINFO *dev;
+
+if (devno >= (unsigned)ndevs) {
+    devs = (DEVINFO *)realloc (devs, (devno + 1) * sizeof (*devs));
+    if (devs == NULL) {
+        fprintf (stderr, "Out of memory\n");
+        exit (EXIT_FAILURE);
+        }
+    memset (&devs[ndevs], 0, (devno + 1 - ndevs) * sizeof (*devs));
+    ndevs = devno + 1;
+    }
+dev = &devs[devno];
+free (dev->name);
+dev->name = strdup (p);
+dev->nflags = 0;
+p += strlen (p) + 1;
+while ((p + 5 <= end) && (dev->nflags < 32)) {
+    dev->masks[dev->nflags] = (unsigned)get_le ((const unsigned char *)p, 4);
+    dev->flags[dev->nflags++] = strdup (p + 4);
+    p += 4 + strlen (p + 4) + 1;
+    }
+}
+
+static int do_info (const unsigned char *rec, size_t len)
+{
+const char *p = (const char *)rec + SIM_DEBTRACE_INFO_HDR;
+
+if ((len < SIM_DEBTRACE_INFO_HDR + 2) ||
+    (memcmp (rec + 8, SIM_DEBTRACE_MAGIC, 8) != 0) ||
+    (get_le (rec + 16, 4) != SIM_DEBTRACE_VERSION))
+    return 0;
+pc_radix = (unsigned)get_le (rec + 20, 4);
+pc_width = (unsigned)get_le (rec + 24, 4);
+pc_fmt = (unsigned)get_le (rec + 28, 4);
+base_sec = (long long)get_le (rec + 32, 8);
+base_nsec = (long)get_le (rec + 40, 4);
+p += strlen (p) + 1;                                /* skip the simulator name */
+strncpy (pc_name, p, sizeof (pc_name) - 1);
+ndevs = 0;                                          /* device numbers restart */
+unterm = 0;
+return 1;
+}
+
+static void usage (void)
+{
+fprintf (stderr, "Usage: DebugDecode [-T|-A] [-R] [-P] [-F] tracefile [outputfile]\n\n"
+                 "  -T  show time of day as hh:mm:ss.msec\n"
+                 "  -A  show time of day as seconds.msec\n"
+                 "  -R  show time relative to the start of debugging (implies -T)\n"
+                 "  -P  show the PC value\n"
+                 "  -F  don't summarize duplicate lines\n");
+exit (EXIT_FAILURE);
+}
+
+int main (int argc, char **argv)
+{
+FILE *in;
+unsigned char hdr[SIM_DEBTRACE_HDR], *rec = NULL;
+size_t rec_size = 0, len;
+const char *fin = NULL, *fout = NULL;
+int i, records = 0;
+
+for (i = 1; i < argc; i++) {
+    if ((argv[i][0] == '-') && argv[i][1]) {
+        const char *c;
+
+        for (c = &argv[i][1]; *c; c++) {
+            switch (*c) {
+                case 't': case 'T': sw_t = 1; break;
+                case 'a': case 'A': sw_a = 1; break;
+                case 'r': case 'R': sw_r = 1; break;
+                case 'p': case 'P': sw_p = 1; break;
+                case 'f': case 'F': sw_f = 1; break;
+                default:  usage ();
+                }
+            }
+        }
+    else if (fin == NULL)
+        fin = argv[i];
+    else if (fout == NULL)
+        fout = argv[i];
+    else
+        usage ();
+    }
+if (fin == NULL)
+    usage ();
+if (sw_r && !sw_a)
+    sw_t = 1;
+if (sw_t && sw_a)
+    sw_t = 0;
+in = fopen (fin, "rb");
+if (in == NULL) {
+    perror (fin);
+    return EXIT_FAILURE;
+    }
+out = fout ? fopen (fout, "wb") : stdout;
+if (out == NULL) {
+    perror (fout);
+    return EXIT_FAILURE;
+    }
+while (fread (hdr, 1, sizeof (hdr), in) == sizeof (hdr)) {
+    unsigned type = hdr[1];
+    unsigned devno = (unsigned)get_le (hdr + 2, 2);
+
+    len = (size_t)get_le (hdr + 4, 4);
+    if ((hdr[0] != 0) || (len < SIM_DEBTRACE_HDR)) {
+        fprintf (stderr, "%s: invalid record at offset %ld\n", fin, ftell (in) - (long)sizeof (hdr));
+        return EXIT_FAILURE;
+        }
+    if (len > rec_size) {
+        rec_size = len;
+        rec = (unsigned char *)realloc (rec, rec_size);
+        if (rec == NULL) {
+            fprintf (stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+            }
+        }
+    memcpy (rec, hdr, sizeof (hdr));
+    if (fread (rec + sizeof (hdr), 1, len - sizeof (hdr), in) != len - sizeof (hdr)) {
+        fprintf (stderr, "%s: truncated record\n", fin);
+        break;
+        }
+    if ((records++ == 0) && (type != SIM_DEBTRACE_INFO)) {
+        fprintf (stderr, "%s: not a simulator debug trace\n", fin);
+        return EXIT_FAILURE;
+        }
+    switch (type) {
+        case SIM_DEBTRACE_INFO:
+            if (!do_info (rec, len)) {
+                fprintf (stderr, "%s: unsupported trace format\n", fin);
+                return EXIT_FAILURE;
+                }
+            break;
+        case SIM_DEBTRACE_DEVICE:
+            do_device (rec, len, devno);
+            break;
+        case SIM_DEBTRACE_MSG:
+            if (len >= SIM_DEBTRACE_MSG_HDR)
+                do_msg (rec, len, devno);
+            break;
+        case SIM_DEBTRACE_TEXT:
+            put_text ((const char *)rec + SIM_DEBTRACE_HDR, len - SIM_DEBTRACE_HDR);
+            break;
+        default:                                    /* skip unknown records */
+            break;
+        }
+    }
+if (line_len) {                                     /* unterminated last line */
+    line[line_len] = '\0';
+    put_line (line);
+    }
+flush_dups ();
+fclose (in);
+if (out != stdout)
+    fclose (out);
+return EXIT_SUCCESS;
+}
@@ -0,0 +1,472 @@
+/* sim_DiskTool.c: disk container conversion, verification and checksum tool
+
+   Copyright (c) 2026, The open-simh project
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+   IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   DiskTool is built on the simulator framework, so it opens containers
+   with exactly the code the simulators use (sim_disk.c) and has the usual
+   command line, scripting and help.  It has no processor, just a two unit
+   DSK device used to attach the source and destination containers, and
+   these commands:
+
+        CONVERT {-F format} {-V} source-spec {destination}
+        COMPACT container-spec
+        VERIFY container1 container2
+        CHECKSUM container-spec
+        REPLAY {-W} trace container
+
+   The data is moved by sim_disk_copy, which overlaps reading, scanning
+   and writing across several threads.  A script of these commands can be
+   given on the command line:
+
+        DiskTool convert-script.do
+*/
+
+#include "sim_defs.h"
+#include "sim_disk.h"
+
+char sim_name[64] = "DiskTool";
+int32 sim_emax = 1;
+
+static uint32 dsk_crc;                              /* last checksum computed */
+
+static t_stat dsk_reset (DEVICE *dptr);
+static t_stat dsk_convert_cmd (int32 flag, CONST char *cptr);
+static t_stat dsk_verify_cmd (int32 flag, CONST char *cptr);
+static t_stat dsk_checksum_cmd (int32 flag, CONST char *cptr);
+static t_stat dsk_replay_cmd (int32 flag, CONST char *cptr);
+
+/* DSK data structures
+
+   dsk_dev      DSK device descriptor
+   dsk_unit     DSK unit list: 0 is a source, 1 a destination
+   dsk_reg      DSK register list
+*/
+
+static UNIT dsk_unit[] = {
+    { UDATA (NULL, UNIT_ATTABLE+UNIT_ROABLE, 0) },
+    { UDATA (NULL, UNIT_ATTABLE+UNIT_ROABLE, 0) }
+    };
+
+static REG dsk_reg[] = {
+    { HRDATAD (CRC, dsk_crc, 32, "CRC32 of the last container read") },
+    { NULL }
+    };
+
+static MTAB dsk_mod[] = {
+    { MTAB_XTD|MTAB_VUN, 0, "FORMAT", "FORMAT={AUTO|SIMH|VHD|DDI|RAW}",
+        &sim_disk_set_fmt, &sim_disk_show_fmt, NULL, "Display disk format" },
+    { 0 }
+    };
+
+DEVICE dsk_dev = {
+    "DSK", dsk_unit, dsk_reg, dsk_mod,
+    2, 10, 48, 1, 16, 8,
+    NULL, NULL, &dsk_reset,
+    NULL, NULL, NULL,
+    NULL, DEV_DISK
+    };
+
+DEVICE *sim_devices[] = {
+    &dsk_dev,
+    NULL
+    };
+
+REG *sim_PC = &dsk_reg[0];
+
+const char *sim_stop_messages[SCPE_BASE] = {
+    "Unknown error",
+    "No processor"
+    };
+
+static CTAB dsk_cmd[] = {
+    { "CONVERT",    &dsk_convert_cmd,   0,
+      "conv{ert} {-F format} {-V} source-spec {destination}\n"
+      "                         copy disk containers into new containers of the\n"
+      "                         given format (VHD, SIMH or DDI, default VHD).  The\n"
+      "                         destination is a file, a directory or omitted (the\n"
+      "                         source's name with .vhd, .dsk or .ddi).  Sectors of\n"
+      "                         zeros aren't written.  -V compares the result with\n"
+      "                         its source\n", NULL, NULL },
+    { "COMPACT",    &dsk_convert_cmd,   1,
+      "comp{act} container-spec\n"
+      "                         rewrite disk containers in their own format without\n"
+      "                         their sectors of zeros, comparing before replacing\n"
+      "                         (a differencing VHD becomes a complete VHD)\n", NULL, NULL },
+    { "VERIFY",     &dsk_verify_cmd,    0,
+      "ver{ify} container1 container2\n"
+      "                         compare the data in two disk containers\n", NULL, NULL },
+    { "CHECKSUM",   &dsk_checksum_cmd,  0,
+      "check{sum} container-spec\n"
+      "                         display the CRC32 of the data in disk containers\n"
+      "                         (for SIMH and RAW containers, the CRC32 of the file\n"
+      "                         without its metadata)\n", NULL, NULL },
+    { "REPLAY",     &dsk_replay_cmd,    0,
+      "rep{lay} {-W} trace container\n"
+      "                         perform the transfers recorded by SET <unit>\n"
+      "                         IOTRACE against a container, as fast as it allows,\n"
+      "                         and display the resulting I/O statistics.  Writes\n"
+      "                         are skipped unless -W is given (they overwrite the\n"
+      "                         container's data)\n", NULL, NULL },
+    { NULL }
+    };
+
+static t_stat dsk_reset (DEVICE *dptr)
+{
+sim_vm_cmd = dsk_cmd;
+return SCPE_OK;
+}
+
+t_stat sim_instr (void)
+{
+return 1;                                           /* No processor */
+}
+
+t_stat sim_load (FILE *fileref, CONST char *cptr, CONST char *fnam, int flag)
+{
+return SCPE_NOFNC;
+}
+
+t_stat fprint_sym (FILE *of, t_addr addr, t_value *val, UNIT *uptr, int32 sw)
+{
+return SCPE_ARG;
+}
+
+t_stat parse_sym (CONST char *cptr, t_addr addr, UNIT *uptr, t_value *val, int32 sw)
+{
+return SCPE_ARG;
+}
+
+/* Attach a container at its own size, read only unless it is to be
+   written */
+
+static t_stat dsk_open (UNIT *uptr, const char *path, t_bool writable)
+{
+int32 saved_quiet = sim_quiet;
+uint32 sector_size = 512, xfer_element_size = 1;
+const char *dtype;
+t_stat r;
+
+sim_disk_set_fmt (uptr, 0, "AUTO", NULL);
+uptr->capac = 0;
+sim_quiet = TRUE;
+sim_switches = (writable ? 0 : SWMASK ('R')) | SWMASK ('E');
+r = sim_disk_attach (uptr, path, 512, 1, FALSE, 0, NULL, 0, 0);
+dtype = (r == SCPE_OK) ? sim_disk_get_dtype (uptr, &sector_size, &xfer_element_size) : NULL;
+if (dtype && (sector_size != 512) && (sector_size != 0)) {  /* reopen with its sectors */
+    sim_disk_detach (uptr);
+    sim_disk_set_fmt (uptr, 0, "AUTO", NULL);
+    uptr->capac = 0;
+    sim_switches = (writable ? 0 : SWMASK ('R')) | SWMASK ('E');
+    r = sim_disk_attach (uptr, path, sector_size, xfer_element_size ? xfer_element_size : 1, FALSE, 0, NULL, 0, 0);
+    }
+sim_quiet = saved_quiet;
+if (r != SCPE_OK)
+    return sim_messagef (r, "Can't open disk container %s: %s\n", path, sim_error_text (r));
+return SCPE_OK;
+}
+
+/* Create a container of a given format, the size of the source */
+
+static t_stat dsk_create (UNIT *uptr, UNIT *src, const char *path, const char *fmt)
+{
+int32 saved_quiet = sim_quiet;
+uint32 sector_size = 512, xfer_element_size = 1;
+char dtype[32] = "";
+const char *sdtype = sim_disk_get_dtype (src, &sector_size, &xfer_element_size);
+struct stat statb;
+t_stat r;
+
+if (sim_stat (path, &statb) == 0)
+    return sim_messagef (SCPE_ARG, "Destination %s already exists\n", path);
+if (sdtype)
+    strlcpy (dtype, sdtype, sizeof (dtype));
+if ((sector_size == 0) || (sdtype == NULL))
+    sector_size = 512;
+if ((xfer_element_size == 0) || (sdtype == NULL))
+    xfer_element_size = 1;
+if (sim_disk_set_fmt (uptr, 0, fmt, NULL) != SCPE_OK)
+    return SCPE_ARG;
+uptr->capac = src->capac;
+sim_quiet = TRUE;
+sim_switches = 0;
+r = sim_disk_attach (uptr, path, sector_size, xfer_element_size, TRUE, 0, dtype[0] ? dtype : NULL, 0, 0);
+sim_quiet = saved_quiet;
+if (r != SCPE_OK)
+    return sim_messagef (r, "Can't create %s disk container %s: %s\n", fmt, path, sim_error_text (r));
+return SCPE_OK;
+}
+
+static void dsk_close (void)
+{
+int32 saved_quiet = sim_quiet;
+
+sim_quiet = TRUE;
+if (dsk_unit[0].flags & UNIT_ATT)
+    sim_disk_detach (&dsk_unit[0]);
+if (dsk_unit[1].flags & UNIT_ATT)
+    sim_disk_detach (&dsk_unit[1]);
+sim_quiet = saved_quiet;
+}
+
+static const char *dsk_fmt_name (UNIT *uptr)
+{
+switch (DK_GET_FMT (uptr)) {
+    case DKUF_F_STD:
+        return "SIMH";
+    case DKUF_F_RAW:
+        return "RAW";
+    case DKUF_F_VHD:
+        return "VHD";
+    case DKUF_F_DDI:
+        return "DDI";
+    default:
+        return "AUTO";
+    }
+}
+
+static const char *dsk_fmt_ext (const char *fmt)
+{
+if (strcmp (fmt, "VHD") == 0)
+    return ".vhd";
+if (strcmp (fmt, "DDI") == 0)
+    return ".ddi";
+return ".dsk";
+}
+
+/* CONVERT and COMPACT */
+
+typedef struct {
+    int32       flag;                               /* 0 CONVERT, 1 COMPACT */
+    int32       switches;
+    char        fmt[16];
+    const char  *dest;                              /* destination file or directory */
+    t_bool      dest_is_dir;
+    int         count;
+    t_stat      stat;
+    } CONVERT_CTX;
+
+static void dsk_convert_entry (const char *directory,
+                               const char *filename,
+                               t_offset FileSize,
+                               const struct stat *filestat,
+                               void *context)
+{
+CONVERT_CTX *cv = (CONVERT_CTX *)context;
+char src[PATH_MAX + 1], dst[PATH_MAX + 32];
+const char *fmt = cv->fmt;
+char *base;
+t_offset before, after;
+uint32 flags = DK_COPY_WRITE | DK_COPY_SPARSE;
+t_bool created;
+t_stat r;
+
+if (cv->stat != SCPE_OK)
+    return;
+if (filestat->st_mode & S_IFDIR)
+    return;
+snprintf (src, sizeof (src), "%s%s", directory, filename);
+r = dsk_open (&dsk_unit[0], src, FALSE);
+if (r != SCPE_OK) {
+    cv->stat = r;
+    return;
+    }
+if (cv->flag) {                                     /* COMPACT: same format, then replace */
+    fmt = dsk_fmt_name (&dsk_unit[0]);
+    if (strcmp (fmt, "RAW") == 0)
+        fmt = "SIMH";
+    snprintf (dst, sizeof (dst), "%s.compact", src);
+    }
+else {
+    if ((cv->dest == NULL) || cv->dest_is_dir) {
+        base = sim_filepath_parts (src, cv->dest ? "n" : "pn");
+        snprintf (dst, sizeof (dst), "%s%s%s%s", cv->dest ? cv->dest : "",
+                  (cv->dest && !strchr ("/\\:", cv->dest[strlen (cv->dest) - 1])) ? "/" : "",
+                  base ? base : filename, dsk_fmt_ext (fmt));
+        free (base);
+        }
+    else
+        strlcpy (dst, cv->dest, sizeof (dst));
+    }
+sim_messagef (SCPE_OK, "%s: %s format, %s bytes -> %s (%s format)\n", src, dsk_fmt_name (&dsk_unit[0]),
+              sim_fmt_numeric ((double)dsk_unit[0].capac), dst, fmt);
+r = dsk_create (&dsk_unit[1], &dsk_unit[0], dst, fmt);
+created = (r == SCPE_OK);
+if (r == SCPE_OK)
+    r = sim_disk_copy (&dsk_unit[0], &dsk_unit[1], flags, &dsk_crc);
+if ((r == SCPE_OK) && (cv->flag || (cv->switches & SWMASK ('V'))))
+    r = sim_disk_copy (&dsk_unit[0], &dsk_unit[1], DK_COPY_COMPARE, NULL);
+dsk_close ();
+if (r != SCPE_OK) {
+    if (created)                                    /* never remove a file we didn't create */
+        (void)remove (dst);
+    cv->stat = r;
+    return;
+    }
+if (cv->flag) {
+    before = sim_fsize_name_ex (src);
+    after = sim_fsize_name_ex (dst);
+    if ((remove (src) != 0) || (rename (dst, src) != 0)) {
+        cv->stat = sim_messagef (SCPE_IOERR, "Can't replace %s with %s: %s\n", src, dst, strerror (errno));
+        return;
+        }
+    sim_messagef (SCPE_OK, "%s: compacted from %s to %s bytes\n", src,
+                  sim_fmt_numeric ((double)before), sim_fmt_numeric ((double)after));
+    }
+sim_messagef (SCPE_OK, "%s: CRC32 0x%08X\n", cv->flag ? src : dst, dsk_crc);
+++cv->count;
+}
+
+static t_stat dsk_convert_cmd (int32 flag, CONST char *cptr)
+{
+CONVERT_CTX cv;
+char gbuf[CBUFSIZE], dbuf[CBUFSIZE];
+struct stat statb;
+t_stat r;
+
+memset (&cv, 0, sizeof (cv));
+cv.flag = flag;
+strlcpy (cv.fmt, "VHD", sizeof (cv.fmt));
+if ((!cptr) || (*cptr == 0))
+    return SCPE_2FARG;
+GET_SWITCHES (cptr);                                /* get switches */
+if ((sim_switches & SWMASK ('F')) && !flag) {       /* format spec? */
+    cptr = get_glyph (cptr, gbuf, 0);
+    if ((strcmp (gbuf, "VHD") != 0) && (strcmp (gbuf, "SIMH") != 0) && (strcmp (gbuf, "DDI") != 0))
+        return sim_messagef (SCPE_ARG, "Can't convert to %s format\n", gbuf);
+    strlcpy (cv.fmt, gbuf, sizeof (cv.fmt));
+    cv.switches = sim_switches;
+    GET_SWITCHES (cptr);                            /* switches may follow the format */
+    sim_switches |= cv.switches;
+    }
+cv.switches = sim_switches;
+cptr = get_glyph_quoted (cptr, gbuf, 0);            /* source spec */
+if (gbuf[0] == '\0')
+    return SCPE_2FARG;
+cptr = get_glyph_quoted (cptr, dbuf, 0);            /* destination */
+if (*cptr)
+    return SCPE_2MARG;
+if (dbuf[0]) {
+    if (flag)
+        return SCPE_2MARG;
+    cv.dest = dbuf;
+    cv.dest_is_dir = ((sim_stat (dbuf, &statb) == 0) && (statb.st_mode & S_IFDIR));
+    }
+r = sim_dir_scan (gbuf, dsk_convert_entry, &cv);
+if (r != SCPE_OK)
+    return sim_messagef (SCPE_ARG, "No such file or directory: %s\n", gbuf);
+if (cv.stat != SCPE_OK)
+    return cv.stat | SCPE_NOMESSAGE;
+if (cv.count > 1)
+    sim_messagef (SCPE_OK, "%d containers %s\n", cv.count, flag ? "compacted" : "converted");
+return SCPE_OK;
+}
+
+/* VERIFY */
+
+static t_stat dsk_verify_cmd (int32 flag, CONST char *cptr)
+{
+char gbuf[CBUFSIZE], dbuf[CBUFSIZE];
+t_stat r;
+
+if ((!cptr) || (*cptr == 0))
+    return SCPE_2FARG;
+GET_SWITCHES (cptr);                                /* get switches */
+cptr = get_glyph_quoted (cptr, gbuf, 0);
+cptr = get_glyph_quoted (cptr, dbuf, 0);
+if (dbuf[0] == '\0')
+    return SCPE_2FARG;
+if (*cptr)
+    return SCPE_2MARG;
+r = dsk_open (&dsk_unit[0], gbuf, FALSE);
+if (r == SCPE_OK)
+    r = dsk_open (&dsk_unit[1], dbuf, FALSE);
+if ((r == SCPE_OK) && (dsk_unit[0].capac != dsk_unit[1].capac))
+    r = sim_messagef (SCPE_IOERR, "%s and %s differ in size\n", gbuf, dbuf);
+if (r == SCPE_OK)
+    r = sim_disk_copy (&dsk_unit[0], &dsk_unit[1], DK_COPY_COMPARE, &dsk_crc);
+dsk_close ();
+if (r == SCPE_OK)
+    sim_messagef (SCPE_OK, "%s and %s have the same data, CRC32 0x%08X\n", gbuf, dbuf, dsk_crc);
+return r;
+}
+
+/* CHECKSUM */
+
+static void dsk_checksum_entry (const char *directory,
+                                const char *filename,
+                                t_offset FileSize,
+                                const struct stat *filestat,
+                                void *context)
+{
+t_stat *stat = (t_stat *)context;
+char src[PATH_MAX + 1];
+t_stat r;
+
+if (filestat->st_mode & S_IFDIR)
+    return;
+snprintf (src, sizeof (src), "%s%s", directory, filename);
+r = dsk_open (&dsk_unit[0], src, FALSE);
+if (r == SCPE_OK)
+    r = sim_disk_copy (&dsk_unit[0], NULL, 0, &dsk_crc);
+dsk_close ();
+if (r == SCPE_OK)
+    sim_printf ("CRC32 0x%08X  %s\n", dsk_crc, src);
+else
+    *stat = r;
+}
+
+static t_stat dsk_checksum_cmd (int32 flag, CONST char *cptr)
+{
+t_stat stat = SCPE_OK;
+
+if ((!cptr) || (*cptr == 0))
+    return SCPE_2FARG;
+GET_SWITCHES (cptr);                                /* get switches */
+if (sim_dir_scan (cptr, dsk_checksum_entry, &stat) != SCPE_OK)
+    return sim_messagef (SCPE_ARG, "No such file or directory: %s\n", cptr);
+return stat;
+}
+
+/* REPLAY */
+
+static t_stat dsk_replay_cmd (int32 flag, CONST char *cptr)
+{
+char tbuf[CBUFSIZE], gbuf[CBUFSIZE];
+t_bool writes;
+t_stat r;
+
+if ((!cptr) || (*cptr == 0))
+    return SCPE_2FARG;
+GET_SWITCHES (cptr);                                /* get switches */
+writes = (sim_switches & SWMASK ('W')) != 0;
+cptr = get_glyph_quoted (cptr, tbuf, 0);
+cptr = get_glyph_quoted (cptr, gbuf, 0);
+if (gbuf[0] == '\0')
+    return SCPE_2FARG;
+if (*cptr)
+    return SCPE_2MARG;
+r = dsk_open (&dsk_unit[0], gbuf, writes);
+if (r == SCPE_OK)
+    r = sim_disk_replay (&dsk_unit[0], tbuf, writes);
+if (r == SCPE_OK)
+    sim_disk_show_stats (stdout, &dsk_unit[0]);
+dsk_close ();
+return r;
+}
@@ -2314,7 +2314,8 @@ sim_deb_switches = switches &
                     SWMASK ('T') | SWMASK ('A') |
                     SWMASK ('F') | SWMASK ('N') |
                     SWMASK ('B') | SWMASK ('E') |
-                    SWMASK ('D') );                 /* save debug switches */
+                    SWMASK ('D') | SWMASK ('W') |
+                    SWMASK ('X') );                 /* save debug switches */
 return old_deb_switches;
 }
 
@@ -2335,15 +2336,26 @@ if (sim_switches & SWMASK ('B')) {
     if ((buffer_size == 0) || (buffer_size > 1024))
         return sim_messagef (SCPE_ARG, "Invalid debug memory buffersize %u MB\n", (unsigned int)buffer_size);
     }
+if ((sim_switches & SWMASK ('X')) && (sim_switches & SWMASK ('B')))
+    return sim_messagef (SCPE_ARG, "Binary debug traces can't be written to a memory buffer\n");
 cptr = get_glyph_nc (cptr, gbuf, 0);                    /* get file name */
 if (*cptr != 0)                                         /* now eol? */
     return SCPE_2MARG;
-r = sim_open_logfile (gbuf, FALSE, &sim_deb, &sim_deb_ref);
+sim_debug_writer_stop ();                               /* stop any previous writer */
+r = sim_open_logfile (gbuf, (sim_switches & SWMASK ('X')) == SWMASK ('X'), &sim_deb, &sim_deb_ref);
 
 if (r != SCPE_OK)
     return r;
 
+if ((sim_switches & (SWMASK ('W') | SWMASK ('X'))) &&   /* async output needs a file */
+    ((sim_deb == stdout) || (sim_deb == stderr) || (sim_deb == sim_log))) {
+    sim_close_logfile (&sim_deb_ref);
+    sim_deb = NULL;
+    return sim_messagef (SCPE_ARG, "Asynchronous debug output requires a debug file\n");
+    }
 sim_set_deb_switches (sim_switches);
+if (sim_deb_switches & SWMASK ('B'))                    /* buffer output is already fast */
+    sim_deb_switches &= ~SWMASK ('W');
 
 if (sim_deb_switches & SWMASK ('R')) {
     struct tm loc_tm, gmt_tm;
@@ -2358,6 +2370,13 @@ if (sim_deb_switches & SWMASK ('R')) {
     if (!(sim_deb_switches & (SWMASK ('A') | SWMASK ('T'))))
         sim_deb_switches |= SWMASK ('T');
     }
+r = sim_debug_writer_start ();
+if (r != SCPE_OK) {
+    sim_close_logfile (&sim_deb_ref);
+    sim_deb = NULL;
+    sim_deb_switches = 0;
+    return r;
+    }
 sim_messagef (SCPE_OK, "Debug output to \"%s\"\n", sim_logfile_name (sim_deb, sim_deb_ref));
 if (sim_deb_switches & SWMASK ('P'))
     sim_messagef (SCPE_OK, "   Debug messages contain current PC value\n");
@@ -2372,6 +2391,10 @@ if (sim_deb_switches & SWMASK ('E'))
 if (sim_deb_switches & SWMASK ('B'))
     sim_messagef (SCPE_OK, "   Debug messages will be written to a %u MB circular memory buffer\n",
                                 (unsigned int)buffer_size);
+if (sim_deb_switches & SWMASK ('W'))
+    sim_messagef (SCPE_OK, "   Debug messages will be written by a separate writer thread\n");
+if (sim_deb_switches & SWMASK ('X'))
+    sim_messagef (SCPE_OK, "   Debug messages will be written as binary trace records\n");
 time(&now);
 if (!sim_quiet) {
     fprintf (sim_deb, "Debug output to \"%s\" at %s", sim_logfile_name (sim_deb, sim_deb_ref), ctime(&now));
@@ -2398,6 +2421,7 @@ if (cptr && (*cptr != 0))                               /* now eol? */
     return SCPE_2MARG;
 if (sim_deb == NULL)                                    /* no debug? */
     return SCPE_OK;
+sim_debug_writer_stop ();                               /* write everything queued */
 if (sim_deb_switches & SWMASK ('B')) {
     size_t offset = (sim_debug_buffer_inuse == sim_deb_buffer_size) ? sim_debug_buffer_offset : 0;
     const char *bufmsg = "Circular Buffer Contents follow here:\n\n";
@@ -2444,6 +2468,10 @@ if (sim_deb) {
         fprintf (st, "   Debug messages are not being filtered to summarize duplicate lines\n");
     if (sim_deb_switches & SWMASK ('E'))
         fprintf (st, "   Debug messages containing blob data in EBCDIC will display in readable form\n");
+    if (sim_deb_switches & SWMASK ('W'))
+        fprintf (st, "   Debug messages are written by a separate writer thread\n");
+    if (sim_deb_switches & SWMASK ('X'))
+        fprintf (st, "   Debug messages are written as binary trace records\n");
     for (i = 0; (dptr = sim_devices[i]) != NULL; i++) {
         t_bool unit_debug = FALSE;
         uint32 unit;
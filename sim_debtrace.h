@@ -0,0 +1,80 @@
+/* sim_debtrace.h: binary debug trace record format
+
+   Copyright (c) 2026, The open-simh project
+
+   Permission is hereby granted, free of charge, to any person obtaining a
+   copy of this software and associated documentation files (the "Software"),
+   to deal in the Software without restriction, including without limitation
+   the rights to use, copy, modify, merge, publish, distribute, sublicense,
+   and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+   THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+   IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   This file describes the records written by SET DEBUG -X.  It is shared by
+   scp.c, which writes the records, and sim_DebugDecode.c, which turns them
+   back into the text SET DEBUG would have produced.  It must not depend on
+   anything from sim_defs.h.
+
+   A trace file is a sequence of records.  All integers are little endian.
+   Every record starts with an 8 byte header:
+
+        byte  0         0 (a record never starts with a text character)
+        byte  1         record type
+        bytes 2-3       device number (MSG and DEVICE records)
+        bytes 4-7       total record length, including the header
+
+   INFO     starts the file (and every reopen of the file):
+        bytes 8-15      SIM_DEBTRACE_MAGIC
+        bytes 16-19     format version
+        bytes 20-23     PC register radix
+        bytes 24-27     PC register width
+        bytes 28-31     PC register print format (PV_xxx)
+        bytes 32-39     debug start time, seconds since the epoch
+        bytes 40-43     debug start time, nanoseconds
+        bytes 44-       simulator name, NUL, PC register name, NUL
+
+   DEVICE   precedes the first message from a device:
+        bytes 8-        device name, NUL, then for each debug flag:
+                        4 byte mask, flag name, NUL
+
+   MSG      one sim_debug () call:
+        bytes 8-11      debug bits that matched
+        bytes 12-15     flags (SIM_DEBTRACE_F_xxx)
+        bytes 16-23     time of day, seconds since the epoch
+        bytes 24-27     time of day, nanoseconds
+        bytes 28-35     simulated time (IEEE double)
+        bytes 36-43     PC value
+        bytes 44-       formatted message text, not NUL terminated
+
+   TEXT     other output directed to the debug file (fprintf, sim_printf)
+        bytes 8-        the text, not NUL terminated
+*/
+
+#ifndef SIM_DEBTRACE_H_
+#define SIM_DEBTRACE_H_    0
+
+#define SIM_DEBTRACE_MAGIC      "SIMHDBGT"
+#define SIM_DEBTRACE_VERSION    1
+
+#define SIM_DEBTRACE_HDR        8                   /* record header size */
+#define SIM_DEBTRACE_INFO_HDR   44                  /* INFO fixed size */
+#define SIM_DEBTRACE_MSG_HDR    44                  /* MSG fixed size */
+
+#define SIM_DEBTRACE_INFO       1                   /* record types */
+#define SIM_DEBTRACE_DEVICE     2
+#define SIM_DEBTRACE_MSG        3
+#define SIM_DEBTRACE_TEXT       4
+
+#define SIM_DEBTRACE_F_THREAD   1                   /* not from the simulator thread */
+#define SIM_DEBTRACE_F_PC       2                   /* PC value is valid */
+
+#endif
@@ -484,6 +484,7 @@ typedef struct BRKTAB BRKTAB;
 typedef struct BRKTYPTAB BRKTYPTAB;
 typedef struct EXPTAB EXPTAB;
 typedef struct EXPECT EXPECT;
+typedef struct EXPMATCH EXPMATCH;
 typedef struct SEND SEND;
 typedef struct DEBTAB DEBTAB;
 typedef struct FILEREF FILEREF;
@@ -532,6 +533,10 @@ struct DEVICE {
     const char          *(*description)(DEVICE *dptr);  /* Device Description */
     BRKTYPTAB           *brk_types;                     /* Breakpoint types */
     void                *type_ctx;                      /* Device Type/Library Context */
+    t_uint64            ev_count;                       /* event service calls */
+    t_uint64            ev_host_ns;                     /* host nanoseconds in event service */
+    t_uint64            ev_resched;                     /* reschedules from event service */
+    double              ev_resched_time;                /* total reschedule interval */
     };
 
 /* Device flags */
@@ -617,6 +622,9 @@ struct UNIT {
     char                *uname;                         /* Unit name */
     DEVICE              *dptr;                          /* DEVICE linkage (backpointer) */
     uint32              dctrl;                          /* debug control */
+    double              event_time;                     /* absolute event time (heap event queue) */
+    t_uint64            event_seq;                      /* activation sequence (heap event queue) */
+    uint32              event_index;                    /* position in heap event queue */
 #ifdef SIM_ASYNCH_IO
     void                (*a_check_completion)(UNIT *);
     t_bool              (*a_is_active)(UNIT *);
@@ -843,9 +851,13 @@ struct EXPTAB {
 #define EXP_TYP_TIME            (SWMASK ('T'))      /* halt delay is in microseconds instead of instructions */
 #if defined(USE_REGEX)
     pcre                *regex;                         /* compiled regular expression */
+    pcre_extra          *regex_extra;                   /* study data for regular expression */
     int                 re_nsub;                        /* regular expression sub expression count */
 #endif
     char                *act;                           /* action string */
+    t_uint64            checks;                         /* regular expression evaluations */
+    t_uint64            host_ns;                        /* host nanoseconds spent in evaluations */
+    t_uint64            matches;                        /* match count */
     };
 
 /* Expect Context */
@@ -859,6 +871,10 @@ struct EXPECT {
     size_t              buf_ins;                        /* buffer insertion point for the next output data */
     size_t              buf_size;                       /* buffer size */
     size_t              buf_data;                       /* count of data in buffer */
+    EXPMATCH            *matcher;                       /* combined rule matcher (built on demand) */
+    t_uint64            chars;                          /* count of data scanned */
+    t_uint64            regex_passes;                   /* combined regular expression evaluations */
+    t_uint64            regex_ns;                       /* host nanoseconds in combined evaluations */
     };
 
 /* Send Context */
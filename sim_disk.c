@@ -41,6 +41,21 @@ Public routines:
    sim_disk_rdsect_a         read disk sectors asynchronously
    sim_disk_wrsect           write disk sectors
    sim_disk_wrsect_a         write disk sectors asynchronously
+   sim_disk_rdsect_q         queue a disk read (many may be outstanding)
+   sim_disk_wrsect_q         queue a disk write (many may be outstanding)
+   sim_disk_queue_depth      number of requests worth keeping in flight
+   sim_disk_rdsect_sg        read disk sectors into host memory segments
+   sim_disk_rdsect_sg_a      read disk sectors into segments asynchronously
+   sim_disk_wrsect_sg        write disk sectors from host memory segments
+   sim_disk_wrsect_sg_a      write disk sectors from segments asynchronously
+   sim_disk_unmap            deallocate disk sectors (TRIM/UNMAP)
+   sim_disk_set_cache        enable, size or disable the sector cache
+   sim_disk_set_mmap         enable or disable memory mapped containers
+   sim_disk_set_store        chunk store for new DDI containers
+   sim_disk_cache_summary    sector cache, mapping and VHD chain description for SHOW
+   sim_disk_set_iotrace      start or stop a binary trace of a unit's transfers
+   sim_disk_show_stats       display a unit's I/O statistics
+   sim_disk_replay           perform the transfers of a trace against a container
    sim_disk_unload           unload or detach a disk as needed
    sim_disk_reset            reset unit
    sim_disk_wrp              TRUE if write protected
@@ -71,6 +86,16 @@ Internal routines:
    sim_vhd_disk_size         platform independent virtual disk size
    sim_vhd_disk_rdsect       platform independent read virtual disk sectors
    sim_vhd_disk_wrsect       platform independent write virtual disk sectors
+   sim_vhd_disk_chain_info   differencing chain description for SHOW
+   sim_vhd_disk_parent_path  parent of a differencing virtual disk
+   sim_vhd_disk_merge_block  merge one block of a differencing virtual disk
+
+   sim_ddi_disk_open         open deduplicated disk image
+   sim_ddi_disk_create       create deduplicated disk image
+   sim_ddi_disk_close        close deduplicated disk image
+   sim_ddi_disk_size         deduplicated disk image size
+   sim_ddi_disk_rdsect       read deduplicated disk image sectors
+   sim_ddi_disk_wrsect       write deduplicated disk image sectors
 
 
 */
@@ -86,6 +111,18 @@ Internal routines:
 #if defined SIM_ASYNCH_IO
 #include <pthread.h>
 #endif
+#if !defined (_WIN32) && !defined (VMS)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#define DISK_MMAP           1       /* containers can be memory mapped */
+#if defined (FALLOC_FL_PUNCH_HOLE) && defined (FALLOC_FL_KEEP_SIZE)
+#define DISK_PUNCH_HOLE     1       /* file ranges can be deallocated */
+#endif
+#if defined SIM_ASYNCH_IO
+#define DISK_AIO_PIO        1       /* positional I/O (pread/pwrite) available */
+#endif
+#endif
 
 /* Newly created SIMH (and possibly RAW) disk containers       */
 /* will have this data as the last 512 bytes of the container  */
@@ -149,6 +186,53 @@ return value;
 }
 #endif
 
+#if defined SIM_ASYNCH_IO
+/* Queued asynchronous request.  Each unit has a small pool of I/O threads
+   which take requests from the unit's queue; completions are handed back
+   to the simulator thread through the asynchronous event queue. */
+
+#define DISK_AIO_THREADS    4       /* I/O threads per unit (positional formats) */
+
+struct disk_request {
+    struct disk_request *next;
+    int                 op;                 /* DOP_xxx */
+    t_lba               lba;
+    t_seccnt            sects;
+    uint8               *buf;
+    const DISK_SEG      *segs;              /* scatter/gather list */
+    uint32              nsegs;
+    t_seccnt            *rsects;
+    DISK_PCALLBACK      callback;           /* sim_disk_xxx_a completion */
+    DISK_QCALLBACK      qcallback;          /* sim_disk_xxx_q completion */
+    void                *arg;               /* sim_disk_xxx_q context */
+    double              issued;             /* simulated time the request was made */
+    t_stat              status;
+    };
+#endif
+
+static t_stat _sim_disk_rdsect_at (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, double issued);
+static t_stat _sim_disk_wrsect_at (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects, double issued);
+static t_stat _sim_disk_rdsect_sg_at (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectsread, t_seccnt sects, double issued);
+static t_stat _sim_disk_wrsect_sg_at (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectswritten, t_seccnt sects, double issued);
+
+/* Commit of a snapshot (a differencing VHD) into its parent, see SNAPSHOT */
+
+struct disk_commit {
+    FILE                *parent;            /* parent VHD opened for update */
+    char                parent_path[CBUFSIZE];
+    uint32              next;               /* next block to merge */
+    uint32              blocks;             /* blocks in the differencing VHD */
+    t_stat              status;
+    volatile t_bool     done;               /* merging has finished */
+    t_bool              threaded;           /* merging in a background thread */
+#if defined SIM_ASYNCH_IO
+    pthread_t           thread;
+    pthread_mutex_t     lock;               /* container access while merging */
+#endif
+    };
+
+#define DISK_LAT_BUCKETS    21              /* latency histogram: < 1us, < 2us, ... >= 512ms */
+
 struct disk_context {
     t_offset            container_size;     /* Size of the data portion (of the pseudo disk) */
     t_offset            highwater;          /* Furthest written sector in the disk */
@@ -165,32 +249,61 @@ struct disk_context {
     uint32              auto_format;        /* Format determined dynamically */
     uint32              read_count;         /* Number of read operations performed */
     uint32              write_count;        /* Number of write operations performed */
+    struct disk_stats {                     /* I/O statistics, [0] reads, [1] writes */
+        t_uint64        bytes[2];           /* bytes transferred */
+        uint32          sequential[2];      /* transfers starting where the previous one ended */
+        uint32          latency[2][DISK_LAT_BUCKETS];/* host latency histograms */
+        double          usecs[2];           /* total host latency */
+        double          max_usecs[2];       /* longest host latency */
+        t_lba           next_lba;           /* sector following the previous transfer */
+        }               stats;
+    FILE                *trace;             /* binary transfer trace (SET <unit> IOTRACE) */
     struct simh_disk_footer
                         *footer;
+    struct disk_cache   *cache;             /* host side sector cache */
+    uint8               *map;               /* memory mapped container data */
+    t_offset            map_size;           /* bytes mapped */
+    struct disk_commit  *commit;            /* snapshot commit in progress */
 #if defined _WIN32
     HANDLE              disk_handle;        /* OS specific Raw device handle */
 #endif
 #if defined SIM_ASYNCH_IO
     int                 asynch_io;          /* Asynchronous Interrupt scheduling enabled */
     int                 asynch_io_latency;  /* instructions to delay pending interrupt */
-    pthread_mutex_t     lock;
-    pthread_t           io_thread;          /* I/O Thread Id */
+    int                 io_initialized;     /* locks and conditions have been created */
+    int                 io_threads;         /* number of I/O threads */
+    int                 io_started;         /* I/O threads which have started */
+    int                 io_count;           /* requests queued or being performed */
+    int                 positional_io;      /* SIMH format data transfers via pread/pwrite */
+    pthread_mutex_t     lock;               /* statistics, highwater, cache (multiple I/O threads) */
+    pthread_t           io_thread[DISK_AIO_THREADS];/* I/O Thread Ids */
     pthread_mutex_t     io_lock;
     pthread_cond_t      io_cond;
     pthread_cond_t      io_done;
     pthread_cond_t      startup_cond;
-    int                 io_dop;
-    uint8               *buf;
-    t_seccnt            *rsects;
-    t_seccnt            sects;
-    t_lba               lba;
-    DISK_PCALLBACK      callback;
-    t_stat              io_status;
+    struct disk_request *io_queue;          /* requests waiting for an I/O thread */
+    struct disk_request *io_queue_tail;
+    struct disk_request *io_active;         /* requests being performed */
+    struct disk_request *io_complete;       /* requests awaiting completion dispatch */
+    struct disk_request *io_complete_tail;
+    struct disk_request *io_free;           /* available request blocks */
 #endif
     };
 
 #define disk_ctx up8                        /* Field in Unit structure which points to the disk_context */
 
+#if defined SIM_ASYNCH_IO
+#define COMMIT_LOCK(ctx)                                        \
+    if ((ctx)->commit && (ctx)->commit->threaded)               \
+        pthread_mutex_lock (&(ctx)->commit->lock)
+#define COMMIT_UNLOCK(ctx)                                      \
+    if ((ctx)->commit && (ctx)->commit->threaded)               \
+        pthread_mutex_unlock (&(ctx)->commit->lock)
+#else
+#define COMMIT_LOCK(ctx)
+#define COMMIT_UNLOCK(ctx)
+#endif
+
 #if defined SIM_ASYNCH_IO
 #define AIO_CALLSETUP                                               \
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;   \
@@ -198,42 +311,80 @@ struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;   \
 if ((!callback) || !ctx->asynch_io)
 
 #define AIO_CALL(op, _lba, _buf, _rsects, _sects,  _callback)   \
-    if (ctx->asynch_io) {                                       \
-        struct disk_context *ctx =                              \
-                      (struct disk_context *)uptr->disk_ctx;    \
-                                                                \
-        pthread_mutex_lock (&ctx->io_lock);                     \
-                                                                \
-        sim_debug_unit (ctx->dbit, uptr,                        \
-      "sim_disk AIO_CALL(op=%d, unit=%d, lba=0x%X, sects=%d)\n",\
-                op, (int)(uptr - ctx->dptr->units), _lba, _sects);\
-                                                                \
-        if (ctx->callback)                                      \
-            abort(); /* horrible mistake, stop */               \
-        ctx->io_dop = op;                                       \
-        ctx->lba = _lba;                                        \
-        ctx->buf = _buf;                                        \
-        ctx->sects = _sects;                                    \
-        ctx->rsects = _rsects;                                  \
-        ctx->callback = _callback;                              \
-        pthread_cond_signal (&ctx->io_cond);                    \
-        pthread_mutex_unlock (&ctx->io_lock);                   \
-        }                                                       \
+    if (ctx->asynch_io && (_callback))                          \
+        _disk_aio_queue (uptr, op, _lba, _buf, NULL, 0,         \
+                         _rsects, _sects, _callback, NULL, NULL);\
     else                                                        \
         if (_callback)                                          \
             (_callback) (uptr, r);
 
+#define DISK_LOCK(ctx)                                          \
+    if ((ctx)->io_threads > 1)                                  \
+        pthread_mutex_lock (&(ctx)->lock)
+#define DISK_UNLOCK(ctx)                                        \
+    if ((ctx)->io_threads > 1)                                  \
+        pthread_mutex_unlock (&(ctx)->lock)
 
 #define DOP_DONE  0             /* close */
 #define DOP_RSEC  1             /* sim_disk_rdsect_a */
 #define DOP_WSEC  2             /* sim_disk_wrsect_a */
 #define DOP_IAVL  3             /* sim_disk_isavailable_a */
+#define DOP_RSG   4             /* sim_disk_rdsect_sg_a */
+#define DOP_WSG   5             /* sim_disk_wrsect_sg_a */
+
+#define DOP_READS(op) (((op) == DOP_RSEC) || ((op) == DOP_RSG))
+
+/* Two requests must be performed in the order they were issued if they
+   touch the same sectors and either of them writes.  An availability
+   check may reattach the unit, so it is ordered against everything. */
+
+static t_bool _disk_aio_conflict (const struct disk_request *a, const struct disk_request *b)
+{
+if ((a->op == DOP_IAVL) || (b->op == DOP_IAVL))
+    return TRUE;
+if (DOP_READS (a->op) && DOP_READS (b->op))
+    return FALSE;
+return ((a->lba < b->lba + b->sects) && (b->lba < a->lba + a->sects));
+}
+
+/* Remove and return the oldest queued request which doesn't conflict with
+   an active request or with a request queued ahead of it.  Called with
+   io_lock held. */
+
+static struct disk_request *_disk_aio_next (struct disk_context *ctx)
+{
+struct disk_request *req, *prev, *q;
+
+for (prev = NULL, req = ctx->io_queue; req != NULL; prev = req, req = req->next) {
+    for (q = ctx->io_active; q != NULL; q = q->next)
+        if (_disk_aio_conflict (req, q))
+            break;
+    if (q == NULL) {
+        for (q = ctx->io_queue; q != req; q = q->next)
+            if (_disk_aio_conflict (req, q))
+                break;
+        if (q == req) {
+            if (prev)
+                prev->next = req->next;
+            else
+                ctx->io_queue = req->next;
+            if (ctx->io_queue_tail == req)
+                ctx->io_queue_tail = prev;
+            req->next = ctx->io_active;
+            ctx->io_active = req;
+            return req;
+            }
+        }
+    }
+return NULL;
+}
 
 static void *
 _disk_io(void *arg)
 {
 UNIT* volatile uptr = (UNIT*)arg;
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_request *req, **rp;
 
 /* Boost Priority for this I/O thread vs the CPU instruction execution
    thread which in general won't be readily yielding the processor when
@@ -243,26 +394,46 @@ sim_os_set_thread_priority (PRIORITY_ABOVE_NORMAL);
 sim_debug_unit (ctx->dbit, uptr, "_disk_io(unit=%d) starting\n", (int)(uptr - ctx->dptr->units));
 
 pthread_mutex_lock (&ctx->io_lock);
+++ctx->io_started;
 pthread_cond_signal (&ctx->startup_cond);   /* Signal we're ready to go */
 while (ctx->asynch_io) {
-    pthread_cond_wait (&ctx->io_cond, &ctx->io_lock);
-    if (ctx->io_dop == DOP_DONE)
-        break;
+    req = _disk_aio_next (ctx);
+    if (req == NULL) {
+        pthread_cond_wait (&ctx->io_cond, &ctx->io_lock);
+        continue;
+        }
     pthread_mutex_unlock (&ctx->io_lock);
-    switch (ctx->io_dop) {
+    switch (req->op) {
         case DOP_RSEC:
-            ctx->io_status = sim_disk_rdsect (uptr, ctx->lba, ctx->buf, ctx->rsects, ctx->sects);
+            req->status = _sim_disk_rdsect_at (uptr, req->lba, req->buf, req->rsects, req->sects, req->issued);
             break;
         case DOP_WSEC:
-            ctx->io_status = sim_disk_wrsect (uptr, ctx->lba, ctx->buf, ctx->rsects, ctx->sects);
+            req->status = _sim_disk_wrsect_at (uptr, req->lba, req->buf, req->rsects, req->sects, req->issued);
             break;
         case DOP_IAVL:
-            ctx->io_status = sim_disk_isavailable (uptr);
+            req->status = sim_disk_isavailable (uptr);
+            break;
+        case DOP_RSG:
+            req->status = _sim_disk_rdsect_sg_at (uptr, req->lba, req->segs, req->nsegs, req->rsects, req->sects, req->issued);
+            break;
+        case DOP_WSG:
+            req->status = _sim_disk_wrsect_sg_at (uptr, req->lba, req->segs, req->nsegs, req->rsects, req->sects, req->issued);
             break;
         }
     pthread_mutex_lock (&ctx->io_lock);
-    ctx->io_dop = DOP_DONE;
-    pthread_cond_signal (&ctx->io_done);
+    for (rp = &ctx->io_active; *rp != req; rp = &(*rp)->next)
+        ;
+    *rp = req->next;                        /* unlink from active list */
+    req->next = NULL;
+    if (ctx->io_complete_tail)
+        ctx->io_complete_tail->next = req;
+    else
+        ctx->io_complete = req;
+    ctx->io_complete_tail = req;
+    --ctx->io_count;
+    if (ctx->io_queue)                      /* others may have waited on this one */
+        pthread_cond_broadcast (&ctx->io_cond);
+    pthread_cond_broadcast (&ctx->io_done);
     sim_activate (uptr, ctx->asynch_io_latency);
     }
 pthread_mutex_unlock (&ctx->io_lock);
@@ -272,30 +443,113 @@ sim_debug_unit (ctx->dbit, uptr, "_disk_io(unit=%d) exiting\n", (int)(uptr - ctx
 return NULL;
 }
 
+/* Queue a request for the unit's I/O threads.  If a request block can't
+   be allocated the request is performed synchronously, once the requests
+   queued ahead of it have been performed, and its completion is
+   delivered immediately. */
+
+static t_stat _disk_aio_queue (UNIT *uptr, int op, t_lba lba, uint8 *buf, const DISK_SEG *segs, uint32 nsegs,
+                               t_seccnt *rsects, t_seccnt sects,
+                               DISK_PCALLBACK callback, DISK_QCALLBACK qcallback, void *arg)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_request *req;
+t_stat r;
+
+pthread_mutex_lock (&ctx->io_lock);
+
+sim_debug_unit (ctx->dbit, uptr, "sim_disk AIO_CALL(op=%d, unit=%d, lba=0x%X, sects=%d, queued=%d)\n",
+                op, (int)(uptr - ctx->dptr->units), lba, sects, ctx->io_count);
+
+req = ctx->io_free;
+if (req)
+    ctx->io_free = req->next;
+else
+    req = (struct disk_request *)malloc (sizeof (*req));
+if (req == NULL) {
+    while (ctx->io_count != 0)              /* they may overlap this one */
+        pthread_cond_wait (&ctx->io_done, &ctx->io_lock);
+    pthread_mutex_unlock (&ctx->io_lock);
+    switch (op) {
+        case DOP_RSEC:
+            r = sim_disk_rdsect (uptr, lba, buf, rsects, sects);
+            break;
+        case DOP_WSEC:
+            r = sim_disk_wrsect (uptr, lba, buf, rsects, sects);
+            break;
+        case DOP_RSG:
+            r = sim_disk_rdsect_sg (uptr, lba, segs, nsegs, rsects, sects);
+            break;
+        case DOP_WSG:
+            r = sim_disk_wrsect_sg (uptr, lba, segs, nsegs, rsects, sects);
+            break;
+        default:
+            r = sim_disk_isavailable (uptr);
+            break;
+        }
+    if (qcallback)
+        qcallback (uptr, r, arg);
+    else
+        callback (uptr, r);
+    return r;
+    }
+req->next = NULL;
+req->op = op;
+req->lba = lba;
+req->buf = buf;
+req->segs = segs;
+req->nsegs = nsegs;
+req->rsects = rsects;
+req->sects = sects;
+req->callback = callback;
+req->qcallback = qcallback;
+req->arg = arg;
+req->issued = sim_gtime ();
+req->status = SCPE_OK;
+if (ctx->io_queue_tail)
+    ctx->io_queue_tail->next = req;
+else
+    ctx->io_queue = req;
+ctx->io_queue_tail = req;
+++ctx->io_count;
+pthread_cond_signal (&ctx->io_cond);
+pthread_mutex_unlock (&ctx->io_lock);
+return SCPE_OK;
+}
+
 /* This routine is called in the context of the main simulator thread before
    processing events for any unit. It is only called when an asynchronous
    thread has called sim_activate() to activate a unit.  The job of this
    routine is to put the unit in proper condition to digest what may have
    occurred in the asynchronous thread.
 
-   Since disk processing only handles a single I/O at a time to a
-   particular disk device (due to using stdio for the SimH Disk format
-   and stdio doesn't have an atomic seek+(read|write) operation),
-   we have the opportunity to possibly detect improper attempts to
-   issue multiple concurrent I/O requests. */
+   Several requests may have completed since the unit was last activated.
+   Their callbacks are called in the order the requests completed. */
 static void _disk_completion_dispatch (UNIT *uptr)
 {
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-DISK_PCALLBACK callback = ctx->callback;
+struct disk_request *done, *req, *last = NULL;
 
-sim_debug_unit (ctx->dbit, uptr, "_disk_completion_dispatch(unit=%d, dop=%d, callback=%p)\n", (int)(uptr - ctx->dptr->units), ctx->io_dop, (void *)(ctx->callback));
-
-if (ctx->io_dop != DOP_DONE)
-    abort();                                            /* horribly wrong, stop */
+if ((ctx == NULL) || !ctx->io_initialized)
+    return;
+pthread_mutex_lock (&ctx->io_lock);
+done = ctx->io_complete;
+ctx->io_complete = ctx->io_complete_tail = NULL;
+pthread_mutex_unlock (&ctx->io_lock);
 
-if (ctx->callback && ctx->io_dop == DOP_DONE) {
-    ctx->callback = NULL;
-    callback (uptr, ctx->io_status);
+for (req = done; req != NULL; req = req->next) {
+    sim_debug_unit (ctx->dbit, uptr, "_disk_completion_dispatch(unit=%d, dop=%d, lba=0x%X, callback=%p)\n", (int)(uptr - ctx->dptr->units), req->op, req->lba, req->qcallback ? (void *)req->qcallback : (void *)req->callback);
+    if (req->qcallback)
+        req->qcallback (uptr, req->status, req->arg);
+    else
+        req->callback (uptr, req->status);
+    last = req;
+    }
+if (last) {                                 /* recycle request blocks */
+    pthread_mutex_lock (&ctx->io_lock);
+    last->next = ctx->io_free;
+    ctx->io_free = done;
+    pthread_mutex_unlock (&ctx->io_lock);
     }
 }
 
@@ -304,8 +558,8 @@ static t_bool _disk_is_active (UNIT *uptr)
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
 if (ctx) {
-    sim_debug_unit (ctx->dbit, uptr, "_disk_is_active(unit=%d, dop=%d)\n", (int)(uptr - ctx->dptr->units), ctx->io_dop);
-    return (ctx->io_dop != DOP_DONE);
+    sim_debug_unit (ctx->dbit, uptr, "_disk_is_active(unit=%d, queued=%d)\n", (int)(uptr - ctx->dptr->units), ctx->io_count);
+    return (ctx->io_count != 0);
     }
 return FALSE;
 }
@@ -315,21 +569,46 @@ static t_bool _disk_cancel (UNIT *uptr)
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
 if (ctx) {
-    sim_debug_unit (ctx->dbit, uptr, "_disk_cancel(unit=%d, dop=%d)\n", (int)(uptr - ctx->dptr->units), ctx->io_dop);
+    sim_debug_unit (ctx->dbit, uptr, "_disk_cancel(unit=%d, queued=%d)\n", (int)(uptr - ctx->dptr->units), ctx->io_count);
     if (ctx->asynch_io) {
         pthread_mutex_lock (&ctx->io_lock);
-        while (ctx->io_dop != DOP_DONE)
+        while (ctx->io_count != 0)
             pthread_cond_wait (&ctx->io_done, &ctx->io_lock);
         pthread_mutex_unlock (&ctx->io_lock);
         }
     }
 return FALSE;
 }
+
+/* Release the queueing resources of a unit being detached */
+
+static void _disk_aio_release (struct disk_context *ctx)
+{
+struct disk_request *req;
+
+if (!ctx->io_initialized)
+    return;
+while ((req = ctx->io_free)) {
+    ctx->io_free = req->next;
+    free (req);
+    }
+while ((req = ctx->io_complete)) {          /* undelivered completions */
+    ctx->io_complete = req->next;
+    free (req);
+    }
+pthread_mutex_destroy (&ctx->lock);
+pthread_mutex_destroy (&ctx->io_lock);
+pthread_cond_destroy (&ctx->io_cond);
+pthread_cond_destroy (&ctx->io_done);
+ctx->io_initialized = 0;
+}
 #else
 #define AIO_CALLSETUP
 #define AIO_CALL(op, _lba, _buf, _rsects, _sects,  _callback)   \
     if (_callback)                                              \
         (_callback) (uptr, r);
+#define DISK_LOCK(ctx)
+#define DISK_UNLOCK(ctx)
 #endif
 
 /* Forward declarations */
@@ -347,6 +626,24 @@ static t_stat sim_vhd_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *
 static t_stat sim_vhd_disk_clearerr (UNIT *uptr);
 static t_stat sim_vhd_disk_set_dtype (FILE *f, const char *dtype, uint32 SectorSize, uint32 xfer_element_size);
 static const char *sim_vhd_disk_get_dtype (FILE *f, uint32 *SectorSize, uint32 *xfer_element_size, char sim_name[64], time_t *creation_time);
+static size_t sim_vhd_disk_chain_info (FILE *f, char *buf, size_t size);
+static const char *sim_vhd_disk_parent_path (FILE *f);
+static uint32 sim_vhd_disk_block_count (FILE *f);
+static t_stat sim_vhd_disk_merge_block (FILE *f, FILE *parent, uint32 BlockNumber);
+static t_stat sim_vhd_disk_write (FILE *f, t_lba lba, uint8 *buf, t_seccnt sects, uint32 SectorSize);
+static t_bool sim_ddi_disk_is_ddi (const char *path);
+static FILE *sim_ddi_disk_open (const char *path, const char *mode);
+static FILE *sim_ddi_disk_create (const char *path, t_offset desiredsize);
+static int sim_ddi_disk_close (FILE *f);
+static void sim_ddi_disk_flush (FILE *f);
+static t_offset sim_ddi_disk_size (FILE *f);
+static t_stat sim_ddi_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects);
+static t_stat sim_ddi_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects);
+static t_stat sim_ddi_disk_clearerr (UNIT *uptr);
+static t_stat sim_ddi_disk_set_dtype (FILE *f, const char *dtype, uint32 SectorSize, uint32 xfer_element_size);
+static const char *sim_ddi_disk_get_dtype (FILE *f, uint32 *SectorSize, uint32 *xfer_element_size, char sim_name[64], time_t *creation_time);
+static t_stat sim_ddi_disk_set_store (FILE *f, const char *store);
+static void sim_ddi_disk_info (FILE *f);
 static t_stat sim_os_disk_implemented_raw (void);
 static FILE *sim_os_disk_open_raw (const char *rawdevicename, const char *openmode);
 static int sim_os_disk_close_raw (FILE *f);
@@ -375,6 +672,7 @@ static struct sim_disk_fmt fmts[] = {
     { "SIMH",        0, DKUF_F_STD,  NULL},
     { "RAW",         0, DKUF_F_RAW,  sim_os_disk_implemented_raw},
     { "VHD",         0, DKUF_F_VHD,  sim_vhd_disk_implemented},
+    { "DDI",         0, DKUF_F_DDI,  NULL},
     { NULL,          0, 0,           NULL}
     };
 
@@ -475,6 +773,7 @@ switch (DK_GET_FMT (uptr)) {                            /* case on format */
         is_available = TRUE;
         break;
     case DKUF_F_VHD:                                    /* VHD format */
+    case DKUF_F_DDI:                                    /* DDI format */
         is_available = TRUE;
         break;
     case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
@@ -574,7 +873,12 @@ if ((filesystem_size == (t_offset)-1) ||
 return filesystem_size;
 }
 
-/* Enable asynchronous operation */
+/* Enable asynchronous operation
+
+   Formats whose transfers are positional (SIMH format files via
+   pread/pwrite and sector aligned raw devices) get several I/O threads,
+   so that a controller can keep multiple requests in flight.  VHD files
+   keep their metadata in a shared stdio stream and get a single thread. */
 
 t_stat sim_disk_set_async (UNIT *uptr, int latency)
 {
@@ -585,22 +889,49 @@ return SCPE_NOFNC;
 #else
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 pthread_attr_t attr;
+int i;
 
 sim_debug_unit (ctx->dbit, uptr, "sim_disk_set_async(unit=%d)\n", (int)(uptr - ctx->dptr->units));
 
 ctx->asynch_io = sim_asynch_enabled;
 ctx->asynch_io_latency = latency;
 if (ctx->asynch_io) {
-    pthread_mutex_init (&ctx->io_lock, NULL);
-    pthread_cond_init (&ctx->io_cond, NULL);
-    pthread_cond_init (&ctx->io_done, NULL);
+    if (!ctx->io_initialized) {
+        pthread_mutexattr_t mattr;
+
+        pthread_mutexattr_init (&mattr);        /* cache write-back writes nest */
+        pthread_mutexattr_settype (&mattr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init (&ctx->lock, &mattr);
+        pthread_mutexattr_destroy (&mattr);
+        pthread_mutex_init (&ctx->io_lock, NULL);
+        pthread_cond_init (&ctx->io_cond, NULL);
+        pthread_cond_init (&ctx->io_done, NULL);
+        ctx->io_initialized = 1;
+        }
+    ctx->io_threads = 1;
+#if defined (DISK_AIO_PIO)
+    switch (DK_GET_FMT (uptr)) {
+        case DKUF_F_STD:                                /* SIMH format */
+            fflush (uptr->fileref);                     /* nothing left in stdio buffers */
+            ctx->positional_io = 1;
+            ctx->io_threads = DISK_AIO_THREADS;
+            break;
+        case DKUF_F_RAW:                                /* Raw Physical Disk Access */
+            if (0 == (ctx->sector_size & (ctx->storage_sector_size - 1)))
+                ctx->io_threads = DISK_AIO_THREADS;     /* no read-modify-write of shared sectors */
+            break;
+        }
+#endif
+    ctx->io_started = 0;
     pthread_cond_init (&ctx->startup_cond, NULL);
     pthread_attr_init(&attr);
     pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
     pthread_mutex_lock (&ctx->io_lock);
-    pthread_create (&ctx->io_thread, &attr, _disk_io, (void *)uptr);
+    for (i = 0; i < ctx->io_threads; i++)
+        pthread_create (&ctx->io_thread[i], &attr, _disk_io, (void *)uptr);
     pthread_attr_destroy(&attr);
-    pthread_cond_wait (&ctx->startup_cond, &ctx->io_lock); /* Wait for thread to stabilize */
+    while (ctx->io_started < ctx->io_threads)
+        pthread_cond_wait (&ctx->startup_cond, &ctx->io_lock); /* Wait for threads to stabilize */
     pthread_mutex_unlock (&ctx->io_lock);
     pthread_cond_destroy (&ctx->startup_cond);
     }
@@ -611,7 +942,10 @@ return SCPE_OK;
 #endif
 }
 
-/* Disable asynchronous operation */
+/* Disable asynchronous operation
+
+   Requests already queued are performed before the I/O threads exit.
+   Their completions are delivered when the unit's activation is processed. */
 
 t_stat sim_disk_clr_async (UNIT *uptr)
 {
@@ -619,6 +953,7 @@ t_stat sim_disk_clr_async (UNIT *uptr)
 return SCPE_NOFNC;
 #else
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+int i;
 
 /* make sure device exists */
 if (!ctx) return SCPE_UNATT;
@@ -627,5856 +962,8875 @@ sim_debug_unit (ctx->dbit, uptr, "sim_disk_clr_async(unit=%d)\n", (int)(uptr - c
 
 if (ctx->asynch_io) {
     pthread_mutex_lock (&ctx->io_lock);
+    while (ctx->io_count != 0)
+        pthread_cond_wait (&ctx->io_done, &ctx->io_lock);
     ctx->asynch_io = 0;
-    pthread_cond_signal (&ctx->io_cond);
+    pthread_cond_broadcast (&ctx->io_cond);
     pthread_mutex_unlock (&ctx->io_lock);
-    pthread_join (ctx->io_thread, NULL);
-    pthread_mutex_destroy (&ctx->io_lock);
-    pthread_cond_destroy (&ctx->io_cond);
-    pthread_cond_destroy (&ctx->io_done);
+    for (i = 0; i < ctx->io_threads; i++)
+        pthread_join (ctx->io_thread[i], NULL);
+    ctx->io_threads = 0;
+    ctx->positional_io = 0;
     }
 return SCPE_OK;
 #endif
 }
 
-/* Read Sectors */
+/* Queue depth
 
-static t_stat _sim_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+   Returns the number of requests which the unit can usefully have in
+   flight at once.  A controller which can pipeline transfers uses this
+   to decide how many sim_disk_rdsect_q/sim_disk_wrsect_q requests to
+   issue before waiting for a completion. */
+
+uint32 sim_disk_queue_depth (UNIT *uptr)
 {
-t_offset da;
-uint32 err, tbc;
-size_t i;
+#if defined (SIM_ASYNCH_IO)
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-sim_debug_unit (ctx->dbit, uptr, "_sim_disk_rdsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+if (ctx && ctx->asynch_io)
+    return (uint32)ctx->io_threads;
+#endif
+return 1;
+}
+
+/* Host side sector cache
+
+   A unit may keep recently used sectors in memory (SET <unit> CACHE).
+   The cache sits above the container formats, so SIMH, VHD and RAW
+   containers behave alike.  Sectors are held in the form the simulator
+   sees them (after any byte swapping), looked up through a hash table
+   and replaced least recently used first.
+
+   In write-through mode (the default) every write goes to the container
+   and the cached copy is updated.  In write-back mode small writes only
+   update the cache, and modified sectors are written when they are
+   evicted, when the simulator stops, when the cache is resized or
+   disabled and when the unit is detached.
+
+   The container is read and written outside the unit's lock.  While a
+   transfer does so, the modified sectors in its range are pinned: they
+   stay cached and are not written back by another I/O thread, so a
+   sector's older contents never reach the container behind a newer copy
+   and are never cached in place of a modified one.
+
+   Cache settings belong to the unit and are kept across attaches. */
+
+#define DISK_CACHE_DEFAULT  (1024*1024)         /* default cache size in bytes */
+#define DISK_CACHE_MAXRUN   128                 /* sectors per write-back transfer */
+
+struct disk_cache_block {
+    t_lba                   lba;
+    t_bool                  valid;
+    t_bool                  dirty;
+    uint32                  pins;               /* transfers which need it kept */
+    uint8                   *data;
+    struct disk_cache_block *hnext;             /* hash chain */
+    struct disk_cache_block *prev;              /* LRU list, most recently used first */
+    struct disk_cache_block *next;
+    };
 
-da = ((t_offset)lba) * ctx->sector_size;
-tbc = sects * ctx->sector_size;
-if (sectsread)
-    *sectsread = 0;
-while (tbc) {
-    size_t sectbytes;
+struct disk_cache {
+    uint32                  size;               /* configured size in bytes */
+    t_bool                  write_back;
+    uint32                  nblocks;
+    uint32                  hash_mask;
+    struct disk_cache_block *blocks;
+    struct disk_cache_block **hash;
+    struct disk_cache_block lru;                /* list head */
+    uint8                   *data;
+    uint32                  dirty;              /* modified sectors held */
+    uint32                  pinned;             /* blocks which can't be replaced */
+    t_uint64                hits;               /* sectors found in the cache */
+    t_uint64                misses;             /* sectors read from the container */
+    t_uint64                writes_held;        /* sectors written into the cache only */
+    t_uint64                writebacks;         /* sectors written on eviction or flush */
+    t_uint64                write_errors;       /* failed write-back transfers */
+    };
 
-    clearerr (uptr->fileref);
-    err = sim_fseeko (uptr->fileref, da, SEEK_SET);          /* set pos */
-    if (err)
-        return SCPE_IOERR;
-    i = sim_fread (buf, 1, tbc, uptr->fileref);
-    if (i < tbc)                 /* fill */
-        memset (&buf[i], 0, tbc-i);
-    if ((i == 0) &&             /* Reading at or past EOF? */
-        feof (uptr->fileref))
-        i = tbc;                /* return 0's which have already been filled in buffer */
-    sectbytes = (i / ctx->sector_size) * ctx->sector_size;
-    if (i > sectbytes)
-        sectbytes += ctx->sector_size;
-    if (sectsread)
-        *sectsread += sectbytes / ctx->sector_size;
-    err = ferror (uptr->fileref);
-    if (err)
-        return SCPE_IOERR;
-    tbc -= sectbytes;
-    if ((tbc == 0) || (i == 0))
-        return SCPE_OK;
-    da += sectbytes;
-    buf += sectbytes;
-    }
-return SCPE_OK;
+static struct disk_unit_setting {
+    UNIT                    *uptr;
+    t_bool                  cache;              /* cache enabled */
+    uint32                  size;
+    t_bool                  write_back;
+    t_bool                  mmap;               /* map the container when attached */
+    char                    *store;             /* chunk store for new DDI containers */
+    char                    *trace_path;        /* binary transfer trace file */
+    FILE                    *trace;
+    struct disk_unit_setting *next;
+    } *sim_disk_unit_settings = NULL;
+
+static t_stat _sim_disk_wrsect_container (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects);
+static t_stat _sim_disk_rdsect_cache (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects);
+static t_stat _sim_disk_wrsect_cache (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects);
+static void _sim_disk_commit_poll (UNIT *uptr, t_bool wait);
+
+static struct disk_cache_block *_sim_disk_cache_find (struct disk_cache *cache, t_lba lba)
+{
+struct disk_cache_block *blk;
+
+for (blk = cache->hash[lba & cache->hash_mask]; blk != NULL; blk = blk->hnext)
+    if (blk->lba == lba)
+        return blk;
+return NULL;
 }
 
-t_stat sim_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+static void _sim_disk_cache_touch (struct disk_cache *cache, struct disk_cache_block *blk)
 {
-t_stat r;
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-uint32 f = DK_GET_FMT (uptr);
-t_seccnt sread = 0;
+blk->prev->next = blk->next;                    /* unlink */
+blk->next->prev = blk->prev;
+blk->next = cache->lru.next;                    /* insert at front */
+blk->prev = &cache->lru;
+cache->lru.next->prev = blk;
+cache->lru.next = blk;
+}
 
-sim_debug_unit (ctx->dbit, uptr, "sim_disk_rdsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+static void _sim_disk_cache_unhash (struct disk_cache *cache, struct disk_cache_block *blk)
+{
+struct disk_cache_block **bp;
 
-ctx->read_count++;                                      /* record read operation */
-if ((sects == 1) &&                                     /* Single sector reads */
-    (lba >= (uptr->capac*ctx->capac_factor)/(ctx->sector_size/((ctx->dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)))) {/* beyond the end of the disk */
-    memset (buf, '\0', ctx->sector_size);               /* are bad block management efforts - zero buffer */
-    if (sectsread)
-        *sectsread = 1;
-    return SCPE_OK;                                     /* return success */
-    }
+for (bp = &cache->hash[blk->lba & cache->hash_mask]; *bp != blk; bp = &(*bp)->hnext)
+    ;
+*bp = blk->hnext;
+blk->hnext = NULL;
+blk->valid = FALSE;
+}
 
-if ((0 == (ctx->sector_size & (ctx->storage_sector_size - 1))) ||   /* Sector Aligned & whole sector transfers */
-    ((0 == ((lba*ctx->sector_size) & (ctx->storage_sector_size - 1))) &&
-     (0 == ((sects*ctx->sector_size) & (ctx->storage_sector_size - 1)))) ||
-    (f == DKUF_F_STD) || (f == DKUF_F_VHD)) {                       /* or SIMH or VHD formats */
-    switch (f) {                                        /* case on format */
-        case DKUF_F_STD:                                /* SIMH format */
-            r = _sim_disk_rdsect (uptr, lba, buf, &sread, sects);
-            break;
-        case DKUF_F_VHD:                                /* VHD format */
-            r = sim_vhd_disk_rdsect (uptr, lba, buf, &sread, sects);
-            break;
-        case DKUF_F_RAW:                                /* Raw Physical Disk Access */
-            r = sim_os_disk_rdsect (uptr, lba, buf, &sread, sects);
-            break;
-        default:
-            return SCPE_NOFNC;
+/* Write a dirty block to the container */
+
+static void _sim_disk_cache_writeback (UNIT *uptr, struct disk_cache *cache, struct disk_cache_block *blk)
+{
+t_seccnt written = 0;
+
+if ((_sim_disk_wrsect_container (uptr, blk->lba, blk->data, &written, 1) != SCPE_OK) ||
+    (written != 1))
+    ++cache->write_errors;
+++cache->writebacks;
+blk->dirty = FALSE;
+--cache->dirty;
+}
+
+/* Get the block to hold lba: the cached one or the least recently used
+   one which isn't pinned, NULL if every block is pinned */
+
+static struct disk_cache_block *_sim_disk_cache_get (UNIT *uptr, struct disk_cache *cache, t_lba lba, t_bool *found)
+{
+struct disk_cache_block *blk = _sim_disk_cache_find (cache, lba);
+
+*found = (blk != NULL);
+if (blk == NULL) {
+    for (blk = cache->lru.prev; (blk != &cache->lru) && (blk->pins != 0); blk = blk->prev)
+        ;                                       /* least recently used */
+    if (blk == &cache->lru)
+        return NULL;
+    if (blk->valid) {
+        if (blk->dirty)
+            _sim_disk_cache_writeback (uptr, cache, blk);
+        _sim_disk_cache_unhash (cache, blk);
         }
-    if (sectsread)
-        *sectsread = sread;
-    sim_buf_swap_data (buf, ctx->xfer_element_size, (sread * ctx->sector_size) / ctx->xfer_element_size);
-    return r;
+    blk->lba = lba;
+    blk->valid = TRUE;
+    blk->hnext = cache->hash[lba & cache->hash_mask];
+    cache->hash[lba & cache->hash_mask] = blk;
     }
-else { /* Unaligned and/or partial sector transfers in RAW mode */
-    size_t tbufsize = sects * ctx->sector_size + 2 * ctx->storage_sector_size;
-    uint8 *tbuf = (uint8*) malloc (tbufsize);
-    t_offset ssaddr = (lba * (t_offset)ctx->sector_size) & ~(t_offset)(ctx->storage_sector_size -1);
-    uint32 soffset = (uint32)((lba * (t_offset)ctx->sector_size) - ssaddr);
-    uint32 bytesread;
+_sim_disk_cache_touch (cache, blk);
+return blk;
+}
 
-    if (sectsread)
-        *sectsread = 0;
-    if (tbuf == NULL)
-        return SCPE_MEM;
-    r = sim_os_disk_read (uptr, ssaddr, tbuf, &bytesread, tbufsize & ~(ctx->storage_sector_size - 1));
-    sim_buf_swap_data (tbuf + soffset, ctx->xfer_element_size, (bytesread - soffset) / ctx->xfer_element_size);
-    memcpy (buf, tbuf + soffset, sects * ctx->sector_size);
-    if (sectsread) {
-        *sectsread = (bytesread - soffset) / ctx->sector_size;
-        if (*sectsread > sects)
-            *sectsread = sects;
+/* Pin (or unpin) the modified sectors in a transfer's range.  Requests
+   which overlap a write are never performed concurrently (see
+   _disk_aio_conflict), so the modified sectors in the range, and thus the
+   ones pinned, are the same when the transfer unpins them.  Called with
+   the lock held. */
+
+static void _sim_disk_cache_pin (struct disk_cache *cache, t_lba lba, t_seccnt sects, t_bool pin)
+{
+struct disk_cache_block *blk;
+t_seccnt i;
+
+if (pin ? (cache->dirty == 0) : (cache->pinned == 0))
+    return;
+for (i = 0; i < sects; i++) {
+    blk = _sim_disk_cache_find (cache, lba + i);
+    if (blk == NULL)
+        continue;
+    if (pin && blk->dirty) {
+        if (blk->pins++ == 0)
+            ++cache->pinned;
+        }
+    else if (!pin && blk->pins) {
+        if (--blk->pins == 0)
+            --cache->pinned;
         }
-    free (tbuf);
-    return r;
     }
 }
 
-t_stat sim_disk_rdsect_a (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, DISK_PCALLBACK callback)
+/* Satisfy a read from the cache.  Returns TRUE when every sector was
+   cached; otherwise the whole transfer is to be read from the container,
+   and the modified sectors in its range have been pinned. */
+
+static t_bool _sim_disk_cache_read (struct disk_context *ctx, t_lba lba, uint8 *buf, t_seccnt sects)
 {
-t_stat r = SCPE_OK;
-AIO_CALLSETUP
-    r = sim_disk_rdsect (uptr, lba, buf, sectsread, sects);
-AIO_CALL(DOP_RSEC, lba, buf, sectsread, sects, callback);
-return r;
+struct disk_cache *cache;
+struct disk_cache_block *blk;
+t_seccnt i;
+
+DISK_LOCK (ctx);
+cache = ctx->cache;
+if (cache == NULL) {                            /* removed meanwhile */
+    DISK_UNLOCK (ctx);
+    return FALSE;
+    }
+for (i = 0; i < sects; i++)
+    if (NULL == _sim_disk_cache_find (cache, lba + i))
+        break;
+if (i < sects) {
+    cache->misses += sects;
+    _sim_disk_cache_pin (cache, lba, sects, TRUE);
+    DISK_UNLOCK (ctx);
+    return FALSE;
+    }
+for (i = 0; i < sects; i++) {
+    blk = _sim_disk_cache_find (cache, lba + i);
+    memcpy (buf + i * ctx->sector_size, blk->data, ctx->sector_size);
+    _sim_disk_cache_touch (cache, blk);
+    }
+cache->hits += sects;
+DISK_UNLOCK (ctx);
+return TRUE;
 }
 
-/* Write Sectors */
+/* Enter the sectors of a transfer just read from the container (sread
+   of sects) and unpin its range.  A sector which is already cached
+   (possibly modified and not yet written) is returned from the cache
+   instead.  Only the last part of a transfer larger than the cache is
+   entered. */
 
-static t_stat _sim_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+static void _sim_disk_cache_fill (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt sread, t_seccnt sects)
 {
-t_offset da;
-uint32 err, tbc;
-size_t i;
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_cache *cache;
+struct disk_cache_block *blk;
+t_bool found;
+t_seccnt i;
+
+DISK_LOCK (ctx);
+cache = ctx->cache;
+if (cache == NULL) {                            /* removed meanwhile */
+    DISK_UNLOCK (ctx);
+    return;
+    }
+for (i = 0; i < sread; i++) {
+    if (sread - i > cache->nblocks) {
+        blk = _sim_disk_cache_find (cache, lba + i);
+        found = (blk != NULL);
+        }
+    else
+        blk = _sim_disk_cache_get (uptr, cache, lba + i, &found);
+    if (blk == NULL)
+        continue;
+    if (found)
+        memcpy (buf + i * ctx->sector_size, blk->data, ctx->sector_size);
+    else
+        memcpy (blk->data, buf + i * ctx->sector_size, ctx->sector_size);
+    }
+_sim_disk_cache_pin (cache, lba, sects, FALSE);
+DISK_UNLOCK (ctx);
+}
 
-sim_debug_unit (ctx->dbit, uptr, "_sim_disk_wrsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+/* Record written sectors.  In write-back mode a transfer which fits
+   comfortably in the cache is only held there (returns TRUE).  Anything
+   else has its range pinned and is written through by the caller, which
+   then calls again with write_back FALSE to refresh the cached copies of
+   the sectors written (of sects) and unpin the range. */
 
-da = ((t_offset)lba) * ctx->sector_size;
-tbc = sects * ctx->sector_size;
-if (sectswritten)
-    *sectswritten = 0;
-err = sim_fseeko (uptr->fileref, da, SEEK_SET);          /* set pos */
-if (err)
-    return SCPE_IOERR;
-i = sim_fwrite (buf, ctx->xfer_element_size, tbc/ctx->xfer_element_size, uptr->fileref);
-if (sectswritten)
-    *sectswritten += (t_seccnt)((i * ctx->xfer_element_size + ctx->sector_size - 1)/ctx->sector_size);
-err = ferror (uptr->fileref);
-if (err)
-    return SCPE_IOERR;
-return SCPE_OK;
-}
-
-t_stat sim_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+static t_bool _sim_disk_cache_write (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt written, t_seccnt sects, t_bool write_back)
 {
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-uint32 f = DK_GET_FMT (uptr);
-t_stat r;
-uint8 *tbuf = NULL;
-t_seccnt written = 0;
+struct disk_cache *cache;
+struct disk_cache_block *blk;
+t_bool found;
+t_seccnt i;
+
+DISK_LOCK (ctx);
+cache = ctx->cache;
+if (cache == NULL) {                            /* removed meanwhile */
+    DISK_UNLOCK (ctx);
+    return FALSE;
+    }
+if (write_back &&
+    (!cache->write_back || (sects > cache->nblocks / 4) ||
+     (cache->pinned + sects > cache->nblocks))) {
+    _sim_disk_cache_pin (cache, lba, sects, TRUE);
+    DISK_UNLOCK (ctx);
+    return FALSE;
+    }
+if (write_back)
+    written = sects;
+for (i = 0; i < written; i++) {
+    if (!write_back && (written > cache->nblocks)) {
+        blk = _sim_disk_cache_find (cache, lba + i);/* large transfers only refresh */
+        if (blk == NULL)
+            continue;
+        }
+    else
+        blk = _sim_disk_cache_get (uptr, cache, lba + i, &found);
+    if (blk == NULL)                            /* all pinned */
+        continue;
+    memcpy (blk->data, buf + i * ctx->sector_size, ctx->sector_size);
+    if (blk->dirty != write_back) {
+        blk->dirty = write_back;
+        if (write_back)
+            ++cache->dirty;
+        else
+            --cache->dirty;
+        }
+    }
+if (write_back)
+    cache->writes_held += sects;
+else
+    _sim_disk_cache_pin (cache, lba, sects, FALSE);
+DISK_UNLOCK (ctx);
+return write_back;
+}
 
-sim_debug_unit (ctx->dbit, uptr, "sim_disk_wrsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+static int _sim_disk_cache_lba_compare (const void *pa, const void *pb)
+{
+const struct disk_cache_block *a = *(const struct disk_cache_block * const *)pa;
+const struct disk_cache_block *b = *(const struct disk_cache_block * const *)pb;
 
-if (sectswritten)
-    *sectswritten = 0;
-ctx->write_count++;                                     /* record write operation */
-if (uptr->dynflags & UNIT_DISK_CHK) {
-    DEVICE *dptr = find_dev_from_unit (uptr);
-    uint32 capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* capacity units (quadword: 8, word: 2, byte: 1) */
-    t_lba total_sectors = (t_lba)((uptr->capac*capac_factor)/(ctx->sector_size/((dptr->flags & DEV_SECTORS) ? 512 : 1)));
-    t_lba sect;
+return (a->lba < b->lba) ? -1 : ((a->lba > b->lba) ? 1 : 0);
+}
 
-    for (sect = 0; sect < sects; sect++) {
-        t_lba offset;
-        t_bool sect_error = FALSE;
+/* Write all modified sectors, in LBA order and combining adjacent ones */
 
-        for (offset = 0; offset < ctx->sector_size; offset += sizeof(uint32)) {
-            if (*((uint32 *)&buf[sect*ctx->sector_size + offset]) != (uint32)(lba + sect)) {
-                sect_error = TRUE;
-                break;
-                }
-            }
-        if (sect_error) {
-            uint32 save_dctrl = dptr->dctrl;
-            FILE *save_sim_deb = sim_deb;
+static void _sim_disk_cache_flush (UNIT *uptr)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_cache *cache;
+struct disk_cache_block **dirty;
+uint8 *run;
+uint32 i, j, n = 0;
+t_seccnt written;
 
-            sim_printf ("\n%s: Write Address Verification Error on lbn %d(0x%X) of %d(0x%X).\n", sim_uname (uptr), (int)(lba+sect), (int)(lba+sect), (int)total_sectors, (int)total_sectors);
-            dptr->dctrl = 0xFFFFFFFF;
-            sim_deb = save_sim_deb ? save_sim_deb : stdout;
-            sim_disk_data_trace (uptr, buf+sect*ctx->sector_size, lba+sect, ctx->sector_size,    "Found", TRUE, 1);
-            dptr->dctrl = save_dctrl;
-            sim_deb = save_sim_deb;
-            }
-        }
+if (ctx == NULL)
+    return;
+DISK_LOCK (ctx);
+cache = ctx->cache;
+if ((cache == NULL) || (cache->dirty == 0)) {
+    DISK_UNLOCK (ctx);
+    return;
     }
-switch (f) {                                            /* case on format */
-    case DKUF_F_STD:                                    /* SIMH format */
-        r = _sim_disk_wrsect (uptr, lba, buf, &written, sects);
-        break;
-    case DKUF_F_VHD:                                    /* VHD format */
-        if (!sim_end && (ctx->xfer_element_size != sizeof (char))) {
-            tbuf = (uint8*) malloc (sects * ctx->sector_size);
-            if (NULL == tbuf)
-                return SCPE_MEM;
-            sim_buf_copy_swapped (tbuf, buf, ctx->xfer_element_size, (sects * ctx->sector_size) / ctx->xfer_element_size);
-            buf = tbuf;
-            }
-        r = sim_vhd_disk_wrsect  (uptr, lba, buf, &written, sects);
-        break;
-    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
-        break;                                          /* handle below */
-    default:
-        return SCPE_NOFNC;
+dirty = (struct disk_cache_block **)malloc (cache->dirty * sizeof (*dirty));
+run = (uint8 *)malloc (DISK_CACHE_MAXRUN * ctx->sector_size);
+if ((dirty == NULL) || (run == NULL)) {         /* one at a time then */
+    for (i = 0; i < cache->nblocks; i++)
+        if (cache->blocks[i].dirty)
+            _sim_disk_cache_writeback (uptr, cache, &cache->blocks[i]);
     }
-if (f == DKUF_F_RAW) {
-    if ((0 == (ctx->sector_size & (ctx->storage_sector_size - 1))) ||   /* Sector Aligned & whole sector transfers */
-        ((0 == ((lba*ctx->sector_size) & (ctx->storage_sector_size - 1))) &&
-         (0 == ((sects*ctx->sector_size) & (ctx->storage_sector_size - 1))))) {
+else {
+    for (i = 0; i < cache->nblocks; i++)
+        if (cache->blocks[i].dirty)
+            dirty[n++] = &cache->blocks[i];
+    qsort (dirty, n, sizeof (*dirty), _sim_disk_cache_lba_compare);
+    for (i = 0; i < n; i = j) {
+        for (j = i; (j < n) && (j - i < DISK_CACHE_MAXRUN) && (dirty[j]->lba == dirty[i]->lba + (j - i)); j++)
+            memcpy (run + (j - i) * ctx->sector_size, dirty[j]->data, ctx->sector_size);
+        written = 0;
+        if ((_sim_disk_wrsect_container (uptr, dirty[i]->lba, run, &written, j - i) != SCPE_OK) ||
+            (written != j - i))
+            ++cache->write_errors;
+        cache->writebacks += j - i;
+        }
+    for (i = 0; i < n; i++)
+        dirty[i]->dirty = FALSE;
+    cache->dirty = 0;
+    }
+free (dirty);
+free (run);
+DISK_UNLOCK (ctx);
+}
 
-        if (!sim_end && (ctx->xfer_element_size != sizeof (char))) {
-            tbuf = (uint8*) malloc (sects * ctx->sector_size);
-            if (NULL == tbuf)
-                return SCPE_MEM;
-            sim_buf_copy_swapped (tbuf, buf, ctx->xfer_element_size, (sects * ctx->sector_size) / ctx->xfer_element_size);
-            buf = tbuf;
-            }
+static void _sim_disk_cache_free (UNIT *uptr)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_cache *cache = ctx->cache;
 
-        r = sim_os_disk_wrsect (uptr, lba, buf, &written, sects);
-        }
-    else { /* Unaligned and/or partial sector transfers in RAW mode */
-        size_t tbufsize = sects * ctx->sector_size + 2 * ctx->storage_sector_size;
-        t_offset ssaddr = (lba * (t_offset)ctx->sector_size) & ~(t_offset)(ctx->storage_sector_size -1);
-        t_offset sladdr = ((lba + sects) * (t_offset)ctx->sector_size) & ~(t_offset)(ctx->storage_sector_size -1);
-        uint32 soffset = (uint32)((lba * (t_offset)ctx->sector_size) - ssaddr);
-        uint32 byteswritten;
+if (cache == NULL)
+    return;
+#if defined (SIM_ASYNCH_IO)
+_disk_cancel (uptr);                            /* let queued transfers finish */
+#endif
+_sim_disk_cache_flush (uptr);
+DISK_LOCK (ctx);
+ctx->cache = NULL;
+DISK_UNLOCK (ctx);
+free (cache->data);
+free (cache->blocks);
+free (cache->hash);
+free (cache);
+}
 
-        tbuf = (uint8*) malloc (tbufsize);
-        if (tbuf == NULL)
-            return SCPE_MEM;
-        /* Partial Sector writes require a read-modify-write sequence for the partial sectors */
-        if (soffset)
-            sim_os_disk_read (uptr, ssaddr, tbuf, NULL, ctx->storage_sector_size);
-        sim_os_disk_read (uptr, sladdr, tbuf + (size_t)(sladdr - ssaddr), NULL, ctx->storage_sector_size);
-        sim_buf_copy_swapped (tbuf + soffset,
-                              buf, ctx->xfer_element_size, (sects * ctx->sector_size) / ctx->xfer_element_size);
-        r = sim_os_disk_write (uptr, ssaddr, tbuf, &byteswritten, (soffset + (sects * ctx->sector_size) + ctx->storage_sector_size - 1) & ~(ctx->storage_sector_size - 1));
-        written = byteswritten / ctx->sector_size;
-        if (written > sects)
-            written = sects;
-        }
+static t_stat _sim_disk_cache_create (UNIT *uptr, uint32 size, t_bool write_back)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_cache *cache;
+uint32 i, nhash;
+
+_sim_disk_cache_free (uptr);
+if (ctx->map)                                   /* mapped containers are cached by the host */
+    return SCPE_OK;
+cache = (struct disk_cache *)calloc (1, sizeof (*cache));
+if (cache == NULL)
+    return SCPE_MEM;
+cache->size = size;
+cache->write_back = write_back;
+cache->nblocks = size / ctx->sector_size;
+if (cache->nblocks < 16)
+    cache->nblocks = 16;
+for (nhash = 1; nhash < cache->nblocks; nhash <<= 1)
+    ;
+cache->hash_mask = nhash - 1;
+cache->blocks = (struct disk_cache_block *)calloc (cache->nblocks, sizeof (*cache->blocks));
+cache->hash = (struct disk_cache_block **)calloc (nhash, sizeof (*cache->hash));
+cache->data = (uint8 *)malloc ((size_t)cache->nblocks * ctx->sector_size);
+if ((cache->blocks == NULL) || (cache->hash == NULL) || (cache->data == NULL)) {
+    free (cache->blocks);
+    free (cache->hash);
+    free (cache->data);
+    free (cache);
+    return SCPE_MEM;
     }
-free (tbuf);
-if (sectswritten)
-    *sectswritten = written;
-if (written > 0) {
-    t_offset da = ((t_offset)lba) * ctx->sector_size;
-    t_offset end_write = da + (written * ctx->sector_size);
+cache->lru.next = cache->lru.prev = &cache->lru;
+for (i = 0; i < cache->nblocks; i++) {
+    struct disk_cache_block *blk = &cache->blocks[i];
 
-    if (ctx->highwater < end_write)
-        ctx->highwater = end_write;
+    blk->data = cache->data + (size_t)i * ctx->sector_size;
+    blk->prev = cache->lru.prev;                /* append */
+    blk->next = &cache->lru;
+    cache->lru.prev->next = blk;
+    cache->lru.prev = blk;
     }
-return r;
+DISK_LOCK (ctx);
+ctx->cache = cache;
+DISK_UNLOCK (ctx);
+return SCPE_OK;
 }
 
-t_stat sim_disk_wrsect_a (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects, DISK_PCALLBACK callback)
+static struct disk_unit_setting *_sim_disk_unit_setting (UNIT *uptr, t_bool create)
 {
-t_stat r = SCPE_OK;
-AIO_CALLSETUP
-    r =  sim_disk_wrsect (uptr, lba, buf, sectswritten, sects);
-AIO_CALL(DOP_WSEC, lba, buf, sectswritten, sects, callback);
-return r;
+struct disk_unit_setting *s;
+
+for (s = sim_disk_unit_settings; s != NULL; s = s->next)
+    if (s->uptr == uptr)
+        return s;
+if (!create)
+    return NULL;
+s = (struct disk_unit_setting *)calloc (1, sizeof (*s));
+if (s == NULL)
+    return NULL;
+s->uptr = uptr;
+s->size = DISK_CACHE_DEFAULT;
+s->next = sim_disk_unit_settings;
+sim_disk_unit_settings = s;
+return s;
 }
 
-t_stat sim_disk_unload (UNIT *uptr)
+/* Create the cache of a unit being attached, if it has one configured */
+
+static void _sim_disk_cache_attach (UNIT *uptr)
 {
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_unit_setting *s = _sim_disk_unit_setting (uptr, FALSE);
 
-switch (DK_GET_FMT (uptr)) {                            /* case on format */
-    case DKUF_F_STD:                                    /* Simh */
-    case DKUF_F_VHD:                                    /* VHD format */
-        ctx->media_removed = 1;
-        return sim_disk_detach (uptr);
-    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
-        ctx->media_removed = 1;
-        return sim_os_disk_unload_raw (uptr->fileref);  /* remove/eject disk */
-        break;
-    default:
-        return SCPE_NOFNC;
-    }
+if (s && s->cache && (_sim_disk_cache_create (uptr, s->size, s->write_back) != SCPE_OK))
+    sim_messagef (SCPE_OK, "%s: no memory for a %uKB cache\n", sim_uname (uptr), s->size / 1024);
 }
 
-t_stat sim_disk_erase (UNIT *uptr)
+/* SET <unit> CACHE{=size|WRITEBACK|WRITETHROUGH} and SET <unit> NOCACHE */
+
+t_stat sim_disk_set_cache (UNIT *uptr, int32 flag, CONST char *cptr)
 {
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-uint8 *buf;
-t_lba lba;
-
-if (uptr->flags & UNIT_ATT)
-    return SCPE_UNATT;
+struct disk_unit_setting *s;
+char gbuf[CBUFSIZE];
+t_stat r = SCPE_OK;
 
-buf = (uint8 *)calloc (1, ctx->storage_sector_size);
-if (buf == NULL)
+if (!flag) {
+    if (cptr && *cptr)
+        return SCPE_2MARG;
+    s = _sim_disk_unit_setting (uptr, FALSE);
+    if (s)
+        s->cache = FALSE;
+    if (ctx && (uptr->flags & UNIT_ATT))
+        _sim_disk_cache_free (uptr);
+    return SCPE_OK;
+    }
+s = _sim_disk_unit_setting (uptr, TRUE);
+if (s == NULL)
     return SCPE_MEM;
-for (lba = 0; lba < ctx->container_size / ctx->sector_size; lba++)
-    sim_disk_wrsect (uptr, lba, buf, NULL, 1);          /* write sector */
-free (buf);
-return SCPE_OK;
+s->cache = TRUE;
+if (cptr && *cptr) {
+    get_glyph (cptr, gbuf, 0);
+    if (MATCH_CMD (gbuf, "WRITEBACK") == 0)
+        s->write_back = TRUE;
+    else if (MATCH_CMD (gbuf, "WRITETHROUGH") == 0)
+        s->write_back = FALSE;
+    else {
+        char *tptr;
+        t_value size = strtotv (gbuf, (CONST char **)&tptr, 10);
+
+        if (tptr == gbuf)
+            return sim_messagef (SCPE_ARG, "Invalid cache size: %s\n", cptr);
+        switch (toupper (*tptr)) {
+            case 'G':
+                size *= 1024;
+                /* fall through */
+            case 'M':
+                size *= 1024;
+                /* fall through */
+            case 'K':
+                ++tptr;
+                /* fall through */
+            case '\0':
+                size *= 1024;
+                break;
+            default:
+                return sim_messagef (SCPE_ARG, "Invalid cache size: %s\n", cptr);
+            }
+        if ((*tptr != '\0') || (size == 0) || (size > 0x40000000))
+            return sim_messagef (SCPE_ARG, "Invalid cache size: %s\n", cptr);
+        s->size = (uint32)size;
+        }
+    }
+if (ctx && (uptr->flags & UNIT_ATT))
+    r = _sim_disk_cache_create (uptr, s->size, s->write_back);
+return r;
 }
 
-/*
-   This routine is called when the simulator stops and any time
-   the asynch mode is changed (enabled or disabled)
-*/
-static void _sim_disk_io_flush (UNIT *uptr)
+/* Cache and mapping summary for SHOW <unit>, NULL when the unit has
+   neither configured */
+
+const char *sim_disk_cache_summary (UNIT *uptr)
 {
-uint32 f = DK_GET_FMT (uptr);
+static char buf[200];
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_unit_setting *s = _sim_disk_unit_setting (uptr, FALSE);
+struct disk_cache *cache;
+size_t len = 0;
+
+buf[0] = '\0';
+if ((uptr->flags & UNIT_ATT) && ctx && (DK_GET_FMT (uptr) == DKUF_F_VHD)) {
+    len = sim_vhd_disk_chain_info (uptr->fileref, buf, sizeof (buf));
+    if (ctx->commit)
+        len += snprintf (buf + len, sizeof (buf) - len, ", committing %u%%",
+                         ctx->commit->blocks ? (uint32)((100.0 * ctx->commit->next) / ctx->commit->blocks) : 100);
+    }
+if ((s == NULL) || !(s->cache || s->mmap || s->store))
+    return len ? buf : NULL;
+if (len)
+    len += snprintf (buf + len, sizeof (buf) - len, ", ");
+if (s->store) {
+    len += snprintf (buf + len, sizeof (buf) - len, "ddistore=%s", s->store);
+    if (!(s->cache || s->mmap))
+        return buf;
+    len += snprintf (buf + len, sizeof (buf) - len, ", ");
+    }
+if (s->mmap) {
+    if ((uptr->flags & UNIT_ATT) && ctx && ctx->map)
+        len += snprintf (buf + len, sizeof (buf) - len, "mmap %s bytes", sim_fmt_numeric ((double)ctx->map_size));
+    else
+        len += snprintf (buf + len, sizeof (buf) - len, "mmap");
+    if (!s->cache)
+        return buf;
+    len += snprintf (buf + len, sizeof (buf) - len, ", ");
+    }
+cache = ((uptr->flags & UNIT_ATT) && ctx) ? ctx->cache : NULL;
+len += snprintf (buf + len, sizeof (buf) - len, "cache %uKB %s", (cache ? cache->size : s->size) / 1024,
+                 (cache ? cache->write_back : s->write_back) ? "write-back" : "write-through");
+if ((uptr->flags & UNIT_ATT) && ctx && ctx->map)
+    len += snprintf (buf + len, sizeof (buf) - len, " (unused while mapped)");
+if (cache && (cache->hits + cache->misses)) {
+    len += snprintf (buf + len, sizeof (buf) - len, " (%.1f%% hits, ", (100.0 * cache->hits) / (cache->hits + cache->misses));
+    len += snprintf (buf + len, sizeof (buf) - len, "%s hits, ", sim_fmt_numeric ((double)cache->hits));
+    len += snprintf (buf + len, sizeof (buf) - len, "%s misses", sim_fmt_numeric ((double)cache->misses));
+    if (cache->writes_held)
+        len += snprintf (buf + len, sizeof (buf) - len, ", %s written back", sim_fmt_numeric ((double)cache->writebacks));
+    if (cache->write_errors)
+        len += snprintf (buf + len, sizeof (buf) - len, ", %s write errors", sim_fmt_numeric ((double)cache->write_errors));
+    snprintf (buf + len, sizeof (buf) - len, ")");
+    }
+return buf;
+}
+
+/* Memory mapped containers
+
+   SET <unit> MMAP maps a SIMH format container, or a RAW container which
+   is a plain file, into the simulator's address space when the unit is
+   attached.  Transfers within the mapping are then simple copies, and the
+   host's page cache does the caching and write back.  Modified pages are
+   written to the container by msync when the unit is flushed or detached.
+   A writable container shorter than the disk is extended to the disk's
+   size so that the whole disk can be mapped. */
+
+static void _sim_disk_mmap_sync (UNIT *uptr)
+{
+#if defined (DISK_MMAP)
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-#if defined (SIM_ASYNCH_IO)
+if (ctx && ctx->map && !(uptr->flags & UNIT_RO))
+    msync (ctx->map, (size_t)ctx->map_size, MS_SYNC);
+#endif
+}
+
+static void _sim_disk_mmap_free (UNIT *uptr)
+{
+#if defined (DISK_MMAP)
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-sim_disk_clr_async (uptr);
-if (sim_asynch_enabled)
-    sim_disk_set_async (uptr, ctx->asynch_io_latency);
+if ((ctx == NULL) || (ctx->map == NULL))
+    return;
+_sim_disk_mmap_sync (uptr);
+munmap (ctx->map, (size_t)ctx->map_size);
+ctx->map = NULL;
+ctx->map_size = 0;
 #endif
-switch (f) {                                            /* case on format */
-    case DKUF_F_STD:                                    /* Simh */
+}
+
+static t_stat _sim_disk_mmap_create (UNIT *uptr)
+{
+#if defined (DISK_MMAP)
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_offset size = (((t_offset)uptr->capac) * ctx->capac_factor * ((ctx->dptr->flags & DEV_SECTORS) ? 512 : 1));
+struct stat statb;
+void *map;
+int fd;
+
+_sim_disk_mmap_free (uptr);
+switch (DK_GET_FMT (uptr)) {                            /* case on format */
+    case DKUF_F_STD:                                    /* SIMH format */
         fflush (uptr->fileref);
+        fd = fileno (uptr->fileref);
         break;
-    case DKUF_F_VHD:                                    /* Virtual Disk */
-        sim_vhd_disk_flush (uptr->fileref);
-        break;
-    case DKUF_F_RAW:                                    /* Physical */
-        sim_os_disk_flush_raw (uptr->fileref);
+    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
+        fd = (int)((long)uptr->fileref);
         break;
+    default:
+        return sim_messagef (SCPE_NOFNC, "%s: %s format containers can't be memory mapped\n", sim_uname (uptr), sim_disk_fmt (uptr));
+    }
+if ((fstat (fd, &statb) != 0) || !S_ISREG (statb.st_mode))
+    return sim_messagef (SCPE_NOFNC, "%s: only disk container files can be memory mapped\n", sim_uname (uptr));
+size -= size % ctx->sector_size;
+if ((t_offset)statb.st_size < size) {
+    if (uptr->flags & UNIT_RO)                          /* map what is there */
+        size = ((t_offset)statb.st_size) - (((t_offset)statb.st_size) % ctx->sector_size);
+    else {
+        if (ftruncate (fd, (off_t)size) != 0)
+            return sim_messagef (SCPE_IOERR, "%s: can't extend %s for mapping: %s\n", sim_uname (uptr), uptr->filename, strerror (errno));
         }
+    }
+if ((size == 0) || ((t_offset)((size_t)size) != size))
+    return sim_messagef (SCPE_NOFNC, "%s: %s can't be memory mapped\n", sim_uname (uptr), uptr->filename);
+map = mmap (NULL, (size_t)size, PROT_READ | ((uptr->flags & UNIT_RO) ? 0 : PROT_WRITE), MAP_SHARED, fd, 0);
+if (map == MAP_FAILED)
+    return sim_messagef (SCPE_IOERR, "%s: can't map %s: %s\n", sim_uname (uptr), uptr->filename, strerror (errno));
+_sim_disk_cache_free (uptr);                            /* the host caches mapped data */
+ctx->map = (uint8 *)map;
+ctx->map_size = size;
+sim_debug_unit (ctx->dbit, uptr, "_sim_disk_mmap_create(unit=%d, size=%" LL_FMT "u)\n", (int)(uptr - ctx->dptr->units), (t_uint64)size);
+return SCPE_OK;
+#else
+return sim_messagef (SCPE_NOFNC, "%s: memory mapped containers aren't supported on this host\n", sim_uname (uptr));
+#endif
 }
 
-static t_stat _err_return (UNIT *uptr, t_stat stat)
+/* Map the container of a unit being attached, if it is configured to be */
+
+static void _sim_disk_mmap_attach (UNIT *uptr)
 {
-free (uptr->filename);
-uptr->filename = NULL;
-free (uptr->disk_ctx);
-uptr->disk_ctx = NULL;
-return stat;
+struct disk_unit_setting *s = _sim_disk_unit_setting (uptr, FALSE);
+
+if (s && s->mmap)
+    (void)_sim_disk_mmap_create (uptr);                 /* unmapped I/O on failure */
 }
 
-static t_stat _sim_disk_rdsect_interleave (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, uint16 sectpertrack, uint16 interleave, uint16 skew, uint16 offset)
+/* Transfers entirely within the mapping.  These return FALSE when the
+   transfer must be done by the container's regular routines. */
+
+static t_bool _sim_disk_mmap_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
 {
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-t_lba sectno = lba, psa;
-t_stat status;
+t_offset da = ((t_offset)lba) * ctx->sector_size;
+size_t tbc = ((size_t)sects) * ctx->sector_size;
 
+if ((ctx->map == NULL) || (da + tbc > ctx->map_size))
+    return FALSE;
+sim_buf_copy_swapped (buf, ctx->map + (size_t)da, ctx->xfer_element_size, tbc / ctx->xfer_element_size);
 if (sectsread)
-    *sectsread = 0;
+    *sectsread = sects;
+return TRUE;
+}
 
-do {
-    uint16 i, track, sector;
+static t_bool _sim_disk_mmap_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_offset da = ((t_offset)lba) * ctx->sector_size;
+size_t tbc = ((size_t)sects) * ctx->sector_size;
 
-    /*
-     * Map an LBA address into a physical sector address
-     */
-    track = sectno / sectpertrack;
-    i = (sectno % sectpertrack) * interleave;
-    if (i >= sectpertrack)
-        i++;
-    sector = (i + (track * skew)) % sectpertrack;
+if ((ctx->map == NULL) || (uptr->flags & UNIT_RO) || (da + tbc > ctx->map_size))
+    return FALSE;
+sim_buf_copy_swapped (ctx->map + (size_t)da, buf, ctx->xfer_element_size, tbc / ctx->xfer_element_size);
+if (sectswritten)
+    *sectswritten = sects;
+DISK_LOCK (ctx);
+if (ctx->highwater < da + tbc)
+    ctx->highwater = da + tbc;
+DISK_UNLOCK (ctx);
+return TRUE;
+}
 
-    psa = sector + (track * sectpertrack) + offset;
+/* SET <unit> MMAP and SET <unit> NOMMAP */
 
-    status = sim_disk_rdsect(uptr, psa, buf, NULL, 1);
-    sects--;
-    buf += ctx->sector_size;
-    sectno++;
-    if (sectsread)
-        *sectsread += 1;
-    } while ((sects != 0) && (status == SCPE_OK));
+t_stat sim_disk_set_mmap (UNIT *uptr, int32 flag, CONST char *cptr)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_unit_setting *s;
+t_stat r = SCPE_OK;
 
-return status;
+if (cptr && *cptr)
+    return SCPE_2MARG;
+#if !defined (DISK_MMAP)
+if (flag)
+    return sim_messagef (SCPE_NOFNC, "Memory mapped containers aren't supported on this host\n");
+#endif
+s = _sim_disk_unit_setting (uptr, flag);
+if (s == NULL)
+    return flag ? SCPE_MEM : SCPE_OK;
+s->mmap = (flag != 0);
+if (ctx && (uptr->flags & UNIT_ATT)) {
+    if (flag)
+        r = _sim_disk_mmap_create (uptr);
+    else {
+        _sim_disk_mmap_free (uptr);
+        if (s->cache)                                   /* cache resumes when unmapped */
+            r = _sim_disk_cache_create (uptr, s->size, s->write_back);
+        }
+    }
+return r;
 }
 
-/*
- * Version of sim_disk_rdsect() specifically for filesystem detection of DEC
- * file systems. The routine handles regular DEC disks (physsectsz == 0) and
- * RX01/RX02 disks (physsectsz == 128 or == 256) which ignore track 0,
- * interleave physical sectors 2:1 for the remaining tracks and have a skew
- * 6 sectors at the end of a track.
- */
-#define RX0xNSECT               26                      /* 26 sectors/track */
-#define RX0xINTER               2                       /* 2 sector interleave */
-#define RX0xISKEW               6                       /* 6 sectors interleave per track */
+/* SET <unit> DDISTORE=path and SET <unit> NODDISTORE
 
-static t_stat _DEC_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, uint32 physsectsz)
+   DDI containers subsequently created for the unit keep their chunks in
+   the named store.  A relative path is relative to the container. */
+
+t_stat sim_disk_set_store (UNIT *uptr, int32 flag, CONST char *cptr)
 {
-if (physsectsz == 0)            /* Use device natural sector size */
-    return sim_disk_rdsect(uptr, lba, buf, sectsread, sects);
+struct disk_unit_setting *s;
+char gbuf[CBUFSIZE];
 
-return _sim_disk_rdsect_interleave(uptr, lba, buf, sectsread, sects, RX0xNSECT, RX0xINTER, RX0xISKEW, RX0xNSECT);
+if (!flag) {
+    if (cptr && *cptr)
+        return SCPE_2MARG;
+    s = _sim_disk_unit_setting (uptr, FALSE);
+    if (s) {
+        free (s->store);
+        s->store = NULL;
+        }
+    return SCPE_OK;
+    }
+if ((cptr == NULL) || (*cptr == '\0'))
+    return SCPE_MISVAL;
+cptr = get_glyph_nc (cptr, gbuf, 0);
+if (*cptr)
+    return SCPE_2MARG;
+if (strlen (gbuf) >= 256)
+    return sim_messagef (SCPE_ARG, "Chunk store path too long: %s\n", gbuf);
+s = _sim_disk_unit_setting (uptr, TRUE);
+if (s == NULL)
+    return SCPE_MEM;
+free (s->store);
+s->store = strdup (gbuf);
+if (s->store == NULL)
+    return SCPE_MEM;
+if (uptr->flags & UNIT_ATT)
+    sim_messagef (SCPE_OK, "%s: Chunk store applies to DDI containers created by a later ATTACH\n", sim_uname (uptr));
+return SCPE_OK;
 }
 
-#pragma pack(push,1)
-typedef struct _ODS1_HomeBlock
-    {
-    uint16  hm1_w_ibmapsize;
-    uint32  hm1_l_ibmaplbn;
-    uint16  hm1_w_maxfiles;
-    uint16  hm1_w_cluster;
-    uint16  hm1_w_devtype;
-    uint16  hm1_w_structlev;
-#define HM1_C_LEVEL1    0401
-#define HM1_C_LEVEL2    0402
-    uint8   hm1_t_volname[12];
-    uint8   hm1_b_fill_1[4];
-    uint16  hm1_w_volowner;
-    uint16  hm1_w_protect;
-    uint16  hm1_w_volchar;
-    uint16  hm1_w_fileprot;
-    uint8   hm1_b_fill_2[6];
-    uint8   hm1_b_window;
-    uint8   hm1_b_extend;
-    uint8   hm1_b_lru_lim;
-    uint8   hm1_b_fill_3[11];
-    uint16  hm1_w_checksum1;
-    uint8   hm1_t_credate[14];
-    uint8   hm1_b_fill_4[382];
-    uint32  hm1_l_serialnum;
-    uint8   hm1_b_fill_5[12];
-    uint8   hm1_t_volname2[12];
-    uint8   hm1_t_ownername[12];
-    uint8   hm1_t_format[12];
-    uint8   hm1_t_fill_6[2];
-    uint16  hm1_w_checksum2;
-    } ODS1_HomeBlock;
+/* Apply a unit's chunk store setting to a newly created DDI container */
 
-    typedef struct _ODS2_HomeBlock
-    {
-    uint32 hm2_l_homelbn;
-    uint32 hm2_l_alhomelbn;
-    uint32 hm2_l_altidxlbn;
-    uint8  hm2_b_strucver;
-    uint8  hm2_b_struclev;
-    uint16 hm2_w_cluster;
-    uint16 hm2_w_homevbn;
-    uint16 hm2_w_alhomevbn;
-    uint16 hm2_w_altidxvbn;
-    uint16 hm2_w_ibmapvbn;
-    uint32 hm2_l_ibmaplbn;
-    uint32 hm2_l_maxfiles;
-    uint16 hm2_w_ibmapsize;
-    uint16 hm2_w_resfiles;
-    uint16 hm2_w_devtype;
-    uint16 hm2_w_rvn;
-    uint16 hm2_w_setcount;
-    uint16 hm2_w_volchar;
-    uint32 hm2_l_volowner;
-    uint32 hm2_l_reserved;
-    uint16 hm2_w_protect;
-    uint16 hm2_w_fileprot;
-    uint16 hm2_w_reserved;
-    uint16 hm2_w_checksum1;
-    uint32 hm2_q_credate[2];
-    uint8  hm2_b_window;
-    uint8  hm2_b_lru_lim;
-    uint16 hm2_w_extend;
-    uint32 hm2_q_retainmin[2];
-    uint32 hm2_q_retainmax[2];
-    uint32 hm2_q_revdate[2];
-    uint8  hm2_r_min_class[20];
-    uint8  hm2_r_max_class[20];
-    uint8  hm2_r_reserved[320];
-    uint32 hm2_l_serialnum;
-    uint8  hm2_t_strucname[12];
-    uint8  hm2_t_volname[12];
-    uint8  hm2_t_ownername[12];
-    uint8  hm2_t_format[12];
-    uint16 hm2_w_reserved2;
-    uint16 hm2_w_checksum2;
-    } ODS2_HomeBlock;
+static void _sim_disk_ddi_new_store (UNIT *uptr, FILE *container)
+{
+struct disk_unit_setting *s = _sim_disk_unit_setting (uptr, FALSE);
+t_stat r;
 
-typedef struct _ODS1_FileHeader
-    {
-    uint8   fh1_b_idoffset;
-    uint8   fh1_b_mpoffset;
-    uint16  fh1_w_fid_num;
-    uint16  fh1_w_fid_seq;
-    uint16  fh1_w_struclev;
-    uint16  fh1_w_fileowner;
-    uint16  fh1_w_fileprot;
-    uint16  fh1_w_filechar;
-    uint16  fh1_w_recattr;
-    uint8   fh1_b_fill_1[494];
-    uint16  fh1_w_checksum;
-    } ODS1_FileHeader;
+if ((s == NULL) || (s->store == NULL))
+    return;
+r = sim_ddi_disk_set_store (container, s->store);
+if (r != SCPE_OK)
+    sim_messagef (SCPE_OK, "%s: Can't use chunk store '%s': %s\n", sim_uname (uptr), s->store, sim_error_text (r));
+}
 
-typedef struct _ODS2_FileHeader
-    {
-    uint8  fh2_b_idoffset;
-    uint8  fh2_b_mpoffset;
-    uint8  fh2_b_acoffset;
-    uint8  fh2_b_rsoffset;
-    uint16 fh2_w_seg_num;
-    uint16 fh2_w_structlev;
-    uint16 fh2_w_fid[3];
-    uint16 fh2_w_ext_fid[3];
-    uint16 fh2_w_recattr[16];
-    uint32 fh2_l_filechar;
-    uint16 fh2_w_remaining[228];
-    } ODS2_FileHeader;
+/* I/O statistics and transfer tracing
 
-typedef union _ODS2_Retreval
-    {
-        struct
-            {
-            unsigned fm2___fill   : 14;       /* type specific data               */
-            unsigned fm2_v_format : 2;        /* format type code                 */
-            } fm2_r_word0_bits;
-        struct
-            {
-            unsigned fm2_v_exact    : 1;      /* exact placement specified        */
-            unsigned fm2_v_oncyl    : 1;      /* on cylinder allocation desired   */
-            unsigned fm2___fill     : 10;
-            unsigned fm2_v_lbn      : 1;      /* use LBN of next map pointer      */
-            unsigned fm2_v_rvn      : 1;      /* place on specified RVN           */
-            unsigned fm2_v_format0  : 2;
-            } fm2_r_map_bits0;
-        struct
-            {
-            unsigned fm2_b_count1   : 8;      /* low byte described below         */
-            unsigned fm2_v_highlbn1 : 6;      /* high order LBN                   */
-            unsigned fm2_v_format1  : 2;
-            unsigned fm2_w_lowlbn1  : 16;     /* low order LBN                    */
-            } fm2_r_map_bits1;
-        struct
-            {
-            struct
-                {
-                unsigned fm2_v_count2   : 14; /* count field                      */
-                unsigned fm2_v_format2  : 2;
-                unsigned fm2_l_lowlbn2  : 16; /* low order LBN                    */
-                } fm2_r_map2_long0;
-            uint16 fm2_l_highlbn2;            /* high order LBN                   */
-            } fm2_r_map_bits2;
-        struct
-            {
-            struct
-                {
-                unsigned fm2_v_highcount3 : 14; /* low order count field          */
-                unsigned fm2_v_format3  : 2;
-                unsigned fm2_w_lowcount3 : 16;  /* high order count field         */
-                } fm2_r_map3_long0;
-            uint32 fm2_l_lbn3;
-            } fm2_r_map_bits3;
-    } ODS2_Retreval;
+   Every transfer through sim_disk_rdsect/sim_disk_wrsect (and their
+   scatter/gather forms) is counted: bytes moved, whether it started
+   where the previous transfer ended, and the host time it took, in a
+   histogram of power of 2 microsecond buckets.  The statistics start
+   over when a unit is attached and are displayed by SHOW <unit>.
 
-typedef struct _ODS1_Retreval
-    {
-    uint8   fm1_b_ex_segnum;
-    uint8   fm1_b_ex_rvn;
-    uint16  fm1_w_ex_filnum;
-    uint16  fm1_w_ex_filseq;
-    uint8   fm1_b_countsize;
-    uint8   fm1_b_lbnsize;
-    uint8   fm1_b_inuse;
-    uint8   fm1_b_avail;
-    union {
-        struct {
-            uint8 fm1_b_highlbn;
-            uint8 fm1_b_count;
-            uint16 fm1_w_lowlbn;
-            } fm1_s_fm1def1;
-        struct {
-            uint8 fm1_b_highlbn;
-            uint8 fm1_b_count;
-            uint16 fm1_w_lowlbn;
-            } fm1_s_fm1def2;
-        } fm1_pointers[4];
-    } ODS1_Retreval;
+   SET <unit> IOTRACE=file also records each transfer in a binary trace
+   file which sim_disk_replay (and DiskTool's REPLAY command) can perform
+   against a container.  A trace file is a header followed by records,
+   all little endian:
 
-typedef struct _ODS1_StorageControlBlock
-    {
-    uint8  scb_b_unused[3];
-    uint8  scb_b_bitmapblks;
-    struct _bitmapblk {
-        uint16 scb_w_freeblks;
-        uint16 scb_w_freeptr;
-        } scb_r_blocks[1];
-    } ODS1_SCB;
+       header  8 bytes  "SIMHDKTR"
+               4 bytes  format version (1)
+               4 bytes  reserved (0)
+       record  8 bytes  simulated time (sim_gtime) the transfer was requested
+               8 bytes  first sector
+               4 bytes  sector count
+               2 bytes  operation (0 read, 1 write)
+               2 bytes  sector size                                          */
 
+#define DK_TRACE_MAGIC      "SIMHDKTR"
+#define DK_TRACE_VERSION    1
+#define DK_TRACE_HDRSIZE    16
+#define DK_TRACE_RECSIZE    24
+#define DK_TRACE_READ       0
+#define DK_TRACE_WRITE      1
 
-typedef struct _ODS2_StorageControlBlock
-    {
-    uint8  scb_b_strucver;   /* 1 */
-    uint8  scb_b_struclev;   /* 2 */
-    uint16 scb_w_cluster;
-    uint32 scb_l_volsize;
-    uint32 scb_l_blksize;
-    uint32 scb_l_sectors;
-    uint32 scb_l_tracks;
-    uint32 scb_l_cylinder;
-    uint32 scb_l_status;
-    uint32 scb_l_status2;
-    uint16 scb_w_writecnt;
-    uint8  scb_t_volockname[12];
-    uint32 scb_q_mounttime[2];
-    uint16 scb_w_backrev;
-    uint32 scb_q_genernum[2];
-    uint8  scb_b_reserved[446];
-    uint16 scb_w_checksum;
-    } ODS2_SCB;
-#pragma pack(pop)
+static void _sim_disk_put_le (uint8 *p, t_uint64 val, int bytes)
+{
+while (bytes-- > 0) {
+    *p++ = (uint8)val;
+    val >>= 8;
+    }
+}
 
-static uint16
-ODSChecksum (void *Buffer, uint16 WordCount)
-    {
-    int i;
-    uint16 CheckSum = 0;
-    uint16 *Buf = (uint16 *)Buffer;
+static t_uint64 _sim_disk_get_le (const uint8 *p, int bytes)
+{
+t_uint64 val = 0;
 
-    for (i=0; i<WordCount; i++)
-        CheckSum += Buf[i];
-    return CheckSum;
-    }
+while (bytes-- > 0)
+    val = (val << 8) | p[bytes];
+return val;
+}
+
+static void _sim_disk_stats_start (struct timespec *start)
+{
+#if defined (CLOCK_MONOTONIC)
+clock_gettime (CLOCK_MONOTONIC, start);
+#else
+clock_gettime (CLOCK_REALTIME, start);
+#endif
+}
 
+/* Account for a completed transfer */
 
-static t_offset get_ods2_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
+static void _sim_disk_stats (UNIT *uptr, int op, t_lba lba, t_seccnt sects, const struct timespec *start, double issued)
 {
-DEVICE *dptr;
-t_addr saved_capac;
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-t_offset temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
-ODS2_HomeBlock Home;
-ODS2_FileHeader Header;
-ODS2_Retreval *Retr;
-ODS2_SCB Scb;
-uint16 CheckSum1, CheckSum2;
-uint32 ScbLbn = 0;
-t_offset ret_val = (t_offset)-1;
-t_seccnt sects_read;
+struct disk_stats *st = &ctx->stats;
+struct timespec now;
+double usecs;
+uint32 b;
 
-if ((dptr = find_dev_from_unit (uptr)) == NULL)
-    return ret_val;
-saved_capac = uptr->capac;
-uptr->capac = (t_addr)temp_capac;
-if ((_DEC_rdsect (uptr, 512 / ctx->sector_size, (uint8 *)&Home, &sects_read, sizeof (Home) / ctx->sector_size, physsectsz)) ||
-    (sects_read != (sizeof (Home) / ctx->sector_size)))
-    goto Return_Cleanup;
-CheckSum1 = ODSChecksum (&Home, (uint16)((((char *)&Home.hm2_w_checksum1)-((char *)&Home.hm2_l_homelbn))/2));
-CheckSum2 = ODSChecksum (&Home, (uint16)((((char *)&Home.hm2_w_checksum2)-((char *)&Home.hm2_l_homelbn))/2));
-if ((Home.hm2_l_homelbn == 0) ||
-    (Home.hm2_l_alhomelbn == 0) ||
-    (Home.hm2_l_altidxlbn == 0) ||
-    ((Home.hm2_b_struclev != 2) && (Home.hm2_b_struclev != 5)) ||
-    (Home.hm2_b_strucver == 0) ||
-    (Home.hm2_w_cluster == 0) ||
-    (Home.hm2_w_homevbn == 0) ||
-    (Home.hm2_w_alhomevbn == 0) ||
-    (Home.hm2_w_ibmapvbn == 0) ||
-    (Home.hm2_l_ibmaplbn == 0) ||
-    (Home.hm2_w_resfiles >= Home.hm2_l_maxfiles) ||
-    (Home.hm2_w_ibmapsize == 0) ||
-    (Home.hm2_w_resfiles < 5) ||
-    (Home.hm2_w_checksum1 != CheckSum1) ||
-    (Home.hm2_w_checksum2 != CheckSum2))
-    goto Return_Cleanup;
-if ((_DEC_rdsect (uptr, (Home.hm2_l_ibmaplbn+Home.hm2_w_ibmapsize+1) * (512 / ctx->sector_size),
-                  (uint8 *)&Header, &sects_read, sizeof (Header) / ctx->sector_size, physsectsz)) ||
-    (sects_read != (sizeof (Header) / ctx->sector_size)))
-    goto Return_Cleanup;
-CheckSum1 = ODSChecksum (&Header, 255);
-if (CheckSum1 != *(((uint16 *)&Header)+255)) /* Verify Checksum on BITMAP.SYS file header */
-    goto Return_Cleanup;
-Retr = (ODS2_Retreval *)(((uint16*)(&Header))+Header.fh2_b_mpoffset);
-/* The BitMap File has a single extent, which may be preceded by a placement descriptor */
-if (Retr->fm2_r_word0_bits.fm2_v_format == 0)
-    Retr = (ODS2_Retreval *)(((uint16 *)Retr)+1); /* skip placement descriptor */
-switch (Retr->fm2_r_word0_bits.fm2_v_format)
-    {
-    case 1:
-        ScbLbn = (Retr->fm2_r_map_bits1.fm2_v_highlbn1<<16)+Retr->fm2_r_map_bits1.fm2_w_lowlbn1;
-        break;
-    case 2:
-        ScbLbn = (Retr->fm2_r_map_bits2.fm2_l_highlbn2<<16)+Retr->fm2_r_map_bits2.fm2_r_map2_long0.fm2_l_lowlbn2;
-        break;
-    case 3:
-        ScbLbn = Retr->fm2_r_map_bits3.fm2_l_lbn3;
-        break;
+#if defined (CLOCK_MONOTONIC)
+clock_gettime (CLOCK_MONOTONIC, &now);
+#else
+clock_gettime (CLOCK_REALTIME, &now);
+#endif
+usecs = (now.tv_sec - start->tv_sec) * 1000000.0 + (now.tv_nsec - start->tv_nsec) / 1000.0;
+if (usecs < 0.0)                                        /* host clock stepped back */
+    usecs = 0.0;
+for (b = 0; (b < DISK_LAT_BUCKETS - 1) && (usecs >= (double)(1u << b)); b++)
+    ;
+DISK_LOCK (ctx);
+if (op == DK_TRACE_WRITE)
+    ctx->write_count++;                                 /* record write operation */
+else
+    ctx->read_count++;                                  /* record read operation */
+st->bytes[op] += (t_uint64)sects * ctx->sector_size;
+if (lba == st->next_lba)
+    st->sequential[op]++;
+st->next_lba = lba + sects;
+st->latency[op][b]++;
+st->usecs[op] += usecs;
+if (usecs > st->max_usecs[op])
+    st->max_usecs[op] = usecs;
+if (ctx->trace) {
+    uint8 rec[DK_TRACE_RECSIZE];
+
+    _sim_disk_put_le (rec, (t_uint64)issued, 8);
+    _sim_disk_put_le (rec + 8, (t_uint64)lba, 8);
+    _sim_disk_put_le (rec + 16, sects, 4);
+    _sim_disk_put_le (rec + 20, op, 2);
+    _sim_disk_put_le (rec + 22, ctx->sector_size, 2);
+    (void)fwrite (rec, 1, sizeof (rec), ctx->trace);
     }
-Retr = (ODS2_Retreval *)(((uint16 *)Retr)+Retr->fm2_r_word0_bits.fm2_v_format+1);
-if ((_DEC_rdsect (uptr, ScbLbn * (512 / ctx->sector_size), (uint8 *)&Scb, &sects_read, sizeof (Scb) / ctx->sector_size, physsectsz)) ||
-    (sects_read != (sizeof (Scb) / ctx->sector_size)))
-    goto Return_Cleanup;
-CheckSum1 = ODSChecksum (&Scb, 255);
-if (CheckSum1 != *(((uint16 *)&Scb)+255)) /* Verify Checksum on Storage Control Block */
-    goto Return_Cleanup;
-if ((Scb.scb_w_cluster != Home.hm2_w_cluster) ||
-    (Scb.scb_b_strucver != Home.hm2_b_strucver) ||
-    (Scb.scb_b_struclev != Home.hm2_b_struclev))
-    goto Return_Cleanup;
-sim_messagef (SCPE_OK, "%s: '%s' Contains ODS%d File system\n", sim_uname (uptr), uptr->filename, Home.hm2_b_struclev);
-sim_messagef (SCPE_OK, "%s: Volume Name: %12.12s Format: %12.12s Sectors In Volume: %u\n",
-                                   sim_uname (uptr), Home.hm2_t_volname, Home.hm2_t_format, Scb.scb_l_volsize);
-ret_val = ((t_offset)Scb.scb_l_volsize) * 512;
+DISK_UNLOCK (ctx);
+}
 
-Return_Cleanup:
-uptr->capac = saved_capac;
-if (readonly)
-    *readonly = sim_disk_wrp (uptr);
-return ret_val;
+static void _sim_disk_stats_clear (struct disk_context *ctx)
+{
+DISK_LOCK (ctx);
+memset (&ctx->stats, 0, sizeof (ctx->stats));
+ctx->read_count = ctx->write_count = 0;
+DISK_UNLOCK (ctx);
 }
 
-static t_offset get_ods1_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
+/* Start the statistics of a unit which has been attached, leaving out
+   the transfers done while attaching, and connect its trace file */
+
+static void _sim_disk_stats_attach (UNIT *uptr)
 {
-DEVICE *dptr;
-t_addr saved_capac;
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-t_addr temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
-ODS1_HomeBlock Home;
-ODS1_FileHeader Header;
-ODS1_Retreval *Retr;
-uint8 scb_buf[512];
-ODS1_SCB *Scb = (ODS1_SCB *)scb_buf;
-uint16 CheckSum1, CheckSum2;
-uint32 ScbLbn;
-t_offset ret_val = (t_offset)-1;
-t_seccnt sects_read;
-
-if ((dptr = find_dev_from_unit (uptr)) == NULL)
-    return ret_val;
-saved_capac = uptr->capac;
-uptr->capac = temp_capac;
-if ((_DEC_rdsect (uptr, 512 / ctx->sector_size, (uint8 *)&Home, &sects_read, sizeof (Home) / ctx->sector_size, physsectsz)) ||
-    (sects_read != (sizeof (Home) / ctx->sector_size)))
-    goto Return_Cleanup;
-CheckSum1 = ODSChecksum (&Home, (uint16)((((char *)&Home.hm1_w_checksum1)-((char *)&Home.hm1_w_ibmapsize))/2));
-CheckSum2 = ODSChecksum (&Home, (uint16)((((char *)&Home.hm1_w_checksum2)-((char *)&Home.hm1_w_ibmapsize))/2));
-if ((Home.hm1_w_ibmapsize == 0) ||
-    (Home.hm1_l_ibmaplbn == 0) ||
-    (Home.hm1_w_maxfiles == 0) ||
-    (Home.hm1_w_cluster != 1) ||
-    ((Home.hm1_w_structlev != HM1_C_LEVEL1) && (Home.hm1_w_structlev != HM1_C_LEVEL2)) ||
-    (Home.hm1_l_ibmaplbn == 0) ||
-    (Home.hm1_w_checksum1 != CheckSum1) ||
-    (Home.hm1_w_checksum2 != CheckSum2))
-    goto Return_Cleanup;
-if ((_DEC_rdsect (uptr, (((Home.hm1_l_ibmaplbn << 16) + ((Home.hm1_l_ibmaplbn >> 16) & 0xFFFF)) + Home.hm1_w_ibmapsize + 1) * (512 / ctx->sector_size),
-                  (uint8 *)&Header, &sects_read, sizeof (Header) / ctx->sector_size, physsectsz)) ||
-    (sects_read != (sizeof (Header) / ctx->sector_size)))
-    goto Return_Cleanup;
-CheckSum1 = ODSChecksum (&Header, 255);
-if (CheckSum1 != *(((uint16 *)&Header)+255)) /* Verify Checksum on BITMAP.SYS file header */
-    goto Return_Cleanup;
+struct disk_unit_setting *s = _sim_disk_unit_setting (uptr, FALSE);
 
-Retr = (ODS1_Retreval *)(((uint16*)(&Header))+Header.fh1_b_mpoffset);
-ScbLbn = (Retr->fm1_pointers[0].fm1_s_fm1def1.fm1_b_highlbn<<16)+Retr->fm1_pointers[0].fm1_s_fm1def1.fm1_w_lowlbn;
-if ((_DEC_rdsect (uptr, ScbLbn * (512 / ctx->sector_size), (uint8 *)Scb, &sects_read, 512 / ctx->sector_size, physsectsz)) ||
-    (sects_read != (512 / ctx->sector_size)))
-    goto Return_Cleanup;
-if (Scb->scb_b_bitmapblks < 127)
-    ret_val = (((t_offset)Scb->scb_r_blocks[Scb->scb_b_bitmapblks].scb_w_freeblks << 16) + Scb->scb_r_blocks[Scb->scb_b_bitmapblks].scb_w_freeptr) * 512;
-else
-    ret_val = (((t_offset)Scb->scb_r_blocks[0].scb_w_freeblks << 16) + Scb->scb_r_blocks[0].scb_w_freeptr) * 512;
-sim_messagef (SCPE_OK, "%s: '%s' Contains an ODS1 File system\n", sim_uname (uptr), uptr->filename);
-sim_messagef (SCPE_OK, "%s: Volume Name: %12.12s Format: %12.12s Sectors In Volume: %u\n",
-                                sim_uname (uptr), Home.hm1_t_volname, Home.hm1_t_format, (uint32)(ret_val / 512));
-Return_Cleanup:
-uptr->capac = saved_capac;
-if (readonly)
-    *readonly = sim_disk_wrp (uptr);
-return ret_val;
+_sim_disk_stats_clear (ctx);
+ctx->trace = s ? s->trace : NULL;
 }
 
-typedef struct ultrix_disklabel {
-    uint32  pt_magic;       /* magic no. indicating part. info exits */
-    uint32  pt_valid;       /* set by driver if pt is current */
-    struct  pt_info {
-        uint32  pi_nblocks; /* no. of sectors */
-        uint32  pi_blkoff;  /* block offset for start */
-        } pt_part[8];
-    } ultrix_disklabel;
+/* SET <unit> IOTRACE=file and SET <unit> NOIOTRACE
 
-#define PT_MAGIC        0x032957        /* Partition magic number */
-#define PT_VALID        1               /* Indicates if struct is valid */
+   The trace file is created (replacing an existing file) by the SET
+   command and collects the transfers of every container attached to the
+   unit until NOIOTRACE or the simulator exits. */
 
-static t_offset get_ultrix_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
+t_stat sim_disk_set_iotrace (UNIT *uptr, int32 flag, CONST char *cptr)
 {
-DEVICE *dptr;
-t_addr saved_capac;
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-t_addr temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
-uint8 sector_buf[512];
-ultrix_disklabel *Label = (ultrix_disklabel *)(sector_buf + sizeof (sector_buf) - sizeof (ultrix_disklabel));
-t_offset ret_val = (t_offset)-1;
-int i;
-uint32 max_lbn = 0, max_lbn_partnum = 0;
-t_seccnt sects_read;
-
-if ((dptr = find_dev_from_unit (uptr)) == NULL)
-    return ret_val;
-saved_capac = uptr->capac;
-uptr->capac = temp_capac;
-if ((_DEC_rdsect (uptr, 31 * (512 / ctx->sector_size), sector_buf, &sects_read, 512 / ctx->sector_size, physsectsz)) ||
-    (sects_read != (512 / ctx->sector_size)))
-    goto Return_Cleanup;
+struct disk_unit_setting *s = _sim_disk_unit_setting (uptr, FALSE);
+char gbuf[CBUFSIZE];
+uint8 hdr[DK_TRACE_HDRSIZE];
+FILE *trace = NULL;
+
+if (flag) {
+    if ((cptr == NULL) || (*cptr == '\0'))
+        return SCPE_MISVAL;
+    cptr = get_glyph_nc (cptr, gbuf, 0);
+    if (*cptr)
+        return SCPE_2MARG;
+    trace = sim_fopen (gbuf, "wb");
+    if (trace == NULL)
+        return sim_messagef (SCPE_OPENERR, "Can't create I/O trace file %s: %s\n", gbuf, strerror (errno));
+    memset (hdr, 0, sizeof (hdr));
+    memcpy (hdr, DK_TRACE_MAGIC, 8);
+    _sim_disk_put_le (hdr + 8, DK_TRACE_VERSION, 4);
+    if ((fwrite (hdr, 1, sizeof (hdr), trace) != sizeof (hdr)) ||
+        ((s == NULL) && ((s = _sim_disk_unit_setting (uptr, TRUE)) == NULL))) {
+        fclose (trace);
+        return SCPE_IOERR;
+        }
+    }
+else {
+    if (cptr && *cptr)
+        return SCPE_2MARG;
+    if (s == NULL)
+        return SCPE_OK;
+    }
+if (ctx && (uptr->flags & UNIT_ATT)) {
+    DISK_LOCK (ctx);
+    ctx->trace = trace;
+    DISK_UNLOCK (ctx);
+    }
+if (s->trace)
+    fclose (s->trace);
+free (s->trace_path);
+s->trace = trace;
+s->trace_path = trace ? strdup (gbuf) : NULL;
+return SCPE_OK;
+}
 
-if ((Label->pt_magic != PT_MAGIC) ||
-    (Label->pt_valid != PT_VALID))
-    goto Return_Cleanup;
+/* Statistics display for SHOW <unit> */
 
-for (i = 0; i < 8; i++) {
-    uint32 end_lbn = Label->pt_part[i].pi_blkoff + Label->pt_part[i].pi_nblocks;
-    if (end_lbn > max_lbn) {
-        max_lbn = end_lbn;
-        max_lbn_partnum = i;
+void sim_disk_show_stats (FILE *st, UNIT *uptr)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_unit_setting *s = _sim_disk_unit_setting (uptr, FALSE);
+struct disk_stats stats;
+uint32 count[2];
+const char *name[2] = {"Reads: ", "Writes:"};
+int op;
+uint32 b;
+
+if ((ctx == NULL) || !(uptr->flags & UNIT_ATT))
+    return;
+DISK_LOCK (ctx);
+stats = ctx->stats;
+count[0] = ctx->read_count;
+count[1] = ctx->write_count;
+DISK_UNLOCK (ctx);
+for (op = DK_TRACE_READ; op <= DK_TRACE_WRITE; op++) {
+    fprintf (st, "  %s %s", name[op], sim_fmt_numeric ((double)count[op]));
+    if (count[op] == 0) {
+        fprintf (st, "\n");
+        continue;
+        }
+    fprintf (st, ", %s bytes", sim_fmt_numeric ((double)stats.bytes[op]));
+    fprintf (st, ", %.1f%% sequential", (100.0 * stats.sequential[op]) / count[op]);
+    fprintf (st, ", host latency %.1f usecs average, %.1f usecs max\n", stats.usecs[op] / count[op], stats.max_usecs[op]);
+    for (b = 0; b < DISK_LAT_BUCKETS; b++) {
+        if (stats.latency[op][b] == 0)
+            continue;
+        if (b < DISK_LAT_BUCKETS - 1)
+            fprintf (st, "    < %7u usecs: ", 1u << b);
+        else
+            fprintf (st, "    >=%7u usecs: ", 1u << (b - 1));
+        fprintf (st, "%10u (%5.1f%%)\n", stats.latency[op][b], (100.0 * stats.latency[op][b]) / count[op]);
         }
     }
-sim_messagef (SCPE_OK, "%s: '%s' Contains Ultrix partitions\n", sim_uname (uptr), uptr->filename);
-sim_messagef (SCPE_OK, "Partition with highest sector: %c, Sectors On Disk: %u\n", 'a' + max_lbn_partnum, max_lbn);
-ret_val = ((t_offset)max_lbn) * 512;
-
-Return_Cleanup:
-uptr->capac = saved_capac;
-if (readonly)
-    *readonly = sim_disk_wrp (uptr);
-return ret_val;
+if (s && s->trace_path)
+    fprintf (st, "  I/O trace: %s\n", s->trace_path);
 }
 
+/* Replay a trace against the container attached to a unit
 
-/* ISO 9660 Volume Recognizer - Structure Info gathered from: https://wiki.osdev.org/ISO_9660 */
+   The transfers are performed one after another as fast as the
+   container allows, which leaves the unit's statistics describing how
+   the host storage performs for the traced workload.  Transfers are
+   rescaled if the container's sector size differs from the trace's, and
+   those beyond the end of the container are skipped.  Writes (which
+   destroy the container's data) are performed only if requested, with
+   a non zero fill pattern so that they aren't optimized away. */
 
-typedef struct ISO_9660_Volume_Descriptor {
-    uint8   Type;                       // Volume Descriptor type code (0, 1, 2, 3 and 255)
-    uint8   Identifier[5];              // Always 'CD001'.
-    uint8   Version;                    // Volume Descriptor Version (0x01).
-    uint8   Data[2041];                 // Depends on the volume descriptor type.
-    } ISO_9660_Volume_Descriptor;
+t_stat sim_disk_replay (UNIT *uptr, const char *tracefile, t_bool writes)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+uint8 hdr[DK_TRACE_HDRSIZE], rec[DK_TRACE_RECSIZE];
+uint8 *buf = NULL;
+size_t bufsize = 0;
+uint32 replayed = 0, skipped = 0;
+t_offset total, start, bytes;
+t_lba lba;
+t_seccnt sects, done;
+uint32 op, sector_size;
+FILE *f;
+t_stat r = SCPE_OK;
 
-typedef struct ISO_9660_Primary_Volume_Descriptor {
-    uint8   Type;                       // Always 0x01 for a Primary Volume Descriptor.
-    uint8   Identifier[5];              // Always 'CD001'.
-    uint8   Version;                    // Always 0x01.
-    uint8   Unused;                     // Always 0x00.
-    uint8   SystemIdentifier[32];       // The name of the system that can act upon sectors 0x00-0x0F for the volume.
-    uint8   VolumeIdentifier[32];       // Identification of this volume.
-    uint8   UnusedField[8];             // All zeros.
-    uint32  VolumeSpaceSize[2];         // Number of Logical Blocks in which the volume is recorded
-    uint8   UnusedField2[32];           // All zeroes.
-    uint16  VolumeSetSize[2];           // The size of the set in this logical volume (number of disks).
-    uint16  VolumeSequenceNumber[2];    // The number of this disk in the Volume Set.
-    uint16  LogicalBlockSize[2];        // The size in bytes of a logical block. NB: This means that a logical block on a CD could be something other than 2 KiB!
-    uint32  PathTableSize[2];           // The size in bytes of the path table.
-    uint32  LocationTypeLPathTable;     // LBA location of the path table. The path table pointed to contains only little-endian values.
-    uint32  LocationOptTypeLPathTable;  // LBA location of the optional path table. The path table pointed to contains only little-endian values. Zero means that no optional path table exists.
-    uint32  LocationTypeMPathTable;     // LBA location of the path table. The path table pointed to contains only big-endian values.
-    uint32  LocationOptTypeMPathTable;  // LBA location of the optional path table. The path table pointed to contains only big-endian values. Zero means that no optional path table exists.
-    uint8   DirectoryEntryRootDirectory[34];// Note that this is not an LBA address, it is the actual Directory Record, which contains a single byte Directory Identifier (0x00), hence the fixed 34 byte size.
-    uint8   VolumeSetIdentifier[128];   // Identifier of the volume set of which this volume is a member.
-    uint8   PublisherIdentifier[128];   // The volume publisher. For extended publisher information, the first byte should be 0x5F, followed by the filename of a file in the root directory. If not specified, all bytes should be 0x20.
-    uint8   DataPreparerIdentifier[128];// The identifier of the person(s) who prepared the data for this volume. For extended preparation information, the first byte should be 0x5F, followed by the filename of a file in the root directory. If not specified, all bytes should be 0x20.
-    uint8   ApplicationIdentifier[128]; // Identifies how the data are recorded on this volume. For extended information, the first byte should be 0x5F, followed by the filename of a file in the root directory. If not specified, all bytes should be 0x20.
-    uint8   CopyrightFileIdentifier[37];// Filename of a file in the root directory that contains copyright information for this volume set. If not specified, all bytes should be 0x20.
-    uint8   AbstractFileIdentifier[37]; // Filename of a file in the root directory that contains abstract information for this volume set. If not specified, all bytes should be 0x20.
-    uint8   BibliographicFileIdentifier[37];// Filename of a file in the root directory that contains bibliographic information for this volume set. If not specified, all bytes should be 0x20.
-    uint8   VolumeCreationDateTime[17]; // The date and time of when the volume was created.
-    uint8   VolumeModificationDateTime[17];// The date and time of when the volume was modified.
-    uint8   VolumeExpirationDateTime[17];// The date and time after which this volume is considered to be obsolete. If not specified, then the volume is never considered to be obsolete.
-    uint8   VolumeEffectiveDateTime[17];// The date and time after which the volume may be used. If not specified, the volume may be used immediately.
-    uint8   FileStructureVersion;       // The directory records and path table version (always 0x01).
-    uint8   Unused2;                    // Always 0x00.
-    uint8   ApplicationUsed[512];       // Contents not defined by ISO 9660.
-    uint8   Reserved[653];              // Reserved by ISO.
-    } ISO_9660_Primary_Volume_Descriptor;
+if ((ctx == NULL) || !(uptr->flags & UNIT_ATT))
+    return SCPE_UNATT;
+if (writes && (uptr->flags & UNIT_RO))
+    return SCPE_RO;
+f = sim_fopen (tracefile, "rb");
+if (f == NULL)
+    return sim_messagef (SCPE_OPENERR, "Can't open I/O trace file %s: %s\n", tracefile, strerror (errno));
+if ((fread (hdr, 1, sizeof (hdr), f) != sizeof (hdr)) ||
+    (memcmp (hdr, DK_TRACE_MAGIC, 8) != 0) ||
+    (_sim_disk_get_le (hdr + 8, 4) != DK_TRACE_VERSION)) {
+    fclose (f);
+    return sim_messagef (SCPE_FMT, "%s is not a disk I/O trace\n", tracefile);
+    }
+total = (((t_offset)uptr->capac) * ctx->capac_factor * ((ctx->dptr->flags & DEV_SECTORS) ? 512 : 1));
+_sim_disk_stats_clear (ctx);
+while ((r == SCPE_OK) && (fread (rec, 1, sizeof (rec), f) == sizeof (rec))) {
+    op = (uint32)_sim_disk_get_le (rec + 20, 2);
+    sector_size = (uint32)_sim_disk_get_le (rec + 22, 2);
+    start = (t_offset)_sim_disk_get_le (rec + 8, 8) * sector_size;
+    bytes = (t_offset)_sim_disk_get_le (rec + 16, 4) * sector_size;
+    lba = (t_lba)(start / ctx->sector_size);
+    sects = (t_seccnt)((start + bytes + ctx->sector_size - 1) / ctx->sector_size - lba);
+    if ((op > DK_TRACE_WRITE) || (sects == 0) || (start + bytes > total) ||
+        ((op == DK_TRACE_WRITE) && !writes)) {
+        ++skipped;
+        continue;
+        }
+    if ((size_t)sects * ctx->sector_size > bufsize) {
+        bufsize = (size_t)sects * ctx->sector_size;
+        free (buf);
+        buf = (uint8 *)malloc (bufsize);
+        if (buf == NULL) {
+            r = SCPE_MEM;
+            break;
+            }
+        }
+    if (op == DK_TRACE_WRITE) {
+        memset (buf, 0xE5, (size_t)sects * ctx->sector_size);
+        r = sim_disk_wrsect (uptr, lba, buf, &done, sects);
+        }
+    else
+        r = sim_disk_rdsect (uptr, lba, buf, &done, sects);
+    ++replayed;
+    }
+fclose (f);
+free (buf);
+if (r != SCPE_OK)
+    return sim_messagef (r, "Replay of %s stopped after %u transfers: %s\n", tracefile, replayed, sim_error_text (r));
+sim_messagef (SCPE_OK, "%s: %u transfers replayed, %u skipped\n", tracefile, replayed, skipped);
+return SCPE_OK;
+}
 
-static t_offset get_iso9660_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
+#if defined (DISK_AIO_PIO)
+/* SIMH format transfers while the unit has several I/O threads.  A stdio
+   stream has a single file position, so concurrent requests each use
+   pread/pwrite on the underlying descriptor instead. */
+
+static t_stat _sim_disk_rdsect_pio (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
 {
-DEVICE *dptr;
-t_addr saved_capac;
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-t_addr temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
-uint8 sector_buf[2048];
-ISO_9660_Volume_Descriptor *Desc = (ISO_9660_Volume_Descriptor *)sector_buf;
-uint8 primary_buf[2048];
-ISO_9660_Primary_Volume_Descriptor *Primary = NULL;
-t_lba sectfactor = sizeof (*Desc) / ctx->sector_size;
-t_offset ret_val = (t_offset)-1;
-t_offset cur_pos = 32768;           /* Beyond the boot area of an ISO 9660 image */
-t_seccnt sectsread;
-int read_count = 0;
-
-if ((dptr = find_dev_from_unit (uptr)) == NULL)
-    return ret_val;
-saved_capac = uptr->capac;
-uptr->capac = temp_capac;
-
-while (sim_disk_rdsect(uptr, (t_lba)(sectfactor * cur_pos / sizeof (*Desc)), (uint8 *)Desc, &sectsread, sectfactor) == DKSE_OK) {
-    if ((sectsread != sectfactor)               ||
-        (Desc->Version != 1)                    ||
-        (0 != memcmp (Desc->Identifier, "CD001", sizeof (Desc->Identifier))))
-        break;
-    if (Desc->Type == 1) {  /* Primary Volume Descriptor */
-        Primary = (ISO_9660_Primary_Volume_Descriptor *)primary_buf;
-        *Primary = *(ISO_9660_Primary_Volume_Descriptor *)Desc;
+int fd = fileno (uptr->fileref);
+off_t da = ((off_t)lba) * ctx->sector_size;
+size_t tbc = ((size_t)sects) * ctx->sector_size;
+size_t done = 0;
+ssize_t i;
+
+while (done < tbc) {
+    i = pread (fd, buf + done, tbc - done, da + (off_t)done);
+    if (i < 0) {
+        if (errno == EINTR)
+            continue;
+        if (sectsread)
+            *sectsread = (t_seccnt)((done + ctx->sector_size - 1) / ctx->sector_size);
+        return SCPE_IOERR;
         }
-    cur_pos += sizeof (*Desc);
-    ++read_count;
-    if ((Desc->Type == 255) ||
-        (read_count >= 32)) {
-        ret_val = ctx->container_size;
-        sim_messagef (SCPE_OK, "%s: '%s' Contains an ISO 9660 filesystem\n", sim_uname (uptr), uptr->filename);
-        if (Primary) {
-            char VolId[sizeof (Primary->VolumeIdentifier) + 1];
+    if (i == 0)                                 /* at or past EOF */
+        break;
+    done += (size_t)i;
+    }
+if (done < tbc)                                 /* return 0's beyond EOF */
+    memset (&buf[done], 0, tbc - done);
+if (sectsread)
+    *sectsread = sects;
+return SCPE_OK;
+}
 
-            memcpy (VolId, Primary->VolumeIdentifier, sizeof (Primary->VolumeIdentifier));
-            VolId[sizeof (Primary->VolumeIdentifier)] = '\0';
-            sim_messagef (SCPE_OK, "%s: Volume Identifier: %s   Containing %u %u Byte Sectors\n", sim_uname (uptr), sim_trim_endspc (VolId), (uint32)(ctx->container_size / Primary->LogicalBlockSize[1 - sim_end]), (uint32)Primary->LogicalBlockSize[1 - sim_end]);
-            }
+static t_stat _sim_disk_wrsect_pio (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+int fd = fileno (uptr->fileref);
+off_t da = ((off_t)lba) * ctx->sector_size;
+size_t tbc = ((size_t)sects) * ctx->sector_size;
+size_t done = 0;
+uint8 *tbuf = NULL;
+ssize_t i;
+t_stat r = SCPE_OK;
+
+if (!sim_end && (ctx->xfer_element_size != sizeof (char))) {
+    tbuf = (uint8*) malloc (tbc);
+    if (NULL == tbuf)
+        return SCPE_MEM;
+    sim_buf_copy_swapped (tbuf, buf, ctx->xfer_element_size, tbc / ctx->xfer_element_size);
+    buf = tbuf;
+    }
+while (done < tbc) {
+    i = pwrite (fd, buf + done, tbc - done, da + (off_t)done);
+    if (i < 0) {
+        if (errno == EINTR)
+            continue;
+        r = SCPE_IOERR;
         break;
         }
+    done += (size_t)i;
     }
-uptr->capac = saved_capac;
-if (readonly)
-    *readonly = sim_disk_wrp (uptr) || (ret_val != (t_offset)-1);
-return ret_val;
+free (tbuf);
+if (sectswritten)
+    *sectswritten = (t_seccnt)((done + ctx->sector_size - 1) / ctx->sector_size);
+return r;
 }
+#endif
 
-#pragma pack(push,1)
-/*
- * The first logical block of device cluster 1 is either:
- *      1. MFD label entry (RSTS versions through 7.x)
- *      2. Disk Pack label (RSTS version 8.0 and later)
- */
-typedef struct _RSTS_MFDLABEL {
-    uint16  ml_ulnk;
-    uint16  ml_mbm1;
-    uint16  ml_reserved1;
-    uint16  ml_reserved2;
-    uint16  ml_pcs;
-    uint16  ml_pstat;
-    uint16  ml_packid[2];
-    } RSTS_MFDLABEL;
+/* Read Sectors */
 
-typedef struct _RSTS_PACKLABEL {
-    uint16  pk_mb01;
-    uint16  pk_mbm1;
-    uint16  pk_mdcn;
-    uint16  pk_plvl;
-#define PK_LVL0         0000
-#define PK_LVL11        0401
-#define PK_LVL12        0402
-    uint16  pk_ppcs;
-    uint16  pk_pstat;
-#define PK_UC_NEW       0020000
-    uint16  pk_packid[2];
-    uint16  pk_tapgvn[2];
-    uint16  pk_bckdat;
-    uint16  pk_bcktim;
-    } RSTS_PACKLABEL;
+static t_stat _sim_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+{
+t_offset da;
+uint32 err, tbc;
+size_t i;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-typedef union _RSTS_ROOT {
-    RSTS_MFDLABEL  rt_mfd;
-    RSTS_PACKLABEL rt_pack;
-    uint8          rt_block[512];
-    } RSTS_ROOT;
+sim_debug_unit (ctx->dbit, uptr, "_sim_disk_rdsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
 
-typedef struct _RSTS_MFDBLOCKETTE {
-    uint16  mb_ulnk;
-    uint16  mb_mbm1;
-    uint16  mb_reserved1;
-    uint16  mb_reserved2;
-    uint16  mb_reserved3;
-    uint16  mb_malnk;
-    uint16  mb_lppn;
-    uint16  mb_lid;
-#define MB_ID           0051064
-    } RSTS_MFDBLOCKETTE;
-#define IS_VALID_RSTS_MFD(b) \
-     ((((b)->mb_ulnk == 0) || ((b)->mb_ulnk == 1)) &&                         \
-      ((b)->mb_mbm1 == 0177777) &&                                            \
-      ((b)->mb_reserved1 == 0) &&                                             \
-      ((b)->mb_reserved2 == 0) &&                                             \
-      ((b)->mb_reserved3 == 0) &&                                             \
-      ((b)->mb_lppn == 0177777) &&                                            \
-      ((b)->mb_lid == MB_ID))
+#if defined (DISK_AIO_PIO)
+if (ctx->positional_io)
+    return _sim_disk_rdsect_pio (uptr, lba, buf, sectsread, sects);
+#endif
+da = ((t_offset)lba) * ctx->sector_size;
+tbc = sects * ctx->sector_size;
+if (sectsread)
+    *sectsread = 0;
+while (tbc) {
+    size_t sectbytes;
 
-typedef struct _RSTS_GFDBLOCKETTE {
-    uint16  gb_ulnk;
-    uint16  gb_mbm1;
-    uint16  gb_reserved1;
-    uint16  gb_reserved2;
-    uint16  gb_reserved3;
-    uint16  gb_reserved4;
-    uint16  gb_lppn;
-    uint16  gb_lid;
-#define GB_ID           0026264
-    } RSTS_GFDBLOCKETTE;
-#define IS_VALID_RSTS_GFD(b, g) \
-     ((((b)->gb_ulnk == 0) || ((b)->gb_ulnk == 1)) &&                         \
-      ((b)->gb_mbm1 == 0177777) &&                                            \
-      ((b)->gb_reserved1 == 0) &&                                             \
-      ((b)->gb_reserved2 == 0) &&                                             \
-      ((b)->gb_reserved3 == 0) &&                                             \
-      ((b)->gb_reserved4 == 0) &&                                             \
-      ((b)->gb_lppn == (((g) << 8) | 0377)) &&                                \
-      ((b)->gb_lid == GB_ID))
+    clearerr (uptr->fileref);
+    err = sim_fseeko (uptr->fileref, da, SEEK_SET);          /* set pos */
+    if (err)
+        return SCPE_IOERR;
+    i = sim_fread (buf, 1, tbc, uptr->fileref);
+    if (i < tbc)                 /* fill */
+        memset (&buf[i], 0, tbc-i);
+    if ((i == 0) &&             /* Reading at or past EOF? */
+        feof (uptr->fileref))
+        i = tbc;                /* return 0's which have already been filled in buffer */
+    sectbytes = (i / ctx->sector_size) * ctx->sector_size;
+    if (i > sectbytes)
+        sectbytes += ctx->sector_size;
+    if (sectsread)
+        *sectsread += sectbytes / ctx->sector_size;
+    err = ferror (uptr->fileref);
+    if (err)
+        return SCPE_IOERR;
+    tbc -= sectbytes;
+    if ((tbc == 0) || (i == 0))
+        return SCPE_OK;
+    da += sectbytes;
+    buf += sectbytes;
+    }
+return SCPE_OK;
+}
 
-typedef struct _RSTS_UFDBLOCKETTE {
-    uint16  ub_ulnk;
-    uint16  ub_mbm1;
-    uint16  ub_reserved1;
-    uint16  ub_reserved2;
-    uint16  ub_reserved3;
-    uint16  ub_reserved4;
-    uint16  ub_lppn;
-    uint16  ub_lid;
-#define UB_ID           0102064
-    } RSTS_UFDBLOCKETTE;
-#define IS_VALID_RSTS_UFD(b, g, u) \
-     (((b)->ub_mbm1 == 0177777) &&                                            \
-      ((b)->ub_reserved1 == 0) &&                                             \
-      ((b)->ub_reserved2 == 0) &&                                             \
-      ((b)->ub_reserved3 == 0) &&                                             \
-      ((b)->ub_reserved4 == 0) &&                                             \
-      ((b)->ub_lppn == (((g) << 8) | (u))) &&                                 \
-      ((b)->ub_lid == UB_ID))
+static t_stat _sim_disk_rdsect_container (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+{
+t_stat r;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+uint32 f = DK_GET_FMT (uptr);
+t_seccnt sread = 0;
 
-typedef struct _RSTS_UNAME {
-    uint16  un_ulnk;
-    uint16  un_unam;
-    uint16  un_reserved1;
-    uint16  un_reserved2;
-    uint16  un_ustat;
-    uint16  un_uacnt;
-    uint16  un_uaa;
-    uint16  un_uar;
-    } RSTS_UNAME;
+if ((sects == 1) &&                                     /* Single sector reads */
+    (lba >= (uptr->capac*ctx->capac_factor)/(ctx->sector_size/((ctx->dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)))) {/* beyond the end of the disk */
+    memset (buf, '\0', ctx->sector_size);               /* are bad block management efforts - zero buffer */
+    if (sectsread)
+        *sectsread = 1;
+    return SCPE_OK;                                     /* return success */
+    }
 
-typedef struct _RSTS_FNAME {
-    uint16  fn_ulnk;
-    uint16  fn_unam[3];
-    uint16  fn_ustat;
-    uint16  fn_uacnt;
-    uint16  fn_uaa;
-    uint16  fn_uar;
-    } RSTS_FNAME;
+if (_sim_disk_mmap_rdsect (uptr, lba, buf, sectsread, sects))
+    return SCPE_OK;
 
-typedef struct _RSTS_ACNT {
-    uint16  ac_ulnk;
-    uint16  ac_udla;
-    uint16  ac_usiz;
-    uint16  ac_udc;
-    uint16  ac_utc;
-    uint16  ac_urts[2];
-    uint16  ac_uclus;
-    } RSTS_ACNT;
+if ((0 == (ctx->sector_size & (ctx->storage_sector_size - 1))) ||   /* Sector Aligned & whole sector transfers */
+    ((0 == ((lba*ctx->sector_size) & (ctx->storage_sector_size - 1))) &&
+     (0 == ((sects*ctx->sector_size) & (ctx->storage_sector_size - 1)))) ||
+    (f == DKUF_F_STD) || (f == DKUF_F_VHD) || (f == DKUF_F_DDI)) {  /* or SIMH, VHD or DDI formats */
+    switch (f) {                                        /* case on format */
+        case DKUF_F_STD:                                /* SIMH format */
+            r = _sim_disk_rdsect (uptr, lba, buf, &sread, sects);
+            break;
+        case DKUF_F_VHD:                                /* VHD format */
+            COMMIT_LOCK (ctx);
+            r = sim_vhd_disk_rdsect (uptr, lba, buf, &sread, sects);
+            COMMIT_UNLOCK (ctx);
+            break;
+        case DKUF_F_DDI:                                /* DDI format */
+            r = sim_ddi_disk_rdsect (uptr, lba, buf, &sread, sects);
+            break;
+        case DKUF_F_RAW:                                /* Raw Physical Disk Access */
+            r = sim_os_disk_rdsect (uptr, lba, buf, &sread, sects);
+            break;
+        default:
+            return SCPE_NOFNC;
+        }
+    if (sectsread)
+        *sectsread = sread;
+    sim_buf_swap_data (buf, ctx->xfer_element_size, (sread * ctx->sector_size) / ctx->xfer_element_size);
+    return r;
+    }
+else { /* Unaligned and/or partial sector transfers in RAW mode */
+    size_t tbufsize = sects * ctx->sector_size + 2 * ctx->storage_sector_size;
+    uint8 *tbuf = (uint8*) malloc (tbufsize);
+    t_offset ssaddr = (lba * (t_offset)ctx->sector_size) & ~(t_offset)(ctx->storage_sector_size -1);
+    uint32 soffset = (uint32)((lba * (t_offset)ctx->sector_size) - ssaddr);
+    uint32 bytesread;
 
-typedef struct _RSTS_RETR {
-    uint16  rt_ulnk;
-    uint16  rt_uent[7];
-#define RT_ENTRIES      7
-    } RSTS_RETR;
+    if (sectsread)
+        *sectsread = 0;
+    if (tbuf == NULL)
+        return SCPE_MEM;
+    r = sim_os_disk_read (uptr, ssaddr, tbuf, &bytesread, tbufsize & ~(ctx->storage_sector_size - 1));
+    sim_buf_swap_data (tbuf + soffset, ctx->xfer_element_size, (bytesread - soffset) / ctx->xfer_element_size);
+    memcpy (buf, tbuf + soffset, sects * ctx->sector_size);
+    if (sectsread) {
+        *sectsread = (bytesread - soffset) / ctx->sector_size;
+        if (*sectsread > sects)
+            *sectsread = sects;
+        }
+    free (tbuf);
+    return r;
+    }
+}
 
-typedef struct _RSTS_DCMAP {
-    uint16  dc_clus;
-#define DC_MASK         0077777
-    uint16  dc_map[7];
-    }  RSTS_DCMAP;
+t_stat sim_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+{
+return _sim_disk_rdsect_at (uptr, lba, buf, sectsread, sects, sim_gtime ());
+}
 
-/*
- * Directory link definitions
- */
-#define DL_USE          0000001
-#define DL_BAD          0000002
-#define DL_CHE          0000004
-#define DL_CLN          0000010
-#define DL_ENO          0000760
-#define DL_CLO          0007000
-#define DL_BLO          0170000
+/* A transfer made for a queued request is traced with the simulated
+   time the request was made, rather than whatever time it is when an
+   I/O thread gets to it */
 
-#define DLSH_ENO         4
-#define DLSH_CLO         9
-#define DLSH_BLO        12
+static t_stat _sim_disk_rdsect_at (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, double issued)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct timespec start;
+t_stat r;
 
-#define BLOCKETTE_SZ    (8 * sizeof(uint16))
-#define MAP_OFFSET      (31 * BLOCKETTE_SZ)
+sim_debug_unit (ctx->dbit, uptr, "sim_disk_rdsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
 
-#define SATT0           0073374
-#define SATT1           0076400
-#define SATT2           0075273
+_sim_disk_stats_start (&start);
+r = _sim_disk_rdsect_cache (uptr, lba, buf, sectsread, sects);
+_sim_disk_stats (uptr, DK_TRACE_READ, lba, sects, &start, issued);
+return r;
+}
 
-#pragma pack(pop)
+/* Read through the sector cache, if the unit has one */
 
-typedef struct _rstsContext {
-    UNIT        *uptr;
-    int         dcshift;
-    int         pcs;
-    char        packid[8];
-    t_seccnt    sects;
-    RSTS_DCMAP  map;
-} rstsContext;
+static t_stat _sim_disk_rdsect_cache (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_seccnt sread = 0;
+t_stat r = SCPE_OK;
 
-static char rad50[] = " ABCDEFGHIJKLMNOPQRSTUVWXYZ$.%0123456789";
+if (ctx->cache == NULL)
+    return _sim_disk_rdsect_container (uptr, lba, buf, sectsread, sects);
+if (_sim_disk_cache_read (ctx, lba, buf, sects))
+    sread = sects;
+else {
+    r = _sim_disk_rdsect_container (uptr, lba, buf, &sread, sects);
+    _sim_disk_cache_fill (uptr, lba, buf, sread, sects);
+    }
+if (sectsread)
+    *sectsread = sread;
+return r;
+}
 
-static void r50Asc(uint16 val, char *buf)
+t_stat sim_disk_rdsect_a (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, DISK_PCALLBACK callback)
 {
-buf[2] = rad50[val % 050];
-val /= 050;
-buf[1] = rad50[val % 050];
-buf[0] = rad50[val / 050];
+t_stat r = SCPE_OK;
+AIO_CALLSETUP
+    r = sim_disk_rdsect (uptr, lba, buf, sectsread, sects);
+AIO_CALL(DOP_RSEC, lba, buf, sectsread, sects, callback);
+return r;
 }
 
-static t_stat rstsValidateClusterSize(uint16 size, uint16 minSize)
+/* Queued read: like sim_disk_rdsect_a, but any number of requests may be
+   outstanding on a unit, and the callback gets the caller's context for
+   the request it completes.  Callbacks run in the simulator thread, ahead
+   of the unit's service routine.  When the unit isn't asynchronous the
+   transfer is done, and the callback called, before this returns. */
+
+t_stat sim_disk_rdsect_q (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, DISK_QCALLBACK callback, void *arg)
 {
-int i;
+t_stat r;
+#if defined (SIM_ASYNCH_IO)
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-/*
- * Check that the cluster size is a power of 2 and greater than or equal
- * to some location dependent value.
- */
-if (size >= minSize)
-    for (i = 0; i < 16; i++)
-        if (size == (1 << i))
-            return SCPE_OK;
+if (ctx && ctx->asynch_io && callback)
+    return _disk_aio_queue (uptr, DOP_RSEC, lba, buf, NULL, 0, sectsread, sects, NULL, callback, arg);
+#endif
+r = sim_disk_rdsect (uptr, lba, buf, sectsread, sects);
+if (callback)
+    callback (uptr, r, arg);
+return r;
+}
 
-return SCPE_IOERR;
+/* Zero sector detection
+
+   A transfer which only contains zeros needn't occupy storage in the
+   container.  SIMH format files, and RAW containers which are plain
+   files, get a hole punched where the data would go when the host
+   supports that.  VHD containers leave (or make) the block unallocated
+   and DDI containers don't store a chunk for it. */
+
+static t_bool _sim_disk_is_zero (const uint8 *buf, size_t len)
+{
+const uint8 *end = buf + len;
+
+while ((buf < end) && (*buf == 0))
+    ++buf;
+return (buf == end);
 }
 
-static t_stat rstsReadBlock(rstsContext *context, uint16 cluster, uint16 block, void *buf)
+/* Deallocate a byte range of a plain file.  Only ranges within the file
+   are punched, so a write of zeros which extends a file still sets its
+   size (and allocates the storage of a newly created container). */
+
+static t_bool _sim_disk_punch_fd (int fd, t_offset addr, t_offset bytes)
 {
-t_lba blk = (cluster << context->dcshift) + block;
-t_seccnt sects_read;
+#if defined (DISK_PUNCH_HOLE)
+struct stat statb;
 
-if ((sim_disk_rdsect(context->uptr, blk * context->sects, (uint8 *)buf, &sects_read, context->sects) == SCPE_OK) &&
-    (sects_read == context->sects))
-    return SCPE_OK;
+if ((fstat (fd, &statb) != 0) || !S_ISREG (statb.st_mode) ||
+    (addr + bytes > (t_offset)statb.st_size))
+    return FALSE;
+return (0 == fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)addr, (off_t)bytes));
+#else
+return FALSE;
+#endif
+}
 
-return SCPE_IOERR;
+static t_bool _sim_disk_punch_file (FILE *f, t_offset addr, t_offset bytes)
+{
+#if defined (DISK_PUNCH_HOLE)
+if (fflush (f) != 0)
+    return FALSE;
+return _sim_disk_punch_fd (fileno (f), addr, bytes);
+#else
+return FALSE;
+#endif
 }
 
-static t_stat rstsReadBlockette(rstsContext *context, uint16 link, void *buf)
+static t_bool _sim_disk_punch_hole (UNIT *uptr, t_lba lba, t_seccnt sects)
 {
-uint16 block = (link & DL_BLO) >> DLSH_BLO;
-uint16 dcn = (link & DL_CLO) >> DLSH_CLO;
-uint16 blockette = (link & DL_ENO) >> DLSH_ENO;
-uint8 temp[512];
+#if defined (DISK_PUNCH_HOLE)
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_offset addr = ((t_offset)lba) * ctx->sector_size;
+t_offset bytes = ((t_offset)sects) * ctx->sector_size;
 
-if ((dcn != 7) && (blockette != 31) &&
-    (block <= (context->map.dc_clus & DC_MASK))) {
-    if (rstsReadBlock(context, context->map.dc_map[dcn], block, temp) == SCPE_OK) {
-        memcpy(buf, &temp[blockette * BLOCKETTE_SZ], BLOCKETTE_SZ);
-        return SCPE_OK;
-        }
+switch (DK_GET_FMT (uptr)) {
+    case DKUF_F_STD:
+        return _sim_disk_punch_file (uptr->fileref, addr, bytes);
+    case DKUF_F_RAW:                                /* raw access keeps a descriptor */
+        return _sim_disk_punch_fd ((int)((long)uptr->fileref), addr, bytes);
     }
-return SCPE_IOERR;
+#endif
+return FALSE;
 }
 
-static t_stat rstsFind01UFD(rstsContext *context, uint16 *ufd, uint16 *level)
+/* Write Sectors */
+
+static t_stat _sim_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
 {
-uint16 dcs = 1 << context->dcshift;
-RSTS_ROOT root;
-uint16 buf[256];
+t_offset da;
+uint32 err, tbc;
+size_t i;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-if (rstsReadBlock(context, 1, 0, &root) == SCPE_OK) {
-    /*
-     * First validate fields which are common to both the MFD label and
-     * Pack label - we'll use Pack label offsets here.
-     */
-    if ((root.rt_pack.pk_mbm1 == 0177777) &&
-        (rstsValidateClusterSize(root.rt_pack.pk_ppcs, dcs) == SCPE_OK)) {
-        char ch, *tmp = &context->packid[1];
-        uint16 mfd, gfd;
+sim_debug_unit (ctx->dbit, uptr, "_sim_disk_wrsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
 
-        context->pcs = root.rt_pack.pk_ppcs;
+#if defined (DISK_AIO_PIO)
+if (ctx->positional_io)
+    return _sim_disk_wrsect_pio (uptr, lba, buf, sectswritten, sects);
+#endif
+da = ((t_offset)lba) * ctx->sector_size;
+tbc = sects * ctx->sector_size;
+if (sectswritten)
+    *sectswritten = 0;
+err = sim_fseeko (uptr->fileref, da, SEEK_SET);          /* set pos */
+if (err)
+    return SCPE_IOERR;
+i = sim_fwrite (buf, ctx->xfer_element_size, tbc/ctx->xfer_element_size, uptr->fileref);
+if (sectswritten)
+    *sectswritten += (t_seccnt)((i * ctx->xfer_element_size + ctx->sector_size - 1)/ctx->sector_size);
+err = ferror (uptr->fileref);
+if (err)
+    return SCPE_IOERR;
+return SCPE_OK;
+}
 
-        r50Asc(root.rt_pack.pk_packid[0], &context->packid[0]);
-        r50Asc(root.rt_pack.pk_packid[1], &context->packid[3]);
-        context->packid[6] = '\0';
+t_stat sim_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+{
+return _sim_disk_wrsect_at (uptr, lba, buf, sectswritten, sects, sim_gtime ());
+}
 
-        /*
-         * The Pack ID must consist of 1 - 6 alphanumeric characters
-         * padded at the end with spaces.
-         */
-        if (!isalnum(context->packid[0]))
-            return SCPE_IOERR;
+static t_stat _sim_disk_wrsect_at (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects, double issued)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct timespec start;
+t_stat r;
 
-        while ((ch = *tmp++) != 0) {
-            if (!isalnum(ch)) {
-                if (ch != ' ')
-                    return SCPE_IOERR;
+sim_debug_unit (ctx->dbit, uptr, "sim_disk_wrsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
 
-                while (*tmp)
-                    if (*tmp++ != ' ')
-                        return SCPE_IOERR;
-                break;
-                }
-            }
+_sim_disk_stats_start (&start);
+r = _sim_disk_wrsect_cache (uptr, lba, buf, sectswritten, sects);
+_sim_disk_stats (uptr, DK_TRACE_WRITE, lba, sects, &start, issued);
+return r;
+}
 
-        /*
-         * Determine the pack revision level and, therefore, the path to
-         * [0,1]satt.sys which will allow us to determine the size of the
-         * pack used by RSTS.
-         */
-        if ((root.rt_pack.pk_pstat & PK_UC_NEW) == 0) {
-            uint16 link = root.rt_mfd.ml_ulnk;
-            RSTS_UNAME uname;
+/* Write through the sector cache, if the unit has one */
 
-            /*
-             * Old format used by RSTS up through V07.x
-             */
-            if (dcs > 16)
-                return SCPE_IOERR;
-
-            *level = PK_LVL0;
+static t_stat _sim_disk_wrsect_cache (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_stat r = SCPE_OK;
+t_seccnt written = 0;
 
-            memcpy(&context->map, &root.rt_block[MAP_OFFSET], BLOCKETTE_SZ);
+if (sectswritten)
+    *sectswritten = 0;
+if (uptr->dynflags & UNIT_DISK_CHK) {
+    DEVICE *dptr = find_dev_from_unit (uptr);
+    uint32 capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* capacity units (quadword: 8, word: 2, byte: 1) */
+    t_lba total_sectors = (t_lba)((uptr->capac*capac_factor)/(ctx->sector_size/((dptr->flags & DEV_SECTORS) ? 512 : 1)));
+    t_lba sect;
 
-            /*
-             * Scan the MFD name entries looking for [0,1]. Note there will
-             * always be at least 1 entry.
-             */
-            do {
-                if (rstsReadBlockette(context, link, &uname) != SCPE_OK)
-                    break;
+    for (sect = 0; sect < sects; sect++) {
+        t_lba offset;
+        t_bool sect_error = FALSE;
 
-                if (uname.un_unam == ((0 << 8) | 1)) {
-                    *ufd = uname.un_uar;
-                    return SCPE_OK;
-                    }
-                } while ((link = uname.un_ulnk) != 0);
+        for (offset = 0; offset < ctx->sector_size; offset += sizeof(uint32)) {
+            if (*((uint32 *)&buf[sect*ctx->sector_size + offset]) != (uint32)(lba + sect)) {
+                sect_error = TRUE;
+                break;
+                }
             }
-        else {
-            /*
-             * New format used by RSTS V08 and later
-             */
-            switch (root.rt_pack.pk_plvl) {
-                case PK_LVL11:
-                    if (dcs > 16)
-                        return SCPE_IOERR;
-                    break;
+        if (sect_error) {
+            uint32 save_dctrl = dptr->dctrl;
+            FILE *save_sim_deb = sim_deb;
 
-                case PK_LVL12:
-                    if (dcs > 64)
-                        return SCPE_IOERR;
-                    break;
+            sim_printf ("\n%s: Write Address Verification Error on lbn %d(0x%X) of %d(0x%X).\n", sim_uname (uptr), (int)(lba+sect), (int)(lba+sect), (int)total_sectors, (int)total_sectors);
+            dptr->dctrl = 0xFFFFFFFF;
+            sim_deb = save_sim_deb ? save_sim_deb : stdout;
+            sim_disk_data_trace (uptr, buf+sect*ctx->sector_size, lba+sect, ctx->sector_size,    "Found", TRUE, 1);
+            dptr->dctrl = save_dctrl;
+            sim_deb = save_sim_deb;
+            }
+        }
+    }
+if (ctx->cache == NULL)
+    return _sim_disk_wrsect_container (uptr, lba, buf, sectswritten, sects);
+if (_sim_disk_cache_write (uptr, lba, buf, sects, sects, TRUE))
+    written = sects;                                    /* held for write-back */
+else {
+    r = _sim_disk_wrsect_container (uptr, lba, buf, &written, sects);
+    _sim_disk_cache_write (uptr, lba, buf, written, sects, FALSE);
+    }
+if (sectswritten)
+    *sectswritten = written;
+return r;
+}
 
-                default:
-                    return SCPE_IOERR;
-                }
-            *level = root.rt_pack.pk_plvl;
+static t_stat _sim_disk_wrsect_container (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+uint32 f = DK_GET_FMT (uptr);
+t_stat r;
+uint8 *tbuf = NULL;
+t_seccnt written = 0;
 
-            mfd = root.rt_pack.pk_mdcn;
+if (sectswritten)
+    *sectswritten = 0;
+#if defined (DISK_PUNCH_HOLE)
+if (((f == DKUF_F_STD) || (f == DKUF_F_RAW)) &&
+    _sim_disk_is_zero (buf, ((size_t)sects) * ctx->sector_size) &&
+    _sim_disk_punch_hole (uptr, lba, sects)) {          /* zeros need no storage */
+    sim_debug_unit (ctx->dbit, uptr, "_sim_disk_wrsect_container(unit=%d, lba=0x%X, sects=%d) deallocated\n", (int)(uptr - ctx->dptr->units), lba, sects);
+    if (sectswritten)
+        *sectswritten = sects;
+    return SCPE_OK;
+    }
+#endif
+if (_sim_disk_mmap_wrsect (uptr, lba, buf, sectswritten, sects))
+    return SCPE_OK;
+switch (f) {                                            /* case on format */
+    case DKUF_F_STD:                                    /* SIMH format */
+        r = _sim_disk_wrsect (uptr, lba, buf, &written, sects);
+        break;
+    case DKUF_F_VHD:                                    /* VHD format */
+    case DKUF_F_DDI:                                    /* DDI format */
+        if (!sim_end && (ctx->xfer_element_size != sizeof (char))) {
+            tbuf = (uint8*) malloc (sects * ctx->sector_size);
+            if (NULL == tbuf)
+                return SCPE_MEM;
+            sim_buf_copy_swapped (tbuf, buf, ctx->xfer_element_size, (sects * ctx->sector_size) / ctx->xfer_element_size);
+            buf = tbuf;
+            }
+        if (f == DKUF_F_VHD) {
+            COMMIT_LOCK (ctx);
+            r = sim_vhd_disk_wrsect  (uptr, lba, buf, &written, sects);
+            if (ctx->commit && (written > 0) && (ctx->commit->status == SCPE_OK))
+                ctx->commit->status = sim_vhd_disk_write (ctx->commit->parent, lba, buf, written, ctx->sector_size);
+            COMMIT_UNLOCK (ctx);
+            }
+        else
+            r = sim_ddi_disk_wrsect  (uptr, lba, buf, &written, sects);
+        break;
+    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
+        break;                                          /* handle below */
+    default:
+        return SCPE_NOFNC;
+    }
+if (f == DKUF_F_RAW) {
+    if ((0 == (ctx->sector_size & (ctx->storage_sector_size - 1))) ||   /* Sector Aligned & whole sector transfers */
+        ((0 == ((lba*ctx->sector_size) & (ctx->storage_sector_size - 1))) &&
+         (0 == ((sects*ctx->sector_size) & (ctx->storage_sector_size - 1))))) {
 
-            if (rstsReadBlock(context, mfd, 0, buf) == SCPE_OK) {
-                if (IS_VALID_RSTS_MFD((RSTS_MFDBLOCKETTE *)buf)) {
-                    if (rstsReadBlock(context, mfd, 1, buf) == SCPE_OK)
-                        if ((gfd = buf[0]) != 0)
-                            if (rstsReadBlock(context, gfd, 0, buf) == SCPE_OK)
-                                if (IS_VALID_RSTS_GFD((RSTS_GFDBLOCKETTE *)buf, 0)) {
-                                    if (rstsReadBlock(context, gfd, 1, buf) == SCPE_OK)
-                                        if ((*ufd = buf[1]) != 0)
-                                            return SCPE_OK;
-                                    }
-                    }
-                }
+        if (!sim_end && (ctx->xfer_element_size != sizeof (char))) {
+            tbuf = (uint8*) malloc (sects * ctx->sector_size);
+            if (NULL == tbuf)
+                return SCPE_MEM;
+            sim_buf_copy_swapped (tbuf, buf, ctx->xfer_element_size, (sects * ctx->sector_size) / ctx->xfer_element_size);
+            buf = tbuf;
             }
+
+        r = sim_os_disk_wrsect (uptr, lba, buf, &written, sects);
+        }
+    else { /* Unaligned and/or partial sector transfers in RAW mode */
+        size_t tbufsize = sects * ctx->sector_size + 2 * ctx->storage_sector_size;
+        t_offset ssaddr = (lba * (t_offset)ctx->sector_size) & ~(t_offset)(ctx->storage_sector_size -1);
+        t_offset sladdr = ((lba + sects) * (t_offset)ctx->sector_size) & ~(t_offset)(ctx->storage_sector_size -1);
+        uint32 soffset = (uint32)((lba * (t_offset)ctx->sector_size) - ssaddr);
+        uint32 byteswritten;
+
+        tbuf = (uint8*) malloc (tbufsize);
+        if (tbuf == NULL)
+            return SCPE_MEM;
+        /* Partial Sector writes require a read-modify-write sequence for the partial sectors */
+        if (soffset)
+            sim_os_disk_read (uptr, ssaddr, tbuf, NULL, ctx->storage_sector_size);
+        sim_os_disk_read (uptr, sladdr, tbuf + (size_t)(sladdr - ssaddr), NULL, ctx->storage_sector_size);
+        sim_buf_copy_swapped (tbuf + soffset,
+                              buf, ctx->xfer_element_size, (sects * ctx->sector_size) / ctx->xfer_element_size);
+        r = sim_os_disk_write (uptr, ssaddr, tbuf, &byteswritten, (soffset + (sects * ctx->sector_size) + ctx->storage_sector_size - 1) & ~(ctx->storage_sector_size - 1));
+        written = byteswritten / ctx->sector_size;
+        if (written > sects)
+            written = sects;
         }
     }
-return SCPE_IOERR;
+free (tbuf);
+if (sectswritten)
+    *sectswritten = written;
+if (written > 0) {
+    t_offset da = ((t_offset)lba) * ctx->sector_size;
+    t_offset end_write = da + (written * ctx->sector_size);
+
+    DISK_LOCK (ctx);
+    if (ctx->highwater < end_write)
+        ctx->highwater = end_write;
+    DISK_UNLOCK (ctx);
+    }
+return r;
 }
 
-static t_stat rstsLoadAndScanSATT(rstsContext *context, uint16 uaa, uint16 uar, t_offset *result)
+t_stat sim_disk_wrsect_a (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects, DISK_PCALLBACK callback)
 {
-uint8 bitmap[8192];
-int i, j;
-RSTS_ACNT acnt;
-RSTS_RETR retr;
-
-if (uar != 0) {
-    if (rstsReadBlockette(context, uaa, &acnt) == SCPE_OK) {
-        uint16 blocks = acnt.ac_usiz;
-        uint16 offset = 0;
+t_stat r = SCPE_OK;
+AIO_CALLSETUP
+    r =  sim_disk_wrsect (uptr, lba, buf, sectswritten, sects);
+AIO_CALL(DOP_WSEC, lba, buf, sectswritten, sects, callback);
+return r;
+}
 
-        if ((rstsValidateClusterSize(acnt.ac_uclus, context->pcs) != SCPE_OK) ||
-            (blocks > 16))
-            return SCPE_IOERR;
+/* Queued write, see sim_disk_rdsect_q.  A write and any other request
+   for the same sectors are performed in the order they were issued. */
 
-        memset(bitmap, 0xFF, sizeof(bitmap));
+t_stat sim_disk_wrsect_q (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects, DISK_QCALLBACK callback, void *arg)
+{
+t_stat r;
+#if defined (SIM_ASYNCH_IO)
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-        if (blocks != 0) {
-            do {
-                int i, j;
-                uint16 fcl;
+if (ctx && ctx->asynch_io && callback)
+    return _disk_aio_queue (uptr, DOP_WSEC, lba, buf, NULL, 0, sectswritten, sects, NULL, callback, arg);
+#endif
+r = sim_disk_wrsect (uptr, lba, buf, sectswritten, sects);
+if (callback)
+    callback (uptr, r, arg);
+return r;
+}
 
-                if (rstsReadBlockette(context, uar, &retr) != SCPE_OK)
-                    return SCPE_IOERR;
+/* Scatter/gather transfers
 
-                for (i = 0; i < RT_ENTRIES; i++) {
-                    if ((fcl = retr.rt_uent[i]) == 0)
-                        goto scanBitmap;
+   A controller which can resolve a guest buffer into host memory through
+   its bus map describes the buffer as a list of segments, and sectors
+   move directly between the container and those segments instead of
+   through an intermediate buffer.  Runs of whole sectors within a segment
+   are transferred in place; only a sector which straddles segments goes
+   through a one sector bounce buffer.  When the segments hold fewer bytes
+   than the transfer, a read drops the rest and a write pads with zeros.
+   Segment boundaries must be multiples of the unit's transfer element
+   size. */
 
-                    for (j = 0; j < acnt.ac_uclus; j++) {
-                        if ((blocks == 0) || (offset >= sizeof(bitmap)))
-                            goto scanBitmap;
+static void _sim_disk_sg_copy (const DISK_SEG *segs, uint32 nsegs, uint32 *seg, size_t *off,
+                               uint8 *buf, size_t len, t_bool to_segs)
+{
+size_t part;
 
-                        if (rstsReadBlock(context, fcl, j, &bitmap[offset]) != SCPE_OK)
-                            return SCPE_IOERR;
+while (len > 0) {
+    while ((*seg < nsegs) && (*off >= segs[*seg].size)) {
+        ++*seg;
+        *off = 0;
+        }
+    if (*seg >= nsegs) {                                /* past the segments */
+        if (!to_segs)
+            memset (buf, 0, len);
+        return;
+        }
+    part = segs[*seg].size - *off;
+    if (part > len)
+        part = len;
+    if (to_segs)
+        memcpy (segs[*seg].buf + *off, buf, part);
+    else
+        memcpy (buf, segs[*seg].buf + *off, part);
+    *off += part;
+    buf += part;
+    len -= part;
+    }
+}
 
-                        offset += 512;
-                        blocks--;
-                        }
-                    }
-                } while ((uar = retr.rt_ulnk) != 0);
+static t_stat _sim_disk_xfer_sg (UNIT *uptr, t_bool write, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectsdone, t_seccnt sects)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+size_t ssize = ctx->sector_size;
+uint8 *bounce = NULL;
+uint32 seg = 0;
+size_t off = 0;
+t_seccnt done = 0, count, n;
+t_stat r = SCPE_OK;
 
-        scanBitmap:
-            for (i = sizeof(bitmap) - 1; i != 0; i--)
-                if (bitmap[i] != 0xFF) {
-                    blocks = i * 8;
-                    for (j = 7; j >= 0; j--)
-                        if ((bitmap[i] & (1 << j)) == 0) {
-                            blocks += j + 1;
-                            goto scanDone;
-                            }
-                    }
-        scanDone:
-            *result = (t_offset)(blocks + 1) * context->pcs;
-            return SCPE_OK;
-            }
+while ((done < sects) && (r == SCPE_OK)) {
+    while ((seg < nsegs) && (off >= segs[seg].size)) {
+        ++seg;
+        off = 0;
+        }
+    count = (seg < nsegs) ? (t_seccnt)((segs[seg].size - off) / ssize) : 0;
+    if (count > sects - done)
+        count = sects - done;
+    n = 0;
+    if (count > 0) {                                    /* whole sectors in place */
+        if (write)
+            r = _sim_disk_wrsect_cache (uptr, lba + done, segs[seg].buf + off, &n, count);
+        else
+            r = _sim_disk_rdsect_cache (uptr, lba + done, segs[seg].buf + off, &n, count);
+        off += n * ssize;
+        done += n;
+        if (n < count)
+            break;
+        continue;
+        }
+    if ((bounce == NULL) &&                             /* a sector split across segments */
+        (NULL == (bounce = (uint8 *)malloc (ssize)))) {
+        r = SCPE_MEM;
+        break;
+        }
+    if (write) {
+        _sim_disk_sg_copy (segs, nsegs, &seg, &off, bounce, ssize, FALSE);
+        r = _sim_disk_wrsect_cache (uptr, lba + done, bounce, &n, 1);
+        }
+    else {
+        r = _sim_disk_rdsect_cache (uptr, lba + done, bounce, &n, 1);
+        if (n == 1)
+            _sim_disk_sg_copy (segs, nsegs, &seg, &off, bounce, ssize, TRUE);
         }
+    if (n < 1)
+        break;
+    ++done;
     }
-return SCPE_IOERR;
+free (bounce);
+if (sectsdone)
+    *sectsdone = done;
+return r;
 }
 
-static t_offset get_rsts_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
+t_stat sim_disk_rdsect_sg (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectsread, t_seccnt sects)
+{
+return _sim_disk_rdsect_sg_at (uptr, lba, segs, nsegs, sectsread, sects, sim_gtime ());
+}
+
+static t_stat _sim_disk_rdsect_sg_at (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectsread, t_seccnt sects, double issued)
 {
-DEVICE *dptr;
-t_addr saved_capac;
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-t_addr temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
-uint8 buf[512];
-t_offset ret_val = (t_offset)-1;
-rstsContext context;
+struct timespec start;
+t_stat r;
 
-if ((dptr = find_dev_from_unit (uptr)) == NULL)
-    return ret_val;
+sim_debug_unit (ctx->dbit, uptr, "sim_disk_rdsect_sg(unit=%d, lba=0x%X, sects=%d, segments=%u)\n", (int)(uptr - ctx->dptr->units), lba, sects, nsegs);
 
-saved_capac = uptr->capac;
-uptr->capac = temp_capac;
+_sim_disk_stats_start (&start);
+r = _sim_disk_xfer_sg (uptr, FALSE, lba, segs, nsegs, sectsread, sects);
+_sim_disk_stats (uptr, DK_TRACE_READ, lba, sects, &start, issued);
+return r;
+}
 
-context.uptr = uptr;
-context.sects = 512 / ctx->sector_size;
+t_stat sim_disk_wrsect_sg (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectswritten, t_seccnt sects)
+{
+return _sim_disk_wrsect_sg_at (uptr, lba, segs, nsegs, sectswritten, sects, sim_gtime ());
+}
 
-/*
- * Check all possible device cluster sizes
- */
-for (context.dcshift = 0; context.dcshift < 8; context.dcshift++) {
-    uint16 ufd, level;
+static t_stat _sim_disk_wrsect_sg_at (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectswritten, t_seccnt sects, double issued)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct timespec start;
+t_stat r;
 
-    /*
-     * We need to find [0,1]SATT.SYS to compute the actual size of the disk.
-     * First find the DCN of the [0,1] UFD.
-     */
-    if (rstsFind01UFD(&context, &ufd, &level) == SCPE_OK) {
-        if (rstsReadBlock(&context, ufd, 0, buf) == SCPE_OK) {
-            if (IS_VALID_RSTS_UFD((RSTS_UFDBLOCKETTE *)buf, 0, 1)) {
-                uint16 link = ((RSTS_UFDBLOCKETTE *)buf)->ub_ulnk;
-                RSTS_FNAME fname;
+sim_debug_unit (ctx->dbit, uptr, "sim_disk_wrsect_sg(unit=%d, lba=0x%X, sects=%d, segments=%u)\n", (int)(uptr - ctx->dptr->units), lba, sects, nsegs);
 
-                memcpy(&context.map, &buf[MAP_OFFSET], BLOCKETTE_SZ);
+_sim_disk_stats_start (&start);
+r = _sim_disk_xfer_sg (uptr, TRUE, lba, segs, nsegs, sectswritten, sects);
+_sim_disk_stats (uptr, DK_TRACE_WRITE, lba, sects, &start, issued);
+return r;
+}
 
-                /*
-                 * Scan the UFD looking for SATT.SYS - the allocation bitmap
-                 */
-                do {
-                    if (rstsReadBlockette(&context, link, &fname) != SCPE_OK)
-                        break;
+/* Asynchronous scatter/gather: the segment list (and the memory it
+   describes) must remain valid until the callback is called. */
 
-                    if ((fname.fn_unam[0] == SATT0) &&
-                        (fname.fn_unam[1] == SATT1) &&
-                        (fname.fn_unam[2] == SATT2)) {
-                        if (rstsLoadAndScanSATT(&context, fname.fn_uaa, fname.fn_uar, &ret_val) == SCPE_OK) {
-                            const char *fmt = "???";
+t_stat sim_disk_rdsect_sg_a (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectsread, t_seccnt sects, DISK_PCALLBACK callback)
+{
+t_stat r;
+#if defined (SIM_ASYNCH_IO)
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-                            ret_val *= 512;
+if (ctx->asynch_io && callback)
+    return _disk_aio_queue (uptr, DOP_RSG, lba, NULL, segs, nsegs, sectsread, sects, callback, NULL, NULL);
+#endif
+r = sim_disk_rdsect_sg (uptr, lba, segs, nsegs, sectsread, sects);
+if (callback)
+    callback (uptr, r);
+return r;
+}
 
-                            switch (level) {
-                                case PK_LVL0:
-                                    fmt = "0.0";
-                                    break;
+t_stat sim_disk_wrsect_sg_a (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectswritten, t_seccnt sects, DISK_PCALLBACK callback)
+{
+t_stat r;
+#if defined (SIM_ASYNCH_IO)
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-                                case PK_LVL11:
-                                    fmt = "1.1";
-                                    break;
+if (ctx->asynch_io && callback)
+    return _disk_aio_queue (uptr, DOP_WSG, lba, NULL, segs, nsegs, sectswritten, sects, callback, NULL, NULL);
+#endif
+r = sim_disk_wrsect_sg (uptr, lba, segs, nsegs, sectswritten, sects);
+if (callback)
+    callback (uptr, r);
+return r;
+}
 
-                                case PK_LVL12:
-                                    fmt = "1.2";
-                                    break;
-                                }
+t_stat sim_disk_unload (UNIT *uptr)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-                            sim_messagef(SCPE_OK, "%s: '%s' Contains a RSTS File system\n", sim_uname (uptr), uptr->filename);
-                            sim_messagef(SCPE_OK, "%s: Pack ID: %6.6s Revision Level: %3s Pack Clustersize: %d\n",
-                                                                  sim_uname (uptr), context.packid, fmt, context.pcs);
-                            sim_messagef(SCPE_OK, "%s: Last Unallocated Sector In File System: %u\n", sim_uname (uptr), (uint32)((ret_val / 512) - 1));
-                            goto cleanup_done;
-                            }
-                        }
-                    } while ((link = fname.fn_ulnk) != 0);
-                }
-            }
-        }
+switch (DK_GET_FMT (uptr)) {                            /* case on format */
+    case DKUF_F_STD:                                    /* Simh */
+    case DKUF_F_VHD:                                    /* VHD format */
+    case DKUF_F_DDI:                                    /* DDI format */
+        ctx->media_removed = 1;
+        return sim_disk_detach (uptr);
+    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
+        ctx->media_removed = 1;
+        return sim_os_disk_unload_raw (uptr->fileref);  /* remove/eject disk */
+        break;
+    default:
+        return SCPE_NOFNC;
     }
-cleanup_done:
-uptr->capac = saved_capac;
-if (readonly)
-    *readonly = sim_disk_wrp (uptr);
-return ret_val;
 }
 
-#pragma pack(push,1)
-typedef struct _RT11_HomeBlock {
-    uint8   hb_b_bbtable[130];
-    uint8   hb_b_unused1[2];
-    uint8   hb_b_initrestore[38];
-    uint8   hb_b_bup[18];
-    uint8   hb_b_unused2[260];
-    uint16  hb_w_reserved1;
-    uint16  hb_w_reserved2;
-    uint8   hb_b_unused3[14];
-    uint16  hb_w_clustersize;
-    uint16  hb_w_firstdir;
-    uint16  hb_w_sysver;
-#define HB_C_SYSVER_V3A 36521
-#define HB_C_SYSVER_V04 36434
-#define HB_C_SYSVER_V05 36435
-    uint8   hb_b_volid[12];
-    uint8   hb_b_owner[12];
-    uint8   hb_b_sysid[12];
-#define HB_C_SYSID      "DECRT11A    "
-#define HB_C_VMSSYSID   "DECVMSEXCHNG"
-    uint8   hb_b_unused4[2];
-    uint16  hb_w_checksum;
-    } RT11_HomeBlock;
+t_stat sim_disk_erase (UNIT *uptr)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-typedef struct _RT11_DirHeader {
-    uint16  dh_w_count;
-    uint16  dh_w_next;
-    uint16  dh_w_highest;
-#define DH_C_MAXSEG     31
-    uint16  dh_w_extra;
-    uint16  dh_w_start;
-    } RT11_DirHeader;
+if (!(uptr->flags & UNIT_ATT))
+    return SCPE_UNATT;
+return sim_disk_unmap (uptr, 0, (t_seccnt)(ctx->container_size / ctx->sector_size));
+}
 
-typedef struct _RT11_DirEntry {
-    uint16  de_w_status;
-#define DE_C_PRE        0000020
-#define DE_C_TENT       0000400
-#define DE_C_EMPTY      0001000
-#define DE_C_PERM       0002000
-#define DE_C_EOS        0004000
-#define DE_C_READ       0040000
-#define DE_C_PROT       0100000
-    uint16  de_w_fname1;
-    uint16  de_w_fname2;
-    uint16  de_w_ftype;
-    uint16  de_w_length;
-    uint16  de_w_jobchannel;
-    uint16  de_w_creationdate;
-    } RT11_DirEntry;
-#pragma pack(pop)
+/* Deallocate (TRIM or UNMAP) a range of sectors
 
-#define RT11_MAXPARTITIONS      256             /* Max partitions supported */
-#define RT11_HOME                 1             /* Home block # */
+   The sectors subsequently read as zeros.  Zeros are written in large
+   aligned pieces, which the container formats keep as unallocated
+   storage where they can.  Going through sim_disk_wrsect keeps the
+   sector cache, a mapping and a VHD commit in progress consistent. */
 
-#define RT11_NOPART             0
-#define RT11_SINGLEPART         1
-#define RT11_MULTIPART          2
+#define DK_UNMAP_BYTES  (4*1024*1024)
 
-static int rt11_get_partition_type(RT11_HomeBlock *home, int part)
+t_stat sim_disk_unmap (UNIT *uptr, t_lba lba, t_seccnt sects)
 {
-if (strncmp((char *)&home->hb_b_sysid, HB_C_SYSID, strlen(HB_C_SYSID)) == 0) {
-    uint16 type = home->hb_w_sysver;
-
-    if (part == 0) {
-        if ((type == HB_C_SYSVER_V3A) || (type == HB_C_SYSVER_V04))
-            return RT11_SINGLEPART;
-        }
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_seccnt chunk, count, done;
+uint8 *buf;
+t_stat r = SCPE_OK;
 
-    if (type == HB_C_SYSVER_V05)
-        return RT11_MULTIPART;
+if (!(uptr->flags & UNIT_ATT))
+    return SCPE_UNATT;
+if (sim_disk_wrp (uptr))
+    return SCPE_RO;
+sim_debug_unit (ctx->dbit, uptr, "sim_disk_unmap(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+chunk = DK_UNMAP_BYTES / ctx->sector_size;
+if (chunk == 0)
+    chunk = 1;
+buf = (uint8 *)calloc (chunk, ctx->sector_size);
+if (buf == NULL)
+    return SCPE_MEM;
+while ((sects > 0) && (r == SCPE_OK)) {
+    count = chunk - (lba % chunk);                      /* end pieces on chunk boundaries */
+    if (count > sects)
+        count = sects;
+    r = sim_disk_wrsect (uptr, lba, buf, &done, count);
+    lba += count;
+    sects -= count;
     }
+free (buf);
+return r;
+}
 
-if (strncmp((char *)&home->hb_b_sysid, HB_C_VMSSYSID, strlen(HB_C_VMSSYSID)) == 0)
-    return RT11_SINGLEPART;
+/*
+   This routine is called when the simulator stops and any time
+   the asynch mode is changed (enabled or disabled)
+*/
+static void _sim_disk_io_flush (UNIT *uptr)
+{
+uint32 f = DK_GET_FMT (uptr);
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-return RT11_NOPART;
+#if defined (SIM_ASYNCH_IO)
+sim_disk_clr_async (uptr);
+#endif
+_sim_disk_cache_flush (uptr);                           /* write back modified sectors */
+_sim_disk_mmap_sync (uptr);                             /* write modified mapped pages */
+#if defined (SIM_ASYNCH_IO)
+if (sim_asynch_enabled)
+    sim_disk_set_async (uptr, ctx->asynch_io_latency);
+#endif
+switch (f) {                                            /* case on format */
+    case DKUF_F_STD:                                    /* Simh */
+        fflush (uptr->fileref);
+        break;
+    case DKUF_F_VHD:                                    /* Virtual Disk */
+        COMMIT_LOCK (ctx);
+        sim_vhd_disk_flush (uptr->fileref);
+        COMMIT_UNLOCK (ctx);
+        break;
+    case DKUF_F_DDI:                                    /* Deduplicated Disk Image */
+        sim_ddi_disk_flush (uptr->fileref);
+        break;
+    case DKUF_F_RAW:                                    /* Physical */
+        sim_os_disk_flush_raw (uptr->fileref);
+        break;
+        }
+_sim_disk_commit_poll (uptr, FALSE);                    /* complete a finished commit */
 }
 
-static t_offset get_rt11_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
+static t_stat _err_return (UNIT *uptr, t_stat stat)
+{
+free (uptr->filename);
+uptr->filename = NULL;
+free (uptr->disk_ctx);
+uptr->disk_ctx = NULL;
+return stat;
+}
+
+static t_stat _sim_disk_rdsect_interleave (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, uint16 sectpertrack, uint16 interleave, uint16 skew, uint16 offset)
 {
-DEVICE *dptr;
-t_addr saved_capac;
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-t_addr temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
-uint8 sector_buf[1024];
-RT11_HomeBlock Home;
-t_seccnt sects_read;
-RT11_DirHeader *dir_hdr = (RT11_DirHeader *)sector_buf;
-int partitions = 0;
-int part;
-uint32 base;
-uint32 dir_sec;
-uint16 dir_seg;
-uint16 version = 0;
-t_offset ret_val = (t_offset)-1;
+t_lba sectno = lba, psa;
+t_stat status;
 
-if ((dptr = find_dev_from_unit (uptr)) == NULL)
-     return ret_val;
-saved_capac = uptr->capac;
-uptr->capac = temp_capac;
+if (sectsread)
+    *sectsread = 0;
 
-for (part = 0; part < RT11_MAXPARTITIONS; part++) {
-    uint16 seg_highest = 0;
-    int type;
+do {
+    uint16 i, track, sector;
 
     /*
-     * RX01/RX02 media can only have a single partition
+     * Map an LBA address into a physical sector address
      */
-    if ((part != 0) && (physsectsz != 0))
-      break;
+    track = sectno / sectpertrack;
+    i = (sectno % sectpertrack) * interleave;
+    if (i >= sectpertrack)
+        i++;
+    sector = (i + (track * skew)) % sectpertrack;
 
-    base = part << 16;
+    psa = sector + (track * sectpertrack) + offset;
 
-    if (_DEC_rdsect(uptr, (base + RT11_HOME) * (512 / ctx->sector_size), (uint8 *)&Home, &sects_read, 512 / ctx->sector_size, physsectsz) ||
-        (sects_read != (512 / ctx->sector_size)))
-        goto Return_Cleanup;
-
-    type = rt11_get_partition_type(&Home, part);
-
-    if (type != RT11_NOPART) {
-        uint16 highest = 0;
-        uint8 seg_seen[DH_C_MAXSEG + 1];
+    status = sim_disk_rdsect(uptr, psa, buf, NULL, 1);
+    sects--;
+    buf += ctx->sector_size;
+    sectno++;
+    if (sectsread)
+        *sectsread += 1;
+    } while ((sects != 0) && (status == SCPE_OK));
 
-        memset(seg_seen, 0, sizeof(seg_seen));
+return status;
+}
 
-        partitions++;
+/*
+ * Version of sim_disk_rdsect() specifically for filesystem detection of DEC
+ * file systems. The routine handles regular DEC disks (physsectsz == 0) and
+ * RX01/RX02 disks (physsectsz == 128 or == 256) which ignore track 0,
+ * interleave physical sectors 2:1 for the remaining tracks and have a skew
+ * 6 sectors at the end of a track.
+ */
+#define RX0xNSECT               26                      /* 26 sectors/track */
+#define RX0xINTER               2                       /* 2 sector interleave */
+#define RX0xISKEW               6                       /* 6 sectors interleave per track */
 
-        dir_seg = 1;
-        do {
-            int offset = sizeof(RT11_DirHeader);
-            int dir_size = sizeof(RT11_DirEntry);
-            uint16 cur_blk;
+static t_stat _DEC_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, uint32 physsectsz)
+{
+if (physsectsz == 0)            /* Use device natural sector size */
+    return sim_disk_rdsect(uptr, lba, buf, sectsread, sects);
 
-            if (seg_seen[dir_seg]++ != 0)
-                goto Next_Partition;
+return _sim_disk_rdsect_interleave(uptr, lba, buf, sectsread, sects, RX0xNSECT, RX0xINTER, RX0xISKEW, RX0xNSECT);
+}
 
-            dir_sec = Home.hb_w_firstdir + ((dir_seg - 1) * 2);
+#pragma pack(push,1)
+typedef struct _ODS1_HomeBlock
+    {
+    uint16  hm1_w_ibmapsize;
+    uint32  hm1_l_ibmaplbn;
+    uint16  hm1_w_maxfiles;
+    uint16  hm1_w_cluster;
+    uint16  hm1_w_devtype;
+    uint16  hm1_w_structlev;
+#define HM1_C_LEVEL1    0401
+#define HM1_C_LEVEL2    0402
+    uint8   hm1_t_volname[12];
+    uint8   hm1_b_fill_1[4];
+    uint16  hm1_w_volowner;
+    uint16  hm1_w_protect;
+    uint16  hm1_w_volchar;
+    uint16  hm1_w_fileprot;
+    uint8   hm1_b_fill_2[6];
+    uint8   hm1_b_window;
+    uint8   hm1_b_extend;
+    uint8   hm1_b_lru_lim;
+    uint8   hm1_b_fill_3[11];
+    uint16  hm1_w_checksum1;
+    uint8   hm1_t_credate[14];
+    uint8   hm1_b_fill_4[382];
+    uint32  hm1_l_serialnum;
+    uint8   hm1_b_fill_5[12];
+    uint8   hm1_t_volname2[12];
+    uint8   hm1_t_ownername[12];
+    uint8   hm1_t_format[12];
+    uint8   hm1_t_fill_6[2];
+    uint16  hm1_w_checksum2;
+    } ODS1_HomeBlock;
 
-            if ((_DEC_rdsect(uptr, (base + dir_sec) * (512 / ctx->sector_size), sector_buf, &sects_read, 1024 / ctx->sector_size, physsectsz)) ||
-                (sects_read != (1024 / ctx->sector_size)))
-                goto Return_Cleanup;
+    typedef struct _ODS2_HomeBlock
+    {
+    uint32 hm2_l_homelbn;
+    uint32 hm2_l_alhomelbn;
+    uint32 hm2_l_altidxlbn;
+    uint8  hm2_b_strucver;
+    uint8  hm2_b_struclev;
+    uint16 hm2_w_cluster;
+    uint16 hm2_w_homevbn;
+    uint16 hm2_w_alhomevbn;
+    uint16 hm2_w_altidxvbn;
+    uint16 hm2_w_ibmapvbn;
+    uint32 hm2_l_ibmaplbn;
+    uint32 hm2_l_maxfiles;
+    uint16 hm2_w_ibmapsize;
+    uint16 hm2_w_resfiles;
+    uint16 hm2_w_devtype;
+    uint16 hm2_w_rvn;
+    uint16 hm2_w_setcount;
+    uint16 hm2_w_volchar;
+    uint32 hm2_l_volowner;
+    uint32 hm2_l_reserved;
+    uint16 hm2_w_protect;
+    uint16 hm2_w_fileprot;
+    uint16 hm2_w_reserved;
+    uint16 hm2_w_checksum1;
+    uint32 hm2_q_credate[2];
+    uint8  hm2_b_window;
+    uint8  hm2_b_lru_lim;
+    uint16 hm2_w_extend;
+    uint32 hm2_q_retainmin[2];
+    uint32 hm2_q_retainmax[2];
+    uint32 hm2_q_revdate[2];
+    uint8  hm2_r_min_class[20];
+    uint8  hm2_r_max_class[20];
+    uint8  hm2_r_reserved[320];
+    uint32 hm2_l_serialnum;
+    uint8  hm2_t_strucname[12];
+    uint8  hm2_t_volname[12];
+    uint8  hm2_t_ownername[12];
+    uint8  hm2_t_format[12];
+    uint16 hm2_w_reserved2;
+    uint16 hm2_w_checksum2;
+    } ODS2_HomeBlock;
 
-            if (dir_seg == 1) {
-                seg_highest = dir_hdr->dh_w_highest;
-                if (seg_highest > DH_C_MAXSEG)
-                    goto Next_Partition;
-                }
-            dir_size += dir_hdr->dh_w_extra;
-            cur_blk = dir_hdr->dh_w_start;
+typedef struct _ODS1_FileHeader
+    {
+    uint8   fh1_b_idoffset;
+    uint8   fh1_b_mpoffset;
+    uint16  fh1_w_fid_num;
+    uint16  fh1_w_fid_seq;
+    uint16  fh1_w_struclev;
+    uint16  fh1_w_fileowner;
+    uint16  fh1_w_fileprot;
+    uint16  fh1_w_filechar;
+    uint16  fh1_w_recattr;
+    uint8   fh1_b_fill_1[494];
+    uint16  fh1_w_checksum;
+    } ODS1_FileHeader;
 
-            while ((1024 - offset) >= dir_size) {
-                RT11_DirEntry *dir_entry = (RT11_DirEntry *)&sector_buf[offset];
+typedef struct _ODS2_FileHeader
+    {
+    uint8  fh2_b_idoffset;
+    uint8  fh2_b_mpoffset;
+    uint8  fh2_b_acoffset;
+    uint8  fh2_b_rsoffset;
+    uint16 fh2_w_seg_num;
+    uint16 fh2_w_structlev;
+    uint16 fh2_w_fid[3];
+    uint16 fh2_w_ext_fid[3];
+    uint16 fh2_w_recattr[16];
+    uint32 fh2_l_filechar;
+    uint16 fh2_w_remaining[228];
+    } ODS2_FileHeader;
 
-                if (dir_entry->de_w_status & DE_C_EOS)
-                    break;
+typedef union _ODS2_Retreval
+    {
+        struct
+            {
+            unsigned fm2___fill   : 14;       /* type specific data               */
+            unsigned fm2_v_format : 2;        /* format type code                 */
+            } fm2_r_word0_bits;
+        struct
+            {
+            unsigned fm2_v_exact    : 1;      /* exact placement specified        */
+            unsigned fm2_v_oncyl    : 1;      /* on cylinder allocation desired   */
+            unsigned fm2___fill     : 10;
+            unsigned fm2_v_lbn      : 1;      /* use LBN of next map pointer      */
+            unsigned fm2_v_rvn      : 1;      /* place on specified RVN           */
+            unsigned fm2_v_format0  : 2;
+            } fm2_r_map_bits0;
+        struct
+            {
+            unsigned fm2_b_count1   : 8;      /* low byte described below         */
+            unsigned fm2_v_highlbn1 : 6;      /* high order LBN                   */
+            unsigned fm2_v_format1  : 2;
+            unsigned fm2_w_lowlbn1  : 16;     /* low order LBN                    */
+            } fm2_r_map_bits1;
+        struct
+            {
+            struct
+                {
+                unsigned fm2_v_count2   : 14; /* count field                      */
+                unsigned fm2_v_format2  : 2;
+                unsigned fm2_l_lowlbn2  : 16; /* low order LBN                    */
+                } fm2_r_map2_long0;
+            uint16 fm2_l_highlbn2;            /* high order LBN                   */
+            } fm2_r_map_bits2;
+        struct
+            {
+            struct
+                {
+                unsigned fm2_v_highcount3 : 14; /* low order count field          */
+                unsigned fm2_v_format3  : 2;
+                unsigned fm2_w_lowcount3 : 16;  /* high order count field         */
+                } fm2_r_map3_long0;
+            uint32 fm2_l_lbn3;
+            } fm2_r_map_bits3;
+    } ODS2_Retreval;
 
-                /*
-                 * Within each directory segment the bas address should never
-                 * decrease.
-                 */
-                if (((cur_blk + dir_entry->de_w_length) & 0xFFFF) < cur_blk)
-                    goto Next_Partition;
+typedef struct _ODS1_Retreval
+    {
+    uint8   fm1_b_ex_segnum;
+    uint8   fm1_b_ex_rvn;
+    uint16  fm1_w_ex_filnum;
+    uint16  fm1_w_ex_filseq;
+    uint8   fm1_b_countsize;
+    uint8   fm1_b_lbnsize;
+    uint8   fm1_b_inuse;
+    uint8   fm1_b_avail;
+    union {
+        struct {
+            uint8 fm1_b_highlbn;
+            uint8 fm1_b_count;
+            uint16 fm1_w_lowlbn;
+            } fm1_s_fm1def1;
+        struct {
+            uint8 fm1_b_highlbn;
+            uint8 fm1_b_count;
+            uint16 fm1_w_lowlbn;
+            } fm1_s_fm1def2;
+        } fm1_pointers[4];
+    } ODS1_Retreval;
 
-                cur_blk += dir_entry->de_w_length;
-                offset += dir_size;
-                }
-            if (cur_blk > highest)
-                highest = cur_blk;
-            dir_seg = dir_hdr->dh_w_next;
+typedef struct _ODS1_StorageControlBlock
+    {
+    uint8  scb_b_unused[3];
+    uint8  scb_b_bitmapblks;
+    struct _bitmapblk {
+        uint16 scb_w_freeblks;
+        uint16 scb_w_freeptr;
+        } scb_r_blocks[1];
+    } ODS1_SCB;
 
-            if (dir_seg > seg_highest)
-                goto Next_Partition;
-            } while (dir_seg != 0);
 
-        ret_val = (t_offset)((base + highest) * (t_offset)512);
-        version = Home.hb_w_sysver;
+typedef struct _ODS2_StorageControlBlock
+    {
+    uint8  scb_b_strucver;   /* 1 */
+    uint8  scb_b_struclev;   /* 2 */
+    uint16 scb_w_cluster;
+    uint32 scb_l_volsize;
+    uint32 scb_l_blksize;
+    uint32 scb_l_sectors;
+    uint32 scb_l_tracks;
+    uint32 scb_l_cylinder;
+    uint32 scb_l_status;
+    uint32 scb_l_status2;
+    uint16 scb_w_writecnt;
+    uint8  scb_t_volockname[12];
+    uint32 scb_q_mounttime[2];
+    uint16 scb_w_backrev;
+    uint32 scb_q_genernum[2];
+    uint8  scb_b_reserved[446];
+    uint16 scb_w_checksum;
+    } ODS2_SCB;
+#pragma pack(pop)
 
-        if (type == RT11_SINGLEPART)
-          break;
-        }
-Next_Partition:
-    ;
+static uint16
+ODSChecksum (void *Buffer, uint16 WordCount)
+    {
+    int i;
+    uint16 CheckSum = 0;
+    uint16 *Buf = (uint16 *)Buffer;
+
+    for (i=0; i<WordCount; i++)
+        CheckSum += Buf[i];
+    return CheckSum;
     }
 
-Return_Cleanup:
-if (partitions) {
-    const char *parttype;
 
-    switch (version) {
-        case HB_C_SYSVER_V3A:
-            parttype = "V3A";
-            break;
+static t_offset get_ods2_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
+{
+DEVICE *dptr;
+t_addr saved_capac;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_offset temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
+ODS2_HomeBlock Home;
+ODS2_FileHeader Header;
+ODS2_Retreval *Retr;
+ODS2_SCB Scb;
+uint16 CheckSum1, CheckSum2;
+uint32 ScbLbn = 0;
+t_offset ret_val = (t_offset)-1;
+t_seccnt sects_read;
 
-        case HB_C_SYSVER_V04:
-            parttype = "V04";
-            break;
+if ((dptr = find_dev_from_unit (uptr)) == NULL)
+    return ret_val;
+saved_capac = uptr->capac;
+uptr->capac = (t_addr)temp_capac;
+if ((_DEC_rdsect (uptr, 512 / ctx->sector_size, (uint8 *)&Home, &sects_read, sizeof (Home) / ctx->sector_size, physsectsz)) ||
+    (sects_read != (sizeof (Home) / ctx->sector_size)))
+    goto Return_Cleanup;
+CheckSum1 = ODSChecksum (&Home, (uint16)((((char *)&Home.hm2_w_checksum1)-((char *)&Home.hm2_l_homelbn))/2));
+CheckSum2 = ODSChecksum (&Home, (uint16)((((char *)&Home.hm2_w_checksum2)-((char *)&Home.hm2_l_homelbn))/2));
+if ((Home.hm2_l_homelbn == 0) ||
+    (Home.hm2_l_alhomelbn == 0) ||
+    (Home.hm2_l_altidxlbn == 0) ||
+    ((Home.hm2_b_struclev != 2) && (Home.hm2_b_struclev != 5)) ||
+    (Home.hm2_b_strucver == 0) ||
+    (Home.hm2_w_cluster == 0) ||
+    (Home.hm2_w_homevbn == 0) ||
+    (Home.hm2_w_alhomevbn == 0) ||
+    (Home.hm2_w_ibmapvbn == 0) ||
+    (Home.hm2_l_ibmaplbn == 0) ||
+    (Home.hm2_w_resfiles >= Home.hm2_l_maxfiles) ||
+    (Home.hm2_w_ibmapsize == 0) ||
+    (Home.hm2_w_resfiles < 5) ||
+    (Home.hm2_w_checksum1 != CheckSum1) ||
+    (Home.hm2_w_checksum2 != CheckSum2))
+    goto Return_Cleanup;
+if ((_DEC_rdsect (uptr, (Home.hm2_l_ibmaplbn+Home.hm2_w_ibmapsize+1) * (512 / ctx->sector_size),
+                  (uint8 *)&Header, &sects_read, sizeof (Header) / ctx->sector_size, physsectsz)) ||
+    (sects_read != (sizeof (Header) / ctx->sector_size)))
+    goto Return_Cleanup;
+CheckSum1 = ODSChecksum (&Header, 255);
+if (CheckSum1 != *(((uint16 *)&Header)+255)) /* Verify Checksum on BITMAP.SYS file header */
+    goto Return_Cleanup;
+Retr = (ODS2_Retreval *)(((uint16*)(&Header))+Header.fh2_b_mpoffset);
+/* The BitMap File has a single extent, which may be preceded by a placement descriptor */
+if (Retr->fm2_r_word0_bits.fm2_v_format == 0)
+    Retr = (ODS2_Retreval *)(((uint16 *)Retr)+1); /* skip placement descriptor */
+switch (Retr->fm2_r_word0_bits.fm2_v_format)
+    {
+    case 1:
+        ScbLbn = (Retr->fm2_r_map_bits1.fm2_v_highlbn1<<16)+Retr->fm2_r_map_bits1.fm2_w_lowlbn1;
+        break;
+    case 2:
+        ScbLbn = (Retr->fm2_r_map_bits2.fm2_l_highlbn2<<16)+Retr->fm2_r_map_bits2.fm2_r_map2_long0.fm2_l_lowlbn2;
+        break;
+    case 3:
+        ScbLbn = Retr->fm2_r_map_bits3.fm2_l_lbn3;
+        break;
+    }
+Retr = (ODS2_Retreval *)(((uint16 *)Retr)+Retr->fm2_r_word0_bits.fm2_v_format+1);
+if ((_DEC_rdsect (uptr, ScbLbn * (512 / ctx->sector_size), (uint8 *)&Scb, &sects_read, sizeof (Scb) / ctx->sector_size, physsectsz)) ||
+    (sects_read != (sizeof (Scb) / ctx->sector_size)))
+    goto Return_Cleanup;
+CheckSum1 = ODSChecksum (&Scb, 255);
+if (CheckSum1 != *(((uint16 *)&Scb)+255)) /* Verify Checksum on Storage Control Block */
+    goto Return_Cleanup;
+if ((Scb.scb_w_cluster != Home.hm2_w_cluster) ||
+    (Scb.scb_b_strucver != Home.hm2_b_strucver) ||
+    (Scb.scb_b_struclev != Home.hm2_b_struclev))
+    goto Return_Cleanup;
+sim_messagef (SCPE_OK, "%s: '%s' Contains ODS%d File system\n", sim_uname (uptr), uptr->filename, Home.hm2_b_struclev);
+sim_messagef (SCPE_OK, "%s: Volume Name: %12.12s Format: %12.12s Sectors In Volume: %u\n",
+                                   sim_uname (uptr), Home.hm2_t_volname, Home.hm2_t_format, Scb.scb_l_volsize);
+ret_val = ((t_offset)Scb.scb_l_volsize) * 512;
 
-        case HB_C_SYSVER_V05:
-            parttype = "V05";
-            break;
+Return_Cleanup:
+uptr->capac = saved_capac;
+if (readonly)
+    *readonly = sim_disk_wrp (uptr);
+return ret_val;
+}
 
-        default:
-            parttype = "???";
-            break;
-        }
-    sim_messagef (SCPE_OK, "%s: '%s' Contains RT11 partitions\n", sim_uname (uptr), uptr->filename);
-    sim_messagef (SCPE_OK, "%d valid partition%s, Type: %s, Sectors On Disk: %u\n", partitions, partitions == 1 ? "" : "s", parttype, (uint32)(ret_val / 512));
-    }
+static t_offset get_ods1_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
+{
+DEVICE *dptr;
+t_addr saved_capac;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_addr temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
+ODS1_HomeBlock Home;
+ODS1_FileHeader Header;
+ODS1_Retreval *Retr;
+uint8 scb_buf[512];
+ODS1_SCB *Scb = (ODS1_SCB *)scb_buf;
+uint16 CheckSum1, CheckSum2;
+uint32 ScbLbn;
+t_offset ret_val = (t_offset)-1;
+t_seccnt sects_read;
+
+if ((dptr = find_dev_from_unit (uptr)) == NULL)
+    return ret_val;
+saved_capac = uptr->capac;
+uptr->capac = temp_capac;
+if ((_DEC_rdsect (uptr, 512 / ctx->sector_size, (uint8 *)&Home, &sects_read, sizeof (Home) / ctx->sector_size, physsectsz)) ||
+    (sects_read != (sizeof (Home) / ctx->sector_size)))
+    goto Return_Cleanup;
+CheckSum1 = ODSChecksum (&Home, (uint16)((((char *)&Home.hm1_w_checksum1)-((char *)&Home.hm1_w_ibmapsize))/2));
+CheckSum2 = ODSChecksum (&Home, (uint16)((((char *)&Home.hm1_w_checksum2)-((char *)&Home.hm1_w_ibmapsize))/2));
+if ((Home.hm1_w_ibmapsize == 0) ||
+    (Home.hm1_l_ibmaplbn == 0) ||
+    (Home.hm1_w_maxfiles == 0) ||
+    (Home.hm1_w_cluster != 1) ||
+    ((Home.hm1_w_structlev != HM1_C_LEVEL1) && (Home.hm1_w_structlev != HM1_C_LEVEL2)) ||
+    (Home.hm1_l_ibmaplbn == 0) ||
+    (Home.hm1_w_checksum1 != CheckSum1) ||
+    (Home.hm1_w_checksum2 != CheckSum2))
+    goto Return_Cleanup;
+if ((_DEC_rdsect (uptr, (((Home.hm1_l_ibmaplbn << 16) + ((Home.hm1_l_ibmaplbn >> 16) & 0xFFFF)) + Home.hm1_w_ibmapsize + 1) * (512 / ctx->sector_size),
+                  (uint8 *)&Header, &sects_read, sizeof (Header) / ctx->sector_size, physsectsz)) ||
+    (sects_read != (sizeof (Header) / ctx->sector_size)))
+    goto Return_Cleanup;
+CheckSum1 = ODSChecksum (&Header, 255);
+if (CheckSum1 != *(((uint16 *)&Header)+255)) /* Verify Checksum on BITMAP.SYS file header */
+    goto Return_Cleanup;
+
+Retr = (ODS1_Retreval *)(((uint16*)(&Header))+Header.fh1_b_mpoffset);
+ScbLbn = (Retr->fm1_pointers[0].fm1_s_fm1def1.fm1_b_highlbn<<16)+Retr->fm1_pointers[0].fm1_s_fm1def1.fm1_w_lowlbn;
+if ((_DEC_rdsect (uptr, ScbLbn * (512 / ctx->sector_size), (uint8 *)Scb, &sects_read, 512 / ctx->sector_size, physsectsz)) ||
+    (sects_read != (512 / ctx->sector_size)))
+    goto Return_Cleanup;
+if (Scb->scb_b_bitmapblks < 127)
+    ret_val = (((t_offset)Scb->scb_r_blocks[Scb->scb_b_bitmapblks].scb_w_freeblks << 16) + Scb->scb_r_blocks[Scb->scb_b_bitmapblks].scb_w_freeptr) * 512;
+else
+    ret_val = (((t_offset)Scb->scb_r_blocks[0].scb_w_freeblks << 16) + Scb->scb_r_blocks[0].scb_w_freeptr) * 512;
+sim_messagef (SCPE_OK, "%s: '%s' Contains an ODS1 File system\n", sim_uname (uptr), uptr->filename);
+sim_messagef (SCPE_OK, "%s: Volume Name: %12.12s Format: %12.12s Sectors In Volume: %u\n",
+                                sim_uname (uptr), Home.hm1_t_volname, Home.hm1_t_format, (uint32)(ret_val / 512));
+Return_Cleanup:
 uptr->capac = saved_capac;
 if (readonly)
     *readonly = sim_disk_wrp (uptr);
 return ret_val;
 }
 
-t_offset pseudo_filesystem_size = 0;        /* Dummy file system check return used during testing */
+typedef struct ultrix_disklabel {
+    uint32  pt_magic;       /* magic no. indicating part. info exits */
+    uint32  pt_valid;       /* set by driver if pt is current */
+    struct  pt_info {
+        uint32  pi_nblocks; /* no. of sectors */
+        uint32  pi_blkoff;  /* block offset for start */
+        } pt_part[8];
+    } ultrix_disklabel;
 
-typedef t_offset (*FILESYSTEM_CHECK)(UNIT *uptr, uint32, t_bool *);
+#define PT_MAGIC        0x032957        /* Partition magic number */
+#define PT_VALID        1               /* Indicates if struct is valid */
 
-static t_offset get_filesystem_size (UNIT *uptr, t_bool *readonly)
+static t_offset get_ultrix_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
 {
-static FILESYSTEM_CHECK checks[] = {
-    &get_ods2_filesystem_size,
-    &get_ods1_filesystem_size,
-    &get_ultrix_filesystem_size,
-    &get_iso9660_filesystem_size,
-    &get_rsts_filesystem_size,
-    &get_rt11_filesystem_size,          /* This should be the last entry
-                                           in the table to reduce the
-                                           possibility of matching an RT-11
-                                           container file stored in another
-                                           filesystem */
-    NULL
-    };
+DEVICE *dptr;
+t_addr saved_capac;
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-uint32 saved_sector_size = ctx->sector_size;
+t_addr temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
+uint8 sector_buf[512];
+ultrix_disklabel *Label = (ultrix_disklabel *)(sector_buf + sizeof (sector_buf) - sizeof (ultrix_disklabel));
 t_offset ret_val = (t_offset)-1;
 int i;
+uint32 max_lbn = 0, max_lbn_partnum = 0;
+t_seccnt sects_read;
 
-if (pseudo_filesystem_size != 0) {      /* Dummy file system size mechanism? */
-    sim_messagef (SCPE_OK, "%s: '%s' Pseudo File System containing %u %d byte sectors\n", sim_uname (uptr), uptr->filename, (uint32)(pseudo_filesystem_size / ctx->sector_size), ctx->sector_size);
-    return pseudo_filesystem_size;
+if ((dptr = find_dev_from_unit (uptr)) == NULL)
+    return ret_val;
+saved_capac = uptr->capac;
+uptr->capac = temp_capac;
+if ((_DEC_rdsect (uptr, 31 * (512 / ctx->sector_size), sector_buf, &sects_read, 512 / ctx->sector_size, physsectsz)) ||
+    (sects_read != (512 / ctx->sector_size)))
+    goto Return_Cleanup;
+
+if ((Label->pt_magic != PT_MAGIC) ||
+    (Label->pt_valid != PT_VALID))
+    goto Return_Cleanup;
+
+for (i = 0; i < 8; i++) {
+    uint32 end_lbn = Label->pt_part[i].pi_blkoff + Label->pt_part[i].pi_nblocks;
+    if (end_lbn > max_lbn) {
+        max_lbn = end_lbn;
+        max_lbn_partnum = i;
+        }
     }
+sim_messagef (SCPE_OK, "%s: '%s' Contains Ultrix partitions\n", sim_uname (uptr), uptr->filename);
+sim_messagef (SCPE_OK, "Partition with highest sector: %c, Sectors On Disk: %u\n", 'a' + max_lbn_partnum, max_lbn);
+ret_val = ((t_offset)max_lbn) * 512;
 
-for (i = 0; checks[i] != NULL; i++)
-    if ((ret_val = checks[i] (uptr, 0, readonly)) != (t_offset)-1) {
-        /* ISO files that haven't already been determined to be ISO 9660
-         * which contain a known file system are also marked read-only
-         * now.  This fits early DEC distribution CDs that were created
-         * before ISO 9660 was standardized and operating support was added.
-         */
-        if ((readonly != NULL)          &&
-            (*readonly == FALSE)        &&
-            (NULL != match_ext (uptr->filename, "ISO")))
-            *readonly = TRUE;
-        return ret_val;
-        }
-/*
- * The only known interleaved disk devices have either 256 byte
- * or 128 byte sector sizes.  If additional interleaved file
- * system scenarios with different sector sizes come up they
- * should be added here.
- */
-
-for (i = 0; checks[i] != NULL; i++) {
-    ctx->sector_size = 256;
-    if ((ret_val = checks[i] (uptr, ctx->sector_size, readonly)) != (t_offset)-1)
-        break;
-    ctx->sector_size = 128;
-    if ((ret_val = checks[i] (uptr, ctx->sector_size, readonly)) != (t_offset)-1)
-        break;
-    }
-if ((ret_val != (t_offset)-1) && (ctx->sector_size != saved_sector_size ))
-    sim_messagef (SCPE_OK, "%s: with an unexpected sector size of %u bytes instead of %u bytes\n",
-                           sim_uname (uptr), ctx->sector_size, saved_sector_size);
-ctx->sector_size = saved_sector_size;
+Return_Cleanup:
+uptr->capac = saved_capac;
+if (readonly)
+    *readonly = sim_disk_wrp (uptr);
 return ret_val;
 }
 
-static t_stat store_disk_footer (UNIT *uptr, const char *dtype);
 
-static t_stat get_disk_footer (UNIT *uptr)
+/* ISO 9660 Volume Recognizer - Structure Info gathered from: https://wiki.osdev.org/ISO_9660 */
+
+typedef struct ISO_9660_Volume_Descriptor {
+    uint8   Type;                       // Volume Descriptor type code (0, 1, 2, 3 and 255)
+    uint8   Identifier[5];              // Always 'CD001'.
+    uint8   Version;                    // Volume Descriptor Version (0x01).
+    uint8   Data[2041];                 // Depends on the volume descriptor type.
+    } ISO_9660_Volume_Descriptor;
+
+typedef struct ISO_9660_Primary_Volume_Descriptor {
+    uint8   Type;                       // Always 0x01 for a Primary Volume Descriptor.
+    uint8   Identifier[5];              // Always 'CD001'.
+    uint8   Version;                    // Always 0x01.
+    uint8   Unused;                     // Always 0x00.
+    uint8   SystemIdentifier[32];       // The name of the system that can act upon sectors 0x00-0x0F for the volume.
+    uint8   VolumeIdentifier[32];       // Identification of this volume.
+    uint8   UnusedField[8];             // All zeros.
+    uint32  VolumeSpaceSize[2];         // Number of Logical Blocks in which the volume is recorded
+    uint8   UnusedField2[32];           // All zeroes.
+    uint16  VolumeSetSize[2];           // The size of the set in this logical volume (number of disks).
+    uint16  VolumeSequenceNumber[2];    // The number of this disk in the Volume Set.
+    uint16  LogicalBlockSize[2];        // The size in bytes of a logical block. NB: This means that a logical block on a CD could be something other than 2 KiB!
+    uint32  PathTableSize[2];           // The size in bytes of the path table.
+    uint32  LocationTypeLPathTable;     // LBA location of the path table. The path table pointed to contains only little-endian values.
+    uint32  LocationOptTypeLPathTable;  // LBA location of the optional path table. The path table pointed to contains only little-endian values. Zero means that no optional path table exists.
+    uint32  LocationTypeMPathTable;     // LBA location of the path table. The path table pointed to contains only big-endian values.
+    uint32  LocationOptTypeMPathTable;  // LBA location of the optional path table. The path table pointed to contains only big-endian values. Zero means that no optional path table exists.
+    uint8   DirectoryEntryRootDirectory[34];// Note that this is not an LBA address, it is the actual Directory Record, which contains a single byte Directory Identifier (0x00), hence the fixed 34 byte size.
+    uint8   VolumeSetIdentifier[128];   // Identifier of the volume set of which this volume is a member.
+    uint8   PublisherIdentifier[128];   // The volume publisher. For extended publisher information, the first byte should be 0x5F, followed by the filename of a file in the root directory. If not specified, all bytes should be 0x20.
+    uint8   DataPreparerIdentifier[128];// The identifier of the person(s) who prepared the data for this volume. For extended preparation information, the first byte should be 0x5F, followed by the filename of a file in the root directory. If not specified, all bytes should be 0x20.
+    uint8   ApplicationIdentifier[128]; // Identifies how the data are recorded on this volume. For extended information, the first byte should be 0x5F, followed by the filename of a file in the root directory. If not specified, all bytes should be 0x20.
+    uint8   CopyrightFileIdentifier[37];// Filename of a file in the root directory that contains copyright information for this volume set. If not specified, all bytes should be 0x20.
+    uint8   AbstractFileIdentifier[37]; // Filename of a file in the root directory that contains abstract information for this volume set. If not specified, all bytes should be 0x20.
+    uint8   BibliographicFileIdentifier[37];// Filename of a file in the root directory that contains bibliographic information for this volume set. If not specified, all bytes should be 0x20.
+    uint8   VolumeCreationDateTime[17]; // The date and time of when the volume was created.
+    uint8   VolumeModificationDateTime[17];// The date and time of when the volume was modified.
+    uint8   VolumeExpirationDateTime[17];// The date and time after which this volume is considered to be obsolete. If not specified, then the volume is never considered to be obsolete.
+    uint8   VolumeEffectiveDateTime[17];// The date and time after which the volume may be used. If not specified, the volume may be used immediately.
+    uint8   FileStructureVersion;       // The directory records and path table version (always 0x01).
+    uint8   Unused2;                    // Always 0x00.
+    uint8   ApplicationUsed[512];       // Contents not defined by ISO 9660.
+    uint8   Reserved[653];              // Reserved by ISO.
+    } ISO_9660_Primary_Volume_Descriptor;
+
+static t_offset get_iso9660_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
 {
+DEVICE *dptr;
+t_addr saved_capac;
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-struct simh_disk_footer *f = (struct simh_disk_footer *)calloc (1, sizeof (*f));
-t_offset container_size;
-t_offset sim_fsize_ex (FILE *fptr);
-uint32 bytesread;
+t_addr temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
+uint8 sector_buf[2048];
+ISO_9660_Volume_Descriptor *Desc = (ISO_9660_Volume_Descriptor *)sector_buf;
+uint8 primary_buf[2048];
+ISO_9660_Primary_Volume_Descriptor *Primary = NULL;
+t_lba sectfactor = sizeof (*Desc) / ctx->sector_size;
+t_offset ret_val = (t_offset)-1;
+t_offset cur_pos = 32768;           /* Beyond the boot area of an ISO 9660 image */
+t_seccnt sectsread;
+int read_count = 0;
 
-if (f == NULL)
-    return SCPE_MEM;
-sim_debug_unit (ctx->dbit, uptr, "get_disk_footer(%s)\n", sim_uname (uptr));
-switch (DK_GET_FMT (uptr)) {                            /* case on format */
-    case DKUF_F_STD:                                    /* SIMH format */
-        container_size = sim_fsize_ex (uptr->fileref);
-        if ((container_size != (t_offset)-1) && (container_size > (t_offset)sizeof (*f)) &&
-            (sim_fseeko (uptr->fileref, container_size - sizeof (*f), SEEK_SET) == 0) &&
-            (sizeof (*f) == sim_fread (f, 1, sizeof (*f), uptr->fileref)))
-            break;
-        free (f);
-        f = NULL;
-        break;
-    case DKUF_F_RAW:                                    /* RAW format */
-        container_size = sim_os_disk_size_raw (uptr->fileref);
-        if ((container_size != (t_offset)-1) && (container_size > (t_offset)sizeof (*f)) &&
-            (sim_os_disk_read (uptr, container_size - sizeof (*f), (uint8 *)f, &bytesread, sizeof (*f)) == SCPE_OK) &&
-            (bytesread == sizeof (*f)))
-            break;
-        free (f);
-        f = NULL;
-        break;
-    case DKUF_F_VHD:                                    /* VHD format */
-        if (1) {
-            time_t creation_time;
+if ((dptr = find_dev_from_unit (uptr)) == NULL)
+    return ret_val;
+saved_capac = uptr->capac;
+uptr->capac = temp_capac;
 
-            /* Construct a pseudo simh disk footer*/
-            memcpy (f->Signature, "simh", 4);
-            f->FooterVersion = FOOTER_VERSION;
-            memset (f->DriveType, 0, sizeof (f->DriveType));
-            strlcpy ((char *)f->DriveType, sim_vhd_disk_get_dtype (uptr->fileref, &f->SectorSize, &f->TransferElementSize, (char *)f->CreatingSimulator, &creation_time), sizeof (f->DriveType));
-            f->SectorSize = NtoHl (f->SectorSize);
-            f->TransferElementSize = NtoHl (f->TransferElementSize);
-            if ((f->SectorSize == 0) || (NtoHl (f->SectorSize) == 0x00020000)) {  /* Old or mangled format VHD footer */
-                sim_vhd_disk_set_dtype (uptr->fileref, (char *)f->DriveType, ctx->sector_size, ctx->xfer_element_size);
-                sim_vhd_disk_get_dtype (uptr->fileref, &f->SectorSize, &f->TransferElementSize, (char *)f->CreatingSimulator, NULL);
-                f->SectorSize = NtoHl (f->SectorSize);
-                f->TransferElementSize = NtoHl (f->TransferElementSize);
-                }
-            memset (f->CreationTime, 0, sizeof (f->CreationTime));
-            strlcpy ((char*)f->CreationTime, ctime (&creation_time), sizeof (f->CreationTime));
-            container_size = sim_vhd_disk_size (uptr->fileref);
-            if ((f->SectorSize != 0) && (NtoHl (f->SectorSize) <= 65536)) /* Range check for Coverity sake */
-                f->SectorCount = NtoHl ((uint32)(container_size / NtoHl (f->SectorSize)));
-            container_size += sizeof (*f);      /* Adjust since it is removed below */
-            f->AccessFormat = DKUF_F_VHD;
-            f->Checksum = NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)));
-            }
+while (sim_disk_rdsect(uptr, (t_lba)(sectfactor * cur_pos / sizeof (*Desc)), (uint8 *)Desc, &sectsread, sectfactor) == DKSE_OK) {
+    if ((sectsread != sectfactor)               ||
+        (Desc->Version != 1)                    ||
+        (0 != memcmp (Desc->Identifier, "CD001", sizeof (Desc->Identifier))))
         break;
-    default:
-        free (f);
-        return SCPE_IERR;
-    }
-if (f) {
-    if (f->Checksum != NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)))) {
-        sim_debug_unit (ctx->dbit, uptr, "No footer found on %s format container: %s\n", sim_disk_fmt (uptr), uptr->filename);
-        free (f);
-        f = NULL;
+    if (Desc->Type == 1) {  /* Primary Volume Descriptor */
+        Primary = (ISO_9660_Primary_Volume_Descriptor *)primary_buf;
+        *Primary = *(ISO_9660_Primary_Volume_Descriptor *)Desc;
         }
-    else {
-        /* We've got a valid footer, but it may need to be corrected */
-        if ((NtoHl (f->TransferElementSize) == 1) &&
-            (0 == memcmp (f->DriveType, "RZ", 2))) {
-            f->TransferElementSize = NtoHl (2);
-            f->Checksum = NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)));
-            store_disk_footer (uptr, (char *)f->DriveType);
+    cur_pos += sizeof (*Desc);
+    ++read_count;
+    if ((Desc->Type == 255) ||
+        (read_count >= 32)) {
+        ret_val = ctx->container_size;
+        sim_messagef (SCPE_OK, "%s: '%s' Contains an ISO 9660 filesystem\n", sim_uname (uptr), uptr->filename);
+        if (Primary) {
+            char VolId[sizeof (Primary->VolumeIdentifier) + 1];
+
+            memcpy (VolId, Primary->VolumeIdentifier, sizeof (Primary->VolumeIdentifier));
+            VolId[sizeof (Primary->VolumeIdentifier)] = '\0';
+            sim_messagef (SCPE_OK, "%s: Volume Identifier: %s   Containing %u %u Byte Sectors\n", sim_uname (uptr), sim_trim_endspc (VolId), (uint32)(ctx->container_size / Primary->LogicalBlockSize[1 - sim_end]), (uint32)Primary->LogicalBlockSize[1 - sim_end]);
             }
-        free (ctx->footer);
-        ctx->footer = f;
-        ctx->highwater = (((t_offset)NtoHl (f->Highwater[0])) << 32) | ((t_offset)NtoHl (f->Highwater[1]));
-        container_size -= sizeof (*f);
-        sim_debug_unit (ctx->dbit, uptr, "Footer: %s - %s\n"
-            "   Simulator:           %s\n"
-            "   DriveType:           %s\n"
-            "   SectorSize:          %u\n"
-            "   SectorCount:         %u\n"
-            "   TransferElementSize: %u\n"
-            "   FooterVersion:       %u\n"
-            "   AccessFormat:        %u\n"
-            "   CreationTime:        %s",
-            sim_uname (uptr), uptr->filename,
-            f->CreatingSimulator, f->DriveType, NtoHl(f->SectorSize), NtoHl (f->SectorCount),
-            NtoHl (f->TransferElementSize), f->FooterVersion, f->AccessFormat, f->CreationTime);
-        if (f->DeviceName[0] != '\0')
-            sim_debug_unit (ctx->dbit, uptr,
-                "   DeviceName:          %s\n", (char *)f->DeviceName);
-        sim_debug_unit (ctx->dbit, uptr,
-            "   HighwaterSector:     %u\n", (uint32)(ctx->highwater/ctx->sector_size));
+        break;
         }
     }
-sim_debug_unit (ctx->dbit, uptr, "Container Size: %u sectors %u bytes each\n", (uint32)(container_size/ctx->sector_size), ctx->sector_size);
-ctx->container_size = container_size;
-return SCPE_OK;
+uptr->capac = saved_capac;
+if (readonly)
+    *readonly = sim_disk_wrp (uptr) || (ret_val != (t_offset)-1);
+return ret_val;
 }
 
-static t_stat store_disk_footer (UNIT *uptr, const char *dtype)
-{
-DEVICE *dptr;
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-struct stat statb;
-struct simh_disk_footer *f;
-time_t now = time (NULL);
-t_offset total_sectors;
-t_offset highwater;
+#pragma pack(push,1)
+/*
+ * The first logical block of device cluster 1 is either:
+ *      1. MFD label entry (RSTS versions through 7.x)
+ *      2. Disk Pack label (RSTS version 8.0 and later)
+ */
+typedef struct _RSTS_MFDLABEL {
+    uint16  ml_ulnk;
+    uint16  ml_mbm1;
+    uint16  ml_reserved1;
+    uint16  ml_reserved2;
+    uint16  ml_pcs;
+    uint16  ml_pstat;
+    uint16  ml_packid[2];
+    } RSTS_MFDLABEL;
 
-return SCPE_OK;
+typedef struct _RSTS_PACKLABEL {
+    uint16  pk_mb01;
+    uint16  pk_mbm1;
+    uint16  pk_mdcn;
+    uint16  pk_plvl;
+#define PK_LVL0         0000
+#define PK_LVL11        0401
+#define PK_LVL12        0402
+    uint16  pk_ppcs;
+    uint16  pk_pstat;
+#define PK_UC_NEW       0020000
+    uint16  pk_packid[2];
+    uint16  pk_tapgvn[2];
+    uint16  pk_bckdat;
+    uint16  pk_bcktim;
+    } RSTS_PACKLABEL;
 
-if ((dptr = find_dev_from_unit (uptr)) == NULL)
-    return SCPE_NOATT;
-if (uptr->flags & UNIT_RO)
-    return SCPE_RO;
-if (sim_stat (uptr->filename, &statb))
-    memset (&statb, 0, sizeof (statb));
-f = (struct simh_disk_footer *)calloc (1, sizeof (*f));
-f->AccessFormat = DK_GET_FMT (uptr);
-total_sectors = (((t_offset)uptr->capac) * ctx->capac_factor * ((dptr->flags & DEV_SECTORS) ? 512 : 1)) / ctx->sector_size;
-memcpy (f->Signature, "simh", 4);
-f->FooterVersion = FOOTER_VERSION;
-memset (f->CreatingSimulator, 0, sizeof (f->CreatingSimulator));
-strlcpy ((char *)f->CreatingSimulator, sim_name, sizeof (f->CreatingSimulator));
-memset (f->DriveType, 0, sizeof (f->DriveType));
-strlcpy ((char *)f->DriveType, dtype, sizeof (f->DriveType));
-f->SectorSize = NtoHl (ctx->sector_size);
-f->SectorCount = NtoHl ((uint32)total_sectors);
-f->TransferElementSize = NtoHl (ctx->xfer_element_size);
-memset (f->CreationTime, 0, sizeof (f->CreationTime));
-strlcpy ((char*)f->CreationTime, ctime (&now), sizeof (f->CreationTime));
-memset (f->DeviceName, 0, sizeof (f->DeviceName));
-strlcpy ((char*)f->DeviceName, dptr->name, sizeof (f->DeviceName));
-highwater = sim_fsize_name_ex (uptr->filename);
-/* Align Initial Highwater to a sector boundary */
-highwater = ((highwater + ctx->sector_size - 1) / ctx->sector_size) * ctx->sector_size;
-f->Highwater[0] = NtoHl ((uint32)(highwater >> 32));
-f->Highwater[1] = NtoHl ((uint32)(highwater & 0xFFFFFFFF));
-f->Checksum = NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)));
-free (ctx->footer);
-ctx->footer = f;
-switch (f->AccessFormat) {
-    case DKUF_F_STD:                                    /* SIMH format */
-        if (sim_fseeko ((FILE *)uptr->fileref, total_sectors * ctx->sector_size, SEEK_SET) == 0) {
-            sim_fwrite (f, sizeof (*f), 1, (FILE *)uptr->fileref);
-            fclose ((FILE *)uptr->fileref);
-            sim_set_file_times (uptr->filename, statb.st_atime, statb.st_mtime);
-            uptr->fileref = sim_fopen (uptr->filename, "rb+");
-            }
-        break;
-    case DKUF_F_VHD:                                    /* VHD format */
-        break;
-    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
-        sim_os_disk_write (uptr, total_sectors * ctx->sector_size, (uint8 *)f, NULL, sizeof (*f));
-        sim_os_disk_close_raw (uptr->fileref);
-        sim_set_file_times (uptr->filename, statb.st_atime, statb.st_mtime);
-        uptr->fileref = sim_os_disk_open_raw (uptr->filename, "rb+");
-        break;
-    default:
-        break;
-    }
-return SCPE_OK;
-}
+typedef union _RSTS_ROOT {
+    RSTS_MFDLABEL  rt_mfd;
+    RSTS_PACKLABEL rt_pack;
+    uint8          rt_block[512];
+    } RSTS_ROOT;
 
-static t_stat update_disk_footer (UNIT *uptr)
-{
-DEVICE *dptr;
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-struct stat statb;
-struct simh_disk_footer *f;
-t_offset total_sectors;
-t_offset highwater;
-t_offset footer_highwater;
+typedef struct _RSTS_MFDBLOCKETTE {
+    uint16  mb_ulnk;
+    uint16  mb_mbm1;
+    uint16  mb_reserved1;
+    uint16  mb_reserved2;
+    uint16  mb_reserved3;
+    uint16  mb_malnk;
+    uint16  mb_lppn;
+    uint16  mb_lid;
+#define MB_ID           0051064
+    } RSTS_MFDBLOCKETTE;
+#define IS_VALID_RSTS_MFD(b) \
+     ((((b)->mb_ulnk == 0) || ((b)->mb_ulnk == 1)) &&                         \
+      ((b)->mb_mbm1 == 0177777) &&                                            \
+      ((b)->mb_reserved1 == 0) &&                                             \
+      ((b)->mb_reserved2 == 0) &&                                             \
+      ((b)->mb_reserved3 == 0) &&                                             \
+      ((b)->mb_lppn == 0177777) &&                                            \
+      ((b)->mb_lid == MB_ID))
 
-return SCPE_OK;
+typedef struct _RSTS_GFDBLOCKETTE {
+    uint16  gb_ulnk;
+    uint16  gb_mbm1;
+    uint16  gb_reserved1;
+    uint16  gb_reserved2;
+    uint16  gb_reserved3;
+    uint16  gb_reserved4;
+    uint16  gb_lppn;
+    uint16  gb_lid;
+#define GB_ID           0026264
+    } RSTS_GFDBLOCKETTE;
+#define IS_VALID_RSTS_GFD(b, g) \
+     ((((b)->gb_ulnk == 0) || ((b)->gb_ulnk == 1)) &&                         \
+      ((b)->gb_mbm1 == 0177777) &&                                            \
+      ((b)->gb_reserved1 == 0) &&                                             \
+      ((b)->gb_reserved2 == 0) &&                                             \
+      ((b)->gb_reserved3 == 0) &&                                             \
+      ((b)->gb_reserved4 == 0) &&                                             \
+      ((b)->gb_lppn == (((g) << 8) | 0377)) &&                                \
+      ((b)->gb_lid == GB_ID))
 
-if ((dptr = find_dev_from_unit (uptr)) == NULL)
-    return SCPE_NOATT;
-if (uptr->flags & UNIT_RO)
-    return SCPE_RO;
-if (ctx == NULL)
-    return SCPE_IERR;
-f = ctx->footer;
-if (f == NULL)
-    return SCPE_IERR;
+typedef struct _RSTS_UFDBLOCKETTE {
+    uint16  ub_ulnk;
+    uint16  ub_mbm1;
+    uint16  ub_reserved1;
+    uint16  ub_reserved2;
+    uint16  ub_reserved3;
+    uint16  ub_reserved4;
+    uint16  ub_lppn;
+    uint16  ub_lid;
+#define UB_ID           0102064
+    } RSTS_UFDBLOCKETTE;
+#define IS_VALID_RSTS_UFD(b, g, u) \
+     (((b)->ub_mbm1 == 0177777) &&                                            \
+      ((b)->ub_reserved1 == 0) &&                                             \
+      ((b)->ub_reserved2 == 0) &&                                             \
+      ((b)->ub_reserved3 == 0) &&                                             \
+      ((b)->ub_reserved4 == 0) &&                                             \
+      ((b)->ub_lppn == (((g) << 8) | (u))) &&                                 \
+      ((b)->ub_lid == UB_ID))
 
-footer_highwater = (((t_offset)NtoHl (f->Highwater[0])) << 32) | ((t_offset)NtoHl (f->Highwater[1]));
-if (ctx->highwater <= footer_highwater)
-    return SCPE_OK;
+typedef struct _RSTS_UNAME {
+    uint16  un_ulnk;
+    uint16  un_unam;
+    uint16  un_reserved1;
+    uint16  un_reserved2;
+    uint16  un_ustat;
+    uint16  un_uacnt;
+    uint16  un_uaa;
+    uint16  un_uar;
+    } RSTS_UNAME;
 
-if (sim_stat (uptr->filename, &statb))
-    memset (&statb, 0, sizeof (statb));
-total_sectors = (((t_offset)uptr->capac) * ctx->capac_factor * ((dptr->flags & DEV_SECTORS) ? 512 : 1)) / ctx->sector_size;
-highwater = ctx->highwater;
-f->Highwater[0] = NtoHl ((uint32)(highwater >> 32));
-f->Highwater[1] = NtoHl ((uint32)(highwater & 0xFFFFFFFF));
-f->Checksum = NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)));
-switch (f->AccessFormat) {
-    case DKUF_F_STD:                                    /* SIMH format */
-        if (sim_fseeko ((FILE *)uptr->fileref, total_sectors * ctx->sector_size, SEEK_SET) == 0) {
-            sim_fwrite (f, sizeof (*f), 1, (FILE *)uptr->fileref);
-            fclose ((FILE *)uptr->fileref);
-            sim_set_file_times (uptr->filename, statb.st_atime, statb.st_mtime);
-            uptr->fileref = sim_fopen (uptr->filename, "rb+");
-            }
-        break;
-    case DKUF_F_VHD:                                    /* VHD format */
-        break;
-    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
-        sim_os_disk_write (uptr, total_sectors * ctx->sector_size, (uint8 *)f, NULL, sizeof (*f));
-        sim_os_disk_close_raw (uptr->fileref);
-        sim_set_file_times (uptr->filename, statb.st_atime, statb.st_mtime);
-        uptr->fileref = sim_os_disk_open_raw (uptr->filename, "rb+");
-        break;
-    default:
-        break;
-    }
-return SCPE_OK;
-}
+typedef struct _RSTS_FNAME {
+    uint16  fn_ulnk;
+    uint16  fn_unam[3];
+    uint16  fn_ustat;
+    uint16  fn_uacnt;
+    uint16  fn_uaa;
+    uint16  fn_uar;
+    } RSTS_FNAME;
 
-t_stat sim_disk_attach (UNIT *uptr, const char *cptr, size_t sector_size, size_t xfer_element_size, t_bool dontchangecapac,
-                        uint32 dbit, const char *dtype, uint32 pdp11tracksize, int completion_delay)
-{
-return sim_disk_attach_ex (uptr, cptr, sector_size, xfer_element_size, dontchangecapac, dbit, dtype, pdp11tracksize, completion_delay, NULL);
-}
+typedef struct _RSTS_ACNT {
+    uint16  ac_ulnk;
+    uint16  ac_udla;
+    uint16  ac_usiz;
+    uint16  ac_udc;
+    uint16  ac_utc;
+    uint16  ac_urts[2];
+    uint16  ac_uclus;
+    } RSTS_ACNT;
 
-t_stat sim_disk_attach_ex (UNIT *uptr, const char *cptr, size_t sector_size, size_t xfer_element_size, t_bool dontchangecapac,
-                           uint32 dbit, const char *dtype, uint32 pdp11tracksize, int completion_delay, const char **drivetypes)
+typedef struct _RSTS_RETR {
+    uint16  rt_ulnk;
+    uint16  rt_uent[7];
+#define RT_ENTRIES      7
+    } RSTS_RETR;
+
+typedef struct _RSTS_DCMAP {
+    uint16  dc_clus;
+#define DC_MASK         0077777
+    uint16  dc_map[7];
+    }  RSTS_DCMAP;
+
+/*
+ * Directory link definitions
+ */
+#define DL_USE          0000001
+#define DL_BAD          0000002
+#define DL_CHE          0000004
+#define DL_CLN          0000010
+#define DL_ENO          0000760
+#define DL_CLO          0007000
+#define DL_BLO          0170000
+
+#define DLSH_ENO         4
+#define DLSH_CLO         9
+#define DLSH_BLO        12
+
+#define BLOCKETTE_SZ    (8 * sizeof(uint16))
+#define MAP_OFFSET      (31 * BLOCKETTE_SZ)
+
+#define SATT0           0073374
+#define SATT1           0076400
+#define SATT2           0075273
+
+#pragma pack(pop)
+
+typedef struct _rstsContext {
+    UNIT        *uptr;
+    int         dcshift;
+    int         pcs;
+    char        packid[8];
+    t_seccnt    sects;
+    RSTS_DCMAP  map;
+} rstsContext;
+
+static char rad50[] = " ABCDEFGHIJKLMNOPQRSTUVWXYZ$.%0123456789";
+
+static void r50Asc(uint16 val, char *buf)
 {
-return sim_disk_attach_ex2 (uptr, cptr, sector_size, xfer_element_size, dontchangecapac,
-                            dbit, dtype, pdp11tracksize, completion_delay, drivetypes, 0);
+buf[2] = rad50[val % 050];
+val /= 050;
+buf[1] = rad50[val % 050];
+buf[0] = rad50[val / 050];
 }
 
-t_stat sim_disk_attach_ex2 (UNIT *uptr, const char *cptr, size_t sector_size, size_t xfer_element_size, t_bool dontchangecapac,
-                            uint32 dbit, const char *dtype, uint32 pdp11tracksize, int completion_delay, const char **drivetypes,
-                            size_t reserved_sectors)
+static t_stat rstsValidateClusterSize(uint16 size, uint16 minSize)
 {
-struct disk_context *ctx;
-DEVICE *dptr;
-char tbuf[4*CBUFSIZE];
-FILE *(*open_function)(const char *filename, const char *mode) = sim_fopen;
-FILE *(*create_function)(const char *filename, t_offset desiredsize) = NULL;
-t_stat (*storage_function)(FILE *file, uint32 *sector_size, uint32 *removable, uint32 *is_cdrom) = NULL;
-t_bool created = FALSE, copied = FALSE, autosized = FALSE;
-t_bool auto_format = FALSE;
-t_offset container_size, filesystem_size, current_unit_size;
-size_t tmp_size = 1;
+int i;
 
-if (sim_disk_no_autosize) {
-    dontchangecapac = TRUE;
-    drivetypes = NULL;
-    }
-if (uptr->flags & UNIT_DIS)                             /* disabled? */
-    return SCPE_UDIS;
-if (!(uptr->flags & UNIT_ATTABLE))                      /* not attachable? */
-    return SCPE_NOATT;
-if ((dptr = find_dev_from_unit (uptr)) == NULL)
-    return SCPE_NOATT;
-switch (xfer_element_size) {
-    default:
-        return sim_messagef (SCPE_ARG, "Unsupported transfer element size: %u\n", (uint32)xfer_element_size);
-    case 1: case 2: case 4: case 8:
-        break;
-    }
-if ((sector_size % xfer_element_size) != 0)
-    return sim_messagef (SCPE_ARG, "Invalid sector size: %u - must be a multiple of the transfer element size %u\n", (uint32)sector_size, (uint32)xfer_element_size);
-if (sim_switches & SWMASK ('F')) {                      /* format spec? */
-    char gbuf[CBUFSIZE];
-    cptr = get_glyph (cptr, gbuf, 0);                   /* get spec */
-    if (*cptr == 0)                                     /* must be more */
-        return SCPE_2FARG;
-    if ((sim_disk_set_fmt (uptr, 0, gbuf, NULL) != SCPE_OK) ||
-        (DK_GET_FMT (uptr) == DKUF_F_AUTO))
-        return sim_messagef (SCPE_ARG, "Invalid Override Disk Format: %s\n", gbuf);
-    sim_switches = sim_switches & ~(SWMASK ('F'));      /* Record Format specifier already processed */
-    auto_format = TRUE;
-    }
-if (sim_switches & SWMASK ('D')) {                      /* create difference disk? */
-    char gbuf[CBUFSIZE];
-    FILE *vhd;
+/*
+ * Check that the cluster size is a power of 2 and greater than or equal
+ * to some location dependent value.
+ */
+if (size >= minSize)
+    for (i = 0; i < 16; i++)
+        if (size == (1 << i))
+            return SCPE_OK;
 
-    sim_switches = sim_switches & ~(SWMASK ('D'));
-    cptr = get_glyph_nc (cptr, gbuf, 0);                /* get spec */
-    if (*cptr == 0)                                     /* must be more */
-        return SCPE_2FARG;
-    vhd = sim_vhd_disk_create_diff (gbuf, cptr);
-    if (vhd) {
-        sim_vhd_disk_close (vhd);
-        return sim_disk_attach (uptr, gbuf, sector_size, xfer_element_size, dontchangecapac, dbit, dtype, pdp11tracksize, completion_delay);
+return SCPE_IOERR;
+}
+
+static t_stat rstsReadBlock(rstsContext *context, uint16 cluster, uint16 block, void *buf)
+{
+t_lba blk = (cluster << context->dcshift) + block;
+t_seccnt sects_read;
+
+if ((sim_disk_rdsect(context->uptr, blk * context->sects, (uint8 *)buf, &sects_read, context->sects) == SCPE_OK) &&
+    (sects_read == context->sects))
+    return SCPE_OK;
+
+return SCPE_IOERR;
+}
+
+static t_stat rstsReadBlockette(rstsContext *context, uint16 link, void *buf)
+{
+uint16 block = (link & DL_BLO) >> DLSH_BLO;
+uint16 dcn = (link & DL_CLO) >> DLSH_CLO;
+uint16 blockette = (link & DL_ENO) >> DLSH_ENO;
+uint8 temp[512];
+
+if ((dcn != 7) && (blockette != 31) &&
+    (block <= (context->map.dc_clus & DC_MASK))) {
+    if (rstsReadBlock(context, context->map.dc_map[dcn], block, temp) == SCPE_OK) {
+        memcpy(buf, &temp[blockette * BLOCKETTE_SZ], BLOCKETTE_SZ);
+        return SCPE_OK;
         }
-    return sim_messagef (SCPE_ARG, "Unable to create differencing VHD: %s\n", gbuf);
     }
-if (sim_switches & SWMASK ('C')) {                      /* create new disk container & copy contents? */
-    char gbuf[CBUFSIZE];
-    const char *dest_fmt = ((DK_GET_FMT (uptr) == DKUF_F_AUTO) || (DK_GET_FMT (uptr) == DKUF_F_VHD)) ? "VHD" : "SIMH";
-    FILE *dest;
-    int saved_sim_switches = sim_switches;
-    int32 saved_sim_quiet = sim_quiet;
-    t_addr target_capac = uptr->capac;
-    t_addr source_capac;
-    uint32 capac_factor;
-    t_stat r;
+return SCPE_IOERR;
+}
 
-    sim_switches = sim_switches & ~(SWMASK ('C'));
-    cptr = get_glyph_nc (cptr, gbuf, 0);                /* get spec */
-    if (*cptr == 0)                                     /* must be more */
-        return SCPE_2FARG;
-    sim_switches |= SWMASK ('R') | SWMASK ('E');
-    sim_quiet = TRUE;
-    /* First open the source of the copy operation */
-    r = sim_disk_attach_ex (uptr, cptr, sector_size, xfer_element_size, dontchangecapac, dbit, dtype, pdp11tracksize, completion_delay, NULL);
-    sim_quiet = saved_sim_quiet;
-    if (r != SCPE_OK) {
-        sim_switches = saved_sim_switches;
-        return sim_messagef (r, "%s: Cannot open copy source: %s - %s\n", sim_uname (uptr), cptr, sim_error_text (r));
-        }
-    source_capac = uptr->capac;
-    sim_messagef (SCPE_OK, "%s: Creating new %s '%s' disk container copied from '%s'\n", sim_uname (uptr), dest_fmt, gbuf, cptr);
-    capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* capacity units (quadword: 8, word: 2, byte: 1) */
-    uptr->capac = target_capac;
-    if (strcmp ("VHD", dest_fmt) == 0)
-        dest = sim_vhd_disk_create (gbuf, ((t_offset)uptr->capac)*capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1));
-    else
-        dest = sim_fopen (gbuf, "wb+");
-    if (!dest) {
-        sim_disk_detach (uptr);
-        return sim_messagef (r, "%s: Cannot create %s disk container '%s'\n", sim_uname (uptr), dest_fmt, gbuf);
-        }
-    else {
-        uint8 *copy_buf = (uint8*) malloc (1024*1024);
-        t_lba lba;
-        t_seccnt sectors_per_buffer = (t_seccnt)((1024*1024)/sector_size);
-        t_lba total_sectors = (t_lba)((target_capac*capac_factor)/(sector_size/((dptr->flags & DEV_SECTORS) ? 512 : 1)));
-        t_seccnt sects = sectors_per_buffer;
-        t_seccnt sects_read;
+static t_stat rstsFind01UFD(rstsContext *context, uint16 *ufd, uint16 *level)
+{
+uint16 dcs = 1 << context->dcshift;
+RSTS_ROOT root;
+uint16 buf[256];
 
-        if (!copy_buf) {
-            if (strcmp ("VHD", dest_fmt) == 0)
-                sim_vhd_disk_close (dest);
-            else
-                fclose (dest);
-            (void)remove (gbuf);
-            sim_disk_detach (uptr);
-            return SCPE_MEM;
-            }
-        sim_messagef (SCPE_OK, "Copying %u sectors each %u bytes in size\n", (uint32)total_sectors, (uint32)sector_size);
-        if (source_capac > target_capac) {
-            sim_messagef (SCPE_OK, "The source container is %u sectors larger than the destination disk container\n",
-                        (t_lba)(((source_capac - target_capac)*capac_factor)/(sector_size/((dptr->flags & DEV_SECTORS) ? 512 : 1))));
-            sim_messagef (SCPE_OK, "these additional sectors will be unavailable on the target drive\n");
-            }
-        for (lba = 0; (lba < total_sectors) && (r == SCPE_OK); lba += sects_read) {
-            uptr->capac = source_capac;
-            sects = sectors_per_buffer;
-            if (lba + sects > total_sectors)
-                sects = total_sectors - lba;
-            r = sim_disk_rdsect (uptr, lba, copy_buf, &sects_read, sects);
-            if ((r == SCPE_OK) && (sects_read > 0)) {
-                uint32 saved_unit_flags = uptr->flags;
-                FILE *save_unit_fileref = uptr->fileref;
-                t_seccnt sects_written;
+if (rstsReadBlock(context, 1, 0, &root) == SCPE_OK) {
+    /*
+     * First validate fields which are common to both the MFD label and
+     * Pack label - we'll use Pack label offsets here.
+     */
+    if ((root.rt_pack.pk_mbm1 == 0177777) &&
+        (rstsValidateClusterSize(root.rt_pack.pk_ppcs, dcs) == SCPE_OK)) {
+        char ch, *tmp = &context->packid[1];
+        uint16 mfd, gfd;
 
-                sim_disk_set_fmt (uptr, 0, dest_fmt, NULL);
-                uptr->fileref = dest;
-                uptr->capac = target_capac;
-                r = sim_disk_wrsect (uptr, lba, copy_buf, &sects_written, sects_read);
-                uptr->fileref = save_unit_fileref;
-                uptr->flags = saved_unit_flags;
-                if (sects_read != sects_written)
-                    r = SCPE_IOERR;
-                sim_messagef (SCPE_OK, "%s: Copied %u/%u sectors.  %d%% complete.\r", sim_uname (uptr), (uint32)(lba + sects_read), (uint32)total_sectors, (int)((((float)lba)*100)/total_sectors));
-                }
-            }
-        if (r == SCPE_OK)
-            sim_messagef (SCPE_OK, "\n%s: Copied %u sectors. Done.\n", sim_uname (uptr), (uint32)total_sectors);
-        else
-            sim_messagef (r, "\n%s: Error copying: %s.\n", sim_uname (uptr), sim_error_text (r));
-        if ((r == SCPE_OK) && (sim_switches & SWMASK ('V'))) {
-            uint8 *verify_buf = (uint8*) malloc (1024*1024);
-            t_seccnt sects_read, verify_read;
+        context->pcs = root.rt_pack.pk_ppcs;
 
-            if (!verify_buf) {
-                if (strcmp ("VHD", dest_fmt) == 0)
-                    sim_vhd_disk_close (dest);
-                else
-                    fclose (dest);
-                (void)remove (gbuf);
-                free (copy_buf);
-                sim_disk_detach (uptr);
-                return SCPE_MEM;
-                }
-            for (lba = 0; (lba < total_sectors) && (r == SCPE_OK); lba += sects_read) {
-                sim_messagef (SCPE_OK, "%s: Verified %u/%u sectors.  %d%% complete.\r", sim_uname (uptr), (uint32)lba, (uint32)total_sectors, (int)((((float)lba)*100)/total_sectors));
-                uptr->capac = source_capac;
-                sects = sectors_per_buffer;
-                if (lba + sects > total_sectors)
-                    sects = total_sectors - lba;
-                r = sim_disk_rdsect (uptr, lba, copy_buf, &sects_read, sects);
-                if (r == SCPE_OK) {
-                    uint32 saved_unit_flags = uptr->flags;
-                    FILE *save_unit_fileref = uptr->fileref;
+        r50Asc(root.rt_pack.pk_packid[0], &context->packid[0]);
+        r50Asc(root.rt_pack.pk_packid[1], &context->packid[3]);
+        context->packid[6] = '\0';
 
-                    sim_disk_set_fmt (uptr, 0, dest_fmt, NULL);
-                    uptr->fileref = dest;
-                    uptr->capac = target_capac;
-                    r = sim_disk_rdsect (uptr, lba, verify_buf, &verify_read, sects_read);
-                    uptr->fileref = save_unit_fileref;
-                    uptr->flags = saved_unit_flags;
-                    if (r == SCPE_OK) {
-                        if ((sects_read != verify_read) ||
-                            (0 != memcmp (copy_buf, verify_buf, verify_read*sector_size)))
-                            r = SCPE_IOERR;
-                        }
-                    }
-                if (r != SCPE_OK)
-                    break;
+        /*
+         * The Pack ID must consist of 1 - 6 alphanumeric characters
+         * padded at the end with spaces.
+         */
+        if (!isalnum(context->packid[0]))
+            return SCPE_IOERR;
+
+        while ((ch = *tmp++) != 0) {
+            if (!isalnum(ch)) {
+                if (ch != ' ')
+                    return SCPE_IOERR;
+
+                while (*tmp)
+                    if (*tmp++ != ' ')
+                        return SCPE_IOERR;
+                break;
                 }
-            if (!sim_quiet) {
-                if (r == SCPE_OK)
-                    sim_messagef (r, "\n%s: Verified %u sectors. Done.\n", sim_uname (uptr), (uint32)total_sectors);
-                else {
-                    t_lba i;
-                    uint32 save_dctrl = dptr->dctrl;
-                    FILE *save_sim_deb = sim_deb;
+            }
 
-                    for (i = 0; i < sects_read; ++i)
-                        if (0 != memcmp (copy_buf+i*sector_size, verify_buf+i*sector_size, sector_size))
-                            break;
-                    sim_printf ("\n%s: Verification Error on lbn %d.\n", sim_uname (uptr), lba+i);
-                    dptr->dctrl = 0xFFFFFFFF;
-                    sim_deb = stdout;
-                    sim_disk_data_trace (uptr,   copy_buf+i*sector_size, lba+i, sector_size, "Expected", TRUE, 1);
-                    sim_disk_data_trace (uptr, verify_buf+i*sector_size, lba+i, sector_size,    "Found", TRUE, 1);
-                    dptr->dctrl = save_dctrl;
-                    sim_deb = save_sim_deb;
+        /*
+         * Determine the pack revision level and, therefore, the path to
+         * [0,1]satt.sys which will allow us to determine the size of the
+         * pack used by RSTS.
+         */
+        if ((root.rt_pack.pk_pstat & PK_UC_NEW) == 0) {
+            uint16 link = root.rt_mfd.ml_ulnk;
+            RSTS_UNAME uname;
+
+            /*
+             * Old format used by RSTS up through V07.x
+             */
+            if (dcs > 16)
+                return SCPE_IOERR;
+
+            *level = PK_LVL0;
+
+            memcpy(&context->map, &root.rt_block[MAP_OFFSET], BLOCKETTE_SZ);
+
+            /*
+             * Scan the MFD name entries looking for [0,1]. Note there will
+             * always be at least 1 entry.
+             */
+            do {
+                if (rstsReadBlockette(context, link, &uname) != SCPE_OK)
+                    break;
+
+                if (uname.un_unam == ((0 << 8) | 1)) {
+                    *ufd = uname.un_uar;
+                    return SCPE_OK;
                     }
-                }
-            free (verify_buf);
+                } while ((link = uname.un_ulnk) != 0);
             }
-        free (copy_buf);
-        if (strcmp ("VHD", dest_fmt) == 0)
-            sim_vhd_disk_close (dest);
-        else
-            fclose (dest);
-        sim_disk_detach (uptr);
-        if (r == SCPE_OK) {
-            created = TRUE;
-            copied = TRUE;
-            strlcpy (tbuf, gbuf, sizeof(tbuf)-1);
-            cptr = tbuf;
-            sim_disk_set_fmt (uptr, 0, dest_fmt, NULL);
-            sim_switches = saved_sim_switches;
+        else {
+            /*
+             * New format used by RSTS V08 and later
+             */
+            switch (root.rt_pack.pk_plvl) {
+                case PK_LVL11:
+                    if (dcs > 16)
+                        return SCPE_IOERR;
+                    break;
+
+                case PK_LVL12:
+                    if (dcs > 64)
+                        return SCPE_IOERR;
+                    break;
+
+                default:
+                    return SCPE_IOERR;
+                }
+            *level = root.rt_pack.pk_plvl;
+
+            mfd = root.rt_pack.pk_mdcn;
+
+            if (rstsReadBlock(context, mfd, 0, buf) == SCPE_OK) {
+                if (IS_VALID_RSTS_MFD((RSTS_MFDBLOCKETTE *)buf)) {
+                    if (rstsReadBlock(context, mfd, 1, buf) == SCPE_OK)
+                        if ((gfd = buf[0]) != 0)
+                            if (rstsReadBlock(context, gfd, 0, buf) == SCPE_OK)
+                                if (IS_VALID_RSTS_GFD((RSTS_GFDBLOCKETTE *)buf, 0)) {
+                                    if (rstsReadBlock(context, gfd, 1, buf) == SCPE_OK)
+                                        if ((*ufd = buf[1]) != 0)
+                                            return SCPE_OK;
+                                    }
+                    }
+                }
             }
-        else
-            return r;
-        /* fall through and open/return the newly created & copied disk container */
         }
     }
-else
-    if (sim_switches & SWMASK ('M')) {                 /* merge difference disk? */
-        char gbuf[CBUFSIZE], *Parent = NULL;
-        FILE *vhd;
+return SCPE_IOERR;
+}
 
-        sim_switches = sim_switches & ~(SWMASK ('M'));
-        get_glyph_nc (cptr, gbuf, 0);                  /* get spec */
-        vhd = sim_vhd_disk_merge (gbuf, &Parent);
-        if (vhd) {
-            t_stat r;
+static t_stat rstsLoadAndScanSATT(rstsContext *context, uint16 uaa, uint16 uar, t_offset *result)
+{
+uint8 bitmap[8192];
+int i, j;
+RSTS_ACNT acnt;
+RSTS_RETR retr;
 
-            sim_vhd_disk_close (vhd);
-            r = sim_disk_attach (uptr, Parent, sector_size, xfer_element_size, dontchangecapac, dbit, dtype, pdp11tracksize, completion_delay);
-            free (Parent);
-            return r;
+if (uar != 0) {
+    if (rstsReadBlockette(context, uaa, &acnt) == SCPE_OK) {
+        uint16 blocks = acnt.ac_usiz;
+        uint16 offset = 0;
+
+        if ((rstsValidateClusterSize(acnt.ac_uclus, context->pcs) != SCPE_OK) ||
+            (blocks > 16))
+            return SCPE_IOERR;
+
+        memset(bitmap, 0xFF, sizeof(bitmap));
+
+        if (blocks != 0) {
+            do {
+                int i, j;
+                uint16 fcl;
+
+                if (rstsReadBlockette(context, uar, &retr) != SCPE_OK)
+                    return SCPE_IOERR;
+
+                for (i = 0; i < RT_ENTRIES; i++) {
+                    if ((fcl = retr.rt_uent[i]) == 0)
+                        goto scanBitmap;
+
+                    for (j = 0; j < acnt.ac_uclus; j++) {
+                        if ((blocks == 0) || (offset >= sizeof(bitmap)))
+                            goto scanBitmap;
+
+                        if (rstsReadBlock(context, fcl, j, &bitmap[offset]) != SCPE_OK)
+                            return SCPE_IOERR;
+
+                        offset += 512;
+                        blocks--;
+                        }
+                    }
+                } while ((uar = retr.rt_ulnk) != 0);
+
+        scanBitmap:
+            for (i = sizeof(bitmap) - 1; i != 0; i--)
+                if (bitmap[i] != 0xFF) {
+                    blocks = i * 8;
+                    for (j = 7; j >= 0; j--)
+                        if ((bitmap[i] & (1 << j)) == 0) {
+                            blocks += j + 1;
+                            goto scanDone;
+                            }
+                    }
+        scanDone:
+            *result = (t_offset)(blocks + 1) * context->pcs;
+            return SCPE_OK;
             }
-        return SCPE_ARG;
         }
+    }
+return SCPE_IOERR;
+}
 
-switch (DK_GET_FMT (uptr)) {                            /* case on format */
-    case DKUF_F_AUTO:                                   /* SIMH format */
-        auto_format = TRUE;
-        if (NULL != (uptr->fileref = sim_vhd_disk_open (cptr, "rb"))) { /* Try VHD */
-            sim_disk_set_fmt (uptr, 0, "VHD", NULL);    /* set file format to VHD */
-            sim_vhd_disk_close (uptr->fileref);         /* close vhd file*/
-            uptr->fileref = NULL;
-            open_function = sim_vhd_disk_open;
-            break;
-            }
-        while (tmp_size < sector_size)
-            tmp_size <<= 1;
-        if (tmp_size ==  sector_size) {                     /* Power of 2 sector size can do RAW */
-            if (NULL != (uptr->fileref = sim_os_disk_open_raw (cptr, "rb"))) {
-                sim_disk_set_fmt (uptr, 0, "RAW", NULL);    /* set file format to RAW */
-                sim_os_disk_close_raw (uptr->fileref);      /* close raw file*/
-                open_function = sim_os_disk_open_raw;
-                storage_function = sim_os_disk_info_raw;
-                uptr->fileref = NULL;
-                break;
+static t_offset get_rsts_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
+{
+DEVICE *dptr;
+t_addr saved_capac;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_addr temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
+uint8 buf[512];
+t_offset ret_val = (t_offset)-1;
+rstsContext context;
+
+if ((dptr = find_dev_from_unit (uptr)) == NULL)
+    return ret_val;
+
+saved_capac = uptr->capac;
+uptr->capac = temp_capac;
+
+context.uptr = uptr;
+context.sects = 512 / ctx->sector_size;
+
+/*
+ * Check all possible device cluster sizes
+ */
+for (context.dcshift = 0; context.dcshift < 8; context.dcshift++) {
+    uint16 ufd, level;
+
+    /*
+     * We need to find [0,1]SATT.SYS to compute the actual size of the disk.
+     * First find the DCN of the [0,1] UFD.
+     */
+    if (rstsFind01UFD(&context, &ufd, &level) == SCPE_OK) {
+        if (rstsReadBlock(&context, ufd, 0, buf) == SCPE_OK) {
+            if (IS_VALID_RSTS_UFD((RSTS_UFDBLOCKETTE *)buf, 0, 1)) {
+                uint16 link = ((RSTS_UFDBLOCKETTE *)buf)->ub_ulnk;
+                RSTS_FNAME fname;
+
+                memcpy(&context.map, &buf[MAP_OFFSET], BLOCKETTE_SZ);
+
+                /*
+                 * Scan the UFD looking for SATT.SYS - the allocation bitmap
+                 */
+                do {
+                    if (rstsReadBlockette(&context, link, &fname) != SCPE_OK)
+                        break;
+
+                    if ((fname.fn_unam[0] == SATT0) &&
+                        (fname.fn_unam[1] == SATT1) &&
+                        (fname.fn_unam[2] == SATT2)) {
+                        if (rstsLoadAndScanSATT(&context, fname.fn_uaa, fname.fn_uar, &ret_val) == SCPE_OK) {
+                            const char *fmt = "???";
+
+                            ret_val *= 512;
+
+                            switch (level) {
+                                case PK_LVL0:
+                                    fmt = "0.0";
+                                    break;
+
+                                case PK_LVL11:
+                                    fmt = "1.1";
+                                    break;
+
+                                case PK_LVL12:
+                                    fmt = "1.2";
+                                    break;
+                                }
+
+                            sim_messagef(SCPE_OK, "%s: '%s' Contains a RSTS File system\n", sim_uname (uptr), uptr->filename);
+                            sim_messagef(SCPE_OK, "%s: Pack ID: %6.6s Revision Level: %3s Pack Clustersize: %d\n",
+                                                                  sim_uname (uptr), context.packid, fmt, context.pcs);
+                            sim_messagef(SCPE_OK, "%s: Last Unallocated Sector In File System: %u\n", sim_uname (uptr), (uint32)((ret_val / 512) - 1));
+                            goto cleanup_done;
+                            }
+                        }
+                    } while ((link = fname.fn_ulnk) != 0);
                 }
             }
-        sim_disk_set_fmt (uptr, 0, "SIMH", NULL);       /* set file format to SIMH */
-        open_function = sim_fopen;
-        break;
-    case DKUF_F_STD:                                    /* SIMH format */
-        if (NULL != (uptr->fileref = sim_vhd_disk_open (cptr, "rb"))) { /* Try VHD first */
-            sim_disk_set_fmt (uptr, 0, "VHD", NULL);    /* set file format to VHD */
-            sim_vhd_disk_close (uptr->fileref);         /* close vhd file*/
-            uptr->fileref = NULL;
-            open_function = sim_vhd_disk_open;
-            auto_format = TRUE;
-            break;
-            }
-        open_function = sim_fopen;
-        break;
-    case DKUF_F_VHD:                                    /* VHD format */
-        open_function = sim_vhd_disk_open;
-        create_function = sim_vhd_disk_create;
-        storage_function = sim_os_disk_info_raw;
-        break;
-    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
-        if (NULL != (uptr->fileref = sim_vhd_disk_open (cptr, "rb"))) { /* Try VHD first */
-            sim_disk_set_fmt (uptr, 0, "VHD", NULL);    /* set file format to VHD */
-            sim_vhd_disk_close (uptr->fileref);         /* close vhd file*/
-            uptr->fileref = NULL;
-            open_function = sim_vhd_disk_open;
-            auto_format = TRUE;
-            break;
-            }
-        open_function = sim_os_disk_open_raw;
-        storage_function = sim_os_disk_info_raw;
-        break;
-    default:
-        return SCPE_IERR;
-    }
-uptr->filename = (char *) calloc (CBUFSIZE, sizeof (char));/* alloc name buf */
-uptr->disk_ctx = ctx = (struct disk_context *)calloc(1, sizeof(struct disk_context));
-if ((uptr->filename == NULL) || (uptr->disk_ctx == NULL))
-    return _err_return (uptr, SCPE_MEM);
-strlcpy (uptr->filename, cptr, CBUFSIZE);               /* save name */
-ctx->sector_size = (uint32)sector_size;                 /* save sector_size */
-ctx->capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* save capacity units (quadword: 8, word: 2, byte: 1) */
-ctx->xfer_element_size = (uint32)xfer_element_size;     /* save xfer_element_size */
-ctx->dptr = dptr;                                       /* save DEVICE pointer */
-ctx->dbit = dbit;                                       /* save debug bit */
-ctx->media_removed = 0;                                 /* default present */
-sim_debug_unit (ctx->dbit, uptr, "sim_disk_attach(unit=%d,filename='%s')\n", (int)(uptr - ctx->dptr->units), uptr->filename);
-ctx->auto_format = auto_format;                         /* save that we auto selected format */
-ctx->storage_sector_size = (uint32)sector_size;         /* Default */
-if ((sim_switches & SWMASK ('R')) ||                    /* read only? */
-    ((uptr->flags & UNIT_RO) != 0)) {
-    if (((uptr->flags & UNIT_ROABLE) == 0) &&           /* allowed? */
-        ((uptr->flags & UNIT_RO) == 0))
-        return sim_messagef (_err_return (uptr, SCPE_NORO), "%s: Read Only operation not allowed\n", /* no, error */
-                                                        sim_uname (uptr));
-    uptr->fileref = open_function (cptr, "rb");         /* open rd only */
-    if (uptr->fileref == NULL)                          /* open fail? */
-        return sim_messagef (_err_return (uptr, SCPE_OPENERR), "%s: Can't open '%s': %s\n", /* yes, error */
-                                            sim_uname (uptr), cptr, strerror (errno));
-    uptr->flags = uptr->flags | UNIT_RO;                /* set rd only */
-    sim_messagef (SCPE_OK, "%s: Unit is read only\n", sim_uname (uptr));
+        }
     }
-else {                                                  /* normal */
-    uptr->fileref = open_function (cptr, "rb+");        /* open r/w */
-    if (uptr->fileref == NULL) {                        /* open fail? */
-        if ((errno == EROFS) || (errno == EACCES)) {    /* read only? */
-            if ((uptr->flags & UNIT_ROABLE) == 0)       /* allowed? */
-                return sim_messagef (_err_return (uptr, SCPE_NORO), "%s: Read Only operation not allowed\n", /* no, error */
-                                                                sim_uname (uptr));
-            uptr->fileref = open_function (cptr, "rb"); /* open rd only */
-            if (uptr->fileref == NULL)                  /* open fail? */
-                return sim_messagef (_err_return (uptr, SCPE_OPENERR), "%s: Can't open '%s': %s\n", /* yes, error */
-                                                    sim_uname (uptr), cptr, strerror (errno));
-            uptr->flags = uptr->flags | UNIT_RO;        /* set rd only */
-            sim_messagef (SCPE_OK, "%s: Unit is read only\n", sim_uname (uptr));
-            }
-        else {                                          /* other error? */
-            if ((sim_switches & SWMASK ('E')) ||        /* must exist? */
-                (errno != ENOENT))                      /* or must not re-create? */
-                return sim_messagef (_err_return (uptr, SCPE_OPENERR), "%s: Cannot open '%s' - %s\n",
-                                     sim_uname (uptr), cptr, strerror (errno));
-            if (create_function)
-                uptr->fileref = create_function (cptr, ((t_offset)uptr->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1));/* create new file */
-            else
-                uptr->fileref = open_function (cptr, "wb+");/* open new file */
-            if (uptr->fileref == NULL)                  /* open fail? */
-                return sim_messagef (_err_return (uptr, SCPE_OPENERR), "%s: Cannot create '%s' - %s\n",
-                                     sim_uname (uptr), cptr, strerror (errno));
-            sim_messagef (SCPE_OK, "%s: Creating new file: %s\n", sim_uname (uptr), cptr);
-            created = TRUE;
-            }
-        }                                               /* end if null */
-    }                                                   /* end else */
-(void)get_disk_footer (uptr);
-if ((DK_GET_FMT (uptr) == DKUF_F_VHD) || (ctx->footer)) {
-    uint32 container_sector_size = 0, container_xfer_element_size = 0, container_sectors = 0;
-    char created_name[64];
-    const char *container_dtype = ctx->footer ? (char *)ctx->footer->DriveType : sim_vhd_disk_get_dtype (uptr->fileref, &container_sector_size, &container_xfer_element_size, created_name, NULL);
+cleanup_done:
+uptr->capac = saved_capac;
+if (readonly)
+    *readonly = sim_disk_wrp (uptr);
+return ret_val;
+}
 
-    if (ctx->footer) {
-        container_sector_size = NtoHl (ctx->footer->SectorSize);
-        container_sectors = NtoHl (ctx->footer->SectorCount);
-        xfer_element_size = NtoHl (ctx->footer->TransferElementSize);
-        strlcpy (created_name, (char *)ctx->footer->CreatingSimulator, sizeof (created_name));
-        }
-    if ((DK_GET_FMT (uptr) == DKUF_F_VHD) && created && dtype) {
-        sim_vhd_disk_set_dtype (uptr->fileref, dtype, ctx->sector_size, ctx->xfer_element_size);
-        (void)get_disk_footer (uptr);
-        container_dtype = (char *)ctx->footer->DriveType;
-        }
-    if (dtype) {
-        char cmd[32];
-        t_stat r = SCPE_OK;
+#pragma pack(push,1)
+typedef struct _RT11_HomeBlock {
+    uint8   hb_b_bbtable[130];
+    uint8   hb_b_unused1[2];
+    uint8   hb_b_initrestore[38];
+    uint8   hb_b_bup[18];
+    uint8   hb_b_unused2[260];
+    uint16  hb_w_reserved1;
+    uint16  hb_w_reserved2;
+    uint8   hb_b_unused3[14];
+    uint16  hb_w_clustersize;
+    uint16  hb_w_firstdir;
+    uint16  hb_w_sysver;
+#define HB_C_SYSVER_V3A 36521
+#define HB_C_SYSVER_V04 36434
+#define HB_C_SYSVER_V05 36435
+    uint8   hb_b_volid[12];
+    uint8   hb_b_owner[12];
+    uint8   hb_b_sysid[12];
+#define HB_C_SYSID      "DECRT11A    "
+#define HB_C_VMSSYSID   "DECVMSEXCHNG"
+    uint8   hb_b_unused4[2];
+    uint16  hb_w_checksum;
+    } RT11_HomeBlock;
 
-        if ((strcmp (container_dtype, dtype) == 0) ||
-            (((container_sector_size == 0) || (container_sector_size == ctx->sector_size)) &&
-             ((container_xfer_element_size == 0) || (container_xfer_element_size == ctx->xfer_element_size)))) {
-            if (strcmp (container_dtype, dtype) != 0) {
-                if ((drivetypes != NULL) || (!dontchangecapac)) { /* Autosize allowed */
-                    snprintf (cmd, sizeof (cmd), "%s %s", sim_uname (uptr), container_dtype);
-                    r = set_cmd (0, cmd);
-                    if (r != SCPE_OK)
-                        r = sim_messagef (SCPE_INCOMPDSK, "%s: Cannot set to drive type %s\n", sim_uname (uptr), container_dtype);
-                    }
-                current_unit_size = ((t_offset)uptr->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1);
-                if (ctx->container_size > current_unit_size) {
-                    if ((uptr->flags & UNIT_RO) != 0)                   /* Not Opening read only? */
-                        r = sim_messagef (SCPE_OK, "%s: Read Only access to inconsistent drive type allowed\n", sim_uname (uptr));
-                    else
-                        r = sim_messagef (SCPE_INCOMPDSK, "%s: '%s' can only be attached Read Only\n", sim_uname (uptr), cptr);
-                    }
-                }
-            else { /* Type already matches, Need to confirm compatibility */
-                t_addr saved_capac = uptr->capac;
-                t_lba current_unit_sectors = (t_lba)((dptr->flags & DEV_SECTORS) ? uptr->capac : (uptr->capac*ctx->capac_factor)/ctx->sector_size);
+typedef struct _RT11_DirHeader {
+    uint16  dh_w_count;
+    uint16  dh_w_next;
+    uint16  dh_w_highest;
+#define DH_C_MAXSEG     31
+    uint16  dh_w_extra;
+    uint16  dh_w_start;
+    } RT11_DirHeader;
 
-                if ((container_sector_size != 0) && (sector_size != container_sector_size))
-                    r = sim_messagef (SCPE_OPENERR, "%s: Incompatible Container Sector Size %d\n", sim_uname (uptr), container_sector_size);
-                else {
-                    if (dontchangecapac &&
-                        ((((t_lba)(ctx->container_size/sector_size) > current_unit_sectors)) ||
-                         ((container_sectors != 0) && (container_sectors != current_unit_sectors)))) {
-                         r = sim_messagef (SCPE_OK, "%s: Container has %u sectors, drive has: %u sectors\n", sim_uname (uptr), container_sectors, current_unit_sectors);
-                         if (container_sectors != 0)
-                             r = sim_messagef (SCPE_INCOMPDSK, "%s: %s container created by the %s simulator is incompatible with the %s device on the %s simulator\n", sim_uname (uptr), container_dtype, created_name, uptr->dptr->name, sim_name);
-                         else
-                             r = sim_messagef (SCPE_INCOMPDSK, "%s: disk container %s is incompatible with the %s device\n", sim_uname (uptr), uptr->filename, uptr->dptr->name);
-                         if ((uptr->flags & UNIT_RO) != 0)
-                             r = sim_messagef (SCPE_OK, "%s: Read Only access to incompatible %s container '%s' allowed\n", sim_uname (uptr), container_dtype, uptr->filename);
-                         if (container_sectors < current_unit_sectors) {
-                             r = sim_messagef (SCPE_BARE_STATUS (r), "%s: Since the container is smaller than the drive, this might be useful:\n", sim_uname (uptr));
-                             r = sim_messagef (SCPE_BARE_STATUS (r), "%s:   sim> ATTACH %s -C New-%s %s\n", sim_uname (uptr), sim_uname (uptr), uptr->filename, uptr->filename);
-                             }
-                        }
-                    }
-                if (r == SCPE_OK) {
-                    int32 saved_show_message = sim_show_message;
+typedef struct _RT11_DirEntry {
+    uint16  de_w_status;
+#define DE_C_PRE        0000020
+#define DE_C_TENT       0000400
+#define DE_C_EMPTY      0001000
+#define DE_C_PERM       0002000
+#define DE_C_EOS        0004000
+#define DE_C_READ       0040000
+#define DE_C_PROT       0100000
+    uint16  de_w_fname1;
+    uint16  de_w_fname2;
+    uint16  de_w_ftype;
+    uint16  de_w_length;
+    uint16  de_w_jobchannel;
+    uint16  de_w_creationdate;
+    } RT11_DirEntry;
+#pragma pack(pop)
 
-                    snprintf (cmd, sizeof (cmd), "%s %s", sim_uname (uptr), container_dtype);
-                    set_cmd (0, "NOMESSAGE");
-                    set_cmd (0, cmd);
-                    sim_show_message = saved_show_message;
-                    }
-                }
-            if (r == SCPE_OK)
-                autosized = TRUE;
-            }
-        else
-            r = sim_messagef (SCPE_INCOMPDSK, "%s: %s container created by the %s simulator is incompatible with the %s device on the %s simulator\n", sim_uname (uptr), container_dtype, created_name, uptr->dptr->name, sim_name);
-        if (r != SCPE_OK) {
-            uptr->flags |= UNIT_ATT;
-            sim_disk_detach (uptr);                         /* report error now */
-            sprintf (cmd, "%s%d %s", dptr->name, (int)(uptr-dptr->units), dtype);/* restore original dtype */
-            set_cmd (0, cmd);
-            return r;
-            }
+#define RT11_MAXPARTITIONS      256             /* Max partitions supported */
+#define RT11_HOME                 1             /* Home block # */
+
+#define RT11_NOPART             0
+#define RT11_SINGLEPART         1
+#define RT11_MULTIPART          2
+
+static int rt11_get_partition_type(RT11_HomeBlock *home, int part)
+{
+if (strncmp((char *)&home->hb_b_sysid, HB_C_SYSID, strlen(HB_C_SYSID)) == 0) {
+    uint16 type = home->hb_w_sysver;
+
+    if (part == 0) {
+        if ((type == HB_C_SYSVER_V3A) || (type == HB_C_SYSVER_V04))
+            return RT11_SINGLEPART;
         }
+
+    if (type == HB_C_SYSVER_V05)
+        return RT11_MULTIPART;
     }
-uptr->flags |= UNIT_ATT;
-uptr->pos = 0;
 
-/* Get Device attributes if they are available */
-if (storage_function)
-    storage_function (uptr->fileref, &ctx->storage_sector_size, &ctx->removable, &ctx->is_cdrom);
+if (strncmp((char *)&home->hb_b_sysid, HB_C_VMSSYSID, strlen(HB_C_VMSSYSID)) == 0)
+    return RT11_SINGLEPART;
 
-if ((created) && (!copied)) {
-    t_stat r = SCPE_OK;
-    uint8 *secbuf = (uint8 *)calloc (128, ctx->sector_size);     /* alloc temp sector buf */
+return RT11_NOPART;
+}
 
-    /*
-       On a newly created disk, we write zeros to the whole disk.
-       This serves 3 purposes:
-         1) it avoids strange allocation delays writing newly allocated
-            storage at the end of the disk during simulator operation
-         2) it allocates storage for the whole disk at creation time to
-            avoid strange failures which may happen during simulator execution
-            if the containing disk is full
-         3) it leaves a Simh Format disk at the intended size so it may
-            subsequently be autosized with the correct size.
-    */
-    if (secbuf == NULL)
-        r = SCPE_MEM;
-    if (r == SCPE_OK) { /* Write all blocks */
-        t_lba lba;
-        t_lba total_lbas = (t_lba)((((t_offset)uptr->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1))/ctx->sector_size);
+static t_offset get_rt11_filesystem_size (UNIT *uptr, uint32 physsectsz, t_bool *readonly)
+{
+DEVICE *dptr;
+t_addr saved_capac;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_addr temp_capac = (sim_toffset_64 ? (t_addr)0xFFFFFFFFu : (t_addr)0x7FFFFFFFu);  /* Make sure we can access the largest sector */
+uint8 sector_buf[1024];
+RT11_HomeBlock Home;
+t_seccnt sects_read;
+RT11_DirHeader *dir_hdr = (RT11_DirHeader *)sector_buf;
+int partitions = 0;
+int part;
+uint32 base;
+uint32 dir_sec;
+uint16 dir_seg;
+uint16 version = 0;
+t_offset ret_val = (t_offset)-1;
 
-        for (lba = 0; (r == SCPE_OK) && (lba < total_lbas); lba += 128) {
-            t_seccnt sectors = ((lba + 128) <= total_lbas) ? 128 : total_lbas - lba;
+if ((dptr = find_dev_from_unit (uptr)) == NULL)
+     return ret_val;
+saved_capac = uptr->capac;
+uptr->capac = temp_capac;
 
-            r = sim_disk_wrsect (uptr, lba, secbuf, NULL, sectors);
-            }
-        }
-    free (secbuf);
-    if (r != SCPE_OK) {
-        sim_disk_detach (uptr);                         /* report error now */
-        (void)remove (cptr);                            /* remove the created file */
-        return SCPE_OPENERR;
-        }
-    if (sim_switches & SWMASK ('I')) {                  /* Initialize To Sector Address */
-        size_t init_buf_size = 1024*1024;
-        uint8 *init_buf = (uint8*) malloc (init_buf_size);
-        t_lba lba, sect;
-        uint32 capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* capacity units (quadword: 8, word: 2, byte: 1) */
-        t_seccnt sectors_per_buffer = (t_seccnt)((init_buf_size)/sector_size);
-        t_lba total_sectors = (t_lba)((uptr->capac*capac_factor)/(sector_size/((dptr->flags & DEV_SECTORS) ? 512 : 1)));
-        t_seccnt sects = sectors_per_buffer;
+for (part = 0; part < RT11_MAXPARTITIONS; part++) {
+    uint16 seg_highest = 0;
+    int type;
 
-        if (!init_buf) {
-            sim_disk_detach (uptr);                         /* report error now */
-            (void)remove (cptr);
-            return SCPE_MEM;
-            }
-        sim_messagef (SCPE_OK, "Initializing %u sectors each %u bytes in size with the sector address\n", (uint32)total_sectors, (uint32)sector_size);
-        for (lba = 0; (lba < total_sectors) && (r == SCPE_OK); lba += sects) {
-            t_seccnt sects_written;
+    /*
+     * RX01/RX02 media can only have a single partition
+     */
+    if ((part != 0) && (physsectsz != 0))
+      break;
 
-            sects = sectors_per_buffer;
-            if (lba + sects > total_sectors)
-                sects = total_sectors - lba;
-            for (sect = 0; sect < sects; sect++) {
-                t_lba offset;
-                for (offset = 0; offset < sector_size; offset += sizeof(uint32))
-                    *((uint32 *)&init_buf[sect*sector_size + offset]) = (uint32)(lba + sect);
+    base = part << 16;
+
+    if (_DEC_rdsect(uptr, (base + RT11_HOME) * (512 / ctx->sector_size), (uint8 *)&Home, &sects_read, 512 / ctx->sector_size, physsectsz) ||
+        (sects_read != (512 / ctx->sector_size)))
+        goto Return_Cleanup;
+
+    type = rt11_get_partition_type(&Home, part);
+
+    if (type != RT11_NOPART) {
+        uint16 highest = 0;
+        uint8 seg_seen[DH_C_MAXSEG + 1];
+
+        memset(seg_seen, 0, sizeof(seg_seen));
+
+        partitions++;
+
+        dir_seg = 1;
+        do {
+            int offset = sizeof(RT11_DirHeader);
+            int dir_size = sizeof(RT11_DirEntry);
+            uint16 cur_blk;
+
+            if (seg_seen[dir_seg]++ != 0)
+                goto Next_Partition;
+
+            dir_sec = Home.hb_w_firstdir + ((dir_seg - 1) * 2);
+
+            if ((_DEC_rdsect(uptr, (base + dir_sec) * (512 / ctx->sector_size), sector_buf, &sects_read, 1024 / ctx->sector_size, physsectsz)) ||
+                (sects_read != (1024 / ctx->sector_size)))
+                goto Return_Cleanup;
+
+            if (dir_seg == 1) {
+                seg_highest = dir_hdr->dh_w_highest;
+                if (seg_highest > DH_C_MAXSEG)
+                    goto Next_Partition;
                 }
-            r = sim_disk_wrsect (uptr, lba, init_buf, &sects_written, sects);
-            if ((r != SCPE_OK) || (sects != sects_written)) {
-                free (init_buf);
-                sim_disk_detach (uptr);                         /* report error now */
-                (void)remove (cptr);                            /* remove the created file */
-                return sim_messagef (SCPE_OPENERR, "Error initializing each sector with its address: %s\n",
-                                                   (r == SCPE_OK) ? sim_error_text (r) : "sectors written not what was requested");
+            dir_size += dir_hdr->dh_w_extra;
+            cur_blk = dir_hdr->dh_w_start;
+
+            while ((1024 - offset) >= dir_size) {
+                RT11_DirEntry *dir_entry = (RT11_DirEntry *)&sector_buf[offset];
+
+                if (dir_entry->de_w_status & DE_C_EOS)
+                    break;
+
+                /*
+                 * Within each directory segment the bas address should never
+                 * decrease.
+                 */
+                if (((cur_blk + dir_entry->de_w_length) & 0xFFFF) < cur_blk)
+                    goto Next_Partition;
+
+                cur_blk += dir_entry->de_w_length;
+                offset += dir_size;
                 }
-            sim_messagef (SCPE_OK, "%s: Initialized To Sector Address %u/%u sectors.  %d%% complete.\r", sim_uname (uptr), (uint32)(lba + sects_written), (uint32)total_sectors, (int)((((float)lba)*100)/total_sectors));
-            }
-        sim_messagef (SCPE_OK, "%s: Initialized To Sector Address %u sectors.  100%% complete.       \n", sim_uname (uptr), (uint32)total_sectors);
-        free (init_buf);
+            if (cur_blk > highest)
+                highest = cur_blk;
+            dir_seg = dir_hdr->dh_w_next;
+
+            if (dir_seg > seg_highest)
+                goto Next_Partition;
+            } while (dir_seg != 0);
+
+        ret_val = (t_offset)((base + highest) * (t_offset)512);
+        version = Home.hb_w_sysver;
+
+        if (type == RT11_SINGLEPART)
+          break;
         }
-    if (pdp11tracksize)
-        sim_disk_pdp11_bad_block (uptr, pdp11tracksize, sector_size/sizeof(uint16));
+Next_Partition:
+    ;
     }
-if (sim_switches & SWMASK ('K')) {
-    t_stat r = SCPE_OK;
-    t_lba lba, sect;
-    uint32 capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* capacity units (word: 2, byte: 1) */
-    t_seccnt sectors_per_buffer = (t_seccnt)((1024*1024)/sector_size);
-    t_lba total_sectors = (t_lba)((uptr->capac*capac_factor)/(sector_size/((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
-    t_seccnt sects = sectors_per_buffer;
-    t_seccnt sects_verify;
-    uint8 *verify_buf = (uint8*) malloc (1024*1024);
 
-    if (!verify_buf) {
-        sim_disk_detach (uptr);                         /* report error now */
-        return SCPE_MEM;
-        }
-    for (lba = 0; (lba < total_sectors) && (r == SCPE_OK); lba += sects_verify) {
-        sects = sectors_per_buffer;
-        if (lba + sects > total_sectors)
-            sects = total_sectors - lba;
-        r = sim_disk_rdsect (uptr, lba, verify_buf, &sects_verify, sects);
-        if (r == SCPE_OK) {
-            if (sects != sects_verify)
-                sim_printf ("\n%s: Verification Error when reading lbn %d(0x%X) of %d(0x%X) Requested %u sectors, read %u sectors.\n",
-                            sim_uname (uptr), (int)lba, (int)lba, (int)total_sectors, (int)total_sectors, sects, sects_verify);
-            for (sect = 0; sect < sects_verify; sect++) {
-                t_lba offset;
-                t_bool sect_error = FALSE;
+Return_Cleanup:
+if (partitions) {
+    const char *parttype;
 
-                for (offset = 0; offset < sector_size; offset += sizeof(uint32)) {
-                    if (*((uint32 *)&verify_buf[sect*sector_size + offset]) != (uint32)(lba + sect)) {
-                        sect_error = TRUE;
-                        break;
-                        }
-                    }
-                if (sect_error) {
-                    uint32 save_dctrl = dptr->dctrl;
-                    FILE *save_sim_deb = sim_deb;
+    switch (version) {
+        case HB_C_SYSVER_V3A:
+            parttype = "V3A";
+            break;
 
-                    sim_printf ("\n%s: Verification Error on lbn %d(0x%X) of %d(0x%X).\n", sim_uname (uptr), (int)(lba+sect), (int)(lba+sect), (int)total_sectors, (int)total_sectors);
-                    dptr->dctrl = 0xFFFFFFFF;
-                    sim_deb = stdout;
-                    sim_disk_data_trace (uptr, verify_buf+sect*sector_size, lba+sect, sector_size,    "Found", TRUE, 1);
-                    dptr->dctrl = save_dctrl;
-                    sim_deb = save_sim_deb;
-                    }
-                }
-            }
-        sim_messagef (SCPE_OK, "%s: Verified containing Sector Address %u/%u sectors.  %d%% complete.\r", sim_uname (uptr), (uint32)lba, (uint32)total_sectors, (int)((((float)lba)*100)/total_sectors));
+        case HB_C_SYSVER_V04:
+            parttype = "V04";
+            break;
+
+        case HB_C_SYSVER_V05:
+            parttype = "V05";
+            break;
+
+        default:
+            parttype = "???";
+            break;
         }
-    sim_messagef (SCPE_OK, "%s: Verified containing Sector Address %u sectors.  100%% complete.         \n", sim_uname (uptr), (uint32)lba);
-    free (verify_buf);
-    uptr->dynflags |= UNIT_DISK_CHK;
+    sim_messagef (SCPE_OK, "%s: '%s' Contains RT11 partitions\n", sim_uname (uptr), uptr->filename);
+    sim_messagef (SCPE_OK, "%d valid partition%s, Type: %s, Sectors On Disk: %u\n", partitions, partitions == 1 ? "" : "s", parttype, (uint32)(ret_val / 512));
     }
+uptr->capac = saved_capac;
+if (readonly)
+    *readonly = sim_disk_wrp (uptr);
+return ret_val;
+}
 
-if (get_disk_footer (uptr) != SCPE_OK) {
-    sim_disk_detach (uptr);
-    return SCPE_OPENERR;
-    }
-filesystem_size = get_filesystem_size (uptr, NULL);
-if (filesystem_size != (t_offset)-1)
-    filesystem_size += reserved_sectors * sector_size;
-container_size = sim_disk_size (uptr);
-if ((filesystem_size == (t_offset)-1) &&
-    (ctx->footer != NULL))                      /* The presence of metadata means we already */
-    filesystem_size = ctx->container_size;      /* know the interesting disk size */
-current_unit_size = ((t_offset)uptr->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1);
-if (container_size && (container_size != (t_offset)-1)) {
-    if (dontchangecapac) {  /* autosize by changing drive type */
-        t_addr saved_capac = uptr->capac;
+t_offset pseudo_filesystem_size = 0;        /* Dummy file system check return used during testing */
 
-        if (drivetypes != NULL) {
-            if (filesystem_size != (t_offset)-1) {  /* File System found? */
-                /* Walk through all potential drive types until we find one the right size */
-                while (*drivetypes != NULL) {
-                    char cmd[CBUFSIZE];
-                    t_stat st;
+typedef t_offset (*FILESYSTEM_CHECK)(UNIT *uptr, uint32, t_bool *);
 
-                    uptr->flags &= ~UNIT_ATT;   /* temporarily mark as un-attached */
-                    sprintf (cmd, "%s %s", sim_uname (uptr), *drivetypes);
-                    st = set_cmd (0, cmd);
-                    uptr->flags |= UNIT_ATT;    /* restore attached indicator */
-                    if (st == SCPE_OK)
-                        current_unit_size = ((t_offset)uptr->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1);
-                    if (current_unit_size >= filesystem_size)
-                        break;
-                    ++drivetypes;
-                    }
-            if (filesystem_size > current_unit_size) {
-                t_stat r = SCPE_FSSIZE;
-                char *capac1;
-
-                uptr->capac = (t_addr)(filesystem_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
-                capac1 = strdup (sprint_capac (dptr, uptr));
-                uptr->capac = saved_capac;
-                r = sim_messagef (r, "%s: The file system on the disk %s is larger than simulated device (%s > %s)\n",
-                                    sim_uname (uptr), cptr, capac1, sprint_capac (dptr, uptr));
-                free (capac1);
-                sim_disk_detach (uptr);
-                return r;
-                }
-            else
-                autosized = TRUE;
-            }
-            else {
-                if (!created && (ctx->footer == NULL)) {
-                    sim_messagef (SCPE_OK, "%s: Amount of data in use in disk container '%s' cannot be determined, skipping autosizing\n", sim_uname (uptr), cptr);
-                    if (container_size > current_unit_size) {
-                        t_stat r = SCPE_FSSIZE;
-                        char *capac1;
-
-                        uptr->capac = (t_addr)(container_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
-                        capac1 = strdup (sprint_capac (dptr, uptr));
-                        uptr->capac = saved_capac;
-                        r = sim_messagef (r, "%s: The disk container '%s' is larger than simulated device (%s > %s)\n",
-                                            sim_uname (uptr), cptr, capac1, sprint_capac (dptr, uptr));
-                        free (capac1);
-                        sim_disk_detach (uptr);
-                        return r;
-                        }
-                    }
-                }
-            }
-        if (filesystem_size != (t_offset)-1) {
-            if (filesystem_size > current_unit_size) {
-                t_stat r = SCPE_FSSIZE;
-                char *capac1;
-
-                uptr->capac = (t_addr)(filesystem_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
-                capac1 = strdup (sprint_capac (dptr, uptr));
-                uptr->capac = saved_capac;
-                r = sim_messagef (r, "%s: The file system on the %s disk container is larger than simulated device (%s > %s)\n",
-                                    sim_uname (uptr), cptr, capac1, sprint_capac (dptr, uptr));
-                free (capac1);
-                sim_disk_detach (uptr);
-                return r;
-                }
-            if (filesystem_size == current_unit_size)
-                autosized = TRUE;
-            }
-        if ((container_size != current_unit_size)) {
-            if (container_size < current_unit_size) {
-                if (DKUF_F_VHD == DK_GET_FMT (uptr)){
-                    t_stat r = SCPE_INCOMPDSK;
-                    const char *container_dtype = ctx->footer ? (const char *)ctx->footer->DriveType : "";
-                    char *capac1;
-
-                    uptr->capac = (t_addr)(container_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
-                    capac1 = strdup (sprint_capac (dptr, uptr));
-                    uptr->capac = saved_capac;
-                    r = sim_messagef (r, "%s: non expandable %s%sdisk container '%s' is smaller than simulated device (%s < %s)\n",
-                                        sim_uname (uptr), container_dtype, (*container_dtype != '\0') ? " " : "", cptr, capac1, sprint_capac (dptr, uptr));
-                    free (capac1);
-                    sim_disk_detach (uptr);
-                    return r;
-                    }
-                }
-            else { /* (container_size > current_unit_size) */
-                if (0 == (uptr->flags & UNIT_RO)) {
-                    t_stat r = SCPE_OK;
-                    int32 saved_switches = sim_switches;
-                    const char *container_dtype;
-                    char *capac1;
+static t_offset get_filesystem_size (UNIT *uptr, t_bool *readonly)
+{
+static FILESYSTEM_CHECK checks[] = {
+    &get_ods2_filesystem_size,
+    &get_ods1_filesystem_size,
+    &get_ultrix_filesystem_size,
+    &get_iso9660_filesystem_size,
+    &get_rsts_filesystem_size,
+    &get_rt11_filesystem_size,          /* This should be the last entry
+                                           in the table to reduce the
+                                           possibility of matching an RT-11
+                                           container file stored in another
+                                           filesystem */
+    NULL
+    };
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+uint32 saved_sector_size = ctx->sector_size;
+t_offset ret_val = (t_offset)-1;
+int i;
 
-                    uptr->capac = (t_addr)(container_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
-                    capac1 = strdup (sprint_capac (dptr, uptr));
-                    uptr->capac = saved_capac;
-                    sim_disk_detach (uptr);
-                    sim_switches = SWMASK ('R');
-                    r = sim_disk_attach_ex (uptr, cptr, sector_size, xfer_element_size, dontchangecapac, dbit, dtype, pdp11tracksize, completion_delay, NULL);
-                    container_dtype = ctx->footer ? (const char *)ctx->footer->DriveType : "";
-                    sim_switches = saved_switches;
-                    if (r == SCPE_OK)
-                        r = sim_messagef (SCPE_OK, "%s: %s%sdisk container '%s' is larger than simulated device (%s > %s) Read Only Forced\n",
-                                sim_uname (uptr), container_dtype, (*container_dtype != '\0') ? " " : "", cptr,
-                                capac1, sprint_capac (dptr, uptr));
-                    free (capac1);
-                    return r;
-                    }
-                }
-            }
-        }
-    else {          /* Autosize by changing capacity */
-        if (filesystem_size != (t_offset)-1) {              /* Known file system data size AND */
-            if (filesystem_size >= container_size) {        /*    Data size >= container size? */
-                container_size = filesystem_size +          /*       Use file system data size */
-                             (pdp11tracksize * sector_size);/*       plus any bad block data beyond the file system */
-                autosized = TRUE;
-                }
-            }
-        else {                                              /* Unrecognized file system */
-            if (container_size < current_unit_size)         /*     Use MAX of container or current device size */
-                if ((DKUF_F_VHD != DK_GET_FMT (uptr)) &&    /*     when size can be expanded */
-                    (0 == (uptr->flags & UNIT_RO))) {
-                    container_size = current_unit_size;     /*     Use MAX of container or current device size */
-                    autosized = TRUE;
-                    }
-            }
-        uptr->capac = (t_addr)(container_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1)));  /* update current size */
-        }
+if (pseudo_filesystem_size != 0) {      /* Dummy file system size mechanism? */
+    sim_messagef (SCPE_OK, "%s: '%s' Pseudo File System containing %u %d byte sectors\n", sim_uname (uptr), uptr->filename, (uint32)(pseudo_filesystem_size / ctx->sector_size), ctx->sector_size);
+    return pseudo_filesystem_size;
     }
 
-if ((uptr->flags & UNIT_RO) == 0) {
-    t_bool readonly;
-    int32 saved_quiet = sim_quiet;
-
-    sim_quiet = 1;
-    get_filesystem_size (uptr, &readonly);
-    if (readonly) {
-        sim_disk_detach (uptr);
-        sim_switches |= SWMASK ('R');
-        sim_disk_attach_ex2 (uptr, cptr, sector_size, xfer_element_size, dontchangecapac,
-                            dbit, dtype, pdp11tracksize, completion_delay, drivetypes,
-                            reserved_sectors);
-
+for (i = 0; checks[i] != NULL; i++)
+    if ((ret_val = checks[i] (uptr, 0, readonly)) != (t_offset)-1) {
+        /* ISO files that haven't already been determined to be ISO 9660
+         * which contain a known file system are also marked read-only
+         * now.  This fits early DEC distribution CDs that were created
+         * before ISO 9660 was standardized and operating support was added.
+         */
+        if ((readonly != NULL)          &&
+            (*readonly == FALSE)        &&
+            (NULL != match_ext (uptr->filename, "ISO")))
+            *readonly = TRUE;
+        return ret_val;
         }
-    sim_quiet = saved_quiet;
-    }
-if (dtype && (created || (autosized && (ctx->footer == NULL))))
-    store_disk_footer (uptr, dtype);
-
-#if defined (SIM_ASYNCH_IO)
-sim_disk_set_async (uptr, completion_delay);
-#endif
-uptr->io_flush = _sim_disk_io_flush;
-
-if (uptr->flags & UNIT_BUFABLE) {                       /* buffer in memory? */
-    t_seccnt sectsread;
-    t_stat r = SCPE_OK;
+/*
+ * The only known interleaved disk devices have either 256 byte
+ * or 128 byte sector sizes.  If additional interleaved file
+ * system scenarios with different sector sizes come up they
+ * should be added here.
+ */
 
-    if (uptr->flags & UNIT_MUSTBUF) {                   /* dyn alloc? */
-        uptr->filebuf = calloc ((size_t)(ctx->container_size / ctx->xfer_element_size),
-                                    ctx->xfer_element_size);       /* allocate */
-        uptr->filebuf2 = calloc ((size_t)(ctx->container_size / ctx->xfer_element_size),
-                                    ctx->xfer_element_size);       /* allocate copy */
-        if ((uptr->filebuf == NULL) ||                  /* either failed? */
-            (uptr->filebuf2 == NULL)) {
-            sim_disk_detach (uptr);
-            return SCPE_MEM;                            /* memory allocation error */
-            }
-        }
-    sim_messagef (SCPE_OK, "%s: buffering file in memory\n", sim_uname (uptr));
-    r = sim_disk_rdsect (uptr, 0, (uint8 *)uptr->filebuf, &sectsread, (t_seccnt)(ctx->container_size / ctx->sector_size));
-    if (r != SCPE_OK)
-        return sim_disk_detach (uptr);
-    uptr->hwmark = (sectsread * ctx->sector_size) / ctx->xfer_element_size;
-    memcpy (uptr->filebuf2, uptr->filebuf, (size_t)ctx->container_size);/* save initial contents */
-    uptr->flags |= UNIT_BUF;                            /* mark as buffered */
+for (i = 0; checks[i] != NULL; i++) {
+    ctx->sector_size = 256;
+    if ((ret_val = checks[i] (uptr, ctx->sector_size, readonly)) != (t_offset)-1)
+        break;
+    ctx->sector_size = 128;
+    if ((ret_val = checks[i] (uptr, ctx->sector_size, readonly)) != (t_offset)-1)
+        break;
     }
-
-return SCPE_OK;
+if ((ret_val != (t_offset)-1) && (ctx->sector_size != saved_sector_size ))
+    sim_messagef (SCPE_OK, "%s: with an unexpected sector size of %u bytes instead of %u bytes\n",
+                           sim_uname (uptr), ctx->sector_size, saved_sector_size);
+ctx->sector_size = saved_sector_size;
+return ret_val;
 }
 
-t_stat sim_disk_detach (UNIT *uptr)
-{
-struct disk_context *ctx;
-int (*close_function)(FILE *f);
-FILE *fileref;
-t_bool auto_format;
-
-if (uptr == NULL)
-    return SCPE_IERR;
-if (!(uptr->flags & UNIT_ATT))
-    return SCPE_UNATT;
-
-ctx = (struct disk_context *)uptr->disk_ctx;
-fileref = uptr->fileref;
+static t_stat store_disk_footer (UNIT *uptr, const char *dtype);
 
-sim_debug_unit (ctx->dbit, uptr, "sim_disk_detach(unit=%d,filename='%s')\n", (int)(uptr - ctx->dptr->units), uptr->filename);
+static t_stat get_disk_footer (UNIT *uptr)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct simh_disk_footer *f = (struct simh_disk_footer *)calloc (1, sizeof (*f));
+t_offset container_size;
+t_offset sim_fsize_ex (FILE *fptr);
+uint32 bytesread;
 
+if (f == NULL)
+    return SCPE_MEM;
+sim_debug_unit (ctx->dbit, uptr, "get_disk_footer(%s)\n", sim_uname (uptr));
 switch (DK_GET_FMT (uptr)) {                            /* case on format */
-    case DKUF_F_STD:                                    /* Simh */
-        close_function = fclose;
-        break;
-    case DKUF_F_VHD:                                    /* Virtual Disk */
-        close_function = sim_vhd_disk_close;
-        break;
-    case DKUF_F_RAW:                                    /* Physical */
-        close_function = sim_os_disk_close_raw;
+    case DKUF_F_STD:                                    /* SIMH format */
+        container_size = sim_fsize_ex (uptr->fileref);
+        if ((container_size != (t_offset)-1) && (container_size > (t_offset)sizeof (*f)) &&
+            (sim_fseeko (uptr->fileref, container_size - sizeof (*f), SEEK_SET) == 0) &&
+            (sizeof (*f) == sim_fread (f, 1, sizeof (*f), uptr->fileref)))
+            break;
+        free (f);
+        f = NULL;
         break;
-    default:
-        return SCPE_IERR;
-        }
-if (!(uptr->flags & UNIT_ATTABLE))                      /* attachable? */
-    return SCPE_NOATT;
-if (!(uptr->flags & UNIT_ATT))                          /* attached? */
-    return SCPE_OK;
-if (NULL == find_dev_from_unit (uptr))
-    return SCPE_OK;
+    case DKUF_F_RAW:                                    /* RAW format */
+        container_size = sim_os_disk_size_raw (uptr->fileref);
+        if ((container_size != (t_offset)-1) && (container_size > (t_offset)sizeof (*f)) &&
+            (sim_os_disk_read (uptr, container_size - sizeof (*f), (uint8 *)f, &bytesread, sizeof (*f)) == SCPE_OK) &&
+            (bytesread == sizeof (*f)))
+            break;
+        free (f);
+        f = NULL;
+        break;
+    case DKUF_F_VHD:                                    /* VHD format */
+        if (1) {
+            time_t creation_time;
 
-if ((uptr->flags & UNIT_BUF) && (uptr->filebuf)) {
-    uint32 cap = (uptr->hwmark + uptr->dptr->aincr - 1) / uptr->dptr->aincr;
+            /* Construct a pseudo simh disk footer*/
+            memcpy (f->Signature, "simh", 4);
+            f->FooterVersion = FOOTER_VERSION;
+            memset (f->DriveType, 0, sizeof (f->DriveType));
+            strlcpy ((char *)f->DriveType, sim_vhd_disk_get_dtype (uptr->fileref, &f->SectorSize, &f->TransferElementSize, (char *)f->CreatingSimulator, &creation_time), sizeof (f->DriveType));
+            f->SectorSize = NtoHl (f->SectorSize);
+            f->TransferElementSize = NtoHl (f->TransferElementSize);
+            if ((f->SectorSize == 0) || (NtoHl (f->SectorSize) == 0x00020000)) {  /* Old or mangled format VHD footer */
+                sim_vhd_disk_set_dtype (uptr->fileref, (char *)f->DriveType, ctx->sector_size, ctx->xfer_element_size);
+                sim_vhd_disk_get_dtype (uptr->fileref, &f->SectorSize, &f->TransferElementSize, (char *)f->CreatingSimulator, NULL);
+                f->SectorSize = NtoHl (f->SectorSize);
+                f->TransferElementSize = NtoHl (f->TransferElementSize);
+                }
+            memset (f->CreationTime, 0, sizeof (f->CreationTime));
+            strlcpy ((char*)f->CreationTime, ctime (&creation_time), sizeof (f->CreationTime));
+            container_size = sim_vhd_disk_size (uptr->fileref);
+            if ((f->SectorSize != 0) && (NtoHl (f->SectorSize) <= 65536)) /* Range check for Coverity sake */
+                f->SectorCount = NtoHl ((uint32)(container_size / NtoHl (f->SectorSize)));
+            container_size += sizeof (*f);      /* Adjust since it is removed below */
+            f->AccessFormat = DKUF_F_VHD;
+            f->Checksum = NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)));
+            }
+        break;
+    case DKUF_F_DDI:                                    /* DDI format */
+        if (1) {
+            time_t creation_time;
 
-    if (((uptr->flags & UNIT_RO) == 0) &&
-        (memcmp (uptr->filebuf, uptr->filebuf2, (size_t)ctx->container_size) != 0)) {
-        sim_messagef (SCPE_OK, "%s: writing buffer to file: %s\n", sim_uname (uptr), uptr->filename);
-        sim_disk_wrsect (uptr, 0, (uint8 *)uptr->filebuf, NULL, (cap + ctx->sector_size - 1) / ctx->sector_size);
+            /* Construct a pseudo simh disk footer from the DDI header */
+            memcpy (f->Signature, "simh", 4);
+            f->FooterVersion = FOOTER_VERSION;
+            strlcpy ((char *)f->DriveType, sim_ddi_disk_get_dtype (uptr->fileref, &f->SectorSize, &f->TransferElementSize, (char *)f->CreatingSimulator, &creation_time), sizeof (f->DriveType));
+            f->SectorSize = NtoHl (f->SectorSize);
+            f->TransferElementSize = NtoHl (f->TransferElementSize);
+            strlcpy ((char*)f->CreationTime, ctime (&creation_time), sizeof (f->CreationTime));
+            container_size = sim_ddi_disk_size (uptr->fileref);
+            if ((f->SectorSize != 0) && (NtoHl (f->SectorSize) <= 65536)) /* Range check for Coverity sake */
+                f->SectorCount = NtoHl ((uint32)(container_size / NtoHl (f->SectorSize)));
+            container_size += sizeof (*f);      /* Adjust since it is removed below */
+            f->AccessFormat = DKUF_F_DDI;
+            f->Checksum = NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)));
+            }
+        break;
+    default:
+        free (f);
+        return SCPE_IERR;
+    }
+if (f) {
+    if (f->Checksum != NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)))) {
+        sim_debug_unit (ctx->dbit, uptr, "No footer found on %s format container: %s\n", sim_disk_fmt (uptr), uptr->filename);
+        free (f);
+        f = NULL;
         }
-    if (uptr->flags & UNIT_MUSTBUF) {                   /* dyn alloc? */
-        free (uptr->filebuf);                           /* free buffers */
-        uptr->filebuf = NULL;
-        free (uptr->filebuf2);
-        uptr->filebuf2 = NULL;
+    else {
+        /* We've got a valid footer, but it may need to be corrected */
+        if ((NtoHl (f->TransferElementSize) == 1) &&
+            (0 == memcmp (f->DriveType, "RZ", 2))) {
+            f->TransferElementSize = NtoHl (2);
+            f->Checksum = NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)));
+            store_disk_footer (uptr, (char *)f->DriveType);
+            }
+        free (ctx->footer);
+        ctx->footer = f;
+        ctx->highwater = (((t_offset)NtoHl (f->Highwater[0])) << 32) | ((t_offset)NtoHl (f->Highwater[1]));
+        container_size -= sizeof (*f);
+        sim_debug_unit (ctx->dbit, uptr, "Footer: %s - %s\n"
+            "   Simulator:           %s\n"
+            "   DriveType:           %s\n"
+            "   SectorSize:          %u\n"
+            "   SectorCount:         %u\n"
+            "   TransferElementSize: %u\n"
+            "   FooterVersion:       %u\n"
+            "   AccessFormat:        %u\n"
+            "   CreationTime:        %s",
+            sim_uname (uptr), uptr->filename,
+            f->CreatingSimulator, f->DriveType, NtoHl(f->SectorSize), NtoHl (f->SectorCount),
+            NtoHl (f->TransferElementSize), f->FooterVersion, f->AccessFormat, f->CreationTime);
+        if (f->DeviceName[0] != '\0')
+            sim_debug_unit (ctx->dbit, uptr,
+                "   DeviceName:          %s\n", (char *)f->DeviceName);
+        sim_debug_unit (ctx->dbit, uptr,
+            "   HighwaterSector:     %u\n", (uint32)(ctx->highwater/ctx->sector_size));
         }
-    uptr->flags = uptr->flags & ~UNIT_BUF;
     }
+sim_debug_unit (ctx->dbit, uptr, "Container Size: %u sectors %u bytes each\n", (uint32)(container_size/ctx->sector_size), ctx->sector_size);
+ctx->container_size = container_size;
+return SCPE_OK;
+}
 
-update_disk_footer (uptr);                              /* Update meta data if highwater has changed */
-
-auto_format = ctx->auto_format;
-
-if (uptr->io_flush)
-    uptr->io_flush (uptr);                              /* flush buffered data */
+static t_stat store_disk_footer (UNIT *uptr, const char *dtype)
+{
+DEVICE *dptr;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct stat statb;
+struct simh_disk_footer *f;
+time_t now = time (NULL);
+t_offset total_sectors;
+t_offset highwater;
 
-sim_disk_clr_async (uptr);
+return SCPE_OK;
 
-uptr->flags &= ~(UNIT_ATT | UNIT_RO);
-uptr->dynflags &= ~(UNIT_NO_FIO | UNIT_DISK_CHK);
-free (uptr->filename);
-uptr->filename = NULL;
-uptr->fileref = NULL;
+if ((dptr = find_dev_from_unit (uptr)) == NULL)
+    return SCPE_NOATT;
+if (uptr->flags & UNIT_RO)
+    return SCPE_RO;
+if (sim_stat (uptr->filename, &statb))
+    memset (&statb, 0, sizeof (statb));
+f = (struct simh_disk_footer *)calloc (1, sizeof (*f));
+f->AccessFormat = DK_GET_FMT (uptr);
+total_sectors = (((t_offset)uptr->capac) * ctx->capac_factor * ((dptr->flags & DEV_SECTORS) ? 512 : 1)) / ctx->sector_size;
+memcpy (f->Signature, "simh", 4);
+f->FooterVersion = FOOTER_VERSION;
+memset (f->CreatingSimulator, 0, sizeof (f->CreatingSimulator));
+strlcpy ((char *)f->CreatingSimulator, sim_name, sizeof (f->CreatingSimulator));
+memset (f->DriveType, 0, sizeof (f->DriveType));
+strlcpy ((char *)f->DriveType, dtype, sizeof (f->DriveType));
+f->SectorSize = NtoHl (ctx->sector_size);
+f->SectorCount = NtoHl ((uint32)total_sectors);
+f->TransferElementSize = NtoHl (ctx->xfer_element_size);
+memset (f->CreationTime, 0, sizeof (f->CreationTime));
+strlcpy ((char*)f->CreationTime, ctime (&now), sizeof (f->CreationTime));
+memset (f->DeviceName, 0, sizeof (f->DeviceName));
+strlcpy ((char*)f->DeviceName, dptr->name, sizeof (f->DeviceName));
+highwater = sim_fsize_name_ex (uptr->filename);
+/* Align Initial Highwater to a sector boundary */
+highwater = ((highwater + ctx->sector_size - 1) / ctx->sector_size) * ctx->sector_size;
+f->Highwater[0] = NtoHl ((uint32)(highwater >> 32));
+f->Highwater[1] = NtoHl ((uint32)(highwater & 0xFFFFFFFF));
+f->Checksum = NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)));
 free (ctx->footer);
-free (uptr->disk_ctx);
-uptr->disk_ctx = NULL;
-uptr->io_flush = NULL;
-if (auto_format)
-    sim_disk_set_fmt (uptr, 0, "AUTO", NULL);           /* restore file format */
-
-if (close_function (fileref) == EOF)
-    return SCPE_IOERR;
+ctx->footer = f;
+switch (f->AccessFormat) {
+    case DKUF_F_STD:                                    /* SIMH format */
+        if (sim_fseeko ((FILE *)uptr->fileref, total_sectors * ctx->sector_size, SEEK_SET) == 0) {
+            sim_fwrite (f, sizeof (*f), 1, (FILE *)uptr->fileref);
+            fclose ((FILE *)uptr->fileref);
+            sim_set_file_times (uptr->filename, statb.st_atime, statb.st_mtime);
+            uptr->fileref = sim_fopen (uptr->filename, "rb+");
+            }
+        break;
+    case DKUF_F_VHD:                                    /* VHD format */
+        break;
+    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
+        sim_os_disk_write (uptr, total_sectors * ctx->sector_size, (uint8 *)f, NULL, sizeof (*f));
+        sim_os_disk_close_raw (uptr->fileref);
+        sim_set_file_times (uptr->filename, statb.st_atime, statb.st_mtime);
+        uptr->fileref = sim_os_disk_open_raw (uptr->filename, "rb+");
+        break;
+    default:
+        break;
+    }
 return SCPE_OK;
 }
 
-t_stat sim_disk_attach_help(FILE *st, DEVICE *dptr, UNIT *uptr, int32 flag, const char *cptr)
+static t_stat update_disk_footer (UNIT *uptr)
 {
-static struct example_fields {
-    const char *dname;
-    const char *dtype;
-    const char *dsize;
-    const char *dtype2;
-    const char *dsize2;
-    const char *dtype3;
-    const char *dsize3;
-    const char *dtype4;
-    const char *dsize4;
-    } ex_data[] = {
-        {"RQ", "RD54", "159MB", "RX50", "409KB", "RA81", "456MB", "RA92", "1505MB"},
-        {"RP", "RM03",  "33MW", "RM03",  "33MW", "RP07", "258MW", "RM03",  "15MW"},
-        {"RP", "RM03",  "39MW", "RM03",  "39MW", "RP07", "110MW", "RM03",  "15MW"},
-    };
-struct example_fields *ex = &ex_data[0];
+DEVICE *dptr;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct stat statb;
+struct simh_disk_footer *f;
+t_offset total_sectors;
+t_offset highwater;
+t_offset footer_highwater;
 
-if (strcmp (dptr->name, "RP") == 0)
-    ex = &ex_data[1];
-if (strstr (sim_name, "-10")) {
-    ex = &ex_data[2];
-    if (strstr (sim_name, "PDP") == NULL)
-        ex->dname = "RPA";
-    }
+return SCPE_OK;
 
-fprintf (st, "%s Disk Attach Help\n\n", dptr->name);
+if ((dptr = find_dev_from_unit (uptr)) == NULL)
+    return SCPE_NOATT;
+if (uptr->flags & UNIT_RO)
+    return SCPE_RO;
+if (ctx == NULL)
+    return SCPE_IERR;
+f = ctx->footer;
+if (f == NULL)
+    return SCPE_IERR;
 
-fprintf (st, "Disk container files can be one of several different types:\n\n");
-if (strstr (sim_name, "-10") == NULL) {
-    fprintf (st, "    SIMH   A disk is an unstructured binary file of the size appropriate\n");
-    fprintf (st, "           for the disk drive being simulated accessed by C runtime APIs\n");
-    fprintf (st, "    VHD    Virtual Disk format which is described in the \"Microsoft\n");
-    fprintf (st, "           Virtual Hard Disk (VHD) Image Format Specification\".  The\n");
-    fprintf (st, "           VHD implementation includes support for 1) Fixed (Preallocated)\n");
-    fprintf (st, "           disks, 2) Dynamically Expanding disks, and 3) Differencing disks.\n");
-    fprintf (st, "    RAW    platform specific access to physical disk or CDROM drives\n\n");
-    }
-else {
-    fprintf (st, "    SIMH   A disk is an unstructured binary file of 64bit integers\n"
-                 "           access by C runtime APIs\n");
-    fprintf (st, "    VHD    A disk is an unstructured binary file of 64bit integers\n"
-                 "           contained in a VHD container\n");
-    fprintf (st, "    RAW    A disk is an unstructured binary file of 64bit integers\n"
-                 "           accessed by direct read/write APIs\n");
-    fprintf (st, "    DBD9   Compatible with KLH10 is a packed big endian word\n");
-    fprintf (st, "    DLD9   Compatible with KLH10 is a packed little endian word\n\n");
-    }
-fprintf (st, "Virtual (VHD) Disk  support conforms to the \"Virtual Hard Disk Image Format\n");
-fprintf (st, "Specification\", Version 1.0 October 11, 2006.\n");
-fprintf (st, "Dynamically expanding disks never change their \"Virtual Size\", but they don't\n");
-fprintf (st, "consume disk space on the containing storage until the virtual sectors in the\n");
-fprintf (st, "disk are actually written to (i.e. a 2GB Dynamic disk container file with only\n");
-fprintf (st, "30MB of data will initially be about 30MB in size and this size will grow up to\n");
-fprintf (st, "2GB as different sectors are written to.  The VHD format contains metadata\n");
-fprintf (st, "which describes the drive size and the simh device type in use when the VHD\n");
-fprintf (st, "was created.  This metadata is therefore available whenever that VHD is\n");
-fprintf (st, "attached to an emulated disk device in the future so the device type and\n");
-fprintf (st, "size can be automatically be configured.\n\n");
-
-if (dptr->numunits > 1) {
-    uint32 i, attachable_count = 0, out_count = 0, skip_count;
+footer_highwater = (((t_offset)NtoHl (f->Highwater[0])) << 32) | ((t_offset)NtoHl (f->Highwater[1]));
+if (ctx->highwater <= footer_highwater)
+    return SCPE_OK;
 
-    for (i=0; i < dptr->numunits; ++i)
-        if ((dptr->units[i].flags & UNIT_ATTABLE) &&
-            !(dptr->units[i].flags & UNIT_DIS))
-            ++attachable_count;
-    for (i=0; (i < dptr->numunits) && (out_count < 2); ++i)
-        if ((dptr->units[i].flags & UNIT_ATTABLE) &&
-            !(dptr->units[i].flags & UNIT_DIS)) {
-            fprintf (st, "  sim> ATTACH {switches} %s%d diskfile\n", dptr->name, i);
-            ++out_count;
-            }
-    if (attachable_count > 4) {
-        fprintf (st, "       .\n");
-        fprintf (st, "       .\n");
-        fprintf (st, "       .\n");
-        }
-    skip_count = attachable_count - 2;
-    for (i=0; i < dptr->numunits; ++i)
-        if ((dptr->units[i].flags & UNIT_ATTABLE) &&
-            !(dptr->units[i].flags & UNIT_DIS)) {
-            if (skip_count == 0)
-                fprintf (st, "  sim> ATTACH {switches} %s%d diskfile\n", dptr->name, i);
-            else
-                --skip_count;
+if (sim_stat (uptr->filename, &statb))
+    memset (&statb, 0, sizeof (statb));
+total_sectors = (((t_offset)uptr->capac) * ctx->capac_factor * ((dptr->flags & DEV_SECTORS) ? 512 : 1)) / ctx->sector_size;
+highwater = ctx->highwater;
+f->Highwater[0] = NtoHl ((uint32)(highwater >> 32));
+f->Highwater[1] = NtoHl ((uint32)(highwater & 0xFFFFFFFF));
+f->Checksum = NtoHl (eth_crc32 (0, f, sizeof (*f) - sizeof (f->Checksum)));
+switch (f->AccessFormat) {
+    case DKUF_F_STD:                                    /* SIMH format */
+        if (sim_fseeko ((FILE *)uptr->fileref, total_sectors * ctx->sector_size, SEEK_SET) == 0) {
+            sim_fwrite (f, sizeof (*f), 1, (FILE *)uptr->fileref);
+            fclose ((FILE *)uptr->fileref);
+            sim_set_file_times (uptr->filename, statb.st_atime, statb.st_mtime);
+            uptr->fileref = sim_fopen (uptr->filename, "rb+");
             }
+        break;
+    case DKUF_F_VHD:                                    /* VHD format */
+        break;
+    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
+        sim_os_disk_write (uptr, total_sectors * ctx->sector_size, (uint8 *)f, NULL, sizeof (*f));
+        sim_os_disk_close_raw (uptr->fileref);
+        sim_set_file_times (uptr->filename, statb.st_atime, statb.st_mtime);
+        uptr->fileref = sim_os_disk_open_raw (uptr->filename, "rb+");
+        break;
+    default:
+        break;
     }
-else
-    fprintf (st, "  sim> ATTACH {switches} %s diskfile\n", dptr->name);
-fprintf (st, "\n%s attach command switches\n", dptr->name);
-fprintf (st, "    -R          Attach Read Only.\n");
-fprintf (st, "    -E          Must Exist (if not specified an attempt to create the indicated\n");
-fprintf (st, "                disk container will be attempted).\n");
-fprintf (st, "    -F          Open the indicated disk container in a specific format (default\n");
-fprintf (st, "                is to autodetect VHD defaulting to RAW if the indicated\n");
-fprintf (st, "                container is not a VHD).\n");
-fprintf (st, "    -I          Initialize newly created disk so that each sector contains its\n");
-fprintf (st, "                sector address\n");
-fprintf (st, "    -K          Verify that the disk contents contain the sector address in each\n");
-fprintf (st, "                sector.  Whole disk checked at attach time and each sector is\n");
-fprintf (st, "                checked when written.\n");
-fprintf (st, "    -C          Create a disk container and copy its contents from another disk\n");
-fprintf (st, "                (simh, VHD, or RAW format).  The current (or specified with -F)\n");
-fprintf (st, "                container format will be the format of the created container.\n");
-fprintf (st, "                AUTO or VHD will create a VHD container, SIMH will create a.\n");
-fprintf (st, "                SIMH container. Add a -V switch to verify a copy operation.\n");
-fprintf (st, "                Note: A copy will be performed between dissimilar sized\n");
-fprintf (st, "                containers.  Copying from a larger container to a smaller\n");
-fprintf (st, "                one will produce a truncated result.\n");
-fprintf (st, "    -V          Perform a verification pass to confirm successful data copy\n");
-fprintf (st, "                operation.\n");
-fprintf (st, "    -X          When creating a VHD, create a fixed sized VHD (vs a Dynamically\n");
-fprintf (st, "                expanding one).\n");
-fprintf (st, "    -D          Create a Differencing VHD (relative to an already existing VHD\n");
-fprintf (st, "                disk)\n");
-fprintf (st, "    -M          Merge a Differencing VHD into its parent VHD disk\n");
-fprintf (st, "    -O          Override consistency checks when attaching differencing disks\n");
-fprintf (st, "                which have unexpected parent disk GUID or timestamps\n\n");
-fprintf (st, "    -U          Fix inconsistencies which are overridden by the -O switch\n");
-if (strstr (sim_name, "-10") == NULL) {
-    fprintf (st, "    -Y          Answer Yes to prompt to overwrite last track (on disk create)\n");
-    fprintf (st, "    -N          Answer No to prompt to overwrite last track (on disk create)\n");
-    }
-fprintf (st, "Examples:\n");
-fprintf (st, "  sim> show %s\n", ex->dname);
-fprintf (st, "    %s, address=20001468-2000146B*, no vector, 4 units\n", ex->dname);
-fprintf (st, "    %s0, %s, not attached, write enabled, %s, autosize, AUTO detect format\n", ex->dname, ex->dsize, ex->dtype);
-fprintf (st, "    %s1, %s, not attached, write enabled, %s, autosize, AUTO detect format\n", ex->dname, ex->dsize, ex->dtype);
-fprintf (st, "    %s2, %s, not attached, write enabled, %s, autosize, AUTO detect format\n", ex->dname, ex->dsize, ex->dtype);
-fprintf (st, "    %s3, %s, not attached, write enabled, %s, autosize, AUTO detect format\n", ex->dname, ex->dsize2, ex->dtype2);
-fprintf (st, "  sim> # attach an existing VHD and determine its size and type automatically\n");
-fprintf (st, "  sim> attach %s0 %s.vhd\n", ex->dname, ex->dtype3);
-fprintf (st, "  sim> show %s0\n", ex->dname);
-fprintf (st, "  %s0, %s, attached to %s.vhd, write enabled, %s, autosize, VHD format\n", ex->dname, ex->dsize3, ex->dtype3, ex->dtype3);
-fprintf (st, "  sim> # create a new %s drive type VHD\n", ex->dtype4);
-fprintf (st, "  sim> set %s2 %s\n", ex->dname, ex->dtype4);
-fprintf (st, "  sim> attach %s2 -f vhd %s.vhd\n", ex->dname, ex->dtype4);
-fprintf (st, "  %s2: creating new file\n", ex->dname);
-fprintf (st, "  sim> show %s2\n", ex->dname);
-fprintf (st, "  %s2, %s, attached to %s.vhd, write enabled, %s, autosize, VHD format\n", ex->dname, ex->dsize4, ex->dtype4, ex->dtype4);
-fprintf (st, "  sim> # examine the size consumed by the %s VHD file\n", ex->dsize4);
-fprintf (st, "  sim> dir %s.vhd\n", ex->dtype4);
-fprintf (st, "   Directory of H:\\Data\n\n");
-fprintf (st, "  04/14/2011  12:57 PM             5,120 %s.vhd\n", ex->dtype4);
-fprintf (st, "                 1 File(s)          5,120 bytes\n");
-fprintf (st, "  sim> # create a differencing vhd (%s-1-Diff.vhd) with %s.vhd as parent\n", ex->dtype4, ex->dtype4);
-fprintf (st, "  sim> attach %s3 -d %s-1-Diff.vhd %s.vhd\n", ex->dname, ex->dtype4, ex->dtype4);
-fprintf (st, "  sim> # create a VHD (%s-1.vhd) which is a copy of an existing disk\n", ex->dtype4);
-fprintf (st, "  sim> attach %s3 -c %s-1.vhd %s.vhd\n", ex->dname, ex->dtype4, ex->dtype4);
-fprintf (st, "  %s3: creating new virtual disk '%s-1.vhd'\n", ex->dname, ex->dtype4);
-fprintf (st, "  %s3: Copied %s.  99%% complete.\n", ex->dname, ex->dsize4);
-fprintf (st, "  %s3: Copied %s. Done.\n", ex->dname, ex->dsize4);
-fprintf (st, "  sim> show %s3\n", ex->dname);
-fprintf (st, "  %s3, %s, attached to %s-1.vhd, write enabled, %s, autosize, VHD format\n", ex->dname, ex->dsize4, ex->dtype4, ex->dtype4);
-fprintf (st, "  sim> dir %s*\n", ex->dtype4);
-fprintf (st, "   Directory of H:\\Data\n\n");
-fprintf (st, "  04/14/2011  01:12 PM             5,120 %s-1.vhd\n", ex->dtype4);
-fprintf (st, "  04/14/2011  12:58 PM             5,120 %s.vhd\n", ex->dtype4);
-fprintf (st, "                 2 File(s)         10,240 bytes\n");
-fprintf (st, "  sim> show %s2\n", ex->dname);
-fprintf (st, "  %s2, %s, not attached, write enabled, %s, autosize, VHD format\n", ex->dname, ex->dsize4, ex->dtype4);
-fprintf (st, "  sim> set %s2 %s\n", ex->dname, ex->dtype3);
-fprintf (st, "  sim> set %s2 noauto\n", ex->dname);
-fprintf (st, "  sim> show %s2\n", ex->dname);
-fprintf (st, "  %s2, %s, not attached, write enabled, %s, noautosize, VHD format\n", ex->dname, ex->dsize3, ex->dtype3);
-fprintf (st, "  sim> set %s2 format=simh\n", ex->dname);
-fprintf (st, "  sim> show %s2\n", ex->dname);
-fprintf (st, "  %s2, %s, not attached, write enabled, %s, noautosize, SIMH format\n", ex->dname, ex->dsize3, ex->dtype3);
-fprintf (st, "  sim> # create a VHD from an existing SIMH format disk\n");
-fprintf (st, "  sim> attach %s2 -c %s-Copy.vhd XYZZY.dsk\n", ex->dname, ex->dtype3);
-fprintf (st, "  %s2: creating new virtual disk '%s-Copy.vhd'\n", ex->dname, ex->dtype3);
-fprintf (st, "  %s2: Copied %s.  99%% complete.\n", ex->dname, ex->dsize3);
-fprintf (st, "  %s2: Copied %s. Done.\n", ex->dname, ex->dsize3);
-fprintf (st, "  sim> show %s2\n", ex->dname);
-fprintf (st, "  %s2, %s, attached to %s-Copy.vhd, write enabled, %s, noautosize, VHD format\n", ex->dname, ex->dsize3, ex->dtype3, ex->dtype3);
 return SCPE_OK;
 }
 
-t_bool sim_disk_vhd_support (void)
-{
-return SCPE_OK == sim_vhd_disk_implemented ();
-}
-
-t_bool sim_disk_raw_support (void)
+t_stat sim_disk_attach (UNIT *uptr, const char *cptr, size_t sector_size, size_t xfer_element_size, t_bool dontchangecapac,
+                        uint32 dbit, const char *dtype, uint32 pdp11tracksize, int completion_delay)
 {
-return SCPE_OK == sim_os_disk_implemented_raw ();
+return sim_disk_attach_ex (uptr, cptr, sector_size, xfer_element_size, dontchangecapac, dbit, dtype, pdp11tracksize, completion_delay, NULL);
 }
 
-t_stat sim_disk_reset (UNIT *uptr)
+t_stat sim_disk_attach_ex (UNIT *uptr, const char *cptr, size_t sector_size, size_t xfer_element_size, t_bool dontchangecapac,
+                           uint32 dbit, const char *dtype, uint32 pdp11tracksize, int completion_delay, const char **drivetypes)
 {
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-
-if (!(uptr->flags & UNIT_ATT))                          /* attached? */
-    return SCPE_OK;
-
-sim_debug_unit (ctx->dbit, uptr, "sim_disk_reset(unit=%d)\n", (int)(uptr - ctx->dptr->units));
-
-_sim_disk_io_flush(uptr);
-AIO_VALIDATE(uptr);
-AIO_UPDATE_QUEUE;
-return SCPE_OK;
+return sim_disk_attach_ex2 (uptr, cptr, sector_size, xfer_element_size, dontchangecapac,
+                            dbit, dtype, pdp11tracksize, completion_delay, drivetypes, 0);
 }
 
-t_stat sim_disk_perror (UNIT *uptr, const char *msg)
+t_stat sim_disk_attach_ex2 (UNIT *uptr, const char *cptr, size_t sector_size, size_t xfer_element_size, t_bool dontchangecapac,
+                            uint32 dbit, const char *dtype, uint32 pdp11tracksize, int completion_delay, const char **drivetypes,
+                            size_t reserved_sectors)
 {
-int saved_errno = errno;
+struct disk_context *ctx;
+DEVICE *dptr;
+char tbuf[4*CBUFSIZE];
+FILE *(*open_function)(const char *filename, const char *mode) = sim_fopen;
+FILE *(*create_function)(const char *filename, t_offset desiredsize) = NULL;
+t_stat (*storage_function)(FILE *file, uint32 *sector_size, uint32 *removable, uint32 *is_cdrom) = NULL;
+t_bool created = FALSE, copied = FALSE, autosized = FALSE;
+t_bool auto_format = FALSE;
+t_offset container_size, filesystem_size, current_unit_size;
+size_t tmp_size = 1;
 
-if (!(uptr->flags & UNIT_ATTABLE))                      /* not attachable? */
-    return SCPE_NOATT;
-switch (DK_GET_FMT (uptr)) {                            /* case on format */
-    case DKUF_F_STD:                                    /* SIMH format */
-    case DKUF_F_VHD:                                    /* VHD format */
-    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
-#if defined(_WIN32)
-        saved_errno = GetLastError ();
-#endif
-        perror (msg);
-        sim_printf ("%s %s: %s\n", sim_uname(uptr), msg, sim_get_os_error_text (saved_errno));
-        break;
-    default:
-        ;
+if (sim_disk_no_autosize) {
+    dontchangecapac = TRUE;
+    drivetypes = NULL;
     }
-return SCPE_OK;
-}
-
-t_stat sim_disk_clearerr (UNIT *uptr)
-{
+if (uptr->flags & UNIT_DIS)                             /* disabled? */
+    return SCPE_UDIS;
 if (!(uptr->flags & UNIT_ATTABLE))                      /* not attachable? */
     return SCPE_NOATT;
-switch (DK_GET_FMT (uptr)) {                            /* case on format */
-    case DKUF_F_STD:                                    /* SIMH format */
-        clearerr (uptr->fileref);
-        break;
-    case DKUF_F_VHD:                                    /* VHD format */
-        sim_vhd_disk_clearerr (uptr);
-        break;
+if ((dptr = find_dev_from_unit (uptr)) == NULL)
+    return SCPE_NOATT;
+switch (xfer_element_size) {
     default:
-        ;
+        return sim_messagef (SCPE_ARG, "Unsupported transfer element size: %u\n", (uint32)xfer_element_size);
+    case 1: case 2: case 4: case 8:
+        break;
     }
-return SCPE_OK;
-}
-
-
-/* Factory bad block table creation routine
-
-   This routine writes a DEC standard 144 compliant bad block table on the
-   last track of the specified unit as described in:
-      EL-00144_B_DEC_STD_144_Disk_Standard_for_Recording_and_Handling_Bad_Sectors_Nov76.pdf
-   The bad block table consists of 10 repetitions of the same table,
-   formatted as follows:
+if ((sector_size % xfer_element_size) != 0)
+    return sim_messagef (SCPE_ARG, "Invalid sector size: %u - must be a multiple of the transfer element size %u\n", (uint32)sector_size, (uint32)xfer_element_size);
+if (sim_switches & SWMASK ('F')) {                      /* format spec? */
+    char gbuf[CBUFSIZE];
+    cptr = get_glyph (cptr, gbuf, 0);                   /* get spec */
+    if (*cptr == 0)                                     /* must be more */
+        return SCPE_2FARG;
+    if ((sim_disk_set_fmt (uptr, 0, gbuf, NULL) != SCPE_OK) ||
+        (DK_GET_FMT (uptr) == DKUF_F_AUTO))
+        return sim_messagef (SCPE_ARG, "Invalid Override Disk Format: %s\n", gbuf);
+    sim_switches = sim_switches & ~(SWMASK ('F'));      /* Record Format specifier already processed */
+    auto_format = TRUE;
+    }
+if (sim_switches & SWMASK ('D')) {                      /* create difference disk? */
+    char gbuf[CBUFSIZE];
+    FILE *vhd;
 
-        words 0-1       pack id number
-        words 2-3       cylinder/sector/surface specifications
-         :
-        words n-n+1     end of table (-1,-1)
+    sim_switches = sim_switches & ~(SWMASK ('D'));
+    cptr = get_glyph_nc (cptr, gbuf, 0);                /* get spec */
+    if (*cptr == 0)                                     /* must be more */
+        return SCPE_2FARG;
+    vhd = sim_vhd_disk_create_diff (gbuf, cptr);
+    if (vhd) {
+        sim_vhd_disk_close (vhd);
+        return sim_disk_attach (uptr, gbuf, sector_size, xfer_element_size, dontchangecapac, dbit, dtype, pdp11tracksize, completion_delay);
+        }
+    return sim_messagef (SCPE_ARG, "Unable to create differencing VHD: %s\n", gbuf);
+    }
+if (sim_switches & SWMASK ('C')) {                      /* create new disk container & copy contents? */
+    char gbuf[CBUFSIZE];
+    const char *dest_fmt = ((DK_GET_FMT (uptr) == DKUF_F_AUTO) || (DK_GET_FMT (uptr) == DKUF_F_VHD)) ? "VHD" : (DK_GET_FMT (uptr) == DKUF_F_DDI) ? "DDI" : "SIMH";
+    FILE *dest;
+    int saved_sim_switches = sim_switches;
+    int32 saved_sim_quiet = sim_quiet;
+    t_addr target_capac = uptr->capac;
+    t_addr source_capac;
+    uint32 capac_factor;
+    t_stat r;
 
-   Inputs:
-        uptr    =       pointer to unit
-        sec     =       number of sectors per surface
-        wds     =       number of words per sector
-   Outputs:
-        sta     =       status code
-*/
+    sim_switches = sim_switches & ~(SWMASK ('C'));
+    cptr = get_glyph_nc (cptr, gbuf, 0);                /* get spec */
+    if (*cptr == 0)                                     /* must be more */
+        return SCPE_2FARG;
+    sim_switches |= SWMASK ('R') | SWMASK ('E');
+    sim_quiet = TRUE;
+    if (strcmp ("DDI", dest_fmt) == 0)                  /* copying into DDI converts any format */
+        sim_disk_set_fmt (uptr, 0, "AUTO", NULL);
+    /* First open the source of the copy operation */
+    r = sim_disk_attach_ex (uptr, cptr, sector_size, xfer_element_size, dontchangecapac, dbit, dtype, pdp11tracksize, completion_delay, NULL);
+    sim_quiet = saved_sim_quiet;
+    if (r != SCPE_OK) {
+        sim_switches = saved_sim_switches;
+        if (strcmp ("DDI", dest_fmt) == 0)
+            sim_disk_set_fmt (uptr, 0, dest_fmt, NULL);
+        return sim_messagef (r, "%s: Cannot open copy source: %s - %s\n", sim_uname (uptr), cptr, sim_error_text (r));
+        }
+    source_capac = uptr->capac;
+    _sim_disk_cache_free (uptr);                        /* transfers to the destination */
+    _sim_disk_mmap_free (uptr);                         /* must not use the source's */
+    sim_messagef (SCPE_OK, "%s: Creating new %s '%s' disk container copied from '%s'\n", sim_uname (uptr), dest_fmt, gbuf, cptr);
+    capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* capacity units (quadword: 8, word: 2, byte: 1) */
+    uptr->capac = target_capac;
+    if (strcmp ("VHD", dest_fmt) == 0)
+        dest = sim_vhd_disk_create (gbuf, ((t_offset)uptr->capac)*capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1));
+    else if (strcmp ("DDI", dest_fmt) == 0) {
+        dest = sim_ddi_disk_create (gbuf, ((t_offset)uptr->capac)*capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1));
+        if (dest)
+            _sim_disk_ddi_new_store (uptr, dest);
+        }
+    else
+        dest = sim_fopen (gbuf, "wb+");
+    if (!dest) {
+        sim_disk_detach (uptr);
+        return sim_messagef (r, "%s: Cannot create %s disk container '%s'\n", sim_uname (uptr), dest_fmt, gbuf);
+        }
+    else {
+        uint8 *copy_buf = (uint8*) malloc (1024*1024);
+        t_lba lba;
+        t_seccnt sectors_per_buffer = (t_seccnt)((1024*1024)/sector_size);
+        t_lba total_sectors = (t_lba)((target_capac*capac_factor)/(sector_size/((dptr->flags & DEV_SECTORS) ? 512 : 1)));
+        t_seccnt sects = sectors_per_buffer;
+        t_seccnt sects_read;
 
-t_stat sim_disk_pdp11_bad_block (UNIT *uptr, int32 sec, int32 wds)
-{
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-int32 i;
-t_addr da;
-uint16 *buf;
-DEVICE *dptr;
-char *namebuf, *c;
-uint32 packid;
-t_stat stat = SCPE_OK;
+        if (!copy_buf) {
+            if (strcmp ("VHD", dest_fmt) == 0)
+                sim_vhd_disk_close (dest);
+            else if (strcmp ("DDI", dest_fmt) == 0)
+                sim_ddi_disk_close (dest);
+            else
+                fclose (dest);
+            (void)remove (gbuf);
+            sim_disk_detach (uptr);
+            return SCPE_MEM;
+            }
+        sim_messagef (SCPE_OK, "Copying %u sectors each %u bytes in size\n", (uint32)total_sectors, (uint32)sector_size);
+        if (source_capac > target_capac) {
+            sim_messagef (SCPE_OK, "The source container is %u sectors larger than the destination disk container\n",
+                        (t_lba)(((source_capac - target_capac)*capac_factor)/(sector_size/((dptr->flags & DEV_SECTORS) ? 512 : 1))));
+            sim_messagef (SCPE_OK, "these additional sectors will be unavailable on the target drive\n");
+            }
+        for (lba = 0; (lba < total_sectors) && (r == SCPE_OK); lba += sects_read) {
+            uptr->capac = source_capac;
+            sects = sectors_per_buffer;
+            if (lba + sects > total_sectors)
+                sects = total_sectors - lba;
+            r = sim_disk_rdsect (uptr, lba, copy_buf, &sects_read, sects);
+            if ((r == SCPE_OK) && (sects_read > 0)) {
+                uint32 saved_unit_flags = uptr->flags;
+                FILE *save_unit_fileref = uptr->fileref;
+                t_seccnt sects_written;
 
-if ((sec < 2) || (wds < 16))
-    return SCPE_ARG;
-if ((uptr->flags & UNIT_ATT) == 0)
-    return SCPE_UNATT;
-if ((dptr = find_dev_from_unit (uptr)) == NULL)
-    return SCPE_NOATT;
-if (uptr->flags & UNIT_RO)
-    return SCPE_RO;
-if (!get_yn ("Overwrite last track? [N]", FALSE))
-    return SCPE_OK;
-if ((buf = (uint16 *) malloc (wds * sizeof (uint16))) == NULL)
-    return SCPE_MEM;
-namebuf = uptr->filename;
-if ((c = strrchr (namebuf, '/')))
-    namebuf = c+1;
-if ((c = strrchr (namebuf, '\\')))
-    namebuf = c+1;
-if ((c = strrchr (namebuf, ']')))
-    namebuf = c+1;
-packid = eth_crc32(0, namebuf, strlen (namebuf));
-buf[0] = (uint16)packid;
-buf[1] = (uint16)(packid >> 16) & 0x7FFF;   /* Make sure MSB is clear */
-buf[2] = buf[3] = 0;
-for (i = 4; i < wds; i++)
-    buf[i] = 0177777u;
-da = (uptr->capac*((dptr->flags & DEV_SECTORS) ? 512 : 1)) - (sec * wds);
-for (i = 0; (stat == SCPE_OK) && (i < sec) && (i < 10); i++, da += wds)
-    if (ctx)
-        stat = sim_disk_wrsect (uptr, (t_lba)(da/wds), (uint8 *)buf, NULL, 1);
-    else {
-        if (sim_fseek (uptr->fileref, da, SEEK_SET)) {
-            stat = SCPE_IOERR;
-            break;
+                sim_disk_set_fmt (uptr, 0, dest_fmt, NULL);
+                uptr->fileref = dest;
+                uptr->capac = target_capac;
+                r = sim_disk_wrsect (uptr, lba, copy_buf, &sects_written, sects_read);
+                uptr->fileref = save_unit_fileref;
+                uptr->flags = saved_unit_flags;
+                if (sects_read != sects_written)
+                    r = SCPE_IOERR;
+                sim_messagef (SCPE_OK, "%s: Copied %u/%u sectors.  %d%% complete.\r", sim_uname (uptr), (uint32)(lba + sects_read), (uint32)total_sectors, (int)((((float)lba)*100)/total_sectors));
+                }
             }
-        if ((size_t)wds != sim_fwrite (buf, sizeof (uint16), wds, uptr->fileref))
-            stat = SCPE_IOERR;
-        }
-free (buf);
-return stat;
-}
+        if (r == SCPE_OK)
+            sim_messagef (SCPE_OK, "\n%s: Copied %u sectors. Done.\n", sim_uname (uptr), (uint32)total_sectors);
+        else
+            sim_messagef (r, "\n%s: Error copying: %s.\n", sim_uname (uptr), sim_error_text (r));
+        if ((r == SCPE_OK) && (sim_switches & SWMASK ('V'))) {
+            uint8 *verify_buf = (uint8*) malloc (1024*1024);
+            t_seccnt sects_read, verify_read;
 
-void sim_disk_data_trace(UNIT *uptr, const uint8 *data, size_t lba, size_t len, const char* txt, int detail, uint32 reason)
-{
-DEVICE *dptr = find_dev_from_unit (uptr);
+            if (!verify_buf) {
+                if (strcmp ("VHD", dest_fmt) == 0)
+                    sim_vhd_disk_close (dest);
+                else if (strcmp ("DDI", dest_fmt) == 0)
+                    sim_ddi_disk_close (dest);
+                else
+                    fclose (dest);
+                (void)remove (gbuf);
+                free (copy_buf);
+                sim_disk_detach (uptr);
+                return SCPE_MEM;
+                }
+            for (lba = 0; (lba < total_sectors) && (r == SCPE_OK); lba += sects_read) {
+                sim_messagef (SCPE_OK, "%s: Verified %u/%u sectors.  %d%% complete.\r", sim_uname (uptr), (uint32)lba, (uint32)total_sectors, (int)((((float)lba)*100)/total_sectors));
+                uptr->capac = source_capac;
+                sects = sectors_per_buffer;
+                if (lba + sects > total_sectors)
+                    sects = total_sectors - lba;
+                r = sim_disk_rdsect (uptr, lba, copy_buf, &sects_read, sects);
+                if (r == SCPE_OK) {
+                    uint32 saved_unit_flags = uptr->flags;
+                    FILE *save_unit_fileref = uptr->fileref;
 
-if (sim_deb && ((uptr->dctrl | dptr->dctrl) & reason)) {
-    char pos[32];
+                    sim_disk_set_fmt (uptr, 0, dest_fmt, NULL);
+                    uptr->fileref = dest;
+                    uptr->capac = target_capac;
+                    r = sim_disk_rdsect (uptr, lba, verify_buf, &verify_read, sects_read);
+                    uptr->fileref = save_unit_fileref;
+                    uptr->flags = saved_unit_flags;
+                    if (r == SCPE_OK) {
+                        if ((sects_read != verify_read) ||
+                            (0 != memcmp (copy_buf, verify_buf, verify_read*sector_size)))
+                            r = SCPE_IOERR;
+                        }
+                    }
+                if (r != SCPE_OK)
+                    break;
+                }
+            if (!sim_quiet) {
+                if (r == SCPE_OK)
+                    sim_messagef (r, "\n%s: Verified %u sectors. Done.\n", sim_uname (uptr), (uint32)total_sectors);
+                else {
+                    t_lba i;
+                    uint32 save_dctrl = dptr->dctrl;
+                    FILE *save_sim_deb = sim_deb;
 
-    sprintf (pos, "lbn: %08X ", (unsigned int)lba);
-    sim_data_trace(dptr, uptr, (detail ? data : NULL), pos, len, txt, reason);
+                    for (i = 0; i < sects_read; ++i)
+                        if (0 != memcmp (copy_buf+i*sector_size, verify_buf+i*sector_size, sector_size))
+                            break;
+                    sim_printf ("\n%s: Verification Error on lbn %d.\n", sim_uname (uptr), lba+i);
+                    dptr->dctrl = 0xFFFFFFFF;
+                    sim_deb = stdout;
+                    sim_disk_data_trace (uptr,   copy_buf+i*sector_size, lba+i, sector_size, "Expected", TRUE, 1);
+                    sim_disk_data_trace (uptr, verify_buf+i*sector_size, lba+i, sector_size,    "Found", TRUE, 1);
+                    dptr->dctrl = save_dctrl;
+                    sim_deb = save_sim_deb;
+                    }
+                }
+            free (verify_buf);
+            }
+        free (copy_buf);
+        if (strcmp ("VHD", dest_fmt) == 0)
+            sim_vhd_disk_close (dest);
+        else if (strcmp ("DDI", dest_fmt) == 0)
+            sim_ddi_disk_close (dest);
+        else
+            fclose (dest);
+        sim_disk_detach (uptr);
+        if (r == SCPE_OK) {
+            created = TRUE;
+            copied = TRUE;
+            strlcpy (tbuf, gbuf, sizeof(tbuf)-1);
+            cptr = tbuf;
+            sim_disk_set_fmt (uptr, 0, dest_fmt, NULL);
+            sim_switches = saved_sim_switches;
+            }
+        else
+            return r;
+        /* fall through and open/return the newly created & copied disk container */
+        }
     }
-}
+else
+    if (sim_switches & SWMASK ('M')) {                 /* merge difference disk? */
+        char gbuf[CBUFSIZE], *Parent = NULL;
+        FILE *vhd;
 
-/* OS Specific RAW Disk I/O support */
+        sim_switches = sim_switches & ~(SWMASK ('M'));
+        get_glyph_nc (cptr, gbuf, 0);                  /* get spec */
+        vhd = sim_vhd_disk_merge (gbuf, &Parent);
+        if (vhd) {
+            t_stat r;
 
-#if defined _WIN32
+            sim_vhd_disk_close (vhd);
+            r = sim_disk_attach (uptr, Parent, sector_size, xfer_element_size, dontchangecapac, dbit, dtype, pdp11tracksize, completion_delay);
+            free (Parent);
+            return r;
+            }
+        return SCPE_ARG;
+        }
 
-static void _set_errno_from_status (DWORD dwStatus)
-{
-switch (dwStatus) {
-    case ERROR_FILE_NOT_FOUND:    case ERROR_PATH_NOT_FOUND:
-    case ERROR_INVALID_DRIVE:     case ERROR_NO_MORE_FILES:
-    case ERROR_BAD_NET_NAME:      case ERROR_BAD_NETPATH:
-    case ERROR_BAD_PATHNAME:      case ERROR_FILENAME_EXCED_RANGE:
-        errno = ENOENT;
-        return;
-    case ERROR_INVALID_ACCESS:    case ERROR_INVALID_DATA:
-    case ERROR_INVALID_FUNCTION:  case ERROR_INVALID_PARAMETER:
-    case ERROR_NEGATIVE_SEEK:
-        errno = EINVAL;
-        return;
-    case ERROR_ARENA_TRASHED:     case ERROR_NOT_ENOUGH_MEMORY:
-    case ERROR_INVALID_BLOCK:     case ERROR_NOT_ENOUGH_QUOTA:
-        errno = ENOMEM;
-        return;
-    case ERROR_TOO_MANY_OPEN_FILES:
-        errno = EMFILE;
-        return;
-    case ERROR_ACCESS_DENIED:     case ERROR_CURRENT_DIRECTORY:
-    case ERROR_LOCK_VIOLATION:    case ERROR_NETWORK_ACCESS_DENIED:
-    case ERROR_CANNOT_MAKE:       case ERROR_FAIL_I24:
-    case ERROR_DRIVE_LOCKED:      case ERROR_SEEK_ON_DEVICE:
-    case ERROR_NOT_LOCKED:        case ERROR_LOCK_FAILED:
-        errno = EACCES;
-        return;
-    case ERROR_ALREADY_EXISTS:    case ERROR_FILE_EXISTS:
-        errno = EEXIST;
-        return;
-    case ERROR_INVALID_HANDLE:    case ERROR_INVALID_TARGET_HANDLE:
-    case ERROR_DIRECT_ACCESS_HANDLE:
-        errno = EBADF;
-        return;
-    case ERROR_DIR_NOT_EMPTY:
-        errno = ENOTEMPTY;
-        return;
-    case ERROR_BAD_ENVIRONMENT:
-        errno = E2BIG;
-        return;
-    case ERROR_BAD_FORMAT:
-        errno = ENOEXEC;
-        return;
-    case ERROR_NOT_SAME_DEVICE:
-        errno = EXDEV;
-        return;
-    case ERROR_BROKEN_PIPE:
-        errno = EPIPE;
-        return;
-    case ERROR_DISK_FULL:
-        errno = ENOSPC;
-        return;
-    case ERROR_WAIT_NO_CHILDREN:  case ERROR_CHILD_NOT_COMPLETE:
-        errno = ECHILD;
-        return;
-    case ERROR_NO_PROC_SLOTS:     case ERROR_MAX_THRDS_REACHED:
-    case ERROR_NESTING_NOT_ALLOWED:
-        errno = EAGAIN;
-        return;
-    }
-if ((dwStatus >= ERROR_WRITE_PROTECT) && (dwStatus <= ERROR_SHARING_BUFFER_EXCEEDED)) {
-    errno = EACCES;
-    return;
+switch (DK_GET_FMT (uptr)) {                            /* case on format */
+    case DKUF_F_AUTO:                                   /* SIMH format */
+        auto_format = TRUE;
+        if (sim_ddi_disk_is_ddi (cptr)) {               /* Try DDI */
+            sim_disk_set_fmt (uptr, 0, "DDI", NULL);    /* set file format to DDI */
+            open_function = sim_ddi_disk_open;
+            break;
+            }
+        if (NULL != (uptr->fileref = sim_vhd_disk_open (cptr, "rb"))) { /* Try VHD */
+            sim_disk_set_fmt (uptr, 0, "VHD", NULL);    /* set file format to VHD */
+            sim_vhd_disk_close (uptr->fileref);         /* close vhd file*/
+            uptr->fileref = NULL;
+            open_function = sim_vhd_disk_open;
+            break;
+            }
+        while (tmp_size < sector_size)
+            tmp_size <<= 1;
+        if (tmp_size ==  sector_size) {                     /* Power of 2 sector size can do RAW */
+            if (NULL != (uptr->fileref = sim_os_disk_open_raw (cptr, "rb"))) {
+                sim_disk_set_fmt (uptr, 0, "RAW", NULL);    /* set file format to RAW */
+                sim_os_disk_close_raw (uptr->fileref);      /* close raw file*/
+                open_function = sim_os_disk_open_raw;
+                storage_function = sim_os_disk_info_raw;
+                uptr->fileref = NULL;
+                break;
+                }
+            }
+        sim_disk_set_fmt (uptr, 0, "SIMH", NULL);       /* set file format to SIMH */
+        open_function = sim_fopen;
+        break;
+    case DKUF_F_STD:                                    /* SIMH format */
+        if (sim_ddi_disk_is_ddi (cptr)) {               /* Try DDI first */
+            sim_disk_set_fmt (uptr, 0, "DDI", NULL);    /* set file format to DDI */
+            open_function = sim_ddi_disk_open;
+            auto_format = TRUE;
+            break;
+            }
+        if (NULL != (uptr->fileref = sim_vhd_disk_open (cptr, "rb"))) { /* Try VHD first */
+            sim_disk_set_fmt (uptr, 0, "VHD", NULL);    /* set file format to VHD */
+            sim_vhd_disk_close (uptr->fileref);         /* close vhd file*/
+            uptr->fileref = NULL;
+            open_function = sim_vhd_disk_open;
+            auto_format = TRUE;
+            break;
+            }
+        open_function = sim_fopen;
+        break;
+    case DKUF_F_VHD:                                    /* VHD format */
+        open_function = sim_vhd_disk_open;
+        create_function = sim_vhd_disk_create;
+        storage_function = sim_os_disk_info_raw;
+        break;
+    case DKUF_F_DDI:                                    /* DDI format */
+        open_function = sim_ddi_disk_open;
+        create_function = sim_ddi_disk_create;
+        break;
+    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
+        if (NULL != (uptr->fileref = sim_vhd_disk_open (cptr, "rb"))) { /* Try VHD first */
+            sim_disk_set_fmt (uptr, 0, "VHD", NULL);    /* set file format to VHD */
+            sim_vhd_disk_close (uptr->fileref);         /* close vhd file*/
+            uptr->fileref = NULL;
+            open_function = sim_vhd_disk_open;
+            auto_format = TRUE;
+            break;
+            }
+        open_function = sim_os_disk_open_raw;
+        storage_function = sim_os_disk_info_raw;
+        break;
+    default:
+        return SCPE_IERR;
     }
-if ((dwStatus >= ERROR_INVALID_STARTING_CODESEG) && (dwStatus <= ERROR_INFLOOP_IN_RELOC_CHAIN)) {
-    errno = ENOEXEC;
-    return;
+uptr->filename = (char *) calloc (CBUFSIZE, sizeof (char));/* alloc name buf */
+uptr->disk_ctx = ctx = (struct disk_context *)calloc(1, sizeof(struct disk_context));
+if ((uptr->filename == NULL) || (uptr->disk_ctx == NULL))
+    return _err_return (uptr, SCPE_MEM);
+strlcpy (uptr->filename, cptr, CBUFSIZE);               /* save name */
+ctx->sector_size = (uint32)sector_size;                 /* save sector_size */
+ctx->capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* save capacity units (quadword: 8, word: 2, byte: 1) */
+ctx->xfer_element_size = (uint32)xfer_element_size;     /* save xfer_element_size */
+ctx->dptr = dptr;                                       /* save DEVICE pointer */
+ctx->dbit = dbit;                                       /* save debug bit */
+ctx->media_removed = 0;                                 /* default present */
+sim_debug_unit (ctx->dbit, uptr, "sim_disk_attach(unit=%d,filename='%s')\n", (int)(uptr - ctx->dptr->units), uptr->filename);
+ctx->auto_format = auto_format;                         /* save that we auto selected format */
+ctx->storage_sector_size = (uint32)sector_size;         /* Default */
+if ((sim_switches & SWMASK ('R')) ||                    /* read only? */
+    ((uptr->flags & UNIT_RO) != 0)) {
+    if (((uptr->flags & UNIT_ROABLE) == 0) &&           /* allowed? */
+        ((uptr->flags & UNIT_RO) == 0))
+        return sim_messagef (_err_return (uptr, SCPE_NORO), "%s: Read Only operation not allowed\n", /* no, error */
+                                                        sim_uname (uptr));
+    uptr->fileref = open_function (cptr, "rb");         /* open rd only */
+    if (uptr->fileref == NULL)                          /* open fail? */
+        return sim_messagef (_err_return (uptr, SCPE_OPENERR), "%s: Can't open '%s': %s\n", /* yes, error */
+                                            sim_uname (uptr), cptr, strerror (errno));
+    uptr->flags = uptr->flags | UNIT_RO;                /* set rd only */
+    sim_messagef (SCPE_OK, "%s: Unit is read only\n", sim_uname (uptr));
     }
-errno = EINVAL;
-}
-#if defined(__GNUC__) && defined(HAVE_NTDDDISK_H)
-#include <ddk/ntddstor.h>
-#include <ddk/ntdddisk.h>
-#else
-#include <winioctl.h>
-#endif
+else {                                                  /* normal */
+    uptr->fileref = open_function (cptr, "rb+");        /* open r/w */
+    if (uptr->fileref == NULL) {                        /* open fail? */
+        if ((errno == EROFS) || (errno == EACCES)) {    /* read only? */
+            if ((uptr->flags & UNIT_ROABLE) == 0)       /* allowed? */
+                return sim_messagef (_err_return (uptr, SCPE_NORO), "%s: Read Only operation not allowed\n", /* no, error */
+                                                                sim_uname (uptr));
+            uptr->fileref = open_function (cptr, "rb"); /* open rd only */
+            if (uptr->fileref == NULL)                  /* open fail? */
+                return sim_messagef (_err_return (uptr, SCPE_OPENERR), "%s: Can't open '%s': %s\n", /* yes, error */
+                                                    sim_uname (uptr), cptr, strerror (errno));
+            uptr->flags = uptr->flags | UNIT_RO;        /* set rd only */
+            sim_messagef (SCPE_OK, "%s: Unit is read only\n", sim_uname (uptr));
+            }
+        else {                                          /* other error? */
+            if ((sim_switches & SWMASK ('E')) ||        /* must exist? */
+                (errno != ENOENT))                      /* or must not re-create? */
+                return sim_messagef (_err_return (uptr, SCPE_OPENERR), "%s: Cannot open '%s' - %s\n",
+                                     sim_uname (uptr), cptr, strerror (errno));
+            if (create_function)
+                uptr->fileref = create_function (cptr, ((t_offset)uptr->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1));/* create new file */
+            else
+                uptr->fileref = open_function (cptr, "wb+");/* open new file */
+            if (uptr->fileref == NULL)                  /* open fail? */
+                return sim_messagef (_err_return (uptr, SCPE_OPENERR), "%s: Cannot create '%s' - %s\n",
+                                     sim_uname (uptr), cptr, strerror (errno));
+            sim_messagef (SCPE_OK, "%s: Creating new file: %s\n", sim_uname (uptr), cptr);
+            created = TRUE;
+            }
+        }                                               /* end if null */
+    }                                                   /* end else */
+(void)get_disk_footer (uptr);
+if ((DK_GET_FMT (uptr) == DKUF_F_VHD) || (ctx->footer)) {
+    uint32 container_sector_size = 0, container_xfer_element_size = 0, container_sectors = 0;
+    char created_name[64];
+    const char *container_dtype = ctx->footer ? (char *)ctx->footer->DriveType : sim_vhd_disk_get_dtype (uptr->fileref, &container_sector_size, &container_xfer_element_size, created_name, NULL);
 
-#if defined(__cplusplus)
-extern "C" {
-#endif
-WINBASEAPI BOOL WINAPI GetFileSizeEx(HANDLE hFile, PLARGE_INTEGER lpFileSize);
-#if defined(__cplusplus)
-    }
-#endif
+    if (ctx->footer) {
+        container_sector_size = NtoHl (ctx->footer->SectorSize);
+        container_sectors = NtoHl (ctx->footer->SectorCount);
+        xfer_element_size = NtoHl (ctx->footer->TransferElementSize);
+        strlcpy (created_name, (char *)ctx->footer->CreatingSimulator, sizeof (created_name));
+        }
+    if ((DK_GET_FMT (uptr) == DKUF_F_VHD) && created && dtype) {
+        sim_vhd_disk_set_dtype (uptr->fileref, dtype, ctx->sector_size, ctx->xfer_element_size);
+        (void)get_disk_footer (uptr);
+        container_dtype = (char *)ctx->footer->DriveType;
+        }
+    if ((DK_GET_FMT (uptr) == DKUF_F_DDI) && created) {
+        if (!copied)                                    /* a copy already has its store */
+            _sim_disk_ddi_new_store (uptr, uptr->fileref);
+        if (dtype)
+            sim_ddi_disk_set_dtype (uptr->fileref, dtype, ctx->sector_size, ctx->xfer_element_size);
+        (void)get_disk_footer (uptr);
+        container_dtype = (char *)ctx->footer->DriveType;
+        }
+    if (dtype) {
+        char cmd[32];
+        t_stat r = SCPE_OK;
 
-struct _device_type {
-    int32 Type;
-    const char *desc;
-    } DeviceTypes[] = {
-        {FILE_DEVICE_8042_PORT,             "8042_PORT"},
-        {FILE_DEVICE_ACPI,                  "ACPI"},
-        {FILE_DEVICE_BATTERY,               "BATTERY"},
-        {FILE_DEVICE_BEEP,                  "BEEP"},
-#ifdef FILE_DEVICE_BLUETOOTH
-        {FILE_DEVICE_BLUETOOTH,             "BLUETOOTH"},
-#endif
-        {FILE_DEVICE_BUS_EXTENDER,          "BUS_EXTENDER"},
-        {FILE_DEVICE_CD_ROM,                "CD_ROM"},
-        {FILE_DEVICE_CD_ROM_FILE_SYSTEM,    "CD_ROM_FILE_SYSTEM"},
-        {FILE_DEVICE_CHANGER,               "CHANGER"},
-        {FILE_DEVICE_CONTROLLER,            "CONTROLLER"},
-#ifdef FILE_DEVICE_CRYPT_PROVIDER
-        {FILE_DEVICE_CRYPT_PROVIDER,        "CRYPT_PROVIDER"},
-#endif
-        {FILE_DEVICE_DATALINK,              "DATALINK"},
-        {FILE_DEVICE_DFS,                   "DFS"},
-        {FILE_DEVICE_DFS_FILE_SYSTEM,       "DFS_FILE_SYSTEM"},
-        {FILE_DEVICE_DFS_VOLUME,            "DFS_VOLUME"},
-        {FILE_DEVICE_DISK,                  "DISK"},
-        {FILE_DEVICE_DISK_FILE_SYSTEM,      "DISK_FILE_SYSTEM"},
-        {FILE_DEVICE_DVD,                   "DVD"},
-        {FILE_DEVICE_FILE_SYSTEM,           "FILE_SYSTEM"},
-#ifdef FILE_DEVICE_FIPS
-        {FILE_DEVICE_FIPS,                  "FIPS"},
-#endif
-        {FILE_DEVICE_FULLSCREEN_VIDEO,      "FULLSCREEN_VIDEO"},
-#ifdef FILE_DEVICE_INFINIBAND
-        {FILE_DEVICE_INFINIBAND,            "INFINIBAND"},
-#endif
-        {FILE_DEVICE_INPORT_PORT,           "INPORT_PORT"},
-        {FILE_DEVICE_KEYBOARD,              "KEYBOARD"},
-        {FILE_DEVICE_KS,                    "KS"},
-        {FILE_DEVICE_KSEC,                  "KSEC"},
-        {FILE_DEVICE_MAILSLOT,              "MAILSLOT"},
-        {FILE_DEVICE_MASS_STORAGE,          "MASS_STORAGE"},
-        {FILE_DEVICE_MIDI_IN,               "MIDI_IN"},
-        {FILE_DEVICE_MIDI_OUT,              "MIDI_OUT"},
-        {FILE_DEVICE_MODEM,                 "MODEM"},
-        {FILE_DEVICE_MOUSE,                 "MOUSE"},
-        {FILE_DEVICE_MULTI_UNC_PROVIDER,    "MULTI_UNC_PROVIDER"},
-        {FILE_DEVICE_NAMED_PIPE,            "NAMED_PIPE"},
-        {FILE_DEVICE_NETWORK,               "NETWORK"},
-        {FILE_DEVICE_NETWORK_BROWSER,       "NETWORK_BROWSER"},
-        {FILE_DEVICE_NETWORK_FILE_SYSTEM,   "NETWORK_FILE_SYSTEM"},
-        {FILE_DEVICE_NETWORK_REDIRECTOR,    "NETWORK_REDIRECTOR"},
-        {FILE_DEVICE_NULL,                  "NULL"},
-        {FILE_DEVICE_PARALLEL_PORT,         "PARALLEL_PORT"},
-        {FILE_DEVICE_PHYSICAL_NETCARD,      "PHYSICAL_NETCARD"},
-        {FILE_DEVICE_PRINTER,               "PRINTER"},
-        {FILE_DEVICE_SCANNER,               "SCANNER"},
-        {FILE_DEVICE_SCREEN,                "SCREEN"},
-        {FILE_DEVICE_SERENUM,               "SERENUM"},
-        {FILE_DEVICE_SERIAL_MOUSE_PORT,     "SERIAL_MOUSE_PORT"},
-        {FILE_DEVICE_SERIAL_PORT,           "SERIAL_PORT"},
-        {FILE_DEVICE_SMARTCARD,             "SMARTCARD"},
-        {FILE_DEVICE_SMB,                   "SMB"},
-        {FILE_DEVICE_SOUND,                 "SOUND"},
-        {FILE_DEVICE_STREAMS,               "STREAMS"},
-        {FILE_DEVICE_TAPE,                  "TAPE"},
-        {FILE_DEVICE_TAPE_FILE_SYSTEM,      "TAPE_FILE_SYSTEM"},
-        {FILE_DEVICE_TERMSRV,               "TERMSRV"},
-        {FILE_DEVICE_TRANSPORT,             "TRANSPORT"},
-        {FILE_DEVICE_UNKNOWN,               "UNKNOWN"},
-        {FILE_DEVICE_VDM,                   "VDM"},
-        {FILE_DEVICE_VIDEO,                 "VIDEO"},
-        {FILE_DEVICE_VIRTUAL_DISK,          "VIRTUAL_DISK"},
-#ifdef FILE_DEVICE_VMBUS
-        {FILE_DEVICE_VMBUS,                 "VMBUS"},
-#endif
-        {FILE_DEVICE_WAVE_IN,               "WAVE_IN"},
-        {FILE_DEVICE_WAVE_OUT,              "WAVE_OUT"},
-#ifdef FILE_DEVICE_WPD
-        {FILE_DEVICE_WPD,                   "WPD"},
-#endif
-        {0,                                 NULL}};
-
-static const char *_device_type_name (int DeviceType)
-{
-int i;
-
-for (i=0; DeviceTypes[i].desc; i++)
-    if (DeviceTypes[i].Type == DeviceType)
-        return DeviceTypes[i].desc;
-return "Unknown";
-}
-
-static t_stat sim_os_disk_implemented_raw (void)
-{
-return sim_toffset_64 ? SCPE_OK : SCPE_NOFNC;
-}
+        if ((strcmp (container_dtype, dtype) == 0) ||
+            (((container_sector_size == 0) || (container_sector_size == ctx->sector_size)) &&
+             ((container_xfer_element_size == 0) || (container_xfer_element_size == ctx->xfer_element_size)))) {
+            if (strcmp (container_dtype, dtype) != 0) {
+                if ((drivetypes != NULL) || (!dontchangecapac)) { /* Autosize allowed */
+                    snprintf (cmd, sizeof (cmd), "%s %s", sim_uname (uptr), container_dtype);
+                    r = set_cmd (0, cmd);
+                    if (r != SCPE_OK)
+                        r = sim_messagef (SCPE_INCOMPDSK, "%s: Cannot set to drive type %s\n", sim_uname (uptr), container_dtype);
+                    }
+                current_unit_size = ((t_offset)uptr->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1);
+                if (ctx->container_size > current_unit_size) {
+                    if ((uptr->flags & UNIT_RO) != 0)                   /* Not Opening read only? */
+                        r = sim_messagef (SCPE_OK, "%s: Read Only access to inconsistent drive type allowed\n", sim_uname (uptr));
+                    else
+                        r = sim_messagef (SCPE_INCOMPDSK, "%s: '%s' can only be attached Read Only\n", sim_uname (uptr), cptr);
+                    }
+                }
+            else { /* Type already matches, Need to confirm compatibility */
+                t_addr saved_capac = uptr->capac;
+                t_lba current_unit_sectors = (t_lba)((dptr->flags & DEV_SECTORS) ? uptr->capac : (uptr->capac*ctx->capac_factor)/ctx->sector_size);
 
-static FILE *sim_os_disk_open_raw (const char *rawdevicename, const char *openmode)
-{
-HANDLE Handle;
-DWORD DesiredAccess = 0;
-uint32 is_cdrom;
-char *tmpname = (char *)malloc (2 + strlen (rawdevicename));
+                if ((container_sector_size != 0) && (sector_size != container_sector_size))
+                    r = sim_messagef (SCPE_OPENERR, "%s: Incompatible Container Sector Size %d\n", sim_uname (uptr), container_sector_size);
+                else {
+                    if (dontchangecapac &&
+                        ((((t_lba)(ctx->container_size/sector_size) > current_unit_sectors)) ||
+                         ((container_sectors != 0) && (container_sectors != current_unit_sectors)))) {
+                         r = sim_messagef (SCPE_OK, "%s: Container has %u sectors, drive has: %u sectors\n", sim_uname (uptr), container_sectors, current_unit_sectors);
+                         if (container_sectors != 0)
+                             r = sim_messagef (SCPE_INCOMPDSK, "%s: %s container created by the %s simulator is incompatible with the %s device on the %s simulator\n", sim_uname (uptr), container_dtype, created_name, uptr->dptr->name, sim_name);
+                         else
+                             r = sim_messagef (SCPE_INCOMPDSK, "%s: disk container %s is incompatible with the %s device\n", sim_uname (uptr), uptr->filename, uptr->dptr->name);
+                         if ((uptr->flags & UNIT_RO) != 0)
+                             r = sim_messagef (SCPE_OK, "%s: Read Only access to incompatible %s container '%s' allowed\n", sim_uname (uptr), container_dtype, uptr->filename);
+                         if (container_sectors < current_unit_sectors) {
+                             r = sim_messagef (SCPE_BARE_STATUS (r), "%s: Since the container is smaller than the drive, this might be useful:\n", sim_uname (uptr));
+                             r = sim_messagef (SCPE_BARE_STATUS (r), "%s:   sim> ATTACH %s -C New-%s %s\n", sim_uname (uptr), sim_uname (uptr), uptr->filename, uptr->filename);
+                             }
+                        }
+                    }
+                if (r == SCPE_OK) {
+                    int32 saved_show_message = sim_show_message;
 
-if (tmpname == NULL)
-    return NULL;
-if (strchr (openmode, 'r'))
-    DesiredAccess |= GENERIC_READ;
-if (strchr (openmode, 'w') || strchr (openmode, '+'))
-    DesiredAccess |= GENERIC_WRITE;
-/* SCP Command Line parsing replaces \\ with \ presuming this is an
-   escape sequence.  This only affects RAW device names and UNC paths.
-   We handle the RAW device name case here by prepending paths beginning
-   with \.\ with an extra \. */
-if ((!memcmp ("\\.\\", rawdevicename, 3)) ||
-    (!memcmp ("/./", rawdevicename, 3))) {
-    *tmpname = '\\';
-    strcpy (tmpname + 1, rawdevicename);
-    }
-else
-    strcpy (tmpname, rawdevicename);
-Handle = CreateFileA (tmpname, DesiredAccess, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS|FILE_FLAG_WRITE_THROUGH, NULL);
-free (tmpname);
-if (Handle != INVALID_HANDLE_VALUE) {
-    if ((sim_os_disk_info_raw ((FILE *)Handle, NULL, NULL, &is_cdrom)) ||
-        ((DesiredAccess & GENERIC_WRITE) && is_cdrom)) {
-        CloseHandle (Handle);
-        errno = EACCES;
-        return NULL;
+                    snprintf (cmd, sizeof (cmd), "%s %s", sim_uname (uptr), container_dtype);
+                    set_cmd (0, "NOMESSAGE");
+                    set_cmd (0, cmd);
+                    sim_show_message = saved_show_message;
+                    }
+                }
+            if (r == SCPE_OK)
+                autosized = TRUE;
+            }
+        else
+            r = sim_messagef (SCPE_INCOMPDSK, "%s: %s container created by the %s simulator is incompatible with the %s device on the %s simulator\n", sim_uname (uptr), container_dtype, created_name, uptr->dptr->name, sim_name);
+        if (r != SCPE_OK) {
+            uptr->flags |= UNIT_ATT;
+            sim_disk_detach (uptr);                         /* report error now */
+            sprintf (cmd, "%s%d %s", dptr->name, (int)(uptr-dptr->units), dtype);/* restore original dtype */
+            set_cmd (0, cmd);
+            return r;
+            }
         }
-    return (FILE *)Handle;
-    }
-_set_errno_from_status (GetLastError ());
-return NULL;
-}
-
-static int sim_os_disk_close_raw (FILE *f)
-{
-if (!CloseHandle ((HANDLE)f)) {
-    _set_errno_from_status (GetLastError ());
-    return EOF;
     }
-return 0;
-}
+uptr->flags |= UNIT_ATT;
+uptr->pos = 0;
 
-static void sim_os_disk_flush_raw (FILE *f)
-{
-FlushFileBuffers ((HANDLE)f);
-}
+/* Get Device attributes if they are available */
+if (storage_function)
+    storage_function (uptr->fileref, &ctx->storage_sector_size, &ctx->removable, &ctx->is_cdrom);
 
-static t_offset sim_os_disk_size_raw (FILE *Disk)
-{
-DWORD IoctlReturnSize;
-LARGE_INTEGER Size;
+if ((created) && (!copied)) {
+    t_stat r = SCPE_OK;
+    uint8 *secbuf = (uint8 *)calloc (128, ctx->sector_size);     /* alloc temp sector buf */
 
-if (GetFileSizeEx((HANDLE)Disk, &Size))
-    return (t_offset)(Size.QuadPart);
-#ifdef IOCTL_STORAGE_READ_CAPACITY
-if (1) {
-    STORAGE_READ_CAPACITY S;
+    /*
+       On a newly created disk, we write zeros to the whole disk.
+       This serves 3 purposes:
+         1) it avoids strange allocation delays writing newly allocated
+            storage at the end of the disk during simulator operation
+         2) it allocates storage for the whole disk at creation time to
+            avoid strange failures which may happen during simulator execution
+            if the containing disk is full
+         3) it leaves a Simh Format disk at the intended size so it may
+            subsequently be autosized with the correct size.
+    */
+    if (secbuf == NULL)
+        r = SCPE_MEM;
+    if (r == SCPE_OK) { /* Write all blocks */
+        t_lba lba;
+        t_lba total_lbas = (t_lba)((((t_offset)uptr->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1))/ctx->sector_size);
 
-    ZeroMemory (&S, sizeof (S));
-    S.Version = sizeof (STORAGE_READ_CAPACITY);
-    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
-                         IOCTL_STORAGE_READ_CAPACITY,      /* dwIoControlCode */
-                         NULL,                             /* lpInBuffer */
-                         0,                                /* nInBufferSize */
-                         (LPVOID) &S,                      /* output buffer */
-                         (DWORD) sizeof(S),                /* size of output buffer */
-                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
-                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
-        return (t_offset)(S.DiskLength.QuadPart);
-    }
-#endif
-#ifdef IOCTL_DISK_GET_DRIVE_GEOMETRY_EX
-if (1) {
-    DISK_GEOMETRY_EX G;
+        for (lba = 0; (r == SCPE_OK) && (lba < total_lbas); lba += 128) {
+            t_seccnt sectors = ((lba + 128) <= total_lbas) ? 128 : total_lbas - lba;
 
-    ZeroMemory (&G, sizeof (G));
-    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
-                         IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, /* dwIoControlCode */
-                         NULL,                             /* lpInBuffer */
-                         0,                                /* nInBufferSize */
-                         (LPVOID) &G,                      /* output buffer */
-                         (DWORD) sizeof(G),                /* size of output buffer */
-                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
-                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
-        return (t_offset)(G.DiskSize.QuadPart);
-    }
-#endif
-#ifdef IOCTL_DISK_GET_DRIVE_GEOMETRY
-if (1) {
-    DISK_GEOMETRY G;
+            r = sim_disk_wrsect (uptr, lba, secbuf, NULL, sectors);
+            }
+        }
+    free (secbuf);
+    if (r != SCPE_OK) {
+        sim_disk_detach (uptr);                         /* report error now */
+        (void)remove (cptr);                            /* remove the created file */
+        return SCPE_OPENERR;
+        }
+    if (sim_switches & SWMASK ('I')) {                  /* Initialize To Sector Address */
+        size_t init_buf_size = 1024*1024;
+        uint8 *init_buf = (uint8*) malloc (init_buf_size);
+        t_lba lba, sect;
+        uint32 capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* capacity units (quadword: 8, word: 2, byte: 1) */
+        t_seccnt sectors_per_buffer = (t_seccnt)((init_buf_size)/sector_size);
+        t_lba total_sectors = (t_lba)((uptr->capac*capac_factor)/(sector_size/((dptr->flags & DEV_SECTORS) ? 512 : 1)));
+        t_seccnt sects = sectors_per_buffer;
 
-    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
-                         IOCTL_DISK_GET_DRIVE_GEOMETRY,    /* dwIoControlCode */
-                         NULL,                             /* lpInBuffer */
-                         0,                                /* nInBufferSize */
-                         (LPVOID) &G,                      /* output buffer */
-                         (DWORD) sizeof(G),                /* size of output buffer */
-                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
-                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
-        return (t_offset)(G.Cylinders.QuadPart*G.TracksPerCylinder*G.SectorsPerTrack*G.BytesPerSector);
-    }
-#endif
-_set_errno_from_status (GetLastError ());
-return (t_offset)-1;
-}
-
-static t_stat sim_os_disk_unload_raw (FILE *Disk)
-{
-#ifdef IOCTL_STORAGE_EJECT_MEDIA
-DWORD BytesReturned;
-uint32 Removable = FALSE;
+        if (!init_buf) {
+            sim_disk_detach (uptr);                         /* report error now */
+            (void)remove (cptr);
+            return SCPE_MEM;
+            }
+        sim_messagef (SCPE_OK, "Initializing %u sectors each %u bytes in size with the sector address\n", (uint32)total_sectors, (uint32)sector_size);
+        for (lba = 0; (lba < total_sectors) && (r == SCPE_OK); lba += sects) {
+            t_seccnt sects_written;
 
-sim_os_disk_info_raw (Disk, NULL, &Removable, NULL);
-if (Removable) {
-    if (!DeviceIoControl((HANDLE)Disk,                  /* handle to disk */
-                         IOCTL_STORAGE_EJECT_MEDIA,     /* dwIoControlCode */
-                         NULL,                          /* lpInBuffer */
-                         0,                             /* nInBufferSize */
-                         NULL,                          /* lpOutBuffer */
-                         0,                             /* nOutBufferSize */
-                         (LPDWORD) &BytesReturned,      /* number of bytes returned */
-                         (LPOVERLAPPED) NULL)) {        /* OVERLAPPED structure */
-        _set_errno_from_status (GetLastError ());
-        return SCPE_IOERR;
+            sects = sectors_per_buffer;
+            if (lba + sects > total_sectors)
+                sects = total_sectors - lba;
+            for (sect = 0; sect < sects; sect++) {
+                t_lba offset;
+                for (offset = 0; offset < sector_size; offset += sizeof(uint32))
+                    *((uint32 *)&init_buf[sect*sector_size + offset]) = (uint32)(lba + sect);
+                }
+            r = sim_disk_wrsect (uptr, lba, init_buf, &sects_written, sects);
+            if ((r != SCPE_OK) || (sects != sects_written)) {
+                free (init_buf);
+                sim_disk_detach (uptr);                         /* report error now */
+                (void)remove (cptr);                            /* remove the created file */
+                return sim_messagef (SCPE_OPENERR, "Error initializing each sector with its address: %s\n",
+                                                   (r == SCPE_OK) ? sim_error_text (r) : "sectors written not what was requested");
+                }
+            sim_messagef (SCPE_OK, "%s: Initialized To Sector Address %u/%u sectors.  %d%% complete.\r", sim_uname (uptr), (uint32)(lba + sects_written), (uint32)total_sectors, (int)((((float)lba)*100)/total_sectors));
+            }
+        sim_messagef (SCPE_OK, "%s: Initialized To Sector Address %u sectors.  100%% complete.       \n", sim_uname (uptr), (uint32)total_sectors);
+        free (init_buf);
         }
+    if (pdp11tracksize)
+        sim_disk_pdp11_bad_block (uptr, pdp11tracksize, sector_size/sizeof(uint16));
     }
-return SCPE_OK;
-#else
-return SCPE_NOFNC;
-#endif
-}
-
-static t_bool sim_os_disk_isavailable_raw (FILE *Disk)
-{
-#ifdef IOCTL_STORAGE_EJECT_MEDIA
-DWORD BytesReturned;
-uint32 Removable = FALSE;
+if (sim_switches & SWMASK ('K')) {
+    t_stat r = SCPE_OK;
+    t_lba lba, sect;
+    uint32 capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* capacity units (word: 2, byte: 1) */
+    t_seccnt sectors_per_buffer = (t_seccnt)((1024*1024)/sector_size);
+    t_lba total_sectors = (t_lba)((uptr->capac*capac_factor)/(sector_size/((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
+    t_seccnt sects = sectors_per_buffer;
+    t_seccnt sects_verify;
+    uint8 *verify_buf = (uint8*) malloc (1024*1024);
 
-sim_os_disk_info_raw (Disk, NULL, &Removable, NULL);
-if (Removable) {
-    if (!DeviceIoControl((HANDLE)Disk,                  /* handle to disk */
-                         IOCTL_STORAGE_CHECK_VERIFY,    /* dwIoControlCode */
-                         NULL,                          /* lpInBuffer */
-                         0,                             /* nInBufferSize */
-                         NULL,                          /* lpOutBuffer */
-                         0,                             /* nOutBufferSize */
-                         (LPDWORD) &BytesReturned,      /* number of bytes returned */
-                         (LPOVERLAPPED) NULL)) {        /* OVERLAPPED structure */
-        _set_errno_from_status (GetLastError ());
-        return FALSE;
+    if (!verify_buf) {
+        sim_disk_detach (uptr);                         /* report error now */
+        return SCPE_MEM;
         }
-    }
-#endif
-return TRUE;
-}
-
-static t_stat sim_os_disk_info_raw (FILE *Disk, uint32 *sector_size, uint32 *removable, uint32 *is_cdrom)
-{
-DWORD IoctlReturnSize;
-STORAGE_DEVICE_NUMBER Device;
-
-ZeroMemory (&Device, sizeof (Device));
-DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
-                IOCTL_STORAGE_GET_DEVICE_NUMBER,  /* dwIoControlCode */
-                NULL,                             /* lpInBuffer */
-                0,                                /* nInBufferSize */
-                (LPVOID) &Device,                 /* output buffer */
-                (DWORD) sizeof(Device),           /* size of output buffer */
-                (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
-                (LPOVERLAPPED) NULL);             /* OVERLAPPED structure */
+    for (lba = 0; (lba < total_sectors) && (r == SCPE_OK); lba += sects_verify) {
+        sects = sectors_per_buffer;
+        if (lba + sects > total_sectors)
+            sects = total_sectors - lba;
+        r = sim_disk_rdsect (uptr, lba, verify_buf, &sects_verify, sects);
+        if (r == SCPE_OK) {
+            if (sects != sects_verify)
+                sim_printf ("\n%s: Verification Error when reading lbn %d(0x%X) of %d(0x%X) Requested %u sectors, read %u sectors.\n",
+                            sim_uname (uptr), (int)lba, (int)lba, (int)total_sectors, (int)total_sectors, sects, sects_verify);
+            for (sect = 0; sect < sects_verify; sect++) {
+                t_lba offset;
+                t_bool sect_error = FALSE;
 
-if (sector_size)
-    *sector_size = 512;
-if (removable)
-    *removable = 0;
-if (is_cdrom)
-    *is_cdrom = (Device.DeviceType == FILE_DEVICE_CD_ROM) || (Device.DeviceType == FILE_DEVICE_DVD);
-#ifdef IOCTL_STORAGE_READ_CAPACITY
-if (1) {
-    STORAGE_READ_CAPACITY S;
+                for (offset = 0; offset < sector_size; offset += sizeof(uint32)) {
+                    if (*((uint32 *)&verify_buf[sect*sector_size + offset]) != (uint32)(lba + sect)) {
+                        sect_error = TRUE;
+                        break;
+                        }
+                    }
+                if (sect_error) {
+                    uint32 save_dctrl = dptr->dctrl;
+                    FILE *save_sim_deb = sim_deb;
 
-    ZeroMemory (&S, sizeof (S));
-    S.Version = sizeof (STORAGE_READ_CAPACITY);
-    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
-                         IOCTL_STORAGE_READ_CAPACITY,      /* dwIoControlCode */
-                         NULL,                             /* lpInBuffer */
-                         0,                                /* nInBufferSize */
-                         (LPVOID) &S,                      /* output buffer */
-                         (DWORD) sizeof(S),                /* size of output buffer */
-                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
-                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
-        if (sector_size)
-            *sector_size = S.BlockLength;
+                    sim_printf ("\n%s: Verification Error on lbn %d(0x%X) of %d(0x%X).\n", sim_uname (uptr), (int)(lba+sect), (int)(lba+sect), (int)total_sectors, (int)total_sectors);
+                    dptr->dctrl = 0xFFFFFFFF;
+                    sim_deb = stdout;
+                    sim_disk_data_trace (uptr, verify_buf+sect*sector_size, lba+sect, sector_size,    "Found", TRUE, 1);
+                    dptr->dctrl = save_dctrl;
+                    sim_deb = save_sim_deb;
+                    }
+                }
+            }
+        sim_messagef (SCPE_OK, "%s: Verified containing Sector Address %u/%u sectors.  %d%% complete.\r", sim_uname (uptr), (uint32)lba, (uint32)total_sectors, (int)((((float)lba)*100)/total_sectors));
+        }
+    sim_messagef (SCPE_OK, "%s: Verified containing Sector Address %u sectors.  100%% complete.         \n", sim_uname (uptr), (uint32)lba);
+    free (verify_buf);
+    uptr->dynflags |= UNIT_DISK_CHK;
     }
-#endif
-#ifdef IOCTL_DISK_GET_DRIVE_GEOMETRY_EX
-if (1) {
-    DISK_GEOMETRY_EX G;
 
-    ZeroMemory (&G, sizeof (G));
-    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
-                         IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, /* dwIoControlCode */
-                         NULL,                             /* lpInBuffer */
-                         0,                                /* nInBufferSize */
-                         (LPVOID) &G,                      /* output buffer */
-                         (DWORD) sizeof(G),                /* size of output buffer */
-                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
-                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
-        if (sector_size)
-            *sector_size = G.Geometry.BytesPerSector;
+if (get_disk_footer (uptr) != SCPE_OK) {
+    sim_disk_detach (uptr);
+    return SCPE_OPENERR;
     }
-#endif
-#ifdef IOCTL_DISK_GET_DRIVE_GEOMETRY
-if (1) {
-    DISK_GEOMETRY G;
+filesystem_size = get_filesystem_size (uptr, NULL);
+if (filesystem_size != (t_offset)-1)
+    filesystem_size += reserved_sectors * sector_size;
+container_size = sim_disk_size (uptr);
+if ((filesystem_size == (t_offset)-1) &&
+    (ctx->footer != NULL))                      /* The presence of metadata means we already */
+    filesystem_size = ctx->container_size;      /* know the interesting disk size */
+current_unit_size = ((t_offset)uptr->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1);
+if (container_size && (container_size != (t_offset)-1)) {
+    if (dontchangecapac) {  /* autosize by changing drive type */
+        t_addr saved_capac = uptr->capac;
 
-    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
-                         IOCTL_DISK_GET_DRIVE_GEOMETRY,    /* dwIoControlCode */
-                         NULL,                             /* lpInBuffer */
-                         0,                                /* nInBufferSize */
-                         (LPVOID) &G,                      /* output buffer */
-                         (DWORD) sizeof(G),                /* size of output buffer */
-                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
-                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
-        if (sector_size)
-            *sector_size = G.BytesPerSector;
-    }
-#endif
-#ifdef IOCTL_STORAGE_GET_HOTPLUG_INFO
-if (1) {
-    STORAGE_HOTPLUG_INFO H;
+        if (drivetypes != NULL) {
+            if (filesystem_size != (t_offset)-1) {  /* File System found? */
+                /* Walk through all potential drive types until we find one the right size */
+                while (*drivetypes != NULL) {
+                    char cmd[CBUFSIZE];
+                    t_stat st;
 
-    ZeroMemory (&H, sizeof (H));
-    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
-                         IOCTL_STORAGE_GET_HOTPLUG_INFO,   /* dwIoControlCode */
-                         NULL,                             /* lpInBuffer */
-                         0,                                /* nInBufferSize */
-                         (LPVOID) &H,                      /* output buffer */
-                         (DWORD) sizeof(H),                /* size of output buffer */
-                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
-                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
-        if (removable)
-            *removable = H.MediaRemovable;
-    }
-#endif
-return SCPE_OK;
-}
+                    uptr->flags &= ~UNIT_ATT;   /* temporarily mark as un-attached */
+                    sprintf (cmd, "%s %s", sim_uname (uptr), *drivetypes);
+                    st = set_cmd (0, cmd);
+                    uptr->flags |= UNIT_ATT;    /* restore attached indicator */
+                    if (st == SCPE_OK)
+                        current_unit_size = ((t_offset)uptr->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1);
+                    if (current_unit_size >= filesystem_size)
+                        break;
+                    ++drivetypes;
+                    }
+            if (filesystem_size > current_unit_size) {
+                t_stat r = SCPE_FSSIZE;
+                char *capac1;
 
-static t_stat sim_os_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
-{
-OVERLAPPED pos;
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-long long addr = ((long long)lba) * ctx->sector_size;
-DWORD bytestoread = sects * ctx->sector_size;
+                uptr->capac = (t_addr)(filesystem_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
+                capac1 = strdup (sprint_capac (dptr, uptr));
+                uptr->capac = saved_capac;
+                r = sim_messagef (r, "%s: The file system on the disk %s is larger than simulated device (%s > %s)\n",
+                                    sim_uname (uptr), cptr, capac1, sprint_capac (dptr, uptr));
+                free (capac1);
+                sim_disk_detach (uptr);
+                return r;
+                }
+            else
+                autosized = TRUE;
+            }
+            else {
+                if (!created && (ctx->footer == NULL)) {
+                    sim_messagef (SCPE_OK, "%s: Amount of data in use in disk container '%s' cannot be determined, skipping autosizing\n", sim_uname (uptr), cptr);
+                    if (container_size > current_unit_size) {
+                        t_stat r = SCPE_FSSIZE;
+                        char *capac1;
 
-sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_rdsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
-if (sectsread)
-    *sectsread = 0;
-memset (&pos, 0, sizeof (pos));
-while (bytestoread) {
-    DWORD bytesread;
-    DWORD sectorbytes;
+                        uptr->capac = (t_addr)(container_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
+                        capac1 = strdup (sprint_capac (dptr, uptr));
+                        uptr->capac = saved_capac;
+                        r = sim_messagef (r, "%s: The disk container '%s' is larger than simulated device (%s > %s)\n",
+                                            sim_uname (uptr), cptr, capac1, sprint_capac (dptr, uptr));
+                        free (capac1);
+                        sim_disk_detach (uptr);
+                        return r;
+                        }
+                    }
+                }
+            }
+        if (filesystem_size != (t_offset)-1) {
+            if (filesystem_size > current_unit_size) {
+                t_stat r = SCPE_FSSIZE;
+                char *capac1;
 
-    pos.Offset = (DWORD)addr;
-    pos.OffsetHigh = (DWORD)(addr >> 32);
-    if (!ReadFile ((HANDLE)(uptr->fileref), buf, bytestoread, &bytesread, &pos)) {
-        if (ERROR_HANDLE_EOF == GetLastError ()) {  /* Return 0's for reads past EOF */
-            memset (buf, 0, bytestoread);
-            if (sectsread)
-                *sectsread += bytestoread / ctx->sector_size;
-            return SCPE_OK;
+                uptr->capac = (t_addr)(filesystem_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
+                capac1 = strdup (sprint_capac (dptr, uptr));
+                uptr->capac = saved_capac;
+                r = sim_messagef (r, "%s: The file system on the %s disk container is larger than simulated device (%s > %s)\n",
+                                    sim_uname (uptr), cptr, capac1, sprint_capac (dptr, uptr));
+                free (capac1);
+                sim_disk_detach (uptr);
+                return r;
+                }
+            if (filesystem_size == current_unit_size)
+                autosized = TRUE;
+            }
+        if ((container_size != current_unit_size)) {
+            if (container_size < current_unit_size) {
+                if ((DKUF_F_VHD == DK_GET_FMT (uptr)) || (DKUF_F_DDI == DK_GET_FMT (uptr))) {
+                    t_stat r = SCPE_INCOMPDSK;
+                    const char *container_dtype = ctx->footer ? (const char *)ctx->footer->DriveType : "";
+                    char *capac1;
+
+                    uptr->capac = (t_addr)(container_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
+                    capac1 = strdup (sprint_capac (dptr, uptr));
+                    uptr->capac = saved_capac;
+                    r = sim_messagef (r, "%s: non expandable %s%sdisk container '%s' is smaller than simulated device (%s < %s)\n",
+                                        sim_uname (uptr), container_dtype, (*container_dtype != '\0') ? " " : "", cptr, capac1, sprint_capac (dptr, uptr));
+                    free (capac1);
+                    sim_disk_detach (uptr);
+                    return r;
+                    }
+                }
+            else { /* (container_size > current_unit_size) */
+                if (0 == (uptr->flags & UNIT_RO)) {
+                    t_stat r = SCPE_OK;
+                    int32 saved_switches = sim_switches;
+                    const char *container_dtype;
+                    char *capac1;
+
+                    uptr->capac = (t_addr)(container_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? ctx->sector_size : 1)));
+                    capac1 = strdup (sprint_capac (dptr, uptr));
+                    uptr->capac = saved_capac;
+                    sim_disk_detach (uptr);
+                    sim_switches = SWMASK ('R');
+                    r = sim_disk_attach_ex (uptr, cptr, sector_size, xfer_element_size, dontchangecapac, dbit, dtype, pdp11tracksize, completion_delay, NULL);
+                    container_dtype = ctx->footer ? (const char *)ctx->footer->DriveType : "";
+                    sim_switches = saved_switches;
+                    if (r == SCPE_OK)
+                        r = sim_messagef (SCPE_OK, "%s: %s%sdisk container '%s' is larger than simulated device (%s > %s) Read Only Forced\n",
+                                sim_uname (uptr), container_dtype, (*container_dtype != '\0') ? " " : "", cptr,
+                                capac1, sprint_capac (dptr, uptr));
+                    free (capac1);
+                    return r;
+                    }
+                }
             }
-        _set_errno_from_status (GetLastError ());
-        return SCPE_IOERR;
         }
-    sectorbytes = (bytesread / ctx->sector_size) * ctx->sector_size;
-    if (bytesread > sectorbytes) {
-        memset (buf + bytesread, 0, bytestoread - bytesread);
-        sectorbytes += ctx->sector_size;
+    else {          /* Autosize by changing capacity */
+        if (filesystem_size != (t_offset)-1) {              /* Known file system data size AND */
+            if (filesystem_size >= container_size) {        /*    Data size >= container size? */
+                container_size = filesystem_size +          /*       Use file system data size */
+                             (pdp11tracksize * sector_size);/*       plus any bad block data beyond the file system */
+                autosized = TRUE;
+                }
+            }
+        else {                                              /* Unrecognized file system */
+            if (container_size < current_unit_size)         /*     Use MAX of container or current device size */
+                if ((DKUF_F_VHD != DK_GET_FMT (uptr)) &&    /*     when size can be expanded */
+                    (DKUF_F_DDI != DK_GET_FMT (uptr)) &&
+                    (0 == (uptr->flags & UNIT_RO))) {
+                    container_size = current_unit_size;     /*     Use MAX of container or current device size */
+                    autosized = TRUE;
+                    }
+            }
+        uptr->capac = (t_addr)(container_size/(ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1)));  /* update current size */
         }
-    if (sectsread)
-        *sectsread += sectorbytes / ctx->sector_size;
-    bytestoread -= sectorbytes;
-    buf +=  sectorbytes;
-    addr += sectorbytes;
     }
-return SCPE_OK;
-}
 
-static t_stat sim_os_disk_read (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *bytesread, uint32 bytes)
-{
-OVERLAPPED pos;
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+if ((uptr->flags & UNIT_RO) == 0) {
+    t_bool readonly;
+    int32 saved_quiet = sim_quiet;
 
-sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_read(unit=%d, addr=0x%X, bytes=%u)\n", (int)(uptr - ctx->dptr->units), (uint32)addr, bytes);
+    sim_quiet = 1;
+    get_filesystem_size (uptr, &readonly);
+    if (readonly) {
+        sim_disk_detach (uptr);
+        sim_switches |= SWMASK ('R');
+        sim_disk_attach_ex2 (uptr, cptr, sector_size, xfer_element_size, dontchangecapac,
+                            dbit, dtype, pdp11tracksize, completion_delay, drivetypes,
+                            reserved_sectors);
 
-memset (&pos, 0, sizeof (pos));
-pos.Offset = (DWORD)addr;
-pos.OffsetHigh = (DWORD)(addr >> 32);
-if (ReadFile ((HANDLE)(uptr->fileref), buf, (DWORD)bytes, (LPDWORD)bytesread, &pos))
-    return SCPE_OK;
-if (ERROR_HANDLE_EOF == GetLastError ()) {  /* Return 0's for reads past EOF */
-    memset (buf, 0, bytes);
-    if (bytesread)
-        *bytesread = bytes;
-    return SCPE_OK;
+        }
+    sim_quiet = saved_quiet;
     }
-_set_errno_from_status (GetLastError ());
-return SCPE_IOERR;
-}
-
-static t_stat sim_os_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
-{
-OVERLAPPED pos;
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-long long addr;
-DWORD byteswritten;
-DWORD bytestowrite = sects * ctx->sector_size;
+if (dtype && (created || (autosized && (ctx->footer == NULL))))
+    store_disk_footer (uptr, dtype);
 
-sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_wrsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+#if defined (SIM_ASYNCH_IO)
+sim_disk_set_async (uptr, completion_delay);
+#endif
+uptr->io_flush = _sim_disk_io_flush;
+_sim_disk_mmap_attach (uptr);
+_sim_disk_cache_attach (uptr);
 
-if (sectswritten)
-    *sectswritten = 0;
-addr = ((long long)lba) * ctx->sector_size;
-memset (&pos, 0, sizeof (pos));
-while (bytestowrite) {
-    DWORD sectorbytes;
+if (uptr->flags & UNIT_BUFABLE) {                       /* buffer in memory? */
+    t_seccnt sectsread;
+    t_stat r = SCPE_OK;
 
-    pos.Offset = (DWORD)addr;
-    pos.OffsetHigh = (DWORD)(addr >> 32);
-    if (!WriteFile ((HANDLE)(uptr->fileref), buf, bytestowrite, &byteswritten, &pos)) {
-        _set_errno_from_status (GetLastError ());
-        return SCPE_IOERR;
+    if (uptr->flags & UNIT_MUSTBUF) {                   /* dyn alloc? */
+        uptr->filebuf = calloc ((size_t)(ctx->container_size / ctx->xfer_element_size),
+                                    ctx->xfer_element_size);       /* allocate */
+        uptr->filebuf2 = calloc ((size_t)(ctx->container_size / ctx->xfer_element_size),
+                                    ctx->xfer_element_size);       /* allocate copy */
+        if ((uptr->filebuf == NULL) ||                  /* either failed? */
+            (uptr->filebuf2 == NULL)) {
+            sim_disk_detach (uptr);
+            return SCPE_MEM;                            /* memory allocation error */
+            }
         }
-    if (sectswritten)
-        *sectswritten += byteswritten / ctx->sector_size;
-    sectorbytes = (byteswritten / ctx->sector_size) * ctx->sector_size;
-    bytestowrite -= sectorbytes;
-    if (bytestowrite == 0)
-        break;
-    buf += sectorbytes;
-    addr += sectorbytes;
+    sim_messagef (SCPE_OK, "%s: buffering file in memory\n", sim_uname (uptr));
+    r = sim_disk_rdsect (uptr, 0, (uint8 *)uptr->filebuf, &sectsread, (t_seccnt)(ctx->container_size / ctx->sector_size));
+    if (r != SCPE_OK)
+        return sim_disk_detach (uptr);
+    uptr->hwmark = (sectsread * ctx->sector_size) / ctx->xfer_element_size;
+    memcpy (uptr->filebuf2, uptr->filebuf, (size_t)ctx->container_size);/* save initial contents */
+    uptr->flags |= UNIT_BUF;                            /* mark as buffered */
     }
+_sim_disk_stats_attach (uptr);                          /* count the simulator's I/O from here */
+
 return SCPE_OK;
 }
 
-static t_stat sim_os_disk_write (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *byteswritten, uint32 bytes)
+t_stat sim_disk_detach (UNIT *uptr)
 {
-OVERLAPPED pos;
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-
-sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_write(unit=%d, lba=0x%X, bytes=%u)\n", (int)(uptr - ctx->dptr->units), (uint32)addr, bytes);
+struct disk_context *ctx;
+int (*close_function)(FILE *f);
+FILE *fileref;
+t_bool auto_format;
 
-memset (&pos, 0, sizeof (pos));
-pos.Offset = (DWORD)addr;
-pos.OffsetHigh = (DWORD)(addr >> 32);
-if (WriteFile ((HANDLE)(uptr->fileref), buf, bytes, (LPDWORD)byteswritten, &pos))
-    return SCPE_OK;
-_set_errno_from_status (GetLastError ());
-return SCPE_IOERR;
-}
+if (uptr == NULL)
+    return SCPE_IERR;
+if (!(uptr->flags & UNIT_ATT))
+    return SCPE_UNATT;
 
-#elif defined (__linux) || defined (__linux__) || defined (__APPLE__)|| defined (__sun) || defined (__sun__) || defined (__hpux) || defined (_AIX)
+ctx = (struct disk_context *)uptr->disk_ctx;
+fileref = uptr->fileref;
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
-#if defined(HAVE_SYS_IOCTL)
-#include <sys/ioctl.h>
-#endif
-#if defined(HAVE_LINUX_CDROM)
-#include <linux/cdrom.h>
-#endif
+sim_debug_unit (ctx->dbit, uptr, "sim_disk_detach(unit=%d,filename='%s')\n", (int)(uptr - ctx->dptr->units), uptr->filename);
 
-static t_stat sim_os_disk_implemented_raw (void)
-{
-return sim_toffset_64 ? SCPE_OK : SCPE_NOFNC;
-}
-
-static FILE *sim_os_disk_open_raw (const char *rawdevicename, const char *openmode)
-{
-int mode = 0;
-int fd;
-
-if (strchr (openmode, 'r') && (strchr (openmode, '+') || strchr (openmode, 'w')))
-    mode = O_RDWR;
-else
-    if (strchr (openmode, 'r'))
-        mode = O_RDONLY;
-#ifdef O_LARGEFILE
-mode |= O_LARGEFILE;
-#endif
-#ifdef O_DSYNC
-mode |= O_DSYNC;
-#endif
-fd = open (rawdevicename, mode, 0);
-if (fd < 0)
-    return (FILE *)NULL;
-return (FILE *)((long)fd);
-}
-
-static int sim_os_disk_close_raw (FILE *f)
-{
-return close ((int)((long)f));
-}
-
-static void sim_os_disk_flush_raw (FILE *f)
-{
-fsync ((int)((long)f));
-}
-
-static t_offset sim_os_disk_size_raw (FILE *f)
-{
-t_offset pos, size;
-
-pos = (t_offset)lseek ((int)((long)f), (off_t)0, SEEK_CUR);
-size = (t_offset)lseek ((int)((long)f), (off_t)0, SEEK_END);
-if (pos != (t_offset)-1)
-    (void)lseek ((int)((long)f), (off_t)pos, SEEK_SET);
-return size;
-}
-
-static t_stat sim_os_disk_unload_raw (FILE *f)
-{
-#if defined(CDROM_GET_CAPABILITY) && defined(CDROMEJECT) && defined(CDROMEJECT_SW)
-if (ioctl ((int)((long)f), CDROM_GET_CAPABILITY, NULL) < 0)
+switch (DK_GET_FMT (uptr)) {                            /* case on format */
+    case DKUF_F_STD:                                    /* Simh */
+        close_function = fclose;
+        break;
+    case DKUF_F_VHD:                                    /* Virtual Disk */
+        close_function = sim_vhd_disk_close;
+        break;
+    case DKUF_F_DDI:                                    /* Deduplicated Disk Image */
+        close_function = sim_ddi_disk_close;
+        break;
+    case DKUF_F_RAW:                                    /* Physical */
+        close_function = sim_os_disk_close_raw;
+        break;
+    default:
+        return SCPE_IERR;
+        }
+if (!(uptr->flags & UNIT_ATTABLE))                      /* attachable? */
+    return SCPE_NOATT;
+if (!(uptr->flags & UNIT_ATT))                          /* attached? */
+    return SCPE_OK;
+if (NULL == find_dev_from_unit (uptr))
     return SCPE_OK;
-if (ioctl((int)((long)f), CDROM_LOCKDOOR, 0) < 0)
-    return SCPE_IOERR;
-if (ioctl((int)((long)f), CDROMEJECT) < 0)
-    return SCPE_IOERR;
-#endif
-return SCPE_OK;
-}
-
-static t_bool sim_os_disk_isavailable_raw (FILE *Disk)
-{
-#if defined(CDROMSTART) && defined(CDROM_GET_CAPABILITY)
-if (ioctl ((int)((long)Disk), CDROM_GET_CAPABILITY, NULL) < 0)
-    return TRUE;
-switch (ioctl((int)((long)Disk), CDROM_DRIVE_STATUS, CDSL_NONE)) {
-    case CDS_NO_INFO:
-    case CDS_NO_DISC:
-    case CDS_TRAY_OPEN:
-    case CDS_DRIVE_NOT_READY:
-    default: /* error */
-        return FALSE;
-    case CDS_DISC_OK:
-        return TRUE;
-    }
-#endif
-return TRUE;
-}
-
-static t_stat sim_os_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
-{
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-off_t addr = ((off_t)lba) * ctx->sector_size;
-ssize_t bytesread;
-size_t bytestoread = sects * ctx->sector_size;
-
-sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_rdsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
 
-if (sectsread)
-    *sectsread = 0;
-while (bytestoread) {
-    size_t sectorbytes;
+if ((uptr->flags & UNIT_BUF) && (uptr->filebuf)) {
+    uint32 cap = (uptr->hwmark + uptr->dptr->aincr - 1) / uptr->dptr->aincr;
 
-    bytesread = pread((int)((long)uptr->fileref), buf, bytestoread, addr);
-    if (bytesread < 0) {
-        return SCPE_IOERR;
+    if (((uptr->flags & UNIT_RO) == 0) &&
+        (memcmp (uptr->filebuf, uptr->filebuf2, (size_t)ctx->container_size) != 0)) {
+        sim_messagef (SCPE_OK, "%s: writing buffer to file: %s\n", sim_uname (uptr), uptr->filename);
+        sim_disk_wrsect (uptr, 0, (uint8 *)uptr->filebuf, NULL, (cap + ctx->sector_size - 1) / ctx->sector_size);
         }
-    if ((size_t)bytesread < bytestoread) {/* read zeros at/past EOF */
-        memset (buf + bytesread, 0, bytestoread - bytesread);
-        bytesread = bytestoread;
+    if (uptr->flags & UNIT_MUSTBUF) {                   /* dyn alloc? */
+        free (uptr->filebuf);                           /* free buffers */
+        uptr->filebuf = NULL;
+        free (uptr->filebuf2);
+        uptr->filebuf2 = NULL;
         }
-    sectorbytes = (bytesread / ctx->sector_size) * ctx->sector_size;
-    if ((size_t)bytesread > sectorbytes)
-        sectorbytes += ctx->sector_size;
-    if (sectsread)
-        *sectsread += sectorbytes / ctx->sector_size;
-    bytestoread -= sectorbytes;
-    buf += sectorbytes;
-    addr += sectorbytes;
+    uptr->flags = uptr->flags & ~UNIT_BUF;
     }
-return SCPE_OK;
-}
-
-static t_stat sim_os_disk_read (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *rbytesread, uint32 bytes)
-{
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-ssize_t bytesread;
 
-sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_read(unit=%d, addr=0x%X, bytes=%u)\n", (int)(uptr - ctx->dptr->units), (uint32)addr, bytes);
+_sim_disk_commit_poll (uptr, TRUE);                     /* let a commit finish */
+_sim_disk_cache_free (uptr);                            /* write back and release cache */
+update_disk_footer (uptr);                              /* Update meta data if highwater has changed */
 
-bytesread = pread((int)((long)uptr->fileref), buf, bytes, (off_t)addr);
-if (bytesread < 0) {
-    if (rbytesread)
-        *rbytesread = 0;
-    return SCPE_IOERR;
-    }
-if (rbytesread)
-    *rbytesread = bytesread;
-return SCPE_OK;
-}
+auto_format = ctx->auto_format;
 
-static t_stat sim_os_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
-{
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-off_t addr = ((off_t)lba) * ctx->sector_size;
-ssize_t byteswritten;
-size_t bytestowrite = sects * ctx->sector_size;
+if (uptr->io_flush)
+    uptr->io_flush (uptr);                              /* flush buffered data */
 
-sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_wrsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+sim_disk_clr_async (uptr);
+#if defined (SIM_ASYNCH_IO)
+_disk_aio_release (ctx);
+#endif
+_sim_disk_mmap_free (uptr);                             /* unmap before the container is closed */
 
-if (sectswritten)
-    *sectswritten = 0;
-while (bytestowrite) {
-    size_t sectorbytes;
+uptr->flags &= ~(UNIT_ATT | UNIT_RO);
+uptr->dynflags &= ~(UNIT_NO_FIO | UNIT_DISK_CHK);
+free (uptr->filename);
+uptr->filename = NULL;
+uptr->fileref = NULL;
+free (ctx->footer);
+free (uptr->disk_ctx);
+uptr->disk_ctx = NULL;
+uptr->io_flush = NULL;
+if (auto_format)
+    sim_disk_set_fmt (uptr, 0, "AUTO", NULL);           /* restore file format */
 
-    byteswritten = pwrite((int)((long)uptr->fileref), buf, bytestowrite, addr);
-    if (byteswritten < 0) {
-        return SCPE_IOERR;
-        }
-    if (sectswritten)
-        *sectswritten += byteswritten / ctx->sector_size;
-    sectorbytes = (byteswritten / ctx->sector_size) * ctx->sector_size;
-    bytestowrite -= sectorbytes;
-    if (bytestowrite == 0)
-        break;
-    buf += sectorbytes;
-    addr += sectorbytes;
-    }
+if (close_function (fileref) == EOF)
+    return SCPE_IOERR;
 return SCPE_OK;
 }
 
-static t_stat sim_os_disk_write (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *rbyteswritten, uint32 bytes)
+t_stat sim_disk_attach_help(FILE *st, DEVICE *dptr, UNIT *uptr, int32 flag, const char *cptr)
 {
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
-ssize_t byteswritten;
+static struct example_fields {
+    const char *dname;
+    const char *dtype;
+    const char *dsize;
+    const char *dtype2;
+    const char *dsize2;
+    const char *dtype3;
+    const char *dsize3;
+    const char *dtype4;
+    const char *dsize4;
+    } ex_data[] = {
+        {"RQ", "RD54", "159MB", "RX50", "409KB", "RA81", "456MB", "RA92", "1505MB"},
+        {"RP", "RM03",  "33MW", "RM03",  "33MW", "RP07", "258MW", "RM03",  "15MW"},
+        {"RP", "RM03",  "39MW", "RM03",  "39MW", "RP07", "110MW", "RM03",  "15MW"},
+    };
+struct example_fields *ex = &ex_data[0];
 
-sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_write(unit=%d, addr=0x%X, bytes=%u)\n", (int)(uptr - ctx->dptr->units), (uint32)addr, bytes);
+if (strcmp (dptr->name, "RP") == 0)
+    ex = &ex_data[1];
+if (strstr (sim_name, "-10")) {
+    ex = &ex_data[2];
+    if (strstr (sim_name, "PDP") == NULL)
+        ex->dname = "RPA";
+    }
 
-if (rbyteswritten)
-    *rbyteswritten = 0;
-byteswritten = pwrite((int)((long)uptr->fileref), buf, bytes, (off_t)addr);
-if (byteswritten < 0)
-    return SCPE_IOERR;
-if (rbyteswritten)
-    *rbyteswritten = byteswritten;
-return SCPE_OK;
-}
+fprintf (st, "%s Disk Attach Help\n\n", dptr->name);
 
-static t_stat sim_os_disk_info_raw (FILE *f, uint32 *sector_size, uint32 *removable, uint32 *is_cdrom)
-{
-if (sector_size) {
-#if defined(BLKSSZGET)
-    if (ioctl ((int)((long)f), BLKSSZGET, sector_size) < 0)
-#endif
-        *sector_size = 512;
+fprintf (st, "Disk container files can be one of several different types:\n\n");
+if (strstr (sim_name, "-10") == NULL) {
+    fprintf (st, "    SIMH   A disk is an unstructured binary file of the size appropriate\n");
+    fprintf (st, "           for the disk drive being simulated accessed by C runtime APIs\n");
+    fprintf (st, "    VHD    Virtual Disk format which is described in the \"Microsoft\n");
+    fprintf (st, "           Virtual Hard Disk (VHD) Image Format Specification\".  The\n");
+    fprintf (st, "           VHD implementation includes support for 1) Fixed (Preallocated)\n");
+    fprintf (st, "           disks, 2) Dynamically Expanding disks, and 3) Differencing disks.\n");
+    fprintf (st, "    RAW    platform specific access to physical disk or CDROM drives\n\n");
     }
-if (removable)
-    *removable = 0;
-if (is_cdrom) {
-#if defined(CDROM_GET_CAPABILITY)
-    int cd_cap = ioctl ((int)((long)f), CDROM_GET_CAPABILITY, NULL);
-
-    if (cd_cap < 0)
-        *is_cdrom = 0;
-    else {
-        *is_cdrom = 1;
-        if (removable)
-            *removable = 1;
-        if (sector_size)
-            *sector_size = 2048;
-        }
-#else
-    *is_cdrom = 0;
-#endif
+else {
+    fprintf (st, "    SIMH   A disk is an unstructured binary file of 64bit integers\n"
+                 "           access by C runtime APIs\n");
+    fprintf (st, "    VHD    A disk is an unstructured binary file of 64bit integers\n"
+                 "           contained in a VHD container\n");
+    fprintf (st, "    RAW    A disk is an unstructured binary file of 64bit integers\n"
+                 "           accessed by direct read/write APIs\n");
+    fprintf (st, "    DBD9   Compatible with KLH10 is a packed big endian word\n");
+    fprintf (st, "    DLD9   Compatible with KLH10 is a packed little endian word\n\n");
     }
-return SCPE_OK;
-}
-
-#else
-/*============================================================================*/
-/*                        Non-implemented versions                            */
-/*============================================================================*/
+fprintf (st, "Virtual (VHD) Disk  support conforms to the \"Virtual Hard Disk Image Format\n");
+fprintf (st, "Specification\", Version 1.0 October 11, 2006.\n");
+fprintf (st, "Dynamically expanding disks never change their \"Virtual Size\", but they don't\n");
+fprintf (st, "consume disk space on the containing storage until the virtual sectors in the\n");
+fprintf (st, "disk are actually written to (i.e. a 2GB Dynamic disk container file with only\n");
+fprintf (st, "30MB of data will initially be about 30MB in size and this size will grow up to\n");
+fprintf (st, "2GB as different sectors are written to.  The VHD format contains metadata\n");
+fprintf (st, "which describes the drive size and the simh device type in use when the VHD\n");
+fprintf (st, "was created.  This metadata is therefore available whenever that VHD is\n");
+fprintf (st, "attached to an emulated disk device in the future so the device type and\n");
+fprintf (st, "size can be automatically be configured.\n\n");
 
-static t_stat sim_os_disk_implemented_raw (void)
-{
-return SCPE_NOFNC;
-}
+if (dptr->numunits > 1) {
+    uint32 i, attachable_count = 0, out_count = 0, skip_count;
 
-static FILE *sim_os_disk_open_raw (const char *rawdevicename, const char *openmode)
-{
-return NULL;
+    for (i=0; i < dptr->numunits; ++i)
+        if ((dptr->units[i].flags & UNIT_ATTABLE) &&
+            !(dptr->units[i].flags & UNIT_DIS))
+            ++attachable_count;
+    for (i=0; (i < dptr->numunits) && (out_count < 2); ++i)
+        if ((dptr->units[i].flags & UNIT_ATTABLE) &&
+            !(dptr->units[i].flags & UNIT_DIS)) {
+            fprintf (st, "  sim> ATTACH {switches} %s%d diskfile\n", dptr->name, i);
+            ++out_count;
+            }
+    if (attachable_count > 4) {
+        fprintf (st, "       .\n");
+        fprintf (st, "       .\n");
+        fprintf (st, "       .\n");
+        }
+    skip_count = attachable_count - 2;
+    for (i=0; i < dptr->numunits; ++i)
+        if ((dptr->units[i].flags & UNIT_ATTABLE) &&
+            !(dptr->units[i].flags & UNIT_DIS)) {
+            if (skip_count == 0)
+                fprintf (st, "  sim> ATTACH {switches} %s%d diskfile\n", dptr->name, i);
+            else
+                --skip_count;
+            }
+    }
+else
+    fprintf (st, "  sim> ATTACH {switches} %s diskfile\n", dptr->name);
+fprintf (st, "\n%s attach command switches\n", dptr->name);
+fprintf (st, "    -R          Attach Read Only.\n");
+fprintf (st, "    -E          Must Exist (if not specified an attempt to create the indicated\n");
+fprintf (st, "                disk container will be attempted).\n");
+fprintf (st, "    -F          Open the indicated disk container in a specific format (default\n");
+fprintf (st, "                is to autodetect VHD defaulting to RAW if the indicated\n");
+fprintf (st, "                container is not a VHD).\n");
+fprintf (st, "    -I          Initialize newly created disk so that each sector contains its\n");
+fprintf (st, "                sector address\n");
+fprintf (st, "    -K          Verify that the disk contents contain the sector address in each\n");
+fprintf (st, "                sector.  Whole disk checked at attach time and each sector is\n");
+fprintf (st, "                checked when written.\n");
+fprintf (st, "    -C          Create a disk container and copy its contents from another disk\n");
+fprintf (st, "                (simh, VHD, or RAW format).  The current (or specified with -F)\n");
+fprintf (st, "                container format will be the format of the created container.\n");
+fprintf (st, "                AUTO or VHD will create a VHD container, SIMH will create a.\n");
+fprintf (st, "                SIMH container. Add a -V switch to verify a copy operation.\n");
+fprintf (st, "                Note: A copy will be performed between dissimilar sized\n");
+fprintf (st, "                containers.  Copying from a larger container to a smaller\n");
+fprintf (st, "                one will produce a truncated result.\n");
+fprintf (st, "    -V          Perform a verification pass to confirm successful data copy\n");
+fprintf (st, "                operation.\n");
+fprintf (st, "    -X          When creating a VHD, create a fixed sized VHD (vs a Dynamically\n");
+fprintf (st, "                expanding one).\n");
+fprintf (st, "    -D          Create a Differencing VHD (relative to an already existing VHD\n");
+fprintf (st, "                disk)\n");
+fprintf (st, "    -M          Merge a Differencing VHD into its parent VHD disk\n");
+fprintf (st, "    -O          Override consistency checks when attaching differencing disks\n");
+fprintf (st, "                which have unexpected parent disk GUID or timestamps\n\n");
+fprintf (st, "    -U          Fix inconsistencies which are overridden by the -O switch\n");
+if (strstr (sim_name, "-10") == NULL) {
+    fprintf (st, "    -Y          Answer Yes to prompt to overwrite last track (on disk create)\n");
+    fprintf (st, "    -N          Answer No to prompt to overwrite last track (on disk create)\n");
+    }
+fprintf (st, "Examples:\n");
+fprintf (st, "  sim> show %s\n", ex->dname);
+fprintf (st, "    %s, address=20001468-2000146B*, no vector, 4 units\n", ex->dname);
+fprintf (st, "    %s0, %s, not attached, write enabled, %s, autosize, AUTO detect format\n", ex->dname, ex->dsize, ex->dtype);
+fprintf (st, "    %s1, %s, not attached, write enabled, %s, autosize, AUTO detect format\n", ex->dname, ex->dsize, ex->dtype);
+fprintf (st, "    %s2, %s, not attached, write enabled, %s, autosize, AUTO detect format\n", ex->dname, ex->dsize, ex->dtype);
+fprintf (st, "    %s3, %s, not attached, write enabled, %s, autosize, AUTO detect format\n", ex->dname, ex->dsize2, ex->dtype2);
+fprintf (st, "  sim> # attach an existing VHD and determine its size and type automatically\n");
+fprintf (st, "  sim> attach %s0 %s.vhd\n", ex->dname, ex->dtype3);
+fprintf (st, "  sim> show %s0\n", ex->dname);
+fprintf (st, "  %s0, %s, attached to %s.vhd, write enabled, %s, autosize, VHD format\n", ex->dname, ex->dsize3, ex->dtype3, ex->dtype3);
+fprintf (st, "  sim> # create a new %s drive type VHD\n", ex->dtype4);
+fprintf (st, "  sim> set %s2 %s\n", ex->dname, ex->dtype4);
+fprintf (st, "  sim> attach %s2 -f vhd %s.vhd\n", ex->dname, ex->dtype4);
+fprintf (st, "  %s2: creating new file\n", ex->dname);
+fprintf (st, "  sim> show %s2\n", ex->dname);
+fprintf (st, "  %s2, %s, attached to %s.vhd, write enabled, %s, autosize, VHD format\n", ex->dname, ex->dsize4, ex->dtype4, ex->dtype4);
+fprintf (st, "  sim> # examine the size consumed by the %s VHD file\n", ex->dsize4);
+fprintf (st, "  sim> dir %s.vhd\n", ex->dtype4);
+fprintf (st, "   Directory of H:\\Data\n\n");
+fprintf (st, "  04/14/2011  12:57 PM             5,120 %s.vhd\n", ex->dtype4);
+fprintf (st, "                 1 File(s)          5,120 bytes\n");
+fprintf (st, "  sim> # create a differencing vhd (%s-1-Diff.vhd) with %s.vhd as parent\n", ex->dtype4, ex->dtype4);
+fprintf (st, "  sim> attach %s3 -d %s-1-Diff.vhd %s.vhd\n", ex->dname, ex->dtype4, ex->dtype4);
+fprintf (st, "  sim> # create a VHD (%s-1.vhd) which is a copy of an existing disk\n", ex->dtype4);
+fprintf (st, "  sim> attach %s3 -c %s-1.vhd %s.vhd\n", ex->dname, ex->dtype4, ex->dtype4);
+fprintf (st, "  %s3: creating new virtual disk '%s-1.vhd'\n", ex->dname, ex->dtype4);
+fprintf (st, "  %s3: Copied %s.  99%% complete.\n", ex->dname, ex->dsize4);
+fprintf (st, "  %s3: Copied %s. Done.\n", ex->dname, ex->dsize4);
+fprintf (st, "  sim> show %s3\n", ex->dname);
+fprintf (st, "  %s3, %s, attached to %s-1.vhd, write enabled, %s, autosize, VHD format\n", ex->dname, ex->dsize4, ex->dtype4, ex->dtype4);
+fprintf (st, "  sim> dir %s*\n", ex->dtype4);
+fprintf (st, "   Directory of H:\\Data\n\n");
+fprintf (st, "  04/14/2011  01:12 PM             5,120 %s-1.vhd\n", ex->dtype4);
+fprintf (st, "  04/14/2011  12:58 PM             5,120 %s.vhd\n", ex->dtype4);
+fprintf (st, "                 2 File(s)         10,240 bytes\n");
+fprintf (st, "  sim> show %s2\n", ex->dname);
+fprintf (st, "  %s2, %s, not attached, write enabled, %s, autosize, VHD format\n", ex->dname, ex->dsize4, ex->dtype4);
+fprintf (st, "  sim> set %s2 %s\n", ex->dname, ex->dtype3);
+fprintf (st, "  sim> set %s2 noauto\n", ex->dname);
+fprintf (st, "  sim> show %s2\n", ex->dname);
+fprintf (st, "  %s2, %s, not attached, write enabled, %s, noautosize, VHD format\n", ex->dname, ex->dsize3, ex->dtype3);
+fprintf (st, "  sim> set %s2 format=simh\n", ex->dname);
+fprintf (st, "  sim> show %s2\n", ex->dname);
+fprintf (st, "  %s2, %s, not attached, write enabled, %s, noautosize, SIMH format\n", ex->dname, ex->dsize3, ex->dtype3);
+fprintf (st, "  sim> # create a VHD from an existing SIMH format disk\n");
+fprintf (st, "  sim> attach %s2 -c %s-Copy.vhd XYZZY.dsk\n", ex->dname, ex->dtype3);
+fprintf (st, "  %s2: creating new virtual disk '%s-Copy.vhd'\n", ex->dname, ex->dtype3);
+fprintf (st, "  %s2: Copied %s.  99%% complete.\n", ex->dname, ex->dsize3);
+fprintf (st, "  %s2: Copied %s. Done.\n", ex->dname, ex->dsize3);
+fprintf (st, "  sim> show %s2\n", ex->dname);
+fprintf (st, "  %s2, %s, attached to %s-Copy.vhd, write enabled, %s, noautosize, VHD format\n", ex->dname, ex->dsize3, ex->dtype3, ex->dtype3);
+return SCPE_OK;
 }
 
-static int sim_os_disk_close_raw (FILE *f)
+t_bool sim_disk_vhd_support (void)
 {
-return EOF;
+return SCPE_OK == sim_vhd_disk_implemented ();
 }
 
-static void sim_os_disk_flush_raw (FILE *f)
+t_bool sim_disk_raw_support (void)
 {
+return SCPE_OK == sim_os_disk_implemented_raw ();
 }
 
-static t_offset sim_os_disk_size_raw (FILE *f)
+t_stat sim_disk_reset (UNIT *uptr)
 {
-return (t_offset)-1;
-}
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-static t_stat sim_os_disk_unload_raw (FILE *f)
-{
-return SCPE_NOFNC;
-}
+if (!(uptr->flags & UNIT_ATT))                          /* attached? */
+    return SCPE_OK;
 
-static t_bool sim_os_disk_isavailable_raw (FILE *Disk)
-{
-return FALSE;
-}
+sim_debug_unit (ctx->dbit, uptr, "sim_disk_reset(unit=%d)\n", (int)(uptr - ctx->dptr->units));
 
-static t_stat sim_os_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
-{
-*sectsread = 0;
-return SCPE_NOFNC;
+_sim_disk_io_flush(uptr);
+AIO_VALIDATE(uptr);
+AIO_UPDATE_QUEUE;
+return SCPE_OK;
 }
 
-static t_stat sim_os_disk_read (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *bytesread, uint32 bytes)
+t_stat sim_disk_perror (UNIT *uptr, const char *msg)
 {
-*bytesread = 0;
-return SCPE_NOFNC;
-}
+int saved_errno = errno;
 
-static t_stat sim_os_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
-{
-*sectswritten = 0;
-return SCPE_NOFNC;
+if (!(uptr->flags & UNIT_ATTABLE))                      /* not attachable? */
+    return SCPE_NOATT;
+switch (DK_GET_FMT (uptr)) {                            /* case on format */
+    case DKUF_F_STD:                                    /* SIMH format */
+    case DKUF_F_VHD:                                    /* VHD format */
+    case DKUF_F_DDI:                                    /* DDI format */
+    case DKUF_F_RAW:                                    /* Raw Physical Disk Access */
+#if defined(_WIN32)
+        saved_errno = GetLastError ();
+#endif
+        perror (msg);
+        sim_printf ("%s %s: %s\n", sim_uname(uptr), msg, sim_get_os_error_text (saved_errno));
+        break;
+    default:
+        ;
+    }
+return SCPE_OK;
 }
 
-static t_stat sim_os_disk_write (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *byteswritten, uint32 bytes)
+t_stat sim_disk_clearerr (UNIT *uptr)
 {
-*byteswritten = 0;
-return SCPE_NOFNC;
+if (!(uptr->flags & UNIT_ATTABLE))                      /* not attachable? */
+    return SCPE_NOATT;
+switch (DK_GET_FMT (uptr)) {                            /* case on format */
+    case DKUF_F_STD:                                    /* SIMH format */
+        clearerr (uptr->fileref);
+        break;
+    case DKUF_F_VHD:                                    /* VHD format */
+        sim_vhd_disk_clearerr (uptr);
+        break;
+    case DKUF_F_DDI:                                    /* DDI format */
+        sim_ddi_disk_clearerr (uptr);
+        break;
+    default:
+        ;
+    }
+return SCPE_OK;
 }
 
-static t_stat sim_os_disk_info_raw (FILE *f, uint32 *sector_size, uint32 *removable, uint32 *is_cdrom)
-{
-*sector_size = *removable = *is_cdrom = 0;
-return SCPE_NOFNC;
-}
 
-#endif
+/* Factory bad block table creation routine
 
-/* OS Independent Disk Virtual Disk (VHD) I/O support */
+   This routine writes a DEC standard 144 compliant bad block table on the
+   last track of the specified unit as described in:
+      EL-00144_B_DEC_STD_144_Disk_Standard_for_Recording_and_Handling_Bad_Sectors_Nov76.pdf
+   The bad block table consists of 10 repetitions of the same table,
+   formatted as follows:
 
-#if (defined (VMS) && !(defined (__ALPHA) || defined (__ia64)))
-#define DONT_DO_VHD_SUPPORT  /* VAX/VMS compilers don't have 64 bit integers */
-#endif
+        words 0-1       pack id number
+        words 2-3       cylinder/sector/surface specifications
+         :
+        words n-n+1     end of table (-1,-1)
 
-#if defined (DONT_DO_VHD_SUPPORT)
-
-/*============================================================================*/
-/*                        Non-implemented version                             */
-/*   This is only for hody systems which don't have 64 bit integer types      */
-/*============================================================================*/
-
-static t_stat sim_vhd_disk_implemented (void)
-{
-return SCPE_NOFNC;
-}
-
-static FILE *sim_vhd_disk_open (const char *vhdfilename, const char *openmode)
-{
-return NULL;
-}
-
-static FILE *sim_vhd_disk_merge (const char *szVHDPath, char **ParentVHD)
-{
-return NULL;
-}
-
-static FILE *sim_vhd_disk_create (const char *szVHDPath, t_offset desiredsize)
-{
-return NULL;
-}
-
-static FILE *sim_vhd_disk_create_diff (const char *szVHDPath, const char *szParentVHDPath)
-{
-return NULL;
-}
+   Inputs:
+        uptr    =       pointer to unit
+        sec     =       number of sectors per surface
+        wds     =       number of words per sector
+   Outputs:
+        sta     =       status code
+*/
 
-static int sim_vhd_disk_close (FILE *f)
+t_stat sim_disk_pdp11_bad_block (UNIT *uptr, int32 sec, int32 wds)
 {
-return -1;
-}
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+int32 i;
+t_addr da;
+uint16 *buf;
+DEVICE *dptr;
+char *namebuf, *c;
+uint32 packid;
+t_stat stat = SCPE_OK;
 
-static void sim_vhd_disk_flush (FILE *f)
-{
+if ((sec < 2) || (wds < 16))
+    return SCPE_ARG;
+if ((uptr->flags & UNIT_ATT) == 0)
+    return SCPE_UNATT;
+if ((dptr = find_dev_from_unit (uptr)) == NULL)
+    return SCPE_NOATT;
+if (uptr->flags & UNIT_RO)
+    return SCPE_RO;
+if (!get_yn ("Overwrite last track? [N]", FALSE))
+    return SCPE_OK;
+if ((buf = (uint16 *) malloc (wds * sizeof (uint16))) == NULL)
+    return SCPE_MEM;
+namebuf = uptr->filename;
+if ((c = strrchr (namebuf, '/')))
+    namebuf = c+1;
+if ((c = strrchr (namebuf, '\\')))
+    namebuf = c+1;
+if ((c = strrchr (namebuf, ']')))
+    namebuf = c+1;
+packid = eth_crc32(0, namebuf, strlen (namebuf));
+buf[0] = (uint16)packid;
+buf[1] = (uint16)(packid >> 16) & 0x7FFF;   /* Make sure MSB is clear */
+buf[2] = buf[3] = 0;
+for (i = 4; i < wds; i++)
+    buf[i] = 0177777u;
+da = (uptr->capac*((dptr->flags & DEV_SECTORS) ? 512 : 1)) - (sec * wds);
+for (i = 0; (stat == SCPE_OK) && (i < sec) && (i < 10); i++, da += wds)
+    if (ctx)
+        stat = sim_disk_wrsect (uptr, (t_lba)(da/wds), (uint8 *)buf, NULL, 1);
+    else {
+        if (sim_fseek (uptr->fileref, da, SEEK_SET)) {
+            stat = SCPE_IOERR;
+            break;
+            }
+        if ((size_t)wds != sim_fwrite (buf, sizeof (uint16), wds, uptr->fileref))
+            stat = SCPE_IOERR;
+        }
+free (buf);
+return stat;
 }
 
-static t_offset sim_vhd_disk_size (FILE *f)
+void sim_disk_data_trace(UNIT *uptr, const uint8 *data, size_t lba, size_t len, const char* txt, int detail, uint32 reason)
 {
-return (t_offset)-1;
-}
+DEVICE *dptr = find_dev_from_unit (uptr);
 
-static t_stat sim_vhd_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
-{
-*sectsread = 0;
-return SCPE_IOERR;
-}
+if (sim_deb && ((uptr->dctrl | dptr->dctrl) & reason)) {
+    char pos[32];
 
-static t_stat sim_vhd_disk_clearerr (UNIT *uptr)
-{
-return SCPE_IOERR;
+    sprintf (pos, "lbn: %08X ", (unsigned int)lba);
+    sim_data_trace(dptr, uptr, (detail ? data : NULL), pos, len, txt, reason);
+    }
 }
 
-static t_stat sim_vhd_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
-{
-*sectswritten = 0;
-return SCPE_IOERR;
-}
+/* OS Specific RAW Disk I/O support */
 
-static t_stat sim_vhd_disk_set_dtype (FILE *f, const char *dtype)
-{
-return SCPE_NOFNC;
-}
+#if defined _WIN32
 
-static const char *sim_vhd_disk_get_dtype (FILE *f, uint32 *SectorSize, uint32 *xfer_element_size, char sim_name[64], time_t *creation_time)
+static void _set_errno_from_status (DWORD dwStatus)
 {
-*SectorSize = *xfer_element_size = 0;
-return NULL;
+switch (dwStatus) {
+    case ERROR_FILE_NOT_FOUND:    case ERROR_PATH_NOT_FOUND:
+    case ERROR_INVALID_DRIVE:     case ERROR_NO_MORE_FILES:
+    case ERROR_BAD_NET_NAME:      case ERROR_BAD_NETPATH:
+    case ERROR_BAD_PATHNAME:      case ERROR_FILENAME_EXCED_RANGE:
+        errno = ENOENT;
+        return;
+    case ERROR_INVALID_ACCESS:    case ERROR_INVALID_DATA:
+    case ERROR_INVALID_FUNCTION:  case ERROR_INVALID_PARAMETER:
+    case ERROR_NEGATIVE_SEEK:
+        errno = EINVAL;
+        return;
+    case ERROR_ARENA_TRASHED:     case ERROR_NOT_ENOUGH_MEMORY:
+    case ERROR_INVALID_BLOCK:     case ERROR_NOT_ENOUGH_QUOTA:
+        errno = ENOMEM;
+        return;
+    case ERROR_TOO_MANY_OPEN_FILES:
+        errno = EMFILE;
+        return;
+    case ERROR_ACCESS_DENIED:     case ERROR_CURRENT_DIRECTORY:
+    case ERROR_LOCK_VIOLATION:    case ERROR_NETWORK_ACCESS_DENIED:
+    case ERROR_CANNOT_MAKE:       case ERROR_FAIL_I24:
+    case ERROR_DRIVE_LOCKED:      case ERROR_SEEK_ON_DEVICE:
+    case ERROR_NOT_LOCKED:        case ERROR_LOCK_FAILED:
+        errno = EACCES;
+        return;
+    case ERROR_ALREADY_EXISTS:    case ERROR_FILE_EXISTS:
+        errno = EEXIST;
+        return;
+    case ERROR_INVALID_HANDLE:    case ERROR_INVALID_TARGET_HANDLE:
+    case ERROR_DIRECT_ACCESS_HANDLE:
+        errno = EBADF;
+        return;
+    case ERROR_DIR_NOT_EMPTY:
+        errno = ENOTEMPTY;
+        return;
+    case ERROR_BAD_ENVIRONMENT:
+        errno = E2BIG;
+        return;
+    case ERROR_BAD_FORMAT:
+        errno = ENOEXEC;
+        return;
+    case ERROR_NOT_SAME_DEVICE:
+        errno = EXDEV;
+        return;
+    case ERROR_BROKEN_PIPE:
+        errno = EPIPE;
+        return;
+    case ERROR_DISK_FULL:
+        errno = ENOSPC;
+        return;
+    case ERROR_WAIT_NO_CHILDREN:  case ERROR_CHILD_NOT_COMPLETE:
+        errno = ECHILD;
+        return;
+    case ERROR_NO_PROC_SLOTS:     case ERROR_MAX_THRDS_REACHED:
+    case ERROR_NESTING_NOT_ALLOWED:
+        errno = EAGAIN;
+        return;
+    }
+if ((dwStatus >= ERROR_WRITE_PROTECT) && (dwStatus <= ERROR_SHARING_BUFFER_EXCEEDED)) {
+    errno = EACCES;
+    return;
+    }
+if ((dwStatus >= ERROR_INVALID_STARTING_CODESEG) && (dwStatus <= ERROR_INFLOOP_IN_RELOC_CHAIN)) {
+    errno = ENOEXEC;
+    return;
+    }
+errno = EINVAL;
 }
-
+#if defined(__GNUC__) && defined(HAVE_NTDDDISK_H)
+#include <ddk/ntddstor.h>
+#include <ddk/ntdddisk.h>
 #else
+#include <winioctl.h>
+#endif
 
-/*++
-    This code follows the details specified in the "Virtual Hard Disk Image
-    Format Specification", Version 1.0 October 11, 2006.  This format
-    specification is available for anyone to implement under the
-    "Microsoft Open Specification Promise" described at:
-        http://www.microsoft.com/interop/osp/default.mspx.
---*/
-
-typedef t_uint64    uint64;
-typedef t_int64     int64;
-
-typedef struct _VHD_Footer {
-    /*
-    Cookies are used to uniquely identify the original creator of the hard disk
-    image. The values are case-sensitive.  Microsoft uses the "conectix" string
-    to identify this file as a hard disk image created by Microsoft Virtual
-    Server, Virtual PC, and predecessor products. The cookie is stored as an
-    eight-character ASCII string with the "c" in the first byte, the "o" in
-    the second byte, and so on.
-    */
-    char Cookie[8];
-    /*
-    This is a bit field used to indicate specific feature support. The following
-    table displays the list of features.
-    Any fields not listed are reserved.
-
-    Feature Value:
-       No features enabled     0x00000000
-       Temporary               0x00000001
-       Reserved                0x00000002
+#if defined(__cplusplus)
+extern "C" {
+#endif
+WINBASEAPI BOOL WINAPI GetFileSizeEx(HANDLE hFile, PLARGE_INTEGER lpFileSize);
+#if defined(__cplusplus)
+    }
+#endif
 
-       No features enabled.
-              The hard disk image has no special features enabled in it.
-       Temporary.
-              This bit is set if the current disk is a temporary disk. A
-              temporary disk designation indicates to an application that
-              this disk is a candidate for deletion on shutdown.
-       Reserved.
-              This bit must always be set to 1.
-       All other bits are also reserved and should be set to 0.
-    */
-    uint32 Features;
-    /*
-    This field is divided into a major/minor version and matches the version of
-    the specification used in creating the file. The most-significant two bytes
-    are for the major version. The least-significant two bytes are the minor
-    version.  This must match the file format specification. For the current
-    specification, this field must be initialized to 0x00010000.
-    The major version will be incremented only when the file format is modified
-    in such a way that it is no longer compatible with older versions of the
-    file format.
-    */
-    uint32 FileFormatVersion;
+struct _device_type {
+    int32 Type;
+    const char *desc;
+    } DeviceTypes[] = {
+        {FILE_DEVICE_8042_PORT,             "8042_PORT"},
+        {FILE_DEVICE_ACPI,                  "ACPI"},
+        {FILE_DEVICE_BATTERY,               "BATTERY"},
+        {FILE_DEVICE_BEEP,                  "BEEP"},
+#ifdef FILE_DEVICE_BLUETOOTH
+        {FILE_DEVICE_BLUETOOTH,             "BLUETOOTH"},
+#endif
+        {FILE_DEVICE_BUS_EXTENDER,          "BUS_EXTENDER"},
+        {FILE_DEVICE_CD_ROM,                "CD_ROM"},
+        {FILE_DEVICE_CD_ROM_FILE_SYSTEM,    "CD_ROM_FILE_SYSTEM"},
+        {FILE_DEVICE_CHANGER,               "CHANGER"},
+        {FILE_DEVICE_CONTROLLER,            "CONTROLLER"},
+#ifdef FILE_DEVICE_CRYPT_PROVIDER
+        {FILE_DEVICE_CRYPT_PROVIDER,        "CRYPT_PROVIDER"},
+#endif
+        {FILE_DEVICE_DATALINK,              "DATALINK"},
+        {FILE_DEVICE_DFS,                   "DFS"},
+        {FILE_DEVICE_DFS_FILE_SYSTEM,       "DFS_FILE_SYSTEM"},
+        {FILE_DEVICE_DFS_VOLUME,            "DFS_VOLUME"},
+        {FILE_DEVICE_DISK,                  "DISK"},
+        {FILE_DEVICE_DISK_FILE_SYSTEM,      "DISK_FILE_SYSTEM"},
+        {FILE_DEVICE_DVD,                   "DVD"},
+        {FILE_DEVICE_FILE_SYSTEM,           "FILE_SYSTEM"},
+#ifdef FILE_DEVICE_FIPS
+        {FILE_DEVICE_FIPS,                  "FIPS"},
+#endif
+        {FILE_DEVICE_FULLSCREEN_VIDEO,      "FULLSCREEN_VIDEO"},
+#ifdef FILE_DEVICE_INFINIBAND
+        {FILE_DEVICE_INFINIBAND,            "INFINIBAND"},
+#endif
+        {FILE_DEVICE_INPORT_PORT,           "INPORT_PORT"},
+        {FILE_DEVICE_KEYBOARD,              "KEYBOARD"},
+        {FILE_DEVICE_KS,                    "KS"},
+        {FILE_DEVICE_KSEC,                  "KSEC"},
+        {FILE_DEVICE_MAILSLOT,              "MAILSLOT"},
+        {FILE_DEVICE_MASS_STORAGE,          "MASS_STORAGE"},
+        {FILE_DEVICE_MIDI_IN,               "MIDI_IN"},
+        {FILE_DEVICE_MIDI_OUT,              "MIDI_OUT"},
+        {FILE_DEVICE_MODEM,                 "MODEM"},
+        {FILE_DEVICE_MOUSE,                 "MOUSE"},
+        {FILE_DEVICE_MULTI_UNC_PROVIDER,    "MULTI_UNC_PROVIDER"},
+        {FILE_DEVICE_NAMED_PIPE,            "NAMED_PIPE"},
+        {FILE_DEVICE_NETWORK,               "NETWORK"},
+        {FILE_DEVICE_NETWORK_BROWSER,       "NETWORK_BROWSER"},
+        {FILE_DEVICE_NETWORK_FILE_SYSTEM,   "NETWORK_FILE_SYSTEM"},
+        {FILE_DEVICE_NETWORK_REDIRECTOR,    "NETWORK_REDIRECTOR"},
+        {FILE_DEVICE_NULL,                  "NULL"},
+        {FILE_DEVICE_PARALLEL_PORT,         "PARALLEL_PORT"},
+        {FILE_DEVICE_PHYSICAL_NETCARD,      "PHYSICAL_NETCARD"},
+        {FILE_DEVICE_PRINTER,               "PRINTER"},
+        {FILE_DEVICE_SCANNER,               "SCANNER"},
+        {FILE_DEVICE_SCREEN,                "SCREEN"},
+        {FILE_DEVICE_SERENUM,               "SERENUM"},
+        {FILE_DEVICE_SERIAL_MOUSE_PORT,     "SERIAL_MOUSE_PORT"},
+        {FILE_DEVICE_SERIAL_PORT,           "SERIAL_PORT"},
+        {FILE_DEVICE_SMARTCARD,             "SMARTCARD"},
+        {FILE_DEVICE_SMB,                   "SMB"},
+        {FILE_DEVICE_SOUND,                 "SOUND"},
+        {FILE_DEVICE_STREAMS,               "STREAMS"},
+        {FILE_DEVICE_TAPE,                  "TAPE"},
+        {FILE_DEVICE_TAPE_FILE_SYSTEM,      "TAPE_FILE_SYSTEM"},
+        {FILE_DEVICE_TERMSRV,               "TERMSRV"},
+        {FILE_DEVICE_TRANSPORT,             "TRANSPORT"},
+        {FILE_DEVICE_UNKNOWN,               "UNKNOWN"},
+        {FILE_DEVICE_VDM,                   "VDM"},
+        {FILE_DEVICE_VIDEO,                 "VIDEO"},
+        {FILE_DEVICE_VIRTUAL_DISK,          "VIRTUAL_DISK"},
+#ifdef FILE_DEVICE_VMBUS
+        {FILE_DEVICE_VMBUS,                 "VMBUS"},
+#endif
+        {FILE_DEVICE_WAVE_IN,               "WAVE_IN"},
+        {FILE_DEVICE_WAVE_OUT,              "WAVE_OUT"},
+#ifdef FILE_DEVICE_WPD
+        {FILE_DEVICE_WPD,                   "WPD"},
+#endif
+        {0,                                 NULL}};
+
+static const char *_device_type_name (int DeviceType)
+{
+int i;
+
+for (i=0; DeviceTypes[i].desc; i++)
+    if (DeviceTypes[i].Type == DeviceType)
+        return DeviceTypes[i].desc;
+return "Unknown";
+}
+
+static t_stat sim_os_disk_implemented_raw (void)
+{
+return sim_toffset_64 ? SCPE_OK : SCPE_NOFNC;
+}
+
+static FILE *sim_os_disk_open_raw (const char *rawdevicename, const char *openmode)
+{
+HANDLE Handle;
+DWORD DesiredAccess = 0;
+uint32 is_cdrom;
+char *tmpname = (char *)malloc (2 + strlen (rawdevicename));
+
+if (tmpname == NULL)
+    return NULL;
+if (strchr (openmode, 'r'))
+    DesiredAccess |= GENERIC_READ;
+if (strchr (openmode, 'w') || strchr (openmode, '+'))
+    DesiredAccess |= GENERIC_WRITE;
+/* SCP Command Line parsing replaces \\ with \ presuming this is an
+   escape sequence.  This only affects RAW device names and UNC paths.
+   We handle the RAW device name case here by prepending paths beginning
+   with \.\ with an extra \. */
+if ((!memcmp ("\\.\\", rawdevicename, 3)) ||
+    (!memcmp ("/./", rawdevicename, 3))) {
+    *tmpname = '\\';
+    strcpy (tmpname + 1, rawdevicename);
+    }
+else
+    strcpy (tmpname, rawdevicename);
+Handle = CreateFileA (tmpname, DesiredAccess, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS|FILE_FLAG_WRITE_THROUGH, NULL);
+free (tmpname);
+if (Handle != INVALID_HANDLE_VALUE) {
+    if ((sim_os_disk_info_raw ((FILE *)Handle, NULL, NULL, &is_cdrom)) ||
+        ((DesiredAccess & GENERIC_WRITE) && is_cdrom)) {
+        CloseHandle (Handle);
+        errno = EACCES;
+        return NULL;
+        }
+    return (FILE *)Handle;
+    }
+_set_errno_from_status (GetLastError ());
+return NULL;
+}
+
+static int sim_os_disk_close_raw (FILE *f)
+{
+if (!CloseHandle ((HANDLE)f)) {
+    _set_errno_from_status (GetLastError ());
+    return EOF;
+    }
+return 0;
+}
+
+static void sim_os_disk_flush_raw (FILE *f)
+{
+FlushFileBuffers ((HANDLE)f);
+}
+
+static t_offset sim_os_disk_size_raw (FILE *Disk)
+{
+DWORD IoctlReturnSize;
+LARGE_INTEGER Size;
+
+if (GetFileSizeEx((HANDLE)Disk, &Size))
+    return (t_offset)(Size.QuadPart);
+#ifdef IOCTL_STORAGE_READ_CAPACITY
+if (1) {
+    STORAGE_READ_CAPACITY S;
+
+    ZeroMemory (&S, sizeof (S));
+    S.Version = sizeof (STORAGE_READ_CAPACITY);
+    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
+                         IOCTL_STORAGE_READ_CAPACITY,      /* dwIoControlCode */
+                         NULL,                             /* lpInBuffer */
+                         0,                                /* nInBufferSize */
+                         (LPVOID) &S,                      /* output buffer */
+                         (DWORD) sizeof(S),                /* size of output buffer */
+                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
+                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
+        return (t_offset)(S.DiskLength.QuadPart);
+    }
+#endif
+#ifdef IOCTL_DISK_GET_DRIVE_GEOMETRY_EX
+if (1) {
+    DISK_GEOMETRY_EX G;
+
+    ZeroMemory (&G, sizeof (G));
+    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
+                         IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, /* dwIoControlCode */
+                         NULL,                             /* lpInBuffer */
+                         0,                                /* nInBufferSize */
+                         (LPVOID) &G,                      /* output buffer */
+                         (DWORD) sizeof(G),                /* size of output buffer */
+                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
+                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
+        return (t_offset)(G.DiskSize.QuadPart);
+    }
+#endif
+#ifdef IOCTL_DISK_GET_DRIVE_GEOMETRY
+if (1) {
+    DISK_GEOMETRY G;
+
+    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
+                         IOCTL_DISK_GET_DRIVE_GEOMETRY,    /* dwIoControlCode */
+                         NULL,                             /* lpInBuffer */
+                         0,                                /* nInBufferSize */
+                         (LPVOID) &G,                      /* output buffer */
+                         (DWORD) sizeof(G),                /* size of output buffer */
+                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
+                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
+        return (t_offset)(G.Cylinders.QuadPart*G.TracksPerCylinder*G.SectorsPerTrack*G.BytesPerSector);
+    }
+#endif
+_set_errno_from_status (GetLastError ());
+return (t_offset)-1;
+}
+
+static t_stat sim_os_disk_unload_raw (FILE *Disk)
+{
+#ifdef IOCTL_STORAGE_EJECT_MEDIA
+DWORD BytesReturned;
+uint32 Removable = FALSE;
+
+sim_os_disk_info_raw (Disk, NULL, &Removable, NULL);
+if (Removable) {
+    if (!DeviceIoControl((HANDLE)Disk,                  /* handle to disk */
+                         IOCTL_STORAGE_EJECT_MEDIA,     /* dwIoControlCode */
+                         NULL,                          /* lpInBuffer */
+                         0,                             /* nInBufferSize */
+                         NULL,                          /* lpOutBuffer */
+                         0,                             /* nOutBufferSize */
+                         (LPDWORD) &BytesReturned,      /* number of bytes returned */
+                         (LPOVERLAPPED) NULL)) {        /* OVERLAPPED structure */
+        _set_errno_from_status (GetLastError ());
+        return SCPE_IOERR;
+        }
+    }
+return SCPE_OK;
+#else
+return SCPE_NOFNC;
+#endif
+}
+
+static t_bool sim_os_disk_isavailable_raw (FILE *Disk)
+{
+#ifdef IOCTL_STORAGE_EJECT_MEDIA
+DWORD BytesReturned;
+uint32 Removable = FALSE;
+
+sim_os_disk_info_raw (Disk, NULL, &Removable, NULL);
+if (Removable) {
+    if (!DeviceIoControl((HANDLE)Disk,                  /* handle to disk */
+                         IOCTL_STORAGE_CHECK_VERIFY,    /* dwIoControlCode */
+                         NULL,                          /* lpInBuffer */
+                         0,                             /* nInBufferSize */
+                         NULL,                          /* lpOutBuffer */
+                         0,                             /* nOutBufferSize */
+                         (LPDWORD) &BytesReturned,      /* number of bytes returned */
+                         (LPOVERLAPPED) NULL)) {        /* OVERLAPPED structure */
+        _set_errno_from_status (GetLastError ());
+        return FALSE;
+        }
+    }
+#endif
+return TRUE;
+}
+
+static t_stat sim_os_disk_info_raw (FILE *Disk, uint32 *sector_size, uint32 *removable, uint32 *is_cdrom)
+{
+DWORD IoctlReturnSize;
+STORAGE_DEVICE_NUMBER Device;
+
+ZeroMemory (&Device, sizeof (Device));
+DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
+                IOCTL_STORAGE_GET_DEVICE_NUMBER,  /* dwIoControlCode */
+                NULL,                             /* lpInBuffer */
+                0,                                /* nInBufferSize */
+                (LPVOID) &Device,                 /* output buffer */
+                (DWORD) sizeof(Device),           /* size of output buffer */
+                (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
+                (LPOVERLAPPED) NULL);             /* OVERLAPPED structure */
+
+if (sector_size)
+    *sector_size = 512;
+if (removable)
+    *removable = 0;
+if (is_cdrom)
+    *is_cdrom = (Device.DeviceType == FILE_DEVICE_CD_ROM) || (Device.DeviceType == FILE_DEVICE_DVD);
+#ifdef IOCTL_STORAGE_READ_CAPACITY
+if (1) {
+    STORAGE_READ_CAPACITY S;
+
+    ZeroMemory (&S, sizeof (S));
+    S.Version = sizeof (STORAGE_READ_CAPACITY);
+    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
+                         IOCTL_STORAGE_READ_CAPACITY,      /* dwIoControlCode */
+                         NULL,                             /* lpInBuffer */
+                         0,                                /* nInBufferSize */
+                         (LPVOID) &S,                      /* output buffer */
+                         (DWORD) sizeof(S),                /* size of output buffer */
+                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
+                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
+        if (sector_size)
+            *sector_size = S.BlockLength;
+    }
+#endif
+#ifdef IOCTL_DISK_GET_DRIVE_GEOMETRY_EX
+if (1) {
+    DISK_GEOMETRY_EX G;
+
+    ZeroMemory (&G, sizeof (G));
+    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
+                         IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, /* dwIoControlCode */
+                         NULL,                             /* lpInBuffer */
+                         0,                                /* nInBufferSize */
+                         (LPVOID) &G,                      /* output buffer */
+                         (DWORD) sizeof(G),                /* size of output buffer */
+                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
+                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
+        if (sector_size)
+            *sector_size = G.Geometry.BytesPerSector;
+    }
+#endif
+#ifdef IOCTL_DISK_GET_DRIVE_GEOMETRY
+if (1) {
+    DISK_GEOMETRY G;
+
+    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
+                         IOCTL_DISK_GET_DRIVE_GEOMETRY,    /* dwIoControlCode */
+                         NULL,                             /* lpInBuffer */
+                         0,                                /* nInBufferSize */
+                         (LPVOID) &G,                      /* output buffer */
+                         (DWORD) sizeof(G),                /* size of output buffer */
+                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
+                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
+        if (sector_size)
+            *sector_size = G.BytesPerSector;
+    }
+#endif
+#ifdef IOCTL_STORAGE_GET_HOTPLUG_INFO
+if (1) {
+    STORAGE_HOTPLUG_INFO H;
+
+    ZeroMemory (&H, sizeof (H));
+    if (DeviceIoControl((HANDLE)Disk,                      /* handle to volume */
+                         IOCTL_STORAGE_GET_HOTPLUG_INFO,   /* dwIoControlCode */
+                         NULL,                             /* lpInBuffer */
+                         0,                                /* nInBufferSize */
+                         (LPVOID) &H,                      /* output buffer */
+                         (DWORD) sizeof(H),                /* size of output buffer */
+                         (LPDWORD) &IoctlReturnSize,       /* number of bytes returned */
+                         (LPOVERLAPPED) NULL))             /* OVERLAPPED structure */
+        if (removable)
+            *removable = H.MediaRemovable;
+    }
+#endif
+return SCPE_OK;
+}
+
+static t_stat sim_os_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+{
+OVERLAPPED pos;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+long long addr = ((long long)lba) * ctx->sector_size;
+DWORD bytestoread = sects * ctx->sector_size;
+
+sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_rdsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+if (sectsread)
+    *sectsread = 0;
+memset (&pos, 0, sizeof (pos));
+while (bytestoread) {
+    DWORD bytesread;
+    DWORD sectorbytes;
+
+    pos.Offset = (DWORD)addr;
+    pos.OffsetHigh = (DWORD)(addr >> 32);
+    if (!ReadFile ((HANDLE)(uptr->fileref), buf, bytestoread, &bytesread, &pos)) {
+        if (ERROR_HANDLE_EOF == GetLastError ()) {  /* Return 0's for reads past EOF */
+            memset (buf, 0, bytestoread);
+            if (sectsread)
+                *sectsread += bytestoread / ctx->sector_size;
+            return SCPE_OK;
+            }
+        _set_errno_from_status (GetLastError ());
+        return SCPE_IOERR;
+        }
+    sectorbytes = (bytesread / ctx->sector_size) * ctx->sector_size;
+    if (bytesread > sectorbytes) {
+        memset (buf + bytesread, 0, bytestoread - bytesread);
+        sectorbytes += ctx->sector_size;
+        }
+    if (sectsread)
+        *sectsread += sectorbytes / ctx->sector_size;
+    bytestoread -= sectorbytes;
+    buf +=  sectorbytes;
+    addr += sectorbytes;
+    }
+return SCPE_OK;
+}
+
+static t_stat sim_os_disk_read (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *bytesread, uint32 bytes)
+{
+OVERLAPPED pos;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+
+sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_read(unit=%d, addr=0x%X, bytes=%u)\n", (int)(uptr - ctx->dptr->units), (uint32)addr, bytes);
+
+memset (&pos, 0, sizeof (pos));
+pos.Offset = (DWORD)addr;
+pos.OffsetHigh = (DWORD)(addr >> 32);
+if (ReadFile ((HANDLE)(uptr->fileref), buf, (DWORD)bytes, (LPDWORD)bytesread, &pos))
+    return SCPE_OK;
+if (ERROR_HANDLE_EOF == GetLastError ()) {  /* Return 0's for reads past EOF */
+    memset (buf, 0, bytes);
+    if (bytesread)
+        *bytesread = bytes;
+    return SCPE_OK;
+    }
+_set_errno_from_status (GetLastError ());
+return SCPE_IOERR;
+}
+
+static t_stat sim_os_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+{
+OVERLAPPED pos;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+long long addr;
+DWORD byteswritten;
+DWORD bytestowrite = sects * ctx->sector_size;
+
+sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_wrsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+
+if (sectswritten)
+    *sectswritten = 0;
+addr = ((long long)lba) * ctx->sector_size;
+memset (&pos, 0, sizeof (pos));
+while (bytestowrite) {
+    DWORD sectorbytes;
+
+    pos.Offset = (DWORD)addr;
+    pos.OffsetHigh = (DWORD)(addr >> 32);
+    if (!WriteFile ((HANDLE)(uptr->fileref), buf, bytestowrite, &byteswritten, &pos)) {
+        _set_errno_from_status (GetLastError ());
+        return SCPE_IOERR;
+        }
+    if (sectswritten)
+        *sectswritten += byteswritten / ctx->sector_size;
+    sectorbytes = (byteswritten / ctx->sector_size) * ctx->sector_size;
+    bytestowrite -= sectorbytes;
+    if (bytestowrite == 0)
+        break;
+    buf += sectorbytes;
+    addr += sectorbytes;
+    }
+return SCPE_OK;
+}
+
+static t_stat sim_os_disk_write (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *byteswritten, uint32 bytes)
+{
+OVERLAPPED pos;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+
+sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_write(unit=%d, lba=0x%X, bytes=%u)\n", (int)(uptr - ctx->dptr->units), (uint32)addr, bytes);
+
+memset (&pos, 0, sizeof (pos));
+pos.Offset = (DWORD)addr;
+pos.OffsetHigh = (DWORD)(addr >> 32);
+if (WriteFile ((HANDLE)(uptr->fileref), buf, bytes, (LPDWORD)byteswritten, &pos))
+    return SCPE_OK;
+_set_errno_from_status (GetLastError ());
+return SCPE_IOERR;
+}
+
+#elif defined (__linux) || defined (__linux__) || defined (__APPLE__)|| defined (__sun) || defined (__sun__) || defined (__hpux) || defined (_AIX)
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(HAVE_SYS_IOCTL)
+#include <sys/ioctl.h>
+#endif
+#if defined(HAVE_LINUX_CDROM)
+#include <linux/cdrom.h>
+#endif
+
+static t_stat sim_os_disk_implemented_raw (void)
+{
+return sim_toffset_64 ? SCPE_OK : SCPE_NOFNC;
+}
+
+static FILE *sim_os_disk_open_raw (const char *rawdevicename, const char *openmode)
+{
+int mode = 0;
+int fd;
+
+if (strchr (openmode, 'r') && (strchr (openmode, '+') || strchr (openmode, 'w')))
+    mode = O_RDWR;
+else
+    if (strchr (openmode, 'r'))
+        mode = O_RDONLY;
+#ifdef O_LARGEFILE
+mode |= O_LARGEFILE;
+#endif
+#ifdef O_DSYNC
+mode |= O_DSYNC;
+#endif
+fd = open (rawdevicename, mode, 0);
+if (fd < 0)
+    return (FILE *)NULL;
+return (FILE *)((long)fd);
+}
+
+static int sim_os_disk_close_raw (FILE *f)
+{
+return close ((int)((long)f));
+}
+
+static void sim_os_disk_flush_raw (FILE *f)
+{
+fsync ((int)((long)f));
+}
+
+static t_offset sim_os_disk_size_raw (FILE *f)
+{
+t_offset pos, size;
+
+pos = (t_offset)lseek ((int)((long)f), (off_t)0, SEEK_CUR);
+size = (t_offset)lseek ((int)((long)f), (off_t)0, SEEK_END);
+if (pos != (t_offset)-1)
+    (void)lseek ((int)((long)f), (off_t)pos, SEEK_SET);
+return size;
+}
+
+static t_stat sim_os_disk_unload_raw (FILE *f)
+{
+#if defined(CDROM_GET_CAPABILITY) && defined(CDROMEJECT) && defined(CDROMEJECT_SW)
+if (ioctl ((int)((long)f), CDROM_GET_CAPABILITY, NULL) < 0)
+    return SCPE_OK;
+if (ioctl((int)((long)f), CDROM_LOCKDOOR, 0) < 0)
+    return SCPE_IOERR;
+if (ioctl((int)((long)f), CDROMEJECT) < 0)
+    return SCPE_IOERR;
+#endif
+return SCPE_OK;
+}
+
+static t_bool sim_os_disk_isavailable_raw (FILE *Disk)
+{
+#if defined(CDROMSTART) && defined(CDROM_GET_CAPABILITY)
+if (ioctl ((int)((long)Disk), CDROM_GET_CAPABILITY, NULL) < 0)
+    return TRUE;
+switch (ioctl((int)((long)Disk), CDROM_DRIVE_STATUS, CDSL_NONE)) {
+    case CDS_NO_INFO:
+    case CDS_NO_DISC:
+    case CDS_TRAY_OPEN:
+    case CDS_DRIVE_NOT_READY:
+    default: /* error */
+        return FALSE;
+    case CDS_DISC_OK:
+        return TRUE;
+    }
+#endif
+return TRUE;
+}
+
+static t_stat sim_os_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+off_t addr = ((off_t)lba) * ctx->sector_size;
+ssize_t bytesread;
+size_t bytestoread = sects * ctx->sector_size;
+
+sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_rdsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+
+if (sectsread)
+    *sectsread = 0;
+while (bytestoread) {
+    size_t sectorbytes;
+
+    bytesread = pread((int)((long)uptr->fileref), buf, bytestoread, addr);
+    if (bytesread < 0) {
+        return SCPE_IOERR;
+        }
+    if ((size_t)bytesread < bytestoread) {/* read zeros at/past EOF */
+        memset (buf + bytesread, 0, bytestoread - bytesread);
+        bytesread = bytestoread;
+        }
+    sectorbytes = (bytesread / ctx->sector_size) * ctx->sector_size;
+    if ((size_t)bytesread > sectorbytes)
+        sectorbytes += ctx->sector_size;
+    if (sectsread)
+        *sectsread += sectorbytes / ctx->sector_size;
+    bytestoread -= sectorbytes;
+    buf += sectorbytes;
+    addr += sectorbytes;
+    }
+return SCPE_OK;
+}
+
+static t_stat sim_os_disk_read (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *rbytesread, uint32 bytes)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+ssize_t bytesread;
+
+sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_read(unit=%d, addr=0x%X, bytes=%u)\n", (int)(uptr - ctx->dptr->units), (uint32)addr, bytes);
+
+bytesread = pread((int)((long)uptr->fileref), buf, bytes, (off_t)addr);
+if (bytesread < 0) {
+    if (rbytesread)
+        *rbytesread = 0;
+    return SCPE_IOERR;
+    }
+if (rbytesread)
+    *rbytesread = bytesread;
+return SCPE_OK;
+}
+
+static t_stat sim_os_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+off_t addr = ((off_t)lba) * ctx->sector_size;
+ssize_t byteswritten;
+size_t bytestowrite = sects * ctx->sector_size;
+
+sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_wrsect(unit=%d, lba=0x%X, sects=%d)\n", (int)(uptr - ctx->dptr->units), lba, sects);
+
+if (sectswritten)
+    *sectswritten = 0;
+while (bytestowrite) {
+    size_t sectorbytes;
+
+    byteswritten = pwrite((int)((long)uptr->fileref), buf, bytestowrite, addr);
+    if (byteswritten < 0) {
+        return SCPE_IOERR;
+        }
+    if (sectswritten)
+        *sectswritten += byteswritten / ctx->sector_size;
+    sectorbytes = (byteswritten / ctx->sector_size) * ctx->sector_size;
+    bytestowrite -= sectorbytes;
+    if (bytestowrite == 0)
+        break;
+    buf += sectorbytes;
+    addr += sectorbytes;
+    }
+return SCPE_OK;
+}
+
+static t_stat sim_os_disk_write (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *rbyteswritten, uint32 bytes)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+ssize_t byteswritten;
+
+sim_debug_unit (ctx->dbit, uptr, "sim_os_disk_write(unit=%d, addr=0x%X, bytes=%u)\n", (int)(uptr - ctx->dptr->units), (uint32)addr, bytes);
+
+if (rbyteswritten)
+    *rbyteswritten = 0;
+byteswritten = pwrite((int)((long)uptr->fileref), buf, bytes, (off_t)addr);
+if (byteswritten < 0)
+    return SCPE_IOERR;
+if (rbyteswritten)
+    *rbyteswritten = byteswritten;
+return SCPE_OK;
+}
+
+static t_stat sim_os_disk_info_raw (FILE *f, uint32 *sector_size, uint32 *removable, uint32 *is_cdrom)
+{
+if (sector_size) {
+#if defined(BLKSSZGET)
+    if (ioctl ((int)((long)f), BLKSSZGET, sector_size) < 0)
+#endif
+        *sector_size = 512;
+    }
+if (removable)
+    *removable = 0;
+if (is_cdrom) {
+#if defined(CDROM_GET_CAPABILITY)
+    int cd_cap = ioctl ((int)((long)f), CDROM_GET_CAPABILITY, NULL);
+
+    if (cd_cap < 0)
+        *is_cdrom = 0;
+    else {
+        *is_cdrom = 1;
+        if (removable)
+            *removable = 1;
+        if (sector_size)
+            *sector_size = 2048;
+        }
+#else
+    *is_cdrom = 0;
+#endif
+    }
+return SCPE_OK;
+}
+
+#else
+/*============================================================================*/
+/*                        Non-implemented versions                            */
+/*============================================================================*/
+
+static t_stat sim_os_disk_implemented_raw (void)
+{
+return SCPE_NOFNC;
+}
+
+static FILE *sim_os_disk_open_raw (const char *rawdevicename, const char *openmode)
+{
+return NULL;
+}
+
+static int sim_os_disk_close_raw (FILE *f)
+{
+return EOF;
+}
+
+static void sim_os_disk_flush_raw (FILE *f)
+{
+}
+
+static t_offset sim_os_disk_size_raw (FILE *f)
+{
+return (t_offset)-1;
+}
+
+static t_stat sim_os_disk_unload_raw (FILE *f)
+{
+return SCPE_NOFNC;
+}
+
+static t_bool sim_os_disk_isavailable_raw (FILE *Disk)
+{
+return FALSE;
+}
+
+static t_stat sim_os_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+{
+*sectsread = 0;
+return SCPE_NOFNC;
+}
+
+static t_stat sim_os_disk_read (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *bytesread, uint32 bytes)
+{
+*bytesread = 0;
+return SCPE_NOFNC;
+}
+
+static t_stat sim_os_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+{
+*sectswritten = 0;
+return SCPE_NOFNC;
+}
+
+static t_stat sim_os_disk_write (UNIT *uptr, t_offset addr, uint8 *buf, uint32 *byteswritten, uint32 bytes)
+{
+*byteswritten = 0;
+return SCPE_NOFNC;
+}
+
+static t_stat sim_os_disk_info_raw (FILE *f, uint32 *sector_size, uint32 *removable, uint32 *is_cdrom)
+{
+*sector_size = *removable = *is_cdrom = 0;
+return SCPE_NOFNC;
+}
+
+#endif
+
+/* OS Independent Disk Virtual Disk (VHD) I/O support */
+
+#if (defined (VMS) && !(defined (__ALPHA) || defined (__ia64)))
+#define DONT_DO_VHD_SUPPORT  /* VAX/VMS compilers don't have 64 bit integers */
+#endif
+
+#if defined (DONT_DO_VHD_SUPPORT)
+
+/*============================================================================*/
+/*                        Non-implemented version                             */
+/*   This is only for hody systems which don't have 64 bit integer types      */
+/*============================================================================*/
+
+static t_stat sim_vhd_disk_implemented (void)
+{
+return SCPE_NOFNC;
+}
+
+static FILE *sim_vhd_disk_open (const char *vhdfilename, const char *openmode)
+{
+return NULL;
+}
+
+static FILE *sim_vhd_disk_merge (const char *szVHDPath, char **ParentVHD)
+{
+return NULL;
+}
+
+static FILE *sim_vhd_disk_create (const char *szVHDPath, t_offset desiredsize)
+{
+return NULL;
+}
+
+static FILE *sim_vhd_disk_create_diff (const char *szVHDPath, const char *szParentVHDPath)
+{
+return NULL;
+}
+
+static int sim_vhd_disk_close (FILE *f)
+{
+return -1;
+}
+
+static void sim_vhd_disk_flush (FILE *f)
+{
+}
+
+static t_offset sim_vhd_disk_size (FILE *f)
+{
+return (t_offset)-1;
+}
+
+static t_stat sim_vhd_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+{
+*sectsread = 0;
+return SCPE_IOERR;
+}
+
+static t_stat sim_vhd_disk_clearerr (UNIT *uptr)
+{
+return SCPE_IOERR;
+}
+
+static t_stat sim_vhd_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+{
+*sectswritten = 0;
+return SCPE_IOERR;
+}
+
+static t_stat sim_vhd_disk_set_dtype (FILE *f, const char *dtype)
+{
+return SCPE_NOFNC;
+}
+
+static const char *sim_vhd_disk_get_dtype (FILE *f, uint32 *SectorSize, uint32 *xfer_element_size, char sim_name[64], time_t *creation_time)
+{
+*SectorSize = *xfer_element_size = 0;
+return NULL;
+}
+
+static size_t sim_vhd_disk_chain_info (FILE *f, char *buf, size_t size)
+{
+return 0;
+}
+
+static const char *sim_vhd_disk_parent_path (FILE *f)
+{
+return NULL;
+}
+
+static uint32 sim_vhd_disk_block_count (FILE *f)
+{
+return 0;
+}
+
+static t_stat sim_vhd_disk_merge_block (FILE *f, FILE *parent, uint32 BlockNumber)
+{
+return SCPE_NOFNC;
+}
+
+static t_stat sim_vhd_disk_write (FILE *f, t_lba lba, uint8 *buf, t_seccnt sects, uint32 SectorSize)
+{
+return SCPE_NOFNC;
+}
+
+#else
+
+/*++
+    This code follows the details specified in the "Virtual Hard Disk Image
+    Format Specification", Version 1.0 October 11, 2006.  This format
+    specification is available for anyone to implement under the
+    "Microsoft Open Specification Promise" described at:
+        http://www.microsoft.com/interop/osp/default.mspx.
+--*/
+
+typedef t_uint64    uint64;
+typedef t_int64     int64;
+
+typedef struct _VHD_Footer {
+    /*
+    Cookies are used to uniquely identify the original creator of the hard disk
+    image. The values are case-sensitive.  Microsoft uses the "conectix" string
+    to identify this file as a hard disk image created by Microsoft Virtual
+    Server, Virtual PC, and predecessor products. The cookie is stored as an
+    eight-character ASCII string with the "c" in the first byte, the "o" in
+    the second byte, and so on.
+    */
+    char Cookie[8];
+    /*
+    This is a bit field used to indicate specific feature support. The following
+    table displays the list of features.
+    Any fields not listed are reserved.
+
+    Feature Value:
+       No features enabled     0x00000000
+       Temporary               0x00000001
+       Reserved                0x00000002
+
+       No features enabled.
+              The hard disk image has no special features enabled in it.
+       Temporary.
+              This bit is set if the current disk is a temporary disk. A
+              temporary disk designation indicates to an application that
+              this disk is a candidate for deletion on shutdown.
+       Reserved.
+              This bit must always be set to 1.
+       All other bits are also reserved and should be set to 0.
+    */
+    uint32 Features;
+    /*
+    This field is divided into a major/minor version and matches the version of
+    the specification used in creating the file. The most-significant two bytes
+    are for the major version. The least-significant two bytes are the minor
+    version.  This must match the file format specification. For the current
+    specification, this field must be initialized to 0x00010000.
+    The major version will be incremented only when the file format is modified
+    in such a way that it is no longer compatible with older versions of the
+    file format.
+    */
+    uint32 FileFormatVersion;
+    /*
+    This field holds the absolute byte offset, from the beginning of the file,
+    to the next structure. This field is used for dynamic disks and differencing
+    disks, but not fixed disks. For fixed disks, this field should be set to
+    0xFFFFFFFF.
+    */
+    uint64 DataOffset;
+    /*
+    This field stores the creation time of a hard disk image. This is the number
+    of seconds since January 1, 2000 12:00:00 AM in UTC/GMT.
+    */
+    uint32 TimeStamp;
+    /*
+    This field is used to document which application created the hard disk. The
+    field is a left-justified text field. It uses a single-byte character set.
+    If the hard disk is created by Microsoft Virtual PC, "vpc " is written in
+    this field. If the hard disk image is created by Microsoft Virtual Server,
+    then "vs  " is written in this field.
+    Other applications should use their own unique identifiers.
+    */
+    char CreatorApplication[4];
+    /*
+    This field holds the major/minor version of the application that created
+    the hard disk image.  Virtual Server 2004 sets this value to 0x00010000 and
+    Virtual PC 2004 sets this to 0x00050000.
+    */
+    uint32 CreatorVersion;
+    /*
+    This field stores the type of host operating system this disk image is
+    created on.
+       Host OS type    Value
+       Windows         0x5769326B (Wi2k)
+       Macintosh       0x4D616320 (Mac )
+    */
+    uint8 CreatorHostOS[4];
+    /*
+    This field stores the size of the hard disk in bytes, from the perspective
+    of the virtual machine, at creation time. This field is for informational
+    purposes.
+    */
+    uint64 OriginalSize;
+    /*
+    This field stores the current size of the hard disk, in bytes, from the
+    perspective of the virtual machine.
+    This value is same as the original size when the hard disk is created.
+    This value can change depending on whether the hard disk is expanded.
+    */
+    uint64 CurrentSize;
+    /*
+    This field stores the cylinder, heads, and sectors per track value for the
+    hard disk.
+       Disk Geometry field          Size (bytes)
+       Cylinder                     2
+       Heads                        1
+       Sectors per track/cylinder   1
+
+    When a hard disk is configured as an ATA hard disk, the CHS values (that is,
+    Cylinder, Heads, Sectors per track) are used by the ATA controller to
+    determine the size of the disk. When the user creates a hard disk of a
+    certain size, the size of the hard disk image in the virtual machine is
+    smaller than that created by the user. This is because CHS value calculated
+    from the hard disk size is rounded down. The pseudo-code for the algorithm
+    used to determine the CHS values can be found in the appendix of this
+    document.
+    */
+    uint32 DiskGeometry;
+    /*
+       Disk Type field              Value
+       None                         0
+       Reserved (deprecated)        1
+       Fixed hard disk              2
+       Dynamic hard disk            3
+       Differencing hard disk       4
+       Reserved (deprecated)        5
+       Reserved (deprecated)        6
+    */
+    uint32 DiskType;
+    /*
+    This field holds a basic checksum of the hard disk footer. It is just a
+    one's complement of the sum of all the bytes in the footer without the
+    checksum field.
+    If the checksum verification fails, the Virtual PC and Virtual Server
+    products will instead use the header. If the checksum in the header also
+    fails, the file should be assumed to be corrupt. The pseudo-code for the
+    algorithm used to determine the checksum can be found in the appendix of
+    this document.
+    */
+    uint32 Checksum;
     /*
-    This field holds the absolute byte offset, from the beginning of the file,
-    to the next structure. This field is used for dynamic disks and differencing
-    disks, but not fixed disks. For fixed disks, this field should be set to
-    0xFFFFFFFF.
+    Every hard disk has a unique ID stored in the hard disk. This is used to
+    identify the hard disk. This is a 128-bit universally unique identifier
+    (UUID). This field is used to associate a parent hard disk image with its
+    differencing hard disk image(s).
+    */
+    uint8 UniqueID[16];
+    /*
+    This field holds a one-byte flag that describes whether the system is in
+    saved state. If the hard disk is in the saved state the value is set to 1.
+    Operations such as compaction and expansion cannot be performed on a hard
+    disk in a saved state.
+    */
+    uint8 SavedState;
+    /*
+    This field contains zeroes. It is 427 bytes in size.
+    */
+    uint8 Reserved1[11];
+    /*
+    This field is an extension to the VHD spec and includes a simh drive type
+    name as a nul terminated string.
+    */
+    uint8 DriveType[16];
+    uint32 DriveSectorSize;
+    uint32 DriveTransferElementSize;
+    uint8 CreatingSimulator[64];
+    /*
+    This field contains zeroes. It is 328 bytes in size.
+    */
+    uint8 Reserved[328];
+    } VHD_Footer;
+
+/*
+For dynamic and differencing disk images, the "Data Offset" field within
+the image footer points to a secondary structure that provides additional
+information about the disk image. The dynamic disk header should appear on
+a sector (512-byte) boundary.
+*/
+typedef struct _VHD_DynamicDiskHeader {
+    /*
+    This field holds the value "cxsparse". This field identifies the header.
+    */
+    char Cookie[8];
+    /*
+    This field contains the absolute byte offset to the next structure in the
+    hard disk image. It is currently unused by existing formats and should be
+    set to 0xFFFFFFFF.
     */
     uint64 DataOffset;
     /*
-    This field stores the creation time of a hard disk image. This is the number
-    of seconds since January 1, 2000 12:00:00 AM in UTC/GMT.
+    This field stores the absolute byte offset of the Block Allocation Table
+    (BAT) in the file.
     */
-    uint32 TimeStamp;
+    uint64 TableOffset;
     /*
-    This field is used to document which application created the hard disk. The
-    field is a left-justified text field. It uses a single-byte character set.
-    If the hard disk is created by Microsoft Virtual PC, "vpc " is written in
-    this field. If the hard disk image is created by Microsoft Virtual Server,
-    then "vs  " is written in this field.
-    Other applications should use their own unique identifiers.
+    This field stores the version of the dynamic disk header. The field is
+    divided into Major/Minor version. The least-significant two bytes represent
+    the minor version, and the most-significant two bytes represent the major
+    version. This must match with the file format specification. For this
+    specification, this field must be initialized to 0x00010000.
+    The major version will be incremented only when the header format is
+    modified in such a way that it is no longer compatible with older versions
+    of the product.
     */
-    char CreatorApplication[4];
+    uint32 HeaderVersion;
     /*
-    This field holds the major/minor version of the application that created
-    the hard disk image.  Virtual Server 2004 sets this value to 0x00010000 and
-    Virtual PC 2004 sets this to 0x00050000.
+    This field holds the maximum entries present in the BAT. This should be
+    equal to the number of blocks in the disk (that is, the disk size divided
+    by the block size).
     */
-    uint32 CreatorVersion;
+    uint32 MaxTableEntries;
     /*
-    This field stores the type of host operating system this disk image is
-    created on.
-       Host OS type    Value
-       Windows         0x5769326B (Wi2k)
-       Macintosh       0x4D616320 (Mac )
+    A block is a unit of expansion for dynamic and differencing hard disks. It
+    is stored in bytes. This size does not include the size of the block bitmap.
+    It is only the size of the data section of the block. The sectors per block
+    must always be a power of two. The default value is 0x00200000 (indicating a
+    block size of 2 MB).
     */
-    uint8 CreatorHostOS[4];
+    uint32 BlockSize;
     /*
-    This field stores the size of the hard disk in bytes, from the perspective
-    of the virtual machine, at creation time. This field is for informational
-    purposes.
+    This field holds a basic checksum of the dynamic header. It is a one's
+    complement of the sum of all the bytes in the header without the checksum
+    field.
+    If the checksum verification fails the file should be assumed to be corrupt.
     */
-    uint64 OriginalSize;
+    uint32 Checksum;
     /*
-    This field stores the current size of the hard disk, in bytes, from the
-    perspective of the virtual machine.
-    This value is same as the original size when the hard disk is created.
-    This value can change depending on whether the hard disk is expanded.
+    This field is used for differencing hard disks. A differencing hard disk
+    stores a 128-bit UUID of the parent hard disk. For more information, see
+    "Creating Differencing Hard Disk Images" later in this paper.
     */
-    uint64 CurrentSize;
+    uint8 ParentUniqueID[16];
     /*
-    This field stores the cylinder, heads, and sectors per track value for the
-    hard disk.
-       Disk Geometry field          Size (bytes)
-       Cylinder                     2
-       Heads                        1
-       Sectors per track/cylinder   1
+    This field stores the modification time stamp of the parent hard disk. This
+    is the number of seconds since January 1, 2000 12:00:00 AM in UTC/GMT.
+    */
+    uint32 ParentTimeStamp;
+    /*
+    This field should be set to zero.
+    */
+    uint32 Reserved0;
+    /*
+    This field contains a Unicode string (UTF-16) of the parent hard disk
+    filename.
+    */
+    char ParentUnicodeName[512];
+    /*
+    These entries store an absolute byte offset in the file where the parent
+    locator for a differencing hard disk is stored. This field is used only for
+    differencing disks and should be set to zero for dynamic disks.
+    */
+    struct VHD_ParentLocator {
+        /*
+        The platform code describes which platform-specific format is used for the
+        file locator. For Windows, a file locator is stored as a path (for example.
+        "c:\disksimages\ParentDisk.vhd"). On a Macintosh system, the file locator
+        is a binary large object (blob) that contains an "alias." The parent locator
+        table is used to support moving hard disk images across platforms.
+        Some current platform codes include the following:
+           Platform Code        Description
+           None (0x0)
+           Wi2r (0x57693272)    [deprecated]
+           Wi2k (0x5769326B)    [deprecated]
+           W2ru (0x57327275)    Unicode pathname (UTF-16) on Windows relative to the differencing disk pathname.
+           W2ku (0x57326B75)    Absolute Unicode (UTF-16) pathname on Windows.
+           Mac (0x4D616320)     (Mac OS alias stored as a blob)
+           MacX(0x4D616358)     A file URL with UTF-8 encoding conforming to RFC 2396.
+        */
+        uint8 PlatformCode[4];
+        /*
+        This field stores the number of 512-byte sectors needed to store the parent
+        hard disk locator.
+        */
+        uint32 PlatformDataSpace;
+        /*
+        This field stores the actual length of the parent hard disk locator in bytes.
+        */
+        uint32 PlatformDataLength;
+        /*
+        This field must be set to zero.
+        */
+        uint32 Reserved;
+        /*
+        This field stores the absolute file offset in bytes where the platform
+        specific file locator data is stored.
+        */
+        uint64 PlatformDataOffset;
+        /*
+        This field stores the absolute file offset in bytes where the platform
+        specific file locator data is stored.
+        */
+        } ParentLocatorEntries[8];
+    /*
+    This must be initialized to zeroes.
+    */
+    char Reserved[256];
+    } VHD_DynamicDiskHeader;
+
+#define VHD_BAT_FREE_ENTRY (0xFFFFFFFF)
+#define VHD_DATA_BLOCK_ALIGNMENT ((uint64)4096)    /* Optimum when underlying storage has 4k sectors */
+
+#define VHD_DT_Fixed                 2  /* Fixed hard disk */
+#define VHD_DT_Dynamic               3  /* Dynamic hard disk */
+#define VHD_DT_Differencing          4  /* Differencing hard disk */
+
+#define VHD_Internal_SectorSize     512
+
+typedef struct VHD_IOData *VHDHANDLE;
+
+static t_stat ReadFilePosition(FILE *File, void *buf, size_t bufsize, uint32 *bytesread, uint64 position)
+{
+uint32 err = sim_fseeko (File, (t_offset)position, SEEK_SET);
+size_t i;
+
+if (bytesread)
+    *bytesread = 0;
+if (!err) {
+    i = fread (buf, 1, bufsize, File);
+    if (bytesread)
+        *bytesread = (uint32)i;
+    err = ferror (File);
+    }
+return (err ? SCPE_IOERR : SCPE_OK);
+}
+
+static t_stat WriteFilePosition(FILE *File, void *buf, size_t bufsize, uint32 *byteswritten, uint64 position)
+{
+uint32 err = sim_fseeko (File, (t_offset)position, SEEK_SET);
+size_t i;
+
+if (byteswritten)
+    *byteswritten = 0;
+if (!err) {
+    i = fwrite (buf, 1, bufsize, File);
+    if (byteswritten)
+        *byteswritten = (uint32)i;
+    err = ferror (File);
+    }
+return (err ? SCPE_IOERR : SCPE_OK);
+}
+
+static uint32
+CalculateVhdFooterChecksum(void *data,
+                           size_t size)
+{
+uint32 sum = 0;
+uint8 *c = (uint8 *)data;
+
+while (size--)
+    sum += *c++;
+return ~sum;
+}
+
+#if defined(_WIN32) || defined (__ALPHA) || defined (__ia64) || defined (VMS)
+#ifndef __BYTE_ORDER__
+#define __BYTE_ORDER__ __ORDER_LITTLE_ENDIAN__
+#endif
+#endif
+#ifndef __BYTE_ORDER__
+#define __BYTE_ORDER__ UNKNOWN
+#endif
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static uint64
+NtoHll(uint64 value)
+{
+uint8 *l = (uint8 *)&value;
+uint64 highresult = (uint64)l[3] | ((uint64)l[2]<<8) | ((uint64)l[1]<<16) | ((uint64)l[0]<<24);
+uint32 lowresult = (uint64)l[7] | ((uint64)l[6]<<8) | ((uint64)l[5]<<16) | ((uint64)l[4]<<24);
+return (highresult << 32) | lowresult;
+}
+#elif  __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static uint64
+NtoHll(uint64 value)
+{
+return value;
+}
+#else
+static uint32
+NtoHl(uint32 value)
+{
+uint8 *l = (uint8 *)&value;
+
+if (sim_end)
+    return l[3] | (l[2]<<8) | (l[1]<<16) | (l[0]<<24);
+return value;
+}
+
+static uint64
+NtoHll(uint64 value)
+{
+uint8 *l = (uint8 *)&value;
+
+if (sim_end) {
+    uint64 highresult = l[3] | (l[2]<<8) | (l[1]<<16) | (l[0]<<24);
+    uint32 lowresult = l[7] | (l[6]<<8) | (l[5]<<16) | (l[4]<<24);
+    return (highresult << 32) | lowresult;
+    }
+return value;
+}
+#endif
+
+static
+int
+GetVHDFooter(const char *szVHDPath,
+             VHD_Footer *sFooter,
+             VHD_DynamicDiskHeader *sDynamic,
+             uint32 **aBAT,
+             uint32 *ModifiedTimeStamp,
+             char *szParentVHDPath,
+             size_t ParentVHDPathSize)
+{
+FILE *File = NULL;
+uint64 position;
+uint32 sum, saved_sum;
+int Return = 0;
+VHD_Footer sHeader;
+struct stat statb;
+
+memset(sFooter, '\0', sizeof(*sFooter));
+if (sDynamic)
+    memset(sDynamic, '\0', sizeof(*sDynamic));
+if (aBAT)
+    *aBAT = NULL;
+File = sim_fopen (szVHDPath, "rb");
+if (!File) {
+    Return = errno;
+    goto Return_Cleanup;
+    }
+if (ModifiedTimeStamp) {
+    if (fstat (fileno (File), &statb)) {
+        Return = errno;
+        goto Return_Cleanup;
+        }
+    else
+        *ModifiedTimeStamp = NtoHl ((uint32)(statb.st_mtime-946684800));
+    }
+position = sim_fsize_ex (File);
+if (((int64)position) == -1) {
+    Return = errno;
+    goto Return_Cleanup;
+    }
+position -= sizeof(*sFooter);
+if (ReadFilePosition(File,
+                     sFooter,
+                     sizeof(*sFooter),
+                     NULL,
+                     position)) {
+    Return = errno;
+    goto Return_Cleanup;
+    }
+saved_sum = NtoHl(sFooter->Checksum);
+sFooter->Checksum = 0;
+sum = CalculateVhdFooterChecksum(sFooter, sizeof(*sFooter));
+sFooter->Checksum = NtoHl(saved_sum);
+if ((sum != saved_sum) || (memcmp("conectix", sFooter->Cookie, sizeof(sFooter->Cookie)))) {
+    Return = EINVAL;                                    /* File Corrupt */
+    goto Return_Cleanup;
+    }
+if (ReadFilePosition(File,
+                     &sHeader,
+                     sizeof(sHeader),
+                     NULL,
+                     (uint64)0)) {
+    Return = errno;
+    goto Return_Cleanup;
+    }
+if ((NtoHl(sFooter->DiskType) != VHD_DT_Dynamic) &&
+    (NtoHl(sFooter->DiskType) != VHD_DT_Differencing) &&
+    (NtoHl(sFooter->DiskType) != VHD_DT_Fixed)) {
+    Return = EINVAL;                                    /* File Corrupt */
+    goto Return_Cleanup;
+    }
+if (((NtoHl(sFooter->DiskType) == VHD_DT_Dynamic) ||
+     (NtoHl(sFooter->DiskType) == VHD_DT_Differencing)) &&
+     memcmp(sFooter, &sHeader, sizeof(sHeader))) {
+    Return = EINVAL;                                    /* File Corrupt */
+    goto Return_Cleanup;
+    }
+if ((sDynamic) &&
+    ((NtoHl(sFooter->DiskType) == VHD_DT_Dynamic) ||
+     (NtoHl(sFooter->DiskType) == VHD_DT_Differencing))) {
+    if (ReadFilePosition(File,
+                         sDynamic,
+                         sizeof (*sDynamic),
+                         NULL,
+                         NtoHll (sFooter->DataOffset))) {
+        Return = errno;
+        goto Return_Cleanup;
+        }
+    saved_sum = NtoHl (sDynamic->Checksum);
+    sDynamic->Checksum = 0;
+    sum = CalculateVhdFooterChecksum (sDynamic, sizeof(*sDynamic));
+    sDynamic->Checksum = NtoHl (saved_sum);
+    if ((sum != saved_sum) || (memcmp ("cxsparse", sDynamic->Cookie, sizeof (sDynamic->Cookie)))) {
+        Return = errno;
+        goto Return_Cleanup;
+        }
+    if (aBAT) {
+        *aBAT = (uint32*) calloc(1, VHD_Internal_SectorSize * ((sizeof(**aBAT) * NtoHl(sDynamic->MaxTableEntries) + VHD_Internal_SectorSize - 1) / VHD_Internal_SectorSize));
+        if (ReadFilePosition(File,
+                             *aBAT,
+                             sizeof (**aBAT) * NtoHl(sDynamic->MaxTableEntries),
+                             NULL,
+                             NtoHll (sDynamic->TableOffset))) {
+            Return = EINVAL;                            /* File Corrupt */
+            goto Return_Cleanup;
+            }
+        }
+    if (szParentVHDPath && ParentVHDPathSize) {
+        VHD_Footer sParentFooter;
+
+        memset (szParentVHDPath, '\0', ParentVHDPathSize);
+        if (NtoHl (sFooter->DiskType) == VHD_DT_Differencing) {
+            size_t i, j;
+
+            for (j=0; j<8; ++j) {
+                uint8 *Pdata;
+                uint32 PdataSize;
+                char ParentName[512];
+                char CheckPath[512];
+                uint32 ParentModificationTime;
+
+                if ('\0' == sDynamic->ParentLocatorEntries[j].PlatformCode[0])
+                    continue;
+                memset (ParentName, '\0', sizeof(ParentName));
+                memset (CheckPath, '\0', sizeof(CheckPath));
+                PdataSize = NtoHl(sDynamic->ParentLocatorEntries[j].PlatformDataSpace);
+                Pdata = (uint8*) calloc (1, PdataSize+2);
+                if (!Pdata)
+                    continue;
+                if (ReadFilePosition(File,
+                                     Pdata,
+                                     PdataSize,
+                                     NULL,
+                                     NtoHll (sDynamic->ParentLocatorEntries[j].PlatformDataOffset))) {
+                    free (Pdata);
+                    continue;
+                    }
+                for (i=0; i<NtoHl(sDynamic->ParentLocatorEntries[j].PlatformDataLength); i+=2)
+                    if ((Pdata[i] == '\0') && (Pdata[i+1] == '\0')) {
+                        ParentName[i/2] = '\0';
+                        break;
+                        }
+                    else
+                        ParentName[i/2] = Pdata[i] ? Pdata[i] : Pdata[i+1];
+                free (Pdata);
+                memset (CheckPath, 0, sizeof (CheckPath));
+                if (0 == memcmp (sDynamic->ParentLocatorEntries[j].PlatformCode, "W2ku", 4))
+                    strlcpy (CheckPath, ParentName, sizeof (CheckPath));
+                else
+                    if (0 == memcmp (sDynamic->ParentLocatorEntries[j].PlatformCode, "W2ru", 4)) {
+                        const char *c;
+
+                        if ((c = strrchr (szVHDPath, '\\'))) {
+                            memcpy (CheckPath, szVHDPath, c-szVHDPath+1);
+                            strlcat (CheckPath, ParentName, sizeof (CheckPath));
+                            }
+                        }
+                VhdPathToHostPath (CheckPath, CheckPath, sizeof (CheckPath));
+                if (0 == GetVHDFooter(CheckPath,
+                                      &sParentFooter,
+                                      NULL,
+                                      NULL,
+                                      &ParentModificationTime,
+                                      NULL,
+                                      0)) {
+                    if ((0 == memcmp (sDynamic->ParentUniqueID, sParentFooter.UniqueID, sizeof (sParentFooter.UniqueID))) &&
+                        ((sDynamic->ParentTimeStamp == ParentModificationTime) ||
+                         ((NtoHl(sDynamic->ParentTimeStamp)-NtoHl(ParentModificationTime)) == 3600) ||
+                         (sim_switches & SWMASK ('O')))) {
+                         memset (szParentVHDPath, 0, ParentVHDPathSize);
+                         strlcpy (szParentVHDPath, CheckPath, ParentVHDPathSize);
+                        }
+                    else {
+                        if (0 != memcmp (sDynamic->ParentUniqueID, sParentFooter.UniqueID, sizeof (sParentFooter.UniqueID)))
+                            sim_printf ("Error Invalid Parent VHD '%s' for Differencing VHD: %s\n", CheckPath, szVHDPath);
+                        else
+                            sim_printf ("Error Parent VHD '%s' has been modified since Differencing VHD: %s was created\n", CheckPath, szVHDPath);
+                        Return = EINVAL;                /* File Corrupt/Invalid */
+                        }
+                    break;
+                    }
+                else {
+                    struct stat statb;
+
+                    if (0 == stat (CheckPath, &statb)) {
+                        sim_printf ("Parent VHD '%s' corrupt for Differencing VHD: %s\n", CheckPath, szVHDPath);
+                        Return = EBADF;                /* File Corrupt/Invalid */
+                        break;
+                        }
+                    }
+                }
+            if (!*szParentVHDPath) {
+                if (Return != EINVAL)                   /* File Not Corrupt? */
+                    sim_printf ("Missing Parent VHD for Differencing VHD: %s\n", szVHDPath);
+                Return = EBADF;
+                }
+            }
+        }
+    }
+Return_Cleanup:
+if (File)
+    fclose(File);
+if (aBAT && (0 != Return)) {
+    free (*aBAT);
+    *aBAT = NULL;
+    }
+return errno = Return;
+}
+
+struct VHD_BlockLocation {
+    struct VHD_IOData *Owner;       /* VHD holding the block, NULL reads as zeros */
+    uint64 Offset;                  /* file position of the block's data in Owner */
+    };
+
+struct VHD_IOData {
+    VHD_Footer Footer;
+    VHD_DynamicDiskHeader Dynamic;
+    uint32 *BAT;
+    FILE *File;
+    char ParentVHDPath[512];
+    struct VHD_IOData *Parent;
+    uint32 ChainDepth;              /* this VHD and its parents */
+    struct VHD_BlockLocation *Map;  /* merged block map of a differencing chain */
+    uint32 MapEntries;
+    t_uint64 MapReads;              /* reads resolved with the map */
+    t_uint64 MapTransfers;          /* file reads they took */
+    };
+
+/* Differencing chains
+
+   A block which a differencing VHD hasn't written is read from the first
+   parent down the chain which holds it.  Rather than walking the parents'
+   BATs on every read, the location of each block is resolved once when a
+   differencing VHD is opened, into a map of the VHD file and position
+   holding the block's data.  Parents are opened read only, so the map only
+   changes when a write allocates a block in the differencing VHD itself.
+   A chain whose dynamic VHDs don't share a block size is walked instead. */
+
+static uint32 _vhd_bitmap_sectors (VHDHANDLE hVHD)
+{
+uint32 BitMapBytes = (7 + (NtoHl (hVHD->Dynamic.BlockSize) / VHD_Internal_SectorSize)) / 8;
+
+return (BitMapBytes + VHD_Internal_SectorSize - 1) / VHD_Internal_SectorSize;
+}
+
+static void _vhd_block_location (VHDHANDLE hVHD, uint32 BlockNumber, uint32 BlockSize, struct VHD_BlockLocation *Loc)
+{
+Loc->Owner = NULL;
+Loc->Offset = 0;
+if (hVHD == NULL)
+    return;
+if (NtoHl (hVHD->Footer.DiskType) == VHD_DT_Fixed) {
+    if ((uint64)BlockNumber * BlockSize < (uint64)NtoHll (hVHD->Footer.CurrentSize)) {
+        Loc->Owner = hVHD;
+        Loc->Offset = (uint64)BlockNumber * BlockSize;
+        }
+    return;
+    }
+if (hVHD->Map) {
+    if (BlockNumber < hVHD->MapEntries)
+        *Loc = hVHD->Map[BlockNumber];
+    return;
+    }
+if (BlockNumber >= NtoHl (hVHD->Dynamic.MaxTableEntries))
+    return;
+if (hVHD->BAT[BlockNumber] != VHD_BAT_FREE_ENTRY) {
+    Loc->Owner = hVHD;
+    Loc->Offset = VHD_Internal_SectorSize * ((uint64)(NtoHl (hVHD->BAT[BlockNumber]) + _vhd_bitmap_sectors (hVHD)));
+    return;
+    }
+_vhd_block_location (hVHD->Parent, BlockNumber, BlockSize, Loc);
+}
+
+static void _vhd_build_block_map (VHDHANDLE hVHD)
+{
+uint32 BlockSize = NtoHl (hVHD->Dynamic.BlockSize);
+uint32 Entries = NtoHl (hVHD->Dynamic.MaxTableEntries);
+VHDHANDLE Parent;
+uint32 i;
+
+if ((BlockSize == 0) || ((BlockSize & (BlockSize - 1)) != 0))
+    return;
+for (Parent = hVHD->Parent; Parent != NULL; Parent = Parent->Parent)
+    if ((NtoHl (Parent->Footer.DiskType) != VHD_DT_Fixed) &&
+        (NtoHl (Parent->Dynamic.BlockSize) != BlockSize))
+        return;
+hVHD->Map = (struct VHD_BlockLocation *)calloc (Entries, sizeof (*hVHD->Map));
+if (hVHD->Map == NULL)
+    return;
+hVHD->MapEntries = Entries;
+for (i = 0; i < Entries; i++) {
+    if (hVHD->BAT[i] != VHD_BAT_FREE_ENTRY) {
+        hVHD->Map[i].Owner = hVHD;
+        hVHD->Map[i].Offset = VHD_Internal_SectorSize * ((uint64)(NtoHl (hVHD->BAT[i]) + _vhd_bitmap_sectors (hVHD)));
+        }
+    else
+        _vhd_block_location (hVHD->Parent, i, BlockSize, &hVHD->Map[i]);
+    }
+}
+
+static size_t sim_vhd_disk_chain_info (FILE *f, char *buf, size_t size)
+{
+VHDHANDLE hVHD = (VHDHANDLE)f;
+size_t len;
+
+if ((hVHD == NULL) || (hVHD->Parent == NULL))
+    return 0;
+len = snprintf (buf, size, "differencing chain depth %u", hVHD->ChainDepth);
+if (hVHD->Map == NULL)
+    len += snprintf (buf + len, size - len, " (walked)");
+else
+    if (hVHD->MapReads)
+        len += snprintf (buf + len, size - len, " (%.2f file reads per read)", (double)hVHD->MapTransfers / hVHD->MapReads);
+return len;
+}
+
+static t_stat sim_vhd_disk_implemented (void)
+{
+return SCPE_OK;
+}
+
+static t_stat sim_vhd_disk_set_dtype (FILE *f, const char *dtype, uint32 SectorSize, uint32 xfer_element_size)
+{
+VHDHANDLE hVHD  = (VHDHANDLE)f;
+int Status = 0;
+
+memset (hVHD->Footer.DriveType, '\0', sizeof hVHD->Footer.DriveType);
+memcpy (hVHD->Footer.DriveType, dtype, ((1+strlen (dtype)) < sizeof (hVHD->Footer.DriveType)) ? (1+strlen (dtype)) : sizeof (hVHD->Footer.DriveType));
+hVHD->Footer.DriveSectorSize = NtoHl (SectorSize);
+hVHD->Footer.DriveTransferElementSize = NtoHl (xfer_element_size);
+hVHD->Footer.CreatingSimulator[sizeof (hVHD->Footer.CreatingSimulator) - 1] = '\0';  /* Force NUL termination */
+memset (hVHD->Footer.CreatingSimulator, 0, sizeof (hVHD->Footer.CreatingSimulator));
+strlcpy ((char *)hVHD->Footer.CreatingSimulator, sim_name, sizeof (hVHD->Footer.CreatingSimulator));
+hVHD->Footer.Checksum = 0;
+hVHD->Footer.Checksum = NtoHl (CalculateVhdFooterChecksum (&hVHD->Footer, sizeof(hVHD->Footer)));
+
+if (NtoHl (hVHD->Footer.DiskType) == VHD_DT_Fixed) {
+    if (WriteFilePosition(hVHD->File,
+                          &hVHD->Footer,
+                          sizeof(hVHD->Footer),
+                          NULL,
+                          NtoHll (hVHD->Footer.CurrentSize)))
+        Status = errno;
+    goto Cleanup_Return;
+    }
+else {
+    uint64 position;
+
+    position = sim_fsize_ex (hVHD->File);
+    if (((int64)position) == -1) {
+        Status = errno;
+        goto Cleanup_Return;
+        }
+    position -= sizeof(hVHD->Footer);
+    /* Update both copies on a dynamic disk */
+    if (WriteFilePosition(hVHD->File,
+                          &hVHD->Footer,
+                          sizeof(hVHD->Footer),
+                          NULL,
+                          (uint64)0)) {
+        Status = errno;
+        goto Cleanup_Return;
+        }
+    if (WriteFilePosition(hVHD->File,
+                          &hVHD->Footer,
+                          sizeof(hVHD->Footer),
+                          NULL,
+                          position)) {
+        Status = errno;
+        goto Cleanup_Return;
+        }
+    }
+Cleanup_Return:
+if (Status)
+    return SCPE_IOERR;
+return SCPE_OK;
+}
+
+static const char *sim_vhd_disk_get_dtype (FILE *f, uint32 *SectorSize, uint32 *xfer_element_size, char sim_name[64], time_t *creation_time)
+{
+VHDHANDLE hVHD  = (VHDHANDLE)f;
+
+if (SectorSize)
+    *SectorSize = NtoHl (hVHD->Footer.DriveSectorSize);
+if (xfer_element_size)
+    *xfer_element_size = NtoHl (hVHD->Footer.DriveTransferElementSize);
+if (sim_name)
+    memcpy (sim_name, hVHD->Footer.CreatingSimulator, 64);
+if (creation_time)
+    *creation_time = (time_t)NtoHl (hVHD->Footer.TimeStamp) + 946684800;
+return (char *)(&hVHD->Footer.DriveType[0]);
+}
+
+static FILE *sim_vhd_disk_open (const char *szVHDPath, const char *DesiredAccess)
+    {
+    VHDHANDLE hVHD = (VHDHANDLE) calloc (1, sizeof(*hVHD));
+    int NeedUpdate = FALSE;
+    int Status;
+
+    if (!hVHD)
+        return (FILE *)hVHD;
+    Status = GetVHDFooter (szVHDPath,
+                           &hVHD->Footer,
+                           &hVHD->Dynamic,
+                           &hVHD->BAT,
+                           NULL,
+                           hVHD->ParentVHDPath,
+                           sizeof (hVHD->ParentVHDPath));
+    if (Status)
+        goto Cleanup_Return;
+    if (NtoHl (hVHD->Footer.DiskType) == VHD_DT_Differencing) {
+        uint32 ParentModifiedTimeStamp;
+        VHD_Footer ParentFooter;
+        VHD_DynamicDiskHeader ParentDynamic;
+
+        hVHD->Parent = (VHDHANDLE)sim_vhd_disk_open (hVHD->ParentVHDPath, "rb");
+        if (!hVHD->Parent) {
+            Status = errno;
+            goto Cleanup_Return;
+            }
+        Status = GetVHDFooter (hVHD->ParentVHDPath,
+                               &ParentFooter,
+                               &ParentDynamic,
+                               NULL,
+                               &ParentModifiedTimeStamp,
+                               NULL,
+                               0);
+        if (Status)
+            goto Cleanup_Return;
+        if ((0 != memcmp (hVHD->Dynamic.ParentUniqueID, ParentFooter.UniqueID, sizeof (ParentFooter.UniqueID))) ||
+            (ParentModifiedTimeStamp != hVHD->Dynamic.ParentTimeStamp)) {
+            if (sim_switches & SWMASK ('O')) {                      /* OVERRIDE consistency checks? */
+                if ((sim_switches & SWMASK ('U')) &&                /* FIX (UPDATE) consistency checks AND */
+                    (strchr (DesiredAccess, '+'))) {                /* open for write/update? */
+                    memcpy (hVHD->Dynamic.ParentUniqueID, ParentFooter.UniqueID, sizeof (ParentFooter.UniqueID));
+                    hVHD->Dynamic.ParentTimeStamp = ParentModifiedTimeStamp;
+                    hVHD->Dynamic.Checksum = 0;
+                    hVHD->Dynamic.Checksum = NtoHl (CalculateVhdFooterChecksum (&hVHD->Dynamic, sizeof(hVHD->Dynamic)));
+                    NeedUpdate = TRUE;
+                    }
+                }
+            else {
+                Status = EBADF;
+                goto Cleanup_Return;
+                }
+            }
+        }
+    if (hVHD->Footer.SavedState) {
+        Status = EAGAIN;                                /* Busy */
+        goto Cleanup_Return;
+        }
+    hVHD->File = sim_fopen (szVHDPath, DesiredAccess);
+    if (!hVHD->File) {
+        Status = errno;
+        goto Cleanup_Return;
+        }
+    hVHD->ChainDepth = 1 + (hVHD->Parent ? hVHD->Parent->ChainDepth : 0);
+    if (hVHD->Parent)
+        _vhd_build_block_map (hVHD);
+Cleanup_Return:
+    if (Status) {
+        sim_vhd_disk_close ((FILE *)hVHD);
+        hVHD = NULL;
+        }
+    else {
+        if (NeedUpdate) {                               /* Update Differencing Disk Header? */
+            if (WriteFilePosition(hVHD->File,
+                                  &hVHD->Dynamic,
+                                  sizeof (hVHD->Dynamic),
+                                  NULL,
+                                  NtoHll (hVHD->Footer.DataOffset))) {
+                sim_vhd_disk_close ((FILE *)hVHD);
+                hVHD = NULL;
+                }
+            }
+        }
+    errno = Status;
+    return (FILE *)hVHD;
+    }
+
+static t_stat
+WriteVirtualDiskSectors(VHDHANDLE hVHD,
+                        uint8 *buf,
+                        t_seccnt sects,
+                        t_seccnt *sectswritten,
+                        uint32 SectorSize,
+                        t_lba lba);
+
+static FILE *sim_vhd_disk_merge (const char *szVHDPath, char **ParentVHD)
+    {
+    VHDHANDLE hVHD = (VHDHANDLE) calloc (1, sizeof(*hVHD));
+    VHDHANDLE Parent = NULL;
+    int Status;
+    uint32 SectorSize, SectorsPerBlock, BlockSize, BlockNumber, BitMapBytes, BitMapSectors, BlocksToMerge, NeededBlock;
+    uint64 BlockOffset;
+    uint32 BytesRead;
+    t_seccnt SectorsWritten;
+    void *BlockData = NULL;
+
+    if (!hVHD)
+        return (FILE *)hVHD;
+    if (0 != (Status = GetVHDFooter (szVHDPath,
+                                     &hVHD->Footer,
+                                     &hVHD->Dynamic,
+                                     &hVHD->BAT,
+                                     NULL,
+                                     hVHD->ParentVHDPath,
+                                     sizeof (hVHD->ParentVHDPath))))
+        goto Cleanup_Return;
+    if (NtoHl (hVHD->Footer.DiskType) != VHD_DT_Differencing) {
+        Status = EINVAL;
+        goto Cleanup_Return;
+        }
+    if (hVHD->Footer.SavedState) {
+        Status = EAGAIN;                                /* Busy */
+        goto Cleanup_Return;
+        }
+    SectorSize = 512;
+    BlockSize = NtoHl (hVHD->Dynamic.BlockSize);
+    BlockData = malloc (BlockSize*SectorSize);
+    if (NULL == BlockData) {
+        Status = errno;
+        goto Cleanup_Return;
+        }
+    Parent = (VHDHANDLE)sim_vhd_disk_open (hVHD->ParentVHDPath, "rb+");
+    if (!Parent) {
+        Status = errno;
+        goto Cleanup_Return;
+        }
+    hVHD->File = sim_fopen (szVHDPath, "rb");
+    if (!hVHD->File) {
+        Status = errno;
+        goto Cleanup_Return;
+        }
+    SectorsPerBlock = NtoHl (hVHD->Dynamic.BlockSize)/SectorSize;
+    BitMapBytes = (7+(NtoHl (hVHD->Dynamic.BlockSize)/SectorSize))/8;
+    BitMapSectors = (BitMapBytes+SectorSize-1)/SectorSize;
+    for (BlockNumber=BlocksToMerge=0; BlockNumber< NtoHl (hVHD->Dynamic.MaxTableEntries); ++BlockNumber) {
+        if (hVHD->BAT[BlockNumber] == VHD_BAT_FREE_ENTRY)
+            continue;
+        ++BlocksToMerge;
+        }
+    sim_messagef (SCPE_OK, "Merging %s\ninto %s\n", szVHDPath, hVHD->ParentVHDPath);
+    for (BlockNumber=NeededBlock=0; BlockNumber < NtoHl (hVHD->Dynamic.MaxTableEntries); ++BlockNumber) {
+        uint32 BlockSectors = SectorsPerBlock;
 
-    When a hard disk is configured as an ATA hard disk, the CHS values (that is,
-    Cylinder, Heads, Sectors per track) are used by the ATA controller to
-    determine the size of the disk. When the user creates a hard disk of a
-    certain size, the size of the hard disk image in the virtual machine is
-    smaller than that created by the user. This is because CHS value calculated
-    from the hard disk size is rounded down. The pseudo-code for the algorithm
-    used to determine the CHS values can be found in the appendix of this
-    document.
-    */
-    uint32 DiskGeometry;
-    /*
-       Disk Type field              Value
-       None                         0
-       Reserved (deprecated)        1
-       Fixed hard disk              2
-       Dynamic hard disk            3
-       Differencing hard disk       4
-       Reserved (deprecated)        5
-       Reserved (deprecated)        6
-    */
-    uint32 DiskType;
-    /*
-    This field holds a basic checksum of the hard disk footer. It is just a
-    one's complement of the sum of all the bytes in the footer without the
-    checksum field.
-    If the checksum verification fails, the Virtual PC and Virtual Server
-    products will instead use the header. If the checksum in the header also
-    fails, the file should be assumed to be corrupt. The pseudo-code for the
-    algorithm used to determine the checksum can be found in the appendix of
-    this document.
-    */
-    uint32 Checksum;
-    /*
-    Every hard disk has a unique ID stored in the hard disk. This is used to
-    identify the hard disk. This is a 128-bit universally unique identifier
-    (UUID). This field is used to associate a parent hard disk image with its
-    differencing hard disk image(s).
-    */
-    uint8 UniqueID[16];
-    /*
-    This field holds a one-byte flag that describes whether the system is in
-    saved state. If the hard disk is in the saved state the value is set to 1.
-    Operations such as compaction and expansion cannot be performed on a hard
-    disk in a saved state.
-    */
-    uint8 SavedState;
-    /*
-    This field contains zeroes. It is 427 bytes in size.
-    */
-    uint8 Reserved1[11];
-    /*
-    This field is an extension to the VHD spec and includes a simh drive type
-    name as a nul terminated string.
-    */
-    uint8 DriveType[16];
-    uint32 DriveSectorSize;
-    uint32 DriveTransferElementSize;
-    uint8 CreatingSimulator[64];
-    /*
-    This field contains zeroes. It is 328 bytes in size.
-    */
-    uint8 Reserved[328];
-    } VHD_Footer;
+        if (hVHD->BAT[BlockNumber] == VHD_BAT_FREE_ENTRY)
+            continue;
+        ++NeededBlock;
+        BlockOffset = SectorSize*((uint64)(NtoHl (hVHD->BAT[BlockNumber]) + BitMapSectors));
+        if (((uint64)BlockNumber*SectorsPerBlock + BlockSectors) > ((uint64)NtoHll (hVHD->Footer.CurrentSize))/SectorSize)
+            BlockSectors = (uint32)(((uint64)NtoHll (hVHD->Footer.CurrentSize))/SectorSize - (BlockNumber*SectorsPerBlock));
+        if (ReadFilePosition(hVHD->File,
+                             BlockData,
+                             SectorSize*BlockSectors,
+                             &BytesRead,
+                             BlockOffset))
+            break;
+        if (WriteVirtualDiskSectors (Parent,
+                                     (uint8*)BlockData,
+                                     BlockSectors,
+                                     &SectorsWritten,
+                                     SectorSize,
+                                     SectorsPerBlock*BlockNumber))
+            break;
+        sim_messagef (SCPE_OK, "Merged %dMB.  %d%% complete.\r", (int)((((float)NeededBlock)*SectorsPerBlock)*SectorSize/1000000), (int)((((float)NeededBlock)*100)/BlocksToMerge));
+        hVHD->BAT[BlockNumber] = VHD_BAT_FREE_ENTRY;
+        }
+    if (BlockNumber < NtoHl (hVHD->Dynamic.MaxTableEntries)) {
+        Status = errno;
+        }
+    else {
+        Status = 0;
+        sim_messagef (SCPE_OK, "Merged %dMB.  100%% complete.\n", (int)((((float)NeededBlock)*SectorsPerBlock)*SectorSize/1000000));
+        fclose (hVHD->File);
+        hVHD->File = NULL;
+        (void)remove (szVHDPath);
+        *ParentVHD = (char*) malloc (strlen (hVHD->ParentVHDPath)+1);
+        strcpy (*ParentVHD, hVHD->ParentVHDPath);
+        }
+Cleanup_Return:
+    free (BlockData);
+    if (hVHD->File)
+        fclose (hVHD->File);
+    if (Status) {
+        free (hVHD->BAT);
+        free (hVHD);
+        hVHD = NULL;
+        sim_vhd_disk_close ((FILE *)Parent);
+        }
+    else {
+        free (hVHD->BAT);
+        free (hVHD);
+        hVHD = Parent;
+        }
+    errno = Status;
+    return (FILE *)hVHD;
+    }
 
-/*
-For dynamic and differencing disk images, the "Data Offset" field within
-the image footer points to a secondary structure that provides additional
-information about the disk image. The dynamic disk header should appear on
-a sector (512-byte) boundary.
-*/
-typedef struct _VHD_DynamicDiskHeader {
-    /*
-    This field holds the value "cxsparse". This field identifies the header.
-    */
-    char Cookie[8];
-    /*
-    This field contains the absolute byte offset to the next structure in the
-    hard disk image. It is currently unused by existing formats and should be
-    set to 0xFFFFFFFF.
-    */
-    uint64 DataOffset;
-    /*
-    This field stores the absolute byte offset of the Block Allocation Table
-    (BAT) in the file.
-    */
-    uint64 TableOffset;
-    /*
-    This field stores the version of the dynamic disk header. The field is
-    divided into Major/Minor version. The least-significant two bytes represent
-    the minor version, and the most-significant two bytes represent the major
-    version. This must match with the file format specification. For this
-    specification, this field must be initialized to 0x00010000.
-    The major version will be incremented only when the header format is
-    modified in such a way that it is no longer compatible with older versions
-    of the product.
-    */
-    uint32 HeaderVersion;
-    /*
-    This field holds the maximum entries present in the BAT. This should be
-    equal to the number of blocks in the disk (that is, the disk size divided
-    by the block size).
-    */
-    uint32 MaxTableEntries;
-    /*
-    A block is a unit of expansion for dynamic and differencing hard disks. It
-    is stored in bytes. This size does not include the size of the block bitmap.
-    It is only the size of the data section of the block. The sectors per block
-    must always be a power of two. The default value is 0x00200000 (indicating a
-    block size of 2 MB).
-    */
-    uint32 BlockSize;
-    /*
-    This field holds a basic checksum of the dynamic header. It is a one's
-    complement of the sum of all the bytes in the header without the checksum
-    field.
-    If the checksum verification fails the file should be assumed to be corrupt.
-    */
-    uint32 Checksum;
-    /*
-    This field is used for differencing hard disks. A differencing hard disk
-    stores a 128-bit UUID of the parent hard disk. For more information, see
-    "Creating Differencing Hard Disk Images" later in this paper.
-    */
-    uint8 ParentUniqueID[16];
-    /*
-    This field stores the modification time stamp of the parent hard disk. This
-    is the number of seconds since January 1, 2000 12:00:00 AM in UTC/GMT.
-    */
-    uint32 ParentTimeStamp;
-    /*
-    This field should be set to zero.
-    */
-    uint32 Reserved0;
-    /*
-    This field contains a Unicode string (UTF-16) of the parent hard disk
-    filename.
-    */
-    char ParentUnicodeName[512];
-    /*
-    These entries store an absolute byte offset in the file where the parent
-    locator for a differencing hard disk is stored. This field is used only for
-    differencing disks and should be set to zero for dynamic disks.
-    */
-    struct VHD_ParentLocator {
-        /*
-        The platform code describes which platform-specific format is used for the
-        file locator. For Windows, a file locator is stored as a path (for example.
-        "c:\disksimages\ParentDisk.vhd"). On a Macintosh system, the file locator
-        is a binary large object (blob) that contains an "alias." The parent locator
-        table is used to support moving hard disk images across platforms.
-        Some current platform codes include the following:
-           Platform Code        Description
-           None (0x0)
-           Wi2r (0x57693272)    [deprecated]
-           Wi2k (0x5769326B)    [deprecated]
-           W2ru (0x57327275)    Unicode pathname (UTF-16) on Windows relative to the differencing disk pathname.
-           W2ku (0x57326B75)    Absolute Unicode (UTF-16) pathname on Windows.
-           Mac (0x4D616320)     (Mac OS alias stored as a blob)
-           MacX(0x4D616358)     A file URL with UTF-8 encoding conforming to RFC 2396.
-        */
-        uint8 PlatformCode[4];
-        /*
-        This field stores the number of 512-byte sectors needed to store the parent
-        hard disk locator.
-        */
-        uint32 PlatformDataSpace;
-        /*
-        This field stores the actual length of the parent hard disk locator in bytes.
-        */
-        uint32 PlatformDataLength;
-        /*
-        This field must be set to zero.
-        */
-        uint32 Reserved;
-        /*
-        This field stores the absolute file offset in bytes where the platform
-        specific file locator data is stored.
-        */
-        uint64 PlatformDataOffset;
-        /*
-        This field stores the absolute file offset in bytes where the platform
-        specific file locator data is stored.
-        */
-        } ParentLocatorEntries[8];
-    /*
-    This must be initialized to zeroes.
-    */
-    char Reserved[256];
-    } VHD_DynamicDiskHeader;
+/* Block at a time merging, for committing a snapshot while it is in use */
+
+static const char *sim_vhd_disk_parent_path (FILE *f)
+{
+VHDHANDLE hVHD = (VHDHANDLE)f;
+
+return hVHD->Parent ? hVHD->ParentVHDPath : NULL;
+}
+
+static uint32 sim_vhd_disk_block_count (FILE *f)
+{
+VHDHANDLE hVHD = (VHDHANDLE)f;
+
+if (NtoHl (hVHD->Footer.DiskType) == VHD_DT_Fixed)
+    return 0;
+return NtoHl (hVHD->Dynamic.MaxTableEntries);
+}
+
+static t_stat sim_vhd_disk_merge_block (FILE *f, FILE *parent, uint32 BlockNumber)
+{
+VHDHANDLE hVHD = (VHDHANDLE)f;
+uint32 BlockSize = NtoHl (hVHD->Dynamic.BlockSize);
+uint32 SectorsPerBlock = BlockSize / VHD_Internal_SectorSize;
+uint32 BlockSectors = SectorsPerBlock;
+uint64 TotalSectors = NtoHll (hVHD->Footer.CurrentSize) / VHD_Internal_SectorSize;
+uint32 BytesRead;
+t_seccnt SectorsWritten;
+uint8 *BlockData;
+t_stat r = SCPE_OK;
 
-#define VHD_BAT_FREE_ENTRY (0xFFFFFFFF)
-#define VHD_DATA_BLOCK_ALIGNMENT ((uint64)4096)    /* Optimum when underlying storage has 4k sectors */
+if ((BlockNumber >= NtoHl (hVHD->Dynamic.MaxTableEntries)) ||
+    (hVHD->BAT[BlockNumber] == VHD_BAT_FREE_ENTRY))
+    return SCPE_OK;                                 /* never written */
+if ((uint64)BlockNumber * SectorsPerBlock + BlockSectors > TotalSectors)
+    BlockSectors = (uint32)(TotalSectors - (uint64)BlockNumber * SectorsPerBlock);
+BlockData = (uint8 *)malloc (BlockSize);
+if (BlockData == NULL)
+    return SCPE_MEM;
+if (ReadFilePosition(hVHD->File,
+                     BlockData,
+                     BlockSectors * VHD_Internal_SectorSize,
+                     &BytesRead,
+                     VHD_Internal_SectorSize * ((uint64)(NtoHl (hVHD->BAT[BlockNumber]) + _vhd_bitmap_sectors (hVHD)))) ||
+    WriteVirtualDiskSectors ((VHDHANDLE)parent,
+                             BlockData,
+                             BlockSectors,
+                             &SectorsWritten,
+                             VHD_Internal_SectorSize,
+                             SectorsPerBlock * BlockNumber))
+    r = SCPE_IOERR;
+free (BlockData);
+return r;
+}
 
-#define VHD_DT_Fixed                 2  /* Fixed hard disk */
-#define VHD_DT_Dynamic               3  /* Dynamic hard disk */
-#define VHD_DT_Differencing          4  /* Differencing hard disk */
+static t_stat sim_vhd_disk_write (FILE *f, t_lba lba, uint8 *buf, t_seccnt sects, uint32 SectorSize)
+{
+t_seccnt SectorsWritten;
 
-#define VHD_Internal_SectorSize     512
+return WriteVirtualDiskSectors ((VHDHANDLE)f, buf, sects, &SectorsWritten, SectorSize, lba);
+}
 
-typedef struct VHD_IOData *VHDHANDLE;
+static int sim_vhd_disk_close (FILE *f)
+{
+VHDHANDLE hVHD = (VHDHANDLE)f;
 
-static t_stat ReadFilePosition(FILE *File, void *buf, size_t bufsize, uint32 *bytesread, uint64 position)
+if (NULL != hVHD) {
+    if (hVHD->Parent)
+        sim_vhd_disk_close ((FILE *)hVHD->Parent);
+    free (hVHD->BAT);
+    free (hVHD->Map);
+    if (hVHD->File) {
+        fflush (hVHD->File);
+        fclose (hVHD->File);
+        }
+    free (hVHD);
+    return 0;
+    }
+return -1;
+}
+
+static void sim_vhd_disk_flush (FILE *f)
 {
-uint32 err = sim_fseeko (File, (t_offset)position, SEEK_SET);
-size_t i;
+VHDHANDLE hVHD = (VHDHANDLE)f;
 
-if (bytesread)
-    *bytesread = 0;
-if (!err) {
-    i = fread (buf, 1, bufsize, File);
-    if (bytesread)
-        *bytesread = (uint32)i;
-    err = ferror (File);
+if ((NULL != hVHD) && (hVHD->File))
+    fflush (hVHD->File);
+}
+
+static t_offset sim_vhd_disk_size (FILE *f)
+{
+VHDHANDLE hVHD = (VHDHANDLE)f;
+
+return (t_offset)(NtoHll (hVHD->Footer.CurrentSize));
+}
+
+
+#include <stdlib.h>
+#include <time.h>
+static void
+_rand_uuid_gen (void *uuidaddr)
+{
+int i;
+uint8 *b = (uint8 *)uuidaddr;
+uint32 timenow = (uint32)time (NULL);
+
+memcpy (uuidaddr, &timenow, sizeof (timenow));
+srand ((unsigned)timenow);
+for (i=4; i<16; i++) {
+    b[i] = (uint8)rand();
+    }
+}
+
+#if defined (_WIN32)
+static void
+uuid_gen (void *uuidaddr)
+{
+static
+RPC_STATUS
+(RPC_ENTRY *UuidCreate_c) (void *);
+
+if (!UuidCreate_c) {
+    HINSTANCE hDll;
+    hDll = LoadLibraryA("rpcrt4.dll");
+    UuidCreate_c = (RPC_STATUS (RPC_ENTRY *) (void *))GetProcAddress(hDll, "UuidCreate");
+    }
+if (UuidCreate_c)
+    UuidCreate_c(uuidaddr);
+else
+    _rand_uuid_gen (uuidaddr);
+}
+#elif defined (SIM_HAVE_DLOPEN)
+#include <dlfcn.h>
+
+static void
+uuid_gen (void *uuidaddr)
+{
+void (*uuid_generate_c) (void *) = NULL;
+void *handle;
+
+#define S__STR_QUOTE(tok) #tok
+#define S__STR(tok) S__STR_QUOTE(tok)
+    handle = dlopen("libuuid." S__STR(SIM_HAVE_DLOPEN), RTLD_NOW|RTLD_GLOBAL);
+    if (handle)
+        uuid_generate_c = (void (*)(void *))((size_t)dlsym(handle, "uuid_generate"));
+    if (uuid_generate_c)
+        uuid_generate_c(uuidaddr);
+    else
+        _rand_uuid_gen (uuidaddr);
+    if (handle)
+        dlclose(handle);
+}
+#else
+static void
+uuid_gen (void *uuidaddr)
+{
+_rand_uuid_gen (uuidaddr);
+}
+#endif
+
+static VHDHANDLE
+sim_CreateVirtualDisk(const char *szVHDPath,
+                      uint32 SizeInSectors,
+                      uint32 BlockSize,
+                      t_bool bFixedVHD)
+{
+VHD_Footer Footer;
+VHD_DynamicDiskHeader Dynamic;
+uint32 *BAT = NULL;
+time_t now;
+uint32 i;
+FILE *File = NULL;
+uint32 Status = 0;
+uint32 BytesPerSector = 512;
+uint64 SizeInBytes = ((uint64)SizeInSectors) * BytesPerSector;
+uint64 TableOffset;
+uint32 MaxTableEntries;
+VHDHANDLE hVHD = NULL;
+
+if (SizeInBytes > ((uint64)(1024 * 1024 * 1024)) * 2040) {
+    Status = EFBIG;
+    goto Cleanup_Return;
+    }
+File = sim_fopen (szVHDPath, "rb");
+if (File) {
+    fclose (File);
+    File = NULL;
+    Status = EEXIST;
+    goto Cleanup_Return;
+    }
+File = sim_fopen (szVHDPath, "wb");
+if (!File) {
+    Status = errno;
+    goto Cleanup_Return;
+    }
+
+memset (&Footer, 0, sizeof(Footer));
+memcpy (Footer.Cookie, "conectix", 8);
+Footer.Features = NtoHl (0x00000002);;
+Footer.FileFormatVersion = NtoHl (0x00010000);;
+Footer.DataOffset = NtoHll (bFixedVHD ? ((long long)-1) : (long long)(sizeof(Footer)));
+time (&now);
+Footer.TimeStamp = NtoHl ((uint32)(now - 946684800));
+memcpy (Footer.CreatorApplication, "simh", 4);
+Footer.CreatorVersion = NtoHl (0x00040000);
+memcpy (Footer.CreatorHostOS, "Wi2k", 4);
+Footer.OriginalSize = NtoHll (SizeInBytes);
+Footer.CurrentSize = NtoHll (SizeInBytes);
+uuid_gen (Footer.UniqueID);
+Footer.DiskType = NtoHl (bFixedVHD ? VHD_DT_Fixed : VHD_DT_Dynamic);
+Footer.DiskGeometry = NtoHl (0xFFFF10FF);
+if (1) { /* CHS Calculation */
+    uint32 totalSectors = (uint32)(SizeInBytes/BytesPerSector);/* Total data sectors present in the disk image */
+    uint32 cylinders;                                          /* Number of cylinders present on the disk */
+    uint32 heads;                                              /* Number of heads present on the disk */
+    uint32 sectorsPerTrack;                                    /* Sectors per track on the disk */
+    uint32 cylinderTimesHeads;                                 /* Cylinders x heads */
+
+    if (totalSectors > 65535 * 16 * 255)
+        totalSectors = 65535 * 16 * 255;
+
+    if (totalSectors >= 65535 * 16 * 63) {
+        sectorsPerTrack = 255;
+        heads = 16;
+        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        }
+    else {
+        sectorsPerTrack = 17;
+        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+
+        heads = (cylinderTimesHeads + 1023) / 1024;
+
+        if (heads < 4)
+            heads = 4;
+        if (cylinderTimesHeads >= (heads * 1024) || heads > 16)
+            {
+            sectorsPerTrack = 31;
+            heads = 16;
+            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+            }
+        if (cylinderTimesHeads >= (heads * 1024))
+            {
+            sectorsPerTrack = 63;
+            heads = 16;
+            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+            }
+        }
+    cylinders = (totalSectors + sectorsPerTrack * heads - 1) / (sectorsPerTrack * heads);
+    Footer.DiskGeometry = NtoHl ((cylinders<<16)|(heads<<8)|sectorsPerTrack);
+    }
+Footer.Checksum = NtoHl (CalculateVhdFooterChecksum(&Footer, sizeof(Footer)));
+
+if (bFixedVHD) {
+    if (WriteFilePosition(File,
+                          &Footer,
+                          sizeof(Footer),
+                          NULL,
+                          SizeInBytes))
+        Status = errno;
+    goto Cleanup_Return;
+    }
+
+/* Dynamic Disk */
+memset (&Dynamic, 0, sizeof(Dynamic));
+memcpy (Dynamic.Cookie, "cxsparse", 8);
+Dynamic.DataOffset = NtoHll ((uint64)0xFFFFFFFFFFFFFFFFLL);
+TableOffset = NtoHll(Footer.DataOffset)+sizeof(Dynamic);
+Dynamic.TableOffset = NtoHll (TableOffset);
+Dynamic.HeaderVersion = NtoHl (0x00010000);
+if (0 == BlockSize)
+    BlockSize = 2*1024*1024;
+Dynamic.BlockSize = NtoHl (BlockSize);
+MaxTableEntries = (uint32)((SizeInBytes+BlockSize-1)/BlockSize);
+Dynamic.MaxTableEntries = NtoHl (MaxTableEntries);
+Dynamic.Checksum = NtoHl (CalculateVhdFooterChecksum(&Dynamic, sizeof(Dynamic)));
+BAT = (uint32*) malloc (BytesPerSector*((MaxTableEntries*sizeof(*BAT)+BytesPerSector-1)/BytesPerSector));
+memset (BAT, 0, BytesPerSector*((MaxTableEntries*sizeof(*BAT)+BytesPerSector-1)/BytesPerSector));
+for (i=0; i<MaxTableEntries; ++i)
+    BAT[i] = VHD_BAT_FREE_ENTRY;
+
+if (WriteFilePosition(File,
+                      &Footer,
+                      sizeof(Footer),
+                      NULL,
+                      0)) {
+    Status = errno;
+    goto Cleanup_Return;
+    }
+if (WriteFilePosition(File,
+                      &Dynamic,
+                      sizeof(Dynamic),
+                      NULL,
+                      NtoHll(Footer.DataOffset))) {
+    Status = errno;
+    goto Cleanup_Return;
+    }
+if (WriteFilePosition(File,
+                      BAT,
+                      BytesPerSector*((MaxTableEntries*sizeof(*BAT)+BytesPerSector-1)/BytesPerSector),
+                      NULL,
+                      NtoHll(Dynamic.TableOffset))) {
+    Status = errno;
+    goto Cleanup_Return;
+    }
+if (WriteFilePosition(File,
+                      &Footer,
+                      sizeof(Footer),
+                      NULL,
+                      NtoHll(Dynamic.TableOffset)+BytesPerSector*((MaxTableEntries*sizeof(*BAT)+BytesPerSector-1)/BytesPerSector))) {
+    Status = errno;
+    goto Cleanup_Return;
     }
-return (err ? SCPE_IOERR : SCPE_OK);
-}
-
-static t_stat WriteFilePosition(FILE *File, void *buf, size_t bufsize, uint32 *byteswritten, uint64 position)
-{
-uint32 err = sim_fseeko (File, (t_offset)position, SEEK_SET);
-size_t i;
 
-if (byteswritten)
-    *byteswritten = 0;
-if (!err) {
-    i = fwrite (buf, 1, bufsize, File);
-    if (byteswritten)
-        *byteswritten = (uint32)i;
-    err = ferror (File);
+Cleanup_Return:
+free (BAT);
+if (File)
+    fclose (File);
+if (Status) {
+    if (Status != EEXIST)
+        (void)remove (szVHDPath);
     }
-return (err ? SCPE_IOERR : SCPE_OK);
+else {
+    hVHD = (VHDHANDLE)sim_vhd_disk_open (szVHDPath, "rb+");
+    if (!hVHD)
+        Status = errno;
+    }
+errno = Status;
+return hVHD;
 }
 
-static uint32
-CalculateVhdFooterChecksum(void *data,
-                           size_t size)
+#if defined(__CYGWIN__) || defined(VMS) || defined(__APPLE__) || defined(__linux) || defined(__linux__) || defined(__unix__)
+#include <unistd.h>
+#endif
+static void
+ExpandToFullPath (const char *szFileSpec,
+                  char *szFullFileSpecBuffer,
+                  size_t BufferSize)
 {
-uint32 sum = 0;
-uint8 *c = (uint8 *)data;
-
-while (size--)
-    sum += *c++;
-return ~sum;
-}
+char *c;
+#ifdef _WIN32
+for (c = strchr (szFullFileSpecBuffer, '/'); c; c = strchr (szFullFileSpecBuffer, '/'))
+    *c = '\\';
+GetFullPathNameA (szFileSpec, (DWORD)BufferSize, szFullFileSpecBuffer, NULL);
+for (c = strchr (szFullFileSpecBuffer, '\\'); c; c = strchr (szFullFileSpecBuffer, '\\'))
+    *c = '/';
+#else
+char buffer[PATH_MAX];
+char *wd = getcwd(buffer, PATH_MAX);
 
-#if defined(_WIN32) || defined (__ALPHA) || defined (__ia64) || defined (VMS)
-#ifndef __BYTE_ORDER__
-#define __BYTE_ORDER__ __ORDER_LITTLE_ENDIAN__
-#endif
-#endif
-#ifndef __BYTE_ORDER__
-#define __BYTE_ORDER__ UNKNOWN
+if ((szFileSpec[0] != '/') || (strchr (szFileSpec, ':')))
+    snprintf (szFullFileSpecBuffer, BufferSize, "%s/%s", wd, szFileSpec);
+else
+    strlcpy (szFullFileSpecBuffer, szFileSpec, BufferSize);
+if ((c = strstr (szFullFileSpecBuffer, "]/")))
+    memmove (c+1, c+2, strlen(c+2)+1);
+memset (szFullFileSpecBuffer + strlen (szFullFileSpecBuffer), 0, BufferSize - strlen (szFullFileSpecBuffer));
 #endif
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-static uint64
-NtoHll(uint64 value)
-{
-uint8 *l = (uint8 *)&value;
-uint64 highresult = (uint64)l[3] | ((uint64)l[2]<<8) | ((uint64)l[1]<<16) | ((uint64)l[0]<<24);
-uint32 lowresult = (uint64)l[7] | ((uint64)l[6]<<8) | ((uint64)l[5]<<16) | ((uint64)l[4]<<24);
-return (highresult << 32) | lowresult;
-}
-#elif  __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-static uint64
-NtoHll(uint64 value)
-{
-return value;
 }
-#else
-static uint32
-NtoHl(uint32 value)
+
+static char *
+HostPathToVhdPath (const char *szHostPath,
+                   char *szVhdPath,
+                   size_t VhdPathSize)
 {
-uint8 *l = (uint8 *)&value;
+char *c, *d;
 
-if (sim_end)
-    return l[3] | (l[2]<<8) | (l[1]<<16) | (l[0]<<24);
-return value;
+memset (szVhdPath, 0, VhdPathSize);
+strlcpy (szVhdPath, szHostPath, VhdPathSize-1);
+if ((szVhdPath[1] == ':') && islower(szVhdPath[0]))
+    szVhdPath[0] = toupper(szVhdPath[0]);
+szVhdPath[VhdPathSize-1] = '\0';
+if ((c = strrchr (szVhdPath, ']'))) {
+    *c = '\0';
+    if (!(d = strchr (szVhdPath, '[')))
+        return d;
+    *d = '/';
+    while ((d = strchr (d, '.')))
+        *d = '/';
+    *c = '/';
+    }
+while ((c = strchr (szVhdPath, '/')))
+    *c = '\\';
+for (c = strstr (szVhdPath, "\\.\\"); c; c = strstr (szVhdPath, "\\.\\"))
+    memmove (c, c+2, strlen(c+2)+1);
+for (c = strstr (szVhdPath, "\\\\"); c; c = strstr (szVhdPath, "\\\\"))
+    memmove (c, c+1, strlen(c+1)+1);
+while ((c = strstr (szVhdPath, "\\..\\"))) {
+    *c = '\0';
+    d = strrchr (szVhdPath, '\\');
+    if (d)
+        memmove (d, c+3, strlen(c+3)+1);
+    else
+        return d;
+    }
+memset (szVhdPath + strlen (szVhdPath), 0, VhdPathSize - strlen (szVhdPath));
+return szVhdPath;
 }
 
-static uint64
-NtoHll(uint64 value)
+static char *
+VhdPathToHostPath (const char *szVhdPath,
+                   char *szHostPath,
+                   size_t HostPathSize)
 {
-uint8 *l = (uint8 *)&value;
+char *c;
+char *d = szHostPath;
 
-if (sim_end) {
-    uint64 highresult = l[3] | (l[2]<<8) | (l[1]<<16) | (l[0]<<24);
-    uint32 lowresult = l[7] | (l[6]<<8) | (l[5]<<16) | (l[4]<<24);
-    return (highresult << 32) | lowresult;
+memmove (szHostPath, szVhdPath, HostPathSize);
+szHostPath[HostPathSize-1] = '\0';
+#if defined(VMS)
+c = strchr (szHostPath, ':');
+if (*(c+1) != '\\')
+    return NULL;
+*(c+1) = '[';
+d = strrchr (c+2, '\\');
+if (d) {
+    *d = ']';
+    while ((d = strrchr (c+2, '\\')))
+        *d = '.';
     }
-return value;
-}
+else
+    return NULL;
+#else
+while ((c = strchr (d, '\\')))
+    *c = '/';
 #endif
+memset (szHostPath + strlen (szHostPath), 0, HostPathSize - strlen (szHostPath));
+return szHostPath;
+}
 
-static
-int
-GetVHDFooter(const char *szVHDPath,
-             VHD_Footer *sFooter,
-             VHD_DynamicDiskHeader *sDynamic,
-             uint32 **aBAT,
-             uint32 *ModifiedTimeStamp,
-             char *szParentVHDPath,
-             size_t ParentVHDPathSize)
+static VHDHANDLE
+CreateDifferencingVirtualDisk(const char *szVHDPath,
+                              const char *szParentVHDPath)
 {
-FILE *File = NULL;
-uint64 position;
-uint32 sum, saved_sum;
-int Return = 0;
-VHD_Footer sHeader;
-struct stat statb;
+uint32 BytesPerSector = 512;
+VHDHANDLE hVHD = NULL;
+VHD_Footer ParentFooter;
+VHD_DynamicDiskHeader ParentDynamic;
+uint32 ParentTimeStamp;
+uint32 Status = 0;
+char *RelativeParentVHDPath = NULL;
+char *FullParentVHDPath = NULL;
+char *RelativeParentVHDPathUnicode = NULL;
+char *FullParentVHDPathUnicode = NULL;
+char *FullVHDPath = NULL;
+char *TempPath = NULL;
+size_t i, RelativeMatch, UpDirectories, LocatorsWritten = 0;
+int64 LocatorPosition;
 
-memset(sFooter, '\0', sizeof(*sFooter));
-if (sDynamic)
-    memset(sDynamic, '\0', sizeof(*sDynamic));
-if (aBAT)
-    *aBAT = NULL;
-File = sim_fopen (szVHDPath, "rb");
-if (!File) {
-    Return = errno;
-    goto Return_Cleanup;
+if ((Status = GetVHDFooter (szParentVHDPath,
+                            &ParentFooter,
+                            &ParentDynamic,
+                            NULL,
+                            &ParentTimeStamp,
+                            NULL,
+                            0)))
+    goto Cleanup_Return;
+hVHD = sim_CreateVirtualDisk (szVHDPath,
+                              (uint32)(NtoHll(ParentFooter.CurrentSize)/BytesPerSector),
+                              NtoHl(ParentDynamic.BlockSize),
+                              FALSE);
+if (!hVHD) {
+    Status = errno;
+    goto Cleanup_Return;
     }
-if (ModifiedTimeStamp) {
-    if (fstat (fileno (File), &statb)) {
-        Return = errno;
-        goto Return_Cleanup;
+LocatorPosition = ((sizeof (hVHD->Footer) + BytesPerSector - 1)/BytesPerSector + (sizeof (hVHD->Dynamic) + BytesPerSector - 1)/BytesPerSector)*BytesPerSector;
+hVHD->Dynamic.Checksum = 0;
+RelativeParentVHDPath = (char*) calloc (1, BytesPerSector+2);
+FullParentVHDPath = (char*) calloc (1, BytesPerSector+2);
+RelativeParentVHDPathUnicode = (char*) calloc (1, BytesPerSector+2);
+FullParentVHDPathUnicode = (char*) calloc (1, BytesPerSector+2);
+FullVHDPath = (char*) calloc (1, BytesPerSector+2);
+TempPath = (char*) calloc (1, BytesPerSector+2);
+ExpandToFullPath (szParentVHDPath, TempPath, BytesPerSector);
+HostPathToVhdPath (TempPath, FullParentVHDPath, BytesPerSector);
+for (i=0; i < strlen (FullParentVHDPath); i++)
+    hVHD->Dynamic.ParentUnicodeName[i*2+1] = FullParentVHDPath[i];  /* Big Endian Unicode */
+for (i=0; i < strlen (FullParentVHDPath); i++)
+    FullParentVHDPathUnicode[i*2] = FullParentVHDPath[i];           /* Little Endian Unicode */
+ExpandToFullPath (szVHDPath, TempPath, BytesPerSector);
+HostPathToVhdPath (TempPath, FullVHDPath, BytesPerSector);
+for (i=0, RelativeMatch=UpDirectories=0; i<strlen(FullVHDPath); i++)
+    if (FullVHDPath[i] == '\\') {
+        if (memcmp (FullVHDPath, FullParentVHDPath, i+1))
+            ++UpDirectories;
+        else
+            RelativeMatch = i;
         }
+if (RelativeMatch) {
+    char UpDir[4] = "..\\";
+
+    UpDir[2] = FullParentVHDPath[RelativeMatch];
+    if (UpDirectories)
+        for (i=0; i<UpDirectories; i++)
+            strcpy (RelativeParentVHDPath+strlen (RelativeParentVHDPath), UpDir);
     else
-        *ModifiedTimeStamp = NtoHl ((uint32)(statb.st_mtime-946684800));
-    }
-position = sim_fsize_ex (File);
-if (((int64)position) == -1) {
-    Return = errno;
-    goto Return_Cleanup;
+        strcpy (RelativeParentVHDPath+strlen (RelativeParentVHDPath), UpDir+1);
+    strcpy (RelativeParentVHDPath+strlen (RelativeParentVHDPath), &FullParentVHDPath[RelativeMatch+1]);
     }
-position -= sizeof(*sFooter);
-if (ReadFilePosition(File,
-                     sFooter,
-                     sizeof(*sFooter),
-                     NULL,
-                     position)) {
-    Return = errno;
-    goto Return_Cleanup;
+for (i=0; i < strlen(RelativeParentVHDPath); i++)
+    RelativeParentVHDPathUnicode[i*2] = RelativeParentVHDPath[i];
+hVHD->Dynamic.ParentTimeStamp = ParentTimeStamp;
+memcpy (hVHD->Dynamic.ParentUniqueID, ParentFooter.UniqueID, sizeof (hVHD->Dynamic.ParentUniqueID));
+/* There are two potential parent locators on current vhds */
+memcpy (hVHD->Dynamic.ParentLocatorEntries[0].PlatformCode, "W2ku", 4);
+hVHD->Dynamic.ParentLocatorEntries[0].PlatformDataSpace = NtoHl (BytesPerSector);
+hVHD->Dynamic.ParentLocatorEntries[0].PlatformDataLength = NtoHl ((uint32)(2*strlen(FullParentVHDPath)));
+hVHD->Dynamic.ParentLocatorEntries[0].Reserved = 0;
+hVHD->Dynamic.ParentLocatorEntries[0].PlatformDataOffset = NtoHll (LocatorPosition+LocatorsWritten*BytesPerSector);
+++LocatorsWritten;
+if (RelativeMatch) {
+    memcpy (hVHD->Dynamic.ParentLocatorEntries[1].PlatformCode, "W2ru", 4);
+    hVHD->Dynamic.ParentLocatorEntries[1].PlatformDataSpace = NtoHl (BytesPerSector);
+    hVHD->Dynamic.ParentLocatorEntries[1].PlatformDataLength = NtoHl ((uint32)(2*strlen(RelativeParentVHDPath)));
+    hVHD->Dynamic.ParentLocatorEntries[1].Reserved = 0;
+    hVHD->Dynamic.ParentLocatorEntries[1].PlatformDataOffset = NtoHll (LocatorPosition+LocatorsWritten*BytesPerSector);
+    ++LocatorsWritten;
     }
-saved_sum = NtoHl(sFooter->Checksum);
-sFooter->Checksum = 0;
-sum = CalculateVhdFooterChecksum(sFooter, sizeof(*sFooter));
-sFooter->Checksum = NtoHl(saved_sum);
-if ((sum != saved_sum) || (memcmp("conectix", sFooter->Cookie, sizeof(sFooter->Cookie)))) {
-    Return = EINVAL;                                    /* File Corrupt */
-    goto Return_Cleanup;
+hVHD->Dynamic.TableOffset = NtoHll (((LocatorPosition+LocatorsWritten*BytesPerSector + VHD_DATA_BLOCK_ALIGNMENT - 1)/VHD_DATA_BLOCK_ALIGNMENT)*VHD_DATA_BLOCK_ALIGNMENT);
+hVHD->Dynamic.Checksum = 0;
+hVHD->Dynamic.Checksum = NtoHl (CalculateVhdFooterChecksum (&hVHD->Dynamic, sizeof(hVHD->Dynamic)));
+hVHD->Footer.Checksum = 0;
+hVHD->Footer.DiskType = NtoHl (VHD_DT_Differencing);
+memcpy (hVHD->Footer.DriveType, ParentFooter.DriveType, sizeof (hVHD->Footer.DriveType));
+hVHD->Footer.DriveSectorSize = ParentFooter.DriveSectorSize;
+hVHD->Footer.DriveTransferElementSize = ParentFooter.DriveTransferElementSize;
+hVHD->Footer.Checksum = NtoHl (CalculateVhdFooterChecksum (&hVHD->Footer, sizeof(hVHD->Footer)));
+
+if (WriteFilePosition (hVHD->File,
+                       &hVHD->Footer,
+                       sizeof (hVHD->Footer),
+                       NULL,
+                       0)) {
+    Status = errno;
+    goto Cleanup_Return;
     }
-if (ReadFilePosition(File,
-                     &sHeader,
-                     sizeof(sHeader),
-                     NULL,
-                     (uint64)0)) {
-    Return = errno;
-    goto Return_Cleanup;
+if (WriteFilePosition (hVHD->File,
+                       &hVHD->Dynamic,
+                       sizeof (hVHD->Dynamic),
+                       NULL,
+                       NtoHll (hVHD->Footer.DataOffset))) {
+    Status = errno;
+    goto Cleanup_Return;
     }
-if ((NtoHl(sFooter->DiskType) != VHD_DT_Dynamic) &&
-    (NtoHl(sFooter->DiskType) != VHD_DT_Differencing) &&
-    (NtoHl(sFooter->DiskType) != VHD_DT_Fixed)) {
-    Return = EINVAL;                                    /* File Corrupt */
-    goto Return_Cleanup;
+if (WriteFilePosition (hVHD->File,
+                       hVHD->BAT,
+                       BytesPerSector*((NtoHl (hVHD->Dynamic.MaxTableEntries)*sizeof(*hVHD->BAT)+BytesPerSector-1)/BytesPerSector),
+                       NULL,
+                       NtoHll (hVHD->Dynamic.TableOffset))) {
+    Status = errno;
+    goto Cleanup_Return;
     }
-if (((NtoHl(sFooter->DiskType) == VHD_DT_Dynamic) ||
-     (NtoHl(sFooter->DiskType) == VHD_DT_Differencing)) &&
-     memcmp(sFooter, &sHeader, sizeof(sHeader))) {
-    Return = EINVAL;                                    /* File Corrupt */
-    goto Return_Cleanup;
+if (WriteFilePosition (hVHD->File,
+                       &hVHD->Footer,
+                       sizeof (hVHD->Footer),
+                       NULL,
+                       NtoHll (hVHD->Dynamic.TableOffset)+BytesPerSector*((NtoHl (hVHD->Dynamic.MaxTableEntries)*sizeof(*hVHD->BAT)+BytesPerSector-1)/BytesPerSector))) {
+    Status = errno;
+    goto Cleanup_Return;
     }
-if ((sDynamic) &&
-    ((NtoHl(sFooter->DiskType) == VHD_DT_Dynamic) ||
-     (NtoHl(sFooter->DiskType) == VHD_DT_Differencing))) {
-    if (ReadFilePosition(File,
-                         sDynamic,
-                         sizeof (*sDynamic),
-                         NULL,
-                         NtoHll (sFooter->DataOffset))) {
-        Return = errno;
-        goto Return_Cleanup;
-        }
-    saved_sum = NtoHl (sDynamic->Checksum);
-    sDynamic->Checksum = 0;
-    sum = CalculateVhdFooterChecksum (sDynamic, sizeof(*sDynamic));
-    sDynamic->Checksum = NtoHl (saved_sum);
-    if ((sum != saved_sum) || (memcmp ("cxsparse", sDynamic->Cookie, sizeof (sDynamic->Cookie)))) {
-        Return = errno;
-        goto Return_Cleanup;
+if (hVHD->Dynamic.ParentLocatorEntries[0].PlatformDataLength)
+    if (WriteFilePosition (hVHD->File,
+                           FullParentVHDPathUnicode,
+                           BytesPerSector,
+                           NULL,
+                           NtoHll (hVHD->Dynamic.ParentLocatorEntries[0].PlatformDataOffset))) {
+        Status = errno;
+        goto Cleanup_Return;
         }
-    if (aBAT) {
-        *aBAT = (uint32*) calloc(1, VHD_Internal_SectorSize * ((sizeof(**aBAT) * NtoHl(sDynamic->MaxTableEntries) + VHD_Internal_SectorSize - 1) / VHD_Internal_SectorSize));
-        if (ReadFilePosition(File,
-                             *aBAT,
-                             sizeof (**aBAT) * NtoHl(sDynamic->MaxTableEntries),
-                             NULL,
-                             NtoHll (sDynamic->TableOffset))) {
-            Return = EINVAL;                            /* File Corrupt */
-            goto Return_Cleanup;
-            }
+if (hVHD->Dynamic.ParentLocatorEntries[1].PlatformDataLength)
+    if (WriteFilePosition (hVHD->File,
+                           RelativeParentVHDPathUnicode,
+                           BytesPerSector,
+                           NULL,
+                           NtoHll (hVHD->Dynamic.ParentLocatorEntries[1].PlatformDataOffset))) {
+        Status = errno;
+        goto Cleanup_Return;
         }
-    if (szParentVHDPath && ParentVHDPathSize) {
-        VHD_Footer sParentFooter;
-
-        memset (szParentVHDPath, '\0', ParentVHDPathSize);
-        if (NtoHl (sFooter->DiskType) == VHD_DT_Differencing) {
-            size_t i, j;
-
-            for (j=0; j<8; ++j) {
-                uint8 *Pdata;
-                uint32 PdataSize;
-                char ParentName[512];
-                char CheckPath[512];
-                uint32 ParentModificationTime;
-
-                if ('\0' == sDynamic->ParentLocatorEntries[j].PlatformCode[0])
-                    continue;
-                memset (ParentName, '\0', sizeof(ParentName));
-                memset (CheckPath, '\0', sizeof(CheckPath));
-                PdataSize = NtoHl(sDynamic->ParentLocatorEntries[j].PlatformDataSpace);
-                Pdata = (uint8*) calloc (1, PdataSize+2);
-                if (!Pdata)
-                    continue;
-                if (ReadFilePosition(File,
-                                     Pdata,
-                                     PdataSize,
-                                     NULL,
-                                     NtoHll (sDynamic->ParentLocatorEntries[j].PlatformDataOffset))) {
-                    free (Pdata);
-                    continue;
-                    }
-                for (i=0; i<NtoHl(sDynamic->ParentLocatorEntries[j].PlatformDataLength); i+=2)
-                    if ((Pdata[i] == '\0') && (Pdata[i+1] == '\0')) {
-                        ParentName[i/2] = '\0';
-                        break;
-                        }
-                    else
-                        ParentName[i/2] = Pdata[i] ? Pdata[i] : Pdata[i+1];
-                free (Pdata);
-                memset (CheckPath, 0, sizeof (CheckPath));
-                if (0 == memcmp (sDynamic->ParentLocatorEntries[j].PlatformCode, "W2ku", 4))
-                    strlcpy (CheckPath, ParentName, sizeof (CheckPath));
-                else
-                    if (0 == memcmp (sDynamic->ParentLocatorEntries[j].PlatformCode, "W2ru", 4)) {
-                        const char *c;
 
-                        if ((c = strrchr (szVHDPath, '\\'))) {
-                            memcpy (CheckPath, szVHDPath, c-szVHDPath+1);
-                            strlcat (CheckPath, ParentName, sizeof (CheckPath));
-                            }
-                        }
-                VhdPathToHostPath (CheckPath, CheckPath, sizeof (CheckPath));
-                if (0 == GetVHDFooter(CheckPath,
-                                      &sParentFooter,
-                                      NULL,
-                                      NULL,
-                                      &ParentModificationTime,
-                                      NULL,
-                                      0)) {
-                    if ((0 == memcmp (sDynamic->ParentUniqueID, sParentFooter.UniqueID, sizeof (sParentFooter.UniqueID))) &&
-                        ((sDynamic->ParentTimeStamp == ParentModificationTime) ||
-                         ((NtoHl(sDynamic->ParentTimeStamp)-NtoHl(ParentModificationTime)) == 3600) ||
-                         (sim_switches & SWMASK ('O')))) {
-                         memset (szParentVHDPath, 0, ParentVHDPathSize);
-                         strlcpy (szParentVHDPath, CheckPath, ParentVHDPathSize);
-                        }
-                    else {
-                        if (0 != memcmp (sDynamic->ParentUniqueID, sParentFooter.UniqueID, sizeof (sParentFooter.UniqueID)))
-                            sim_printf ("Error Invalid Parent VHD '%s' for Differencing VHD: %s\n", CheckPath, szVHDPath);
-                        else
-                            sim_printf ("Error Parent VHD '%s' has been modified since Differencing VHD: %s was created\n", CheckPath, szVHDPath);
-                        Return = EINVAL;                /* File Corrupt/Invalid */
-                        }
-                    break;
-                    }
-                else {
-                    struct stat statb;
-
-                    if (0 == stat (CheckPath, &statb)) {
-                        sim_printf ("Parent VHD '%s' corrupt for Differencing VHD: %s\n", CheckPath, szVHDPath);
-                        Return = EBADF;                /* File Corrupt/Invalid */
-                        break;
-                        }
-                    }
-                }
-            if (!*szParentVHDPath) {
-                if (Return != EINVAL)                   /* File Not Corrupt? */
-                    sim_printf ("Missing Parent VHD for Differencing VHD: %s\n", szVHDPath);
-                Return = EBADF;
-                }
-            }
-        }
+Cleanup_Return:
+free (RelativeParentVHDPath);
+free (FullParentVHDPath);
+free (RelativeParentVHDPathUnicode);
+free (FullParentVHDPathUnicode);
+free (FullVHDPath);
+free (TempPath);
+sim_vhd_disk_close ((FILE *)hVHD);
+hVHD = NULL;
+if (Status) {
+    if ((EEXIST != Status) && (ENOENT != Status))
+        (void)remove (szVHDPath);
     }
-Return_Cleanup:
-if (File)
-    fclose(File);
-if (aBAT && (0 != Return)) {
-    free (*aBAT);
-    *aBAT = NULL;
+else {
+    hVHD = (VHDHANDLE)sim_vhd_disk_open (szVHDPath, "rb+");
+    if (!hVHD)
+        Status = errno;
     }
-return errno = Return;
+errno = Status;
+return hVHD;
 }
 
-struct VHD_IOData {
-    VHD_Footer Footer;
-    VHD_DynamicDiskHeader Dynamic;
-    uint32 *BAT;
-    FILE *File;
-    char ParentVHDPath[512];
-    struct VHD_IOData *Parent;
-    };
-
-static t_stat sim_vhd_disk_implemented (void)
+static FILE *sim_vhd_disk_create (const char *szVHDPath, t_offset desiredsize)
 {
-return SCPE_OK;
+return (FILE *)sim_CreateVirtualDisk (szVHDPath, (uint32)(desiredsize/512), 0, (sim_switches & SWMASK ('X')));
 }
 
-static t_stat sim_vhd_disk_set_dtype (FILE *f, const char *dtype, uint32 SectorSize, uint32 xfer_element_size)
+static FILE *sim_vhd_disk_create_diff (const char *szVHDPath, const char *szParentVHDPath)
 {
-VHDHANDLE hVHD  = (VHDHANDLE)f;
-int Status = 0;
+return (FILE *)CreateDifferencingVirtualDisk (szVHDPath, szParentVHDPath);
+}
 
-memset (hVHD->Footer.DriveType, '\0', sizeof hVHD->Footer.DriveType);
-memcpy (hVHD->Footer.DriveType, dtype, ((1+strlen (dtype)) < sizeof (hVHD->Footer.DriveType)) ? (1+strlen (dtype)) : sizeof (hVHD->Footer.DriveType));
-hVHD->Footer.DriveSectorSize = NtoHl (SectorSize);
-hVHD->Footer.DriveTransferElementSize = NtoHl (xfer_element_size);
-hVHD->Footer.CreatingSimulator[sizeof (hVHD->Footer.CreatingSimulator) - 1] = '\0';  /* Force NUL termination */
-memset (hVHD->Footer.CreatingSimulator, 0, sizeof (hVHD->Footer.CreatingSimulator));
-strlcpy ((char *)hVHD->Footer.CreatingSimulator, sim_name, sizeof (hVHD->Footer.CreatingSimulator));
-hVHD->Footer.Checksum = 0;
-hVHD->Footer.Checksum = NtoHl (CalculateVhdFooterChecksum (&hVHD->Footer, sizeof(hVHD->Footer)));
+static t_stat
+ReadVirtualDisk(VHDHANDLE hVHD,
+                uint8 *buf,
+                uint32 BytesToRead,
+                uint32 *BytesRead,
+                uint64 Offset)
+{
+uint32 TotalBytesRead = 0;
+uint32 BitMapBytes;
+uint32 BitMapSectors;
+uint32 DynamicBlockSize;
+t_stat r = SCPE_OK;
 
+if (BytesRead)
+    *BytesRead = 0;
+if (!hVHD || (hVHD->File == NULL)) {
+    errno = EBADF;
+    return SCPE_IOERR;
+    }
+if (BytesToRead == 0)
+    return SCPE_OK;
+if (Offset >= (uint64)NtoHll (hVHD->Footer.CurrentSize)) {
+    errno = ERANGE;
+    return SCPE_IOERR;
+    }
 if (NtoHl (hVHD->Footer.DiskType) == VHD_DT_Fixed) {
-    if (WriteFilePosition(hVHD->File,
-                          &hVHD->Footer,
-                          sizeof(hVHD->Footer),
-                          NULL,
-                          NtoHll (hVHD->Footer.CurrentSize)))
-        Status = errno;
-    goto Cleanup_Return;
+    if (ReadFilePosition(hVHD->File,
+                         buf,
+                         BytesToRead,
+                         BytesRead,
+                         Offset))
+        r = SCPE_IOERR;
+    return r;
     }
-else {
-    uint64 position;
+/* We are now dealing with a Dynamically expanding or differencing disk */
+DynamicBlockSize = NtoHl (hVHD->Dynamic.BlockSize);
+if ((DynamicBlockSize == 0) ||
+    ((DynamicBlockSize & (DynamicBlockSize - 1)) != 0)) {
+    errno = ERANGE;
+    return SCPE_IOERR;
+    }
+if (hVHD->Map) {                            /* differencing chain with a merged map */
+    ++hVHD->MapReads;
+    while (BytesToRead && (r == SCPE_OK)) {
+        uint32 BlockNumber = (uint32)(Offset / DynamicBlockSize);
+        struct VHD_BlockLocation *Loc;
+        uint64 FileOffset;
+        uint32 BytesInRead, BytesThisRead = 0;
 
-    position = sim_fsize_ex (hVHD->File);
-    if (((int64)position) == -1) {
-        Status = errno;
-        goto Cleanup_Return;
+        if (BlockNumber >= hVHD->MapEntries) {
+            errno = ERANGE;
+            r = SCPE_IOERR;
+            break;
+            }
+        Loc = &hVHD->Map[BlockNumber];
+        FileOffset = Loc->Offset + (Offset % DynamicBlockSize);
+        BytesInRead = DynamicBlockSize - (uint32)(Offset % DynamicBlockSize);
+        if (BytesInRead > BytesToRead)
+            BytesInRead = BytesToRead;
+        /* Extend the transfer over following blocks whose data continues it */
+        while ((BytesInRead < BytesToRead) &&
+               (++BlockNumber < hVHD->MapEntries) &&
+               (hVHD->Map[BlockNumber].Owner == Loc->Owner) &&
+               ((Loc->Owner == NULL) || (hVHD->Map[BlockNumber].Offset == Loc->Offset + DynamicBlockSize))) {
+            Loc = &hVHD->Map[BlockNumber];
+            BytesInRead += ((BytesToRead - BytesInRead) < DynamicBlockSize) ? (BytesToRead - BytesInRead) : DynamicBlockSize;
+            }
+        if (Loc->Owner == NULL) {
+            memset (buf, 0, BytesInRead);
+            BytesThisRead = BytesInRead;
+            }
+        else {
+            ++hVHD->MapTransfers;
+            if (ReadFilePosition(Loc->Owner->File,
+                                 buf,
+                                 BytesInRead,
+                                 &BytesThisRead,
+                                 FileOffset))
+                r = SCPE_IOERR;
+            }
+        BytesToRead -= BytesThisRead;
+        buf = (uint8 *)(((char *)buf) + BytesThisRead);
+        Offset += BytesThisRead;
+        TotalBytesRead += BytesThisRead;
+        if ((BytesThisRead == 0) && (r == SCPE_OK))
+            break;
         }
-    position -= sizeof(hVHD->Footer);
-    /* Update both copies on a dynamic disk */
-    if (WriteFilePosition(hVHD->File,
-                          &hVHD->Footer,
-                          sizeof(hVHD->Footer),
-                          NULL,
-                          (uint64)0)) {
-        Status = errno;
-        goto Cleanup_Return;
+    if (BytesRead)
+        *BytesRead = TotalBytesRead;
+    return r;
+    }
+BitMapBytes = (7+(DynamicBlockSize / VHD_Internal_SectorSize))/8;
+BitMapSectors = (BitMapBytes+VHD_Internal_SectorSize-1)/VHD_Internal_SectorSize;
+while (BytesToRead && (r == SCPE_OK)) {
+    uint32 BlockNumber = (uint32)(Offset / DynamicBlockSize);
+    uint32 BytesInRead = BytesToRead;
+    uint32 BytesThisRead = 0;
+
+    if (BlockNumber != (Offset + BytesToRead) / DynamicBlockSize)
+        BytesInRead = (uint32)(((BlockNumber + 1) * DynamicBlockSize) - Offset);
+    if (hVHD->BAT[BlockNumber] == VHD_BAT_FREE_ENTRY) {
+        if (!hVHD->Parent) {
+            memset (buf, 0, BytesInRead);
+            BytesThisRead = BytesInRead;
+            }
+        else {
+            if (ReadVirtualDisk(hVHD->Parent,
+                                buf,
+                                BytesInRead,
+                                &BytesThisRead,
+                                Offset))
+                r = SCPE_IOERR;
+            }
         }
-    if (WriteFilePosition(hVHD->File,
-                          &hVHD->Footer,
-                          sizeof(hVHD->Footer),
-                          NULL,
-                          position)) {
-        Status = errno;
-        goto Cleanup_Return;
+    else {
+        uint64 BlockOffset = VHD_Internal_SectorSize * ((uint64)(NtoHl (hVHD->BAT[BlockNumber]) + BitMapSectors)) + (Offset % DynamicBlockSize);
+
+        if (ReadFilePosition(hVHD->File,
+                             buf,
+                             BytesInRead,
+                             &BytesThisRead,
+                             BlockOffset))
+            r = SCPE_IOERR;
         }
+    BytesToRead -= BytesThisRead;
+    buf = (uint8 *)(((char *)buf) + BytesThisRead);
+    Offset += BytesThisRead;
+    TotalBytesRead += BytesThisRead;
     }
-Cleanup_Return:
-if (Status)
-    return SCPE_IOERR;
+if (BytesRead)
+    *BytesRead = TotalBytesRead;
 return SCPE_OK;
 }
 
-static const char *sim_vhd_disk_get_dtype (FILE *f, uint32 *SectorSize, uint32 *xfer_element_size, char sim_name[64], time_t *creation_time)
+static t_stat
+ReadVirtualDiskSectors(VHDHANDLE hVHD,
+                       uint8 *buf,
+                       t_seccnt sects,
+                       t_seccnt *sectsread,
+                       uint32 SectorSize,
+                       t_lba lba)
 {
-VHDHANDLE hVHD  = (VHDHANDLE)f;
+uint32 BytesRead;
+t_stat r = ReadVirtualDisk(hVHD,
+                           buf,
+                           sects * SectorSize,
+                           &BytesRead,
+                           SectorSize * (uint64)lba);
+if (sectsread)
+    *sectsread = BytesRead / SectorSize;
+return r;
+}
 
-if (SectorSize)
-    *SectorSize = NtoHl (hVHD->Footer.DriveSectorSize);
-if (xfer_element_size)
-    *xfer_element_size = NtoHl (hVHD->Footer.DriveTransferElementSize);
-if (sim_name)
-    memcpy (sim_name, hVHD->Footer.CreatingSimulator, 64);
-if (creation_time)
-    *creation_time = (time_t)NtoHl (hVHD->Footer.TimeStamp) + 946684800;
-return (char *)(&hVHD->Footer.DriveType[0]);
+static t_stat sim_vhd_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+{
+VHDHANDLE hVHD = (VHDHANDLE)uptr->fileref;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+
+return ReadVirtualDiskSectors(hVHD, buf, sects, sectsread, ctx->sector_size, lba);
 }
 
-static FILE *sim_vhd_disk_open (const char *szVHDPath, const char *DesiredAccess)
-    {
-    VHDHANDLE hVHD = (VHDHANDLE) calloc (1, sizeof(*hVHD));
-    int NeedUpdate = FALSE;
-    int Status;
+static t_stat sim_vhd_disk_clearerr (UNIT *uptr)
+{
+VHDHANDLE hVHD = (VHDHANDLE)uptr->fileref;
+
+clearerr (hVHD->File);
+return SCPE_OK;
+}
+
+static t_bool
+BufferIsZeros(void *Buffer, size_t BufferSize)
+{
+size_t i;
+char *c = (char *)Buffer;
+
+for (i=0; i<BufferSize; ++i)
+    if (c[i])
+        return FALSE;
+return TRUE;
+}
+
+/* Since a large VHD can have a pretty large BAT, and only one longword BAT
+   entry has changed, write just the aligned sector which contains it */
+
+static t_stat
+WriteVirtualDiskBATEntry(VHDHANDLE hVHD,
+                         uint32 BlockNumber)
+{
+uint8 *BATUpdateBufferAddress;
+uint32 BATUpdateBufferSize;
+uint64 BATUpdateStorageAddress;
+
+BATUpdateBufferAddress = (uint8 *)hVHD->BAT - (size_t)NtoHll(hVHD->Dynamic.TableOffset) +
+    (size_t)((((size_t)&hVHD->BAT[BlockNumber]) - (size_t)hVHD->BAT + (size_t)NtoHll(hVHD->Dynamic.TableOffset)) & ~(VHD_DATA_BLOCK_ALIGNMENT-1));
+/* If the starting of the BAT isn't on a VHD_DATA_BLOCK_ALIGNMENT boundary and we've just updated
+   a BAT entry early in the array, the buffer computed address might be before the start of the
+   BAT table.  If so, only write the BAT data needed */
+if (BATUpdateBufferAddress < (uint8 *)hVHD->BAT) {
+    BATUpdateBufferAddress = (uint8 *)hVHD->BAT;
+    BATUpdateBufferSize = (uint32)((((size_t)&hVHD->BAT[BlockNumber]) - (size_t)hVHD->BAT) + 512) & ~511;
+    BATUpdateStorageAddress = NtoHll(hVHD->Dynamic.TableOffset);
+    }
+else {
+    BATUpdateBufferSize = VHD_DATA_BLOCK_ALIGNMENT;
+    BATUpdateStorageAddress = NtoHll(hVHD->Dynamic.TableOffset) + BATUpdateBufferAddress - ((uint8 *)hVHD->BAT);
+    }
+/* If the total BAT is smaller than one VHD_DATA_BLOCK_ALIGNMENT, then be sure to only write out the BAT data */
+if ((size_t)(BATUpdateBufferAddress - (uint8 *)hVHD->BAT + BATUpdateBufferSize) > VHD_Internal_SectorSize * ((sizeof(*hVHD->BAT)*NtoHl(hVHD->Dynamic.MaxTableEntries) + VHD_Internal_SectorSize - 1)/VHD_Internal_SectorSize))
+    BATUpdateBufferSize = (uint32)(VHD_Internal_SectorSize * ((sizeof(*hVHD->BAT) * NtoHl(hVHD->Dynamic.MaxTableEntries) + VHD_Internal_SectorSize - 1)/VHD_Internal_SectorSize) - (BATUpdateBufferAddress - ((uint8 *)hVHD->BAT)));
+return WriteFilePosition(hVHD->File,
+                         BATUpdateBufferAddress,
+                         BATUpdateBufferSize,
+                         NULL,
+                         BATUpdateStorageAddress);
+}
+
+/* A write of zeros which leaves a whole block of a dynamic (not
+   differencing) VHD containing zeros releases the block: its BAT entry
+   is freed and its storage is punched out of the file where the host
+   allows.  Only a write which reaches the end of a block examines the
+   rest of it, so a disk being zeroed sequentially releases each block
+   as it goes. */
+
+static t_bool
+ReleaseVirtualDiskBlock(VHDHANDLE hVHD,
+                        uint32 BlockNumber,
+                        uint32 OffsetInBlock,
+                        uint32 BytesInWrite)
+{
+uint32 DynamicBlockSize = NtoHl(hVHD->Dynamic.BlockSize);
+uint32 BitMapBytes = _vhd_bitmap_sectors (hVHD) * VHD_Internal_SectorSize;
+uint64 BlockOffset = VHD_Internal_SectorSize * (uint64)NtoHl(hVHD->BAT[BlockNumber]);
+uint8 *Data;
+t_bool Zeros;
+
+if ((hVHD->Parent != NULL) || (OffsetInBlock + BytesInWrite != DynamicBlockSize))
+    return FALSE;
+if (OffsetInBlock > 0) {                    /* the rest of the block must be zeros too */
+    Data = (uint8 *)malloc (OffsetInBlock);
+    Zeros = ((Data != NULL) &&
+             (SCPE_OK == ReadFilePosition(hVHD->File, Data, OffsetInBlock, NULL, BlockOffset + BitMapBytes)) &&
+             BufferIsZeros(Data, OffsetInBlock));
+    free (Data);
+    if (!Zeros)
+        return FALSE;
+    }
+hVHD->BAT[BlockNumber] = VHD_BAT_FREE_ENTRY;
+if (WriteVirtualDiskBATEntry(hVHD, BlockNumber)) {
+    hVHD->BAT[BlockNumber] = NtoHl((uint32)(BlockOffset / VHD_Internal_SectorSize));
+    return FALSE;
+    }
+(void)_sim_disk_punch_file (hVHD->File, BlockOffset, BitMapBytes + DynamicBlockSize);
+return TRUE;
+}
+
+static t_stat
+WriteVirtualDisk(VHDHANDLE hVHD,
+                 uint8 *buf,
+                 uint32 BytesToWrite,
+                 uint32 *BytesWritten,
+                 uint64 Offset)
+{
+uint32 TotalBytesWritten = 0;
+uint32 BitMapBytes;
+uint32 BitMapSectors;
+uint32 DynamicBlockSize;
+t_stat r = SCPE_OK;
+
+if (BytesWritten)
+    *BytesWritten = 0;
+if (!hVHD || !hVHD->File) {
+    errno = EBADF;
+    return SCPE_IOERR;
+    }
+if (BytesToWrite == 0)
+    return SCPE_OK;
+if (Offset >= (uint64)NtoHll(hVHD->Footer.CurrentSize)) {
+    errno = ERANGE;
+    return SCPE_IOERR;
+    }
+if (NtoHl(hVHD->Footer.DiskType) == VHD_DT_Fixed) {
+    if (WriteFilePosition(hVHD->File,
+                          buf,
+                          BytesToWrite,
+                          BytesWritten,
+                          Offset))
+        r = SCPE_IOERR;
+    return r;
+    }
+/* We are now dealing with a Dynamically expanding or differencing disk */
+DynamicBlockSize = NtoHl (hVHD->Dynamic.BlockSize);
+if ((DynamicBlockSize == 0) ||
+    ((DynamicBlockSize & (DynamicBlockSize - 1)) != 0)) {
+    errno = ERANGE;
+    return SCPE_IOERR;
+    }
+BitMapBytes = (7 + (DynamicBlockSize / VHD_Internal_SectorSize)) / 8;
+BitMapSectors = (BitMapBytes + VHD_Internal_SectorSize - 1) / VHD_Internal_SectorSize;
+while (BytesToWrite && (r == SCPE_OK)) {
+    uint32 BlockNumber = (uint32)(Offset / DynamicBlockSize);
+    uint32 BytesInWrite = BytesToWrite;
+    uint32 BytesThisWrite = 0;
 
-    if (!hVHD)
-        return (FILE *)hVHD;
-    Status = GetVHDFooter (szVHDPath,
-                           &hVHD->Footer,
-                           &hVHD->Dynamic,
-                           &hVHD->BAT,
-                           NULL,
-                           hVHD->ParentVHDPath,
-                           sizeof (hVHD->ParentVHDPath));
-    if (Status)
-        goto Cleanup_Return;
-    if (NtoHl (hVHD->Footer.DiskType) == VHD_DT_Differencing) {
-        uint32 ParentModifiedTimeStamp;
-        VHD_Footer ParentFooter;
-        VHD_DynamicDiskHeader ParentDynamic;
+    if (BlockNumber >= NtoHl(hVHD->Dynamic.MaxTableEntries)) {
+        return SCPE_EOF;
+        }
+    if (BlockNumber != (Offset + BytesToWrite) / DynamicBlockSize)
+        BytesInWrite = (uint32)(((BlockNumber + 1) * DynamicBlockSize) - Offset);
+    if (hVHD->BAT[BlockNumber] == VHD_BAT_FREE_ENTRY) {
+        uint8 *BitMap = NULL;
+        uint32 BitMapBufferSize = VHD_DATA_BLOCK_ALIGNMENT;
+        uint8 *BitMapBuffer = NULL;
+        void *BlockData = NULL;
+        uint64 BlockOffset;
 
-        hVHD->Parent = (VHDHANDLE)sim_vhd_disk_open (hVHD->ParentVHDPath, "rb");
-        if (!hVHD->Parent) {
-            Status = errno;
-            goto Cleanup_Return;
+        if (!hVHD->Parent && BufferIsZeros(buf, BytesInWrite)) {
+            BytesThisWrite = BytesInWrite;
+            goto IO_Done;
             }
-        Status = GetVHDFooter (hVHD->ParentVHDPath,
-                               &ParentFooter,
-                               &ParentDynamic,
-                               NULL,
-                               &ParentModifiedTimeStamp,
-                               NULL,
-                               0);
-        if (Status)
-            goto Cleanup_Return;
-        if ((0 != memcmp (hVHD->Dynamic.ParentUniqueID, ParentFooter.UniqueID, sizeof (ParentFooter.UniqueID))) ||
-            (ParentModifiedTimeStamp != hVHD->Dynamic.ParentTimeStamp)) {
-            if (sim_switches & SWMASK ('O')) {                      /* OVERRIDE consistency checks? */
-                if ((sim_switches & SWMASK ('U')) &&                /* FIX (UPDATE) consistency checks AND */
-                    (strchr (DesiredAccess, '+'))) {                /* open for write/update? */
-                    memcpy (hVHD->Dynamic.ParentUniqueID, ParentFooter.UniqueID, sizeof (ParentFooter.UniqueID));
-                    hVHD->Dynamic.ParentTimeStamp = ParentModifiedTimeStamp;
-                    hVHD->Dynamic.Checksum = 0;
-                    hVHD->Dynamic.Checksum = NtoHl (CalculateVhdFooterChecksum (&hVHD->Dynamic, sizeof(hVHD->Dynamic)));
-                    NeedUpdate = TRUE;
-                    }
-                }
-            else {
-                Status = EBADF;
-                goto Cleanup_Return;
+        /* Need to allocate a new Data Block. */
+        BlockOffset = sim_fsize_ex (hVHD->File);
+        if (((int64)BlockOffset) == -1)
+            return SCPE_IOERR;
+        if ((BitMapSectors * VHD_Internal_SectorSize) > BitMapBufferSize)
+            BitMapBufferSize = BitMapSectors * VHD_Internal_SectorSize;
+        BitMapBuffer = (uint8 *)calloc(1, BitMapBufferSize + DynamicBlockSize);
+        if (BitMapBufferSize > BitMapSectors * VHD_Internal_SectorSize)
+            BitMap = BitMapBuffer + BitMapBufferSize - BitMapBytes;
+        else
+            BitMap = BitMapBuffer;
+        memset(BitMap, 0xFF, BitMapBytes);
+        BlockOffset -= sizeof(hVHD->Footer);
+        if (0 == (BlockOffset & (VHD_DATA_BLOCK_ALIGNMENT-1)))
+            {  // Already aligned, so use padded BitMapBuffer
+            if (WriteFilePosition(hVHD->File,
+                                  BitMapBuffer,
+                                  BitMapBufferSize + DynamicBlockSize,
+                                  NULL,
+                                  BlockOffset)) {
+                free (BitMapBuffer);
+                return SCPE_IOERR;
                 }
+            BlockOffset += BitMapBufferSize;
             }
-        }
-    if (hVHD->Footer.SavedState) {
-        Status = EAGAIN;                                /* Busy */
-        goto Cleanup_Return;
-        }
-    hVHD->File = sim_fopen (szVHDPath, DesiredAccess);
-    if (!hVHD->File) {
-        Status = errno;
-        goto Cleanup_Return;
-        }
-Cleanup_Return:
-    if (Status) {
-        sim_vhd_disk_close ((FILE *)hVHD);
-        hVHD = NULL;
-        }
-    else {
-        if (NeedUpdate) {                               /* Update Differencing Disk Header? */
+        else
+            {
+            // align the data portion of the block to the desired alignment
+            // compute the address of the data portion of the block
+            BlockOffset += BitMapSectors * VHD_Internal_SectorSize;
+            // round up this address to the desired alignment
+            BlockOffset += VHD_DATA_BLOCK_ALIGNMENT-1;
+            BlockOffset &= ~(VHD_DATA_BLOCK_ALIGNMENT - 1);
+            BlockOffset -= BitMapSectors * VHD_Internal_SectorSize;
             if (WriteFilePosition(hVHD->File,
-                                  &hVHD->Dynamic,
-                                  sizeof (hVHD->Dynamic),
+                                  BitMap,
+                                  (BitMapSectors * VHD_Internal_SectorSize) + DynamicBlockSize,
                                   NULL,
-                                  NtoHll (hVHD->Footer.DataOffset))) {
-                sim_vhd_disk_close ((FILE *)hVHD);
-                hVHD = NULL;
+                                  BlockOffset)) {
+                free (BitMapBuffer);
+                return SCPE_IOERR;
                 }
+            BlockOffset += BitMapSectors * VHD_Internal_SectorSize;
             }
-        }
-    errno = Status;
-    return (FILE *)hVHD;
-    }
-
-static t_stat
-WriteVirtualDiskSectors(VHDHANDLE hVHD,
-                        uint8 *buf,
-                        t_seccnt sects,
-                        t_seccnt *sectswritten,
-                        uint32 SectorSize,
-                        t_lba lba);
-
-static FILE *sim_vhd_disk_merge (const char *szVHDPath, char **ParentVHD)
-    {
-    VHDHANDLE hVHD = (VHDHANDLE) calloc (1, sizeof(*hVHD));
-    VHDHANDLE Parent = NULL;
-    int Status;
-    uint32 SectorSize, SectorsPerBlock, BlockSize, BlockNumber, BitMapBytes, BitMapSectors, BlocksToMerge, NeededBlock;
-    uint64 BlockOffset;
-    uint32 BytesRead;
-    t_seccnt SectorsWritten;
-    void *BlockData = NULL;
-
-    if (!hVHD)
-        return (FILE *)hVHD;
-    if (0 != (Status = GetVHDFooter (szVHDPath,
-                                     &hVHD->Footer,
-                                     &hVHD->Dynamic,
-                                     &hVHD->BAT,
-                                     NULL,
-                                     hVHD->ParentVHDPath,
-                                     sizeof (hVHD->ParentVHDPath))))
-        goto Cleanup_Return;
-    if (NtoHl (hVHD->Footer.DiskType) != VHD_DT_Differencing) {
-        Status = EINVAL;
-        goto Cleanup_Return;
-        }
-    if (hVHD->Footer.SavedState) {
-        Status = EAGAIN;                                /* Busy */
-        goto Cleanup_Return;
-        }
-    SectorSize = 512;
-    BlockSize = NtoHl (hVHD->Dynamic.BlockSize);
-    BlockData = malloc (BlockSize*SectorSize);
-    if (NULL == BlockData) {
-        Status = errno;
-        goto Cleanup_Return;
-        }
-    Parent = (VHDHANDLE)sim_vhd_disk_open (hVHD->ParentVHDPath, "rb+");
-    if (!Parent) {
-        Status = errno;
-        goto Cleanup_Return;
-        }
-    hVHD->File = sim_fopen (szVHDPath, "rb");
-    if (!hVHD->File) {
-        Status = errno;
-        goto Cleanup_Return;
-        }
-    SectorsPerBlock = NtoHl (hVHD->Dynamic.BlockSize)/SectorSize;
-    BitMapBytes = (7+(NtoHl (hVHD->Dynamic.BlockSize)/SectorSize))/8;
-    BitMapSectors = (BitMapBytes+SectorSize-1)/SectorSize;
-    for (BlockNumber=BlocksToMerge=0; BlockNumber< NtoHl (hVHD->Dynamic.MaxTableEntries); ++BlockNumber) {
-        if (hVHD->BAT[BlockNumber] == VHD_BAT_FREE_ENTRY)
-            continue;
-        ++BlocksToMerge;
-        }
-    sim_messagef (SCPE_OK, "Merging %s\ninto %s\n", szVHDPath, hVHD->ParentVHDPath);
-    for (BlockNumber=NeededBlock=0; BlockNumber < NtoHl (hVHD->Dynamic.MaxTableEntries); ++BlockNumber) {
-        uint32 BlockSectors = SectorsPerBlock;
-
-        if (hVHD->BAT[BlockNumber] == VHD_BAT_FREE_ENTRY)
-            continue;
-        ++NeededBlock;
-        BlockOffset = SectorSize*((uint64)(NtoHl (hVHD->BAT[BlockNumber]) + BitMapSectors));
-        if (((uint64)BlockNumber*SectorsPerBlock + BlockSectors) > ((uint64)NtoHll (hVHD->Footer.CurrentSize))/SectorSize)
-            BlockSectors = (uint32)(((uint64)NtoHll (hVHD->Footer.CurrentSize))/SectorSize - (BlockNumber*SectorsPerBlock));
-        if (ReadFilePosition(hVHD->File,
-                             BlockData,
-                             SectorSize*BlockSectors,
-                             &BytesRead,
-                             BlockOffset))
-            break;
-        if (WriteVirtualDiskSectors (Parent,
-                                     (uint8*)BlockData,
-                                     BlockSectors,
-                                     &SectorsWritten,
-                                     SectorSize,
-                                     SectorsPerBlock*BlockNumber))
-            break;
-        sim_messagef (SCPE_OK, "Merged %dMB.  %d%% complete.\r", (int)((((float)NeededBlock)*SectorsPerBlock)*SectorSize/1000000), (int)((((float)NeededBlock)*100)/BlocksToMerge));
-        hVHD->BAT[BlockNumber] = VHD_BAT_FREE_ENTRY;
-        }
-    if (BlockNumber < NtoHl (hVHD->Dynamic.MaxTableEntries)) {
-        Status = errno;
-        }
-    else {
-        Status = 0;
-        sim_messagef (SCPE_OK, "Merged %dMB.  100%% complete.\n", (int)((((float)NeededBlock)*SectorsPerBlock)*SectorSize/1000000));
-        fclose (hVHD->File);
-        hVHD->File = NULL;
-        (void)remove (szVHDPath);
-        *ParentVHD = (char*) malloc (strlen (hVHD->ParentVHDPath)+1);
-        strcpy (*ParentVHD, hVHD->ParentVHDPath);
-        }
-Cleanup_Return:
-    free (BlockData);
-    if (hVHD->File)
-        fclose (hVHD->File);
-    if (Status) {
-        free (hVHD->BAT);
-        free (hVHD);
-        hVHD = NULL;
-        sim_vhd_disk_close ((FILE *)Parent);
+        free(BitMapBuffer);
+        BitMapBuffer = BitMap = NULL;
+        /* the BAT block address is the beginning of the block bitmap */
+        BlockOffset -= BitMapSectors * VHD_Internal_SectorSize;
+        hVHD->BAT[BlockNumber] = NtoHl((uint32)(BlockOffset / VHD_Internal_SectorSize));
+        if (hVHD->Map) {
+            hVHD->Map[BlockNumber].Owner = hVHD;
+            hVHD->Map[BlockNumber].Offset = BlockOffset + (BitMapSectors * VHD_Internal_SectorSize);
+            }
+        BlockOffset += (BitMapSectors * VHD_Internal_SectorSize) + DynamicBlockSize;
+        if (WriteFilePosition(hVHD->File,
+                              &hVHD->Footer,
+                              sizeof(hVHD->Footer),
+                              NULL,
+                              BlockOffset))
+            goto Fatal_IO_Error;
+        if (WriteVirtualDiskBATEntry(hVHD, BlockNumber))
+            goto Fatal_IO_Error;
+        if (hVHD->Parent)
+            { /* Need to populate data block contents from parent VHD */
+            BlockData = malloc (NtoHl (hVHD->Dynamic.BlockSize));
+
+            if (ReadVirtualDisk(hVHD->Parent,
+                                (uint8*) BlockData,
+                                NtoHl (hVHD->Dynamic.BlockSize),
+                                NULL,
+                                (Offset / NtoHl (hVHD->Dynamic.BlockSize)) * NtoHl (hVHD->Dynamic.BlockSize)))
+                goto Fatal_IO_Error;
+            if (WriteVirtualDisk(hVHD,
+                                 (uint8*) BlockData,
+                                 NtoHl (hVHD->Dynamic.BlockSize),
+                                 NULL,
+                                 (Offset / NtoHl (hVHD->Dynamic.BlockSize)) * NtoHl (hVHD->Dynamic.BlockSize)))
+                goto Fatal_IO_Error;
+            free(BlockData);
+            }
+        continue;
+Fatal_IO_Error:
+        free (BitMap);
+        free (BlockData);
+        r = SCPE_IOERR;
         }
     else {
-        free (hVHD->BAT);
-        free (hVHD);
-        hVHD = Parent;
-        }
-    errno = Status;
-    return (FILE *)hVHD;
-    }
-
-static int sim_vhd_disk_close (FILE *f)
-{
-VHDHANDLE hVHD = (VHDHANDLE)f;
+        uint64 BlockOffset = VHD_Internal_SectorSize * ((uint64)(NtoHl(hVHD->BAT[BlockNumber]) + BitMapSectors)) + (Offset % DynamicBlockSize);
 
-if (NULL != hVHD) {
-    if (hVHD->Parent)
-        sim_vhd_disk_close ((FILE *)hVHD->Parent);
-    free (hVHD->BAT);
-    if (hVHD->File) {
-        fflush (hVHD->File);
-        fclose (hVHD->File);
+        if (BufferIsZeros(buf, BytesInWrite) &&
+            ReleaseVirtualDiskBlock(hVHD, BlockNumber, (uint32)(Offset % DynamicBlockSize), BytesInWrite)) {
+            BytesThisWrite = BytesInWrite;
+            goto IO_Done;
+            }
+        if (WriteFilePosition(hVHD->File,
+                              buf,
+                              BytesInWrite,
+                              &BytesThisWrite,
+                              BlockOffset))
+            r = SCPE_IOERR;
         }
-    free (hVHD);
-    return 0;
+IO_Done:
+    BytesToWrite -= BytesThisWrite;
+    buf = (uint8 *)(((char *)buf) + BytesThisWrite);
+    Offset += BytesThisWrite;
+    TotalBytesWritten += BytesThisWrite;
     }
-return -1;
+if (BytesWritten)
+    *BytesWritten = TotalBytesWritten;
+return r;
 }
 
-static void sim_vhd_disk_flush (FILE *f)
+static t_stat
+WriteVirtualDiskSectors(VHDHANDLE hVHD,
+                        uint8 *buf,
+                        t_seccnt sects,
+                        t_seccnt *sectswritten,
+                        uint32 SectorSize,
+                        t_lba lba)
 {
-VHDHANDLE hVHD = (VHDHANDLE)f;
+uint32 BytesWritten;
+t_stat r = WriteVirtualDisk(hVHD,
+                            buf,
+                            sects * SectorSize,
+                            &BytesWritten,
+                            SectorSize * (uint64)lba);
 
-if ((NULL != hVHD) && (hVHD->File))
-    fflush (hVHD->File);
+if (sectswritten)
+    *sectswritten = BytesWritten / SectorSize;
+return r;
 }
 
-static t_offset sim_vhd_disk_size (FILE *f)
+static t_stat sim_vhd_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
 {
-VHDHANDLE hVHD = (VHDHANDLE)f;
+VHDHANDLE hVHD = (VHDHANDLE)uptr->fileref;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
 
-return (t_offset)(NtoHll (hVHD->Footer.CurrentSize));
+return WriteVirtualDiskSectors(hVHD, buf, sects, sectswritten, ctx->sector_size, lba);
 }
+#endif
 
+/* OS Independent Deduplicated Disk Image (DDI) support
+
+   A DDI container holds the disk as fixed size chunks.  Each chunk is
+   stored once, compressed, and located through a chunk index which
+   follows the container header.  Chunks of zeros aren't stored at all,
+   and a chunk whose contents are already present in the container, or in
+   the shared chunk store it refers to, is stored by reference.
+
+   A chunk store may be shared by any number of containers (for example a
+   collection of system disks built from the same distribution).  Chunks
+   written by containers which refer to a store are added to the store.
+   Only one simulator at a time should attach writable containers which
+   use a given store.
+
+   Layout of a container:
+
+       header          512 bytes (struct ddi_header)
+       chunk index     ChunkCount big endian 64 bit record locations,
+                       padded to a multiple of 512 bytes
+       chunk records   struct ddi_record followed by the stored data
+
+   A chunk store has a header with the DDS signature followed by chunk
+   records.  A record location of 0 is a chunk of zeros and a location
+   with the high bit set refers to a record in the chunk store.
+
+   Rewritten chunks are appended; the space of the records they replace
+   isn't reclaimed until the container is copied to a new one.
+
+   Recently used chunks are kept decompressed in memory.  Writes modify
+   the cached chunk, which is stored when it is evicted or when the
+   container is flushed. */
+
+#define DDI_SIGNATURE       "SIMHDDI"
+#define DDS_SIGNATURE       "SIMHDDS"
+#define DDI_VERSION         1
+#define DDI_CHUNK_SIZE      65536                       /* default chunk size */
+#define DDI_CACHE_CHUNKS    32                          /* decompressed chunks kept in memory */
+#define DDI_LOC_STORE       (((t_uint64)1) << 63)       /* record is in the chunk store */
+#define DDI_REC_LZ          1                           /* record data is compressed */
+
+struct ddi_header {
+    uint8       Signature[8];
+    uint32      Version;
+    uint32      ChunkSize;
+    uint32      DiskSize[2];
+    uint32      ChunkCount;
+    uint32      SectorSize;
+    uint32      TransferElementSize;
+    uint32      CreationTime;
+    uint8       DriveType[16];
+    uint8       CreatingSimulator[64];
+    uint8       StorePath[256];                         /* relative to the container's directory */
+    uint8       Reserved[132];
+    uint32      Checksum;                               /* CRC32 of the preceding bytes */
+    };
 
-#include <stdlib.h>
-#include <time.h>
-static void
-_rand_uuid_gen (void *uuidaddr)
-{
-int i;
-uint8 *b = (uint8 *)uuidaddr;
-uint32 timenow = (uint32)time (NULL);
+struct ddi_record {
+    uint8       Signature[4];                           /* "CHNK" */
+    uint32      StoredSize;                             /* bytes of data following */
+    uint32      Flags;
+    uint32      Crc;                                    /* CRC32 of the chunk's contents */
+    uint32      Hash[2];                                /* content hash */
+    uint32      Reserved[2];
+    };
 
-memcpy (uuidaddr, &timenow, sizeof (timenow));
-srand ((unsigned)timenow);
-for (i=4; i<16; i++) {
-    b[i] = (uint8)rand();
-    }
-}
+/* Content hash table: record locations keyed by chunk content hash */
 
-#if defined (_WIN32)
-static void
-uuid_gen (void *uuidaddr)
-{
-static
-RPC_STATUS
-(RPC_ENTRY *UuidCreate_c) (void *);
+struct ddi_hash {
+    t_uint64    *key;
+    t_uint64    *loc;                                   /* 0 is an empty slot */
+    size_t      size;                                   /* power of 2 */
+    size_t      count;
+    };
 
-if (!UuidCreate_c) {
-    HINSTANCE hDll;
-    hDll = LoadLibraryA("rpcrt4.dll");
-    UuidCreate_c = (RPC_STATUS (RPC_ENTRY *) (void *))GetProcAddress(hDll, "UuidCreate");
-    }
-if (UuidCreate_c)
-    UuidCreate_c(uuidaddr);
-else
-    _rand_uuid_gen (uuidaddr);
-}
-#elif defined (SIM_HAVE_DLOPEN)
-#include <dlfcn.h>
+struct ddi_store {
+    char                *Path;
+    FILE                *File;
+    t_bool              Writable;
+    int                 Refs;
+    uint32              ChunkSize;
+    t_offset            End;                            /* where the next record goes */
+    struct ddi_hash     Hash;
+#if defined (SIM_ASYNCH_IO)
+    pthread_mutex_t     Lock;                           /* units' I/O threads share the store */
+#endif
+    struct ddi_store    *Next;
+    };
 
-static void
-uuid_gen (void *uuidaddr)
-{
-void (*uuid_generate_c) (void *) = NULL;
-void *handle;
+static struct ddi_store *ddi_stores = NULL;
 
-#define S__STR_QUOTE(tok) #tok
-#define S__STR(tok) S__STR_QUOTE(tok)
-    handle = dlopen("libuuid." S__STR(SIM_HAVE_DLOPEN), RTLD_NOW|RTLD_GLOBAL);
-    if (handle)
-        uuid_generate_c = (void (*)(void *))((size_t)dlsym(handle, "uuid_generate"));
-    if (uuid_generate_c)
-        uuid_generate_c(uuidaddr);
-    else
-        _rand_uuid_gen (uuidaddr);
-    if (handle)
-        dlclose(handle);
-}
+#if defined (SIM_ASYNCH_IO)
+#define DDI_STORE_LOCK(s)   pthread_mutex_lock (&(s)->Lock)
+#define DDI_STORE_UNLOCK(s) pthread_mutex_unlock (&(s)->Lock)
 #else
-static void
-uuid_gen (void *uuidaddr)
-{
-_rand_uuid_gen (uuidaddr);
-}
+#define DDI_STORE_LOCK(s)
+#define DDI_STORE_UNLOCK(s)
 #endif
 
-static VHDHANDLE
-sim_CreateVirtualDisk(const char *szVHDPath,
-                      uint32 SizeInSectors,
-                      uint32 BlockSize,
-                      t_bool bFixedVHD)
-{
-VHD_Footer Footer;
-VHD_DynamicDiskHeader Dynamic;
-uint32 *BAT = NULL;
-time_t now;
-uint32 i;
-FILE *File = NULL;
-uint32 Status = 0;
-uint32 BytesPerSector = 512;
-uint64 SizeInBytes = ((uint64)SizeInSectors) * BytesPerSector;
-uint64 TableOffset;
-uint32 MaxTableEntries;
-VHDHANDLE hVHD = NULL;
-
-if (SizeInBytes > ((uint64)(1024 * 1024 * 1024)) * 2040) {
-    Status = EFBIG;
-    goto Cleanup_Return;
-    }
-File = sim_fopen (szVHDPath, "rb");
-if (File) {
-    fclose (File);
-    File = NULL;
-    Status = EEXIST;
-    goto Cleanup_Return;
-    }
-File = sim_fopen (szVHDPath, "wb");
-if (!File) {
-    Status = errno;
-    goto Cleanup_Return;
-    }
-
-memset (&Footer, 0, sizeof(Footer));
-memcpy (Footer.Cookie, "conectix", 8);
-Footer.Features = NtoHl (0x00000002);;
-Footer.FileFormatVersion = NtoHl (0x00010000);;
-Footer.DataOffset = NtoHll (bFixedVHD ? ((long long)-1) : (long long)(sizeof(Footer)));
-time (&now);
-Footer.TimeStamp = NtoHl ((uint32)(now - 946684800));
-memcpy (Footer.CreatorApplication, "simh", 4);
-Footer.CreatorVersion = NtoHl (0x00040000);
-memcpy (Footer.CreatorHostOS, "Wi2k", 4);
-Footer.OriginalSize = NtoHll (SizeInBytes);
-Footer.CurrentSize = NtoHll (SizeInBytes);
-uuid_gen (Footer.UniqueID);
-Footer.DiskType = NtoHl (bFixedVHD ? VHD_DT_Fixed : VHD_DT_Dynamic);
-Footer.DiskGeometry = NtoHl (0xFFFF10FF);
-if (1) { /* CHS Calculation */
-    uint32 totalSectors = (uint32)(SizeInBytes/BytesPerSector);/* Total data sectors present in the disk image */
-    uint32 cylinders;                                          /* Number of cylinders present on the disk */
-    uint32 heads;                                              /* Number of heads present on the disk */
-    uint32 sectorsPerTrack;                                    /* Sectors per track on the disk */
-    uint32 cylinderTimesHeads;                                 /* Cylinders x heads */
-
-    if (totalSectors > 65535 * 16 * 255)
-        totalSectors = 65535 * 16 * 255;
-
-    if (totalSectors >= 65535 * 16 * 63) {
-        sectorsPerTrack = 255;
-        heads = 16;
-        cylinderTimesHeads = totalSectors / sectorsPerTrack;
-        }
-    else {
-        sectorsPerTrack = 17;
-        cylinderTimesHeads = totalSectors / sectorsPerTrack;
-
-        heads = (cylinderTimesHeads + 1023) / 1024;
+struct ddi_chunk {
+    uint32      Chunk;
+    t_bool      Valid;
+    t_bool      Dirty;
+    uint32      Used;                                   /* LRU stamp */
+    uint8       *Data;
+    };
 
-        if (heads < 4)
-            heads = 4;
-        if (cylinderTimesHeads >= (heads * 1024) || heads > 16)
-            {
-            sectorsPerTrack = 31;
-            heads = 16;
-            cylinderTimesHeads = totalSectors / sectorsPerTrack;
-            }
-        if (cylinderTimesHeads >= (heads * 1024))
-            {
-            sectorsPerTrack = 63;
-            heads = 16;
-            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+typedef struct DDI_Handle {
+    FILE                *File;
+    t_bool              Writable;
+    struct ddi_header   Header;
+    char                *Path;
+    uint32              ChunkSize;
+    uint32              ChunkCount;
+    t_offset            DiskSize;
+    t_uint64            *Index;
+    t_bool              IndexDirty;
+    t_offset            DataStart;                      /* first chunk record */
+    t_offset            End;                            /* where the next record goes */
+    struct ddi_hash     Hash;                           /* records in this container */
+    struct ddi_store    *Store;
+    struct ddi_chunk    Cache[DDI_CACHE_CHUNKS];
+    uint32              Clock;
+    uint8               *CacheData;
+    uint8               *Work;                          /* stored form of a record */
+    uint8               *Compare;                       /* deduplication candidate */
+    } *DDIHANDLE;
+
+/* Chunk compression
+
+   A small LZ77 coder with an 8KB window.  The stored form is a sequence
+   of items, each starting with a control byte:
+
+       000nnnnn                    n+1 literal bytes follow
+       lllooooo oooooooo           copy l+2 bytes from o+1 bytes back (l 1-6)
+       111ooooo llllllll oooooooo  copy l+9 bytes from o+1 bytes back
+
+   Decompression is a simple copy loop, so reads of compressed chunks
+   stay cheap. */
+
+#define DDI_LZ_HASH_BITS    13
+#define DDI_LZ_MAX_LIT      32
+#define DDI_LZ_MAX_OFF      8192
+#define DDI_LZ_MAX_LEN      264
+
+/* Returns the compressed size, or 0 if it would exceed out_len */
+
+static size_t _ddi_lz_compress (const uint8 *in, size_t in_len, uint8 *out, size_t out_len)
+{
+uint32 htab[1 << DDI_LZ_HASH_BITS];
+const uint8 *ip = in;
+const uint8 *in_end = in + in_len;
+uint8 *op = out;
+uint8 *out_end = out + out_len;
+uint8 *lit_ctl = NULL;                                  /* control byte of the current literal run */
+
+memset (htab, 0, sizeof (htab));
+while (ip < in_end) {
+    if (ip + 3 <= in_end) {
+        uint32 h = ((((uint32)ip[0] << 16) | ((uint32)ip[1] << 8) | ip[2]) * 2654435761u) >> (32 - DDI_LZ_HASH_BITS);
+        const uint8 *ref = htab[h] ? in + htab[h] - 1 : NULL;
+        size_t off = 0;
+
+        htab[h] = (uint32)(ip - in) + 1;
+        if (ref)
+            off = (size_t)(ip - ref) - 1;
+        if (ref && (off < DDI_LZ_MAX_OFF) &&
+            (ref[0] == ip[0]) && (ref[1] == ip[1]) && (ref[2] == ip[2])) {
+            size_t len = 3;
+            size_t max = (size_t)(in_end - ip);
+
+            if (max > DDI_LZ_MAX_LEN)
+                max = DDI_LZ_MAX_LEN;
+            while ((len < max) && (ref[len] == ip[len]))
+                ++len;
+            if (op + 3 > out_end)
+                return 0;
+            lit_ctl = NULL;                             /* a reference ends a literal run */
+            ip += len;
+            len -= 2;
+            if (len < 7)
+                *op++ = (uint8)((len << 5) | (off >> 8));
+            else {
+                *op++ = (uint8)((7 << 5) | (off >> 8));
+                *op++ = (uint8)(len - 7);
+                }
+            *op++ = (uint8)(off & 0xFF);
+            continue;
             }
         }
-    cylinders = (totalSectors + sectorsPerTrack * heads - 1) / (sectorsPerTrack * heads);
-    Footer.DiskGeometry = NtoHl ((cylinders<<16)|(heads<<8)|sectorsPerTrack);
+    if (lit_ctl == NULL) {                              /* start a literal run */
+        if (op + 2 > out_end)
+            return 0;
+        lit_ctl = op++;
+        *lit_ctl = 0;
+        }
+    else {
+        if (op + 1 > out_end)
+            return 0;
+        ++*lit_ctl;
+        }
+    *op++ = *ip++;
+    if (*lit_ctl == DDI_LZ_MAX_LIT - 1)
+        lit_ctl = NULL;
     }
-Footer.Checksum = NtoHl (CalculateVhdFooterChecksum(&Footer, sizeof(Footer)));
+return (size_t)(op - out);
+}
 
-if (bFixedVHD) {
-    if (WriteFilePosition(File,
-                          &Footer,
-                          sizeof(Footer),
-                          NULL,
-                          SizeInBytes))
-        Status = errno;
-    goto Cleanup_Return;
-    }
+/* Returns the decompressed size, or 0 if the data is malformed */
 
-/* Dynamic Disk */
-memset (&Dynamic, 0, sizeof(Dynamic));
-memcpy (Dynamic.Cookie, "cxsparse", 8);
-Dynamic.DataOffset = NtoHll ((uint64)0xFFFFFFFFFFFFFFFFLL);
-TableOffset = NtoHll(Footer.DataOffset)+sizeof(Dynamic);
-Dynamic.TableOffset = NtoHll (TableOffset);
-Dynamic.HeaderVersion = NtoHl (0x00010000);
-if (0 == BlockSize)
-    BlockSize = 2*1024*1024;
-Dynamic.BlockSize = NtoHl (BlockSize);
-MaxTableEntries = (uint32)((SizeInBytes+BlockSize-1)/BlockSize);
-Dynamic.MaxTableEntries = NtoHl (MaxTableEntries);
-Dynamic.Checksum = NtoHl (CalculateVhdFooterChecksum(&Dynamic, sizeof(Dynamic)));
-BAT = (uint32*) malloc (BytesPerSector*((MaxTableEntries*sizeof(*BAT)+BytesPerSector-1)/BytesPerSector));
-memset (BAT, 0, BytesPerSector*((MaxTableEntries*sizeof(*BAT)+BytesPerSector-1)/BytesPerSector));
-for (i=0; i<MaxTableEntries; ++i)
-    BAT[i] = VHD_BAT_FREE_ENTRY;
+static size_t _ddi_lz_decompress (const uint8 *in, size_t in_len, uint8 *out, size_t out_len)
+{
+const uint8 *ip = in;
+const uint8 *in_end = in + in_len;
+uint8 *op = out;
+uint8 *out_end = out + out_len;
 
-if (WriteFilePosition(File,
-                      &Footer,
-                      sizeof(Footer),
-                      NULL,
-                      0)) {
-    Status = errno;
-    goto Cleanup_Return;
-    }
-if (WriteFilePosition(File,
-                      &Dynamic,
-                      sizeof(Dynamic),
-                      NULL,
-                      NtoHll(Footer.DataOffset))) {
-    Status = errno;
-    goto Cleanup_Return;
-    }
-if (WriteFilePosition(File,
-                      BAT,
-                      BytesPerSector*((MaxTableEntries*sizeof(*BAT)+BytesPerSector-1)/BytesPerSector),
-                      NULL,
-                      NtoHll(Dynamic.TableOffset))) {
-    Status = errno;
-    goto Cleanup_Return;
-    }
-if (WriteFilePosition(File,
-                      &Footer,
-                      sizeof(Footer),
-                      NULL,
-                      NtoHll(Dynamic.TableOffset)+BytesPerSector*((MaxTableEntries*sizeof(*BAT)+BytesPerSector-1)/BytesPerSector))) {
-    Status = errno;
-    goto Cleanup_Return;
-    }
+while (ip < in_end) {
+    uint32 ctl = *ip++;
 
-Cleanup_Return:
-free (BAT);
-if (File)
-    fclose (File);
-if (Status) {
-    if (Status != EEXIST)
-        (void)remove (szVHDPath);
+    if (ctl < DDI_LZ_MAX_LIT) {                         /* literal run */
+        size_t n = ctl + 1;
+
+        if ((n > (size_t)(in_end - ip)) || (n > (size_t)(out_end - op)))
+            return 0;
+        memcpy (op, ip, n);
+        op += n;
+        ip += n;
+        }
+    else {                                              /* back reference */
+        size_t len = ctl >> 5;
+        size_t off;
+        const uint8 *ref;
+
+        if (len == 7) {
+            if (ip >= in_end)
+                return 0;
+            len += *ip++;
+            }
+        if (ip >= in_end)
+            return 0;
+        off = (((size_t)(ctl & 0x1F)) << 8) + *ip++ + 1;
+        len += 2;
+        if ((off > (size_t)(op - out)) || (len > (size_t)(out_end - op)))
+            return 0;
+        for (ref = op - off; len > 0; --len)            /* may overlap */
+            *op++ = *ref++;
+        }
     }
-else {
-    hVHD = (VHDHANDLE)sim_vhd_disk_open (szVHDPath, "rb+");
-    if (!hVHD)
-        Status = errno;
+return (size_t)(op - out);
+}
+
+static t_uint64 _ddi_content_hash (const uint8 *data, size_t len)
+{
+t_uint64 h = (((t_uint64)0xCBF29CE4) << 32) | 0x84222325;
+const t_uint64 prime = (((t_uint64)0x00000100) << 32) | 0x000001B3;
+size_t i;
+
+for (i = 0; i + 8 <= len; i += 8) {
+    t_uint64 w = ((t_uint64)data[i])           | (((t_uint64)data[i + 1]) << 8)  |
+                 (((t_uint64)data[i + 2]) << 16) | (((t_uint64)data[i + 3]) << 24) |
+                 (((t_uint64)data[i + 4]) << 32) | (((t_uint64)data[i + 5]) << 40) |
+                 (((t_uint64)data[i + 6]) << 48) | (((t_uint64)data[i + 7]) << 56);
+
+    h = (h ^ w) * prime;
+    h ^= h >> 29;
     }
-errno = Status;
-return hVHD;
+for (; i < len; i++)
+    h = (h ^ data[i]) * prime;
+return h;
 }
 
-#if defined(__CYGWIN__) || defined(VMS) || defined(__APPLE__) || defined(__linux) || defined(__linux__) || defined(__unix__)
-#include <unistd.h>
-#endif
-static void
-ExpandToFullPath (const char *szFileSpec,
-                  char *szFullFileSpecBuffer,
-                  size_t BufferSize)
+static t_bool _ddi_is_zero (const uint8 *data, size_t len)
 {
-char *c;
-#ifdef _WIN32
-for (c = strchr (szFullFileSpecBuffer, '/'); c; c = strchr (szFullFileSpecBuffer, '/'))
-    *c = '\\';
-GetFullPathNameA (szFileSpec, (DWORD)BufferSize, szFullFileSpecBuffer, NULL);
-for (c = strchr (szFullFileSpecBuffer, '\\'); c; c = strchr (szFullFileSpecBuffer, '\\'))
-    *c = '/';
-#else
-char buffer[PATH_MAX];
-char *wd = getcwd(buffer, PATH_MAX);
+size_t i;
 
-if ((szFileSpec[0] != '/') || (strchr (szFileSpec, ':')))
-    snprintf (szFullFileSpecBuffer, BufferSize, "%s/%s", wd, szFileSpec);
-else
-    strlcpy (szFullFileSpecBuffer, szFileSpec, BufferSize);
-if ((c = strstr (szFullFileSpecBuffer, "]/")))
-    memmove (c+1, c+2, strlen(c+2)+1);
-memset (szFullFileSpecBuffer + strlen (szFullFileSpecBuffer), 0, BufferSize - strlen (szFullFileSpecBuffer));
-#endif
+for (i = 0; i < len; i++)
+    if (data[i])
+        return FALSE;
+return TRUE;
 }
 
-static char *
-HostPathToVhdPath (const char *szHostPath,
-                   char *szVhdPath,
-                   size_t VhdPathSize)
+static void _ddi_put64 (uint32 *dst, t_uint64 val)
 {
-char *c, *d;
+dst[0] = NtoHl ((uint32)(val >> 32));
+dst[1] = NtoHl ((uint32)(val & 0xFFFFFFFF));
+}
 
-memset (szVhdPath, 0, VhdPathSize);
-strlcpy (szVhdPath, szHostPath, VhdPathSize-1);
-if ((szVhdPath[1] == ':') && islower(szVhdPath[0]))
-    szVhdPath[0] = toupper(szVhdPath[0]);
-szVhdPath[VhdPathSize-1] = '\0';
-if ((c = strrchr (szVhdPath, ']'))) {
-    *c = '\0';
-    if (!(d = strchr (szVhdPath, '[')))
-        return d;
-    *d = '/';
-    while ((d = strchr (d, '.')))
-        *d = '/';
-    *c = '/';
-    }
-while ((c = strchr (szVhdPath, '/')))
-    *c = '\\';
-for (c = strstr (szVhdPath, "\\.\\"); c; c = strstr (szVhdPath, "\\.\\"))
-    memmove (c, c+2, strlen(c+2)+1);
-for (c = strstr (szVhdPath, "\\\\"); c; c = strstr (szVhdPath, "\\\\"))
-    memmove (c, c+1, strlen(c+1)+1);
-while ((c = strstr (szVhdPath, "\\..\\"))) {
-    *c = '\0';
-    d = strrchr (szVhdPath, '\\');
-    if (d)
-        memmove (d, c+3, strlen(c+3)+1);
-    else
-        return d;
-    }
-memset (szVhdPath + strlen (szVhdPath), 0, VhdPathSize - strlen (szVhdPath));
-return szVhdPath;
+static t_uint64 _ddi_get64 (const uint32 *src)
+{
+return (((t_uint64)NtoHl (src[0])) << 32) | ((t_uint64)NtoHl (src[1]));
 }
 
-static char *
-VhdPathToHostPath (const char *szVhdPath,
-                   char *szHostPath,
-                   size_t HostPathSize)
+static void _ddi_hash_insert (struct ddi_hash *h, t_uint64 key, t_uint64 loc)
 {
-char *c;
-char *d = szHostPath;
+size_t i;
 
-memmove (szHostPath, szVhdPath, HostPathSize);
-szHostPath[HostPathSize-1] = '\0';
-#if defined(VMS)
-c = strchr (szHostPath, ':');
-if (*(c+1) != '\\')
-    return NULL;
-*(c+1) = '[';
-d = strrchr (c+2, '\\');
-if (d) {
-    *d = ']';
-    while ((d = strrchr (c+2, '\\')))
-        *d = '.';
+for (i = (size_t)key & (h->size - 1); h->loc[i] != 0; i = (i + 1) & (h->size - 1))
+    if ((h->key[i] == key) && (h->loc[i] == loc))
+        return;
+h->key[i] = key;
+h->loc[i] = loc;
+++h->count;
+}
+
+static t_stat _ddi_hash_add (struct ddi_hash *h, t_uint64 key, t_uint64 loc)
+{
+if (2 * (h->count + 1) > h->size) {                     /* grow to keep probes short */
+    struct ddi_hash n;
+    size_t i;
+
+    n.size = h->size ? 2 * h->size : 1024;
+    n.count = 0;
+    n.key = (t_uint64 *)calloc (n.size, sizeof (*n.key));
+    n.loc = (t_uint64 *)calloc (n.size, sizeof (*n.loc));
+    if ((n.key == NULL) || (n.loc == NULL)) {
+        free (n.key);
+        free (n.loc);
+        return SCPE_MEM;
+        }
+    for (i = 0; i < h->size; i++)
+        if (h->loc[i])
+            _ddi_hash_insert (&n, h->key[i], h->loc[i]);
+    free (h->key);
+    free (h->loc);
+    *h = n;
+    }
+_ddi_hash_insert (h, key, loc);
+return SCPE_OK;
+}
+
+static void _ddi_hash_free (struct ddi_hash *h)
+{
+free (h->key);
+free (h->loc);
+memset (h, 0, sizeof (*h));
+}
+
+/* Collect up to max record locations whose content hash is key */
+
+static int _ddi_hash_find (const struct ddi_hash *h, t_uint64 key, t_uint64 *locs, int max)
+{
+size_t i;
+int n = 0;
+
+if (h->size == 0)
+    return 0;
+for (i = (size_t)key & (h->size - 1); (h->loc[i] != 0) && (n < max); i = (i + 1) & (h->size - 1))
+    if (h->key[i] == key)
+        locs[n++] = h->loc[i];
+return n;
+}
+
+/* Add the records found from pos onward to a hash table.  Returns the
+   end of the last complete record, which is where the next one goes. */
+
+static t_offset _ddi_scan_records (FILE *File, t_offset pos, struct ddi_hash *h, t_uint64 tag)
+{
+t_offset end = sim_fsize_ex (File);
+struct ddi_record rec;
+
+while ((end != (t_offset)-1) && (pos + (t_offset)sizeof (rec) <= end)) {
+    t_offset next;
+
+    if ((sim_fseeko (File, pos, SEEK_SET) != 0) ||
+        (1 != fread (&rec, sizeof (rec), 1, File)) ||
+        (memcmp (rec.Signature, "CHNK", 4) != 0))
+        break;
+    next = pos + sizeof (rec) + NtoHl (rec.StoredSize);
+    if (next > end)                                     /* incomplete final record */
+        break;
+    if (_ddi_hash_add (h, _ddi_get64 (rec.Hash), pos | tag) != SCPE_OK)
+        break;
+    pos = next;
     }
-else
-    return NULL;
-#else
-while ((c = strchr (d, '\\')))
-    *c = '/';
-#endif
-memset (szHostPath + strlen (szHostPath), 0, HostPathSize - strlen (szHostPath));
-return szHostPath;
+return pos;
 }
 
-static VHDHANDLE
-CreateDifferencingVirtualDisk(const char *szVHDPath,
-                              const char *szParentVHDPath)
+static t_bool _ddi_header_valid (const struct ddi_header *h, const char *signature)
 {
-uint32 BytesPerSector = 512;
-VHDHANDLE hVHD = NULL;
-VHD_Footer ParentFooter;
-VHD_DynamicDiskHeader ParentDynamic;
-uint32 ParentTimeStamp;
-uint32 Status = 0;
-char *RelativeParentVHDPath = NULL;
-char *FullParentVHDPath = NULL;
-char *RelativeParentVHDPathUnicode = NULL;
-char *FullParentVHDPathUnicode = NULL;
-char *FullVHDPath = NULL;
-char *TempPath = NULL;
-size_t i, RelativeMatch, UpDirectories, LocatorsWritten = 0;
-int64 LocatorPosition;
+uint32 chunk_size = NtoHl (h->ChunkSize);
 
-if ((Status = GetVHDFooter (szParentVHDPath,
-                            &ParentFooter,
-                            &ParentDynamic,
-                            NULL,
-                            &ParentTimeStamp,
-                            NULL,
-                            0)))
-    goto Cleanup_Return;
-hVHD = sim_CreateVirtualDisk (szVHDPath,
-                              (uint32)(NtoHll(ParentFooter.CurrentSize)/BytesPerSector),
-                              NtoHl(ParentDynamic.BlockSize),
-                              FALSE);
-if (!hVHD) {
-    Status = errno;
-    goto Cleanup_Return;
+return ((memcmp (h->Signature, signature, sizeof (h->Signature)) == 0) &&
+        (NtoHl (h->Version) == DDI_VERSION) &&
+        (chunk_size >= 4096) && (chunk_size <= 1024*1024) && ((chunk_size & 511) == 0) &&
+        (NtoHl (h->Checksum) == eth_crc32 (0, h, sizeof (*h) - sizeof (h->Checksum))));
+}
+
+static void _ddi_header_checksum (struct ddi_header *h)
+{
+h->Checksum = NtoHl (eth_crc32 (0, h, sizeof (*h) - sizeof (h->Checksum)));
+}
+
+/* Open (or create) a chunk store, or share one already open */
+
+static struct ddi_store *_ddi_store_open (const char *container, const char *store, uint32 chunk_size, t_bool writable)
+{
+struct ddi_store *s;
+struct ddi_header h;
+char *path;
+
+if ((store[0] == '/') || (store[0] == '\\') || (store[1] == ':'))
+    path = strdup (store);
+else {                                                  /* relative to the container */
+    char *dir = sim_filepath_parts (container, "p");
+    size_t size;
+
+    if (dir == NULL)
+        return NULL;
+    size = strlen (dir) + strlen (store) + 1;
+    path = (char *)malloc (size);
+    if (path != NULL) {
+        strlcpy (path, dir, size);
+        strlcat (path, store, size);
+        }
+    free (dir);
+    }
+if (path == NULL)
+    return NULL;
+for (s = ddi_stores; s != NULL; s = s->Next)
+    if (strcmp (s->Path, path) == 0) {
+        free (path);
+        if (s->ChunkSize != chunk_size)
+            return NULL;
+        ++s->Refs;
+        return s;
+        }
+s = (struct ddi_store *)calloc (1, sizeof (*s));
+if (s == NULL) {
+    free (path);
+    return NULL;
+    }
+s->Path = path;
+s->Writable = writable;
+s->File = writable ? sim_fopen (path, "rb+") : NULL;
+if ((s->File == NULL) && writable && (errno == ENOENT)) {
+    s->File = sim_fopen (path, "wb+");                  /* new store */
+    if (s->File != NULL) {
+        memset (&h, 0, sizeof (h));
+        memcpy (h.Signature, DDS_SIGNATURE, sizeof (h.Signature));
+        h.Version = NtoHl (DDI_VERSION);
+        h.ChunkSize = NtoHl (chunk_size);
+        h.CreationTime = NtoHl ((uint32)time (NULL));
+        strlcpy ((char *)h.CreatingSimulator, sim_name, sizeof (h.CreatingSimulator));
+        _ddi_header_checksum (&h);
+        if ((1 != fwrite (&h, sizeof (h), 1, s->File)) || fflush (s->File)) {
+            fclose (s->File);
+            s->File = NULL;
+            }
+        }
     }
-LocatorPosition = ((sizeof (hVHD->Footer) + BytesPerSector - 1)/BytesPerSector + (sizeof (hVHD->Dynamic) + BytesPerSector - 1)/BytesPerSector)*BytesPerSector;
-hVHD->Dynamic.Checksum = 0;
-RelativeParentVHDPath = (char*) calloc (1, BytesPerSector+2);
-FullParentVHDPath = (char*) calloc (1, BytesPerSector+2);
-RelativeParentVHDPathUnicode = (char*) calloc (1, BytesPerSector+2);
-FullParentVHDPathUnicode = (char*) calloc (1, BytesPerSector+2);
-FullVHDPath = (char*) calloc (1, BytesPerSector+2);
-TempPath = (char*) calloc (1, BytesPerSector+2);
-ExpandToFullPath (szParentVHDPath, TempPath, BytesPerSector);
-HostPathToVhdPath (TempPath, FullParentVHDPath, BytesPerSector);
-for (i=0; i < strlen (FullParentVHDPath); i++)
-    hVHD->Dynamic.ParentUnicodeName[i*2+1] = FullParentVHDPath[i];  /* Big Endian Unicode */
-for (i=0; i < strlen (FullParentVHDPath); i++)
-    FullParentVHDPathUnicode[i*2] = FullParentVHDPath[i];           /* Little Endian Unicode */
-ExpandToFullPath (szVHDPath, TempPath, BytesPerSector);
-HostPathToVhdPath (TempPath, FullVHDPath, BytesPerSector);
-for (i=0, RelativeMatch=UpDirectories=0; i<strlen(FullVHDPath); i++)
-    if (FullVHDPath[i] == '\\') {
-        if (memcmp (FullVHDPath, FullParentVHDPath, i+1))
-            ++UpDirectories;
-        else
-            RelativeMatch = i;
+if (s->File == NULL) {
+    s->Writable = FALSE;
+    s->File = sim_fopen (path, "rb");
+    }
+if ((s->File == NULL) ||
+    (sim_fseeko (s->File, 0, SEEK_SET) != 0) ||
+    (1 != fread (&h, sizeof (h), 1, s->File)) ||
+    (!_ddi_header_valid (&h, DDS_SIGNATURE)) ||
+    (NtoHl (h.ChunkSize) != chunk_size)) {
+    if (s->File)
+        fclose (s->File);
+    free (s->Path);
+    free (s);
+    return NULL;
+    }
+s->ChunkSize = chunk_size;
+s->End = _ddi_scan_records (s->File, sizeof (h), &s->Hash, DDI_LOC_STORE);
+s->Refs = 1;
+#if defined (SIM_ASYNCH_IO)
+pthread_mutex_init (&s->Lock, NULL);
+#endif
+s->Next = ddi_stores;
+ddi_stores = s;
+return s;
+}
+
+static void _ddi_store_release (struct ddi_store *s)
+{
+struct ddi_store **sp;
+
+if ((s == NULL) || (--s->Refs > 0))
+    return;
+for (sp = &ddi_stores; *sp != NULL; sp = &(*sp)->Next)
+    if (*sp == s) {
+        *sp = s->Next;
+        break;
         }
-if (RelativeMatch) {
-    char UpDir[4] = "..\\";
+fclose (s->File);
+_ddi_hash_free (&s->Hash);
+#if defined (SIM_ASYNCH_IO)
+pthread_mutex_destroy (&s->Lock);
+#endif
+free (s->Path);
+free (s);
+}
 
-    UpDir[2] = FullParentVHDPath[RelativeMatch];
-    if (UpDirectories)
-        for (i=0; i<UpDirectories; i++)
-            strcpy (RelativeParentVHDPath+strlen (RelativeParentVHDPath), UpDir);
-    else
-        strcpy (RelativeParentVHDPath+strlen (RelativeParentVHDPath), UpDir+1);
-    strcpy (RelativeParentVHDPath+strlen (RelativeParentVHDPath), &FullParentVHDPath[RelativeMatch+1]);
+/* Read a record and produce the chunk contents it holds */
+
+static t_stat _ddi_read_record (DDIHANDLE hDDI, t_uint64 loc, uint8 *data)
+{
+struct ddi_store *s = (loc & DDI_LOC_STORE) ? hDDI->Store : NULL;
+FILE *File = s ? s->File : hDDI->File;
+struct ddi_record rec;
+uint32 stored, flags = 0;
+t_stat r = SCPE_OK;
+
+if ((loc & DDI_LOC_STORE) && (s == NULL))
+    return SCPE_IOERR;                                  /* store is unavailable */
+if (s)
+    DDI_STORE_LOCK (s);
+if ((sim_fseeko (File, (t_offset)(loc & ~DDI_LOC_STORE), SEEK_SET) != 0) ||
+    (1 != fread (&rec, sizeof (rec), 1, File)) ||
+    (memcmp (rec.Signature, "CHNK", 4) != 0) ||
+    ((stored = NtoHl (rec.StoredSize)) > hDDI->ChunkSize) ||
+    (stored != fread (((flags = NtoHl (rec.Flags)) & DDI_REC_LZ) ? hDDI->Work : data, 1, stored, File)))
+    r = SCPE_IOERR;
+if (s)
+    DDI_STORE_UNLOCK (s);
+if (r != SCPE_OK)
+    return r;
+if (flags & DDI_REC_LZ) {
+    if (_ddi_lz_decompress (hDDI->Work, stored, data, hDDI->ChunkSize) != hDDI->ChunkSize)
+        return SCPE_IOERR;
     }
-for (i=0; i < strlen(RelativeParentVHDPath); i++)
-    RelativeParentVHDPathUnicode[i*2] = RelativeParentVHDPath[i];
-hVHD->Dynamic.ParentTimeStamp = ParentTimeStamp;
-memcpy (hVHD->Dynamic.ParentUniqueID, ParentFooter.UniqueID, sizeof (hVHD->Dynamic.ParentUniqueID));
-/* There are two potential parent locators on current vhds */
-memcpy (hVHD->Dynamic.ParentLocatorEntries[0].PlatformCode, "W2ku", 4);
-hVHD->Dynamic.ParentLocatorEntries[0].PlatformDataSpace = NtoHl (BytesPerSector);
-hVHD->Dynamic.ParentLocatorEntries[0].PlatformDataLength = NtoHl ((uint32)(2*strlen(FullParentVHDPath)));
-hVHD->Dynamic.ParentLocatorEntries[0].Reserved = 0;
-hVHD->Dynamic.ParentLocatorEntries[0].PlatformDataOffset = NtoHll (LocatorPosition+LocatorsWritten*BytesPerSector);
-++LocatorsWritten;
-if (RelativeMatch) {
-    memcpy (hVHD->Dynamic.ParentLocatorEntries[1].PlatformCode, "W2ru", 4);
-    hVHD->Dynamic.ParentLocatorEntries[1].PlatformDataSpace = NtoHl (BytesPerSector);
-    hVHD->Dynamic.ParentLocatorEntries[1].PlatformDataLength = NtoHl ((uint32)(2*strlen(RelativeParentVHDPath)));
-    hVHD->Dynamic.ParentLocatorEntries[1].Reserved = 0;
-    hVHD->Dynamic.ParentLocatorEntries[1].PlatformDataOffset = NtoHll (LocatorPosition+LocatorsWritten*BytesPerSector);
-    ++LocatorsWritten;
+else {
+    if (stored != hDDI->ChunkSize)
+        return SCPE_IOERR;
     }
-hVHD->Dynamic.TableOffset = NtoHll (((LocatorPosition+LocatorsWritten*BytesPerSector + VHD_DATA_BLOCK_ALIGNMENT - 1)/VHD_DATA_BLOCK_ALIGNMENT)*VHD_DATA_BLOCK_ALIGNMENT);
-hVHD->Dynamic.Checksum = 0;
-hVHD->Dynamic.Checksum = NtoHl (CalculateVhdFooterChecksum (&hVHD->Dynamic, sizeof(hVHD->Dynamic)));
-hVHD->Footer.Checksum = 0;
-hVHD->Footer.DiskType = NtoHl (VHD_DT_Differencing);
-memcpy (hVHD->Footer.DriveType, ParentFooter.DriveType, sizeof (hVHD->Footer.DriveType));
-hVHD->Footer.DriveSectorSize = ParentFooter.DriveSectorSize;
-hVHD->Footer.DriveTransferElementSize = ParentFooter.DriveTransferElementSize;
-hVHD->Footer.Checksum = NtoHl (CalculateVhdFooterChecksum (&hVHD->Footer, sizeof(hVHD->Footer)));
+if (eth_crc32 (0, data, hDDI->ChunkSize) != NtoHl (rec.Crc))
+    return SCPE_IOERR;
+return SCPE_OK;
+}
 
-if (WriteFilePosition (hVHD->File,
-                       &hVHD->Footer,
-                       sizeof (hVHD->Footer),
-                       NULL,
-                       0)) {
-    Status = errno;
-    goto Cleanup_Return;
-    }
-if (WriteFilePosition (hVHD->File,
-                       &hVHD->Dynamic,
-                       sizeof (hVHD->Dynamic),
-                       NULL,
-                       NtoHll (hVHD->Footer.DataOffset))) {
-    Status = errno;
-    goto Cleanup_Return;
+/* Append a record holding data to the chunk store, if there is a
+   writable one, or to the container */
+
+static t_stat _ddi_write_record (DDIHANDLE hDDI, const uint8 *data, t_uint64 key, t_uint64 *loc)
+{
+struct ddi_store *s = (hDDI->Store && hDDI->Store->Writable) ? hDDI->Store : NULL;
+FILE *File = s ? s->File : hDDI->File;
+struct ddi_record rec;
+size_t stored = _ddi_lz_compress (data, hDDI->ChunkSize, hDDI->Work, hDDI->ChunkSize - 1);
+const uint8 *src = hDDI->Work;
+t_offset pos;
+t_stat r = SCPE_OK;
+
+memset (&rec, 0, sizeof (rec));
+memcpy (rec.Signature, "CHNK", 4);
+if (stored == 0) {                                      /* incompressible */
+    stored = hDDI->ChunkSize;
+    src = data;
     }
-if (WriteFilePosition (hVHD->File,
-                       hVHD->BAT,
-                       BytesPerSector*((NtoHl (hVHD->Dynamic.MaxTableEntries)*sizeof(*hVHD->BAT)+BytesPerSector-1)/BytesPerSector),
-                       NULL,
-                       NtoHll (hVHD->Dynamic.TableOffset))) {
-    Status = errno;
-    goto Cleanup_Return;
+else
+    rec.Flags = NtoHl (DDI_REC_LZ);
+rec.StoredSize = NtoHl ((uint32)stored);
+rec.Crc = NtoHl (eth_crc32 (0, data, hDDI->ChunkSize));
+_ddi_put64 (rec.Hash, key);
+if (s)
+    DDI_STORE_LOCK (s);
+pos = s ? s->End : hDDI->End;
+if ((sim_fseeko (File, pos, SEEK_SET) != 0) ||
+    (1 != fwrite (&rec, sizeof (rec), 1, File)) ||
+    (stored != fwrite (src, 1, stored, File)))
+    r = SCPE_IOERR;
+else {
+    if (s) {
+        s->End += sizeof (rec) + stored;
+        *loc = ((t_uint64)pos) | DDI_LOC_STORE;
+        r = _ddi_hash_add (&s->Hash, key, *loc);
+        }
+    else {
+        hDDI->End += sizeof (rec) + stored;
+        *loc = (t_uint64)pos;
+        r = _ddi_hash_add (&hDDI->Hash, key, *loc);
+        }
     }
-if (WriteFilePosition (hVHD->File,
-                       &hVHD->Footer,
-                       sizeof (hVHD->Footer),
-                       NULL,
-                       NtoHll (hVHD->Dynamic.TableOffset)+BytesPerSector*((NtoHl (hVHD->Dynamic.MaxTableEntries)*sizeof(*hVHD->BAT)+BytesPerSector-1)/BytesPerSector))) {
-    Status = errno;
-    goto Cleanup_Return;
+if (s)
+    DDI_STORE_UNLOCK (s);
+return r;
+}
+
+/* Find an existing record with the same contents as data */
+
+static t_uint64 _ddi_find_record (DDIHANDLE hDDI, const uint8 *data, t_uint64 key)
+{
+t_uint64 locs[8];
+int i, n;
+
+n = _ddi_hash_find (&hDDI->Hash, key, locs, 8);
+if (hDDI->Store && (n < 8)) {
+    DDI_STORE_LOCK (hDDI->Store);
+    n += _ddi_hash_find (&hDDI->Store->Hash, key, locs + n, 8 - n);
+    DDI_STORE_UNLOCK (hDDI->Store);
     }
-if (hVHD->Dynamic.ParentLocatorEntries[0].PlatformDataLength)
-    if (WriteFilePosition (hVHD->File,
-                           FullParentVHDPathUnicode,
-                           BytesPerSector,
-                           NULL,
-                           NtoHll (hVHD->Dynamic.ParentLocatorEntries[0].PlatformDataOffset))) {
-        Status = errno;
-        goto Cleanup_Return;
+for (i = 0; i < n; i++)
+    if ((_ddi_read_record (hDDI, locs[i], hDDI->Compare) == SCPE_OK) &&
+        (memcmp (hDDI->Compare, data, hDDI->ChunkSize) == 0))
+        return locs[i];
+return 0;
+}
+
+static t_stat _ddi_store_chunk (DDIHANDLE hDDI, struct ddi_chunk *c)
+{
+t_uint64 loc = 0;
+t_stat r;
+
+if (!_ddi_is_zero (c->Data, hDDI->ChunkSize)) {
+    t_uint64 key = _ddi_content_hash (c->Data, hDDI->ChunkSize);
+
+    loc = _ddi_find_record (hDDI, c->Data, key);
+    if (loc == 0) {
+        r = _ddi_write_record (hDDI, c->Data, key, &loc);
+        if (r != SCPE_OK)
+            return r;
         }
-if (hVHD->Dynamic.ParentLocatorEntries[1].PlatformDataLength)
-    if (WriteFilePosition (hVHD->File,
-                           RelativeParentVHDPathUnicode,
-                           BytesPerSector,
-                           NULL,
-                           NtoHll (hVHD->Dynamic.ParentLocatorEntries[1].PlatformDataOffset))) {
-        Status = errno;
-        goto Cleanup_Return;
+    }
+if (hDDI->Index[c->Chunk] != loc) {
+    hDDI->Index[c->Chunk] = loc;
+    hDDI->IndexDirty = TRUE;
+    }
+c->Dirty = FALSE;
+return SCPE_OK;
+}
+
+static struct ddi_chunk *_ddi_cached_chunk (DDIHANDLE hDDI, uint32 chunk)
+{
+int i;
+
+for (i = 0; i < DDI_CACHE_CHUNKS; i++)
+    if (hDDI->Cache[i].Valid && (hDDI->Cache[i].Chunk == chunk)) {
+        hDDI->Cache[i].Used = ++hDDI->Clock;
+        return &hDDI->Cache[i];
         }
+return NULL;
+}
 
-Cleanup_Return:
-free (RelativeParentVHDPath);
-free (FullParentVHDPath);
-free (RelativeParentVHDPathUnicode);
-free (FullParentVHDPathUnicode);
-free (FullVHDPath);
-free (TempPath);
-sim_vhd_disk_close ((FILE *)hVHD);
-hVHD = NULL;
-if (Status) {
-    if ((EEXIST != Status) && (ENOENT != Status))
-        (void)remove (szVHDPath);
+/* Return the cached copy of a chunk, reading it (when load is set) into
+   the least recently used cache entry if it isn't already cached. */
+
+static struct ddi_chunk *_ddi_get_chunk (DDIHANDLE hDDI, uint32 chunk, t_bool load, t_stat *stat)
+{
+struct ddi_chunk *c = _ddi_cached_chunk (hDDI, chunk);
+struct ddi_chunk *victim = NULL;
+int i;
+
+if (c)
+    return c;
+for (i = 0; i < DDI_CACHE_CHUNKS; i++) {
+    c = &hDDI->Cache[i];
+    if (!c->Valid) {
+        victim = c;
+        break;
+        }
+    if ((victim == NULL) || (c->Used < victim->Used))
+        victim = c;
     }
-else {
-    hVHD = (VHDHANDLE)sim_vhd_disk_open (szVHDPath, "rb+");
-    if (!hVHD)
-        Status = errno;
+if (victim->Valid && victim->Dirty) {
+    *stat = _ddi_store_chunk (hDDI, victim);
+    if (*stat != SCPE_OK)
+        return NULL;
     }
-errno = Status;
-return hVHD;
+victim->Valid = FALSE;
+if (load) {
+    if (hDDI->Index[chunk] == 0)
+        memset (victim->Data, 0, hDDI->ChunkSize);
+    else {
+        *stat = _ddi_read_record (hDDI, hDDI->Index[chunk], victim->Data);
+        if (*stat != SCPE_OK)
+            return NULL;
+        }
+    }
+victim->Chunk = chunk;
+victim->Valid = TRUE;
+victim->Dirty = FALSE;
+victim->Used = ++hDDI->Clock;
+return victim;
 }
 
-static FILE *sim_vhd_disk_create (const char *szVHDPath, t_offset desiredsize)
+static t_stat _ddi_write_index (DDIHANDLE hDDI)
 {
-return (FILE *)sim_CreateVirtualDisk (szVHDPath, (uint32)(desiredsize/512), 0, (sim_switches & SWMASK ('X')));
+size_t size = (((size_t)hDDI->ChunkCount * 8) + 511) & ~(size_t)511;
+uint32 *index = (uint32 *)calloc (1, size);
+uint32 i;
+t_stat r = SCPE_OK;
+
+if (index == NULL)
+    return SCPE_MEM;
+for (i = 0; i < hDDI->ChunkCount; i++)
+    _ddi_put64 (&index[2 * i], hDDI->Index[i]);
+if ((sim_fseeko (hDDI->File, sizeof (hDDI->Header), SEEK_SET) != 0) ||
+    (1 != fwrite (index, size, 1, hDDI->File)))
+    r = SCPE_IOERR;
+free (index);
+if (r == SCPE_OK)
+    hDDI->IndexDirty = FALSE;
+return r;
 }
 
-static FILE *sim_vhd_disk_create_diff (const char *szVHDPath, const char *szParentVHDPath)
+static t_stat _ddi_write_header (DDIHANDLE hDDI)
 {
-return (FILE *)CreateDifferencingVirtualDisk (szVHDPath, szParentVHDPath);
+_ddi_header_checksum (&hDDI->Header);
+if ((sim_fseeko (hDDI->File, 0, SEEK_SET) != 0) ||
+    (1 != fwrite (&hDDI->Header, sizeof (hDDI->Header), 1, hDDI->File)) ||
+    (fflush (hDDI->File) != 0))
+    return SCPE_IOERR;
+return SCPE_OK;
 }
 
-static t_stat
-ReadVirtualDisk(VHDHANDLE hVHD,
-                uint8 *buf,
-                uint32 BytesToRead,
-                uint32 *BytesRead,
-                uint64 Offset)
+/* Store modified chunks, then the index which refers to them */
+
+static t_stat _ddi_flush (DDIHANDLE hDDI)
 {
-uint32 TotalBytesRead = 0;
-uint32 BitMapBytes;
-uint32 BitMapSectors;
-uint32 DynamicBlockSize;
 t_stat r = SCPE_OK;
+int i;
 
-if (BytesRead)
-    *BytesRead = 0;
-if (!hVHD || (hVHD->File == NULL)) {
-    errno = EBADF;
-    return SCPE_IOERR;
-    }
-if (BytesToRead == 0)
+if (!hDDI->Writable)
     return SCPE_OK;
-if (Offset >= (uint64)NtoHll (hVHD->Footer.CurrentSize)) {
-    errno = ERANGE;
-    return SCPE_IOERR;
-    }
-if (NtoHl (hVHD->Footer.DiskType) == VHD_DT_Fixed) {
-    if (ReadFilePosition(hVHD->File,
-                         buf,
-                         BytesToRead,
-                         BytesRead,
-                         Offset))
+while (r == SCPE_OK) {                                  /* in chunk order */
+    struct ddi_chunk *c = NULL;
+
+    for (i = 0; i < DDI_CACHE_CHUNKS; i++)
+        if (hDDI->Cache[i].Valid && hDDI->Cache[i].Dirty &&
+            ((c == NULL) || (hDDI->Cache[i].Chunk < c->Chunk)))
+            c = &hDDI->Cache[i];
+    if (c == NULL)
+        break;
+    r = _ddi_store_chunk (hDDI, c);
+    }
+if (hDDI->Store && hDDI->Store->Writable) {
+    DDI_STORE_LOCK (hDDI->Store);
+    fflush (hDDI->Store->File);
+    DDI_STORE_UNLOCK (hDDI->Store);
+    }
+if (fflush (hDDI->File) != 0)
+    r = SCPE_IOERR;
+if ((r == SCPE_OK) && hDDI->IndexDirty) {
+    r = _ddi_write_index (hDDI);
+    if (fflush (hDDI->File) != 0)
         r = SCPE_IOERR;
-    return r;
-    }
-/* We are now dealing with a Dynamically expanding or differencing disk */
-DynamicBlockSize = NtoHl (hVHD->Dynamic.BlockSize);
-if ((DynamicBlockSize == 0) ||
-    ((DynamicBlockSize & (DynamicBlockSize - 1)) != 0)) {
-    errno = ERANGE;
-    return SCPE_IOERR;
     }
-BitMapBytes = (7+(DynamicBlockSize / VHD_Internal_SectorSize))/8;
-BitMapSectors = (BitMapBytes+VHD_Internal_SectorSize-1)/VHD_Internal_SectorSize;
-while (BytesToRead && (r == SCPE_OK)) {
-    uint32 BlockNumber = (uint32)(Offset / DynamicBlockSize);
-    uint32 BytesInRead = BytesToRead;
-    uint32 BytesThisRead = 0;
+return r;
+}
+
+static void _ddi_free (DDIHANDLE hDDI)
+{
+_ddi_store_release (hDDI->Store);
+_ddi_hash_free (&hDDI->Hash);
+free (hDDI->Index);
+free (hDDI->CacheData);
+free (hDDI->Work);
+free (hDDI->Compare);
+free (hDDI->Path);
+free (hDDI);
+}
+
+static t_bool sim_ddi_disk_is_ddi (const char *path)
+{
+struct ddi_header Header;
+FILE *File = sim_fopen (path, "rb");
+t_bool r;
+
+if (File == NULL)
+    return FALSE;
+r = ((1 == fread (&Header, sizeof (Header), 1, File)) && _ddi_header_valid (&Header, DDI_SIGNATURE));
+fclose (File);
+return r;
+}
+
+static FILE *sim_ddi_disk_open (const char *path, const char *mode)
+{
+DDIHANDLE hDDI;
+FILE *File;
+uint32 *index = NULL;
+size_t index_size;
+uint32 i;
+int saved_errno;
 
-    if (BlockNumber != (Offset + BytesToRead) / DynamicBlockSize)
-        BytesInRead = (uint32)(((BlockNumber + 1) * DynamicBlockSize) - Offset);
-    if (hVHD->BAT[BlockNumber] == VHD_BAT_FREE_ENTRY) {
-        if (!hVHD->Parent) {
-            memset (buf, 0, BytesInRead);
-            BytesThisRead = BytesInRead;
-            }
-        else {
-            if (ReadVirtualDisk(hVHD->Parent,
-                                buf,
-                                BytesInRead,
-                                &BytesThisRead,
-                                Offset))
-                r = SCPE_IOERR;
-            }
+File = sim_fopen (path, strchr (mode, '+') ? "rb+" : "rb");
+if (File == NULL)
+    return NULL;
+hDDI = (DDIHANDLE)calloc (1, sizeof (*hDDI));
+if (hDDI == NULL) {
+    fclose (File);
+    errno = ENOMEM;
+    return NULL;
+    }
+hDDI->File = File;
+hDDI->Writable = (strchr (mode, '+') != NULL);
+if ((1 != fread (&hDDI->Header, sizeof (hDDI->Header), 1, File)) ||
+    (!_ddi_header_valid (&hDDI->Header, DDI_SIGNATURE))) {
+    saved_errno = EINVAL;                               /* not a DDI container */
+    goto Error_Return;
+    }
+hDDI->ChunkSize = NtoHl (hDDI->Header.ChunkSize);
+hDDI->ChunkCount = NtoHl (hDDI->Header.ChunkCount);
+hDDI->DiskSize = (t_offset)_ddi_get64 (hDDI->Header.DiskSize);
+if (hDDI->ChunkCount != (uint32)((hDDI->DiskSize + hDDI->ChunkSize - 1) / hDDI->ChunkSize)) {
+    saved_errno = EINVAL;
+    goto Error_Return;
+    }
+index_size = (((size_t)hDDI->ChunkCount * 8) + 511) & ~(size_t)511;
+hDDI->DataStart = sizeof (hDDI->Header) + index_size;
+hDDI->Path = strdup (path);
+hDDI->Index = (t_uint64 *)calloc (hDDI->ChunkCount + 1, sizeof (*hDDI->Index));
+index = (uint32 *)malloc (index_size);
+hDDI->CacheData = (uint8 *)malloc ((size_t)DDI_CACHE_CHUNKS * hDDI->ChunkSize);
+hDDI->Work = (uint8 *)malloc (hDDI->ChunkSize);
+hDDI->Compare = (uint8 *)malloc (hDDI->ChunkSize);
+if ((hDDI->Path == NULL) || (hDDI->Index == NULL) || (index == NULL) ||
+    (hDDI->CacheData == NULL) || (hDDI->Work == NULL) || (hDDI->Compare == NULL)) {
+    saved_errno = ENOMEM;
+    goto Error_Return;
+    }
+if (1 != fread (index, index_size, 1, File)) {
+    saved_errno = EINVAL;
+    goto Error_Return;
+    }
+for (i = 0; i < hDDI->ChunkCount; i++)
+    hDDI->Index[i] = _ddi_get64 (&index[2 * i]);
+free (index);
+index = NULL;
+for (i = 0; i < DDI_CACHE_CHUNKS; i++)
+    hDDI->Cache[i].Data = hDDI->CacheData + (size_t)i * hDDI->ChunkSize;
+hDDI->End = _ddi_scan_records (File, hDDI->DataStart, &hDDI->Hash, 0);
+if (hDDI->Header.StorePath[0]) {
+    hDDI->Header.StorePath[sizeof (hDDI->Header.StorePath) - 1] = '\0';
+    hDDI->Store = _ddi_store_open (path, (char *)hDDI->Header.StorePath, hDDI->ChunkSize, hDDI->Writable);
+    if (hDDI->Store == NULL) {
+        saved_errno = ENOENT;                           /* chunk store is missing */
+        goto Error_Return;
         }
-    else {
-        uint64 BlockOffset = VHD_Internal_SectorSize * ((uint64)(NtoHl (hVHD->BAT[BlockNumber]) + BitMapSectors)) + (Offset % DynamicBlockSize);
+    }
+return (FILE *)hDDI;
 
-        if (ReadFilePosition(hVHD->File,
-                             buf,
-                             BytesInRead,
-                             &BytesThisRead,
-                             BlockOffset))
-            r = SCPE_IOERR;
-        }
-    BytesToRead -= BytesThisRead;
-    buf = (uint8 *)(((char *)buf) + BytesThisRead);
-    Offset += BytesThisRead;
-    TotalBytesRead += BytesThisRead;
+Error_Return:
+free (index);
+fclose (File);
+_ddi_free (hDDI);
+errno = saved_errno;
+return NULL;
+}
+
+static FILE *sim_ddi_disk_create (const char *path, t_offset desiredsize)
+{
+struct ddi_header h;
+FILE *File;
+uint8 *index;
+size_t index_size;
+uint32 count = (uint32)((desiredsize + DDI_CHUNK_SIZE - 1) / DDI_CHUNK_SIZE);
+t_bool ok;
+
+index_size = (((size_t)count * 8) + 511) & ~(size_t)511;
+index = (uint8 *)calloc (1, index_size);
+if (index == NULL)
+    return NULL;
+File = sim_fopen (path, "wb");
+if (File == NULL) {
+    free (index);
+    return NULL;
     }
-if (BytesRead)
-    *BytesRead = TotalBytesRead;
-return SCPE_OK;
+memset (&h, 0, sizeof (h));
+memcpy (h.Signature, DDI_SIGNATURE, sizeof (h.Signature));
+h.Version = NtoHl (DDI_VERSION);
+h.ChunkSize = NtoHl (DDI_CHUNK_SIZE);
+_ddi_put64 (h.DiskSize, (t_uint64)desiredsize);
+h.ChunkCount = NtoHl (count);
+h.CreationTime = NtoHl ((uint32)time (NULL));
+strlcpy ((char *)h.CreatingSimulator, sim_name, sizeof (h.CreatingSimulator));
+_ddi_header_checksum (&h);
+ok = ((1 == fwrite (&h, sizeof (h), 1, File)) &&
+      (1 == fwrite (index, index_size, 1, File)));
+free (index);
+if ((fclose (File) != 0) || !ok) {
+    (void)remove (path);
+    return NULL;
+    }
+return sim_ddi_disk_open (path, "rb+");
 }
 
-static t_stat
-ReadVirtualDiskSectors(VHDHANDLE hVHD,
-                       uint8 *buf,
-                       t_seccnt sects,
-                       t_seccnt *sectsread,
-                       uint32 SectorSize,
-                       t_lba lba)
+static int sim_ddi_disk_close (FILE *f)
 {
-uint32 BytesRead;
-t_stat r = ReadVirtualDisk(hVHD,
-                           buf,
-                           sects * SectorSize,
-                           &BytesRead,
-                           SectorSize * (uint64)lba);
-if (sectsread)
-    *sectsread = BytesRead / SectorSize;
+DDIHANDLE hDDI = (DDIHANDLE)f;
+int r;
+
+if (hDDI == NULL)
+    return -1;
+(void)_ddi_flush (hDDI);
+r = fclose (hDDI->File);
+_ddi_free (hDDI);
 return r;
 }
 
-static t_stat sim_vhd_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
+static void sim_ddi_disk_flush (FILE *f)
 {
-VHDHANDLE hVHD = (VHDHANDLE)uptr->fileref;
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+DDIHANDLE hDDI = (DDIHANDLE)f;
 
-return ReadVirtualDiskSectors(hVHD, buf, sects, sectsread, ctx->sector_size, lba);
+if (hDDI)
+    (void)_ddi_flush (hDDI);
 }
 
-static t_stat sim_vhd_disk_clearerr (UNIT *uptr)
+static t_offset sim_ddi_disk_size (FILE *f)
 {
-VHDHANDLE hVHD = (VHDHANDLE)uptr->fileref;
+DDIHANDLE hDDI = (DDIHANDLE)f;
 
-clearerr (hVHD->File);
-return SCPE_OK;
+return hDDI ? hDDI->DiskSize : (t_offset)-1;
 }
 
-static t_bool
-BufferIsZeros(void *Buffer, size_t BufferSize)
+static t_stat sim_ddi_disk_clearerr (UNIT *uptr)
 {
-size_t i;
-char *c = (char *)Buffer;
+DDIHANDLE hDDI = (DDIHANDLE)uptr->fileref;
 
-for (i=0; i<BufferSize; ++i)
-    if (c[i])
-        return FALSE;
-return TRUE;
+clearerr (hDDI->File);
+return SCPE_OK;
 }
 
-static t_stat
-WriteVirtualDisk(VHDHANDLE hVHD,
-                 uint8 *buf,
-                 uint32 BytesToWrite,
-                 uint32 *BytesWritten,
-                 uint64 Offset)
+static t_stat sim_ddi_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects)
 {
-uint32 TotalBytesWritten = 0;
-uint32 BitMapBytes;
-uint32 BitMapSectors;
-uint32 DynamicBlockSize;
+DDIHANDLE hDDI = (DDIHANDLE)uptr->fileref;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_offset da = ((t_offset)lba) * ctx->sector_size;
+size_t tbc = ((size_t)sects) * ctx->sector_size;
+size_t done = 0;
 t_stat r = SCPE_OK;
 
-if (BytesWritten)
-    *BytesWritten = 0;
-if (!hVHD || !hVHD->File) {
-    errno = EBADF;
-    return SCPE_IOERR;
-    }
-if (BytesToWrite == 0)
-    return SCPE_OK;
-if (Offset >= (uint64)NtoHll(hVHD->Footer.CurrentSize)) {
-    errno = ERANGE;
-    return SCPE_IOERR;
-    }
-if (NtoHl(hVHD->Footer.DiskType) == VHD_DT_Fixed) {
-    if (WriteFilePosition(hVHD->File,
-                          buf,
-                          BytesToWrite,
-                          BytesWritten,
-                          Offset))
-        r = SCPE_IOERR;
-    return r;
-    }
-/* We are now dealing with a Dynamically expanding or differencing disk */
-DynamicBlockSize = NtoHl (hVHD->Dynamic.BlockSize);
-if ((DynamicBlockSize == 0) ||
-    ((DynamicBlockSize & (DynamicBlockSize - 1)) != 0)) {
-    errno = ERANGE;
-    return SCPE_IOERR;
-    }
-BitMapBytes = (7 + (DynamicBlockSize / VHD_Internal_SectorSize)) / 8;
-BitMapSectors = (BitMapBytes + VHD_Internal_SectorSize - 1) / VHD_Internal_SectorSize;
-while (BytesToWrite && (r == SCPE_OK)) {
-    uint32 BlockNumber = (uint32)(Offset / DynamicBlockSize);
-    uint32 BytesInWrite = BytesToWrite;
-    uint32 BytesThisWrite = 0;
-
-    if (BlockNumber >= NtoHl(hVHD->Dynamic.MaxTableEntries)) {
-        return SCPE_EOF;
+while (done < tbc) {
+    t_offset pos = da + done;
+    uint32 chunk = (uint32)(pos / hDDI->ChunkSize);
+    uint32 offset = (uint32)(pos % hDDI->ChunkSize);
+    size_t n = hDDI->ChunkSize - offset;
+    struct ddi_chunk *c;
+
+    if (n > tbc - done)
+        n = tbc - done;
+    if (pos >= hDDI->DiskSize) {                        /* beyond the end reads zeros */
+        memset (buf + done, 0, tbc - done);
+        done = tbc;
+        break;
         }
-    if (BlockNumber != (Offset + BytesToWrite) / DynamicBlockSize)
-        BytesInWrite = (uint32)(((BlockNumber + 1) * DynamicBlockSize) - Offset);
-    if (hVHD->BAT[BlockNumber] == VHD_BAT_FREE_ENTRY) {
-        uint8 *BitMap = NULL;
-        uint32 BitMapBufferSize = VHD_DATA_BLOCK_ALIGNMENT;
-        uint8 *BitMapBuffer = NULL;
-        void *BlockData = NULL;
-        uint8 *BATUpdateBufferAddress;
-        uint32 BATUpdateBufferSize;
-        uint64 BATUpdateStorageAddress;
-        uint64 BlockOffset;
+    c = _ddi_cached_chunk (hDDI, chunk);
+    if ((c == NULL) && (hDDI->Index[chunk] == 0))       /* never written */
+        memset (buf + done, 0, n);
+    else {
+        if (c == NULL)
+            c = _ddi_get_chunk (hDDI, chunk, TRUE, &r);
+        if (c == NULL)
+            break;
+        memcpy (buf + done, c->Data + offset, n);
+        }
+    done += n;
+    }
+if (sectsread)
+    *sectsread = (t_seccnt)(done / ctx->sector_size);
+return r;
+}
 
-        if (!hVHD->Parent && BufferIsZeros(buf, BytesInWrite)) {
-            BytesThisWrite = BytesInWrite;
-            goto IO_Done;
-            }
-        /* Need to allocate a new Data Block. */
-        BlockOffset = sim_fsize_ex (hVHD->File);
-        if (((int64)BlockOffset) == -1)
-            return SCPE_IOERR;
-        if ((BitMapSectors * VHD_Internal_SectorSize) > BitMapBufferSize)
-            BitMapBufferSize = BitMapSectors * VHD_Internal_SectorSize;
-        BitMapBuffer = (uint8 *)calloc(1, BitMapBufferSize + DynamicBlockSize);
-        if (BitMapBufferSize > BitMapSectors * VHD_Internal_SectorSize)
-            BitMap = BitMapBuffer + BitMapBufferSize - BitMapBytes;
-        else
-            BitMap = BitMapBuffer;
-        memset(BitMap, 0xFF, BitMapBytes);
-        BlockOffset -= sizeof(hVHD->Footer);
-        if (0 == (BlockOffset & (VHD_DATA_BLOCK_ALIGNMENT-1)))
-            {  // Already aligned, so use padded BitMapBuffer
-            if (WriteFilePosition(hVHD->File,
-                                  BitMapBuffer,
-                                  BitMapBufferSize + DynamicBlockSize,
-                                  NULL,
-                                  BlockOffset)) {
-                free (BitMapBuffer);
-                return SCPE_IOERR;
-                }
-            BlockOffset += BitMapBufferSize;
-            }
-        else
-            {
-            // align the data portion of the block to the desired alignment
-            // compute the address of the data portion of the block
-            BlockOffset += BitMapSectors * VHD_Internal_SectorSize;
-            // round up this address to the desired alignment
-            BlockOffset += VHD_DATA_BLOCK_ALIGNMENT-1;
-            BlockOffset &= ~(VHD_DATA_BLOCK_ALIGNMENT - 1);
-            BlockOffset -= BitMapSectors * VHD_Internal_SectorSize;
-            if (WriteFilePosition(hVHD->File,
-                                  BitMap,
-                                  (BitMapSectors * VHD_Internal_SectorSize) + DynamicBlockSize,
-                                  NULL,
-                                  BlockOffset)) {
-                free (BitMapBuffer);
-                return SCPE_IOERR;
-                }
-            BlockOffset += BitMapSectors * VHD_Internal_SectorSize;
-            }
-        free(BitMapBuffer);
-        BitMapBuffer = BitMap = NULL;
-        /* the BAT block address is the beginning of the block bitmap */
-        BlockOffset -= BitMapSectors * VHD_Internal_SectorSize;
-        hVHD->BAT[BlockNumber] = NtoHl((uint32)(BlockOffset / VHD_Internal_SectorSize));
-        BlockOffset += (BitMapSectors * VHD_Internal_SectorSize) + DynamicBlockSize;
-        if (WriteFilePosition(hVHD->File,
-                              &hVHD->Footer,
-                              sizeof(hVHD->Footer),
-                              NULL,
-                              BlockOffset))
-            goto Fatal_IO_Error;
-        /* Since a large VHD can have a pretty large BAT, and we've only changed one longword bat entry
-           in the current BAT, we write just the aligned sector which contains the updated BAT entry */
-        BATUpdateBufferAddress = (uint8 *)hVHD->BAT - (size_t)NtoHll(hVHD->Dynamic.TableOffset) +
-            (size_t)((((size_t)&hVHD->BAT[BlockNumber]) - (size_t)hVHD->BAT + (size_t)NtoHll(hVHD->Dynamic.TableOffset)) & ~(VHD_DATA_BLOCK_ALIGNMENT-1));
-        /* If the starting of the BAT isn't on a VHD_DATA_BLOCK_ALIGNMENT boundary and we've just updated
-           a BAT entry early in the array, the buffer computed address might be before the start of the
-           BAT table.  If so, only write the BAT data needed */
-        if (BATUpdateBufferAddress < (uint8 *)hVHD->BAT) {
-            BATUpdateBufferAddress = (uint8 *)hVHD->BAT;
-            BATUpdateBufferSize = (uint32)((((size_t)&hVHD->BAT[BlockNumber]) - (size_t)hVHD->BAT) + 512) & ~511;
-            BATUpdateStorageAddress = NtoHll(hVHD->Dynamic.TableOffset);
-            }
-        else {
-            BATUpdateBufferSize = VHD_DATA_BLOCK_ALIGNMENT;
-            BATUpdateStorageAddress = NtoHll(hVHD->Dynamic.TableOffset) + BATUpdateBufferAddress - ((uint8 *)hVHD->BAT);
-            }
-        /* If the total BAT is smaller than one VHD_DATA_BLOCK_ALIGNMENT, then be sure to only write out the BAT data */
-        if ((size_t)(BATUpdateBufferAddress - (uint8 *)hVHD->BAT + BATUpdateBufferSize) > VHD_Internal_SectorSize * ((sizeof(*hVHD->BAT)*NtoHl(hVHD->Dynamic.MaxTableEntries) + VHD_Internal_SectorSize - 1)/VHD_Internal_SectorSize))
-            BATUpdateBufferSize = (uint32)(VHD_Internal_SectorSize * ((sizeof(*hVHD->BAT) * NtoHl(hVHD->Dynamic.MaxTableEntries) + VHD_Internal_SectorSize - 1)/VHD_Internal_SectorSize) - (BATUpdateBufferAddress - ((uint8 *)hVHD->BAT)));
-        if (WriteFilePosition(hVHD->File,
-                              BATUpdateBufferAddress,
-                              BATUpdateBufferSize,
-                              NULL,
-                              BATUpdateStorageAddress))
-            goto Fatal_IO_Error;
-        if (hVHD->Parent)
-            { /* Need to populate data block contents from parent VHD */
-            BlockData = malloc (NtoHl (hVHD->Dynamic.BlockSize));
+static t_stat sim_ddi_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+{
+DDIHANDLE hDDI = (DDIHANDLE)uptr->fileref;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+t_offset da = ((t_offset)lba) * ctx->sector_size;
+size_t tbc = ((size_t)sects) * ctx->sector_size;
+size_t done = 0;
+t_stat r = SCPE_OK;
 
-            if (ReadVirtualDisk(hVHD->Parent,
-                                (uint8*) BlockData,
-                                NtoHl (hVHD->Dynamic.BlockSize),
-                                NULL,
-                                (Offset / NtoHl (hVHD->Dynamic.BlockSize)) * NtoHl (hVHD->Dynamic.BlockSize)))
-                goto Fatal_IO_Error;
-            if (WriteVirtualDisk(hVHD,
-                                 (uint8*) BlockData,
-                                 NtoHl (hVHD->Dynamic.BlockSize),
-                                 NULL,
-                                 (Offset / NtoHl (hVHD->Dynamic.BlockSize)) * NtoHl (hVHD->Dynamic.BlockSize)))
-                goto Fatal_IO_Error;
-            free(BlockData);
-            }
-        continue;
-Fatal_IO_Error:
-        free (BitMap);
-        free (BlockData);
+if (!hDDI->Writable)
+    r = SCPE_RO;
+while ((r == SCPE_OK) && (done < tbc)) {
+    t_offset pos = da + done;
+    uint32 chunk = (uint32)(pos / hDDI->ChunkSize);
+    uint32 offset = (uint32)(pos % hDDI->ChunkSize);
+    size_t n = hDDI->ChunkSize - offset;
+    struct ddi_chunk *c;
+
+    if (n > tbc - done)
+        n = tbc - done;
+    if (pos >= hDDI->DiskSize) {
         r = SCPE_IOERR;
+        break;
         }
-    else {
-        uint64 BlockOffset = VHD_Internal_SectorSize * ((uint64)(NtoHl(hVHD->BAT[BlockNumber]) + BitMapSectors)) + (Offset % DynamicBlockSize);
-
-        if (WriteFilePosition(hVHD->File,
-                              buf,
-                              BytesInWrite,
-                              &BytesThisWrite,
-                              BlockOffset))
-            r = SCPE_IOERR;
-        }
-IO_Done:
-    BytesToWrite -= BytesThisWrite;
-    buf = (uint8 *)(((char *)buf) + BytesThisWrite);
-    Offset += BytesThisWrite;
-    TotalBytesWritten += BytesThisWrite;
+    c = _ddi_get_chunk (hDDI, chunk, (n != hDDI->ChunkSize), &r);
+    if (c == NULL)
+        break;
+    memcpy (c->Data + offset, buf + done, n);
+    c->Dirty = TRUE;
+    done += n;
     }
-if (BytesWritten)
-    *BytesWritten = TotalBytesWritten;
+if (sectswritten)
+    *sectswritten = (t_seccnt)(done / ctx->sector_size);
 return r;
 }
 
-static t_stat
-WriteVirtualDiskSectors(VHDHANDLE hVHD,
-                        uint8 *buf,
-                        t_seccnt sects,
-                        t_seccnt *sectswritten,
-                        uint32 SectorSize,
-                        t_lba lba)
+static t_stat sim_ddi_disk_set_dtype (FILE *f, const char *dtype, uint32 SectorSize, uint32 xfer_element_size)
+{
+DDIHANDLE hDDI = (DDIHANDLE)f;
+
+memset (hDDI->Header.DriveType, 0, sizeof (hDDI->Header.DriveType));
+strlcpy ((char *)hDDI->Header.DriveType, dtype, sizeof (hDDI->Header.DriveType));
+hDDI->Header.SectorSize = NtoHl (SectorSize);
+hDDI->Header.TransferElementSize = NtoHl (xfer_element_size);
+memset (hDDI->Header.CreatingSimulator, 0, sizeof (hDDI->Header.CreatingSimulator));
+strlcpy ((char *)hDDI->Header.CreatingSimulator, sim_name, sizeof (hDDI->Header.CreatingSimulator));
+return _ddi_write_header (hDDI);
+}
+
+static const char *sim_ddi_disk_get_dtype (FILE *f, uint32 *SectorSize, uint32 *xfer_element_size, char sim_name[64], time_t *creation_time)
 {
-uint32 BytesWritten;
-t_stat r = WriteVirtualDisk(hVHD,
-                            buf,
-                            sects * SectorSize,
-                            &BytesWritten,
-                            SectorSize * (uint64)lba);
+DDIHANDLE hDDI = (DDIHANDLE)f;
 
-if (sectswritten)
-    *sectswritten = BytesWritten / SectorSize;
-return r;
+if (SectorSize)
+    *SectorSize = NtoHl (hDDI->Header.SectorSize);
+if (xfer_element_size)
+    *xfer_element_size = NtoHl (hDDI->Header.TransferElementSize);
+if (sim_name)
+    memcpy (sim_name, hDDI->Header.CreatingSimulator, 64);
+if (creation_time)
+    *creation_time = (time_t)NtoHl (hDDI->Header.CreationTime);
+hDDI->Header.DriveType[sizeof (hDDI->Header.DriveType) - 1] = '\0';
+return (char *)hDDI->Header.DriveType;
 }
 
-static t_stat sim_vhd_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects)
+/* Make a container which holds no chunks yet use a chunk store */
+
+static t_stat sim_ddi_disk_set_store (FILE *f, const char *store)
 {
-VHDHANDLE hVHD = (VHDHANDLE)uptr->fileref;
-struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+DDIHANDLE hDDI = (DDIHANDLE)f;
+struct ddi_store *s;
+uint32 i;
 
-return WriteVirtualDiskSectors(hVHD, buf, sects, sectswritten, ctx->sector_size, lba);
+for (i = 0; i < hDDI->ChunkCount; i++)
+    if (hDDI->Index[i] != 0)
+        return SCPE_NOFNC;
+if (strlen (store) >= sizeof (hDDI->Header.StorePath))
+    return SCPE_ARG;
+s = _ddi_store_open (hDDI->Path, store, hDDI->ChunkSize, hDDI->Writable);
+if (s == NULL)
+    return SCPE_OPENERR;
+_ddi_store_release (hDDI->Store);
+hDDI->Store = s;
+memset (hDDI->Header.StorePath, 0, sizeof (hDDI->Header.StorePath));
+strlcpy ((char *)hDDI->Header.StorePath, store, sizeof (hDDI->Header.StorePath));
+return _ddi_write_header (hDDI);
+}
+
+static void sim_ddi_disk_info (FILE *f)
+{
+DDIHANDLE hDDI = (DDIHANDLE)f;
+t_offset file_size = sim_fsize_ex (hDDI->File);
+uint32 i, zero = 0, shared = 0;
+
+for (i = 0; i < hDDI->ChunkCount; i++) {
+    if (hDDI->Index[i] == 0)
+        ++zero;
+    else
+        if (hDDI->Index[i] & DDI_LOC_STORE)
+            ++shared;
+    }
+sim_printf ("   ChunkSize:           %u\n", hDDI->ChunkSize);
+sim_printf ("   Chunks:              %u (%u zero, %u in chunk store)\n", hDDI->ChunkCount, zero, shared);
+sim_printf ("   StoredRecords:       %u\n", (uint32)hDDI->Hash.count);
+if (hDDI->Store) {
+    sim_printf ("   ChunkStore:          %s\n", hDDI->Store->Path);
+    sim_printf ("   ChunkStoreRecords:   %u\n", (uint32)hDDI->Store->Hash.count);
+    }
+sim_printf ("   ContainerFileSize:   %s bytes\n", sim_fmt_numeric ((double)file_size));
 }
-#endif
 
 t_stat sim_disk_init (void)
 {
@@ -6655,17 +10009,25 @@ if (info->flag == 0) {
     sim_switches |= SWMASK ('E') | SWMASK ('R');   /* Must exist, Read Only */
     uptr->flags |= UNIT_ATTABLE;
     uptr->disk_ctx = &disk_ctx;
-    sim_disk_set_fmt (uptr, 0, "VHD", NULL);
-    container = sim_vhd_disk_open (FullPath, "r");
-    if (container == NULL) {
-        sim_disk_set_fmt (uptr, 0, "SIMH", NULL);
-        container = sim_fopen (FullPath, "rb+");
-        close_function = fclose;
-        size_function = sim_fsize_ex;
+    if (sim_ddi_disk_is_ddi (FullPath)) {
+        sim_disk_set_fmt (uptr, 0, "DDI", NULL);
+        container = sim_ddi_disk_open (FullPath, "r");
+        close_function = sim_ddi_disk_close;
+        size_function = sim_ddi_disk_size;
         }
     else {
-        close_function = sim_vhd_disk_close;
-        size_function = sim_vhd_disk_size;
+        sim_disk_set_fmt (uptr, 0, "VHD", NULL);
+        container = sim_vhd_disk_open (FullPath, "r");
+        if (container == NULL) {
+            sim_disk_set_fmt (uptr, 0, "SIMH", NULL);
+            container = sim_fopen (FullPath, "rb+");
+            close_function = fclose;
+            size_function = sim_fsize_ex;
+            }
+        else {
+            close_function = sim_vhd_disk_close;
+            size_function = sim_vhd_disk_size;
+            }
         }
     if (container) {
         container_size = size_function (container);
@@ -6677,54 +10039,717 @@ if (info->flag == 0) {
         if (f) {
             t_offset highwater_sector = (f->SectorSize == 0) ? (t_offset)-1 : ((((t_offset)NtoHl (f->Highwater[0])) << 32) | ((t_offset)NtoHl (f->Highwater[1]))) / NtoHl(f->SectorSize);
 
-            sim_printf ("Container:              %s\n"
-                        "   Simulator:           %s\n"
-                        "   DriveType:           %s\n"
-                        "   SectorSize:          %u\n"
-                        "   SectorCount:         %u\n"
-                        "   TransferElementSize: %u\n"
-                        "   AccessFormat:        %s\n"
-                        "   CreationTime:        %s",
-                        uptr->filename,
-                        f->CreatingSimulator, f->DriveType, NtoHl(f->SectorSize), NtoHl (f->SectorCount),
-                        NtoHl (f->TransferElementSize), fmts[f->AccessFormat].name, f->CreationTime);
-            if (f->DeviceName[0] != '\0')
-                sim_printf ("   DeviceName:          %s\n", (char *)f->DeviceName);
-            if (highwater_sector > 0)
-                sim_printf ("   HighwaterSector:     %u\n", (uint32)highwater_sector);
-            sim_printf ("Container Size: %s bytes\n", sim_fmt_numeric ((double)ctx->container_size));
-            }
-        else {
-            sim_printf ("Container Info for '%s' unavailable\n", uptr->filename);
-            sim_printf ("Container Size: %s bytes\n", sim_fmt_numeric ((double)container_size));
-            info->stat = SCPE_ARG|SCPE_NOMESSAGE;
-            }
-        free (f);
-        free (uptr->filename);
-        close_function (container);
-        return;
-        }
-    else {
-        info->stat = sim_messagef (SCPE_OPENERR, "Cannot open container file '%s' - %s\n", FullPath, strerror (errno));
-        return;
+            sim_printf ("Container:              %s\n"
+                        "   Simulator:           %s\n"
+                        "   DriveType:           %s\n"
+                        "   SectorSize:          %u\n"
+                        "   SectorCount:         %u\n"
+                        "   TransferElementSize: %u\n"
+                        "   AccessFormat:        %s\n"
+                        "   CreationTime:        %s",
+                        uptr->filename,
+                        f->CreatingSimulator, f->DriveType, NtoHl(f->SectorSize), NtoHl (f->SectorCount),
+                        NtoHl (f->TransferElementSize), fmts[f->AccessFormat].name, f->CreationTime);
+            if (f->DeviceName[0] != '\0')
+                sim_printf ("   DeviceName:          %s\n", (char *)f->DeviceName);
+            if (highwater_sector > 0)
+                sim_printf ("   HighwaterSector:     %u\n", (uint32)highwater_sector);
+            if (DK_GET_FMT (uptr) == DKUF_F_DDI)
+                sim_ddi_disk_info (container);
+            sim_printf ("Container Size: %s bytes\n", sim_fmt_numeric ((double)ctx->container_size));
+            }
+        else {
+            sim_printf ("Container Info for '%s' unavailable\n", uptr->filename);
+            sim_printf ("Container Size: %s bytes\n", sim_fmt_numeric ((double)container_size));
+            info->stat = SCPE_ARG|SCPE_NOMESSAGE;
+            }
+        free (f);
+        free (uptr->filename);
+        close_function (container);
+        return;
+        }
+    else {
+        info->stat = sim_messagef (SCPE_OPENERR, "Cannot open container file '%s' - %s\n", FullPath, strerror (errno));
+        return;
+        }
+    }
+}
+
+t_stat sim_disk_info_cmd (int32 flag, CONST char *cptr)
+{
+DISK_INFO_CTX disk_info_state;
+t_stat stat;
+
+if ((!cptr) || (*cptr == 0))
+    return SCPE_2FARG;
+GET_SWITCHES (cptr);                                    /* get switches */
+memset (&disk_info_state, 0, sizeof (disk_info_state));
+disk_info_state.flag = flag;
+stat = sim_dir_scan (cptr, sim_disk_info_entry, &disk_info_state);
+if (stat == SCPE_OK)
+    return disk_info_state.stat;
+return sim_messagef (SCPE_OK, "No such file or directory: %s\n", cptr);
+}
+
+/* Drive type recorded in an attached container's metadata, if any */
+
+const char *sim_disk_get_dtype (UNIT *uptr, uint32 *sector_size, uint32 *xfer_element_size)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+
+if ((!(uptr->flags & UNIT_ATT)) || (ctx == NULL) ||
+    (ctx->footer == NULL) || (ctx->footer->DriveType[0] == '\0'))
+    return NULL;
+if (sector_size)
+    *sector_size = NtoHl (ctx->footer->SectorSize);
+if (xfer_element_size)
+    *xfer_element_size = NtoHl (ctx->footer->TransferElementSize);
+return (const char *)ctx->footer->DriveType;
+}
+
+/* Bulk copying, comparing and checksumming of disk containers
+
+   sim_disk_copy moves the whole of one attached container through a
+   pipeline of large buffers.  A reader thread fills buffers sequentially
+   from the source (and from the destination when comparing), several
+   scanner threads each take a filled buffer and compute its CRC32, find
+   its sectors of zeros and compare it, and the calling thread retires
+   the buffers in order, writing them to the destination and reporting
+   progress.  Compression, where the destination format has it (DDI), is
+   done by the destination's write path.
+
+   With DK_COPY_SPARSE, sectors of zeros are not written, so a newly
+   created VHD or DDI destination only holds the data actually in use and
+   a SIMH format destination is a sparse file.  The checksum returned is
+   the CRC32 of the entire contents of the source, as produced by common
+   CRC32 utilities when run on a SIMH or RAW format container. */
+
+#define DK_PIPE_BUFSIZE     (4*1024*1024)   /* bytes per buffer */
+#define DK_PIPE_BUFFERS     8               /* buffers in the pipeline */
+
+#define PB_FREE             0               /* available to the reader */
+#define PB_READ             1               /* filled, waiting to be scanned */
+#define PB_SCAN             2               /* being scanned */
+#define PB_DONE             3               /* scanned, waiting to be retired */
+
+struct disk_pipe_buf {
+    int                 state;
+    t_lba               lba;
+    t_seccnt            sects;
+    uint8               *data;              /* source data */
+    uint8               *cmp;               /* destination data when comparing */
+    uint8               *zero;              /* per sector: all zeros */
+    uint32              crc;
+    t_seccnt            mismatch;           /* first sector which differs */
+    t_stat              status;
+    };
+
+struct disk_pipe {
+    UNIT                *src;
+    UNIT                *dst;
+    uint32              flags;
+    size_t              sector_size;
+    t_lba               total;              /* sectors to transfer */
+    t_seccnt            bufsects;           /* sectors per buffer */
+    int                 nbufs;
+    struct disk_pipe_buf buf[DK_PIPE_BUFFERS];
+#if defined (SIM_ASYNCH_IO)
+    volatile t_bool     stop;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+#endif
+    };
+
+/* CRC32 of the concatenation of two blocks, given each block's CRC32 */
+
+static uint32 _gf2_times (const uint32 *mat, uint32 vec)
+{
+uint32 sum = 0;
+
+for (; vec; vec >>= 1, mat++)
+    if (vec & 1)
+        sum ^= *mat;
+return sum;
+}
+
+static void _gf2_square (uint32 *square, const uint32 *mat)
+{
+int n;
+
+for (n = 0; n < 32; n++)
+    square[n] = _gf2_times (mat, mat[n]);
+}
+
+static uint32 _sim_disk_crc32_combine (uint32 crc1, uint32 crc2, t_offset len2)
+{
+uint32 even[32], odd[32], row;
+int n;
+
+if (len2 == 0)
+    return crc1;
+odd[0] = 0xEDB88320;                            /* operator for one zero bit */
+for (n = 1, row = 1; n < 32; n++, row <<= 1)
+    odd[n] = row;
+_gf2_square (even, odd);                        /* two zero bits */
+_gf2_square (odd, even);                        /* four zero bits */
+while (1) {                                     /* apply len2 zero bytes */
+    _gf2_square (even, odd);
+    if (len2 & 1)
+        crc1 = _gf2_times (even, crc1);
+    len2 >>= 1;
+    if (len2 == 0)
+        break;
+    _gf2_square (odd, even);
+    if (len2 & 1)
+        crc1 = _gf2_times (odd, crc1);
+    len2 >>= 1;
+    if (len2 == 0)
+        break;
+    }
+return crc1 ^ crc2;
+}
+
+static int _sim_disk_cpu_count (void)
+{
+#if defined (_WIN32)
+SYSTEM_INFO info;
+
+GetSystemInfo (&info);
+return (int)info.dwNumberOfProcessors;
+#elif defined (_SC_NPROCESSORS_ONLN)
+long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+return (n > 0) ? (int)n : 1;
+#else
+return 1;
+#endif
+}
+
+static void _disk_pipe_read (struct disk_pipe *p, struct disk_pipe_buf *b)
+{
+t_seccnt sects_read;
+
+b->status = sim_disk_rdsect (p->src, b->lba, b->data, &sects_read, b->sects);
+if ((b->status == SCPE_OK) && (sects_read != b->sects))
+    b->status = SCPE_IOERR;
+if ((b->status == SCPE_OK) && (p->flags & DK_COPY_COMPARE)) {
+    b->status = sim_disk_rdsect (p->dst, b->lba, b->cmp, &sects_read, b->sects);
+    if ((b->status == SCPE_OK) && (sects_read != b->sects))
+        b->status = SCPE_IOERR;
+    }
+}
+
+static void _disk_pipe_scan (struct disk_pipe *p, struct disk_pipe_buf *b)
+{
+size_t len = b->sects * p->sector_size;
+t_seccnt i;
+size_t j;
+
+if (b->status != SCPE_OK)
+    return;
+b->crc = eth_crc32 (0, b->data, len);
+if (p->flags & DK_COPY_SPARSE) {
+    for (i = 0; i < b->sects; i++) {
+        const uint8 *sector = b->data + i * p->sector_size;
+
+        for (j = 0; (j < p->sector_size) && (sector[j] == 0); j++)
+            ;
+        b->zero[i] = (j == p->sector_size);
+        }
+    }
+b->mismatch = b->sects;
+if ((p->flags & DK_COPY_COMPARE) && (memcmp (b->data, b->cmp, len) != 0)) {
+    for (i = 0; i < b->sects; i++)
+        if (memcmp (b->data + i * p->sector_size, b->cmp + i * p->sector_size, p->sector_size) != 0)
+            break;
+    b->mismatch = i;
+    }
+}
+
+/* Retire a buffer: write it to the destination or report a difference */
+
+static t_stat _disk_pipe_retire (struct disk_pipe *p, struct disk_pipe_buf *b, t_lba *zeros)
+{
+t_seccnt i, run, sects_written;
+t_stat r = SCPE_OK;
+
+if (b->status != SCPE_OK)
+    return b->status;
+if (b->mismatch < b->sects) {
+    sim_messagef (SCPE_OK, "\n%s: %s and %s differ at sector %u\n", sim_uname (p->src), p->src->filename, p->dst->filename, (uint32)(b->lba + b->mismatch));
+    return SCPE_IOERR;
+    }
+if (!(p->flags & DK_COPY_WRITE))
+    return SCPE_OK;
+if (!(p->flags & DK_COPY_SPARSE))
+    memset (b->zero, 0, b->sects);
+if ((b->lba + b->sects == p->total) &&              /* a SIMH file must extend */
+    (DK_GET_FMT (p->dst) == DKUF_F_STD))            /* to its last sector */
+    b->zero[b->sects - 1] = 0;
+for (i = 0; (i < b->sects) && (r == SCPE_OK); i += run) {
+    for (run = 1; (i + run < b->sects) && (b->zero[i + run] == b->zero[i]); run++)
+        ;
+    if (b->zero[i]) {
+        *zeros += run;
+        continue;
+        }
+    r = sim_disk_wrsect (p->dst, b->lba + i, b->data + i * p->sector_size, &sects_written, run);
+    if ((r == SCPE_OK) && (sects_written != run))
+        r = SCPE_IOERR;
+    }
+return r;
+}
+
+#if defined (SIM_ASYNCH_IO)
+static void *_disk_pipe_reader (void *arg)
+{
+struct disk_pipe *p = (struct disk_pipe *)arg;
+struct disk_pipe_buf *b;
+t_lba lba;
+int i;
+
+for (lba = 0, i = 0; lba < p->total; lba += b->sects, i = (i + 1) % p->nbufs) {
+    b = &p->buf[i];
+    pthread_mutex_lock (&p->lock);
+    while ((b->state != PB_FREE) && !p->stop)
+        pthread_cond_wait (&p->cond, &p->lock);
+    pthread_mutex_unlock (&p->lock);
+    if (p->stop)
+        break;
+    b->lba = lba;
+    b->sects = (p->total - lba < p->bufsects) ? (t_seccnt)(p->total - lba) : p->bufsects;
+    _disk_pipe_read (p, b);
+    pthread_mutex_lock (&p->lock);
+    b->state = PB_READ;
+    pthread_cond_broadcast (&p->cond);
+    pthread_mutex_unlock (&p->lock);
+    }
+return NULL;
+}
+
+static void *_disk_pipe_scanner (void *arg)
+{
+struct disk_pipe *p = (struct disk_pipe *)arg;
+struct disk_pipe_buf *b;
+int i;
+
+pthread_mutex_lock (&p->lock);
+while (!p->stop) {
+    for (b = NULL, i = 0; i < p->nbufs; i++)        /* oldest buffer to scan */
+        if ((p->buf[i].state == PB_READ) && ((b == NULL) || (p->buf[i].lba < b->lba)))
+            b = &p->buf[i];
+    if (b == NULL) {
+        pthread_cond_wait (&p->cond, &p->lock);
+        continue;
+        }
+    b->state = PB_SCAN;
+    pthread_mutex_unlock (&p->lock);
+    _disk_pipe_scan (p, b);
+    pthread_mutex_lock (&p->lock);
+    b->state = PB_DONE;
+    pthread_cond_broadcast (&p->cond);
+    }
+pthread_mutex_unlock (&p->lock);
+return NULL;
+}
+#endif
+
+/* Copy, compare or checksum a container
+
+   src and dst are attached units with the same sector size.  dst may be
+   NULL when only a checksum is wanted.  The CRC32 of the source's data is
+   returned in *crc when crc isn't NULL. */
+
+t_stat sim_disk_copy (UNIT *src, UNIT *dst, uint32 flags, uint32 *crc)
+{
+struct disk_context *ctx = (struct disk_context *)src->disk_ctx;
+DEVICE *dptr = find_dev_from_unit (src);
+struct disk_pipe *p;
+uint32 start = sim_os_msec (), last = start, now, ms;
+uint32 total_crc = 0;
+t_lba lba = 0, zeros = 0;
+const char *what = (flags & DK_COPY_WRITE) ? "Copied" : (flags & DK_COPY_COMPARE) ? "Compared" : "Checksummed";
+char zbuf[64] = "";
+double mb;
+t_stat r = SCPE_OK;
+int i;
+#if defined (SIM_ASYNCH_IO)
+pthread_t reader, scanner[DK_PIPE_BUFFERS];
+int scanners = 0;
+t_bool threaded = FALSE;
+#endif
+
+if ((ctx == NULL) || !(src->flags & UNIT_ATT) || (dptr == NULL))
+    return SCPE_UNATT;
+if (flags & (DK_COPY_WRITE | DK_COPY_COMPARE)) {
+    struct disk_context *dctx = (dst != NULL) ? (struct disk_context *)dst->disk_ctx : NULL;
+
+    if ((dctx == NULL) || !(dst->flags & UNIT_ATT))
+        return SCPE_UNATT;
+    if (dctx->sector_size != ctx->sector_size)
+        return sim_messagef (SCPE_ARG, "%s has %u byte sectors, %s has %u byte sectors\n",
+                             src->filename, (uint32)ctx->sector_size, dst->filename, (uint32)dctx->sector_size);
+    if ((flags & DK_COPY_WRITE) && (dst->flags & UNIT_RO))
+        return SCPE_RO;
+    }
+p = (struct disk_pipe *)calloc (1, sizeof (*p));
+if (p == NULL)
+    return SCPE_MEM;
+p->src = src;
+p->dst = dst;
+p->flags = flags;
+p->sector_size = ctx->sector_size;
+p->total = (t_lba)((((t_offset)src->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1))/ctx->sector_size);
+p->bufsects = (t_seccnt)(DK_PIPE_BUFSIZE / p->sector_size);
+p->nbufs = DK_PIPE_BUFFERS;
+#if !defined (SIM_ASYNCH_IO)
+p->nbufs = 1;
+#endif
+for (i = 0; (i < p->nbufs) && (r == SCPE_OK); i++) {
+    p->buf[i].data = (uint8 *)malloc (p->bufsects * p->sector_size);
+    p->buf[i].zero = (uint8 *)malloc (p->bufsects);
+    if (flags & DK_COPY_COMPARE)
+        p->buf[i].cmp = (uint8 *)malloc (p->bufsects * p->sector_size);
+    if ((p->buf[i].data == NULL) || (p->buf[i].zero == NULL) ||
+        ((flags & DK_COPY_COMPARE) && (p->buf[i].cmp == NULL)))
+        r = SCPE_MEM;
+    }
+#if defined (SIM_ASYNCH_IO)
+if (r == SCPE_OK) {
+    int cpus = _sim_disk_cpu_count () - 2;          /* besides the reader and retirer */
+
+    if (cpus > DK_PIPE_BUFFERS - 2)
+        cpus = DK_PIPE_BUFFERS - 2;
+    if (cpus < 1)
+        cpus = 1;
+
+    pthread_mutex_init (&p->lock, NULL);
+    pthread_cond_init (&p->cond, NULL);
+    threaded = (0 == pthread_create (&reader, NULL, _disk_pipe_reader, (void *)p));
+    for (scanners = 0; threaded && (scanners < cpus); scanners++)
+        if (0 != pthread_create (&scanner[scanners], NULL, _disk_pipe_scanner, (void *)p))
+            break;
+    if (threaded && (scanners == 0)) {              /* scan in this thread */
+        p->stop = TRUE;
+        pthread_cond_broadcast (&p->cond);
+        pthread_join (reader, NULL);
+        threaded = FALSE;
+        }
+    if (!threaded) {
+        pthread_mutex_destroy (&p->lock);
+        pthread_cond_destroy (&p->cond);
+        p->stop = FALSE;
+        for (i = 0; i < p->nbufs; i++)
+            p->buf[i].state = PB_FREE;
+        }
+    }
+#endif
+for (i = 0; (lba < p->total) && (r == SCPE_OK); i = (i + 1) % p->nbufs) {
+    struct disk_pipe_buf *b = &p->buf[i];
+
+#if defined (SIM_ASYNCH_IO)
+    if (threaded) {
+        pthread_mutex_lock (&p->lock);
+        while (b->state != PB_DONE)
+            pthread_cond_wait (&p->cond, &p->lock);
+        pthread_mutex_unlock (&p->lock);
+        }
+    else
+#endif
+        {
+        b->lba = lba;
+        b->sects = (p->total - lba < p->bufsects) ? (t_seccnt)(p->total - lba) : p->bufsects;
+        _disk_pipe_read (p, b);
+        _disk_pipe_scan (p, b);
+        }
+    r = _disk_pipe_retire (p, b, &zeros);
+    total_crc = _sim_disk_crc32_combine (total_crc, b->crc, (t_offset)b->sects * p->sector_size);
+    lba += b->sects;
+#if defined (SIM_ASYNCH_IO)
+    if (threaded) {
+        pthread_mutex_lock (&p->lock);
+        b->state = PB_FREE;
+        pthread_cond_broadcast (&p->cond);
+        pthread_mutex_unlock (&p->lock);
+        }
+#endif
+    now = sim_os_msec ();
+    if ((now - last >= 1000) && (r == SCPE_OK)) {
+        last = now;
+        mb = ((double)lba * p->sector_size) / 1000000.0;
+        sim_messagef (SCPE_OK, "%s: %s %.0f/%.0fMB.  %d%% complete.  %.1fMB/s\r", src->filename, what, mb,
+                      ((double)p->total * p->sector_size) / 1000000.0, (int)((((float)lba)*100)/p->total), mb * 1000.0 / (now - start));
+        }
+    }
+#if defined (SIM_ASYNCH_IO)
+if (threaded) {
+    pthread_mutex_lock (&p->lock);
+    p->stop = TRUE;
+    pthread_cond_broadcast (&p->cond);
+    pthread_mutex_unlock (&p->lock);
+    pthread_join (reader, NULL);
+    for (i = 0; i < scanners; i++)
+        pthread_join (scanner[i], NULL);
+    pthread_mutex_destroy (&p->lock);
+    pthread_cond_destroy (&p->cond);
+    }
+#endif
+for (i = 0; i < p->nbufs; i++) {
+    free (p->buf[i].data);
+    free (p->buf[i].cmp);
+    free (p->buf[i].zero);
+    }
+if (r == SCPE_OK) {
+    ms = sim_os_msec () - start;
+    if (ms == 0)
+        ms = 1;
+    mb = ((double)p->total * p->sector_size) / 1000000.0;
+    if (flags & DK_COPY_SPARSE)
+        snprintf (zbuf, sizeof (zbuf), ", %u sectors of zeros left unwritten", (uint32)zeros);
+    sim_messagef (SCPE_OK, "%s: %s %u sectors (%.1fMB) in %.2f seconds, %.1fMB/s%s\n", src->filename, what, (uint32)p->total, mb, ms / 1000.0, mb * 1000.0 / ms, zbuf);
+    if (crc)
+        *crc = total_crc;
+    }
+free (p);
+return r;
+}
+
+/* Snapshots
+
+   SNAPSHOT <unit> {file} puts a new differencing VHD over the unit's VHD
+   container.  The data the unit held at that moment is preserved in the
+   container, which becomes read only, and subsequent writes go to the
+   snapshot.  Only the container handle changes; transfers which were
+   queued are completed first and the guest carries on as before.
+
+   ROLLBACK <unit> discards the most recent snapshot and returns the unit
+   to its parent.  COMMIT <unit> merges the snapshot into its parent and
+   then attaches the unit to the parent.  Merging is done by a background
+   thread while the unit remains in use; writes made meanwhile go to both
+   the snapshot and the parent.  The switch to the parent is made when the
+   merge has finished, the next time the simulator stops (or a snapshot
+   command, SAVE or DETACH needs it to).
+
+   A snapshot is an ordinary differencing VHD, so it can be detached and
+   later attached again, and a SAVE of a unit with a snapshot records the
+   snapshot as the unit's container.  RESTORE then reattaches it with its
+   chain of parents, which must not be rolled back or committed between
+   the SAVE and the RESTORE. */
+
+#define DK_SNAPSHOT 0
+#define DK_ROLLBACK 1
+#define DK_COMMIT   2
+
+static void _sim_disk_commit_finish (UNIT *uptr)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_commit *c = ctx->commit;
+char overlay[CBUFSIZE];
+
+#if defined (SIM_ASYNCH_IO)
+if (c->threaded)
+    pthread_join (c->thread, NULL);
+sim_disk_clr_async (uptr);                      /* nothing in flight while switching */
+#endif
+ctx->commit = NULL;
+#if defined (SIM_ASYNCH_IO)
+if (c->threaded)
+    pthread_mutex_destroy (&c->lock);
+#endif
+if (c->status == SCPE_OK) {
+    strlcpy (overlay, uptr->filename, sizeof (overlay));
+    sim_vhd_disk_close (uptr->fileref);
+    uptr->fileref = c->parent;
+    strlcpy (uptr->filename, c->parent_path, CBUFSIZE);
+    (void)remove (overlay);
+    sim_messagef (SCPE_OK, "%s: Committed %s into %s\n", sim_uname (uptr), overlay, c->parent_path);
+    }
+else {
+    sim_vhd_disk_close (c->parent);
+    sim_messagef (SCPE_OK, "%s: Commit of %s failed: %s\n", sim_uname (uptr), uptr->filename, sim_error_text (c->status));
+    }
+free (c);
+#if defined (SIM_ASYNCH_IO)
+if (sim_asynch_enabled)
+    sim_disk_set_async (uptr, ctx->asynch_io_latency);
+#endif
+}
+
+/* Complete a commit whose merging has finished, or wait for one to finish */
+
+static void _sim_disk_commit_poll (UNIT *uptr, t_bool wait)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+
+if ((ctx == NULL) || (ctx->commit == NULL))
+    return;
+if (wait || ctx->commit->done)
+    _sim_disk_commit_finish (uptr);
+}
+
+#if defined (SIM_ASYNCH_IO)
+static void *_disk_commit_thread (void *arg)
+{
+UNIT *uptr = (UNIT *)arg;
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_commit *c = ctx->commit;
+t_bool done = FALSE;
+
+while (!done) {
+    pthread_mutex_lock (&c->lock);
+    if ((c->next < c->blocks) && (c->status == SCPE_OK))
+        c->status = sim_vhd_disk_merge_block (uptr->fileref, c->parent, c->next++);
+    else
+        done = c->done = TRUE;
+    pthread_mutex_unlock (&c->lock);
+    }
+return NULL;
+}
+#endif
+
+static t_stat _sim_disk_snapshot (UNIT *uptr, const char *name)
+{
+char snapshot[CBUFSIZE];
+struct stat statb;
+FILE *f;
+
+if (*name)
+    strlcpy (snapshot, name, sizeof (snapshot));
+else {                                          /* <container>-snapN.vhd */
+    char *base = sim_filepath_parts (uptr->filename, "pn");
+    char *suffix;
+    int n;
+
+    if (base == NULL)
+        return SCPE_MEM;
+    suffix = strstr (base, "-snap");
+    while (suffix && strstr (suffix + 1, "-snap"))
+        suffix = strstr (suffix + 1, "-snap");
+    if (suffix && (suffix[5] != '\0') && (strspn (suffix + 5, "0123456789") == strlen (suffix + 5)))
+        *suffix = '\0';                         /* a snapshot of a snapshot */
+    for (n = 1; ; n++) {
+        snprintf (snapshot, sizeof (snapshot), "%s-snap%d.vhd", base, n);
+        if (sim_stat (snapshot, &statb) != 0)
+            break;
         }
+    free (base);
     }
+if (sim_stat (snapshot, &statb) == 0)
+    return sim_messagef (SCPE_ARG, "%s: Snapshot file already exists: %s\n", sim_uname (uptr), snapshot);
+_sim_disk_io_flush (uptr);                      /* complete transfers and write back */
+f = sim_vhd_disk_create_diff (snapshot, uptr->filename);
+if (f == NULL)
+    return sim_messagef (SCPE_OPENERR, "%s: Can't create snapshot %s: %s\n", sim_uname (uptr), snapshot, strerror (errno));
+sim_vhd_disk_close (uptr->fileref);
+uptr->fileref = f;
+strlcpy (uptr->filename, snapshot, CBUFSIZE);
+return sim_messagef (SCPE_OK, "%s: Snapshot taken, now writing to %s\n", sim_uname (uptr), snapshot);
 }
 
-t_stat sim_disk_info_cmd (int32 flag, CONST char *cptr)
+static t_stat _sim_disk_rollback (UNIT *uptr)
 {
-DISK_INFO_CTX disk_info_state;
-t_stat stat;
+char snapshot[CBUFSIZE], parent[CBUFSIZE];
+FILE *f;
+
+strlcpy (parent, sim_vhd_disk_parent_path (uptr->fileref), sizeof (parent));
+strlcpy (snapshot, uptr->filename, sizeof (snapshot));
+_sim_disk_io_flush (uptr);
+f = sim_vhd_disk_open (parent, "rb+");
+if (f == NULL)
+    return sim_messagef (SCPE_OPENERR, "%s: Can't open %s: %s\n", sim_uname (uptr), parent, strerror (errno));
+_sim_disk_cache_free (uptr);                    /* it holds the snapshot's data */
+sim_vhd_disk_close (uptr->fileref);
+uptr->fileref = f;
+strlcpy (uptr->filename, parent, CBUFSIZE);
+(void)remove (snapshot);
+_sim_disk_cache_attach (uptr);
+return sim_messagef (SCPE_OK, "%s: Discarded %s, now using %s\n", sim_uname (uptr), snapshot, parent);
+}
+
+static t_stat _sim_disk_commit (UNIT *uptr)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+struct disk_commit *c = (struct disk_commit *)calloc (1, sizeof (*c));
+t_stat r;
+
+if (c == NULL)
+    return SCPE_MEM;
+strlcpy (c->parent_path, sim_vhd_disk_parent_path (uptr->fileref), sizeof (c->parent_path));
+_sim_disk_io_flush (uptr);
+c->parent = sim_vhd_disk_open (c->parent_path, "rb+");
+if (c->parent == NULL) {
+    r = sim_messagef (SCPE_OPENERR, "%s: Can't open %s for update: %s\n", sim_uname (uptr), c->parent_path, strerror (errno));
+    free (c);
+    return r;
+    }
+c->blocks = sim_vhd_disk_block_count (uptr->fileref);
+sim_messagef (SCPE_OK, "%s: Committing %s into %s\n", sim_uname (uptr), uptr->filename, c->parent_path);
+ctx->commit = c;
+#if defined (SIM_ASYNCH_IO)
+pthread_mutex_init (&c->lock, NULL);
+c->threaded = TRUE;
+if (0 == pthread_create (&c->thread, NULL, _disk_commit_thread, (void *)uptr))
+    return SCPE_OK;
+c->threaded = FALSE;
+pthread_mutex_destroy (&c->lock);
+#endif
+for (; (c->next < c->blocks) && (c->status == SCPE_OK); c->next++)
+    c->status = sim_vhd_disk_merge_block (uptr->fileref, c->parent, c->next);
+c->done = TRUE;
+r = c->status;
+_sim_disk_commit_finish (uptr);
+return r;
+}
+
+t_stat sim_disk_snapshot_cmd (int32 flag, CONST char *cptr)
+{
+char gbuf[CBUFSIZE];
+DEVICE *dptr;
+UNIT *uptr;
+struct disk_context *ctx;
 
 if ((!cptr) || (*cptr == 0))
     return SCPE_2FARG;
 GET_SWITCHES (cptr);                                    /* get switches */
-memset (&disk_info_state, 0, sizeof (disk_info_state));
-disk_info_state.flag = flag;
-stat = sim_dir_scan (cptr, sim_disk_info_entry, &disk_info_state);
-if (stat == SCPE_OK)
-    return disk_info_state.stat;
-return sim_messagef (SCPE_OK, "No such file or directory: %s\n", cptr);
+cptr = get_glyph (cptr, gbuf, 0);                       /* get unit */
+dptr = find_unit (gbuf, &uptr);
+if (dptr == NULL)
+    return SCPE_NXDEV;
+if (uptr == NULL)
+    return SCPE_NXUN;
+if ((!(uptr->flags & UNIT_ATT)) ||
+    (uptr->io_flush != _sim_disk_io_flush))             /* not a disk container? */
+    return sim_messagef (SCPE_UNATT, "%s: No disk container is attached\n", sim_uname (uptr));
+get_glyph_nc (cptr, gbuf, 0);                           /* snapshot file name */
+if ((flag != DK_SNAPSHOT) && (gbuf[0] != '\0'))
+    return SCPE_2MARG;
+ctx = (struct disk_context *)uptr->disk_ctx;
+if (DK_GET_FMT (uptr) != DKUF_F_VHD)
+    return sim_messagef (SCPE_NOFNC, "%s: Snapshots need a VHD format container, %s is %s format\n", sim_uname (uptr), uptr->filename, sim_disk_fmt (uptr));
+if (uptr->flags & UNIT_RO)
+    return sim_messagef (SCPE_RO, "%s: %s is read only\n", sim_uname (uptr), uptr->filename);
+_sim_disk_commit_poll (uptr, FALSE);
+if (ctx->commit)
+    return sim_messagef (SCPE_NOFNC, "%s: A commit of %s is in progress\n", sim_uname (uptr), uptr->filename);
+if ((flag != DK_SNAPSHOT) && (sim_vhd_disk_parent_path (uptr->fileref) == NULL))
+    return sim_messagef (SCPE_NOFNC, "%s: %s isn't a snapshot\n", sim_uname (uptr), uptr->filename);
+switch (flag) {
+    case DK_SNAPSHOT:
+        return _sim_disk_snapshot (uptr, gbuf);
+    case DK_ROLLBACK:
+        return _sim_disk_rollback (uptr);
+    default:
+        return _sim_disk_commit (uptr);
+    }
+}
+
+/* Wait for a unit's commit to finish, so its container stays put (SAVE) */
+
+t_stat sim_disk_snapshot_wait (UNIT *uptr)
+{
+if ((uptr->flags & UNIT_ATT) && (uptr->io_flush == _sim_disk_io_flush))
+    _sim_disk_commit_poll (uptr, TRUE);
+return SCPE_OK;
 }
 
 /* disk testing */
@@ -6740,6 +10765,85 @@ struct disk_test_coverage {
     uint32 *data;
     };
 
+/* Queued requests: a burst of overlapping writes followed by reads of the
+   same area must find the data of the last write to each sector, however
+   the unit's I/O threads happen to interleave them. */
+
+#define DISK_TEST_QUEUED    32
+
+struct disk_test_request {
+    uint32 *data;
+    t_seccnt done;
+    t_stat status;
+    t_bool completed;
+    };
+
+static void _sim_disk_test_queued_done (UNIT *uptr, t_stat status, void *arg)
+{
+struct disk_test_request *q = (struct disk_test_request *)arg;
+
+q->status = status;
+q->completed = TRUE;
+}
+
+static t_stat sim_disk_test_queued (UNIT *uptr, struct disk_test_coverage *c)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+uint32 uint32s_per_sector = (ctx->sector_size / sizeof (*c->data));
+t_seccnt span = (c->max_xfer_sectors < 16) ? c->max_xfer_sectors : 16;
+t_lba area = (c->total_sectors < 4 * span) ? c->total_sectors : 4 * span;
+struct disk_test_request q[2 * DISK_TEST_QUEUED];
+uint32 *expected = (uint32 *)malloc (area * sizeof (*expected));
+t_lba lba, reads;
+t_seccnt sects;
+uint32 i, j;
+t_stat r = SCPE_OK;
+
+memset (q, 0, sizeof (q));
+for (lba = 0; lba < area; lba++)
+    expected[lba] = lba;                        /* as written by the exercise */
+for (i = 0; i < DISK_TEST_QUEUED; i++) {
+    lba = rand () % area;
+    sects = 1 + rand () % span;
+    if (lba + sects > area)
+        sects = area - lba;
+    q[i].data = (uint32 *)malloc (sects * ctx->sector_size);
+    for (j = 0; j < sects * uint32s_per_sector; j++)
+        q[i].data[j] = (lba + j / uint32s_per_sector) ^ ((i + 1) << 24);
+    for (j = 0; j < sects; j++)
+        expected[lba + j] = (lba + j) ^ ((i + 1) << 24);
+    sim_disk_wrsect_q (uptr, lba, (uint8 *)q[i].data, &q[i].done, sects, _sim_disk_test_queued_done, &q[i]);
+    }
+for (lba = 0, reads = 0; lba < area; lba += span, reads++) {
+    sects = (lba + span > area) ? (t_seccnt)(area - lba) : span;
+    q[i + reads].data = (uint32 *)malloc (sects * ctx->sector_size);
+    sim_disk_rdsect_q (uptr, lba, (uint8 *)q[i + reads].data, &q[i + reads].done, sects, _sim_disk_test_queued_done, &q[i + reads]);
+    }
+sim_cancel (uptr);                              /* wait for and deliver completions */
+for (i = 0; i < DISK_TEST_QUEUED + reads; i++) {
+    if (!q[i].completed || (q[i].status != SCPE_OK)) {
+        sim_printf ("Queued request %u %s\n", i, q[i].completed ? sim_error_text (q[i].status) : "never completed");
+        r = SCPE_IERR;
+        }
+    }
+for (lba = 0, i = DISK_TEST_QUEUED; (r == SCPE_OK) && (lba < area); lba += span, i++) {
+    sects = (lba + span > area) ? (t_seccnt)(area - lba) : span;
+    for (j = 0; j < sects * uint32s_per_sector; j++)
+        if (q[i].data[j] != expected[lba + j / uint32s_per_sector]) {
+            sim_printf ("Queued read of sector %u has unexpected data at offset 0x%X: 0x%08X, expected 0x%08X\n",
+                        lba + j / uint32s_per_sector, (j % uint32s_per_sector) * (uint32)sizeof (*c->data), q[i].data[j], expected[lba + j / uint32s_per_sector]);
+            r = SCPE_IERR;
+            break;
+            }
+    }
+for (i = 0; i < DISK_TEST_QUEUED + reads; i++)
+    free (q[i].data);
+free (expected);
+if (r == SCPE_OK)
+    sim_printf("Queued I/O OK (queue depth %u)\n", sim_disk_queue_depth (uptr));
+return r;
+}
+
 static t_stat sim_disk_test_exercise (UNIT *uptr)
 {
 struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
@@ -6851,6 +10955,8 @@ if (!(uptr->flags & UNIT_RO)) { /* Only test drives open Read/Write - Read Only
                 r = SCPE_IERR;
             }
         }
+    if (r == SCPE_OK)
+        r = sim_disk_test_queued (uptr, c);
     }
 free (c->data);
 free (c->wbitmap);
@@ -7083,9 +11189,522 @@ sim_free_filelist (&tarfiles);
 return SCPE_OK;
 }
 
+/* The number of 512 byte sectors a test can use on a unit: the area it
+   wants, but no more than the unit's capacity */
+
+static t_lba _sim_disk_test_area (UNIT *uptr, t_lba want)
+{
+DEVICE *dptr = find_dev_from_unit (uptr);
+uint32 capac_factor = ((dptr->dwidth / dptr->aincr) >= 32) ? 8 : ((dptr->dwidth / dptr->aincr) == 16) ? 2 : 1; /* capacity units (quadword: 8, word: 2, byte: 1) */
+t_lba total = (t_lba)((((t_offset)uptr->capac)*capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1))/512);
+
+return (total < want) ? total : want;
+}
+
+/* Differencing VHD chain test
+
+   Each level of a chain of differencing VHDs writes its own set of
+   sectors, some of them replacing sectors written by a lower level.
+   Reading through the top of the chain must return the newest data. */
+
+#define DISK_TEST_CHAIN_DEPTH   4
+
+static uint32 _sim_disk_test_chain_level (t_lba lba, int depth)
+{
+int level;
+
+for (level = depth - 1; level >= 0; level--)
+    if (((lba % (DISK_TEST_CHAIN_DEPTH + 1)) == (t_lba)level) ||
+        ((level > 0) && ((lba % 97) == (t_lba)level)))
+        return level + 1;
+return 0;                                       /* never written */
+}
+
+static t_stat sim_disk_vhd_chain_test (DEVICE *dptr)
+{
+UNIT *uptr = &dptr->units[0];
+t_lba area = _sim_disk_test_area (uptr, 3 * 4096 + 17); /* sectors spanning several VHD blocks */
+uint32 *data = (uint32 *)malloc (64 * 512);
+int32 saved_switches = sim_switches;
+char name[DISK_TEST_CHAIN_DEPTH][32];
+char info[200];
+t_lba lba;
+t_seccnt sects, done;
+uint32 i, level, expected;
+int depth;
+t_stat r = SCPE_OK;
+
+if ((data == NULL) || (sim_vhd_disk_implemented () != SCPE_OK)) {
+    free (data);
+    return SCPE_OK;
+    }
+sim_printf ("\n*** Differencing VHD chain tests\n");
+sim_switches = 0;                               /* plain attaches (not -D, -R, ...) */
+for (depth = 0; (depth < DISK_TEST_CHAIN_DEPTH) && (r == SCPE_OK); depth++) {
+    snprintf (name[depth], sizeof (name[depth]), "Test-Chain-%d.vhd", depth);
+    (void)remove (name[depth]);
+    if (depth > 0) {
+        FILE *vhd = sim_vhd_disk_create_diff (name[depth], name[depth - 1]);
+
+        if (vhd == NULL) {
+            r = sim_messagef (SCPE_OPENERR, "Can't create differencing VHD %s\n", name[depth]);
+            break;
+            }
+        sim_vhd_disk_close (vhd);
+        }
+    sim_disk_set_fmt (uptr, 0, "VHD", NULL);
+    r = sim_disk_attach_ex (uptr, name[depth], 512, 1, TRUE, 0, NULL, 0, 0, NULL);
+    for (lba = 0; (lba < area) && (r == SCPE_OK); lba++) {
+        if (_sim_disk_test_chain_level (lba, depth + 1) != (uint32)(depth + 1))
+            continue;
+        for (i = 0; i < 512 / sizeof (*data); i++)
+            data[i] = lba | ((depth + 1) << 24);
+        r = sim_disk_wrsect (uptr, lba, (uint8 *)data, &done, 1);
+        }
+    if (depth < DISK_TEST_CHAIN_DEPTH - 1)
+        sim_disk_detach (uptr);
+    }
+if (r == SCPE_OK) {
+    srand (0);
+    for (lba = 0; (lba < area) && (r == SCPE_OK); lba += done) {
+        sects = 1 + (rand () % 64);
+        if (lba + sects > area)
+            sects = (t_seccnt)(area - lba);
+        r = sim_disk_rdsect (uptr, lba, (uint8 *)data, &done, sects);
+        if ((r == SCPE_OK) && (done != sects))
+            r = SCPE_INCOMP;
+        for (i = 0; (r == SCPE_OK) && (i < done * (512 / sizeof (*data))); i++) {
+            level = _sim_disk_test_chain_level (lba + i / (512 / sizeof (*data)), DISK_TEST_CHAIN_DEPTH);
+            expected = level ? ((lba + i / (512 / sizeof (*data))) | (level << 24)) : 0;
+            if (data[i] != expected) {
+                sim_printf ("Chain read of sector %u has unexpected data: 0x%08X, expected 0x%08X\n",
+                            (uint32)(lba + i / (512 / sizeof (*data))), data[i], expected);
+                r = SCPE_IERR;
+                }
+            }
+        }
+    }
+if (r == SCPE_OK) {
+    sim_vhd_disk_chain_info (uptr->fileref, info, sizeof (info));
+    sim_printf ("%s\n", info);
+    if (strstr (info, "file reads per read") == NULL)
+        r = SCPE_IERR;
+    }
+sim_disk_detach (uptr);
+for (depth = DISK_TEST_CHAIN_DEPTH - 1; depth >= 0; depth--)
+    (void)remove (name[depth]);
+free (data);
+sim_switches = saved_switches;
+if (r == SCPE_OK)
+    sim_printf ("Differencing chain OK\n");
+return r;
+}
+
+/* Snapshot test
+
+   Sectors written after a SNAPSHOT disappear on ROLLBACK.  Sectors
+   written before and during a COMMIT are all in the parent afterwards. */
+
+static t_stat _sim_disk_test_snap_fill (UNIT *uptr, t_lba first, t_lba last, uint32 tag)
+{
+uint32 data[512 / sizeof (uint32)];
+t_seccnt done;
+t_lba lba;
+uint32 i;
+t_stat r = SCPE_OK;
+
+for (lba = first; (lba < last) && (r == SCPE_OK); lba++) {
+    for (i = 0; i < 512 / sizeof (*data); i++)
+        data[i] = lba | (tag << 24);
+    r = sim_disk_wrsect (uptr, lba, (uint8 *)data, &done, 1);
+    }
+return r;
+}
+
+static t_stat _sim_disk_test_snap_check (UNIT *uptr, t_lba first, t_lba last, uint32 tag)
+{
+uint32 data[512 / sizeof (uint32)];
+t_seccnt done;
+t_lba lba;
+t_stat r = SCPE_OK;
+
+for (lba = first; (lba < last) && (r == SCPE_OK); lba++) {
+    r = sim_disk_rdsect (uptr, lba, (uint8 *)data, &done, 1);
+    if ((r == SCPE_OK) && (data[0] != (lba | (tag << 24)))) {
+        sim_printf ("Snapshot read of sector %u has unexpected data: 0x%08X, expected 0x%08X\n",
+                    (uint32)lba, data[0], lba | (tag << 24));
+        r = SCPE_IERR;
+        }
+    }
+return r;
+}
+
+static t_bool _sim_disk_test_snap_using (UNIT *uptr, const char *name)
+{
+size_t len = strlen (uptr->filename);
+
+return (len >= strlen (name)) && (strcmp (uptr->filename + len - strlen (name), name) == 0);
+}
+
+static t_stat sim_disk_snapshot_test (DEVICE *dptr)
+{
+UNIT *uptr = &dptr->units[0];
+t_lba area = _sim_disk_test_area (uptr, 5 * 4096); /* sectors spanning several VHD blocks */
+const char *base = "Test-Snap.vhd";
+char cmd[CBUFSIZE];
+int32 saved_switches = sim_switches;
+t_stat r;
+
+if (sim_vhd_disk_implemented () != SCPE_OK)
+    return SCPE_OK;
+sim_printf ("\n*** VHD snapshot tests\n");
+sim_switches = 0;                               /* plain attaches (not -D, -R, ...) */
+(void)remove (base);
+sim_disk_set_fmt (uptr, 0, "VHD", NULL);
+r = sim_disk_attach_ex (uptr, base, 512, 1, TRUE, 0, NULL, 0, 0, NULL);
+snprintf (cmd, sizeof (cmd), "%s Test-Snap-1.vhd", sim_uname (uptr));
+if (r == SCPE_OK)
+    r = _sim_disk_test_snap_fill (uptr, 0, area, 1);
+if (r == SCPE_OK)
+    r = sim_disk_snapshot_cmd (DK_SNAPSHOT, cmd);
+if (r == SCPE_OK)
+    r = _sim_disk_test_snap_fill (uptr, area / 3, area, 2);
+if (r == SCPE_OK)
+    r = _sim_disk_test_snap_check (uptr, area / 3, area, 2);
+if (r == SCPE_OK)
+    r = sim_disk_snapshot_cmd (DK_ROLLBACK, sim_uname (uptr));
+if ((r == SCPE_OK) && !_sim_disk_test_snap_using (uptr, base))
+    r = SCPE_IERR;
+if (r == SCPE_OK)
+    r = _sim_disk_test_snap_check (uptr, 0, area, 1);
+if (r == SCPE_OK)
+    r = sim_disk_snapshot_cmd (DK_SNAPSHOT, cmd);
+if (r == SCPE_OK)
+    r = _sim_disk_test_snap_fill (uptr, 0, area / 2, 3);
+if (r == SCPE_OK)
+    r = sim_disk_snapshot_cmd (DK_COMMIT, sim_uname (uptr));
+if (r == SCPE_OK)                               /* while merging */
+    r = _sim_disk_test_snap_fill (uptr, area / 4, 3 * area / 4, 4);
+sim_disk_snapshot_wait (uptr);
+if ((r == SCPE_OK) && !_sim_disk_test_snap_using (uptr, base))
+    r = SCPE_IERR;
+sim_disk_detach (uptr);
+if (r == SCPE_OK)
+    r = sim_disk_attach_ex (uptr, base, 512, 1, TRUE, 0, NULL, 0, 0, NULL);
+if (r == SCPE_OK)
+    r = _sim_disk_test_snap_check (uptr, 0, area / 4, 3);
+if (r == SCPE_OK)
+    r = _sim_disk_test_snap_check (uptr, area / 4, 3 * area / 4, 4);
+if (r == SCPE_OK)
+    r = _sim_disk_test_snap_check (uptr, 3 * area / 4, area, 1);
+sim_disk_detach (uptr);
+(void)remove ("Test-Snap-1.vhd");
+(void)remove (base);
+sim_switches = saved_switches;
+if (r == SCPE_OK)
+    sim_printf ("Snapshot, rollback and commit OK\n");
+return r;
+}
+
+/* Bulk copy test
+
+   A SIMH format container with scattered data is copied to a sparse VHD.
+   The copy must compare equal, leave the zeros unwritten and have the
+   same CRC32 as a sequential reading of the source. */
+
+static t_stat sim_disk_copy_test (DEVICE *dptr)
+{
+UNIT *src = &dptr->units[0];
+UNIT *dst = &dptr->units[1];
+t_addr saved_capac = dst->capac;
+t_lba area = _sim_disk_test_area (src, 40000);
+int32 saved_switches = sim_switches;
+uint32 data[512 / sizeof (uint32)];
+uint32 crc = 0, copy_crc = 0, dst_crc = 0;
+t_seccnt done;
+t_lba lba;
+uint32 i;
+t_stat r;
+
+if (sim_vhd_disk_implemented () != SCPE_OK)
+    return SCPE_OK;
+sim_printf ("\n*** Bulk copy tests\n");
+sim_switches = 0;                               /* plain attaches (not -D, -R, ...) */
+(void)remove ("Test-Copy.dsk");
+(void)remove ("Test-Copy.vhd");
+sim_disk_set_fmt (src, 0, "SIMH", NULL);
+r = sim_disk_attach_ex (src, "Test-Copy.dsk", 512, 1, TRUE, 0, NULL, 0, 0, NULL);
+for (lba = 0; (lba < area) && (r == SCPE_OK); lba += 1 + (lba % 13) * 37) {
+    for (i = 0; i < 512 / sizeof (*data); i++)
+        data[i] = lba * 7 + i;
+    r = sim_disk_wrsect (src, lba, (uint8 *)data, &done, 1);
+    }
+if (r == SCPE_OK) {
+    struct disk_context *ctx = (struct disk_context *)src->disk_ctx;
+    t_lba total = (t_lba)((((t_offset)src->capac)*ctx->capac_factor*((dptr->flags & DEV_SECTORS) ? 512 : 1))/512);
+    uint8 *buf = (uint8 *)malloc (256 * 512);
+
+    if (buf == NULL)
+        r = SCPE_MEM;
+    for (lba = 0; (lba < total) && (r == SCPE_OK); lba += done) {
+        r = sim_disk_rdsect (src, lba, buf, &done, (total - lba < 256) ? (t_seccnt)(total - lba) : 256);
+        crc = eth_crc32 (crc, buf, done * 512);
+        }
+    free (buf);
+    }
+sim_disk_set_fmt (dst, 0, "VHD", NULL);
+dst->capac = src->capac;
+if (r == SCPE_OK)
+    r = sim_disk_attach_ex (dst, "Test-Copy.vhd", 512, 1, TRUE, 0, NULL, 0, 0, NULL);
+if (r == SCPE_OK)
+    r = sim_disk_copy (src, dst, DK_COPY_WRITE | DK_COPY_SPARSE, &copy_crc);
+if (r == SCPE_OK)
+    r = sim_disk_copy (src, dst, DK_COPY_COMPARE, NULL);
+if (r == SCPE_OK)
+    r = sim_disk_copy (dst, NULL, 0, &dst_crc);
+if ((r == SCPE_OK) && ((copy_crc != crc) || (dst_crc != crc)))
+    r = sim_messagef (SCPE_IERR, "CRC32 mismatch: sequential 0x%08X, copy 0x%08X, destination 0x%08X\n", crc, copy_crc, dst_crc);
+if ((r == SCPE_OK) && (sim_fsize_name ("Test-Copy.vhd") > 2 * area * 512))
+    r = sim_messagef (SCPE_IERR, "Sparse copy wrote zeros\n");
+if (r == SCPE_OK) {                             /* a difference must be found */
+    memset (data, 0xFF, sizeof (data));
+    r = sim_disk_wrsect (dst, area / 2, (uint8 *)data, &done, 1);
+    if (r == SCPE_OK)
+        r = (sim_disk_copy (src, dst, DK_COPY_COMPARE, NULL) == SCPE_OK) ? SCPE_IERR : SCPE_OK;
+    }
+sim_disk_detach (src);
+sim_disk_detach (dst);
+dst->capac = saved_capac;
+(void)remove ("Test-Copy.dsk");
+(void)remove ("Test-Copy.vhd");
+sim_switches = saved_switches;
+if (r == SCPE_OK)
+    sim_printf ("Bulk copy OK\n");
+return r;
+}
+
+/* Zeros written by a guest, and sectors unmapped, must read as zeros
+   and shouldn't hold storage: a SIMH container gets holes (where the
+   host can punch them) and a dynamic VHD releases whole blocks, which
+   is visible as the container growing when they are written again. */
+
+static t_offset _sim_disk_test_allocated (UNIT *uptr, const char *filename)
+{
+#if defined (DISK_PUNCH_HOLE)
+struct stat statb;
+
+if ((DK_GET_FMT (uptr) == DKUF_F_STD) && (stat (filename, &statb) == 0))
+    return (t_offset)statb.st_blocks * 512;
+#endif
+return 0;
+}
+
+static t_stat sim_disk_trim_test (DEVICE *dptr)
+{
+UNIT *uptr = &dptr->units[0];
+const char *fmt[] = {"SIMH", "VHD", NULL};
+const char *name[] = {"Test-Trim.dsk", "Test-Trim.vhd", NULL};
+t_lba block = (2*1024*1024) / 512;                  /* default VHD block size */
+t_lba area = _sim_disk_test_area (uptr, 3 * block);
+uint8 *buf, *zeros;
+int32 saved_switches = sim_switches;
+t_offset before, after;
+t_seccnt done;
+t_lba lba;
+int f;
+t_stat r = SCPE_OK;
+
+if ((area < 3 * block) ||                           /* unit smaller than 3 VHD blocks? */
+    (sim_vhd_disk_implemented () != SCPE_OK)) {
+    fmt[1] = NULL;                                  /* SIMH format only, */
+    block = (area / 3) & ~(t_lba)255;               /* in smaller pieces */
+    }
+buf = (uint8 *)malloc (block * 512);
+zeros = (uint8 *)calloc (block, 512);
+if ((buf == NULL) || (zeros == NULL) || (block == 0))
+    r = SCPE_MEM;
+sim_printf ("\n*** Zero sector and unmap tests\n");
+sim_switches = 0;                                   /* plain attaches (not -D, -R, ...) */
+for (f = 0; (fmt[f] != NULL) && (r == SCPE_OK); f++) {
+    (void)remove (name[f]);
+    sim_disk_set_fmt (uptr, 0, fmt[f], NULL);
+    r = sim_disk_attach_ex (uptr, name[f], 512, 1, TRUE, 0, NULL, 0, 0, NULL);
+    memset (buf, 0x5A, block * 512);
+    for (lba = 0; (lba < 3 * block) && (r == SCPE_OK); lba += block)
+        r = sim_disk_wrsect (uptr, lba, buf, &done, block);
+    before = _sim_disk_test_allocated (uptr, name[f]);
+    if (r == SCPE_OK) {                             /* unmap the 2nd block, zero the 3rd piecewise */
+        r = sim_disk_unmap (uptr, block, block);
+        for (lba = 2 * block; (lba < 3 * block) && (r == SCPE_OK); lba += 128)
+            r = sim_disk_wrsect (uptr, lba, zeros, &done, 128);
+        }
+    for (lba = block; (lba < 3 * block) && (r == SCPE_OK); lba += 256) {
+        r = sim_disk_rdsect (uptr, lba, buf, &done, 256);
+        if ((r == SCPE_OK) && (memcmp (buf, zeros, 256 * 512) != 0))
+            r = sim_messagef (SCPE_IERR, "%s: lbn %u doesn't read as zeros\n", name[f], (uint32)lba);
+        }
+    after = _sim_disk_test_allocated (uptr, name[f]);
+    if ((r == SCPE_OK) && (strcmp (fmt[f], "SIMH") == 0) && (before - after < 2 * (t_offset)block * 512))
+        sim_printf ("%s: zeroed sectors still allocated (no holes on this host or file system)\n", name[f]);
+    if ((r == SCPE_OK) && (strcmp (fmt[f], "VHD") == 0)) {
+        before = sim_fsize_name (name[f]);
+        memset (buf, 0xA5, block * 512);
+        r = sim_disk_wrsect (uptr, block, buf, &done, block);
+        if (r == SCPE_OK)
+            r = sim_disk_wrsect (uptr, 2 * block, buf, &done, block);
+        after = sim_fsize_name (name[f]);
+        if ((r == SCPE_OK) && (after < before + 2 * (t_offset)block * 512))
+            r = sim_messagef (SCPE_IERR, "%s: zeroed blocks weren't released\n", name[f]);
+        }
+    sim_disk_detach (uptr);
+    (void)remove (name[f]);
+    }
+free (buf);
+free (zeros);
+sim_switches = saved_switches;
+if (r == SCPE_OK)
+    sim_printf ("Zero sector and unmap OK\n");
+return r;
+}
+
+/* A scatter/gather transfer must move the same bytes as a buffered one,
+   including sectors which straddle segments, and a write which is short
+   of whole sectors must pad the last one with zeros. */
+
+static t_stat sim_disk_sg_test (DEVICE *dptr)
+{
+UNIT *uptr = &dptr->units[0];
+uint32 wsizes[] = {100, 1000, 2996};
+uint32 rsizes[] = {513, 3000, 583};
+uint8 data[4096], back[4096], sgbuf[4096];
+DISK_SEG segs[3];
+t_seccnt done;
+uint32 i, off;
+t_stat r;
+
+sim_printf ("\n*** Scatter/gather transfer tests\n");
+(void)remove ("Test-SG.dsk");
+for (i = 0; i < sizeof (data); i++)
+    data[i] = (uint8)(i * 7 + (i >> 9));
+sim_disk_set_fmt (uptr, 0, "SIMH", NULL);
+r = sim_disk_attach_ex (uptr, "Test-SG.dsk", 512, 1, TRUE, 0, NULL, 0, 0, NULL);
+for (i = off = 0; i < 3; off += wsizes[i++]) {
+    segs[i].buf = data + off;
+    segs[i].size = wsizes[i];
+    }
+if (r == SCPE_OK)
+    r = sim_disk_wrsect_sg (uptr, 10, segs, 3, &done, 8);
+if (r == SCPE_OK)
+    r = sim_disk_rdsect (uptr, 10, back, &done, 8);
+if ((r == SCPE_OK) && ((done != 8) || (memcmp (data, back, sizeof (data)) != 0)))
+    r = sim_messagef (SCPE_IERR, "Gathered write didn't store the segments\n");
+memset (sgbuf, 0, sizeof (sgbuf));
+for (i = off = 0; i < 3; off += rsizes[i++]) {
+    segs[i].buf = sgbuf + off;
+    segs[i].size = rsizes[i];
+    }
+if (r == SCPE_OK)
+    r = sim_disk_rdsect_sg (uptr, 10, segs, 3, &done, 8);
+if ((r == SCPE_OK) && ((done != 8) || (memcmp (data, sgbuf, sizeof (data)) != 0)))
+    r = sim_messagef (SCPE_IERR, "Scattered read didn't fill the segments\n");
+segs[2].size = 500;                             /* 4013 bytes, 8 sectors */
+if (r == SCPE_OK)
+    r = sim_disk_wrsect_sg (uptr, 10, segs, 3, &done, 8);
+if (r == SCPE_OK)
+    r = sim_disk_rdsect (uptr, 10, back, &done, 8);
+if (r == SCPE_OK) {
+    for (i = 4013; (i < sizeof (back)) && (back[i] == 0); i++)
+        ;
+    if ((memcmp (data, back, 4013) != 0) || (i != sizeof (back)))
+        r = sim_messagef (SCPE_IERR, "Short gathered write wasn't zero padded\n");
+    }
+sim_disk_detach (uptr);
+(void)remove ("Test-SG.dsk");
+if (r == SCPE_OK)
+    sim_printf ("Scatter/gather OK\n");
+return r;
+}
+
+/* Transfers must be counted, classified as sequential or random and
+   traced, and replaying the trace must perform the same transfers. */
+
+static t_stat _sim_disk_test_counts (UNIT *uptr, uint32 reads, uint32 writes, uint32 seq_reads, uint32 seq_writes)
+{
+struct disk_context *ctx = (struct disk_context *)uptr->disk_ctx;
+uint32 b, lat[2] = {0, 0};
+
+for (b = 0; b < DISK_LAT_BUCKETS; b++) {
+    lat[0] += ctx->stats.latency[0][b];
+    lat[1] += ctx->stats.latency[1][b];
+    }
+if ((ctx->read_count != reads) || (ctx->write_count != writes) ||
+    (ctx->stats.sequential[0] != seq_reads) || (ctx->stats.sequential[1] != seq_writes) ||
+    (lat[0] != reads) || (lat[1] != writes) ||
+    (ctx->stats.bytes[0] != 4 * 512 * (t_uint64)reads) || (ctx->stats.bytes[1] != 512 * (t_uint64)writes))
+    return sim_messagef (SCPE_IERR, "%s: %u reads (%u sequential), %u writes (%u sequential), expected %u (%u), %u (%u)\n",
+                         uptr->filename, ctx->read_count, ctx->stats.sequential[0], ctx->write_count,
+                         ctx->stats.sequential[1], reads, seq_reads, writes, seq_writes);
+return SCPE_OK;
+}
+
+static t_stat sim_disk_stats_test (DEVICE *dptr)
+{
+UNIT *uptr = &dptr->units[0];
+uint8 buf[4 * 512];
+t_seccnt done;
+t_lba lba;
+t_stat r;
+
+sim_printf ("\n*** I/O statistics and trace tests\n");
+(void)remove ("Test-Trace.dsk");
+(void)remove ("Test-Replay.dsk");
+memset (buf, 0x3C, sizeof (buf));
+sim_disk_set_fmt (uptr, 0, "SIMH", NULL);
+r = sim_disk_set_iotrace (uptr, 1, "Test-IO.trc");
+if (r == SCPE_OK)
+    r = sim_disk_attach_ex (uptr, "Test-Trace.dsk", 512, 1, TRUE, 0, NULL, 0, 0, NULL);
+for (lba = 0; (lba < 8) && (r == SCPE_OK); lba++)     /* 8 sequential writes */
+    r = sim_disk_wrsect (uptr, lba, buf, &done, 1);
+if (r == SCPE_OK)                                       /* a random one */
+    r = sim_disk_wrsect (uptr, 100, buf, &done, 1);
+if (r == SCPE_OK)                                       /* random read, then sequential */
+    r = sim_disk_rdsect (uptr, 0, buf, &done, 4);
+if (r == SCPE_OK)
+    r = sim_disk_rdsect (uptr, 4, buf, &done, 4);
+if (r == SCPE_OK)
+    r = _sim_disk_test_counts (uptr, 2, 9, 1, 8);
+if (r == SCPE_OK)
+    sim_disk_show_stats (stdout, uptr);
+sim_disk_detach (uptr);
+sim_disk_set_iotrace (uptr, 0, NULL);
+if ((r == SCPE_OK) && (sim_fsize_name ("Test-IO.trc") != DK_TRACE_HDRSIZE + 11 * DK_TRACE_RECSIZE))
+    r = sim_messagef (SCPE_IERR, "I/O trace has the wrong size\n");
+if (r == SCPE_OK)
+    r = sim_disk_attach_ex (uptr, "Test-Replay.dsk", 512, 1, TRUE, 0, NULL, 0, 0, NULL);
+if (r == SCPE_OK)
+    r = sim_disk_replay (uptr, "Test-IO.trc", FALSE);
+if (r == SCPE_OK)
+    r = _sim_disk_test_counts (uptr, 2, 0, 2, 0);     /* without the writes, both reads are sequential */
+if (r == SCPE_OK)
+    r = sim_disk_replay (uptr, "Test-IO.trc", TRUE);
+if (r == SCPE_OK)
+    r = _sim_disk_test_counts (uptr, 2, 9, 1, 8);
+if (r == SCPE_OK)
+    r = sim_disk_rdsect (uptr, 100, buf, &done, 1);
+if ((r == SCPE_OK) && (buf[0] != 0xE5))
+    r = sim_messagef (SCPE_IERR, "Replayed write wasn't performed\n");
+sim_disk_detach (uptr);
+(void)remove ("Test-Trace.dsk");
+(void)remove ("Test-Replay.dsk");
+(void)remove ("Test-IO.trc");
+if (r == SCPE_OK)
+    sim_printf ("I/O statistics and trace OK\n");
+return r;
+}
+
 t_stat sim_disk_test (DEVICE *dptr, const char *cptr)
 {
-const char *fmt[] = {"RAW", "VHD", "VHD", "SIMH", NULL};
+const char *fmt[] = {"RAW", "VHD", "VHD", "SIMH", "DDI", NULL};
 uint32 sect_size[] = {576, 4096, 1024, 512, 256, 128, 64, 0};
 uint32 xfr_size[] = {1, 2, 4, 8, 0};
 int x, s, f;
@@ -7104,6 +11723,12 @@ else {
     SIM_TEST (sim_disk_sizing_test (dptr, cptr));
     SIM_TEST (sim_disk_meta_attach_test (dptr, cptr));
     }
+SIM_TEST (sim_disk_vhd_chain_test (dptr));
+SIM_TEST (sim_disk_snapshot_test (dptr));
+SIM_TEST (sim_disk_copy_test (dptr));
+SIM_TEST (sim_disk_trim_test (dptr));
+SIM_TEST (sim_disk_sg_test (dptr));
+SIM_TEST (sim_disk_stats_test (dptr));
 sim_printf ("\n*** Disk Format combination behavior tests\n");
 for (x = 0; xfr_size[x] != 0; x++) {
     for (f = 0; fmt[f] != 0; f++) {
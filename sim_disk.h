@@ -42,12 +42,13 @@ typedef uint32          t_lba;                          /* disk logical block ad
 /* Unit flags */
 
 #define DKUF_V_FMT      (UNIT_V_UF + 0)                 /* disk file format */
-#define DKUF_W_FMT      2                               /* 2b of formats */
+#define DKUF_W_FMT      3                               /* 3b of formats */
 #define DKUF_M_FMT      ((1u << DKUF_W_FMT) - 1)
 #define DKUF_F_AUTO      0                              /* Auto detect format format */
 #define DKUF_F_STD       1                              /* SIMH format */
 #define DKUF_F_RAW       2                              /* Raw Physical Disk Access */
 #define DKUF_F_VHD       3                              /* VHD format */
+#define DKUF_F_DDI       4                              /* Deduplicated Disk Image format */
 #define DKUF_V_NOAUTOSIZE (DKUF_V_FMT + DKUF_W_FMT)     /* Don't Autosize disk option */
 #define DKUF_V_UF       (DKUF_V_NOAUTOSIZE + 1)
 #define DKUF_WLK        UNIT_WLK
@@ -58,6 +59,7 @@ typedef uint32          t_lba;                          /* disk logical block ad
 #define DK_F_STD        (DKUF_F_STD << DKUF_V_FMT)
 #define DK_F_RAW        (DKUF_F_RAW << DKUF_V_FMT)
 #define DK_F_VHD        (DKUF_F_VHD << DKUF_V_FMT)
+#define DK_F_DDI        (DKUF_F_DDI << DKUF_V_FMT)
 
 #define DK_GET_FMT(u)   (((u)->flags >> DKUF_V_FMT) & DKUF_M_FMT)
 
@@ -65,7 +67,21 @@ typedef uint32          t_lba;                          /* disk logical block ad
 
 #define DKSE_OK         0                               /* no error */
 
+/* sim_disk_copy options */
+
+#define DK_COPY_WRITE   1                               /* write the source's data to the destination */
+#define DK_COPY_SPARSE  2                               /* don't write sectors of zeros */
+#define DK_COPY_COMPARE 4                               /* compare the source with the destination */
+
 typedef void (*DISK_PCALLBACK)(UNIT *unit, t_stat status);
+typedef void (*DISK_QCALLBACK)(UNIT *unit, t_stat status, void *arg);
+
+/* Host memory segment of a scatter/gather transfer */
+
+typedef struct {
+    uint8               *buf;                           /* host memory */
+    size_t              size;                           /* byte count */
+    } DISK_SEG;
 
 /* Prototypes */
 
@@ -108,8 +124,23 @@ t_stat sim_disk_rdsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread,
 t_stat sim_disk_rdsect_a (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, DISK_PCALLBACK callback);
 t_stat sim_disk_wrsect (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects);
 t_stat sim_disk_wrsect_a (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects, DISK_PCALLBACK callback);
+t_stat sim_disk_rdsect_q (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectsread, t_seccnt sects, DISK_QCALLBACK callback, void *arg);
+t_stat sim_disk_wrsect_q (UNIT *uptr, t_lba lba, uint8 *buf, t_seccnt *sectswritten, t_seccnt sects, DISK_QCALLBACK callback, void *arg);
+uint32 sim_disk_queue_depth (UNIT *uptr);
+t_stat sim_disk_rdsect_sg (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectsread, t_seccnt sects);
+t_stat sim_disk_rdsect_sg_a (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectsread, t_seccnt sects, DISK_PCALLBACK callback);
+t_stat sim_disk_wrsect_sg (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectswritten, t_seccnt sects);
+t_stat sim_disk_wrsect_sg_a (UNIT *uptr, t_lba lba, const DISK_SEG *segs, uint32 nsegs, t_seccnt *sectswritten, t_seccnt sects, DISK_PCALLBACK callback);
+t_stat sim_disk_set_cache (UNIT *uptr, int32 flag, CONST char *cptr);
+t_stat sim_disk_set_mmap (UNIT *uptr, int32 flag, CONST char *cptr);
+t_stat sim_disk_set_store (UNIT *uptr, int32 flag, CONST char *cptr);
+const char *sim_disk_cache_summary (UNIT *uptr);
+t_stat sim_disk_set_iotrace (UNIT *uptr, int32 flag, CONST char *cptr);
+void sim_disk_show_stats (FILE *st, UNIT *uptr);
+t_stat sim_disk_replay (UNIT *uptr, const char *tracefile, t_bool writes);
 t_stat sim_disk_unload (UNIT *uptr);
 t_stat sim_disk_erase (UNIT *uptr);
+t_stat sim_disk_unmap (UNIT *uptr, t_lba lba, t_seccnt sects);
 t_stat sim_disk_set_fmt (UNIT *uptr, int32 val, CONST char *cptr, void *desc);
 t_stat sim_disk_show_fmt (FILE *st, UNIT *uptr, int32 val, CONST void *desc);
 t_stat sim_disk_set_capac (UNIT *uptr, int32 val, CONST char *cptr, void *desc);
@@ -128,6 +159,10 @@ t_bool sim_disk_vhd_support (void);
 t_bool sim_disk_raw_support (void);
 void sim_disk_data_trace (UNIT *uptr, const uint8 *data, size_t lba, size_t len, const char* txt, int detail, uint32 reason);
 t_stat sim_disk_info_cmd (int32 flag, CONST char *ptr);
+t_stat sim_disk_snapshot_cmd (int32 flag, CONST char *cptr);
+t_stat sim_disk_snapshot_wait (UNIT *uptr);
+t_stat sim_disk_copy (UNIT *src, UNIT *dst, uint32 flags, uint32 *crc);
+const char *sim_disk_get_dtype (UNIT *uptr, uint32 *sector_size, uint32 *xfer_element_size);
 t_stat sim_disk_set_noautosize (int32 flag, CONST char *cptr);
 t_stat sim_disk_test (DEVICE *dptr, const char *cptr);
 
@@ -47,6 +47,7 @@
 #define CMD_RDLONG      0x3E                            /* read long */
 #define CMD_WRITE6      0x0A                            /* write (6 bytes) */
 #define CMD_WRITE10     0x2A                            /* write (10 bytes) */
+#define CMD_UNMAP       0x42                            /* unmap */
 #define CMD_ERASE       0x19                            /* erase */
 #define CMD_RESERVE     0x16                            /* reserve unit */
 #define CMD_RELEASE     0x17                            /* release unit */
@@ -77,6 +78,7 @@
 
 #define ASC_OK          0                               /* no additional sense information */
 #define ASC_INVCOM      0x20                            /* invalid command operation code */
+#define ASC_LBAOOR      0x21                            /* logical block address out of range */
 #define ASC_INVCDB      0x24                            /* invalid field in cdb */
 #define ASC_NOMEDIA     0x3A                            /* media not present */
 
@@ -1069,6 +1071,57 @@ else if (bus->phase == SCSI_DATO) {
     }
 }
 
+/* Command - Unmap
+
+   The parameter list holds an 8 byte header followed by 16 byte block
+   descriptors, each a 64 bit LBA and a 32 bit count of blocks which the
+   initiator no longer needs.  Their contents become zeros and the disk
+   container deallocates their storage where it can. */
+
+void scsi_unmap_disk (SCSI_BUS *bus, uint8 *data, uint32 len)
+{
+UNIT *uptr = bus->dev[bus->target];
+uint32 plen, i;
+t_uint64 lba;
+t_seccnt sects;
+t_stat r = SCPE_OK;
+t_bool range = TRUE;
+
+if (bus->phase == SCSI_CMD) {
+    scsi_debug_cmd (bus, "Unmap - CMD\n");
+    memcpy (&bus->cmd[0], &data[0], 10);
+    plen = GETW (bus->cmd, 7);
+    if (plen == 0)                                      /* nothing to unmap */
+        scsi_status (bus, STS_OK, KEY_OK, ASC_OK);
+    else {
+        bus->buf_b = plen;
+        scsi_set_phase (bus, SCSI_DATO);                /* data out phase next */
+        scsi_set_req (bus);                             /* request data */
+        }
+    }
+else if (bus->phase == SCSI_DATO) {
+    plen = GETW (bus->cmd, 7);
+    if (plen > (uint32)(2 + GETW (bus->buf, 0)))        /* use the smaller of the lengths */
+        plen = 2 + GETW (bus->buf, 0);
+    for (i = 8; (i + 16 <= plen) && (r == SCPE_OK) && range; i += 16) {
+        lba = ((t_uint64)(uint32)GETL (bus->buf, i) << 32) | (uint32)GETL (bus->buf, i + 4);
+        sects = (t_seccnt)GETL (bus->buf, i + 8);
+        scsi_debug_cmd (bus, "Unmap - DATO, lba %" LL_FMT "u blocks %u\n", lba, sects);
+        range = (lba + sects <= (t_uint64)uptr->capac);
+        if ((uptr->flags & UNIT_ATT) && (sects > 0) && range)
+            r = sim_disk_unmap (uptr, (t_lba)lba, sects);
+        }
+
+    memset (&bus->cmd[0], 0, 10);
+    if (!range)
+        scsi_status (bus, STS_CHK, KEY_ILLREQ, ASC_LBAOOR);
+    else if (r == SCPE_RO)
+        scsi_status (bus, STS_CHK, KEY_PROT, ASC_OK);
+    else
+        scsi_status (bus, STS_OK, KEY_OK, ASC_OK);
+    }
+}
+
 /* Command - Erase */
 
 void scsi_erase (SCSI_BUS *bus, uint8 *data, uint32 len)
@@ -1309,6 +1362,10 @@ switch (data[0]) {
         scsi_write10_disk (bus, data, len);
         break;
 
+    case CMD_UNMAP:                                     /* optional */
+        scsi_unmap_disk (bus, data, len);
+        break;
+
     default:
         sim_printf ("SCSI: unknown disk command %02X\n", data[0]);
         scsi_status (bus, STS_CHK, KEY_ILLREQ, ASC_INVCOM);
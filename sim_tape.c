@@ -100,6 +100,9 @@
 #if defined SIM_ASYNCH_IO
 #include <pthread.h>
 #endif
+#if defined (HAVE_ZLIB)
+#include <zlib.h>
+#endif
 
 static struct sim_tape_fmt {
     const char          *name;                          /* name */
@@ -139,35 +142,88 @@ static t_addr sim_tape_tpc_fnd (UNIT *uptr, t_addr *map);
 static void sim_tape_data_trace (UNIT *uptr, const uint8 *data, size_t len, const char* txt, int detail, uint32 reason);
 static t_stat tape_erase_fwd (UNIT *uptr, t_mtrlnt gap_size);
 static t_stat tape_erase_rev (UNIT *uptr, t_mtrlnt gap_size);
+static size_t tape_fread (void *bptr, size_t size, size_t count, UNIT *uptr);
+static size_t tape_fwrite (const void *bptr, size_t size, size_t count, UNIT *uptr);
+static int tape_feof (UNIT *uptr);
+static int tape_ferror (UNIT *uptr);
+static t_addr tape_ftell (UNIT *uptr);
+static t_offset tape_fsize (UNIT *uptr);
+static int tape_set_fsize (UNIT *uptr, t_addr size);
+static int tape_flush (UNIT *uptr);
+
+struct tape_index {
+    t_addr              *pos;               /* start of each object, then the end of data */
+    t_addr              *rpos;              /* object starts seen in reverse (after gaps), or NULL */
+    uint32              objects;            /* records and tape marks indexed */
+    uint32              size;               /* entries allocated in pos */
+    uint32              *tmks;              /* object numbers of the tape marks, ascending */
+    uint32              tmk_count;          /* tape marks indexed */
+    uint32              tmk_size;           /* entries allocated in tmks */
+    };
+
+#if defined SIM_ASYNCH_IO
+struct tape_request {
+    struct tape_request *next;
+    int                 op;                 /* TOP_ operation */
+    uint8               *buf;
+    t_mtrlnt            *bc;
+    uint32              *fc;
+    t_mtrlnt            max;
+    uint32              vbc;
+    uint32              gaplen;
+    uint32              bpi;
+    uint32              *objupdate;
+    TAPE_PCALLBACK      callback;
+    TAPE_QCALLBACK      qcallback;          /* callback with the caller's context */
+    void                *arg;
+    t_stat              status;
+    };
+#endif
 
 struct tape_context {
     DEVICE              *dptr;              /* Device for unit (access to debug flags) */
     uint32              dbit;               /* debugging bit for trace */
     uint32              auto_format;        /* Format determined dynamically */
+    struct tape_index   *index;             /* object index built while validating */
+    uint8               *rbuf;              /* read-ahead window of the container file */
+    t_addr              rbuf_pos;           /* file offset of the window */
+    size_t              rbuf_len;           /* valid bytes in the window */
+    uint8               *wbuf;              /* write-behind data */
+    t_addr              wbuf_pos;           /* file offset of the write-behind data */
+    size_t              wbuf_len;           /* bytes of write-behind data */
+    t_addr              trunc_size;         /* size the file is to be truncated to */
+    t_bool              truncate;           /* truncation pending */
+    t_addr              stream_pos;         /* position of the buffered stream */
+    t_bool              stream_eof;         /* end of file seen since the last seek */
+    t_bool              stream_error;       /* I/O error seen */
+    struct tape_gz      *gz;                /* compressed container state */
 #if defined SIM_ASYNCH_IO
     t_bool              asynch_io;          /* Asynchronous Interrupt scheduling enabled */
     int                 asynch_io_latency;  /* instructions to delay pending interrupt */
-    pthread_mutex_t     lock;
     pthread_t           io_thread;          /* I/O Thread Id */
     pthread_mutex_t     io_lock;
     pthread_cond_t      io_cond;
     pthread_cond_t      io_done;
     pthread_cond_t      startup_cond;
-    int                 io_top;
-    uint8               *buf;
-    uint32              *bc;
-    uint32              *fc;
-    uint32              vbc;
-    uint32              max;
-    uint32              gaplen;
-    uint32              bpi;
-    uint32              *objupdate;
-    TAPE_PCALLBACK      callback;
-    t_stat              io_status;
+    t_bool              io_initialized;     /* io_lock and conditions initialized */
+    struct tape_request *io_queue;          /* requests waiting to be performed */
+    struct tape_request *io_queue_tail;
+    struct tape_request *io_active;         /* request being performed */
+    struct tape_request *io_complete;       /* performed requests awaiting their callbacks */
+    struct tape_request *io_complete_tail;
+    struct tape_request *io_free;           /* recycled request blocks */
+    int                 io_count;           /* requests queued or being performed */
 #endif
     };
 #define tape_ctx up8                        /* Field in Unit structure which points to the tape_context */
 
+static void tape_index_free (struct tape_context *ctx);
+static void tape_buf_setup (UNIT *uptr);
+static void tape_buf_free (struct tape_context *ctx);
+static t_stat tape_gz_setup (UNIT *uptr);
+static void tape_gz_free (UNIT *uptr);
+static int tape_flush_ex (UNIT *uptr, t_bool all);
+
 #if defined SIM_ASYNCH_IO
 #define AIO_CALLSETUP                                                   \
 struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;       \
@@ -177,33 +233,18 @@ if (ctx == NULL)                                                        \
 if ((callback == NULL) || !(ctx->asynch_io))
 
 #define AIO_CALL(op, _buf, _bc, _fc, _max, _vbc, _gaplen, _bpi, _obj, _callback)\
-    if (ctx->asynch_io) {                                               \
-        struct tape_context *ctx =                                      \
-                      (struct tape_context *)uptr->tape_ctx;            \
-                                                                        \
-        pthread_mutex_lock (&ctx->io_lock);                             \
-                                                                        \
-        sim_debug_unit (ctx->dbit, uptr,                                \
-      "sim_tape AIO_CALL(op=%d, unit=%d)\n", op, (int)(uptr-ctx->dptr->units));\
-                                                                        \
-        if (ctx->callback)                                              \
-            abort(); /* horrible mistake, stop */                       \
-        ctx->io_top = op;                                               \
-        ctx->buf = _buf;                                                \
-        ctx->bc = _bc;                                                  \
-        ctx->fc = _fc;                                                  \
-        ctx->max = _max;                                                \
-        ctx->vbc = _vbc;                                                \
-        ctx->gaplen = _gaplen;                                          \
-        ctx->bpi = _bpi;                                                \
-        ctx->objupdate = _obj;                                          \
-        ctx->callback = _callback;                                      \
-        pthread_cond_signal (&ctx->io_cond);                            \
-        pthread_mutex_unlock (&ctx->io_lock);                           \
-        }                                                               \
+    if (ctx->asynch_io && (_callback))                                  \
+        _tape_aio_queue (uptr, op, _buf, _bc, _fc, _max, _vbc, _gaplen, \
+                         _bpi, _obj, _callback, NULL, NULL);            \
     else                                                                \
         if (_callback)                                                  \
             (_callback) (uptr, r);
+
+#define AIO_QUEUE(op, _buf, _bc, _fc, _max, _vbc, _gaplen, _bpi, _obj)   \
+    if ((uptr->tape_ctx != NULL) &&                                     \
+        ((struct tape_context *)uptr->tape_ctx)->asynch_io && callback) \
+        return _tape_aio_queue (uptr, op, _buf, _bc, _fc, _max, _vbc,   \
+                                _gaplen, _bpi, _obj, NULL, callback, arg);
 #define TOP_DONE  0             /* close */
 #define TOP_RDRF  1             /* sim_tape_rdrecf_a */
 #define TOP_RDRR  2             /* sim_tape_rdrecr_a */
@@ -223,11 +264,58 @@ if ((callback == NULL) || !(ctx->asynch_io))
 #define TOP_RWND 16             /* sim_tape_rewind_a */
 #define TOP_POSN 17             /* sim_tape_position_a */
 
+static t_stat _tape_aio_perform (UNIT *uptr, const struct tape_request *req)
+{
+switch (req->op) {
+    case TOP_RDRF:
+        return sim_tape_rdrecf (uptr, req->buf, req->bc, req->max);
+    case TOP_RDRR:
+        return sim_tape_rdrecr (uptr, req->buf, req->bc, req->max);
+    case TOP_WREC:
+        return sim_tape_wrrecf (uptr, req->buf, req->vbc);
+    case TOP_WTMK:
+        return sim_tape_wrtmk (uptr);
+    case TOP_WEOM:
+        return sim_tape_wreom (uptr);
+    case TOP_WEMR:
+        return sim_tape_wreomrw (uptr);
+    case TOP_WGAP:
+        return sim_tape_wrgap (uptr, req->gaplen);
+    case TOP_SPRF:
+        return sim_tape_sprecf (uptr, req->bc);
+    case TOP_SRSF:
+        return sim_tape_sprecsf (uptr, req->vbc, req->bc);
+    case TOP_SPRR:
+        return sim_tape_sprecr (uptr, req->bc);
+    case TOP_SRSR:
+        return sim_tape_sprecsr (uptr, req->vbc, req->bc);
+    case TOP_SPFF:
+        return sim_tape_spfilef (uptr, req->vbc, req->bc);
+    case TOP_SFRF:
+        return sim_tape_spfilebyrecf (uptr, req->vbc, req->bc, req->fc, req->max);
+    case TOP_SPFR:
+        return sim_tape_spfiler (uptr, req->vbc, req->bc);
+    case TOP_SFRR:
+        return sim_tape_spfilebyrecr (uptr, req->vbc, req->bc, req->fc);
+    case TOP_RWND:
+        return sim_tape_rewind (uptr);
+    case TOP_POSN:
+        return sim_tape_position (uptr, req->vbc, req->gaplen, req->bc, req->bpi, req->fc, req->objupdate);
+    }
+return SCPE_IERR;
+}
+
+/* Each unit has a queue of requests which its I/O thread performs in the
+   order they were issued, since every tape operation depends on the
+   position left by the ones before it.  Units each have their own thread,
+   so the operations of different drives overlap. */
+
 static void *
 _tape_io(void *arg)
 {
 UNIT* volatile uptr = (UNIT*)arg;
 struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_request *req;
 
     /* Boost Priority for this I/O thread vs the CPU instruction execution
        thread which in general won't be readily yielding the processor when
@@ -238,67 +326,28 @@ struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
 
     pthread_mutex_lock (&ctx->io_lock);
     pthread_cond_signal (&ctx->startup_cond);   /* Signal we're ready to go */
-    while (1) {
-        pthread_cond_wait (&ctx->io_cond, &ctx->io_lock);
-        if (ctx->io_top == TOP_DONE)
-            break;
-        pthread_mutex_unlock (&ctx->io_lock);
-        switch (ctx->io_top) {
-            case TOP_RDRF:
-                ctx->io_status = sim_tape_rdrecf (uptr, ctx->buf, ctx->bc, ctx->max);
-                break;
-            case TOP_RDRR:
-                ctx->io_status = sim_tape_rdrecr (uptr, ctx->buf, ctx->bc, ctx->max);
-                break;
-            case TOP_WREC:
-                ctx->io_status = sim_tape_wrrecf (uptr, ctx->buf, ctx->vbc);
-                break;
-            case TOP_WTMK:
-                ctx->io_status = sim_tape_wrtmk (uptr);
-                break;
-            case TOP_WEOM:
-                ctx->io_status = sim_tape_wreom (uptr);
-                break;
-            case TOP_WEMR:
-                ctx->io_status = sim_tape_wreomrw (uptr);
-                break;
-            case TOP_WGAP:
-                ctx->io_status = sim_tape_wrgap (uptr, ctx->gaplen);
-                break;
-            case TOP_SPRF:
-                ctx->io_status = sim_tape_sprecf (uptr, ctx->bc);
-                break;
-            case TOP_SRSF:
-                ctx->io_status = sim_tape_sprecsf (uptr, ctx->vbc, ctx->bc);
-                break;
-            case TOP_SPRR:
-                ctx->io_status = sim_tape_sprecr (uptr, ctx->bc);
-                break;
-            case TOP_SRSR:
-                ctx->io_status = sim_tape_sprecsr (uptr, ctx->vbc, ctx->bc);
-                break;
-            case TOP_SPFF:
-                ctx->io_status = sim_tape_spfilef (uptr, ctx->vbc, ctx->bc);
-                break;
-            case TOP_SFRF:
-                ctx->io_status = sim_tape_spfilebyrecf (uptr, ctx->vbc, ctx->bc, ctx->fc, ctx->max);
-                break;
-            case TOP_SPFR:
-                ctx->io_status = sim_tape_spfiler (uptr, ctx->vbc, ctx->bc);
-                break;
-            case TOP_SFRR:
-                ctx->io_status = sim_tape_spfilebyrecr (uptr, ctx->vbc, ctx->bc, ctx->fc);
-                break;
-            case TOP_RWND:
-                ctx->io_status = sim_tape_rewind (uptr);
-                break;
-            case TOP_POSN:
-                ctx->io_status = sim_tape_position (uptr, ctx->vbc, ctx->gaplen, ctx->bc, ctx->bpi, ctx->fc, ctx->objupdate);
-                break;
+    while (ctx->asynch_io) {
+        req = ctx->io_queue;
+        if (req == NULL) {
+            pthread_cond_wait (&ctx->io_cond, &ctx->io_lock);
+            continue;
             }
+        ctx->io_queue = req->next;
+        if (ctx->io_queue == NULL)
+            ctx->io_queue_tail = NULL;
+        ctx->io_active = req;
+        pthread_mutex_unlock (&ctx->io_lock);
+        req->status = _tape_aio_perform (uptr, req);
         pthread_mutex_lock (&ctx->io_lock);
-        ctx->io_top = TOP_DONE;
-        pthread_cond_signal (&ctx->io_done);
+        ctx->io_active = NULL;
+        req->next = NULL;
+        if (ctx->io_complete_tail)
+            ctx->io_complete_tail->next = req;
+        else
+            ctx->io_complete = req;
+        ctx->io_complete_tail = req;
+        --ctx->io_count;
+        pthread_cond_broadcast (&ctx->io_done);
         sim_activate (uptr, ctx->asynch_io_latency);
     }
     pthread_mutex_unlock (&ctx->io_lock);
@@ -308,37 +357,99 @@ struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
     return NULL;
 }
 
+/* Queue a request for the unit's I/O thread.  If a request block can't
+   be allocated the request is performed synchronously, once the requests
+   queued ahead of it have been performed, and its completion is
+   delivered immediately. */
+
+static t_stat _tape_aio_queue (UNIT *uptr, int op, uint8 *buf, t_mtrlnt *bc, uint32 *fc, t_mtrlnt max,
+                               uint32 vbc, uint32 gaplen, uint32 bpi, uint32 *objupdate,
+                               TAPE_PCALLBACK callback, TAPE_QCALLBACK qcallback, void *arg)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_request *req, sreq;
+
+pthread_mutex_lock (&ctx->io_lock);
+
+sim_debug_unit (ctx->dbit, uptr, "sim_tape AIO_CALL(op=%d, unit=%d, queued=%d)\n", op, (int)(uptr-ctx->dptr->units), ctx->io_count);
+
+req = ctx->io_free;
+if (req)
+    ctx->io_free = req->next;
+else
+    req = (struct tape_request *)malloc (sizeof (*req));
+if (req == NULL) {
+    while (ctx->io_count != 0)              /* tape position must be theirs */
+        pthread_cond_wait (&ctx->io_done, &ctx->io_lock);
+    pthread_mutex_unlock (&ctx->io_lock);
+    req = &sreq;
+    }
+req->next = NULL;
+req->op = op;
+req->buf = buf;
+req->bc = bc;
+req->fc = fc;
+req->max = max;
+req->vbc = vbc;
+req->gaplen = gaplen;
+req->bpi = bpi;
+req->objupdate = objupdate;
+req->callback = callback;
+req->qcallback = qcallback;
+req->arg = arg;
+req->status = SCPE_OK;
+if (req == &sreq) {
+    req->status = _tape_aio_perform (uptr, req);
+    if (qcallback)
+        qcallback (uptr, req->status, arg);
+    else
+        callback (uptr, req->status);
+    return req->status;
+    }
+if (ctx->io_queue_tail)
+    ctx->io_queue_tail->next = req;
+else
+    ctx->io_queue = req;
+ctx->io_queue_tail = req;
+++ctx->io_count;
+pthread_cond_signal (&ctx->io_cond);
+pthread_mutex_unlock (&ctx->io_lock);
+return SCPE_OK;
+}
+
 /* This routine is called in the context of the main simulator thread before
    processing events for any unit. It is only called when an asynchronous
    thread has called sim_activate() to activate a unit.  The job of this
    routine is to put the unit in proper condition to digest what may have
    occurred in the asynchronous thread.
 
-   Since tape processing only handles a single I/O at a time to a
-   particular tape device, we have the opportunity to possibly detect
-   improper attempts to issue multiple concurrent I/O requests. */
+   Several requests may have completed since the unit was last activated.
+   Their callbacks are called in the order the requests were issued. */
 static void _tape_completion_dispatch (UNIT *uptr)
 {
 struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
-TAPE_PCALLBACK callback = ctx->callback;
-
-sim_debug_unit (ctx->dbit, uptr, "_tape_completion_dispatch(unit=%d, top=%d, callback=%p)\n", (int)(uptr-ctx->dptr->units), ctx->io_top, ctx->callback);
-
-if (ctx->io_top != TOP_DONE)
-    abort();                                            /* horribly wrong, stop */
+struct tape_request *done, *req, *last = NULL;
 
-if (ctx->asynch_io)
-    pthread_mutex_lock (&ctx->io_lock);
-
-if (ctx->callback) {
-    ctx->callback = NULL;
-    if (ctx->asynch_io)
-        pthread_mutex_unlock (&ctx->io_lock);
-    callback (uptr, ctx->io_status);
+if ((ctx == NULL) || !ctx->io_initialized)
+    return;
+pthread_mutex_lock (&ctx->io_lock);
+done = ctx->io_complete;
+ctx->io_complete = ctx->io_complete_tail = NULL;
+pthread_mutex_unlock (&ctx->io_lock);
+
+for (req = done; req != NULL; req = req->next) {
+    sim_debug_unit (ctx->dbit, uptr, "_tape_completion_dispatch(unit=%d, top=%d, callback=%p)\n", (int)(uptr-ctx->dptr->units), req->op, req->qcallback ? (void *)req->qcallback : (void *)req->callback);
+    if (req->qcallback)
+        req->qcallback (uptr, req->status, req->arg);
+    else
+        req->callback (uptr, req->status);
+    last = req;
     }
-else {
-    if (ctx->asynch_io)
-        pthread_mutex_unlock (&ctx->io_lock);
+if (last) {                                 /* recycle request blocks */
+    pthread_mutex_lock (&ctx->io_lock);
+    last->next = ctx->io_free;
+    ctx->io_free = done;
+    pthread_mutex_unlock (&ctx->io_lock);
     }
 }
 
@@ -347,8 +458,8 @@ static t_bool _tape_is_active (UNIT *uptr)
 struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
 
 if (ctx) {
-    sim_debug_unit (ctx->dbit, uptr, "_tape_is_active(unit=%d, top=%d)\n", (int)(uptr-ctx->dptr->units), ctx->io_top);
-    return (ctx->io_top != TOP_DONE);
+    sim_debug_unit (ctx->dbit, uptr, "_tape_is_active(unit=%d, queued=%d)\n", (int)(uptr-ctx->dptr->units), ctx->io_count);
+    return (ctx->io_count != 0);
     }
 return FALSE;
 }
@@ -358,16 +469,38 @@ static t_bool _tape_cancel (UNIT *uptr)
 struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
 
 if (ctx) {
-    sim_debug_unit (ctx->dbit, uptr, "_tape_cancel(unit=%d, top=%d)\n", (int)(uptr-ctx->dptr->units), ctx->io_top);
+    sim_debug_unit (ctx->dbit, uptr, "_tape_cancel(unit=%d, queued=%d)\n", (int)(uptr-ctx->dptr->units), ctx->io_count);
     if (ctx->asynch_io) {
         pthread_mutex_lock (&ctx->io_lock);
-        while (ctx->io_top != TOP_DONE)
+        while (ctx->io_count != 0)
             pthread_cond_wait (&ctx->io_done, &ctx->io_lock);
         pthread_mutex_unlock (&ctx->io_lock);
         }
     }
 return FALSE;
 }
+
+/* Release the queueing resources of a unit being detached */
+
+static void _tape_aio_release (struct tape_context *ctx)
+{
+struct tape_request *req;
+
+if (!ctx->io_initialized)
+    return;
+while ((req = ctx->io_free)) {
+    ctx->io_free = req->next;
+    free (req);
+    }
+while ((req = ctx->io_complete)) {          /* undelivered completions */
+    ctx->io_complete = req->next;
+    free (req);
+    }
+pthread_mutex_destroy (&ctx->io_lock);
+pthread_cond_destroy (&ctx->io_cond);
+pthread_cond_destroy (&ctx->io_done);
+ctx->io_initialized = FALSE;
+}
 #else
 #define AIO_CALLSETUP                                                       \
     if (uptr->tape_ctx == NULL)                                             \
@@ -375,6 +508,7 @@ return FALSE;
 #define AIO_CALL(op, _buf, _fc, _bc, _max, _vbc, _gaplen, _bpi, _obj, _callback) \
     if (_callback)                                                    \
         (_callback) (uptr, r);
+#define AIO_QUEUE(op, _buf, _bc, _fc, _max, _vbc, _gaplen, _bpi, _obj)
 #endif
 
 #define MIN_RECORD_SIZE    14   /* Mag tape records <14 bytes are considered noise */
@@ -438,18 +572,43 @@ typedef struct HDR4 {       /* Also EOF4, EOV4 */
     char unused[11];
     } HDR4;
 
+/* Generated tapes only hold their labels in memory.  Data records are
+   described by where their contents start in a host file, and are
+   produced from that file when they're read. */
+
 typedef struct TAPE_RECORD {
-    size_t size;
-    uint8 data[1];
+    size_t size;            /* record size, 0 is a tape mark */
+    uint32 source;          /* 1 based index of the host file with the data, 0 if in memory */
+    uint32 state;           /* conversion state at the start of the record */
+    t_offset offset;        /* position of the record's data in the host file */
+    uint8 *data;            /* label records held in memory */
     } TAPE_RECORD;
 
+#define TAPE_SRC_RAW        0   /* binary data, zero padded to the record size */
+#define TAPE_SRC_ANSI_TEXT  1   /* text lines packed into ANSI blocks */
+#define TAPE_SRC_FIXED_TEXT 2   /* one text line per space padded record */
+#define TAPE_SRC_DOS11_TEXT 3   /* text stream with CRLF line endings */
+
+typedef struct TAPE_SOURCE {
+    char *path;             /* host file */
+    uint32 type;            /* TAPE_SRC_xxx conversion */
+    size_t skip_ending;     /* ANSI text: line ending characters dropped */
+    t_bool fixed_text;      /* ANSI text: unformatted stream of bytes */
+    t_bool ebcdic;          /* FIXED text: convert to EBCDIC */
+    } TAPE_SOURCE;
+
 typedef struct MEMORY_TAPE {
     uint32 ansi_type;       /* ANSI-VMS, ANSI-RT11, ANSI-RSTS, ANSI-RSX11, etc. */
     uint32 file_count;      /* number of labeled files */
     uint32 record_count;    /* number of entries in the record array */
     uint32 array_size;      /* allocated size of records array */
     size_t block_size;      /* tape block size */
-    TAPE_RECORD **records;
+    TAPE_RECORD *records;
+    uint32 source_count;    /* number of entries in the sources array */
+    TAPE_SOURCE *sources;
+    FILE *file;             /* currently open host file */
+    uint32 file_source;     /* source index of the open file */
+    char *line;             /* FIXED text line buffer */
     VOL1 vol1;
     } MEMORY_TAPE;
 
@@ -514,6 +673,12 @@ static void sim_tape_add_ansi_entry (const char *directory,
                                      const struct stat *filestat,
                                      void *context);
 static t_bool memory_tape_add_block (MEMORY_TAPE *tape, uint8 *block, size_t size);
+static uint32 memory_tape_add_source (MEMORY_TAPE *tape, const char *path, uint32 type);
+static t_bool memory_tape_add_file_block (MEMORY_TAPE *tape, uint32 source, t_offset offset, uint32 state, size_t size);
+static t_bool memory_tape_add_file_blocks (MEMORY_TAPE *tape, uint32 source, t_offset size, size_t block_size, size_t pad_to);
+static t_bool memory_tape_read_record (MEMORY_TAPE *tape, uint32 recnum, uint8 *buf);
+static size_t dos11_fill_ascii_buffer (FILE *f, char *buf, size_t bufSize, t_bool *crlast);
+static t_bool fixed_fill_text_record (FILE *f, uint8 *block, size_t block_size, t_bool ebcdic);
 
 typedef struct DOS11_HDR {
     uint16 fname[2];        /* File name (RAD50 - 6 characters) */
@@ -550,9 +715,12 @@ pthread_attr_t attr;
 ctx->asynch_io = sim_asynch_enabled;
 ctx->asynch_io_latency = latency;
 if (ctx->asynch_io) {
-    pthread_mutex_init (&ctx->io_lock, NULL);
-    pthread_cond_init (&ctx->io_cond, NULL);
-    pthread_cond_init (&ctx->io_done, NULL);
+    if (!ctx->io_initialized) {
+        pthread_mutex_init (&ctx->io_lock, NULL);
+        pthread_cond_init (&ctx->io_cond, NULL);
+        pthread_cond_init (&ctx->io_done, NULL);
+        ctx->io_initialized = TRUE;
+        }
     pthread_cond_init (&ctx->startup_cond, NULL);
     pthread_attr_init(&attr);
     pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
@@ -570,7 +738,10 @@ return SCPE_OK;
 #endif
 }
 
-/* Disable asynchronous operation */
+/* Disable asynchronous operation
+
+   Requests already queued are performed before the I/O thread exits.
+   Their completions are delivered when the unit's activation is processed. */
 
 t_stat sim_tape_clr_async (UNIT *uptr)
 {
@@ -584,13 +755,12 @@ if (!ctx) return SCPE_UNATT;
 
 if (ctx->asynch_io) {
     pthread_mutex_lock (&ctx->io_lock);
+    while (ctx->io_count != 0)
+        pthread_cond_wait (&ctx->io_done, &ctx->io_lock);
     ctx->asynch_io = FALSE;
     pthread_cond_signal (&ctx->io_cond);
     pthread_mutex_unlock (&ctx->io_lock);
     pthread_join (ctx->io_thread, NULL);
-    pthread_mutex_destroy (&ctx->io_lock);
-    pthread_cond_destroy (&ctx->io_cond);
-    pthread_cond_destroy (&ctx->io_done);
     }
 return SCPE_OK;
 #endif
@@ -609,8 +779,10 @@ sim_tape_clr_async (uptr);
 if (sim_asynch_enabled)
     sim_tape_set_async (uptr, ctx->asynch_io_latency);
 #endif
-if (MT_GET_FMT (uptr) < MTUF_F_ANSI)
+if (MT_GET_FMT (uptr) < MTUF_F_ANSI) {
+    tape_flush (uptr);
     fflush (uptr->fileref);
+    }
 }
 
 static const char *_sim_tape_format_name (UNIT *uptr)
@@ -740,25 +912,8 @@ switch (MT_GET_FMT (uptr)) {
             size_t max_record_size;
             t_bool lf_line_endings;
             t_bool crlf_line_endings;
-            uint8 *block = NULL;
+            uint32 source;
             int error = FALSE;
-            static const uint8 ascii2ebcdic[128] = {
-                0000,0001,0002,0003,0067,0055,0056,0057,
-                0026,0005,0045,0013,0014,0015,0016,0017,
-                0020,0021,0022,0023,0074,0075,0062,0046,
-                0030,0031,0077,0047,0034,0035,0036,0037,
-                0100,0117,0177,0173,0133,0154,0120,0175,
-                0115,0135,0134,0116,0153,0140,0113,0141,
-                0360,0361,0362,0363,0364,0365,0366,0367,
-                0370,0371,0172,0136,0114,0176,0156,0157,
-                0174,0301,0302,0303,0304,0305,0306,0307,
-                0310,0311,0321,0322,0323,0324,0325,0326,
-                0327,0330,0331,0342,0343,0344,0345,0346,
-                0347,0350,0351,0112,0340,0132,0137,0155,
-                0171,0201,0202,0203,0204,0205,0206,0207,
-                0210,0211,0221,0222,0223,0224,0225,0226,
-                0227,0230,0231,0242,0243,0244,0245,0246,
-                0247,0250,0251,0300,0152,0320,0241,0007};
 
             memset (&statb, 0, sizeof (statb));
             tape = memory_create_tape ();
@@ -786,18 +941,9 @@ switch (MT_GET_FMT (uptr)) {
                     break;
                     }
                 tape->block_size = uptr->recsize;
-                block = (uint8 *)malloc (tape->block_size);
-                while (!feof (f) && !error) {
-                    size_t data_read = fread (block, 1, tape->block_size, f);
-                    if (data_read == tape->block_size)
-                        error = memory_tape_add_block (tape, block, tape->block_size);
-                    else {
-                        if (data_read != 0) {
-                            r = sim_messagef (SCPE_ARG, "Read %u bytes of data when expecting %u bytes\n", (uint32)data_read, (uint32)tape->block_size);
-                            error = TRUE;
-                            }
-                        }
-                    }
+                source = memory_tape_add_source (tape, cptr, TAPE_SRC_RAW);
+                error = (source == 0) ||
+                        memory_tape_add_file_blocks (tape, source, (t_offset)statb.st_size, tape->block_size, 0);
                 }
             else {                                              /* text file */
                 if (uptr->recsize == 0)
@@ -808,29 +954,21 @@ switch (MT_GET_FMT (uptr)) {
                     break;
                     }
                 tape->block_size = uptr->recsize;
-                block = (uint8 *)calloc (1, tape->block_size + 3);
+                tape->line = (char *)calloc (1, tape->block_size + 3);
+                source = memory_tape_add_source (tape, cptr, TAPE_SRC_FIXED_TEXT);
+                error = (tape->line == NULL) || (source == 0);
+                if (!error)
+                    tape->sources[source - 1].ebcdic = ((sim_switches & SWMASK ('C')) != 0);
                 while (!feof (f) && !error) {
-                    /* fgets() read size is int, cast accordingly. */
-                    if (fgets ((char *)block, (int) (tape->block_size + 3), f)) {
-                        size_t len = strlen ((char *)block);
-
-                        while ((len > 0) &&
-                               ((block[len - 1] == '\r') || (block[len - 1] == '\n')))
-                            --len;
-                        memset (block + len, ' ', tape->block_size - len);
-                        if (sim_switches & SWMASK ('C')) {
-                            uint32 i;
-
-                            for (i = 0; i < tape->block_size; i++)
-                                block[i] = ascii2ebcdic[block[i]];
-                            }
-                        error = memory_tape_add_block (tape, block, tape->block_size);
-                        }
+                    t_offset offset = sim_ftell (f);
+
+                    /* Only the line boundaries are kept, records are converted when read */
+                    if (fixed_fill_text_record (f, (uint8 *)tape->line, tape->block_size, FALSE))
+                        error = memory_tape_add_file_block (tape, source, offset, 0, tape->block_size);
                     else
                         error = ferror (f);
                     }
                 }
-            free (block);
             fclose (f);
             if (error)
                 r = sim_messagef (SCPE_IERR, "Error processing input file %s\n", cptr);
@@ -926,6 +1064,16 @@ uptr->tape_ctx = ctx = (struct tape_context *)calloc(1, sizeof(struct tape_conte
 ctx->dptr = dptr;                                       /* save DEVICE pointer */
 ctx->dbit = dbit;                                       /* save debug bit */
 ctx->auto_format = auto_format;                         /* save that we auto selected format */
+tape_buf_setup (uptr);                                  /* buffer the container file */
+r = tape_gz_setup (uptr);                               /* compressed container? */
+if (r != SCPE_OK) {
+    sim_tape_detach (uptr);
+    if ((sim_switches & SWMASK ('D')) && !had_debug)
+        sim_set_deboff (0, "");
+    if (sim_switches & SWMASK ('D'))
+        uptr->dctrl = starting_dctrl;
+    return r;
+    }
 
 switch (MT_GET_FMT (uptr)) {                            /* case on format */
 
@@ -945,7 +1093,7 @@ switch (MT_GET_FMT (uptr)) {                            /* case on format */
         break;
 
     case MTUF_F_TAR:                                    /* TAR */
-        uptr->hwmark = (t_addr)sim_fsize (uptr->fileref);
+        uptr->hwmark = (t_addr)tape_fsize (uptr);
         break;
 
     default:
@@ -996,8 +1144,15 @@ if (ctx)
     auto_format = ctx->auto_format;
 
 sim_tape_clr_async (uptr);
+#if defined (SIM_ASYNCH_IO)
+if (ctx)
+    _tape_aio_release (ctx);
+#endif
 
 MT_CLR_INMRK (uptr);                                    /* Not within a TAR tapemark */
+tape_flush_ex (uptr, TRUE);                             /* write out buffered data */
+if (ctx)
+    tape_gz_free (uptr);                                /* complete a compressed image */
 if (MT_GET_FMT (uptr) >= MTUF_F_ANSI) {
     memory_free_tape ((void *)uptr->fileref);
     uptr->fileref = NULL;
@@ -1025,6 +1180,10 @@ uptr->tape_eom = 0;
 uptr->pos = 0;
 MT_CLR_PNU (uptr);
 MT_CLR_INMRK (uptr);                                    /* Not within a TAR tapemark */
+if (ctx) {
+    tape_index_free (ctx);
+    tape_buf_free (ctx);
+    }
 free (uptr->tape_ctx);
 uptr->tape_ctx = NULL;
 uptr->io_flush = NULL;
@@ -1093,6 +1252,10 @@ fprintf (st, "        placed in an otherwise unused word in the header which som
 fprintf (st, "        operating systems will be able to process. If the resulting\n");
 fprintf (st, "        filename is NULL, a filename in the range 000000 - 999999 will be\n");
 fprintf (st, "        generated based of the file position on the tape.\n\n");
+fprintf (st, "        A SIMH, E11, TPC, P7B or AWS format tape container file which has\n");
+fprintf (st, "        been compressed with gzip is decompressed as it is read and is\n");
+fprintf (st, "        attached read only.  A new container file whose name ends in .gz\n");
+fprintf (st, "        is compressed as it is written.\n\n");
 fprintf (st, "Examples:\n\n");
 fprintf (st, "  sim> ATTACH %s -F ANSI-VMS Hobbyist-USE-ONLY-VA.TXT\n", dptr->name);
 fprintf (st, "  sim> ATTACH %s -F ANSI-RSX11 *.TXT,*.ini,*.exe\n", dptr->name);
@@ -1113,17 +1276,841 @@ if (sim_deb && ((uptr->dctrl | ctx->dptr->dctrl) & reason))
     sim_data_trace(ctx->dptr, uptr, (detail ? data : NULL), "", len, txt, reason);
 }
 
+/* Buffered container I/O
+
+   Each record in a container file is transferred as several small pieces
+   (the leading length, the data and the trailing length), each after a
+   seek.  A unit attached to a container file keeps a window of the file
+   which is filled with one large read, placed ahead of the access when
+   moving forward and behind it when moving in reverse, and a write-behind
+   buffer which collects writes to consecutive locations.  Buffered writes
+   reach the file when a tape mark or end of medium is written, when the
+   tape is rewound or detached, when the simulator stops, and whenever a
+   write doesn't fit the buffered data.
+
+   The routines below replace the stdio calls on the container file.
+   sim_tape_seek only sets the position of the buffered stream, and the
+   end-of-file and error indications behave as they do for a stdio stream.
+   Transfers of half the buffer size or more go directly to the file. */
+
+#define TAPE_BUF_SIZE   (256 * 1024)
+
+static void tape_buf_setup (UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+if (MT_GET_FMT (uptr) >= MTUF_F_ANSI)
+    return;
+ctx->rbuf = (uint8 *)malloc (TAPE_BUF_SIZE);
+ctx->rbuf_len = 0;
+ctx->stream_pos = 0;
+}
+
+static void tape_buf_free (struct tape_context *ctx)
+{
+free (ctx->rbuf);
+ctx->rbuf = NULL;
+free (ctx->wbuf);
+ctx->wbuf = NULL;
+ctx->rbuf_len = ctx->wbuf_len = 0;
+}
+
+static t_bool tape_buffered (UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+return ((ctx != NULL) && (ctx->rbuf != NULL));
+}
+
+/* Compressed container files
+
+   A container file which begins with a gzip header is decompressed as it
+   is read.  A deflate stream can only be decoded from its beginning, so
+   while the data is being decompressed an access point is recorded about
+   every TAPE_GZ_SPAN bytes.  An access point is a deflate block boundary:
+   its location in the compressed and in the uncompressed data, along with
+   the 32KB of data preceding it, which is all that is needed to start
+   decoding there.  A read continues the current decompression when it is
+   ahead of the data already produced, and otherwise restarts it at the
+   closest access point.  Files holding several gzip members are read as
+   the concatenation of the members' data.
+
+   Compressed data can't be rewritten in place, so an existing compressed
+   image is attached read-only.  A new image whose name ends in .gz is
+   compressed as it is written.  Written data leaves the write-behind
+   buffer only once it is followed by TAPE_GZ_TAIL bytes of newer data (or
+   when the unit is detached), so that the last records and tape marks
+   written can still be backspaced over and rewritten, and the compressed
+   stream is flushed after each write so that everything written can be
+   read back.  Writing at the beginning of the tape starts the image over;
+   any other write before the end of the data already written fails. */
+
+#define TAPE_GZ_TAIL    (64 * 1024)             /* data kept back from the compressor */
+
+#if defined (HAVE_ZLIB)
+
+#define TAPE_GZ_SPAN    (1024 * 1024)           /* distance between access points */
+#define TAPE_GZ_WINDOW  32768                   /* deflate history */
+#define TAPE_GZ_IOSIZE  65536                   /* compressed data transfer size */
+
+struct tape_gz_point {
+    t_addr              out;                /* offset in the uncompressed data */
+    t_addr              in;                 /* offset of the first full byte in the file */
+    int                 bits;               /* bits of the preceding byte still to decode */
+    uInt                window_len;         /* bytes of history */
+    uint8               window[TAPE_GZ_WINDOW]; /* data preceding the point */
+    };
+
+struct tape_gz {
+    z_stream            zs;                 /* decompression stream */
+    t_bool              zs_active;          /* zs initialized */
+    t_bool              raw;                /* zs restarted within a gzip member */
+    t_bool              member_start;       /* no data decoded since a member ended */
+    uint32              trailer;            /* member trailer bytes left to skip */
+    t_addr              in_pos;             /* file offset of the next compressed input */
+    t_addr              out;                /* uncompressed offset of the stream */
+    t_addr              size;               /* uncompressed data seen so far */
+    t_bool              at_end;             /* size is the size of the data */
+    struct tape_gz_point **points;          /* access points in order of offset */
+    uint32              point_count;
+    uint32              point_size;
+    t_addr              next_point;         /* offset for the next access point */
+    z_stream            ws;                 /* compression stream */
+    t_bool              ws_active;          /* ws initialized */
+    t_bool              ws_pending;         /* data compressed since the last flush */
+    t_addr              committed;          /* uncompressed data handed to ws */
+    t_addr              out_pos;            /* file offset for compressed output */
+    uint8               in[TAPE_GZ_IOSIZE]; /* compressed input */
+    uint8               obuf[TAPE_GZ_IOSIZE];/* compressed output, or data being skipped */
+    };
+
+static int tape_gz_sync (UNIT *uptr);
+static int tape_gz_truncate (UNIT *uptr, t_addr size);
+
+/* Discard the decompression state and the access points */
+
+static void tape_gz_reset (struct tape_gz *gz)
+{
+if (gz->zs_active)
+    inflateEnd (&gz->zs);
+gz->zs_active = FALSE;
+while (gz->point_count)
+    free (gz->points[--gz->point_count]);
+free (gz->points);
+gz->points = NULL;
+gz->point_size = 0;
+gz->next_point = TAPE_GZ_SPAN;
+gz->out = gz->size = 0;
+}
+
+static void tape_gz_add_point (struct tape_gz *gz)
+{
+struct tape_gz_point *p;
+
+if (gz->point_count == gz->point_size) {
+    struct tape_gz_point **points = (struct tape_gz_point **)realloc (gz->points, (gz->point_size + 64) * sizeof (*points));
+
+    if (points == NULL)
+        return;
+    gz->points = points;
+    gz->point_size += 64;
+    }
+p = (struct tape_gz_point *)malloc (sizeof (*p));
+if (p == NULL)
+    return;
+p->out = gz->out;
+p->in = gz->in_pos - gz->zs.avail_in;
+p->bits = gz->zs.data_type & 7;
+p->window_len = TAPE_GZ_WINDOW;
+if (inflateGetDictionary (&gz->zs, p->window, &p->window_len) != Z_OK) {
+    free (p);
+    return;
+    }
+gz->points[gz->point_count++] = p;
+gz->next_point = gz->out + TAPE_GZ_SPAN;
+}
+
+/* Start decompressing at an access point, or at the beginning of the file
+   when p is NULL */
+
+static t_bool tape_gz_restart (UNIT *uptr, struct tape_gz_point *p)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_gz *gz = ctx->gz;
+
+if (gz->zs_active)
+    inflateEnd (&gz->zs);
+memset (&gz->zs, 0, sizeof (gz->zs));
+gz->zs_active = (inflateInit2 (&gz->zs, p ? -15 : 15 + 32) == Z_OK);
+if (!gz->zs_active)
+    return FALSE;
+gz->raw = (p != NULL);
+gz->member_start = FALSE;
+gz->trailer = 0;
+gz->in_pos = p ? p->in : 0;
+gz->out = p ? p->out : 0;
+if (p) {
+    if (p->bits) {
+        uint8 c;
+
+        if (sim_fseek (uptr->fileref, p->in - 1, SEEK_SET) ||
+            (sim_fread (&c, 1, 1, uptr->fileref) != 1))
+            return FALSE;
+        inflatePrime (&gz->zs, p->bits, c >> (8 - p->bits));
+        }
+    inflateSetDictionary (&gz->zs, p->window, p->window_len);
+    }
+return TRUE;
+}
+
+/* Decompress len bytes at the current position into buf, or discard them
+   when buf is NULL.  Returns the number of bytes produced, which is short
+   at the end of the data or on an error. */
+
+static size_t tape_gz_inflate (UNIT *uptr, uint8 *buf, size_t len)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_gz *gz = ctx->gz;
+size_t done = 0;
+size_t n;
+int ret;
+
+while (done < len) {
+    if (gz->zs.avail_in == 0) {                         /* refill input */
+        if (sim_fseek (uptr->fileref, gz->in_pos, SEEK_SET)) {
+            ctx->stream_error = TRUE;
+            break;
+            }
+        n = sim_fread (gz->in, 1, sizeof (gz->in), uptr->fileref);
+        if (ferror (uptr->fileref)) {
+            ctx->stream_error = TRUE;
+            break;
+            }
+        if (n == 0) {                                   /* end of compressed data */
+            if (!gz->ws_active)
+                gz->at_end = TRUE;
+            break;
+            }
+        gz->zs.next_in = gz->in;
+        gz->zs.avail_in = (uInt)n;
+        gz->in_pos += n;
+        }
+    if (gz->trailer) {                                  /* skipping a member trailer? */
+        n = (gz->zs.avail_in < gz->trailer) ? gz->zs.avail_in : gz->trailer;
+        gz->zs.next_in += n;
+        gz->zs.avail_in -= (uInt)n;
+        gz->trailer -= (uint32)n;
+        if (gz->trailer == 0) {
+            inflateReset2 (&gz->zs, 15 + 16);
+            gz->raw = FALSE;
+            gz->member_start = TRUE;
+            }
+        continue;
+        }
+    n = len - done;
+    if ((buf == NULL) && (n > sizeof (gz->obuf)))
+        n = sizeof (gz->obuf);
+    gz->zs.next_out = buf ? buf + done : gz->obuf;
+    gz->zs.avail_out = (uInt)n;
+    ret = inflate (&gz->zs, Z_BLOCK);
+    n -= gz->zs.avail_out;
+    done += n;
+    gz->out += n;
+    if (gz->out > gz->size)
+        gz->size = gz->out;
+    if (n)
+        gz->member_start = FALSE;
+    if (ret == Z_STREAM_END) {                          /* end of a member */
+        if (gz->raw)
+            gz->trailer = 8;
+        else {
+            inflateReset (&gz->zs);
+            gz->member_start = TRUE;
+            }
+        continue;
+        }
+    if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+        if ((ret == Z_DATA_ERROR) && gz->member_start)  /* padding after the last member */
+            gz->at_end = TRUE;
+        else {
+            sim_debug_unit (ctx->dbit, uptr, "tape_gz_inflate(unit=%d) decompression error %d at %" T_ADDR_FMT "u\n",
+                            (int)(uptr-ctx->dptr->units), ret, gz->out);
+            ctx->stream_error = TRUE;
+            }
+        break;
+        }
+    if ((gz->zs.data_type & 128) && !(gz->zs.data_type & 64) && (gz->out >= gz->next_point))
+        tape_gz_add_point (gz);
+    }
+return done;
+}
+
+/* Flush the data compressed so far to the file */
+
+static int tape_gz_deflate (UNIT *uptr, int flush)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_gz *gz = ctx->gz;
+size_t n;
+int ret;
+
+do {
+    gz->ws.next_out = gz->obuf;
+    gz->ws.avail_out = sizeof (gz->obuf);
+    ret = deflate (&gz->ws, flush);
+    if (ret == Z_STREAM_ERROR)
+        return -1;
+    n = sizeof (gz->obuf) - gz->ws.avail_out;
+    if (n != 0) {
+        if (sim_fseek (uptr->fileref, gz->out_pos, SEEK_SET) ||
+            (sim_fwrite (gz->obuf, 1, n, uptr->fileref) != n))
+            return -1;
+        gz->out_pos += n;
+        }
+    } while ((gz->ws.avail_out == 0) || ((flush == Z_FINISH) && (ret != Z_STREAM_END)));
+return 0;
+}
+
+static size_t tape_gz_read (UNIT *uptr, t_addr pos, uint8 *buf, size_t len)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_gz *gz = ctx->gz;
+struct tape_gz_point *p = NULL;
+uint32 lo = 0, hi = gz->point_count;
+
+if (gz->ws_pending && tape_gz_sync (uptr))
+    return 0;
+while (lo < hi) {                                       /* find the last point at or before pos */
+    uint32 mid = lo + (hi - lo) / 2;
+
+    if (gz->points[mid]->out <= pos)
+        lo = mid + 1;
+    else
+        hi = mid;
+    }
+if (lo)
+    p = gz->points[lo - 1];
+if (!gz->zs_active || (pos < gz->out) || (p && (p->out > gz->out))) {
+    if (!tape_gz_restart (uptr, p)) {
+        ctx->stream_error = TRUE;
+        return 0;
+        }
+    }
+while (gz->out < pos)                                   /* skip to pos */
+    if (tape_gz_inflate (uptr, NULL, (size_t)(pos - gz->out)) == 0)
+        return 0;
+return tape_gz_inflate (uptr, buf, len);
+}
+
+/* Size of the uncompressed data, decompressing the rest of the file if
+   it hasn't been seen yet */
+
+static t_addr tape_gz_size (UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_gz *gz = ctx->gz;
+
+if (gz->ws_active)
+    return gz->committed;
+if (!gz->at_end) {
+    (void)tape_gz_read (uptr, gz->size, NULL, 0);       /* continue from the furthest point seen */
+    while (!gz->at_end && !ctx->stream_error)
+        if (tape_gz_inflate (uptr, NULL, sizeof (gz->obuf)) == 0)
+            break;
+    }
+return gz->size;
+}
+
+static size_t tape_gz_write (UNIT *uptr, t_addr pos, const uint8 *buf, size_t len)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_gz *gz = ctx->gz;
+
+if ((pos == 0) && (gz->committed != 0))                /* rewriting from the start? */
+    tape_gz_truncate (uptr, 0);
+if (pos != gz->committed) {
+    sim_debug_unit (ctx->dbit, uptr, "tape_gz_write(unit=%d) can't rewrite compressed data at %" T_ADDR_FMT "u\n",
+                    (int)(uptr-ctx->dptr->units), pos);
+    ctx->stream_error = TRUE;
+    return 0;
+    }
+if (!gz->ws_active) {
+    memset (&gz->ws, 0, sizeof (gz->ws));
+    if (deflateInit2 (&gz->ws, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        ctx->stream_error = TRUE;
+        return 0;
+        }
+    gz->ws_active = TRUE;
+    gz->out_pos = 0;
+    }
+gz->ws.next_in = (Bytef *)buf;
+gz->ws.avail_in = (uInt)len;
+if (tape_gz_deflate (uptr, Z_NO_FLUSH)) {
+    ctx->stream_error = TRUE;
+    return 0;
+    }
+gz->committed += len;
+gz->ws_pending = TRUE;
+return len;
+}
+
+/* Make everything compressed so far readable */
+
+static int tape_gz_sync (UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_gz *gz = ctx->gz;
+
+if (!gz->ws_pending)
+    return 0;
+gz->ws_pending = FALSE;
+if (tape_gz_deflate (uptr, Z_SYNC_FLUSH) || fflush (uptr->fileref)) {
+    ctx->stream_error = TRUE;
+    return -1;
+    }
+return 0;
+}
+
+/* The only truncation possible is discarding everything */
+
+static int tape_gz_truncate (UNIT *uptr, t_addr size)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_gz *gz = ctx->gz;
+
+if (size != 0)
+    return (size >= tape_gz_size (uptr)) ? 0 : -1;
+if (gz->ws_active)
+    deflateEnd (&gz->ws);
+gz->ws_active = gz->ws_pending = FALSE;
+gz->committed = 0;
+tape_gz_reset (gz);
+gz->at_end = TRUE;
+ctx->rbuf_len = 0;
+return sim_set_fsize (uptr->fileref, 0);
+}
+#endif
+
+/* Set up a unit whose container file is compressed */
+
+static t_stat tape_gz_setup (UNIT *uptr)
+{
+#if defined (HAVE_ZLIB)
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+#endif
+uint8 magic[4];
+size_t n;
+
+if ((MT_GET_FMT (uptr) >= MTUF_F_ANSI) || (uptr->fileref == NULL))
+    return SCPE_OK;
+memset (magic, 0, sizeof (magic));
+(void)sim_fseek (uptr->fileref, 0, SEEK_SET);
+n = sim_fread (magic, 1, sizeof (magic), uptr->fileref);
+clearerr (uptr->fileref);
+if ((n == sizeof (magic)) && (magic[0] == 0x28) && (magic[1] == 0xB5) && (magic[2] == 0x2F) && (magic[3] == 0xFD))
+    return sim_messagef (SCPE_OPENERR, "%s: zstd compressed tape images are not supported\n", sim_uname (uptr));
+if ((n >= 2) && (magic[0] == 0x1F) && (magic[1] == 0x8B)) {
+#if defined (HAVE_ZLIB)
+    if (!tape_buffered (uptr) ||
+        ((ctx->gz = (struct tape_gz *)calloc (1, sizeof (*ctx->gz))) == NULL))
+        return SCPE_MEM;
+    ctx->gz->next_point = TAPE_GZ_SPAN;
+    if (!(uptr->flags & UNIT_RO)) {
+        if ((uptr->flags & UNIT_ROABLE) == 0)
+            return sim_messagef (SCPE_NORO, "%s: compressed tape images are read only and Read Only operation is not allowed\n", sim_uname (uptr));
+        uptr->flags |= UNIT_RO;
+        sim_messagef (SCPE_OK, "%s: compressed tape image is read only\n", sim_uname (uptr));
+        }
+    return SCPE_OK;
+#else
+    return sim_messagef (SCPE_OPENERR, "%s: compressed tape images are not supported by this simulator\n", sim_uname (uptr));
+#endif
+    }
+if ((n == 0) && !(uptr->flags & UNIT_RO) && match_ext (uptr->filename, "GZ")) {
+#if defined (HAVE_ZLIB)
+    if (!tape_buffered (uptr) ||
+        ((ctx->gz = (struct tape_gz *)calloc (1, sizeof (*ctx->gz))) == NULL))
+        return SCPE_MEM;
+    ctx->gz->next_point = TAPE_GZ_SPAN;
+    ctx->gz->at_end = TRUE;
+#else
+    return sim_messagef (SCPE_OPENERR, "%s: compressed tape images are not supported by this simulator\n", sim_uname (uptr));
+#endif
+    }
+return SCPE_OK;
+}
+
+/* Finish writing a compressed container and release its state */
+
+static void tape_gz_free (UNIT *uptr)
+{
+#if defined (HAVE_ZLIB)
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_gz *gz = ctx->gz;
+
+if (gz == NULL)
+    return;
+if (gz->ws_active) {
+    gz->ws.avail_in = 0;
+    if (tape_gz_deflate (uptr, Z_FINISH) || fflush (uptr->fileref))
+        sim_printf ("%s: error completing compressed tape image '%s'\n", sim_uname (uptr), uptr->filename);
+    deflateEnd (&gz->ws);
+    }
+tape_gz_reset (gz);
+free (gz);
+ctx->gz = NULL;
+#endif
+}
+
+/* Access to the data of the container file.  The routines below transfer
+   bytes at a given offset of the (uncompressed) data, and set
+   stream_error when the transfer fails. */
+
+static size_t tape_read_at (UNIT *uptr, t_addr pos, uint8 *buf, size_t len)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+size_t n;
+
+#if defined (HAVE_ZLIB)
+if (ctx->gz)
+    return tape_gz_read (uptr, pos, buf, len);
+#endif
+if (sim_fseek (uptr->fileref, pos, SEEK_SET)) {
+    ctx->stream_error = TRUE;
+    return 0;
+    }
+n = sim_fread (buf, 1, len, uptr->fileref);
+if (ferror (uptr->fileref))
+    ctx->stream_error = TRUE;
+return n;
+}
+
+static size_t tape_write_at (UNIT *uptr, t_addr pos, const uint8 *buf, size_t len)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+size_t n;
+
+#if defined (HAVE_ZLIB)
+if (ctx->gz)
+    return tape_gz_write (uptr, pos, buf, len);
+#endif
+if (sim_fseek (uptr->fileref, pos, SEEK_SET)) {
+    ctx->stream_error = TRUE;
+    return 0;
+    }
+n = sim_fwrite ((void *)buf, 1, len, uptr->fileref);
+if (n != len)
+    ctx->stream_error = TRUE;
+return n;
+}
+
+static int tape_file_flush (UNIT *uptr)
+{
+#if defined (HAVE_ZLIB)
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+if (ctx->gz)
+    return tape_gz_sync (uptr);
+#endif
+return fflush (uptr->fileref);
+}
+
+static t_offset tape_file_size (UNIT *uptr)
+{
+#if defined (HAVE_ZLIB)
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+if (ctx && ctx->gz)
+    return (t_offset)tape_gz_size (uptr);
+#endif
+return sim_fsize_ex (uptr->fileref);
+}
+
+static int tape_file_truncate (UNIT *uptr, t_addr size)
+{
+#if defined (HAVE_ZLIB)
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+if (ctx->gz)
+    return tape_gz_truncate (uptr, size);
+#endif
+return sim_set_fsize (uptr->fileref, size);
+}
+
+/* Write out buffered data and perform a pending truncation.  Data for a
+   compressed container can't be changed once it has been written, so
+   unless all is set, the last TAPE_GZ_TAIL bytes are kept in the buffer
+   where they can still be rewritten. */
+
+static int tape_flush_ex (UNIT *uptr, t_bool all)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+int stat = 0;
+
+if (!tape_buffered (uptr))
+    return 0;
+if (ctx->truncate) {
+    ctx->truncate = FALSE;
+    if (tape_file_truncate (uptr, ctx->trunc_size))
+        stat = -1;
+    }
+if (ctx->wbuf_len) {
+    size_t keep = 0;
+    size_t n;
+
+    if ((ctx->gz != NULL) && !all)
+        keep = (ctx->wbuf_len < TAPE_GZ_TAIL) ? ctx->wbuf_len : TAPE_GZ_TAIL;
+    n = ctx->wbuf_len - keep;
+    if (n != 0) {
+        if (tape_write_at (uptr, ctx->wbuf_pos, ctx->wbuf, n) != n)
+            stat = -1;
+        memmove (ctx->wbuf, ctx->wbuf + n, keep);
+        ctx->wbuf_pos += n;
+        ctx->wbuf_len = keep;
+        if (tape_file_flush (uptr))
+            stat = -1;
+        }
+    }
+if (stat)
+    ctx->stream_error = TRUE;
+return stat;
+}
+
+static int tape_flush (UNIT *uptr)
+{
+return tape_flush_ex (uptr, FALSE);
+}
+
+/* Fill the read window with data around pos.  Returns FALSE if pos is at
+   or beyond the end of the file. */
+
+static t_bool tape_fill (UNIT *uptr, t_addr pos, size_t want, t_addr limit)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+t_addr start = pos;
+size_t size = TAPE_BUF_SIZE;
+
+if ((ctx->rbuf_len != 0) && (pos < ctx->rbuf_pos))      /* moving in reverse? */
+    start = (pos + want > TAPE_BUF_SIZE) ? pos + want - TAPE_BUF_SIZE : 0;
+if (limit - start < size)
+    size = (size_t)(limit - start);
+ctx->rbuf_len = 0;
+ctx->rbuf_len = tape_read_at (uptr, start, ctx->rbuf, size);
+ctx->rbuf_pos = start;
+return (pos < ctx->rbuf_pos + ctx->rbuf_len);
+}
+
+static size_t tape_fread (void *bptr, size_t size, size_t count, UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+uint8 *buf = (uint8 *)bptr;
+size_t len = size * count;
+size_t got = 0;
+size_t n;
+t_addr pos, limit, p;
+
+if (!tape_buffered (uptr))
+    return sim_fread (bptr, size, count, uptr->fileref);
+pos = ctx->stream_pos;
+limit = ctx->truncate ? ctx->trunc_size : (t_addr)-1;
+while ((got < len) && !ctx->stream_error) {
+    p = pos + got;
+    if ((p >= ctx->rbuf_pos) && (p < ctx->rbuf_pos + ctx->rbuf_len)) {
+        n = (size_t)(ctx->rbuf_pos + ctx->rbuf_len - p);
+        if (n > len - got)
+            n = len - got;
+        memcpy (buf + got, ctx->rbuf + (size_t)(p - ctx->rbuf_pos), n);
+        got += n;
+        continue;
+        }
+    if (p >= limit)
+        break;
+    if (len - got >= TAPE_BUF_SIZE / 2) {               /* large transfer? */
+        size_t want = len - got;
+
+        if (limit - p < want)
+            want = (size_t)(limit - p);
+        n = tape_read_at (uptr, p, buf + got, want);
+        got += n;
+        if (n < want)
+            break;
+        continue;
+        }
+    if (!tape_fill (uptr, p, len - got, limit))
+        break;
+    }
+if ((ctx->wbuf_len != 0) &&                             /* overlay unwritten data */
+    (pos < ctx->wbuf_pos + ctx->wbuf_len) && (ctx->wbuf_pos < pos + len)) {
+    t_addr start = (pos > ctx->wbuf_pos) ? pos : ctx->wbuf_pos;
+    t_addr end = ctx->wbuf_pos + ctx->wbuf_len;
+
+    if (end > pos + len)
+        end = pos + len;
+    if (start <= pos + got) {
+        memcpy (buf + (size_t)(start - pos), ctx->wbuf + (size_t)(start - ctx->wbuf_pos), (size_t)(end - start));
+        if (end - pos > got)
+            got = (size_t)(end - pos);
+        }
+    }
+ctx->stream_pos = pos + got;
+if ((got < len) && !ctx->stream_error)
+    ctx->stream_eof = TRUE;
+if ((size > 1) && !sim_end)
+    sim_buf_swap_data (buf, size, got / size);
+return got / size;
+}
+
+static size_t tape_fwrite (const void *bptr, size_t size, size_t count, UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+size_t len = size * count;
+size_t off;
+t_addr pos;
+
+if (!tape_buffered (uptr))
+    return sim_fwrite (bptr, size, count, uptr->fileref);
+pos = ctx->stream_pos;
+if ((ctx->wbuf_len != 0) &&                             /* buffer full? */
+    (pos + len > ctx->wbuf_pos + TAPE_BUF_SIZE))
+    tape_flush (uptr);
+if ((ctx->wbuf_len != 0) &&                             /* not an extension or rewrite of buffered data? */
+    ((pos < ctx->wbuf_pos) || (pos > ctx->wbuf_pos + ctx->wbuf_len)))
+    tape_flush_ex (uptr, TRUE);
+if ((ctx->wbuf == NULL) && (len < TAPE_BUF_SIZE / 2))
+    ctx->wbuf = (uint8 *)malloc (TAPE_BUF_SIZE);
+if ((ctx->wbuf == NULL) || (len >= TAPE_BUF_SIZE / 2)) {/* write directly */
+    size_t n;
+
+    tape_flush_ex (uptr, TRUE);
+    if ((pos < ctx->rbuf_pos + ctx->rbuf_len) && (ctx->rbuf_pos < pos + len))
+        ctx->rbuf_len = 0;
+    if (ctx->gz == NULL) {
+        if (sim_fseek (uptr->fileref, pos, SEEK_SET)) {
+            ctx->stream_error = TRUE;
+            return 0;
+            }
+        n = sim_fwrite (bptr, size, count, uptr->fileref);
+        if (ferror (uptr->fileref))
+            ctx->stream_error = TRUE;
+        }
+    else {                                              /* only record data is this large */
+        n = tape_write_at (uptr, pos, (const uint8 *)bptr, len) / size;
+        if (tape_file_flush (uptr))
+            ctx->stream_error = TRUE;
+        }
+    ctx->stream_pos = pos + n * size;
+    return n;
+    }
+if (ctx->wbuf_len == 0)
+    ctx->wbuf_pos = pos;
+off = (size_t)(pos - ctx->wbuf_pos);
+if (sim_end || (size == 1))
+    memcpy (ctx->wbuf + off, bptr, len);
+else
+    sim_buf_copy_swapped (ctx->wbuf + off, bptr, size, count);
+if (off + len > ctx->wbuf_len)
+    ctx->wbuf_len = off + len;
+if ((pos < ctx->rbuf_pos + ctx->rbuf_len) && (ctx->rbuf_pos < pos + len)) {
+    t_addr start = (pos > ctx->rbuf_pos) ? pos : ctx->rbuf_pos;   /* keep the window current */
+    t_addr end = ctx->rbuf_pos + ctx->rbuf_len;
+
+    if (end > pos + len)
+        end = pos + len;
+    memcpy (ctx->rbuf + (size_t)(start - ctx->rbuf_pos), ctx->wbuf + (size_t)(start - ctx->wbuf_pos), (size_t)(end - start));
+    }
+ctx->stream_pos = pos + len;
+return count;
+}
+
+static int tape_feof (UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+if (!tape_buffered (uptr))
+    return feof (uptr->fileref);
+return ctx->stream_eof;
+}
+
+static int tape_ferror (UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+if (!tape_buffered (uptr))
+    return ferror (uptr->fileref);
+return ctx->stream_error || ferror (uptr->fileref);
+}
+
+static void tape_clearerr (UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+if (tape_buffered (uptr))
+    ctx->stream_error = FALSE;
+clearerr (uptr->fileref);
+}
+
+static t_addr tape_ftell (UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+if (!tape_buffered (uptr))
+    return (t_addr)sim_ftell (uptr->fileref);
+return ctx->stream_pos;
+}
+
+static t_offset tape_fsize (UNIT *uptr)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+t_offset size = tape_file_size (uptr);
+
+if (tape_buffered (uptr)) {
+    if (ctx->truncate && (size > (t_offset)ctx->trunc_size))
+        size = (t_offset)ctx->trunc_size;
+    if ((ctx->wbuf_len != 0) && ((t_offset)(ctx->wbuf_pos + ctx->wbuf_len) > size))
+        size = (t_offset)(ctx->wbuf_pos + ctx->wbuf_len);
+    }
+return size;
+}
+
+/* Set the size of the file.  Shortening the file within the buffered data
+   is deferred until the data is written. */
+
+static int tape_set_fsize (UNIT *uptr, t_addr size)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+if (!tape_buffered (uptr))
+    return sim_set_fsize (uptr->fileref, size);
+if (ctx->rbuf_pos + ctx->rbuf_len > size)
+    ctx->rbuf_len = (ctx->rbuf_pos < size) ? (size_t)(size - ctx->rbuf_pos) : 0;
+if ((ctx->wbuf_len == 0) || (size > ctx->wbuf_pos + ctx->wbuf_len)) {
+    tape_flush (uptr);
+    return tape_file_truncate (uptr, size);
+    }
+ctx->wbuf_len = (ctx->wbuf_pos < size) ? (size_t)(size - ctx->wbuf_pos) : 0;
+if (!ctx->truncate || (size < ctx->trunc_size))
+    ctx->trunc_size = size;
+ctx->truncate = TRUE;
+return 0;
+}
+
 static int sim_tape_seek (UNIT *uptr, t_addr pos)
 {
-if (MT_GET_FMT (uptr) < MTUF_F_ANSI)
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+
+if (MT_GET_FMT (uptr) >= MTUF_F_ANSI)
+    return 0;
+if (!tape_buffered (uptr))
     return sim_fseek (uptr->fileref, pos, SEEK_SET);
+ctx->stream_pos = pos;
+ctx->stream_eof = FALSE;
 return 0;
 }
 
 static t_offset sim_tape_size (UNIT *uptr)
 {
 if (MT_GET_FMT (uptr) < MTUF_F_ANSI)
-    return sim_fsize_ex (uptr->fileref); /* True on-disk tape images: file size  */
+    return tape_fsize (uptr);            /* True on-disk tape images: file size  */
 return uptr->tape_eom;                   /* Virtual tape images: record/TM count */
 }
 
@@ -1269,7 +2256,7 @@ switch (f) {                                       /* otherwise the read method
 
         do {                                            /* loop until a record, gap, or error is seen */
             if (bufcntr == bufcap) {                    /* if the buffer is empty then refill it */
-                if (feof (uptr->fileref)) {             /* if we hit the EOF while reading a gap */
+                if (tape_feof (uptr)) {             /* if we hit the EOF while reading a gap */
                     if (sizeof_gap > 0)                 /*   then if detection is enabled */
                         status = MTSE_RUNAWAY;          /*     then report a tape runaway */
                     else                                /*   otherwise report the physical EOF */
@@ -1284,12 +2271,11 @@ switch (f) {                                       /* otherwise the read method
                     bufcap = sizeof (buffer)            /*   to the full size of the buffer */
                                / sizeof (buffer [0]);
 
-                bufcap = sim_fread (buffer,             /* fill the buffer */
+                bufcap = tape_fread (buffer,             /* fill the buffer */
                                     sizeof (t_mtrlnt),  /*   with tape metadata */
-                                    bufcap,
-                                    uptr->fileref);
+                                    bufcap, uptr);
 
-                if (ferror (uptr->fileref)) {           /* if a file I/O error occurred */
+                if (tape_ferror (uptr)) {           /* if a file I/O error occurred */
                     if (bufcntr == 0)                   /*   then if this is the initial read */
                         MT_SET_PNU (uptr);              /*     then set position not updated */
 
@@ -1372,12 +2358,11 @@ switch (f) {                                       /* otherwise the read method
                 break;
                 }
 
-            (void)sim_fread (&rev_lnt,                  /* get the reverse length */
+            (void)tape_fread (&rev_lnt,                  /* get the reverse length */
                              sizeof (t_mtrlnt),
-                             1,
-                             uptr->fileref);
+                             1, uptr);
 
-            if (ferror (uptr->fileref)) {               /* if a file I/O error occurred */
+            if (tape_ferror (uptr)) {               /* if a file I/O error occurred */
                 status = sim_tape_ioerr (uptr);         /* report the error and quit */
                 break;
                 }
@@ -1393,17 +2378,17 @@ switch (f) {                                       /* otherwise the read method
         break;                                          /* otherwise the operation succeeded */
 
     case MTUF_F_TPC:
-        (void)sim_fread (&tpcbc, sizeof (t_tpclnt), 1, uptr->fileref);
+        (void)tape_fread (&tpcbc, sizeof (t_tpclnt), 1, uptr);
         *bc = (t_mtrlnt)tpcbc;                          /* save rec lnt */
 
-        if (ferror (uptr->fileref)) {                   /* error? */
+        if (tape_ferror (uptr)) {                   /* error? */
             MT_SET_PNU (uptr);                          /* pos not upd */
             status = sim_tape_ioerr (uptr);
             }
         else {
-            if ((feof (uptr->fileref)) ||               /* eof? */
+            if ((tape_feof (uptr)) ||               /* eof? */
                 ((tpcbc == TPC_EOM) &&
-                 (sim_fsize (uptr->fileref) == (uint32)sim_ftell (uptr->fileref)))) {
+                 (tape_fsize (uptr) == tape_ftell (uptr)))) {
                 MT_SET_PNU (uptr);                      /* pos not upd */
                 status = MTSE_EOM;
                 }
@@ -1419,14 +2404,14 @@ switch (f) {                                       /* otherwise the read method
 
     case MTUF_F_P7B:
         for (sbc = 0, all_eof = 1; ; sbc++) {           /* loop thru record */
-            (void)sim_fread (&c, sizeof (uint8), 1, uptr->fileref);
+            (void)tape_fread (&c, sizeof (uint8), 1, uptr);
 
-            if (ferror (uptr->fileref)) {               /* error? */
+            if (tape_ferror (uptr)) {               /* error? */
                 MT_SET_PNU (uptr);                      /* pos not upd */
                 status = sim_tape_ioerr (uptr);
                 break;
                 }
-            else if (feof (uptr->fileref)) {            /* eof? */
+            else if (tape_feof (uptr)) {            /* eof? */
                 if (sbc == 0)                           /* no data? eom */
                     status = MTSE_EOM;
                 break;                                  /* treat like eor */
@@ -1450,13 +2435,13 @@ switch (f) {                                       /* otherwise the read method
 
     case MTUF_F_AWS:
         memset (&awshdr, 0, sizeof (awshdr));
-        rdcnt = sim_fread (&awshdr, sizeof (t_awslnt), 3, uptr->fileref);
-        if (ferror (uptr->fileref)) {           /* error? */
+        rdcnt = tape_fread (&awshdr, sizeof (t_awslnt), 3, uptr);
+        if (tape_ferror (uptr)) {           /* error? */
             MT_SET_PNU (uptr);                  /* pos not upd */
             status = sim_tape_ioerr (uptr);
             break;
             }
-        if ((feof (uptr->fileref)) ||           /* eof? */
+        if ((tape_feof (uptr)) ||           /* eof? */
             (rdcnt < 3)) {
             uptr->tape_eom = uptr->pos;
             MT_SET_PNU (uptr);                  /* pos not upd */
@@ -1480,9 +2465,9 @@ switch (f) {                                       /* otherwise the read method
         *bc = (t_mtrlnt)awshdr.nxtlen;          /* save rec lnt */
         uptr->pos += awshdr.nxtlen;             /* spc over record */
         memset (&awshdr, 0, sizeof (t_awslnt));
-        saved_pos = (t_addr)sim_ftell (uptr->fileref);/* save record data address */
+        saved_pos = tape_ftell (uptr);/* save record data address */
         (void)sim_tape_seek (uptr, uptr->pos); /* for read */
-        rdcnt = sim_fread (&awshdr, sizeof (t_awslnt), 3, uptr->fileref);
+        rdcnt = tape_fread (&awshdr, sizeof (t_awslnt), 3, uptr);
         if ((rdcnt == 3) &&
             ((awshdr.prelen != *bc) || ((awshdr.rectyp != AWS_REC) && (awshdr.rectyp != AWS_TMK)))) {
             status = MTSE_INVRL;
@@ -1522,11 +2507,11 @@ switch (f) {                                       /* otherwise the read method
             if (uptr->pos >= tape->record_count)
                 status = MTSE_EOM;
             else {
-                if (tape->records[uptr->pos]->size == 0)
+                if (tape->records[uptr->pos].size == 0)
                     status = MTSE_TMK;
                 else
                     /* Should check range here. */
-                    *bc = (t_mtrlnt) tape->records[uptr->pos]->size;
+                    *bc = (t_mtrlnt) tape->records[uptr->pos].size;
                 ++uptr->pos;
                 }
             }
@@ -1659,10 +2644,10 @@ switch (f) {                                            /* otherwise the read me
                     break;
                     }
 
-                bufcntr = sim_fread (buffer, sizeof (t_mtrlnt), /* fill the buffer */
-                                     bufcap, uptr->fileref);    /*   with tape metadata */
+                bufcntr = tape_fread (buffer, sizeof (t_mtrlnt), /* fill the buffer */
+                                     bufcap, uptr);    /*   with tape metadata */
 
-                if (ferror (uptr->fileref)) {           /* if a file I/O error occurred */
+                if (tape_ferror (uptr)) {           /* if a file I/O error occurred */
                     status = sim_tape_ioerr (uptr);     /*   then report the error and quit */
                     break;
                     }
@@ -1711,12 +2696,12 @@ switch (f) {                                            /* otherwise the read me
     case MTUF_F_TPC:
         ppos = sim_tape_tpc_fnd (uptr, (t_addr *) uptr->filebuf); /* find prev rec */
         (void)sim_tape_seek (uptr, ppos);               /* position */
-        (void)sim_fread (&tpcbc, sizeof (t_tpclnt), 1, uptr->fileref);
+        (void)tape_fread (&tpcbc, sizeof (t_tpclnt), 1, uptr);
         *bc = (t_mtrlnt)tpcbc;                          /* save rec lnt */
 
-        if (ferror (uptr->fileref))                     /* error? */
+        if (tape_ferror (uptr))                     /* error? */
             status = sim_tape_ioerr (uptr);
-        else if (feof (uptr->fileref))                  /* eof? */
+        else if (tape_feof (uptr))                  /* eof? */
             status = MTSE_EOM;
         else {
             uptr->pos = ppos;                           /* spc over record */
@@ -1746,12 +2731,12 @@ switch (f) {                                            /* otherwise the read me
                         buf_offset -= BUF_SZ;
                         }
                     (void)sim_tape_seek (uptr, buf_offset);
-                    bytes_in_buf = sim_fread (buf, sizeof (uint8), read_size, uptr->fileref);
-                    if (ferror (uptr->fileref)) {       /* error? */
+                    bytes_in_buf = tape_fread (buf, sizeof (uint8), read_size, uptr);
+                    if (tape_ferror (uptr)) {       /* error? */
                         status = sim_tape_ioerr (uptr);
                         break;
                         }
-                    if (feof (uptr->fileref)) {         /* eof? */
+                    if (tape_feof (uptr)) {         /* eof? */
                         status = MTSE_EOM;
                         break;
                         }
@@ -1783,14 +2768,14 @@ switch (f) {                                            /* otherwise the read me
                 break;
                 }
             memset (&awshdr, 0, sizeof (awshdr));
-            rdcnt = sim_fread (&awshdr, sizeof (t_awslnt), 3, uptr->fileref);
-            if (ferror (uptr->fileref)) {               /* error? */
+            rdcnt = tape_fread (&awshdr, sizeof (t_awslnt), 3, uptr);
+            if (tape_ferror (uptr)) {               /* error? */
                 status = sim_tape_ioerr (uptr);
                 break;
                 }
-            if (feof (uptr->fileref)) {                 /* eof? */
+            if (tape_feof (uptr)) {                 /* eof? */
                 if ((uptr->pos > sizeof (t_awshdr)) &&
-                    (uptr->pos >= sim_fsize (uptr->fileref))) {
+                    (uptr->pos >= tape_fsize (uptr))) {
                     uptr->tape_eom = uptr->pos;
                     (void)sim_tape_seek (uptr, uptr->pos - sizeof (t_awshdr));/* position */
                     continue;
@@ -1858,11 +2843,11 @@ switch (f) {                                            /* otherwise the read me
             MEMORY_TAPE *tape = (MEMORY_TAPE *)uptr->fileref;
 
             --uptr->pos;
-            if (tape->records[uptr->pos]->size == 0)
+            if (tape->records[uptr->pos].size == 0)
                 status = MTSE_TMK;
             else
                 /* Should check range here. */
-                *bc = (t_mtrlnt) tape->records[uptr->pos]->size;
+                *bc = (t_mtrlnt) tape->records[uptr->pos].size;
             }
         break;
 
@@ -1936,8 +2921,8 @@ if (rbc > max) {                                        /* rec out of range? */
     return MTSE_INVRL;
     }
 if (f < MTUF_F_ANSI) {
-    i = (t_mtrlnt) sim_fread (buf, sizeof (uint8), rbc, uptr->fileref); /* read record */
-    if (ferror (uptr->fileref)) {                           /* error? */
+    i = (t_mtrlnt) tape_fread (buf, sizeof (uint8), rbc, uptr); /* read record */
+    if (tape_ferror (uptr)) {                           /* error? */
         MT_SET_PNU (uptr);
         uptr->pos = opos;
         return sim_tape_ioerr (uptr);
@@ -1946,7 +2931,11 @@ if (f < MTUF_F_ANSI) {
 else {
     MEMORY_TAPE *tape = (MEMORY_TAPE *)uptr->fileref;
 
-    memcpy (buf, tape->records[uptr->pos - 1]->data, rbc);
+    if (memory_tape_read_record (tape, (uint32)(uptr->pos - 1), buf)) {
+        MT_SET_PNU (uptr);
+        uptr->pos = opos;
+        return MTSE_IOERR;
+        }
     i = rbc;
     }
 for ( ; i < rbc; i++)                                   /* fill with 0's */
@@ -1966,6 +2955,26 @@ AIO_CALL(TOP_RDRF, buf, bc, NULL, max, 0, 0, 0, NULL, callback);
 return r;
 }
 
+/* Queued read: like sim_tape_rdrecf_a, but any number of requests may be
+   outstanding on a unit, and the callback gets the caller's context for
+   the request it completes.  Requests are performed, and their callbacks
+   called, in the order they were issued, so a controller can post a
+   sequence of reads, writes and positioning commands and take each
+   completion as it arrives.  Callbacks run in the simulator thread, ahead
+   of the unit's service routine.  When the unit isn't asynchronous the
+   operation is done, and the callback called, before this returns. */
+
+t_stat sim_tape_rdrecf_q (UNIT *uptr, uint8 *buf, t_mtrlnt *bc, t_mtrlnt max, TAPE_QCALLBACK callback, void *arg)
+{
+t_stat r;
+
+AIO_QUEUE(TOP_RDRF, buf, bc, NULL, max, 0, 0, 0, NULL);
+r = sim_tape_rdrecf (uptr, buf, bc, max);
+if (callback)
+    callback (uptr, r, arg);
+return r;
+}
+
 
 /* Read record reverse
 
@@ -2010,14 +3019,15 @@ if (st != MTSE_OK) {
 if (rbc > max)                                          /* rec out of range? */
     return MTSE_INVRL;
 if (f < MTUF_F_ANSI) {
-    i = (t_mtrlnt) sim_fread (buf, sizeof (uint8), rbc, uptr->fileref); /* read record */
-    if (ferror (uptr->fileref))                             /* error? */
+    i = (t_mtrlnt) tape_fread (buf, sizeof (uint8), rbc, uptr); /* read record */
+    if (tape_ferror (uptr))                             /* error? */
         return sim_tape_ioerr (uptr);
     }
 else {
     MEMORY_TAPE *tape = (MEMORY_TAPE *)uptr->fileref;
 
-    memcpy (buf, tape->records[uptr->pos]->data, rbc);
+    if (memory_tape_read_record (tape, (uint32)uptr->pos, buf))
+        return MTSE_IOERR;
     i = rbc;
     }
 for ( ; i < rbc; i++)                                   /* fill with 0's */
@@ -2037,6 +3047,19 @@ AIO_CALL(TOP_RDRR, buf, bc, NULL, max, 0, 0, 0, NULL, callback);
 return r;
 }
 
+/* Queued read reverse, see sim_tape_rdrecf_q */
+
+t_stat sim_tape_rdrecr_q (UNIT *uptr, uint8 *buf, t_mtrlnt *bc, t_mtrlnt max, TAPE_QCALLBACK callback, void *arg)
+{
+t_stat r;
+
+AIO_QUEUE(TOP_RDRR, buf, bc, NULL, max, 0, 0, 0, NULL);
+r = sim_tape_rdrecr (uptr, buf, bc, max);
+if (callback)
+    callback (uptr, r, arg);
+return r;
+}
+
 /* Write record forward
 
    Inputs:
@@ -2064,6 +3087,7 @@ t_stat status = MTSE_OK;
 if (ctx == NULL)                                        /* if not properly attached? */
     return sim_messagef (SCPE_IERR, "Bad Attach\n");    /*   that's a problem */
 sim_debug_unit (ctx->dbit, uptr, "sim_tape_wrrecf(unit=%d, buf=%p, bc=%d)\n", (int)(uptr-ctx->dptr->units), buf, bc);
+tape_index_free (ctx);                                  /* the tape is being changed */
 
 sim_tape_data_trace(uptr, buf, bc, "Record Write", (uptr->dctrl | ctx->dptr->dctrl) & MTSE_DBG_DAT, MTSE_DBG_STR);
 MT_CLR_PNU (uptr);
@@ -2082,10 +3106,10 @@ switch (f) {                                            /* case on format */
         sbc = MTR_L ((bc + 1) & ~1);                    /* pad odd length */
         /* fall through into the E11 handler */
     case MTUF_F_E11:                                    /* E11 */
-        (void)sim_fwrite (&bc, sizeof (t_mtrlnt), 1, uptr->fileref);
-        (void)sim_fwrite (buf, sizeof (uint8), sbc, uptr->fileref);
-        (void)sim_fwrite (&bc, sizeof (t_mtrlnt), 1, uptr->fileref);
-        if (ferror (uptr->fileref)) {                   /* error? */
+        (void)tape_fwrite (&bc, sizeof (t_mtrlnt), 1, uptr);
+        (void)tape_fwrite (buf, sizeof (uint8), sbc, uptr);
+        (void)tape_fwrite (&bc, sizeof (t_mtrlnt), 1, uptr);
+        if (tape_ferror (uptr)) {                   /* error? */
             MT_SET_PNU (uptr);
             return sim_tape_ioerr (uptr);
             }
@@ -2094,9 +3118,9 @@ switch (f) {                                            /* case on format */
 
     case MTUF_F_P7B:                                    /* Pierce 7B */
         buf[0] = buf[0] | P7B_SOR;                      /* mark start of rec */
-        (void)sim_fwrite (buf, sizeof (uint8), sbc, uptr->fileref);
-        (void)sim_fwrite (buf, sizeof (uint8), 1, uptr->fileref); /* delimit rec */
-        if (ferror (uptr->fileref)) {                   /* error? */
+        (void)tape_fwrite (buf, sizeof (uint8), sbc, uptr);
+        (void)tape_fwrite (buf, sizeof (uint8), 1, uptr); /* delimit rec */
+        if (tape_ferror (uptr)) {                   /* error? */
             MT_SET_PNU (uptr);
             return sim_tape_ioerr (uptr);
             }
@@ -2123,6 +3147,21 @@ AIO_CALL(TOP_WREC, buf, 0, NULL, 0, bc, 0, 0, NULL, callback);
 return r;
 }
 
+/* Queued write, see sim_tape_rdrecf_q.  The data is taken from buf when
+   the write is performed, so the buffer must not be reused until the
+   callback has been called. */
+
+t_stat sim_tape_wrrecf_q (UNIT *uptr, uint8 *buf, t_mtrlnt bc, TAPE_QCALLBACK callback, void *arg)
+{
+t_stat r;
+
+AIO_QUEUE(TOP_WREC, buf, NULL, NULL, 0, bc, 0, 0, NULL);
+r = sim_tape_wrrecf (uptr, buf, bc);
+if (callback)
+    callback (uptr, r, arg);
+return r;
+}
+
 /* Write AWS metadata (and possibly data) forward (internal routine) */
 
 static t_stat sim_tape_aws_wrdata (UNIT *uptr, uint8 *buf, t_mtrlnt bc)
@@ -2134,13 +3173,13 @@ t_bool   replacing_record;
 memset (&awshdr, 0, sizeof (t_awshdr));
 if (sim_tape_seek (uptr, uptr->pos))        /* set pos */
     return MTSE_IOERR;
-rdcnt = sim_fread (&awshdr, sizeof (t_awslnt), 3, uptr->fileref);
-if (ferror (uptr->fileref)) {               /* error? */
+rdcnt = tape_fread (&awshdr, sizeof (t_awslnt), 3, uptr);
+if (tape_ferror (uptr)) {               /* error? */
     MT_SET_PNU (uptr);                      /* pos not upd */
     return sim_tape_ioerr (uptr);
     }
 if ((!sim_tape_bot (uptr)) &&
-    (((feof (uptr->fileref)) && (rdcnt < 3)) || /* eof? */
+    (((tape_feof (uptr)) && (rdcnt < 3)) || /* eof? */
      ((awshdr.rectyp != AWS_REC) && (awshdr.rectyp != AWS_TMK)))) {
     MT_SET_PNU (uptr);                      /* pos not upd */
     return MTSE_INVRL;
@@ -2150,17 +3189,17 @@ if (sim_tape_seek (uptr, uptr->pos))        /* set pos */
 replacing_record = (awshdr.nxtlen == (t_awslnt)bc) && (awshdr.rectyp == (bc ? AWS_REC : AWS_TMK));
 awshdr.nxtlen = (t_awslnt)bc;
 awshdr.rectyp = (bc) ? AWS_REC : AWS_TMK;
-(void)sim_fwrite (&awshdr, sizeof (t_awslnt), 3, uptr->fileref);
+(void)tape_fwrite (&awshdr, sizeof (t_awslnt), 3, uptr);
 if (bc)
-    (void)sim_fwrite (buf, sizeof (uint8), bc, uptr->fileref);
+    (void)tape_fwrite (buf, sizeof (uint8), bc, uptr);
 uptr->pos += sizeof (awshdr) + bc;
 if ((!replacing_record) || (bc == 0)) {
     awshdr.prelen = (t_awslnt) bc;
     awshdr.nxtlen = 0;
     awshdr.rectyp = AWS_TMK;
-    (void)sim_fwrite (&awshdr, sizeof (t_awslnt), 3, uptr->fileref);
+    (void)tape_fwrite (&awshdr, sizeof (t_awslnt), 3, uptr);
     if (!replacing_record)
-        sim_set_fsize (uptr->fileref, uptr->pos + sizeof (awshdr));
+        tape_set_fsize (uptr, uptr->pos + sizeof (awshdr));
     }
 if (uptr->pos > uptr->tape_eom)
     uptr->tape_eom = uptr->pos;                     /* Update EOM if we're there */
@@ -2181,8 +3220,8 @@ if (ctx == NULL)                                        /* if not properly attac
 if (sim_tape_wrp (uptr))                                /* write prot? */
     return MTSE_WRP;
 (void)sim_tape_seek (uptr, uptr->pos);                  /* set pos */
-(void)sim_fwrite (&dat, sizeof (uint32), 1, uptr->fileref);
-if (ferror (uptr->fileref)) {                           /* error? */
+(void)tape_fwrite (&dat, sizeof (uint32), 1, uptr);
+if (tape_ferror (uptr)) {                           /* error? */
     MT_SET_PNU (uptr);
     return sim_tape_ioerr (uptr);
     }
@@ -2198,17 +3237,23 @@ return MTSE_OK;
 t_stat sim_tape_wrtmk (UNIT *uptr)
 {
 struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+t_stat st;
 
 if (ctx == NULL)                                        /* if not properly attached? */
     return sim_messagef (SCPE_IERR, "Bad Attach\n");    /*   that's a problem */
 sim_debug_unit (ctx->dbit, uptr, "sim_tape_wrtmk(unit=%d)\n", (int)(uptr-ctx->dptr->units));
+tape_index_free (ctx);                                  /* the tape is being changed */
 if (MT_GET_FMT (uptr) == MTUF_F_P7B) {                  /* P7B? */
     uint8 buf = P7B_EOF;                                /* eof mark */
-    return sim_tape_wrrecf (uptr, &buf, 1);             /* write char */
+    st = sim_tape_wrrecf (uptr, &buf, 1);               /* write char */
     }
-if (MT_GET_FMT (uptr) == MTUF_F_AWS)                    /* AWS? */
-    return sim_tape_aws_wrdata (uptr, NULL, 0);
-return sim_tape_wrdata (uptr, MTR_TMK);
+else if (MT_GET_FMT (uptr) == MTUF_F_AWS)               /* AWS? */
+    st = sim_tape_aws_wrdata (uptr, NULL, 0);
+else
+    st = sim_tape_wrdata (uptr, MTR_TMK);
+if ((st == MTSE_OK) && tape_flush (uptr))               /* write out the file */
+    st = sim_tape_ioerr (uptr);
+return st;
 }
 
 t_stat sim_tape_wrtmk_a (UNIT *uptr, TAPE_PCALLBACK callback)
@@ -2220,6 +3265,19 @@ AIO_CALL(TOP_WTMK, NULL, NULL, NULL, 0, 0, 0, 0, NULL, callback);
 return r;
 }
 
+/* Queued write tape mark, see sim_tape_rdrecf_q */
+
+t_stat sim_tape_wrtmk_q (UNIT *uptr, TAPE_QCALLBACK callback, void *arg)
+{
+t_stat r;
+
+AIO_QUEUE(TOP_WTMK, NULL, NULL, NULL, 0, 0, 0, 0, NULL);
+r = sim_tape_wrtmk (uptr);
+if (callback)
+    callback (uptr, r, arg);
+return r;
+}
+
 /* Write end of medium */
 
 t_stat sim_tape_wreom (UNIT *uptr)
@@ -2230,12 +3288,13 @@ struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
 if (ctx == NULL)                                        /* if not properly attached? */
     return sim_messagef (SCPE_IERR, "Bad Attach\n");    /*   that's a problem */
 sim_debug_unit (ctx->dbit, uptr, "sim_tape_wreom(unit=%d)\n", (int)(uptr-ctx->dptr->units));
+tape_index_free (ctx);                                  /* the tape is being changed */
 if (sim_tape_wrp (uptr))                                /* write prot? */
     return MTSE_WRP;
 if (MT_GET_FMT (uptr) == MTUF_F_P7B)                    /* cant do P7B */
     return MTSE_FMT;
 if (MT_GET_FMT (uptr) == MTUF_F_AWS) {
-    sim_set_fsize (uptr->fileref, uptr->pos);
+    tape_set_fsize (uptr, uptr->pos);
     result = MTSE_OK;
     }
 else {
@@ -2243,7 +3302,8 @@ else {
     uptr->pos = uptr->pos - sizeof (t_mtrlnt);          /* restore original tape position */
     }
 MT_SET_PNU (uptr);                                      /* indicate that position was not updated */
-
+if ((result == MTSE_OK) && tape_flush (uptr))           /* write out the file */
+    result = sim_tape_ioerr (uptr);
 return result;
 }
 
@@ -2429,7 +3489,9 @@ else if (sim_tape_wrp (uptr))                           /* otherwise if the unit
 else if (gap_size == 0 || format != MTUF_F_STD)         /* otherwise if zero length or gaps aren't supported */
     return MTSE_OK;                                     /*   then take no action */
 
-file_size = sim_fsize (uptr->fileref);                  /* get the file size */
+tape_index_free ((struct tape_context *)uptr->tape_ctx);/* the gap changes the tape's objects */
+
+file_size = tape_fsize (uptr);                  /* get the file size */
 
 if (sim_tape_seek (uptr, uptr->pos)) {                  /* position the tape; if it fails */
     MT_SET_PNU (uptr);                                  /*   then set position not updated */
@@ -2449,15 +3511,15 @@ if (sim_tape_seek (uptr, uptr->pos)) {                  /* position the tape; if
 */
 
 do {
-    xfer = sim_fread (&meta, meta_size, 1, uptr->fileref);  /* read a metadatum */
+    xfer = tape_fread (&meta, meta_size, 1, uptr);  /* read a metadatum */
 
-    if (ferror (uptr->fileref)) {                       /* read error? */
+    if (tape_ferror (uptr)) {                       /* read error? */
         uptr->pos = gap_pos;                            /* restore original position */
         MT_SET_PNU (uptr);                              /* position not updated */
         return sim_tape_ioerr (uptr);                   /* translate error */
         }
 
-    else if (xfer != 1 && feof (uptr->fileref) == 0) {  /* otherwise if a partial metadatum was read */
+    else if (xfer != 1 && tape_feof (uptr) == 0) {  /* otherwise if a partial metadatum was read */
         uptr->pos = gap_pos;                            /*   then restore the original position */
         MT_SET_PNU (uptr);                              /* set the position-not-updated flag */
         return MTSE_INVRL;                              /*   and return an invalid record length error */
@@ -2466,7 +3528,7 @@ do {
     else                                                /* otherwise we had a good read */
         uptr->pos = uptr->pos + meta_size;              /*   so move the tape over the datum */
 
-    if (feof (uptr->fileref) || (meta == MTR_EOM)) {    /* at eof or eom? */
+    if (tape_feof (uptr) || (meta == MTR_EOM)) {    /* at eof or eom? */
         gap_alloc = gap_alloc + gap_needed;             /* allocate remainder */
         gap_needed = 0;
         }
@@ -2629,6 +3691,8 @@ else if (sim_tape_wrp (uptr))                           /* otherwise if the unit
 else if ((gap_size == 0) || (format != MTUF_F_STD))     /* otherwise if the gap length is zero or unsupported */
     return MTSE_OK;                                     /*   then take no action */
 
+tape_index_free ((struct tape_context *)uptr->tape_ctx);/* the gap changes the tape's objects */
+
 gap_pos = uptr->pos;                                    /* save the starting position */
 
 if (gap_size == meta_size) {                            /* if the request is for a single metadatum */
@@ -2640,9 +3704,9 @@ if (gap_size == meta_size) {                            /* if the request is for
     if (sim_tape_seek (uptr, uptr->pos))                /* position the tape; if it fails */
         return sim_tape_ioerr (uptr);                   /*   then quit with I/O error status */
 
-    (void)sim_fread (&metadatum, meta_size, 1, uptr->fileref);/* read a metadatum */
+    (void)tape_fread (&metadatum, meta_size, 1, uptr);/* read a metadatum */
 
-    if (ferror (uptr->fileref))                             /* if a file I/O error occurred */
+    if (tape_ferror (uptr))                             /* if a file I/O error occurred */
         return sim_tape_ioerr (uptr);                       /*   then report the error and quit */
 
     else if (metadatum == MTR_TMK)                          /* otherwise if a tape mark is present */
@@ -2652,10 +3716,10 @@ if (gap_size == meta_size) {                            /* if the request is for
         else {                                              /*   otherwise */
             metadatum = MTR_GAP;                            /*     replace it with an erase gap marker */
 
-            xfer = sim_fwrite (&metadatum, meta_size,   /* write the gap marker */
-                               1, uptr->fileref);
+            xfer = tape_fwrite (&metadatum, meta_size,   /* write the gap marker */
+                               1, uptr);
 
-            if (ferror (uptr->fileref) || (xfer == 0))  /* if a file I/O error occurred */
+            if (tape_ferror (uptr) || (xfer == 0))  /* if a file I/O error occurred */
                 return sim_tape_ioerr (uptr);           /* report the error and quit */
             else                                        /* otherwise the write succeeded */
                 status = MTSE_OK;                       /*   so return success */
@@ -2740,7 +3804,7 @@ t_stat sim_tape_wrgap_a (UNIT *uptr, uint32 gaplen, TAPE_PCALLBACK callback)
 t_stat r = MTSE_OK;
 AIO_CALLSETUP
     r = sim_tape_wrgap (uptr, gaplen);
-AIO_CALL(TOP_RDRR, NULL, NULL, NULL, 0, 0, gaplen, 0, NULL, callback);
+AIO_CALL(TOP_WGAP, NULL, NULL, NULL, 0, 0, gaplen, 0, NULL, callback);
 return r;
 }
 
@@ -2798,6 +3862,182 @@ else                                                    /* otherwise */
     return tape_erase_rev (uptr, gap_size);             /*   erase the requested gap */
 }
 
+/* Object index
+
+   The validation pass made when a tape is attached reads every object on
+   the tape.  The position of each record and tape mark it passes is kept,
+   so that spacing over several records or files is a search of the index
+   followed by a single read of the object which stops the motion (a tape
+   mark, the end of medium or whatever ended the scan).  Writing to the
+   tape discards the index and spacing reads the objects one at a time. */
+
+static void tape_index_release (struct tape_index *index)
+{
+if (index == NULL)
+    return;
+free (index->pos);
+free (index->rpos);
+free (index->tmks);
+free (index);
+}
+
+static void tape_index_free (struct tape_context *ctx)
+{
+if (ctx == NULL)
+    return;
+tape_index_release (ctx->index);
+ctx->index = NULL;
+}
+
+static t_bool tape_index_add (struct tape_index *index, t_addr pos, t_addr rpos, t_bool tmk)
+{
+if (index->objects + 1 >= index->size) {                /* keep room for the end of data */
+    uint32 size = index->size ? 2 * index->size : 1024;
+    t_addr *newpos = (t_addr *)realloc (index->pos, size * sizeof (*newpos));
+
+    if (newpos == NULL)
+        return FALSE;
+    index->pos = newpos;
+    if (index->rpos) {
+        newpos = (t_addr *)realloc (index->rpos, size * sizeof (*newpos));
+        if (newpos == NULL)
+            return FALSE;
+        index->rpos = newpos;
+        }
+    index->size = size;
+    }
+if ((rpos != pos) && (index->rpos == NULL)) {           /* first gap? */
+    index->rpos = (t_addr *)malloc (index->size * sizeof (*index->rpos));
+    if (index->rpos == NULL)
+        return FALSE;
+    memcpy (index->rpos, index->pos, index->objects * sizeof (*index->rpos));
+    }
+if (index->rpos)
+    index->rpos[index->objects] = rpos;
+if (tmk) {
+    if (index->tmk_count == index->tmk_size) {
+        uint32 size = index->tmk_size ? 2 * index->tmk_size : 64;
+        uint32 *newtmks = (uint32 *)realloc (index->tmks, size * sizeof (*newtmks));
+
+        if (newtmks == NULL)
+            return FALSE;
+        index->tmks = newtmks;
+        index->tmk_size = size;
+        }
+    index->tmks[index->tmk_count++] = index->objects;
+    }
+index->pos[index->objects++] = pos;
+return TRUE;
+}
+
+/* Find the object which starts at pos (the end of data is object number
+   index->objects).  A gap before an object is passed when moving forward
+   over it, so the object can also be found at its position after the gap,
+   which is where reverse motion leaves the tape.  Returns FALSE when pos
+   isn't an object boundary. */
+
+static t_bool tape_index_search (const t_addr *table, uint32 objects, t_addr pos, uint32 *obj)
+{
+uint32 lo = 0, hi = objects;
+
+while (lo < hi) {
+    uint32 mid = lo + (hi - lo) / 2;
+
+    if (table[mid] < pos)
+        lo = mid + 1;
+    else
+        hi = mid;
+    }
+if (table[lo] != pos)
+    return FALSE;
+*obj = lo;
+return TRUE;
+}
+
+static t_bool tape_index_find (const struct tape_index *index, t_addr pos, uint32 *obj)
+{
+return (tape_index_search (index->pos, index->objects, pos, obj) ||
+        (index->rpos && tape_index_search (index->rpos, index->objects, pos, obj)));
+}
+
+/* Return the number of tape marks before object obj */
+
+static uint32 tape_index_tmks_before (const struct tape_index *index, uint32 obj)
+{
+uint32 lo = 0, hi = index->tmk_count;
+
+while (lo < hi) {
+    uint32 mid = lo + (hi - lo) / 2;
+
+    if (index->tmks[mid] < obj)
+        lo = mid + 1;
+    else
+        hi = mid;
+    }
+return lo;
+}
+
+/* Space records forward using the index.  Returns FALSE if the index can't
+   be used from the current position. */
+
+static t_bool tape_index_sprecsf (UNIT *uptr, uint32 count, uint32 *skipped, t_stat *st)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_index *index = ctx->index;
+uint32 obj, stop, k;
+t_mtrlnt tbc;
+
+if ((index == NULL) || !tape_index_find (index, uptr->pos, &obj))
+    return FALSE;
+k = tape_index_tmks_before (index, obj);
+stop = (k < index->tmk_count) ? index->tmks[k] : index->objects;
+if (count <= stop - obj) {                              /* only data records to pass? */
+    uptr->pos = index->pos[obj + count];
+    MT_CLR_PNU (uptr);
+    *skipped = count;
+    *st = MTSE_OK;
+    }
+else {                                                  /* stop at the tape mark or end of medium */
+    uptr->pos = index->pos[stop];
+    *skipped = stop - obj;
+    *st = sim_tape_sprecf (uptr, &tbc);
+    }
+return TRUE;
+}
+
+/* Space records reverse using the index.  Returns FALSE if the index can't
+   be used from the current position. */
+
+static t_bool tape_index_sprecsr (UNIT *uptr, uint32 count, uint32 *skipped, t_stat *st)
+{
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_index *index = ctx->index;
+uint32 obj, first, k;
+t_mtrlnt tbc;
+
+if ((index == NULL) || !tape_index_find (index, uptr->pos, &obj))
+    return FALSE;
+*st = MTSE_OK;
+if (MT_TST_PNU (uptr)) {                                /* the first space doesn't move */
+    MT_CLR_PNU (uptr);
+    *skipped = *skipped + 1;
+    if (--count == 0)
+        return TRUE;
+    }
+k = tape_index_tmks_before (index, obj);
+first = k ? index->tmks[k - 1] + 1 : 0;                 /* first record after the preceding mark */
+if (count <= obj - first) {                             /* only data records to pass? */
+    uptr->pos = (index->rpos ? index->rpos : index->pos)[obj - count];
+    *skipped = *skipped + count;
+    }
+else {                                                  /* stop at the tape mark or BOT */
+    uptr->pos = (index->rpos ? index->rpos : index->pos)[first];
+    *skipped = *skipped + (obj - first);
+    *st = sim_tape_sprecr (uptr, &tbc);
+    }
+return TRUE;
+}
+
 /* Space record forward
 
    Inputs:
@@ -2870,6 +4110,8 @@ if (ctx == NULL)                                        /* if not properly attac
     return sim_messagef (SCPE_IERR, "Bad Attach\n");    /*   that's a problem */
 sim_debug_unit (ctx->dbit, uptr, "sim_tape_sprecsf(unit=%d, count=%d)\n", (int)(uptr-ctx->dptr->units), count);
 
+if ((count > 1) && tape_index_sprecsf (uptr, count, skipped, &st))
+    return st;
 while (*skipped < count) {                              /* loop */
     st = sim_tape_sprecf (uptr, &tbc);                  /* spc rec */
     if (st != MTSE_OK)
@@ -2967,6 +4209,8 @@ if (ctx == NULL)                                        /* if not properly attac
     return sim_messagef (SCPE_IERR, "Bad Attach\n");    /*   that's a problem */
 sim_debug_unit (ctx->dbit, uptr, "sim_tape_sprecsr(unit=%d, count=%d)\n", (int)(uptr-ctx->dptr->units), count);
 
+if ((count > 1) && tape_index_sprecsr (uptr, count, skipped, &st))
+    return st;
 while (*skipped < count) {                              /* loop */
     st = sim_tape_sprecr (uptr, &tbc);                  /* spc rec rev */
     if (st != MTSE_OK)
@@ -3154,7 +4398,7 @@ t_stat sim_tape_spfilebyrecr_a (UNIT *uptr, uint32 count, uint32 *skipped, uint3
 t_stat r = MTSE_OK;
 AIO_CALLSETUP
     r = sim_tape_spfilebyrecr (uptr, count, skipped, recsskipped);
-AIO_CALL(TOP_SPFR, NULL, skipped, recsskipped, 0, count, 0, 0, NULL, callback);
+AIO_CALL(TOP_SFRR, NULL, skipped, recsskipped, 0, count, 0, 0, NULL, callback);
 return r;
 }
 
@@ -3213,6 +4457,7 @@ if (uptr->flags & UNIT_ATT) {
     }
 uptr->pos = 0;
 if (uptr->flags & UNIT_ATT) {
+    tape_flush (uptr);                                  /* write out buffered data */
     (void)sim_tape_seek (uptr, uptr->pos);
     }
 MT_CLR_PNU (uptr);
@@ -3229,6 +4474,19 @@ AIO_CALL(TOP_RWND, NULL, NULL, NULL, 0, 0, 0, 0, NULL, callback);
 return r;
 }
 
+/* Queued rewind, see sim_tape_rdrecf_q */
+
+t_stat sim_tape_rewind_q (UNIT *uptr, TAPE_QCALLBACK callback, void *arg)
+{
+t_stat r;
+
+AIO_QUEUE(TOP_RWND, NULL, NULL, NULL, 0, 0, 0, 0, NULL);
+r = sim_tape_rewind (uptr);
+if (callback)
+    callback (uptr, r, arg);
+return r;
+}
+
 /* Position Tape */
 
 t_stat sim_tape_position (UNIT *uptr, uint32 flags, uint32 recs, uint32 *recsskipped, uint32 files, uint32 *filesskipped, uint32 *objectsskipped)
@@ -3292,6 +4550,19 @@ AIO_CALL(TOP_POSN, NULL, recsskipped, filesskipped, 0, flags, recs, files, objec
 return r;
 }
 
+/* Queued positioning, see sim_tape_rdrecf_q */
+
+t_stat sim_tape_position_q (UNIT *uptr, uint32 flags, uint32 recs, uint32 *recsskipped, uint32 files, uint32 *filesskipped, uint32 *objectsskipped, TAPE_QCALLBACK callback, void *arg)
+{
+t_stat r;
+
+AIO_QUEUE(TOP_POSN, NULL, recsskipped, filesskipped, 0, flags, recs, files, objectsskipped);
+r = sim_tape_position (uptr, flags, recs, recsskipped, files, filesskipped, objectsskipped);
+if (callback)
+    callback (uptr, r, arg);
+return r;
+}
+
 /* Reset tape */
 
 t_stat sim_tape_reset (UNIT *uptr)
@@ -3340,7 +4611,7 @@ return ((uptr->flags & MTUF_WRP) || (uptr->flags & UNIT_RO) || (MT_GET_FMT (uptr
 static t_stat sim_tape_ioerr (UNIT *uptr)
 {
 sim_printf ("%s: Magtape library I/O error: %s\n", sim_uname (uptr), strerror (errno));
-clearerr (uptr->fileref);
+tape_clearerr (uptr);
 return MTSE_IOERR;
 }
 
@@ -3405,11 +4676,11 @@ if ((uptr == NULL) || (uptr->fileref == NULL))
     return 0;
 countmap = (uint32 *)calloc (65536, sizeof(*countmap));
 recbuf = (uint8 *)malloc (65536);
-tape_size = (t_addr)sim_fsize (uptr->fileref);
+tape_size = (t_addr)tape_fsize (uptr);
 sim_debug_unit (MTSE_DBG_STR, uptr, "tpc_map: tape_size: %" T_ADDR_FMT "u\n", tape_size);
 for (objc = 0, sizec = 0, tpos = 0;; ) {
     (void)sim_tape_seek (uptr, tpos);
-    i = sim_fread (&bc, sizeof (bc), 1, uptr->fileref);
+    i = tape_fread (&bc, sizeof (bc), 1, uptr);
     if (i == 0)     /* past or at eof? */
         break;
     if (bc > 65535) /* Range check length value to satisfy Coverity */
@@ -3422,7 +4693,7 @@ for (objc = 0, sizec = 0, tpos = 0;; ) {
     if (bc) {
         sim_debug_unit (MTSE_DBG_STR, uptr, "tpc_map: %d byte count at pos: %" T_ADDR_FMT "u\n", bc, tpos);
         if (map && sim_deb && (dptr->dctrl & MTSE_DBG_STR)) {
-            (void)sim_fread (recbuf, 1, bc, uptr->fileref);
+            (void)tape_fread (recbuf, 1, bc, uptr);
             sim_data_trace(dptr, uptr, (((uptr->dctrl | dptr->dctrl) & MTSE_DBG_DAT) ? recbuf : NULL), "", bc, "Data Record", MTSE_DBG_STR);
             }
         }
@@ -3529,6 +4800,9 @@ t_addr pos_r;
 t_addr pos_fa;
 t_addr pos_sa;
 t_mtrlnt max = MTR_MAXLEN;
+struct tape_context *ctx = (struct tape_context *)uptr->tape_ctx;
+struct tape_index *index = NULL;
+t_bool stopped = FALSE;
 
 if (!(uptr->flags & UNIT_ATT))
     return SCPE_UNATT;
@@ -3546,6 +4820,9 @@ if (rec_sizes == NULL) {
     free (buf_r);
     return SCPE_MEM;
     }
+tape_index_free (ctx);
+if (ctx && (MT_GET_FMT (uptr) != MTUF_F_TAR))          /* TAR tape marks aren't objects */
+    index = (struct tape_index *)calloc (1, sizeof (*index));
 
 r = sim_tape_rewind (uptr);
 while (r == SCPE_OK) {
@@ -3613,8 +4890,14 @@ while (r == SCPE_OK) {
             }
         if (pos_fa != pos_sa) {
             sim_printf ("Unexpected tape file position after forward and skip record: (%" T_ADDR_FMT "u, %" T_ADDR_FMT "u)\n", pos_fa, pos_sa);
+            tape_index_release (index);
+            index = NULL;
             break;
             }
+        if (index && !tape_index_add (index, pos_f, pos_r, (r_f == MTSE_TMK))) {
+            tape_index_release (index);
+            index = NULL;
+            }
         r = SCPE_OK;
         break;
     case MTSE_INVRL:                                /* invalid rec lnt */
@@ -3626,13 +4909,23 @@ while (r == SCPE_OK) {
     case MTSE_RUNAWAY:                              /* tape runaway */
     default:
         r = r_f;
+        stopped = TRUE;
         break;
     case MTSE_EOM:                                  /* end of medium */
         r = r_f;
+        stopped = TRUE;
         break;
         }
     }
 uptr->tape_eom = uptr->pos;
+if (index) {                /* objects up to the one which stopped the scan */
+    if (stopped && tape_index_add (index, pos_f, pos_f, FALSE)) {
+        --index->objects;                               /* the end of data isn't an object */
+        ctx->index = index;
+        }
+    else
+        tape_index_release (index);                     /* interrupted or inconsistent */
+    }
 if (!stop_cpu) {            /* if SIGINT didn't interrupt the scan */
     sim_messagef (SCPE_OK, "%s: Tape Image %s'%s' scanned as %s format\n", sim_uname (uptr),
                            ((MT_GET_FMT (uptr) >= MTUF_F_ANSI) ? "made from " : ""), uptr->filename,
@@ -4169,6 +5462,72 @@ sim_switches = 0;
 return SCPE_OK;
 }
 
+/* Read a generated tape forward and then in reverse, so that data
+   records are produced from their host files out of order, and check
+   that both passes return the same records */
+
+static t_stat sim_tape_test_generated (UNIT *uptr, const char *filename, const char *format)
+{
+MEMORY_TAPE *tape;
+char args[256];
+uint8 *buf, **data;
+t_mtrlnt bc, *size;
+t_stat st, stat;
+uint32 i, n;
+
+sprintf (args, "%s %s", format, filename);
+sim_tape_detach (uptr);
+sim_switches = SWMASK ('F');
+stat = sim_tape_attach_ex (uptr, args, 0, 0);
+sim_switches = 0;
+if (stat != SCPE_OK)
+    return stat;
+tape = (MEMORY_TAPE *)uptr->fileref;
+for (i = 0; i < tape->record_count; i++) {
+    if ((tape->records[i].source == 0) && (tape->records[i].size > sizeof (HDR1))) {
+        sim_tape_detach (uptr);
+        return sim_messagef (SCPE_IERR, "Record %u of %s tape is held in memory\n", i, format);
+        }
+    }
+n = tape->record_count;
+buf = (uint8 *)malloc (MTR_MAXLEN);
+data = (uint8 **)calloc (n, sizeof (*data));
+size = (t_mtrlnt *)calloc (n, sizeof (*size));
+if ((buf == NULL) || (data == NULL) || (size == NULL))
+    stat = SCPE_MEM;
+for (i = 0; (stat == SCPE_OK) && (i < n); i++) {
+    st = sim_tape_rdrecf (uptr, buf, &bc, MTR_MAXLEN);
+    if (st == MTSE_TMK)
+        continue;
+    if (st != MTSE_OK) {
+        stat = sim_messagef (SCPE_IERR, "Reading record %u of %s tape returned: %d\n", i, format, st);
+        break;
+        }
+    size[i] = bc;
+    data[i] = (uint8 *)malloc (bc);
+    if (data[i] == NULL)
+        stat = SCPE_MEM;
+    else
+        memcpy (data[i], buf, bc);
+    }
+if ((stat == SCPE_OK) && (sim_tape_rdrecf (uptr, buf, &bc, MTR_MAXLEN) != MTSE_EOM))
+    stat = sim_messagef (SCPE_IERR, "%s tape didn't end after %u records\n", format, n);
+for (i = n; (stat == SCPE_OK) && (i > 0); i--) {
+    st = sim_tape_rdrecr (uptr, buf, &bc, MTR_MAXLEN);
+    if ((st == MTSE_TMK) && (data[i - 1] == NULL))
+        continue;
+    if ((st != MTSE_OK) || (bc != size[i - 1]) || memcmp (buf, data[i - 1], bc))
+        stat = sim_messagef (SCPE_IERR, "Reverse read of record %u of %s tape differs, status: %d\n", i - 1, format, st);
+    }
+for (i = 0; (data != NULL) && (i < n); i++)
+    free (data[i]);
+free (data);
+free (size);
+free (buf);
+sim_tape_detach (uptr);
+return stat;
+}
+
 static t_stat sim_tape_test_remove_tape_files (UNIT *uptr, const char *filename)
 {
 char name[256];
@@ -4330,6 +5689,372 @@ return SCPE_OK;
 
 #include <setjmp.h>
 
+/* Compare spacing through the object index with spacing one object at a time */
+
+static t_stat sim_tape_test_index (UNIT *uptr, const char *filename, const char *format)
+{
+struct tape_context *ctx;
+struct tape_index *index;
+char args[256];
+t_stat stat;
+int i;
+
+sprintf (args, "%s %s", format, filename);
+sim_tape_detach (uptr);
+sim_switches = SWMASK ('F');
+stat = sim_tape_attach_ex (uptr, args, 0, 0);
+sim_switches = 0;
+if (stat != SCPE_OK)
+    return stat;
+ctx = (struct tape_context *)uptr->tape_ctx;
+index = ctx->index;
+if (index == NULL) {
+    sim_tape_detach (uptr);
+    return sim_messagef (SCPE_IERR, "No object index for %s format tape\n", format);
+    }
+srand (0);
+for (i = 0; (i < 2000) && (stat == SCPE_OK); i++) {
+    t_bool reverse = (rand () & 1);
+    uint32 count = (i % 50 == 0) ? 0x1ffffff : 2 + (rand () % 40);
+    t_addr pos = uptr->pos;
+    t_bool pnu = (MT_TST_PNU (uptr) != 0);
+    t_stat st_seq, st_idx;
+    uint32 skipped_seq, skipped_idx;
+    t_addr pos_seq;
+    t_bool pnu_seq;
+
+    ctx->index = NULL;
+    st_seq = reverse ? sim_tape_sprecsr (uptr, count, &skipped_seq) : sim_tape_sprecsf (uptr, count, &skipped_seq);
+    pos_seq = uptr->pos;
+    pnu_seq = (MT_TST_PNU (uptr) != 0);
+    ctx->index = index;
+    uptr->pos = pos;
+    if (pnu)
+        MT_SET_PNU (uptr);
+    else
+        MT_CLR_PNU (uptr);
+    st_idx = reverse ? sim_tape_sprecsr (uptr, count, &skipped_idx) : sim_tape_sprecsf (uptr, count, &skipped_idx);
+    if ((st_seq != st_idx) || (skipped_seq != skipped_idx) ||
+        (pos_seq != uptr->pos) || (pnu_seq != (MT_TST_PNU (uptr) != 0)))
+        stat = sim_messagef (SCPE_IERR, "%s: Indexed space %s %u from %" T_ADDR_FMT "u: %s, %u skipped, pos %" T_ADDR_FMT "u, expected %s, %u skipped, pos %" T_ADDR_FMT "u\n",
+                                        format, reverse ? "reverse" : "forward", count, pos,
+                                        sim_tape_error_text (st_idx), skipped_idx, uptr->pos,
+                                        sim_tape_error_text (st_seq), skipped_seq, pos_seq);
+    }
+if (stat == SCPE_OK) {
+    (void)sim_tape_wrtmk (uptr);
+    if (ctx->index != NULL)
+        stat = sim_messagef (SCPE_IERR, "%s: Object index kept after a write\n", format);
+    }
+sim_tape_detach (uptr);
+return stat;
+}
+
+/* Perform the same writes, overwrites, spacing and reads with and without
+   the read-ahead and write-behind buffers and compare the resulting images
+   and the data read back */
+
+static t_stat sim_tape_test_buffering (UNIT *uptr, const char *format)
+{
+char name[2][64];
+char args[128];
+uint8 *buf;
+uint32 sum[2];
+FILE *f[2] = {NULL, NULL};
+t_offset size[2];
+t_stat stat = SCPE_OK;
+int pass, i, j;
+
+buf = (uint8 *)malloc (MTR_MAXLEN);
+if (buf == NULL)
+    return SCPE_MEM;
+for (pass = 0; (pass < 2) && (stat == SCPE_OK); pass++) {
+    struct tape_context *ctx;
+    t_mtrlnt bc;
+    uint32 skipped;
+    t_stat st;
+
+    sprintf (name[pass], "TapeTestFile3.%d.%s", pass, format);
+    (void)remove (name[pass]);
+    sprintf (args, "%s %s", format, name[pass]);
+    sim_tape_detach (uptr);
+    sim_switches = SWMASK ('F') | SWMASK ('N') | SWMASK ('Q');
+    stat = sim_tape_attach_ex (uptr, args, 0, 0);
+    sim_switches = 0;
+    if (stat != SCPE_OK)
+        break;
+    ctx = (struct tape_context *)uptr->tape_ctx;
+    if (pass == 0)
+        tape_buf_free (ctx);                            /* reference image written directly */
+    memset (buf, 0, MTR_MAXLEN);                        /* odd records are padded from the buffer */
+    srand (1);
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 50; j++) {
+            t_mtrlnt k, rec_size = 1 + ((j % 10 == 9) ? (rand () % 200000) : (rand () % 4000));
+
+            for (k = 0; k < rec_size; k++)
+                buf[k] = (uint8)(rand () & 0x3F);
+            (void)sim_tape_wrrecf (uptr, buf, rec_size);
+            }
+        (void)sim_tape_wrtmk (uptr);
+        }
+    (void)sim_tape_rewind (uptr);
+    (void)sim_tape_sprecsf (uptr, 10, &skipped);
+    memset (buf, 0x15, 100);
+    (void)sim_tape_wrrecf (uptr, buf, 100);             /* replace the rest of the tape */
+    (void)sim_tape_wrrecf (uptr, buf, 99);
+    if (MT_GET_FMT (uptr) == MTUF_F_STD)
+        (void)sim_tape_errecf (uptr, 20);
+    (void)sim_tape_wrtmk (uptr);
+    (void)sim_tape_wreom (uptr);
+    (void)sim_tape_rewind (uptr);
+    sum[pass] = 0;
+    while (1) {                                         /* read forward */
+        st = sim_tape_rdrecf (uptr, buf, &bc, MTR_MAXLEN);
+        sum[pass] = (sum[pass] * 31) + st + bc;
+        if ((st != MTSE_OK) && (st != MTSE_TMK))
+            break;
+        for (j = 0; j < (int)bc; j++)
+            sum[pass] = (sum[pass] * 31) + buf[j];
+        }
+    for (i = 0; i < 5; i++) {                           /* and in reverse */
+        st = sim_tape_rdrecr (uptr, buf, &bc, MTR_MAXLEN);
+        sum[pass] = (sum[pass] * 31) + st + bc;
+        for (j = 0; j < (int)bc; j++)
+            sum[pass] = (sum[pass] * 31) + buf[j];
+        }
+    sim_tape_detach (uptr);
+    }
+free (buf);
+if (stat != SCPE_OK)
+    return stat;
+if (sum[0] != sum[1])
+    return sim_messagef (SCPE_IERR, "%s: Buffered tape data read back differs\n", format);
+for (pass = 0; pass < 2; pass++) {
+    f[pass] = fopen (name[pass], "rb");
+    size[pass] = sim_fsize_ex (f[pass]);
+    }
+if ((f[0] == NULL) || (f[1] == NULL) || (size[0] != size[1]))
+    stat = sim_messagef (SCPE_IERR, "%s: Buffered tape image size differs\n", format);
+else {
+    int c;
+
+    while (((c = fgetc (f[0])) != EOF) && (c == fgetc (f[1])))
+        ;
+    if (c != EOF)
+        stat = sim_messagef (SCPE_IERR, "%s: Buffered tape image contents differ\n", format);
+    }
+for (pass = 0; pass < 2; pass++) {
+    if (f[pass])
+        fclose (f[pass]);
+    (void)remove (name[pass]);
+    }
+return stat;
+}
+
+/* Queued operations: a chain of writes, a tape mark, a rewind and reads
+   posted without waiting must complete in the order they were issued and
+   read back what was written. */
+
+#define TAPE_TEST_QUEUED    24
+
+struct tape_test_request {
+    uint8 *data;
+    t_mtrlnt bc;
+    t_stat status;
+    int order;
+    };
+
+static int tape_test_completions;
+
+static void _sim_tape_test_queued_done (UNIT *uptr, t_stat status, void *arg)
+{
+struct tape_test_request *q = (struct tape_test_request *)arg;
+
+q->status = status;
+q->order = ++tape_test_completions;
+}
+
+static t_stat sim_tape_test_queued (UNIT *uptr)
+{
+struct tape_test_request q[2 * TAPE_TEST_QUEUED + 3];
+t_mtrlnt size[TAPE_TEST_QUEUED];
+t_stat stat;
+int i, n = 0;
+uint32 j;
+
+memset (q, 0, sizeof (q));
+(void)remove ("TapeTestFile5.simh");
+sim_tape_detach (uptr);
+sim_switches = SWMASK ('F') | SWMASK ('N') | SWMASK ('Q');
+stat = sim_tape_attach_ex (uptr, "simh TapeTestFile5.simh", 0, 0);
+sim_switches = 0;
+if (stat != SCPE_OK)
+    return stat;
+tape_test_completions = 0;
+srand (5);
+for (i = 0; i < TAPE_TEST_QUEUED; i++, n++) {
+    size[i] = 1 + rand () % 30000;
+    q[n].data = (uint8 *)malloc (size[i] + 1);         /* odd records are padded from the buffer */
+    for (j = 0; j <= size[i]; j++)
+        q[n].data[j] = (uint8)(i + j);
+    sim_tape_wrrecf_q (uptr, q[n].data, size[i], _sim_tape_test_queued_done, &q[n]);
+    }
+sim_tape_wrtmk_q (uptr, _sim_tape_test_queued_done, &q[n++]);
+sim_tape_rewind_q (uptr, _sim_tape_test_queued_done, &q[n++]);
+for (i = 0; i < TAPE_TEST_QUEUED; i++, n++) {
+    q[n].data = (uint8 *)calloc (1, size[i]);
+    sim_tape_rdrecf_q (uptr, q[n].data, &q[n].bc, size[i], _sim_tape_test_queued_done, &q[n]);
+    }
+sim_tape_rdrecf_q (uptr, NULL, &q[n].bc, 0, _sim_tape_test_queued_done, &q[n]);
+n++;
+sim_cancel (uptr);                              /* wait for and deliver completions */
+for (i = 0; (stat == SCPE_OK) && (i < n); i++) {
+    t_stat expected = (i == n - 1) ? MTSE_TMK : MTSE_OK;
+
+    if (q[i].order != i + 1)
+        stat = sim_messagef (SCPE_IERR, "Queued tape operation %d completed %s\n", i, q[i].order ? "out of order" : "never");
+    else if (q[i].status != expected)
+        stat = sim_messagef (SCPE_IERR, "Queued tape operation %d returned: %d - %s\n", i, q[i].status, sim_tape_error_text (q[i].status));
+    }
+for (i = 0; (stat == SCPE_OK) && (i < TAPE_TEST_QUEUED); i++) {
+    struct tape_test_request *rq = &q[TAPE_TEST_QUEUED + 2 + i];
+
+    if ((rq->bc != size[i]) || memcmp (rq->data, q[i].data, size[i]))
+        stat = sim_messagef (SCPE_IERR, "Queued tape read %d returned unexpected data\n", i);
+    }
+for (i = 0; i < n; i++)
+    free (q[i].data);
+sim_tape_detach (uptr);
+(void)remove ("TapeTestFile5.simh");
+return stat;
+}
+
+#if defined (HAVE_ZLIB)
+/* Write the same tape to an uncompressed and to a compressed image, read
+   them back while they are still attached and after reattaching them, and
+   compare the data read and the decompressed image with the uncompressed
+   one */
+
+static uint32 sim_tape_test_sum (uint32 sum, t_stat st, const uint8 *buf, t_mtrlnt bc)
+{
+t_mtrlnt i;
+
+sum = (sum * 31) + st + bc;
+for (i = 0; i < bc; i++)
+    sum = (sum * 31) + buf[i];
+return sum;
+}
+
+static t_stat sim_tape_test_compression (UNIT *uptr, const char *format)
+{
+char name[2][64];
+char args[160];
+uint8 *buf, *cbuf;
+uint32 sum[2][2];
+FILE *f;
+gzFile gzf;
+t_stat stat = SCPE_OK;
+int pass, step, i, j;
+
+buf = (uint8 *)malloc (MTR_MAXLEN);
+cbuf = (uint8 *)malloc (MTR_MAXLEN);
+if ((buf == NULL) || (cbuf == NULL)) {
+    free (buf);
+    free (cbuf);
+    return SCPE_MEM;
+    }
+for (pass = 0; (pass < 2) && (stat == SCPE_OK); pass++) {
+    t_mtrlnt bc;
+    uint32 skipped;
+    t_stat st;
+
+    sprintf (name[pass], "TapeTestFile4.%s%s", format, pass ? ".gz" : "");
+    (void)remove (name[pass]);
+    sprintf (args, "%s %s", format, name[pass]);
+    sim_tape_detach (uptr);
+    sim_switches = SWMASK ('F') | SWMASK ('N') | SWMASK ('Q');
+    stat = sim_tape_attach_ex (uptr, args, 0, 0);
+    sim_switches = 0;
+    if (stat != SCPE_OK)
+        break;
+    memset (buf, 0, MTR_MAXLEN);                        /* odd records are padded from the buffer */
+    srand (1);
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 60; j++) {
+            t_mtrlnt k, rec_size = 1 + ((j % 10 == 9) ? (rand () % 200000) : (rand () % 4000));
+
+            for (k = 0; k < rec_size; k++)
+                buf[k] = (uint8)(rand () & 0x3F);
+            (void)sim_tape_wrrecf (uptr, buf, rec_size);
+            }
+        (void)sim_tape_wrtmk (uptr);
+        (void)sim_tape_wrtmk (uptr);
+        (void)sim_tape_sprecr (uptr, &bc);              /* back over the second tape mark */
+        }
+    (void)sim_tape_wrtmk (uptr);
+    for (step = 0; (step < 2) && (stat == SCPE_OK); step++) {
+        if (step == 1) {                                /* read the image as attached anew */
+            sim_tape_detach (uptr);
+            sim_switches = SWMASK ('F') | SWMASK ('Q');
+            stat = sim_tape_attach_ex (uptr, args, 0, 0);
+            sim_switches = 0;
+            if (stat != SCPE_OK)
+                break;
+            if ((pass == 1) && !sim_tape_wrp (uptr))
+                stat = sim_messagef (SCPE_IERR, "%s: Compressed tape image attached writable\n", format);
+            }
+        (void)sim_tape_rewind (uptr);
+        sum[pass][step] = 0;
+        do {                                            /* read forward */
+            st = sim_tape_rdrecf (uptr, buf, &bc, MTR_MAXLEN);
+            sum[pass][step] = sim_tape_test_sum (sum[pass][step], st, buf, bc);
+            } while ((st == MTSE_OK) || (st == MTSE_TMK));
+        do {                                            /* and in reverse */
+            st = sim_tape_rdrecr (uptr, buf, &bc, MTR_MAXLEN);
+            sum[pass][step] = sim_tape_test_sum (sum[pass][step], st, buf, bc);
+            } while ((st == MTSE_OK) || (st == MTSE_TMK));
+        st = sim_tape_sprecsf (uptr, 100, &skipped);
+        sum[pass][step] = sim_tape_test_sum (sum[pass][step], st + skipped, NULL, 0);
+        st = sim_tape_sprecsr (uptr, 30, &skipped);
+        sum[pass][step] = sim_tape_test_sum (sum[pass][step], st + skipped, NULL, 0);
+        st = sim_tape_rdrecf (uptr, buf, &bc, MTR_MAXLEN);
+        sum[pass][step] = sim_tape_test_sum (sum[pass][step], st, buf, bc);
+        }
+    sim_tape_detach (uptr);
+    }
+if ((stat == SCPE_OK) &&
+    ((sum[0][0] != sum[0][1]) || (sum[1][0] != sum[0][0]) || (sum[1][1] != sum[0][0])))
+    stat = sim_messagef (SCPE_IERR, "%s: Compressed tape data read back differs\n", format);
+if (stat == SCPE_OK) {
+    f = fopen (name[0], "rb");
+    gzf = gzopen (name[1], "rb");
+    if ((f == NULL) || (gzf == NULL))
+        stat = sim_messagef (SCPE_IERR, "%s: Can't open tape images to compare\n", format);
+    else {
+        size_t n;
+        int cn;
+
+        do {
+            n = fread (buf, 1, MTR_MAXLEN, f);
+            cn = gzread (gzf, cbuf, MTR_MAXLEN);
+            if ((cn != (int)n) || memcmp (buf, cbuf, n))
+                stat = sim_messagef (SCPE_IERR, "%s: Decompressed tape image differs\n", format);
+            } while ((n != 0) && (stat == SCPE_OK));
+        }
+    if (f)
+        fclose (f);
+    if (gzf)
+        gzclose (gzf);
+    }
+free (buf);
+free (cbuf);
+(void)remove (name[0]);
+(void)remove (name[1]);
+return stat;
+}
+#endif
+
 t_stat sim_tape_test (DEVICE *dptr, const char *cptr)
 {
 int32 saved_switches = sim_switches;
@@ -4373,6 +6098,14 @@ SIM_TEST(sim_tape_test_process_tape_file (dptr->units, "TapeTestFile1.*", "ansi-
 sim_switches = saved_switches;
 SIM_TEST(sim_tape_test_process_tape_file (dptr->units, "TapeTestFile1.txt", "ansi-var", 0));
 
+SIM_TEST(sim_tape_test_generated (dptr->units, "TapeTestFile1.*", "ansi-vms"));
+
+SIM_TEST(sim_tape_test_generated (dptr->units, "TapeTestFile1.*", "ansi-rt11"));
+
+SIM_TEST(sim_tape_test_generated (dptr->units, "TapeTestFile1.*", "dos11"));
+
+SIM_TEST(sim_tape_test_generated (dptr->units, "TapeTestFile1.txt.fixed", "fixed"));
+
 sim_switches = saved_switches;
 SIM_TEST(sim_tape_test_process_tape_file (dptr->units, "TapeTestFile1", "tar", 0));
 
@@ -4400,9 +6133,43 @@ SIM_TEST(sim_tape_test_process_tape_file (dptr->units, "TapeTestFile1", "e11", 0
 sim_switches = saved_switches;
 SIM_TEST(sim_tape_test_process_tape_file (dptr->units, "TapeTestFile1", "simh", 0));
 
+SIM_TEST(sim_tape_test_remove_tape_files (dptr->units, "TapeTestFile2"));
+
+SIM_TEST(sim_tape_test_create_tape_files (dptr->units, "TapeTestFile2", 6, 40, 512));
+
+SIM_TEST(sim_tape_test_index (dptr->units, "TapeTestFile2.simh", "simh"));
+
+SIM_TEST(sim_tape_test_index (dptr->units, "TapeTestFile2.e11", "e11"));
+
+SIM_TEST(sim_tape_test_index (dptr->units, "TapeTestFile2.aws", "aws"));
+
+SIM_TEST(sim_tape_test_index (dptr->units, "TapeTestFile2.aws.tape", "aws"));
+
+SIM_TEST(sim_tape_test_index (dptr->units, "TapeTestFile2.tpc", "tpc"));
+
+SIM_TEST(sim_tape_test_index (dptr->units, "TapeTestFile2.p7b", "p7b"));
+
+SIM_TEST(sim_tape_test_buffering (dptr->units, "simh"));
+
+SIM_TEST(sim_tape_test_buffering (dptr->units, "e11"));
+
+SIM_TEST(sim_tape_test_buffering (dptr->units, "aws"));
+
+SIM_TEST(sim_tape_test_buffering (dptr->units, "p7b"));
+
+SIM_TEST(sim_tape_test_queued (dptr->units));
+
+#if defined (HAVE_ZLIB)
+SIM_TEST(sim_tape_test_compression (dptr->units, "simh"));
+
+SIM_TEST(sim_tape_test_compression (dptr->units, "aws"));
+#endif
+
 sim_switches = saved_switches;
-if ((sim_switches & SWMASK ('D')) == 0)
+if ((sim_switches & SWMASK ('D')) == 0) {
     SIM_TEST(sim_tape_test_remove_tape_files (dptr->units, "TapeTestFile1"));
+    SIM_TEST(sim_tape_test_remove_tape_files (dptr->units, "TapeTestFile2"));
+    }
 
 return SCPE_OK;
 }
@@ -4556,8 +6323,8 @@ static void ansi_fill_text_buffer (FILE *f, char *buf, size_t buf_size, size_t r
         else {
             size_t move_size;
 
-            if ((tmp[rec_size - 2] != '\r') &&
-                (tmp[rec_size - 1] == '\n')) {
+            if ((tmp[rec_size - 1] == '\n') &&
+                ((rec_size < 2) || (tmp[rec_size - 2] != '\r'))) {
                 memcpy (&tmp[rec_size - 1], "\r\n", 3);
                 rec_size += 1;
                 }
@@ -4584,27 +6351,204 @@ static void ansi_fill_text_buffer (FILE *f, char *buf, size_t buf_size, size_t r
     free (tmp);
     }
 
+static const uint8 ascii2ebcdic[128] = {
+    0000,0001,0002,0003,0067,0055,0056,0057,
+    0026,0005,0045,0013,0014,0015,0016,0017,
+    0020,0021,0022,0023,0074,0075,0062,0046,
+    0030,0031,0077,0047,0034,0035,0036,0037,
+    0100,0117,0177,0173,0133,0154,0120,0175,
+    0115,0135,0134,0116,0153,0140,0113,0141,
+    0360,0361,0362,0363,0364,0365,0366,0367,
+    0370,0371,0172,0136,0114,0176,0156,0157,
+    0174,0301,0302,0303,0304,0305,0306,0307,
+    0310,0311,0321,0322,0323,0324,0325,0326,
+    0327,0330,0331,0342,0343,0344,0345,0346,
+    0347,0350,0351,0112,0340,0132,0137,0155,
+    0171,0201,0202,0203,0204,0205,0206,0207,
+    0210,0211,0221,0222,0223,0224,0225,0226,
+    0227,0230,0231,0242,0243,0244,0245,0246,
+    0247,0250,0251,0300,0152,0320,0241,0007};
+
+/* Read the next line of a text file as a FIXED format record.  The
+   line buffer must have room for block_size + 3 characters. */
+
+static t_bool fixed_fill_text_record (FILE *f, uint8 *block, size_t block_size, t_bool ebcdic)
+{
+size_t len;
+
+/* fgets() read size is int, cast accordingly. */
+if (!fgets ((char *)block, (int) (block_size + 3), f))
+    return FALSE;
+len = strlen ((char *)block);
+while ((len > 0) &&
+       ((block[len - 1] == '\r') || (block[len - 1] == '\n')))
+    --len;
+memset (block + len, ' ', block_size - len);
+if (ebcdic) {
+    uint32 i;
+
+    for (i = 0; i < block_size; i++)
+        block[i] = ascii2ebcdic[block[i]];
+    }
+return TRUE;
+}
+
+static TAPE_RECORD *memory_tape_new_record (MEMORY_TAPE *tape)
+{
+TAPE_RECORD *rec;
+
+if (tape->array_size <= tape->record_count) {
+    TAPE_RECORD *new_records;
+    uint32 new_size = tape->array_size ? 2 * tape->array_size : 1000;
+
+    new_records = (TAPE_RECORD *)realloc (tape->records, new_size * sizeof (*tape->records));
+    if (new_records == NULL)
+        return NULL;                /* no memory error */
+    tape->records = new_records;
+    tape->array_size = new_size;
+    }
+rec = &tape->records[tape->record_count++];
+memset (rec, 0, sizeof (*rec));
+return rec;
+}
+
 static t_bool memory_tape_add_block (MEMORY_TAPE *tape, uint8 *block, size_t size)
 {
 TAPE_RECORD *rec;
 
 ASSURE((size == 0) == (block == NULL));
 
-if (tape->array_size <= tape->record_count) {
-    TAPE_RECORD **new_records;
-    new_records = (TAPE_RECORD **)realloc (tape->records, (tape->array_size + 1000) * sizeof (*tape->records));
-    if (new_records == NULL)
+rec = memory_tape_new_record (tape);
+if (rec == NULL)
+    return TRUE;                    /* no memory error */
+if (size > 0) {
+    rec->data = (uint8 *)malloc (size);
+    if (rec->data == NULL) {
+        --tape->record_count;
         return TRUE;                /* no memory error */
-    tape->records = new_records;
-    memset (tape->records + tape->array_size, 0, 1000 * sizeof (*tape->records));
-    tape->array_size += 1000;
+        }
+    memcpy (rec->data, block, size);
+    }
+rec->size = size;
+return FALSE;
+}
+
+/* Register a host file which record contents are produced from.
+   Returns the source's 1 based index, or 0 if out of memory. */
+
+static uint32 memory_tape_add_source (MEMORY_TAPE *tape, const char *path, uint32 type)
+{
+TAPE_SOURCE *src;
+
+if ((tape->source_count % 64) == 0) {
+    TAPE_SOURCE *new_sources;
+
+    new_sources = (TAPE_SOURCE *)realloc (tape->sources, (tape->source_count + 64) * sizeof (*tape->sources));
+    if (new_sources == NULL)
+        return 0;
+    tape->sources = new_sources;
     }
-rec = (TAPE_RECORD *)malloc (sizeof (*rec) + size);
+src = &tape->sources[tape->source_count];
+memset (src, 0, sizeof (*src));
+src->path = sim_filepath_parts (path, "f");     /* survive a later change of directory */
+if (src->path == NULL)
+    return 0;
+src->type = type;
+return ++tape->source_count;
+}
+
+static t_bool memory_tape_add_file_block (MEMORY_TAPE *tape, uint32 source, t_offset offset, uint32 state, size_t size)
+{
+TAPE_RECORD *rec = memory_tape_new_record (tape);
+
 if (rec == NULL)
     return TRUE;                    /* no memory error */
 rec->size = size;
-memcpy (rec->data, block, size);
-tape->records[tape->record_count++] = rec;
+rec->source = source;
+rec->state = state;
+rec->offset = offset;
+return FALSE;
+}
+
+/* Describe size bytes of binary data as records of block_size bytes.
+   Records are zero padded to a multiple of pad_to when it is non zero. */
+
+static t_bool memory_tape_add_file_blocks (MEMORY_TAPE *tape, uint32 source, t_offset size, size_t block_size, size_t pad_to)
+{
+t_offset pos;
+
+for (pos = 0; pos < size; pos += block_size) {
+    size_t data_size = ((size - pos) < (t_offset)block_size) ? (size_t)(size - pos) : block_size;
+    size_t rec_size = data_size;
+
+    if ((pad_to > 0) && ((data_size % pad_to) != 0))
+        rec_size += pad_to - (data_size % pad_to);
+    if (memory_tape_add_file_block (tape, source, pos, 0, rec_size))
+        return TRUE;
+    }
+return FALSE;
+}
+
+/* Produce the contents of a record.  Only one host file is kept open
+   and no record data is retained, so reading a generated tape uses the
+   same small amount of memory regardless of how much data it holds. */
+
+static t_bool memory_tape_read_record (MEMORY_TAPE *tape, uint32 recnum, uint8 *buf)
+{
+TAPE_RECORD *rec = &tape->records[recnum];
+TAPE_SOURCE *src;
+size_t len;
+
+if (rec->source == 0) {
+    memcpy (buf, rec->data, rec->size);
+    return FALSE;
+    }
+src = &tape->sources[rec->source - 1];
+if (tape->file_source != rec->source) {
+    if (tape->file != NULL)
+        fclose (tape->file);
+    tape->file_source = 0;
+    tape->file = fopen (src->path, "rb");
+    if (tape->file == NULL) {
+        sim_printf ("Can't open: %s - %s\n", src->path, strerror (errno));
+        return TRUE;
+        }
+    tape->file_source = rec->source;
+    }
+if (sim_fseeko (tape->file, rec->offset, SEEK_SET) != 0) {
+    sim_printf ("Can't seek: %s - %s\n", src->path, strerror (errno));
+    return TRUE;
+    }
+switch (src->type) {
+    case TAPE_SRC_RAW:
+        len = fread (buf, 1, (rec->size < tape->block_size) ? rec->size : tape->block_size, tape->file);
+        memset (buf + len, 0, rec->size - len);
+        break;
+
+    case TAPE_SRC_ANSI_TEXT:
+        ansi_fill_text_buffer (tape->file, (char *)buf, rec->size, src->skip_ending, src->fixed_text);
+        break;
+
+    case TAPE_SRC_FIXED_TEXT:
+        if (!fixed_fill_text_record (tape->file, (uint8 *)tape->line, rec->size, src->ebcdic))
+            memset (tape->line, src->ebcdic ? ascii2ebcdic[' '] : ' ', rec->size);
+        memcpy (buf, tape->line, rec->size);
+        break;
+
+    case TAPE_SRC_DOS11_TEXT:
+        if (1) {
+            t_bool crlast = (rec->state != 0);
+
+            len = dos11_fill_ascii_buffer (tape->file, (char *)buf, rec->size, &crlast);
+            memset (buf + len, 0, rec->size - len);
+            }
+        break;
+    }
+if (ferror (tape->file)) {
+    sim_printf ("Error reading: %s - %s\n", src->path, strerror (errno));
+    clearerr (tape->file);
+    return TRUE;
+    }
 return FALSE;
 }
 
@@ -4615,11 +6559,15 @@ MEMORY_TAPE *tape = (MEMORY_TAPE *)vtape;
 
 if (tape == NULL)
     return;
-for (i = 0; i < tape->record_count; i++) {
-    free (tape->records[i]);
-    tape->records[i] = NULL;
-    }
+for (i = 0; i < tape->record_count; i++)
+    free (tape->records[i].data);
 free (tape->records);
+for (i = 0; i < tape->source_count; i++)
+    free (tape->sources[i].path);
+free (tape->sources);
+if (tape->file != NULL)
+    fclose (tape->file);
+free (tape->line);
 free (tape);
 }
 
@@ -4662,54 +6610,32 @@ static void dos11_sanitize(char *buf, int len, const char *inbuf)
     }
 }
 
-static int dos11_copy_ascii_file (FILE *f, MEMORY_TAPE *tape, char *buf, size_t bufSize)
+/* Fill a block with ASCII data, supplying a CR before any bare LF.
+   crlast carries whether the previous character was a CR from one block
+   to the next.  A LF whose CR ends a block is left to start the next
+   one.  Returns the number of characters stored, 0 at end of file. */
+
+static size_t dos11_fill_ascii_buffer (FILE *f, char *buf, size_t bufSize, t_bool *crlast)
 {
-char ch, tmp[512];
-t_bool crlast = FALSE;
-int error = 0;
-size_t i, data_read, offset = 0;
-
-while (!feof (f) && !error) {
-    data_read = fread (tmp, 1, sizeof (tmp), f);
-    if (data_read > 0)
-        for (i = 0; i < data_read; i++) {
-            ch = tmp[i];
-            if (ch == '\n') {
-                if (!crlast) {
-                    buf[offset++] = '\r';
-                    if (offset == bufSize) {
-                        error = memory_tape_add_block (tape, (uint8 *)buf, bufSize);
-                        offset = 0;
-                        }
-                    }
-                buf[offset++] = ch;
-                if (offset == bufSize) {
-                    error = memory_tape_add_block (tape, (uint8 *)buf, bufSize);
-                    offset = 0;
-                    }
-                crlast = FALSE;
-                }
-            else {
-                crlast = ch == '\r';
+int ch;
+size_t offset = 0;
 
-                buf[offset++] = ch;
-                if (offset == bufSize) {
-                    error = memory_tape_add_block (tape, (uint8 *)buf, bufSize);
-                    offset = 0;
-                    }
-                }
+while (offset < bufSize) {
+    ch = fgetc (f);
+    if (ch == EOF)
+        break;
+    if ((ch == '\n') && !*crlast) {
+        buf[offset++] = '\r';
+        *crlast = TRUE;
+        if (offset == bufSize) {
+            ungetc (ch, f);
+            break;
             }
-    }
-    if (offset > 0) {
-        /* RSTS COPY to a DOS volume pads the last block with zeros     */
-        /* VMS EXCHANGE COPY /RECORD_FORMAT=STREAM and RSX-11 FLX /FA   */
-        /* output to a DOS volume do not                                */
-        /* DOS-11 ignores NULs in ASCII data transfer modes             */
-        memset (buf + offset, 0, bufSize - offset);
-        error = memory_tape_add_block (tape, (uint8 *)buf, bufSize);
         }
-
-return error;
+    buf[offset++] = (char)ch;
+    *crlast = (ch == '\r');
+    }
+return offset;
 }
 
 static void sim_tape_add_dos11_entry (const char *directory,
@@ -4725,6 +6651,7 @@ size_t max_record_size;
 t_bool lf_line_endings;
 t_bool crlf_line_endings;
 uint8 *block = NULL;
+uint32 source;
 int error = 0;
 DOS11_HDR hdr;
 char fname[9], ext[3];
@@ -4786,22 +6713,33 @@ hdr.fname3 = dos11_ascR50 (&fname[6]);
 memory_tape_add_block (tape, (uint8 *)&hdr, sizeof (hdr));
 
 rewind (f);
-block = (uint8 *)calloc (tape->block_size, 1);
-
-if (lf_line_endings || crlf_line_endings)
-    error = dos11_copy_ascii_file (f, tape, (char *)block, tape->block_size);
+source = memory_tape_add_source (tape, FullPath, (lf_line_endings || crlf_line_endings) ? TAPE_SRC_DOS11_TEXT : TAPE_SRC_RAW);
+if (source == 0)
+    error = TRUE;
 else {
-    size_t data_read;
+    if (lf_line_endings || crlf_line_endings) {
+        t_bool crlast = FALSE;
 
-    while (!feof (f) && !error) {
-        data_read = fread (block, 1, tape->block_size, f);
-        if (data_read > 0)
-            error = memory_tape_add_block (tape, block, data_read);
+        /* RSTS COPY to a DOS volume pads the last block with zeros     */
+        /* VMS EXCHANGE COPY /RECORD_FORMAT=STREAM and RSX-11 FLX /FA   */
+        /* output to a DOS volume do not                                */
+        /* DOS-11 ignores NULs in ASCII data transfer modes             */
+        block = (uint8 *)calloc (tape->block_size, 1);
+        while (!error) {
+            t_offset offset = sim_ftell (f);
+            uint32 state = crlast;
+
+            if (dos11_fill_ascii_buffer (f, (char *)block, tape->block_size, &crlast) == 0)
+                break;
+            error = memory_tape_add_file_block (tape, source, offset, state, tape->block_size);
+            }
+        free (block);
         }
+    else
+        error = memory_tape_add_file_blocks (tape, source, sim_fsize_ex (f), tape->block_size, 0);
     }
 
 fclose (f);
-free (block);
 if (error)
     sim_messagef (SCPE_IERR, "Error processing input file %s\n", FullPath);
 memory_tape_add_block (tape, NULL, 0); /* Tape Mark */
@@ -4919,6 +6857,7 @@ t_bool lf_line_endings, crlf_line_endings;
 char file_sequence[5];
 int block_count = 0;
 char block_count_string[17];
+uint32 source;
 int error = FALSE;
 HDR1 hdr1;
 HDR2 hdr2;
@@ -4997,37 +6936,36 @@ if ((0 != memcmp (hdr4.extra_name_used, "00", 2)) && !(ansi->nohdr3) && !(ansi->
     memory_tape_add_block (tape, (uint8 *)&hdr4, sizeof (hdr4));
 memory_tape_add_block (tape, NULL, 0);        /* Tape Mark */
 rewind (f);
-block = (uint8 *)calloc (tape->block_size, 1);
-while (!feof (f) && !error) {
-    size_t data_read = tape->block_size;
-
-    if (lf_line_endings || crlf_line_endings)           /* Text file? */
-        ansi_fill_text_buffer (f, (char *)block, tape->block_size,
-                               crlf_line_endings ? ansi->skip_crlf_line_endings : ansi->skip_lf_line_endings,
-                               ansi->fixed_text);
-
-    else {                                              /* Binary file */
-        size_t runt = 0;
-
-        data_read = fread (block, 1, tape->block_size, f);
-        if (max_record_size > 0)                /* always will be true but Xcode thinks otherwise */
-            runt = data_read % max_record_size; /* data_read (=0) % anypositivenumber == 0 */
-        /* Pad short records with zeros */
-        if (runt > 0) {
-            size_t nPad = max_record_size - runt;
-            memset (block + data_read, 0, nPad);
-            data_read += nPad;
+source = memory_tape_add_source (tape, filename, (lf_line_endings || crlf_line_endings) ? TAPE_SRC_ANSI_TEXT : TAPE_SRC_RAW);
+if (source == 0)
+    error = TRUE;
+else {
+    if (lf_line_endings || crlf_line_endings) {         /* Text file? */
+        TAPE_SOURCE *src = &tape->sources[source - 1];
+
+        src->skip_ending = crlf_line_endings ? ansi->skip_crlf_line_endings : ansi->skip_lf_line_endings;
+        src->fixed_text = ansi->fixed_text;
+        /* Lay out the blocks now, their contents are produced again when read */
+        block = (uint8 *)calloc (tape->block_size, 1);
+        while (!feof (f) && !error) {
+            t_offset offset = sim_ftell (f);
+
+            ansi_fill_text_buffer (f, (char *)block, tape->block_size, src->skip_ending, src->fixed_text);
+            error = memory_tape_add_file_block (tape, source, offset, 0, tape->block_size);
+            if (!error)
+                ++block_count;
             }
+        free (block);
         }
+    else {                                              /* Binary file */
+        uint32 first_block = tape->record_count;
 
-    if (data_read > 0) {
-        error = memory_tape_add_block (tape, block, data_read);
-        if (!error)
-            ++block_count;
+        /* Pad short records with zeros */
+        error = memory_tape_add_file_blocks (tape, source, sim_fsize_ex (f), tape->block_size, max_record_size);
+        block_count = (int)(tape->record_count - first_block);
         }
     }
 fclose (f);
-free (block);
 memory_tape_add_block (tape, NULL, 0);        /* Tape Mark */
 memcpy (hdr1.type, "EOF", sizeof (hdr1.type));
 memcpy (hdr2.type, "EOF", sizeof (hdr2.type));
@@ -169,6 +169,7 @@ typedef struct {
 #define MTSE_MAX_ERR    11
 
 typedef void (*TAPE_PCALLBACK)(UNIT *unit, t_stat status);
+typedef void (*TAPE_QCALLBACK)(UNIT *unit, t_stat status, void *arg);
 
 /* Tape Internal Debug flags */
 
@@ -186,12 +187,16 @@ t_stat sim_tape_detach (UNIT *uptr);
 t_stat sim_tape_attach_help(FILE *st, DEVICE *dptr, UNIT *uptr, int32 flag, const char *cptr);
 t_stat sim_tape_rdrecf (UNIT *uptr, uint8 *buf, t_mtrlnt *bc, t_mtrlnt max);
 t_stat sim_tape_rdrecf_a (UNIT *uptr, uint8 *buf, t_mtrlnt *bc, t_mtrlnt max, TAPE_PCALLBACK callback);
+t_stat sim_tape_rdrecf_q (UNIT *uptr, uint8 *buf, t_mtrlnt *bc, t_mtrlnt max, TAPE_QCALLBACK callback, void *arg);
 t_stat sim_tape_rdrecr (UNIT *uptr, uint8 *buf, t_mtrlnt *bc, t_mtrlnt max);
 t_stat sim_tape_rdrecr_a (UNIT *uptr, uint8 *buf, t_mtrlnt *bc, t_mtrlnt max, TAPE_PCALLBACK callback);
+t_stat sim_tape_rdrecr_q (UNIT *uptr, uint8 *buf, t_mtrlnt *bc, t_mtrlnt max, TAPE_QCALLBACK callback, void *arg);
 t_stat sim_tape_wrrecf (UNIT *uptr, uint8 *buf, t_mtrlnt bc);
 t_stat sim_tape_wrrecf_a (UNIT *uptr, uint8 *buf, t_mtrlnt bc, TAPE_PCALLBACK callback);
+t_stat sim_tape_wrrecf_q (UNIT *uptr, uint8 *buf, t_mtrlnt bc, TAPE_QCALLBACK callback, void *arg);
 t_stat sim_tape_wrtmk (UNIT *uptr);
 t_stat sim_tape_wrtmk_a (UNIT *uptr, TAPE_PCALLBACK callback);
+t_stat sim_tape_wrtmk_q (UNIT *uptr, TAPE_QCALLBACK callback, void *arg);
 t_stat sim_tape_wreom (UNIT *uptr);
 t_stat sim_tape_wreom_a (UNIT *uptr, TAPE_PCALLBACK callback);
 t_stat sim_tape_wreomrw (UNIT *uptr);
@@ -218,8 +223,10 @@ t_stat sim_tape_spfilebyrecr (UNIT *uptr, uint32 count, uint32 *skipped, uint32
 t_stat sim_tape_spfilebyrecr_a (UNIT *uptr, uint32 count, uint32 *skipped, uint32 *recsskipped, TAPE_PCALLBACK callback);
 t_stat sim_tape_rewind (UNIT *uptr);
 t_stat sim_tape_rewind_a (UNIT *uptr, TAPE_PCALLBACK callback);
+t_stat sim_tape_rewind_q (UNIT *uptr, TAPE_QCALLBACK callback, void *arg);
 t_stat sim_tape_position (UNIT *uptr, uint32 flags, uint32 recs, uint32 *recskipped, uint32 files, uint32 *fileskipped, uint32 *objectsskipped);
 t_stat sim_tape_position_a (UNIT *uptr, uint32 flags, uint32 recs, uint32 *recsskipped, uint32 files, uint32 *filesskipped, uint32 *objectsskipped, TAPE_PCALLBACK callback);
+t_stat sim_tape_position_q (UNIT *uptr, uint32 flags, uint32 recs, uint32 *recsskipped, uint32 files, uint32 *filesskipped, uint32 *objectsskipped, TAPE_QCALLBACK callback, void *arg);
 t_stat sim_tape_reset (UNIT *uptr);
 t_bool sim_tape_bot (UNIT *uptr);
 t_bool sim_tape_wrp (UNIT *uptr);
@@ -1825,6 +1825,26 @@ if (sim_throt_type != SIM_THROT_NONE) {
     }
 }
 
+/* Suspend throttling and idling for the duration of a BENCHMARK
+   command, restoring the previous settings when it completes */
+
+void sim_timer_set_benchmark (t_bool active)
+{
+static uint32 saved_throt_type;
+static t_bool saved_idle_enab;
+
+if (active) {
+    saved_throt_type = sim_throt_type;
+    saved_idle_enab = sim_idle_enab;
+    sim_throt_type = SIM_THROT_NONE;
+    sim_idle_enab = FALSE;
+    }
+else {
+    sim_throt_type = saved_throt_type;
+    sim_idle_enab = saved_idle_enab;
+    }
+}
+
 void sim_throt_cancel (void)
 {
 sim_cancel (&sim_throttle_unit);